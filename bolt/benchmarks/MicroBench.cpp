@@ -0,0 +1,211 @@
+//===- bolt/benchmarks/MicroBench.cpp - Core data structure benchmarks ----===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Microbenchmarks for hot BOLT primitives: function lookup by address,
+// annotation access, CFG iteration, and profile parsing. The suite operates
+// on a minimal in-memory ELF object and synthetic inputs, so it measures the
+// data structures in isolation from disassembly and rewriting.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bolt/Core/BinaryBasicBlock.h"
+#include "bolt/Core/BinaryContext.h"
+#include "bolt/Core/BinaryFunction.h"
+#include "bolt/Profile/DataReader.h"
+#include "llvm/BinaryFormat/ELF.h"
+#include "llvm/DebugInfo/DWARF/DWARFContext.h"
+#include "llvm/ObjectYAML/yaml2obj.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "benchmark/benchmark.h"
+
+using namespace llvm;
+using namespace llvm::bolt;
+
+namespace llvm {
+namespace bolt {
+
+extern MCPlusBuilder *createX86MCPlusBuilder(const MCInstrAnalysis *,
+                                             const MCInstrInfo *,
+                                             const MCRegisterInfo *);
+
+} // namespace bolt
+} // namespace llvm
+
+namespace {
+
+const char TinyELF[] = R"(
+--- !ELF
+FileHeader:
+  Class:   ELFCLASS64
+  Data:    ELFDATA2LSB
+  Type:    ET_EXEC
+  Machine: EM_X86_64
+Sections:
+  - Name:         .text
+    Type:         SHT_PROGBITS
+    Flags:        [ SHF_ALLOC, SHF_EXECINSTR ]
+    Address:      0x400000
+    AddressAlign: 0x10
+    Content:      "C3"
+)";
+
+/// Shared context over a minimal in-memory x86_64 ELF, populated with a
+/// corpus of synthetic functions for the lookup and CFG benchmarks. Created
+/// lazily on first use and kept alive for the duration of the process.
+struct BenchContext {
+  static constexpr unsigned NumFunctions = 4096;
+  static constexpr uint64_t FirstAddress = 0x400000;
+  static constexpr uint64_t FunctionSize = 0x100;
+
+  SmallString<0> Storage;
+  std::unique_ptr<object::ObjectFile> File;
+  std::unique_ptr<BinaryContext> BC;
+
+  BenchContext() {
+    InitializeAllTargetInfos();
+    InitializeAllTargetMCs();
+    InitializeAllAsmParsers();
+    InitializeAllDisassemblers();
+
+    File = yaml::yaml2ObjectFile(Storage, TinyELF, [](const Twine &Msg) {
+      errs() << "BOLT-ERROR: cannot create benchmark object: " << Msg << '\n';
+      exit(1);
+    });
+    BC = BinaryContext::createBinaryContext(File.get(), /*IsPIC=*/false,
+                                            DWARFContext::create(*File));
+#ifdef X86_AVAILABLE
+    BC->initializeTarget(std::unique_ptr<MCPlusBuilder>(createX86MCPlusBuilder(
+        BC->MIA.get(), BC->MII.get(), BC->MRI.get())));
+#endif
+
+    BinarySection &Section = BC->registerOrUpdateSection(
+        ".text", ELF::SHT_PROGBITS, ELF::SHF_ALLOC | ELF::SHF_EXECINSTR);
+    for (unsigned I = 0; I < NumFunctions; ++I)
+      BC->createBinaryFunction("bench_func_" + std::to_string(I), Section,
+                               FirstAddress + I * FunctionSize, FunctionSize);
+  }
+
+  static BenchContext &get() {
+    static BenchContext Ctx;
+    return Ctx;
+  }
+};
+
+/// Expose the protected parsing interface of DataReader so the profile
+/// parsing kernels can run over an in-memory buffer.
+class ProfileParserBench : public DataReader {
+public:
+  explicit ProfileParserBench(StringRef Buffer)
+      : DataReader("<bolt-micro-bench>") {
+    ParsingBuf = Buffer;
+  }
+
+  std::error_code parseBuffer() { return parse(); }
+
+  ErrorOr<Location> parseOneLocation(StringRef Buffer) {
+    ParsingBuf = Buffer;
+    Col = 0;
+    return parseLocation(FieldSeparator);
+  }
+};
+
+/// Build a synthetic fdata buffer with \p Records branch records between the
+/// corpus functions.
+std::string makeFdataBuffer(unsigned Records) {
+  std::string Buffer;
+  raw_string_ostream OS(Buffer);
+  for (unsigned I = 0; I < Records; ++I) {
+    const unsigned From = I % 512;
+    const unsigned To = (I + 1) % 512;
+    OS << "1 bench_func_" << From << " " << Twine::utohexstr(I % 256 + 4)
+       << " 1 bench_func_" << To << " 0 " << I % 7 << " " << I % 1000 + 1
+       << "\n";
+  }
+  return OS.str();
+}
+
+void BM_AddressLookup(benchmark::State &State) {
+  BenchContext &Ctx = BenchContext::get();
+  // Stride through the address space with a step co-prime to the function
+  // count to defeat lookup locality.
+  uint64_t Index = 0;
+  for (auto _ : State) {
+    const uint64_t Address = BenchContext::FirstAddress +
+                             Index * BenchContext::FunctionSize +
+                             BenchContext::FunctionSize / 2;
+    benchmark::DoNotOptimize(Ctx.BC->getBinaryFunctionContainingAddress(Address));
+    Index = (Index + 977) % BenchContext::NumFunctions;
+  }
+}
+BENCHMARK(BM_AddressLookup);
+
+void BM_CFGIteration(benchmark::State &State) {
+  BenchContext &Ctx = BenchContext::get();
+  // Give the first corpus function a chain-shaped CFG with profiled edges.
+  BinaryFunction &BF = Ctx.BC->getBinaryFunctions().begin()->second;
+  if (BF.size() == 0) {
+    constexpr unsigned NumBlocks = 64;
+    BinaryBasicBlock *PrevBB = nullptr;
+    for (unsigned I = 0; I < NumBlocks; ++I) {
+      BinaryBasicBlock *BB = BF.addBasicBlock(I * 4);
+      BB->setExecutionCount(NumBlocks - I);
+      if (PrevBB)
+        PrevBB->addSuccessor(BB, /*Count=*/NumBlocks - I, /*MispredictedCount=*/I);
+      PrevBB = BB;
+    }
+  }
+  for (auto _ : State) {
+    uint64_t TakenCount = 0;
+    for (BinaryBasicBlock &BB : BF)
+      for (BinaryBasicBlock *Succ : BB.successors())
+        TakenCount += BB.getBranchInfo(*Succ).Count;
+    benchmark::DoNotOptimize(TakenCount);
+  }
+}
+BENCHMARK(BM_CFGIteration);
+
+#ifdef X86_AVAILABLE
+void BM_AnnotationAccess(benchmark::State &State) {
+  BenchContext &Ctx = BenchContext::get();
+  MCPlusBuilder *MIB = Ctx.BC->MIB.get();
+  MCInst Inst;
+  Inst.setOpcode(1);
+  const unsigned Index = MIB->getOrCreateAnnotationIndex("BenchAnnotation");
+  MIB->addAnnotation(Inst, Index, uint64_t(0xdeadbeef));
+  for (auto _ : State) {
+    uint64_t Value = MIB->getAnnotationAs<uint64_t>(Inst, Index);
+    benchmark::DoNotOptimize(Value);
+  }
+}
+BENCHMARK(BM_AnnotationAccess);
+#endif
+
+void BM_ParseLocation(benchmark::State &State) {
+  ProfileParserBench Parser("");
+  const StringRef Input = "1 bench_func_42 3fb ";
+  for (auto _ : State) {
+    ErrorOr<Location> Loc = Parser.parseOneLocation(Input);
+    benchmark::DoNotOptimize(Loc);
+  }
+}
+BENCHMARK(BM_ParseLocation);
+
+void BM_ProfileParse(benchmark::State &State) {
+  const std::string Buffer = makeFdataBuffer(/*Records=*/10000);
+  for (auto _ : State) {
+    ProfileParserBench Parser(Buffer);
+    benchmark::DoNotOptimize(Parser.parseBuffer());
+  }
+  State.SetBytesProcessed(int64_t(State.iterations()) * Buffer.size());
+}
+BENCHMARK(BM_ProfileParse);
+
+} // anonymous namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,98 @@
+//===- bolt/Aggregate/LBRAggregator.h - LBR pre-aggregation -----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Aggregation of raw LBR samples into the pre-aggregated profile format
+// consumed by DataAggregator::parsePreAggregated(). The format is documented
+// in bolt/Profile/DataAggregator.h.
+//
+// Unlike DataAggregator, this component has no knowledge of the profiled
+// binary: it only stitches and counts branch-stack entries. This makes it
+// suitable for profile collection agents that run next to perf on the
+// profiled host and ship kilobytes of aggregated records to a central BOLT
+// job instead of raw perf data. The library depends on LLVMSupport only.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BOLT_AGGREGATE_LBR_AGGREGATOR_H
+#define BOLT_AGGREGATE_LBR_AGGREGATOR_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/raw_ostream.h"
+#include <utility>
+
+namespace llvm {
+namespace bolt {
+
+/// Aggregates taken branches and fall-through traces from LBR branch stacks
+/// and writes them out as pre-aggregated text records.
+///
+/// Addresses are recorded as given. For position-independent binaries the
+/// caller is responsible for subtracting the base load address so that the
+/// records contain offsets from the object base, as the format requires.
+///
+/// Without the disassembled binary it is impossible to tell a fall-through
+/// with external origin (an 'f' record) from a regular one, so all
+/// fall-throughs are emitted as 'F'; BOLT re-validates every trace against
+/// the binary when it parses the pre-aggregated input.
+class LBRAggregator {
+public:
+  /// A single branch stack entry as reported by perf.
+  struct LBREntry {
+    uint64_t From;
+    uint64_t To;
+    bool Mispred;
+  };
+
+  /// Aggregate one sample's branch stack. \p LBR holds entries in reverse
+  /// execution order, newest first, as perf reports them: consecutive
+  /// entries are stitched into fall-through traces in addition to counting
+  /// the taken branches themselves.
+  void addSample(ArrayRef<LBREntry> LBR);
+
+  /// Record a single taken branch.
+  void addBranch(uint64_t From, uint64_t To, bool Mispred) {
+    BranchInfo &Info = Branches[std::make_pair(From, To)];
+    ++Info.TakenCount;
+    Info.MispredCount += Mispred;
+  }
+
+  /// Record a single fall-through trace from \p From to \p To.
+  void addFallthrough(uint64_t From, uint64_t To) {
+    ++Fallthroughs[std::make_pair(From, To)];
+  }
+
+  /// Merge records aggregated by \p Other, e.g. by another thread.
+  void merge(const LBRAggregator &Other);
+
+  /// Write all aggregated records in the pre-aggregated text format, sorted
+  /// by address for deterministic output.
+  void write(raw_ostream &OS) const;
+
+  /// Number of LBR entries aggregated so far.
+  uint64_t getNumEntries() const { return NumEntries; }
+
+private:
+  struct BranchInfo {
+    uint64_t TakenCount{0};
+    uint64_t MispredCount{0};
+  };
+
+  /// Taken branches keyed by (from, to).
+  DenseMap<std::pair<uint64_t, uint64_t>, BranchInfo> Branches;
+
+  /// Fall-through traces keyed by (start, end).
+  DenseMap<std::pair<uint64_t, uint64_t>, uint64_t> Fallthroughs;
+
+  uint64_t NumEntries{0};
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
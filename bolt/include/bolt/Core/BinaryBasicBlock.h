@@ -22,7 +22,10 @@
 #include "llvm/MC/MCSymbol.h"
 #include "llvm/Support/ErrorOr.h"
 #include "llvm/Support/raw_ostream.h"
+#include <cstring>
+#include <iterator>
 #include <limits>
+#include <type_traits>
 #include <utility>
 
 namespace llvm {
@@ -32,6 +35,90 @@ namespace bolt {
 
 class BinaryFunction;
 
+/// Allocate \p Bytes with \p Alignment from the CFG edge arena of \p BF.
+void *allocateEdgeListStorage(BinaryFunction &BF, size_t Bytes,
+                              size_t Alignment);
+
+/// Compact growable array of CFG edge data. It has the same 16-byte
+/// footprint as SmallVector<T, 0>, but draws its storage from the owning
+/// function's edge arena, so the edge lists of all blocks of a function
+/// stay adjacent in memory and CFG walks do not chase heap allocations
+/// scattered across the address space. Memory is reclaimed when the
+/// function releases its CFG, not on element removal, hence mutators need
+/// the owning function to grow.
+template <typename T> class EdgeListTy {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "edge lists are grown with a raw copy");
+
+  T *Data{nullptr};
+  uint32_t Count{0};
+  uint32_t Capacity{0};
+
+public:
+  using value_type = T;
+  using iterator = T *;
+  using const_iterator = const T *;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  iterator begin() { return Data; }
+  iterator end() { return Data + Count; }
+  const_iterator begin() const { return Data; }
+  const_iterator end() const { return Data + Count; }
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rbegin() const {
+    return const_reverse_iterator(end());
+  }
+  const_reverse_iterator rend() const {
+    return const_reverse_iterator(begin());
+  }
+
+  size_t size() const { return Count; }
+  bool empty() const { return Count == 0; }
+
+  T &operator[](size_t Index) {
+    assert(Index < Count && "invalid index");
+    return Data[Index];
+  }
+  const T &operator[](size_t Index) const {
+    assert(Index < Count && "invalid index");
+    return Data[Index];
+  }
+
+  void push_back(BinaryFunction &BF, const T &Value) {
+    if (Count == Capacity)
+      grow(BF);
+    Data[Count++] = Value;
+  }
+
+  iterator erase(iterator Pos) {
+    assert(Pos >= begin() && Pos < end() && "invalid iterator");
+    std::copy(Pos + 1, end(), Pos);
+    --Count;
+    return Pos;
+  }
+
+  void clear() { Count = 0; }
+
+  void swap(EdgeListTy &Other) {
+    std::swap(Data, Other.Data);
+    std::swap(Count, Other.Count);
+    std::swap(Capacity, Other.Capacity);
+  }
+
+private:
+  void grow(BinaryFunction &BF) {
+    const uint32_t NewCapacity = Capacity ? Capacity * 2 : 2;
+    T *NewData = static_cast<T *>(
+        allocateEdgeListStorage(BF, NewCapacity * sizeof(T), alignof(T)));
+    if (Count)
+      memcpy(NewData, Data, Count * sizeof(T));
+    Data = NewData;
+    Capacity = NewCapacity;
+  }
+};
+
 class BinaryBasicBlock {
 public:
   /// Profile execution information for a given edge in CFG.
@@ -58,21 +145,41 @@ public:
   static constexpr uint32_t INVALID_OFFSET =
       std::numeric_limits<uint32_t>::max();
 
+  /// Confidence level of the execution count assigned to a basic block,
+  /// ordered from least to most trustworthy.
+  enum ProfileConfidenceLevel : uint8_t {
+    /// The count has no direct backing in the profile, e.g. it came from a
+    /// partially matched (stale) profile.
+    PROF_CONF_GUESSED = 0,
+    /// The count was derived from the counts of neighboring blocks by
+    /// inference or count fix-ups.
+    PROF_CONF_INFERRED,
+    /// The count is a direct aggregate of LBR records.
+    PROF_CONF_EXACT,
+  };
+
   using BranchInfoType = SmallVector<BinaryBranchInfo, 0>;
 
 private:
   /// Vector of all instructions in the block.
   InstructionListType Instructions;
 
-  /// CFG information.
-  using EdgeListType = SmallVector<BinaryBasicBlock *, 0>;
+  /// CFG information. Lists are backed by the owning function's edge arena.
+  using EdgeListType = EdgeListTy<BinaryBasicBlock *>;
   EdgeListType Predecessors;
   EdgeListType Successors;
 
+  /// For each entry in Predecessors, the index of the slot this block
+  /// occupies in the predecessor's successor list, i.e. the id of the edge
+  /// in the predecessor's Successors and BranchInfo lists. Kept in lockstep
+  /// with Predecessors to allow edge profile lookups that do not depend on
+  /// the predecessor's out-degree.
+  EdgeListTy<uint32_t> PredEdgeIndices;
+
   /// Each successor has a corresponding BranchInfo entry in the list.
-  BranchInfoType BranchInfo;
+  EdgeListTy<BinaryBranchInfo> BranchInfo;
 
-  using ExceptionListType = SmallVector<BinaryBasicBlock *, 0>;
+  using ExceptionListType = EdgeListTy<BinaryBasicBlock *>;
 
   /// List of blocks that this landing pad is handling.
   ExceptionListType Throwers;
@@ -117,6 +224,9 @@ private:
   /// Number of times this basic block was executed.
   uint64_t ExecutionCount{COUNT_NO_PROFILE};
 
+  /// Confidence of the execution count attached to this block.
+  ProfileConfidenceLevel ProfileConfidence{PROF_CONF_GUESSED};
+
   static constexpr unsigned InvalidIndex = ~0u;
 
   /// Index to BasicBlocks vector in BinaryFunction.
@@ -318,8 +428,8 @@ public:
   }
 
   // BranchInfo iterators.
-  using branch_info_iterator = BranchInfoType::iterator;
-  using const_branch_info_iterator = BranchInfoType::const_iterator;
+  using branch_info_iterator = decltype(BranchInfo)::iterator;
+  using const_branch_info_iterator = decltype(BranchInfo)::const_iterator;
   using branch_info_reverse_iterator =
       std::reverse_iterator<branch_info_iterator>;
   using const_branch_info_reverse_iterator =
@@ -653,6 +763,23 @@ public:
   /// Set the execution count for this block.
   void setExecutionCount(uint64_t Count) { ExecutionCount = Count; }
 
+  /// Return the confidence level of the execution count of this block.
+  ProfileConfidenceLevel getProfileConfidence() const {
+    return ProfileConfidence;
+  }
+
+  /// Set the confidence level of the execution count of this block.
+  void setProfileConfidence(ProfileConfidenceLevel Level) {
+    ProfileConfidence = Level;
+  }
+
+  /// Lower the confidence level of the execution count to \p Level unless
+  /// it is already lower.
+  void downgradeProfileConfidence(ProfileConfidenceLevel Level) {
+    if (Level < ProfileConfidence)
+      ProfileConfidence = Level;
+  }
+
   /// Apply a given \p Ratio to the profile information of this basic block.
   void adjustExecutionCount(double Ratio);
 
@@ -919,15 +1046,26 @@ private:
       adjustNumPseudos(*Begin++, Sign);
   }
 
-  /// Adds predecessor to the BB. Most likely you don't need to call this.
-  void addPredecessor(BinaryBasicBlock *Pred);
+  /// Adds predecessor to the BB with \p EdgeIndex being the slot this block
+  /// occupies in the predecessor's successor list. Most likely you don't
+  /// need to call this.
+  void addPredecessor(BinaryBasicBlock *Pred, uint32_t EdgeIndex);
+
+  /// Remove all predecessor entries that are equal to \p Pred. Don't use
+  /// directly, instead use removeAllSuccessors() function.
+  void removePredecessor(BinaryBasicBlock *Pred);
+
+  /// Remove the predecessor entry for the edge from \p Pred with id
+  /// \p EdgeIndex. Don't use directly, instead use removeSuccessor()
+  /// function. The id distinguishes duplicate edges in awkward, redundant
+  /// CFGs.
+  void removePredecessorEdge(BinaryBasicBlock *Pred, uint32_t EdgeIndex);
 
-  /// Remove predecessor of the basic block. Don't use directly, instead
-  /// use removeSuccessor() function.
-  /// If \p Multiple is set to true, it will remove all predecessors that
-  /// are equal to \p Pred. Otherwise, the first instance of \p Pred found
-  /// will be removed. This only matters in awkward, redundant CFGs.
-  void removePredecessor(BinaryBasicBlock *Pred, bool Multiple = true);
+  /// Change the id recorded for the incoming edge from \p Pred from
+  /// \p OldIndex to \p NewIndex. To be used when the predecessor reorders
+  /// its successor list.
+  void updatePredEdgeIndex(BinaryBasicBlock *Pred, uint32_t OldIndex,
+                           uint32_t NewIndex);
 
   /// Set end offset of this basic block.
   void setEndOffset(uint32_t Offset) { InputRange.second = Offset; }
@@ -943,6 +1081,7 @@ private:
   /// Release memory taken by CFG edges and instructions.
   void releaseCFG() {
     clearList(Predecessors);
+    clearList(PredEdgeIndices);
     clearList(Successors);
     clearList(Throwers);
     clearList(LandingPads);
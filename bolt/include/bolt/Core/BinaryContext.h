@@ -37,10 +37,14 @@
 #include "llvm/MC/MCSectionMachO.h"
 #include "llvm/MC/MCSymbol.h"
 #include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/ErrorOr.h"
 #include "llvm/Support/raw_ostream.h"
+#include <array>
+#include <atomic>
 #include <functional>
 #include <map>
+#include <mutex>
 #include <set>
 #include <shared_mutex>
 #include <string>
@@ -59,6 +63,7 @@ namespace bolt {
 
 class BinaryFunction;
 class ExecutableFileMemoryManager;
+class FunctionSizer;
 
 /// Information on loadable part of the file.
 struct SegmentInfo {
@@ -184,6 +189,14 @@ class BinaryContext {
   /// Jump tables for all functions mapped by address.
   std::map<uint64_t, JumpTable *> JumpTables;
 
+  /// Flat address-sorted copy of \p JumpTables servicing lookups once jump
+  /// table discovery is over. Invalidated whenever a new jump table is
+  /// registered.
+  std::vector<std::pair<uint64_t, JumpTable *>> JumpTableIndex;
+
+  /// True when \p JumpTableIndex is in sync with \p JumpTables.
+  bool JumpTableIndexValid{false};
+
   /// Locations of PC-relative relocations in data objects.
   std::unordered_set<uint64_t> DataPCRelocations;
 
@@ -254,8 +267,10 @@ public:
   /// Symbols that are expected to be undefined in MCContext during emission.
   std::unordered_set<MCSymbol *> UndefinedSymbols;
 
-  /// [name] -> [BinaryData*] map used for global symbol resolution.
-  using SymbolMapType = StringMap<BinaryData *>;
+  /// [name] -> [BinaryData*] map used for global symbol resolution. Names
+  /// are interned in the map's arena allocator. Internally generated names
+  /// encode the symbol address and are resolved without being indexed here.
+  using SymbolMapType = StringMap<BinaryData *, BumpPtrAllocator>;
   SymbolMapType GlobalSymbols;
 
   /// [address] -> [BinaryData], ...
@@ -342,6 +357,28 @@ public:
 
   /// Return JumpTable containing a given \p Address.
   JumpTable *getJumpTableContainingAddress(uint64_t Address) {
+    if (JumpTableIndexValid) {
+      // Branchless binary search for the last table starting at or before
+      // \p Address: the conditional advance compiles into a conditional
+      // move, keeping the loop free of unpredictable branches.
+      const std::pair<uint64_t, JumpTable *> *Base = JumpTableIndex.data();
+      size_t N = JumpTableIndex.size();
+      if (N == 0)
+        return nullptr;
+      while (N > 1) {
+        const size_t Half = N / 2;
+        Base += (Base[Half - 1].first <= Address) ? Half : 0;
+        N -= Half;
+      }
+      if (Base->first > Address)
+        return nullptr;
+      if (Base->first + Base->second->getSize() > Address)
+        return Base->second;
+      if (Base->second->getSize() == 0 && Base->first == Address)
+        return Base->second;
+      return nullptr;
+    }
+
     auto JTI = JumpTables.upper_bound(Address);
     if (JTI == JumpTables.begin())
       return nullptr;
@@ -376,10 +413,26 @@ public:
   ///
   /// As we fold identical functions, multiple symbols can point
   /// to the same BinaryFunction.
-  std::unordered_map<const MCSymbol *, BinaryFunction *> SymbolToFunctionMap;
+  ///
+  /// The map is sharded by symbol hash so that lookups and updates running on
+  /// different threads do not serialize on a single lock.
+  static constexpr size_t SymbolToFunctionMapShardsNum = 64;
+
+  struct SymbolToFunctionMapShard {
+    std::unordered_map<const MCSymbol *, BinaryFunction *> Map;
+
+    /// A mutex that is used to control parallel accesses to Map.
+    mutable std::shared_timed_mutex Mutex;
+  };
+
+  std::array<SymbolToFunctionMapShard, SymbolToFunctionMapShardsNum>
+      SymbolToFunctionMap;
 
-  /// A mutex that is used to control parallel accesses to SymbolToFunctionMap
-  mutable std::shared_timed_mutex SymbolToFunctionMapMutex;
+  /// Return the shard of SymbolToFunctionMap that owns \p Symbol.
+  SymbolToFunctionMapShard &getSymbolToFunctionMapShard(const MCSymbol *Symbol) {
+    return SymbolToFunctionMap[std::hash<const MCSymbol *>()(Symbol) %
+                               SymbolToFunctionMapShardsNum];
+  }
 
   /// Look up the symbol entry that contains the given \p Address (based on
   /// the start address and size for each symbol).  Returns a pointer to
@@ -470,6 +523,17 @@ public:
   /// their OffsetEntries based on memory contents.
   void populateJumpTables();
 
+  /// Scan allocatable data sections once, in parallel, and index for every
+  /// aligned word whether it could be the first entry of a PC-relative or
+  /// an absolute jump table. analyzeJumpTable() consults the index to
+  /// reject most non-table candidates without probing section contents.
+  void buildJumpTableCandidateIndex();
+
+  /// (Re)build the flat index servicing getJumpTableContainingAddress().
+  /// Called once jump table discovery is complete; later additions
+  /// invalidate the index and lookups fall back to the address map.
+  void buildJumpTableIndex();
+
   /// Returns a jump table ID and label pointing to the duplicated jump table.
   /// Ordinarily, jump tables are identified by their address in the input
   /// binary. We return an ID with the high bit set to differentiate it from
@@ -571,9 +635,10 @@ public:
   /// Total hotness score according to profiling data for this binary.
   uint64_t TotalScore{0};
 
-  /// Binary-wide stats for macro-fusion.
-  uint64_t MissedMacroFusionPairs{0};
-  uint64_t MissedMacroFusionExecCount{0};
+  /// Binary-wide stats for macro-fusion. Accumulated from multiple threads
+  /// during CFG post-processing.
+  std::atomic<uint64_t> MissedMacroFusionPairs{0};
+  std::atomic<uint64_t> MissedMacroFusionExecCount{0};
 
   // Address of the first allocated segment.
   uint64_t FirstAllocAddress{std::numeric_limits<uint64_t>::max()};
@@ -599,6 +664,12 @@ public:
   /// Page alignment used for code layout.
   uint64_t PageAlign{HugePageSize};
 
+  /// Estimated number of huge pages covering the packed hot code. Set by
+  /// ReorderFunctions when huge-page-aware packing is enabled, and consumed
+  /// by the hugify runtime library. Zero means the layout was not packed by
+  /// pages.
+  uint64_t HugePageCount{0};
+
   /// True if the binary requires immediate relocation processing.
   bool RequiresZNow{false};
 
@@ -765,17 +836,35 @@ public:
   /// global symbol with that name exists.
   const BinaryData *getBinaryDataByName(StringRef Name) const {
     auto Itr = GlobalSymbols.find(Name);
-    return Itr != GlobalSymbols.end() ? Itr->second : nullptr;
+    if (Itr != GlobalSymbols.end())
+      return Itr->second;
+    return getBinaryDataByInternalName(Name);
   }
 
   BinaryData *getBinaryDataByName(StringRef Name) {
-    auto Itr = GlobalSymbols.find(Name);
-    return Itr != GlobalSymbols.end() ? Itr->second : nullptr;
+    return const_cast<BinaryData *>(
+        const_cast<const BinaryContext *>(this)->getBinaryDataByName(Name));
+  }
+
+  /// Resolve an internally generated symbol name (e.g. "SYMBOLat0x<addr>")
+  /// to the BinaryData registered at the address encoded in the name.
+  /// Such names are synthesized from the address on demand and are never
+  /// indexed in GlobalSymbols. Return nullptr if \p Name is not an internal
+  /// name or nothing is registered at its address.
+  const BinaryData *getBinaryDataByInternalName(StringRef Name) const {
+    if (!isInternalSymbolName(Name))
+      return nullptr;
+    uint64_t Address;
+    const size_t Pos = Name.find("at0x");
+    if (Pos == StringRef::npos ||
+        Name.substr(Pos + 4).getAsInteger(16, Address))
+      return nullptr;
+    return getBinaryDataAtAddress(Address);
   }
 
   /// Return true if \p SymbolName was generated internally and was not present
   /// in the input binary.
-  bool isInternalSymbolName(const StringRef Name) {
+  static bool isInternalSymbolName(const StringRef Name) {
     return Name.startswith("SYMBOLat") || Name.startswith("DATAat") ||
            Name.startswith("HOLEat");
   }
@@ -788,6 +877,14 @@ public:
     return Ctx->getOrCreateSymbol("__hot_end");
   }
 
+  MCSymbol *getColdTextStartSymbol() const {
+    return Ctx->getOrCreateSymbol("__bolt_cold_start");
+  }
+
+  MCSymbol *getColdTextEndSymbol() const {
+    return Ctx->getOrCreateSymbol("__bolt_cold_end");
+  }
+
   MCSection *getTextSection() const { return MOFI->getTextSection(); }
 
   /// Return code section with a given name.
@@ -813,6 +910,14 @@ public:
 
   const char *getColdCodeSectionName() const { return ".text.cold"; }
 
+  /// With -split-regions, warm code lands between the main and the cold
+  /// sections, and code with no execution evidence goes to the frozen
+  /// section placed after everything else. The cold section keeps its
+  /// historic name and serves as the "unlikely" tier.
+  const char *getWarmCodeSectionName() const { return ".text.warm"; }
+
+  const char *getFrozenCodeSectionName() const { return ".text.frozen"; }
+
   const char *getHotTextMoverSectionName() const { return ".text.mover"; }
 
   const char *getInjectedCodeSectionName() const { return ".text.injected"; }
@@ -854,6 +959,20 @@ public:
   /// Print the global symbol table.
   void printGlobalSymbols(raw_ostream &OS) const;
 
+  /// Print an estimate of the memory owned by the major subsystems
+  /// (instruction storage, annotations, section contents, jump tables)
+  /// together with the process malloc usage, prefixed with \p Phase. The
+  /// estimates are derived from container sizes and are meant for tracking
+  /// where memory grows between processing phases, not for exact accounting.
+  void printMemoryStats(raw_ostream &OS, StringRef Phase) const;
+
+  /// Print how the stored instructions use the inline operand capacity of
+  /// MCInst: an operand-count histogram, the share of instructions carrying
+  /// an annotation operand, and the projected storage effect of smaller
+  /// inline capacities. The report provides the sizing data for a more
+  /// compact instruction storage tier.
+  void printInstructionFootprint(raw_ostream &OS) const;
+
   /// Register information about the given \p Section so we can look up
   /// sections by address.
   BinarySection &registerSection(SectionRef Section);
@@ -1058,7 +1177,17 @@ public:
   /// Associate the symbol \p Sym with the function \p BF for lookups with
   /// getFunctionForSymbol().
   void setSymbolToFunctionMap(const MCSymbol *Sym, BinaryFunction *BF) {
-    SymbolToFunctionMap[Sym] = BF;
+    SymbolToFunctionMapShard &Shard = getSymbolToFunctionMapShard(Sym);
+    std::unique_lock<std::shared_timed_mutex> Lock(Shard.Mutex);
+    Shard.Map[Sym] = BF;
+  }
+
+  /// Remove the association of \p Sym with any function for lookups with
+  /// getFunctionForSymbol().
+  void removeSymbolFromFunctionMap(const MCSymbol *Sym) {
+    SymbolToFunctionMapShard &Shard = getSymbolToFunctionMapShard(Sym);
+    std::unique_lock<std::shared_timed_mutex> Lock(Shard.Mutex);
+    Shard.Map.erase(Sym);
   }
 
   /// Populate some internal data structures with debug info.
@@ -1081,13 +1210,21 @@ public:
   std::pair<size_t, size_t> calculateEmittedSize(BinaryFunction &BF,
                                                  bool FixBranches = true);
 
+  /// Pool of reusable sizing emitters backing calculateEmittedSize(). Each
+  /// FunctionSizer owns a local MC context and object streamer that are reset
+  /// between functions instead of recreated, and is handed out to one thread
+  /// at a time.
+  std::mutex SizerPoolMutex;
+  std::vector<std::unique_ptr<FunctionSizer>> SizerPool;
+
   /// Calculate the size of the instruction \p Inst optionally using a
   /// user-supplied emitter for lock-free multi-thread work. MCCodeEmitter is
   /// not thread safe and each thread should operate with its own copy of it.
   uint64_t
   computeInstructionSize(const MCInst &Inst,
                          const MCCodeEmitter *Emitter = nullptr) const {
-    if (auto Size = MIB->getAnnotationWithDefault<uint32_t>(Inst, "Size"))
+    if (auto Size = MIB->getAnnotationWithDefault<uint32_t>(
+            Inst, MCPlus::MCAnnotation::kSize))
       return Size;
 
     if (!Emitter)
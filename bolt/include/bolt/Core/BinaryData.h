@@ -124,6 +124,7 @@ public:
   uint64_t getOffset() const;
   uint64_t getSize() const { return Size; }
   uint16_t getAlignment() const { return Alignment; }
+  unsigned getFlags() const { return Flags; }
 
   BinarySection &getSection() { return *Section; }
   const BinarySection &getSection() const { return *Section; }
@@ -41,6 +41,8 @@
 #include "llvm/MC/MCInst.h"
 #include "llvm/MC/MCSymbol.h"
 #include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Regex.h"
 #include "llvm/Support/raw_ostream.h"
 #include <algorithm>
 #include <limits>
@@ -56,6 +58,9 @@ class DWARFUnit;
 
 namespace bolt {
 
+class CFISnapshotCache;
+class StreamingHash64;
+
 using InputOffsetToAddressMapTy = std::unordered_multimap<uint64_t, uint64_t>;
 
 /// Types of macro-fusion alignment corrections.
@@ -133,6 +138,13 @@ public:
     PF_MEMEVENT = 4, /// Profile has mem events.
   };
 
+  /// Placement tiers for the cold fragment under region-based splitting.
+  enum FragmentTier : uint8_t {
+    FT_COLD = 0, /// No execution count recorded for the fragment.
+    FT_WARM,     /// Fragment contains blocks with non-zero counts.
+    FT_FROZEN,   /// No evidence the code was ever executed.
+  };
+
   /// Struct for tracking exception handling ranges.
   struct CallSite {
     const MCSymbol *Start;
@@ -172,11 +184,30 @@ public:
 
     mutable MCSymbol *FunctionConstantIslandLabel{nullptr};
     mutable MCSymbol *FunctionColdConstantIslandLabel{nullptr};
+
+    /// Block after which the islands are emitted in the hot fragment. When
+    /// not set, the islands are emitted past the last block of the fragment.
+    const BinaryBasicBlock *AnchorBlock{nullptr};
+
+    /// When set, the islands are byte-identical to those of \p MergedInto
+    /// and are not emitted with this function; the island symbols are
+    /// defined inside the islands of \p MergedInto instead. Set by the
+    /// constant island dedup pass.
+    BinaryFunction *MergedInto{nullptr};
+
+    /// Island symbols of other functions folded into this function's
+    /// islands, keyed by the offset in this function at which they have to
+    /// be defined. Populated by the constant island dedup pass.
+    std::multimap<uint64_t, MCSymbol *> MergedSymbols;
   };
 
   static constexpr uint64_t COUNT_NO_PROFILE =
       BinaryBasicBlock::COUNT_NO_PROFILE;
 
+  /// Value of FirstTouchTime when the profile carries no first-touch record
+  /// for the function.
+  static constexpr uint64_t FIRST_TOUCH_NONE = UINT64_MAX;
+
   /// We have to use at least 2-byte alignment for functions because of C++ ABI.
   static constexpr unsigned MinAlign = 2;
 
@@ -250,9 +281,24 @@ private:
 
   std::unique_ptr<BinaryLoopInfo> BLI;
 
-  /// Set of external addresses in the code that are not a function start
-  /// and are referenced from this function.
-  std::set<uint64_t> InterproceduralReferences;
+  /// External addresses in the code that are not a function start and are
+  /// referenced from this function. Accumulated without synchronization or
+  /// deduplication during (parallel) disassembly and processed after the
+  /// phase completes.
+  SmallVector<uint64_t, 0> InterproceduralReferences;
+
+  /// Fragment links discovered while analyzing jump tables of this function.
+  /// For each pair, the first function is a fragment of the second one.
+  /// Registration of the links mutates both functions and is deferred until
+  /// no other thread can be disassembling them.
+  SmallVector<std::pair<BinaryFunction *, BinaryFunction *>, 0>
+      FragmentsToRegister;
+
+  /// Addresses of functions referenced by unsupported branches from this
+  /// function. Such functions are ignored after the disassembly phase
+  /// completes since they cannot be modified while they are potentially
+  /// being disassembled on another thread.
+  SmallVector<uint64_t, 0> UnsupportedBranchTargets;
 
   /// All labels in the function that are referenced via relocations from
   /// data objects. Typically these are jump table destinations and computed
@@ -281,6 +327,11 @@ private:
   /// Pseudo functions should not be disassembled or emitted.
   bool IsPseudo{false};
 
+  /// True if the function GC pass proved the function unreachable from any
+  /// exported or address-taken code. Such functions are placed with the
+  /// never-executed code.
+  bool IsUnreachable{false};
+
   /// True if the original function code has all necessary relocations to track
   /// addresses of functions emitted to new locations. Typically set for
   /// functions that we are not going to emit.
@@ -359,6 +410,11 @@ private:
   /// Name for the corresponding cold code section.
   std::string ColdCodeSectionName;
 
+  /// Placement tier for the cold fragment when region-based splitting is
+  /// enabled. Set by SplitFunctions and consumed by section assignment and
+  /// tentative code layout.
+  FragmentTier ColdFragmentTier{FT_COLD};
+
   /// Parent function fragment for split function fragments.
   SmallPtrSet<BinaryFunction *, 1> ParentFragments;
 
@@ -372,6 +428,10 @@ private:
   /// The profile data for the number of times the function was executed.
   uint64_t ExecutionCount{COUNT_NO_PROFILE};
 
+  /// Profile-recorded time of the first execution during startup ("first
+  /// touch"). Used to order the startup function set in the output layout.
+  uint64_t FirstTouchTime{FIRST_TOUCH_NONE};
+
   /// Profile match ratio.
   float ProfileMatchRatio{0.0f};
 
@@ -471,7 +531,54 @@ private:
 
   /// Temporary holder of instructions before CFG is constructed.
   /// Map offset in the function to MCInst.
-  using InstrMapType = std::map<uint32_t, MCInst>;
+  /// Map from an offset in the function to an MCInst at that offset.
+  /// Instructions are only added in the order of increasing offsets during
+  /// disassembly, so they are kept sorted in a single contiguous allocation
+  /// instead of a node-based map. Across millions of functions this avoids
+  /// a heap allocation per instruction, and the storage is released with a
+  /// single deallocation once the CFG is built.
+  class InstrMapType {
+  public:
+    using value_type = std::pair<uint32_t, MCInst>;
+    using iterator = value_type *;
+    using const_iterator = const value_type *;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+
+    iterator begin() { return Storage.begin(); }
+    iterator end() { return Storage.end(); }
+    const_iterator begin() const { return Storage.begin(); }
+    const_iterator end() const { return Storage.end(); }
+    reverse_iterator rbegin() { return Storage.rbegin(); }
+    reverse_iterator rend() { return Storage.rend(); }
+
+    bool empty() const { return Storage.empty(); }
+    size_t size() const { return Storage.size(); }
+
+    /// Add an instruction at a given \p Offset past all existing
+    /// instructions.
+    void emplace(uint32_t Offset, MCInst &&Inst) {
+      assert((Storage.empty() || Storage.back().first < Offset) &&
+             "instructions must be added in increasing offset order");
+      Storage.emplace_back(Offset, std::move(Inst));
+    }
+
+    iterator lower_bound(uint32_t Offset) {
+      return std::lower_bound(begin(), end(), Offset,
+                              [](const value_type &LHS, uint32_t Offset) {
+                                return LHS.first < Offset;
+                              });
+    }
+
+    iterator find(uint32_t Offset) {
+      iterator I = lower_bound(Offset);
+      return (I == end() || I->first != Offset) ? end() : I;
+    }
+
+    void swap(InstrMapType &Other) { Storage.swap(Other.Storage); }
+
+  private:
+    SmallVector<value_type, 0> Storage;
+  };
   InstrMapType Instructions;
 
   /// We don't decode Call Frame Info encoded in DWARF program state
@@ -553,6 +660,10 @@ private:
   using BasicBlockListType = SmallVector<BinaryBasicBlock *, 0>;
   BasicBlockListType BasicBlocks;
   BasicBlockListType DeletedBasicBlocks;
+
+  /// Arena backing the CFG edge lists of this function's basic blocks. See
+  /// EdgeListTy. Reset when the CFG is released.
+  BumpPtrAllocator EdgeListAllocator;
   BasicBlockOrderType BasicBlocksLayout;
   /// Previous layout replaced by modifyLayout
   BasicBlockOrderType BasicBlocksPreviousLayout;
@@ -662,7 +773,8 @@ private:
   /// added to Instructions list.
   IndirectBranchType processIndirectBranch(MCInst &Instruction, unsigned Size,
                                            uint64_t Offset,
-                                           uint64_t &TargetAddress);
+                                           uint64_t &TargetAddress,
+                                           MCPlusBuilder::AllocatorIdTy AllocId);
 
   DenseMap<const MCInst *, SmallVector<MCInst *, 4>>
   computeLocalUDChain(const MCInst *CurInstr);
@@ -705,6 +817,14 @@ private:
   /// disassembled state was later invalidated.
   void clearDisasmState();
 
+  /// Allocate storage for the CFG edge lists of this function's basic
+  /// blocks. See EdgeListTy.
+  void *allocateEdgeListStorage(size_t Bytes, size_t Alignment) {
+    return EdgeListAllocator.Allocate(Bytes, Align(Alignment));
+  }
+  friend void *allocateEdgeListStorage(BinaryFunction &BF, size_t Bytes,
+                                       size_t Alignment);
+
   /// Release memory allocated for CFG and instructions.
   /// We still keep basic blocks for address translation/mapping purposes.
   void releaseCFG() {
@@ -712,6 +832,7 @@ private:
       BB->releaseCFG();
     for (BinaryBasicBlock *BB : DeletedBasicBlocks)
       BB->releaseCFG();
+    EdgeListAllocator.Reset();
 
     clearList(CallSites);
     clearList(ColdCallSites);
@@ -1030,9 +1151,19 @@ public:
     return Res.hasValue();
   }
 
+  /// Build the anchored regular expression that hasNameRegex() matches
+  /// function names against. Callers matching many functions against the
+  /// same pattern should compile it once with this function and use the
+  /// Regex overload of hasNameRegex() instead of recompiling the pattern
+  /// on every call.
+  static Regex buildNameRegex(StringRef NameRegex);
+
   /// Check if any of function names matches the given regex.
   Optional<StringRef> hasNameRegex(const StringRef NameRegex) const;
 
+  /// Check if any of function names matches the given compiled regex.
+  Optional<StringRef> hasNameRegex(const Regex &MatchName) const;
+
   /// Check if any of restored function names matches the given regex.
   /// Restored name means stripping BOLT-added suffixes like "/1",
   Optional<StringRef> hasRestoredNameRegex(const StringRef NameRegex) const;
@@ -1366,6 +1497,12 @@ public:
     return BC.getUniqueSectionByName(getColdCodeSectionName());
   }
 
+  /// Return the placement tier for the cold fragment of the function.
+  FragmentTier getColdFragmentTier() const { return ColdFragmentTier; }
+
+  /// Assign a placement tier to the cold fragment of the function.
+  void setColdFragmentTier(FragmentTier Tier) { ColdFragmentTier = Tier; }
+
   /// Return true iif the function will halt execution on entry.
   bool trapsOnEntry() const { return TrapsOnEntry; }
 
@@ -1383,6 +1520,13 @@ public:
   /// otherwise processed.
   bool isPseudo() const { return IsPseudo; }
 
+  /// Return true if the function was proven unreachable by the function GC
+  /// pass.
+  bool isUnreachable() const { return IsUnreachable; }
+
+  /// Mark the function as proven unreachable from any root.
+  void setUnreachable() { IsUnreachable = true; }
+
   /// Return true if the function contains a jump table with entries pointing
   /// to split fragments.
   bool hasSplitJumpTable() const { return HasSplitJumpTable; }
@@ -1880,6 +2024,17 @@ public:
     return *this;
   }
 
+  /// Set the profile-recorded time of the first execution during startup.
+  void setFirstTouchTime(uint64_t Time) { FirstTouchTime = Time; }
+
+  /// Return true if the profile recorded a first-touch timestamp for the
+  /// function.
+  bool hasFirstTouchTime() const { return FirstTouchTime != FIRST_TOUCH_NONE; }
+
+  /// Return the profile-recorded time of the first execution during startup,
+  /// or FIRST_TOUCH_NONE if the profile has no first-touch record.
+  uint64_t getFirstTouchTime() const { return FirstTouchTime; }
+
   /// Adjust execution count for the function by a given \p Count. The value
   /// \p Count will be subtracted from the current function count.
   ///
@@ -2102,7 +2257,11 @@ public:
   /// state to State:Disassembled.
   ///
   /// Returns false if disassembly failed.
-  bool disassemble();
+  ///
+  /// The function could be disassembled in parallel with other functions,
+  /// in which case \p AllocatorId designates the annotation allocator
+  /// private to the calling thread.
+  bool disassemble(MCPlusBuilder::AllocatorIdTy AllocatorId = 0);
 
   /// Scan function for references to other functions. In relocation mode,
   /// add relocations for external references.
@@ -2198,15 +2357,18 @@ public:
 
   void moveRememberRestorePair(BinaryBasicBlock *BB);
 
-  bool replayCFIInstrs(int32_t FromState, int32_t ToState,
-                       BinaryBasicBlock *InBB,
+  bool replayCFIInstrs(CFISnapshotCache &Cache, int32_t FromState,
+                       int32_t ToState, BinaryBasicBlock *InBB,
                        BinaryBasicBlock::iterator InsertIt);
 
   /// unwindCFIState is used to unwind from a higher to a lower state number
   /// without using remember-restore instructions. We do that by keeping track
   /// of what values have been changed from state A to B and emitting
-  /// instructions that undo this change.
-  SmallVector<int32_t, 4> unwindCFIState(int32_t FromState, int32_t ToState,
+  /// instructions that undo this change. \p Cache reconstructs the CFI states
+  /// on demand and is shared by all unwind/replay requests of one pass over
+  /// the function.
+  SmallVector<int32_t, 4> unwindCFIState(CFISnapshotCache &Cache,
+                                         int32_t FromState, int32_t ToState,
                                          BinaryBasicBlock *InBB,
                                          BinaryBasicBlock::iterator &InsertIt);
 
@@ -2266,7 +2428,7 @@ public:
   size_t getHash() const { return Hash; }
 
   using OperandHashFuncTy =
-      function_ref<typename std::string(const MCOperand &)>;
+      function_ref<void(const MCOperand &, StreamingHash64 &)>;
 
   /// Compute the hash value of the function based on its contents.
   ///
@@ -2274,13 +2436,12 @@ public:
   /// the existing layout order.
   ///
   /// By default, instruction operands are ignored while calculating the hash.
-  /// The caller can change this via passing \p OperandHashFunc function.
-  /// The return result of this function will be mixed with internal hash.
+  /// The caller can change this via passing \p OperandHashFunc function,
+  /// which streams the operand contents into the function hasher.
   size_t computeHash(
       bool UseDFS = false,
-      OperandHashFuncTy OperandHashFunc = [](const MCOperand &) {
-        return std::string();
-      }) const;
+      OperandHashFuncTy OperandHashFunc = [](const MCOperand &,
+                                             StreamingHash64 &) {}) const;
 
   void setDWARFUnit(DWARFUnit *Unit) { DwarfUnit = Unit; }
 
@@ -18,6 +18,7 @@
 #include "bolt/Core/DebugData.h"
 #include "bolt/Core/Relocation.h"
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/BitVector.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/BinaryFormat/ELF.h"
 #include "llvm/Object/ELFObjectFile.h"
@@ -86,12 +87,29 @@ class BinarySection {
   uint64_t OutputSize{0};          // Section size in the rewritten binary.
   uint64_t OutputFileOffset{0};    // File offset in the rewritten binary file.
   StringRef OutputContents;        // Rewritten section contents.
+  bool OwnsOutputContents{false};  // True if OutputContents is a heap buffer
+                                   // owned by this section. Pass-through
+                                   // sections keep referencing the mmapped
+                                   // input file and are promoted to an owned
+                                   // copy only when actually modified.
   unsigned SectionID{-1u};         // Unique ID used for address mapping.
                                    // Set by ExecutableFileMemoryManager.
   uint32_t Index{0};               // Section index in the output file.
   mutable bool IsReordered{false}; // Have the contents been reordered?
   bool IsAnonymous{false};         // True if the name should not be included
                                    // in the output file.
+  bool IsCompressed{false};        // True if the output contents hold an
+                                   // ELF compression header followed by a
+                                   // compressed payload (SHF_COMPRESSED).
+
+  // Jump-table candidate index over the input contents, built once by
+  // BinaryContext::buildJumpTableCandidateIndex(). Bit I tells whether the
+  // 4-byte aligned word at offset 4*I could be the first entry of a
+  // PC-relative or an absolute jump table, i.e. whether the entry's target
+  // falls within the program's function space.
+  BitVector PICJumpTableCandidates;
+  BitVector AbsJumpTableCandidates;
+  bool HasJumpTableCandidates{false};
 
   uint64_t hash(const BinaryData &BD,
                 std::map<const BinaryData *, uint64_t> &Cache) const;
@@ -132,10 +150,7 @@ class BinarySection {
     Alignment = NewAlignment;
     ELFType = NewELFType;
     ELFFlags = NewELFFlags;
-    OutputSize = NewSize;
-    OutputContents = StringRef(reinterpret_cast<const char *>(NewData),
-                               NewData ? NewSize : 0);
-    IsFinalized = true;
+    updateContents(NewData, NewSize);
   }
 
 public:
@@ -175,6 +190,9 @@ public:
         ELFFlags(ELFFlags), IsFinalized(true), OutputName(Name),
         OutputSize(Size), OutputContents(Contents) {
     assert(Alignment > 0 && "section alignment must be > 0");
+    // Output buffers of allocatable sections are owned by the emission
+    // memory manager and must not be freed here.
+    OwnsOutputContents = Data && !isAllocatable();
   }
 
   ~BinarySection();
@@ -225,6 +243,7 @@ public:
   uint64_t getSize() const { return Size; }
   uint64_t getInputFileOffset() const { return InputFileOffset; }
   uint64_t getAlignment() const { return Alignment; }
+  void setAlignment(unsigned NewAlignment) { Alignment = NewAlignment; }
   bool isText() const {
     if (isELF())
       return (ELFFlags & ELF::SHF_EXECINSTR);
@@ -273,6 +292,28 @@ public:
   bool hasSectionRef() const { return Section != SectionRef(); }
   SectionRef getSectionRef() const { return Section; }
 
+  /// Record the jump-table candidate index for this section.
+  void setJumpTableCandidates(BitVector PICCandidates,
+                              BitVector AbsCandidates) {
+    PICJumpTableCandidates = std::move(PICCandidates);
+    AbsJumpTableCandidates = std::move(AbsCandidates);
+    HasJumpTableCandidates = true;
+  }
+
+  /// Return true unless the pre-computed candidate index proves that no
+  /// jump table of the given kind can start at \p Address because its first
+  /// entry would not resolve to an address within any function.
+  bool isJumpTableCandidate(uint64_t Address, bool IsPIC) const {
+    if (!HasJumpTableCandidates || Address % 4 != 0)
+      return true;
+    const uint64_t Word = (Address - getAddress()) / 4;
+    const BitVector &Candidates =
+        IsPIC ? PICJumpTableCandidates : AbsJumpTableCandidates;
+    if (Word >= Candidates.size())
+      return true;
+    return Candidates[Word];
+  }
+
   /// Does this section contain the given \p Address?
   /// Note: this is in terms of the original mapped binary addresses.
   bool containsAddress(uint64_t Address) const {
@@ -296,6 +337,11 @@ public:
     return make_range(Relocations.begin(), Relocations.end());
   }
 
+  /// Iterate over all dynamic relocations for this section.
+  iterator_range<RelocationSetType::const_iterator> dynamicRelocations() const {
+    return make_range(DynamicRelocations.begin(), DynamicRelocations.end());
+  }
+
   /// Does this section have any non-pending relocations?
   bool hasRelocations() const { return !Relocations.empty(); }
 
@@ -376,6 +422,8 @@ public:
 
   bool isFinalized() const { return IsFinalized; }
   void setIsFinalized() { IsFinalized = true; }
+  bool isCompressed() const { return IsCompressed; }
+  void setIsCompressed() { IsCompressed = true; }
   StringRef getOutputName() const { return OutputName; }
   uint64_t getOutputSize() const { return OutputSize; }
   uint8_t *getOutputData() {
@@ -386,6 +434,12 @@ public:
     return reinterpret_cast<const uint8_t *>(getOutputContents().data());
   }
   StringRef getOutputContents() const { return OutputContents; }
+
+  /// Return the number of heap bytes this section owns for its output
+  /// contents. Contents backed by the input file are not counted.
+  uint64_t getAllocatedMemory() const {
+    return OwnsOutputContents ? OutputContents.size() : 0;
+  }
   uint64_t getAllocAddress() const {
     return reinterpret_cast<uint64_t>(getOutputData());
   }
@@ -409,6 +463,22 @@ public:
   void setOutputName(StringRef Name) { OutputName = std::string(Name); }
   void setAnonymous(bool Flag) { IsAnonymous = Flag; }
 
+  /// Replace the output contents with \p NewData, taking ownership of the
+  /// buffer for non-allocatable sections and releasing any buffer previously
+  /// owned. Until this is called, a pass-through section keeps referencing
+  /// the mmapped input file, so memory is only spent on sections that are
+  /// actually modified.
+  void updateContents(const uint8_t *NewData, size_t NewSize) {
+    if (OwnsOutputContents &&
+        reinterpret_cast<const char *>(NewData) != OutputContents.data())
+      delete[] getOutputData();
+    OutputContents = StringRef(reinterpret_cast<const char *>(NewData),
+                               NewData ? NewSize : 0);
+    OutputSize = NewSize;
+    OwnsOutputContents = NewData && !isAllocatable();
+    IsFinalized = true;
+  }
+
   /// Emit the section as data, possibly with relocations. Use name \p NewName
   //  for the section during emission if non-empty.
   void emitAsData(MCStreamer &Streamer, StringRef NewName = StringRef()) const;
@@ -14,6 +14,7 @@
 #ifndef BOLT_CORE_DEBUG_DATA_H
 #define BOLT_CORE_DEBUG_DATA_H
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/MapVector.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/DebugInfo/DWARF/DWARFContext.h"
@@ -311,8 +312,10 @@ public:
   /// Return internal buffer.
   virtual std::unique_ptr<DebugBufferVector> getBuffer();
 
-  /// Offset of an empty location list.
-  static constexpr uint32_t EmptyListOffset = 0;
+  /// Set the offset of an empty location list in the output section. The
+  /// offset is non-zero when input section contents are preserved in front
+  /// of the new location lists.
+  void setEmptyListOffset(uint32_t Offset) { EmptyListOffset = Offset; }
 
   LocWriterKind getKind() const { return Kind; }
 
@@ -331,6 +334,9 @@ protected:
   uint32_t SectionOffset{0};
   LocWriterKind Kind{LocWriterKind::DebugLocWriter};
 
+  /// Offset of an empty location list.
+  uint32_t EmptyListOffset{0};
+
 private:
   struct LocListDebugInfoPatchType {
     uint64_t DebugInfoAttrOffset;
@@ -404,13 +410,22 @@ public:
   /// Implementations do not need to guarantee that size of a new \p
   /// BinaryContents remains unchanged.
   virtual std::string patchBinary(StringRef BinaryContents) = 0;
+
+  /// Returns true if applying the patches may change the size of the
+  /// contents. When false, the patches are guaranteed to be same-size byte
+  /// replacements and may be written directly over the original contents
+  /// without materializing a copy of the section.
+  virtual bool resizesContents() const { return true; }
 };
 
 /// Applies simple modifications to a binary string, such as directly replacing
 /// the contents of a certain portion with a string or an integer.
 class SimpleBinaryPatcher : public BinaryPatcher {
+public:
+  using PatchTy = std::pair<uint32_t, std::string>;
+
 private:
-  std::vector<std::pair<uint32_t, std::string>> Patches;
+  std::vector<PatchTy> Patches;
 
   /// Adds a patch to replace the contents of \p ByteSize bytes with the integer
   /// \p NewValue encoded in little-endian, with the least-significant byte
@@ -479,6 +494,12 @@ public:
   /// This function takes in \p BinaryContents, applies patches to it and
   /// returns an updated string.
   virtual std::string patchBinary(StringRef BinaryContents) override;
+
+  /// All patches replace bytes in place and never resize the contents.
+  bool resizesContents() const override { return false; }
+
+  /// Accumulated patches in the order they were added.
+  ArrayRef<PatchTy> getPatches() const { return Patches; }
 };
 
 class DebugInfoBinaryPatcher : public SimpleBinaryPatcher {
@@ -616,6 +637,9 @@ public:
   /// patches inserted into it. It returns an updated string.
   virtual std::string patchBinary(StringRef BinaryContents) override;
 
+  /// Reference and abbreviation updates may grow or shrink the contents.
+  bool resizesContents() const override { return true; }
+
   /// Adds a patch to put the integer \p NewValue encoded as a 64-bit
   /// little-endian value at offset \p Offset.
   virtual void addLE64Patch(uint64_t Offset, uint64_t NewValue) override;
@@ -23,6 +23,7 @@
 namespace llvm {
 
 namespace bolt {
+class BinaryContext;
 class BinaryFunction;
 
 /// Class encapsulating runtime statistics about an execution unit.
@@ -43,6 +44,7 @@ class DynoStats {
   D(STORES,                       "executed store instructions", Fn)\
   D(JUMP_TABLE_BRANCHES,          "taken jump table branches", Fn)\
   D(UNKNOWN_INDIRECT_BRANCHES,    "taken unknown indirect branches", Fn)\
+  D(MACRO_FUSION_PAIRS,           "executed fused compare-and-branch pairs", Fn)\
   D(ALL_BRANCHES,                 "total branches",\
       Fadd(ALL_CONDITIONAL, UNCOND_BRANCHES))\
   D(ALL_TAKEN,                    "taken branches",\
@@ -144,17 +146,14 @@ DynoStats operator+(const DynoStats &A, const DynoStats &B);
 /// fixBranches().
 DynoStats getDynoStats(const BinaryFunction &BF);
 
+/// Return program-wide dynostats. Functions are processed in parallel with
+/// per-worker accumulators unless threading is disabled.
+DynoStats getDynoStats(const BinaryContext &BC);
+
 /// Return program-wide dynostats.
 template <typename FuncsType>
 inline DynoStats getDynoStats(const FuncsType &Funcs) {
-  bool IsAArch64 = Funcs.begin()->second.getBinaryContext().isAArch64();
-  DynoStats dynoStats(IsAArch64);
-  for (auto &BFI : Funcs) {
-    auto &BF = BFI.second;
-    if (BF.isSimple())
-      dynoStats += getDynoStats(BF);
-  }
-  return dynoStats;
+  return getDynoStats(Funcs.begin()->second.getBinaryContext());
 }
 
 /// Call a function with optional before and after dynostats printing.
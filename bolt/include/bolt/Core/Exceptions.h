@@ -82,6 +82,15 @@ public:
   static Error parse(DWARFDataExtractor Data, uint64_t EHFrameAddress,
                      PatcherCallbackTy PatcherCallback);
 
+  /// Same as parse(), but decode FDEs in parallel chunks. A cheap serial
+  /// pre-scan hops over the entries using their length fields, parses the
+  /// few CIEs that FDEs from any chunk may reference, and partitions the
+  /// FDEs between workers. References found by the workers are buffered and
+  /// PatcherCallback is invoked serially in section order afterwards, so the
+  /// callback does not need to be thread-safe.
+  static Error parseParallel(DWARFDataExtractor Data, uint64_t EHFrameAddress,
+                             PatcherCallbackTy PatcherCallback);
+
 private:
   EHFrameParser(DWARFDataExtractor D, uint64_t E, PatcherCallbackTy P)
       : Data(D), EHFrameAddress(E), PatcherCallback(P), Offset(0) {}
@@ -95,10 +104,21 @@ private:
         : FDEPtrEncoding(F), LSDAPtrEncoding(L), AugmentationString(A) {}
   };
 
+  /// Location of an FDE body recorded by the pre-scan in parseParallel().
+  struct FDEInfo {
+    uint64_t CIEPointer;
+    uint64_t StructureOffset;
+    uint64_t BodyOffset;
+  };
+
   Error parseCIE(uint64_t StartOffset);
   Error parseFDE(uint64_t CIEPointer, uint64_t StartStructureOffset);
   Error parse();
 
+  /// Walk the entries, parsing CIEs in place and recording FDE locations in
+  /// \p FDEWorkList without decoding their bodies.
+  Error scan(std::vector<FDEInfo> &FDEWorkList);
+
   DWARFDataExtractor Data;
   uint64_t EHFrameAddress;
   PatcherCallbackTy PatcherCallback;
@@ -63,6 +63,10 @@ public:
   /// Size of the entry size we will write (we may use a more compact layout)
   size_t OutputEntrySize;
 
+  /// Alignment to use when the table is emitted at a new location. Zero means
+  /// align to the output entry size.
+  size_t OutputAlignment{0};
+
   /// The type of this jump table.
   JumpTableType Type;
 
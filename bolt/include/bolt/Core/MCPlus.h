@@ -65,9 +65,30 @@ public:
     kJumpTable,           /// Jump Table.
     kTailCall,            /// Tail call.
     kConditionalTailCall, /// CTC.
+    kOffset,              /// Offset in the function.
     kGeneric              /// First generic annotation.
   };
 
+  /// Indices of generic annotations known at compile time. These are
+  /// pre-registered by the MCPlusBuilder constructor so that
+  /// performance-sensitive accessors resolve them to a fixed index without
+  /// consulting the annotation name map. Ad-hoc pass annotations are still
+  /// registered by name at run time and are numbered starting at
+  /// kFirstDynamic.
+  enum BuiltinKind : unsigned {
+    kJTIndexReg = kGeneric, /// Register holding a jump table index.
+    kNOP,                   /// Type of the original NOP instruction.
+    kSize,                  /// Size of the original instruction.
+    kCount,                 /// Execution count of a call.
+    kCTCTakenCount,         /// Taken count of a conditional tail call.
+    kCTCMispredCount,       /// Mispredict count of a conditional tail call.
+    kCallProfile,           /// Profile of an indirect call.
+    kArgAccessEntry,        /// Index of a stack-argument access entry.
+    kFrameAccessEntry,      /// Index of a frame-access entry.
+    kAArch64Veneer,         /// Instruction is part of an AArch64 veneer.
+    kFirstDynamic           /// First index for name-registered annotations.
+  };
+
   virtual void print(raw_ostream &OS) const = 0;
   virtual bool equals(const MCAnnotation &) const = 0;
   virtual ~MCAnnotation() {}
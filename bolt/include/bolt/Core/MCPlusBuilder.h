@@ -73,6 +73,10 @@ private:
   /// A variable that is used to generate unique ids for annotation allocators
   AllocatorIdTy MaxAllocatorId = 0;
 
+  /// Id of the allocator backing the active scoped annotation region, or 0
+  /// when no region is active. See startAnnotationRegion().
+  AllocatorIdTy ActiveAnnotationRegion = 0;
+
   /// We encode Index and Value into a 64-bit immediate operand value.
   static int64_t encodeAnnotationImm(unsigned Index, int64_t Value) {
     assert(Index < 256 && "annotation index max value exceeded");
@@ -158,6 +162,13 @@ protected:
   /// Names of non-standard annotations.
   SmallVector<std::string, 8> AnnotationNames;
 
+  /// Lazily-built per-opcode classification table. See getOpcodeInfoBits().
+  mutable std::vector<uint8_t> OpcodeInfoBitsTable;
+
+  /// Populate OpcodeInfoBitsTable by probing the classification predicates
+  /// with an operand-less instruction of every opcode.
+  void buildOpcodeInfoBitsTable() const;
+
   /// Allocate the TailCall annotation value. Clients of the target-specific
   /// MCPlusBuilder classes must use convert/lower/create* interfaces instead.
   void setTailCall(MCInst &Inst);
@@ -269,8 +280,8 @@ public:
         : Itr(new SeqImpl<MutableArrayRef<MCInst>::iterator>(Itr)) {}
 
     // TODO: it would be nice to templatize this on the key type.
-    InstructionIterator(std::map<uint32_t, MCInst>::iterator Itr)
-        : Itr(new MapImpl<std::map<uint32_t, MCInst>::iterator>(Itr)) {}
+    InstructionIterator(std::pair<uint32_t, MCInst> *Itr)
+        : Itr(new MapImpl<std::pair<uint32_t, MCInst> *>(Itr)) {}
 
   private:
     std::unique_ptr<Impl> Itr;
@@ -283,6 +294,18 @@ public:
     // Initialize the default annotation allocator with id 0
     AnnotationAllocators.emplace(0, AnnotationAllocator());
     MaxAllocatorId++;
+    // Pre-register annotations with compile-time known indices. The order
+    // has to match MCAnnotation::BuiltinKind so that the name-based
+    // interfaces resolve these annotations to their fixed indices.
+    for (const char *Name :
+         {"JTIndexReg", "NOP", "Size", "Count", "CTCTakenCount",
+          "CTCMispredCount", "CallProfile", "ArgAccessEntry",
+          "FrameAccessEntry", "AArch64Veneer"})
+      getOrCreateAnnotationIndex(Name);
+    assert(AnnotationNameIndexMap.size() ==
+               MCPlus::MCAnnotation::kFirstDynamic -
+                   MCPlus::MCAnnotation::kGeneric &&
+           "compile-time known annotations must be registered first");
   }
 
   /// Initialize a new annotation allocator and return its id
@@ -291,18 +314,57 @@ public:
     return MaxAllocatorId++;
   }
 
-  /// Return the annotation allocator of a given id
+  /// Return the annotation allocator of a given id. Requests for the shared
+  /// allocator 0 are redirected to the active scoped annotation region, if
+  /// one was declared.
   AnnotationAllocator &getAnnotationAllocator(AllocatorIdTy AllocatorId) {
+    if (AllocatorId == 0)
+      AllocatorId = ActiveAnnotationRegion;
     assert(AnnotationAllocators.count(AllocatorId) &&
            "allocator not initialized");
     return AnnotationAllocators.find(AllocatorId)->second;
   }
 
+  /// Start a scoped annotation region: until endAnnotationRegion() is
+  /// called, annotations requested from the shared allocator 0 are served
+  /// from a dedicated allocator so that their values can be bulk-freed when
+  /// the region ends, instead of accumulating until context teardown.
+  /// Regions do not nest, and allocations made through explicit allocator
+  /// ids are not affected.
+  AllocatorIdTy startAnnotationRegion() {
+    assert(!ActiveAnnotationRegion && "annotation regions do not nest");
+    ActiveAnnotationRegion = initializeNewAnnotationAllocator();
+    return ActiveAnnotationRegion;
+  }
+
+  /// End the scoped annotation region \p Id and bulk-free the values of all
+  /// annotations created within it. The caller guarantees that these
+  /// annotations are temporaries that will not be queried again.
+  void endAnnotationRegion(AllocatorIdTy Id) {
+    assert(Id == ActiveAnnotationRegion && "ending an inactive region");
+    ActiveAnnotationRegion = 0;
+    freeValuesAllocator(Id);
+  }
+
   // Check if an annotation allocator with the given id exists
   bool checkAllocatorExists(AllocatorIdTy AllocatorId) {
     return AnnotationAllocators.count(AllocatorId);
   }
 
+  /// Return an estimate of the memory held by annotation storage across all
+  /// allocators: value slabs plus per-annotation pool bookkeeping. The
+  /// MCInsts that anchor annotations to instructions are allocated from
+  /// untracked slabs and are not included.
+  uint64_t getAnnotationsMemory() const {
+    uint64_t Bytes = 0;
+    for (const auto &Element : AnnotationAllocators) {
+      const AnnotationAllocator &Allocator = Element.second;
+      Bytes += Allocator.ValueAllocator.getTotalMemory() +
+               Allocator.AnnotationPool.size() * sizeof(MCPlus::MCAnnotation *);
+    }
+    return Bytes;
+  }
+
   /// Free the values allocator within the annotation allocator
   void freeValuesAllocator(AllocatorIdTy AllocatorId) {
     AnnotationAllocator &Allocator = getAnnotationAllocator(AllocatorId);
@@ -381,6 +443,26 @@ public:
     return Info->get(Inst.getOpcode()).isPseudo();
   }
 
+  /// Classification bits for the predicates that instruction scans query
+  /// most often. The answers depend only on the opcode, so they are computed
+  /// once per target and served from a flat table afterwards.
+  enum OpcodeInfoBits : uint8_t {
+    OpcodeInfoLoad = 1u << 0,
+    OpcodeInfoStore = 1u << 1,
+    OpcodeInfoCall = 1u << 2,
+    OpcodeInfoBranch = 1u << 3,
+  };
+
+  /// Return the OpcodeInfoBits set for \p Opcode. Note that tail calls are a
+  /// per-instruction property of branch opcodes and are not covered by
+  /// OpcodeInfoCall. The first call builds the table and is not thread-safe:
+  /// concurrent readers must make one call before spawning to prime it.
+  uint8_t getOpcodeInfoBits(unsigned Opcode) const {
+    if (OpcodeInfoBitsTable.empty())
+      buildOpcodeInfoBitsTable();
+    return OpcodeInfoBitsTable[Opcode];
+  }
+
   /// Creates x86 pause instruction.
   virtual void createPause(MCInst &Inst) const {
     llvm_unreachable("not implemented");
@@ -416,10 +498,17 @@ public:
 
   virtual MCPhysReg getX86R11() const { llvm_unreachable("not implemented"); }
 
-  /// Create increment contents of target by 1 for Instrumentation
+  /// Create increment contents of target by 1 for Instrumentation. When
+  /// \p CounterShards is greater than one, the counter region is replicated
+  /// and the increment goes to the slab selected by hashing the running
+  /// thread, trading memory for contention-free updates of hot counters.
+  /// When \p SampleMask is non-zero, only executions whose timestamp counter
+  /// has all \p SampleMask bits clear update the real counter; the rest are
+  /// steered to a slab-local sink slot, keeping hot counter lines clean.
   virtual void createInstrIncMemory(InstructionListType &Instrs,
                                     const MCSymbol *Target, MCContext *Ctx,
-                                    bool IsLeaf) const {
+                                    bool IsLeaf, unsigned CounterShards,
+                                    unsigned SampleMask) const {
     llvm_unreachable("not implemented");
   }
 
@@ -1075,6 +1164,18 @@ public:
   /// branch. Return true if the instruction was converted.
   bool unsetConditionalTailCall(MCInst &Inst);
 
+  /// Return offset of \p Inst in the original function, if available.
+  Optional<uint32_t> getOffset(const MCInst &Inst) const;
+
+  /// Return the offset if the annotation is present, or \p Default otherwise.
+  uint32_t getOffsetWithDefault(const MCInst &Inst, uint32_t Default) const;
+
+  /// Set offset of \p Inst in the original function.
+  bool setOffset(MCInst &Inst, uint32_t Offset, AllocatorIdTy AllocatorId = 0);
+
+  /// Remove offset annotation.
+  bool clearOffset(MCInst &Inst);
+
   /// Return MCSymbol that represents a target of this instruction at a given
   /// operand number \p OpNum. If there's no symbol associated with
   /// the operand - return nullptr.
@@ -1136,6 +1237,17 @@ public:
   virtual const BitVector &getAliases(MCPhysReg Reg,
                                       bool OnlySmaller = false) const;
 
+  /// Return the alias closure of all implicit defs of opcode \p Opcode. The
+  /// result is cached per opcode, folding the per-register alias expansion
+  /// done by dataflow transfer functions into a single OR.
+  const BitVector &getImplicitDefAliases(unsigned Opcode,
+                                         bool OnlySmaller = false) const;
+
+  /// Return the alias closure of all implicit uses of opcode \p Opcode (see
+  /// getImplicitDefAliases()).
+  const BitVector &getImplicitUseAliases(unsigned Opcode,
+                                         bool OnlySmaller = false) const;
+
   /// Change \p Regs setting all registers used to pass parameters according
   /// to the host abi. Do nothing if not implemented.
   virtual BitVector getRegsUsedAsParams() const {
@@ -1394,6 +1506,15 @@ public:
     return false;
   }
 
+  /// Creates a software prefetch of the code at \p Target in Inst.
+  ///
+  /// Returns true on success, or false if the target does not support
+  /// prefetch injection.
+  virtual bool createPrefetch(MCInst &Inst, const MCSymbol *Target,
+                              MCContext *Ctx) const {
+    return false;
+  }
+
   /// Creates a new call instruction in Inst and sets its operand to
   /// Target.
   ///
@@ -1566,6 +1687,13 @@ public:
     return false;
   }
 
+  /// Return true if a conditional branch with condition code \p CC is taken
+  /// exactly when the operands of the preceding comparison are equal.
+  virtual bool isEqualityCondCode(unsigned CC) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
   /// Return the conditional code used in a conditional jump instruction.
   /// Returns invalid code if not conditional jump.
   virtual unsigned getCondCode(const MCInst &Inst) const {
@@ -1621,6 +1749,13 @@ public:
     return Index;
   }
 
+  /// Return the name of an annotation with a given \p Index.
+  StringRef getAnnotationName(unsigned Index) const {
+    assert(Index >= MCPlus::MCAnnotation::kGeneric &&
+           "expected generic annotation");
+    return AnnotationNames[Index - MCPlus::MCAnnotation::kGeneric];
+  }
+
   /// Store an annotation value on an MCInst.  This assumes the annotation
   /// is not already present.
   template <typename ValueType>
@@ -1884,6 +2019,26 @@ public:
     llvm_unreachable("not implemented");
     return BlocksVectorTy();
   }
+
+  /// Variant of jumpTablePromotion() for callsites with many equally likely
+  /// targets, where a sequential compare chain loses. Targets are dispatched
+  /// through a binary-searched ladder of index comparisons: internal blocks
+  /// split the sorted index range in half with an unsigned compare, leaf
+  /// blocks test one index for equality and fall back to the original
+  /// indirect jump on a mismatch. The ladder resolves any promoted index in
+  /// a logarithmic number of well-predicted branches regardless of the shape
+  /// of the target histogram.
+  ///
+  /// Blocks are returned in layout order: conditional branches only target
+  /// blocks that appear later in the vector, and the last block holds the
+  /// fallback indirect jump.
+  virtual BlocksVectorTy jumpTableLadderPromotion(
+      const MCInst &IJmpInst,
+      const std::vector<std::pair<MCSymbol *, uint64_t>> &Targets,
+      const std::vector<MCInst *> &TargetFetchInsns, MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return BlocksVectorTy();
+  }
 };
 
 } // namespace bolt
@@ -54,7 +54,9 @@ enum SchedulingPolicy {
 ThreadPool &getThreadPool();
 
 /// Perform the work on each BinaryFunction except those that are accepted
-/// by SkipPredicate, scheduling heuristic is based on SchedPolicy.
+/// by SkipPredicate. Functions are dispatched to worker threads dynamically,
+/// most expensive first according to SchedPolicy, so a single large function
+/// cannot strand work scheduled behind it.
 /// ForceSequential will selectively disable parallel execution and perform the
 /// work sequentially.
 void runOnEachFunction(BinaryContext &BC, SchedulingPolicy SchedPolicy,
@@ -65,8 +67,8 @@ void runOnEachFunction(BinaryContext &BC, SchedulingPolicy SchedPolicy,
 
 /// Perform the work on each BinaryFunction except those that are rejected
 /// by SkipPredicate, and create a unique annotation allocator for each
-/// task. This should be used whenever the work function creates annotations to
-/// allow thread-safe annotation creation.
+/// worker thread. This should be used whenever the work function creates
+/// annotations to allow thread-safe annotation creation.
 /// ForceSequential will selectively disable parallel execution and perform the
 /// work sequentially.
 void runOnEachFunctionWithUniqueAllocId(
@@ -17,6 +17,8 @@
 
 #include "bolt/Passes/BinaryPasses.h"
 
+#include <mutex>
+
 namespace llvm {
 namespace bolt {
 
@@ -29,14 +31,59 @@ private:
   /// Stats: execution count of blocks that were aligned.
   std::atomic<uint64_t> AlignedBlocksCount{0};
 
+  /// Stats for fetch-block alignment of hot branch targets.
+  std::atomic<uint64_t> FetchAlignedCount{0};
+  std::atomic<uint64_t> FetchPaddingBytes{0};
+  std::atomic<uint64_t> FetchCrossingsSaved{0};
+
+  /// Stats for loop alignment: loops placed within a single fetch block and
+  /// loop headers aligned.
+  std::atomic<uint64_t> ContainedLoopsCount{0};
+  std::atomic<uint64_t> AlignedLoopHeadersCount{0};
+
+  /// Candidate for the budgeted alignment mode: a block together with the
+  /// profile-weighted benefit of aligning it and the worst-case number of
+  /// padding bytes the alignment may consume.
+  struct BudgetCandidate {
+    uint64_t Score;
+    uint64_t MaxBytes;
+    uint64_t FunctionAddress;
+    uint64_t InputOffset;
+    BinaryBasicBlock *BB;
+  };
+  std::vector<BudgetCandidate> BudgetCandidates;
+  std::mutex BudgetCandidatesMtx;
+
   /// Assign alignment to basic blocks based on profile.
   void alignBlocks(BinaryFunction &Function, const MCCodeEmitter *Emitter);
 
+  /// Collect blocks of \p Function worth aligning along with their
+  /// profile-weighted scores for the budgeted alignment mode.
+  void collectBudgetCandidates(BinaryFunction &Function,
+                               const MCCodeEmitter *Emitter);
+
+  /// Distribute the global padding budget greedily over the collected
+  /// candidates and assign alignment to the winners.
+  void applyAlignmentBudget();
+
+  /// Align hot branch targets to fetch-block boundaries when the
+  /// profile-weighted benefit exceeds the cost of the inserted padding.
+  void alignFetchBlocks(BinaryFunction &Function, const MCCodeEmitter *Emitter);
+
+  /// Align hot innermost loops: a loop that fits into one fetch block is
+  /// placed so that it does not cross a fetch-block boundary, and the headers
+  /// of larger hot loops are aligned like hot basic blocks.
+  void alignLoops(BinaryFunction &Function, const MCCodeEmitter *Emitter);
+
 public:
   explicit AlignerPass() : BinaryFunctionPass(false) {}
 
   const char *getName() const override { return "aligner"; }
 
+  // The pass only assigns alignment to functions and basic blocks.
+  unsigned getStateRead() const override { return SC_CFG | SC_LAYOUT; }
+  unsigned getStateWritten() const override { return SC_LAYOUT; }
+
   /// Pass entry point
   void runOnFunctions(BinaryContext &BC) override;
 };
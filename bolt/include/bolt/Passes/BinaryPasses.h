@@ -17,6 +17,7 @@
 #include "bolt/Core/BinaryFunction.h"
 #include "bolt/Core/DynoStats.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Regex.h"
 #include <atomic>
 #include <map>
 #include <set>
@@ -33,13 +34,13 @@ protected:
 
   explicit BinaryFunctionPass(const bool PrintPass) : PrintPass(PrintPass) {}
 
+public:
+  virtual ~BinaryFunctionPass() = default;
+
   /// Control whether a specific function should be skipped during
   /// optimization.
   virtual bool shouldOptimize(const BinaryFunction &BF) const;
 
-public:
-  virtual ~BinaryFunctionPass() = default;
-
   /// The name of this pass
   virtual const char *getName() const = 0;
 
@@ -50,6 +51,30 @@ public:
   /// this pass is completed (printPass() must have returned true).
   virtual bool shouldPrint(const BinaryFunction &BF) const;
 
+  /// Return true if every annotation this pass creates in the shared
+  /// allocator is a temporary that the pass manager can bulk-free in a
+  /// scoped annotation region once the pass completes.
+  virtual bool useAnnotationRegion() const { return false; }
+
+  /// Components of the program state a pass may read or mutate, used by the
+  /// pass manager to decide whether two adjacent passes can run at the same
+  /// time.
+  enum StateComponent : unsigned {
+    SC_NONE = 0,
+    SC_CFG = 1u << 0,
+    SC_LAYOUT = 1u << 1,
+    SC_ANNOTATIONS = 1u << 2,
+    SC_SECTIONS = 1u << 3,
+    SC_ALL = SC_CFG | SC_LAYOUT | SC_ANNOTATIONS | SC_SECTIONS,
+  };
+
+  /// Return the set of StateComponent bits this pass reads. The conservative
+  /// default keeps the pass serialized with its pipeline neighbors.
+  virtual unsigned getStateRead() const { return SC_ALL; }
+
+  /// Return the set of StateComponent bits this pass mutates.
+  virtual unsigned getStateWritten() const { return SC_ALL; }
+
   /// Execute this pass on the given functions.
   virtual void runOnFunctions(BinaryContext &BC) = 0;
 };
@@ -84,6 +109,27 @@ public:
   }
 };
 
+/// Turn the program-wide dyno stats delta into a machine-readable verdict
+/// and fail the run when a metric is predicted to regress beyond its
+/// configured threshold.
+class DynoStatsVerdictPass : public BinaryFunctionPass {
+  DynoStats PrevDynoStats;
+
+public:
+  explicit DynoStatsVerdictPass(const DynoStats &PrevDynoStats)
+      : BinaryFunctionPass(false), PrevDynoStats(PrevDynoStats) {}
+
+  /// Return true if a regression threshold or a verdict file was requested
+  /// on the command line.
+  static bool isEnabled();
+
+  const char *getName() const override { return "dyno-stats-verdict"; }
+
+  bool shouldPrint(const BinaryFunction &BF) const override { return false; }
+
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
 /// The pass normalizes CFG by performing the following transformations:
 ///   * removes empty basic blocks
 ///   * merges duplicate edges and updates jump instructions
@@ -146,12 +192,22 @@ public:
     LT_OPTIMIZE_EXT_TSP,
     /// Create clusters and use random order for them.
     LT_OPTIMIZE_SHUFFLE,
+    /// Evaluate multiple layout algorithms on each function and keep the
+    /// one with the best extended TSP score.
+    LT_OPTIMIZE_BEST,
   };
 
 private:
   void modifyFunctionLayout(BinaryFunction &Function, LayoutType Type,
                             bool MinBranchClusters) const;
 
+  /// Run the candidate layout algorithms on \p Function, score the resulting
+  /// orderings with the extended TSP metric, and apply the best one. Return
+  /// the index of the winning candidate, with zero standing for the input
+  /// layout, which is kept unless a candidate strictly improves on it.
+  size_t selectBestFunctionLayout(BinaryFunction &Function,
+                                  bool MinBranchClusters) const;
+
 public:
   explicit ReorderBasicBlocks(const cl::opt<bool> &PrintPass)
       : BinaryFunctionPass(PrintPass) {}
@@ -293,21 +349,43 @@ public:
   void runOnFunctions(BinaryContext &BC) override;
 };
 
+/// Move the flag-setting instruction feeding a conditional branch next to
+/// the branch, making the pair eligible for macro-op fusion (X86). Earlier
+/// passes can leave unrelated instructions between the two, breaking fusion
+/// in the emitted code.
+class ScheduleMacroFusion : public BinaryFunctionPass {
+  /// Try to make the compare-and-branch pair terminating \p BB adjacent.
+  /// Return true if an instruction was moved.
+  bool scheduleBlock(BinaryBasicBlock &BB);
+
+public:
+  explicit ScheduleMacroFusion(const cl::opt<bool> &PrintPass)
+      : BinaryFunctionPass(PrintPass) {}
+
+  const char *getName() const override { return "sched-macro-fusion"; }
+
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
 /// Perform simple peephole optimizations.
+///
+/// All enabled peepholes are applied in a single walk over the blocks of a
+/// function, and the functions are processed in parallel, so a new pattern
+/// added to the table in runOnFunctions() costs no additional scan.
 class Peepholes : public BinaryFunctionPass {
-  uint64_t NumDoubleJumps{0};
-  uint64_t TailCallTraps{0};
-  uint64_t NumUselessCondBranches{0};
+  std::atomic<uint64_t> NumDoubleJumps{0};
+  std::atomic<uint64_t> TailCallTraps{0};
+  std::atomic<uint64_t> NumUselessCondBranches{0};
 
-  /// Add trap instructions immediately after indirect tail calls to prevent
-  /// the processor from decoding instructions immediate following the
-  /// tailcall.
-  void addTailcallTraps(BinaryFunction &Function);
+  /// Add a trap instruction immediately after an indirect tail call
+  /// terminating \p BB to prevent the processor from decoding instructions
+  /// immediately following the tailcall.
+  void addTailcallTrap(BinaryBasicBlock &BB);
 
-  /// Remove useless duplicate successors.  When the conditional
+  /// Remove a useless duplicate successor of \p BB.  When the conditional
   /// successor is the same as the unconditional successor, we can
   /// remove the conditional successor and branch instruction.
-  void removeUselessCondBranches(BinaryFunction &Function);
+  void removeUselessCondBranch(BinaryBasicBlock &BB);
 
 public:
   explicit Peepholes(const cl::opt<bool> &PrintPass)
@@ -348,6 +426,18 @@ public:
   void runOnFunctions(BinaryContext &BC) override;
 };
 
+/// Opt-in whole-function garbage collection: mark the roots (exported,
+/// address-taken or profiled functions), traverse the call graph, and mark
+/// the functions that are provably unreachable so that AssignSections
+/// places them with the never-executed code.
+class GCFunctions : public BinaryFunctionPass {
+public:
+  explicit GCFunctions() : BinaryFunctionPass(false) {}
+
+  const char *getName() const override { return "gc-functions"; }
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
 /// Assign output sections to all functions.
 class AssignSections : public BinaryFunctionPass {
 public:
@@ -423,6 +513,10 @@ class SpecializeMemcpy1 : public BinaryFunctionPass {
 private:
   std::vector<std::string> Spec;
 
+  /// Function patterns from \p Spec compiled by runOnFunctions(), each
+  /// paired with the call-site part of its spec.
+  std::vector<std::pair<Regex, StringRef>> SpecRegex;
+
   /// Return indices of the call sites to optimize. Count starts at 1.
   /// Returns an empty set for all call sites in the function.
   std::set<size_t> getCallSitesToOptimize(const BinaryFunction &) const;
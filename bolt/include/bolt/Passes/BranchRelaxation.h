@@ -0,0 +1,55 @@
+//===- bolt/Passes/BranchRelaxation.h ---------------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the BranchRelaxationPass class, which selects the final
+// encodings of relaxable x86 branches before emission. The assembler resolves
+// branch sizes by iterating over the whole function fragment until a fixed
+// point is reached, which is quadratic in the worst case and dominates
+// emission time for very large functions. This pass pre-computes the same
+// fixed point with a worklist that only revisits branches whose displacement
+// is affected by an instruction that grew, and widens the affected branches
+// in the CFG so that the assembler converges in a single round. The assembler
+// relaxation stays on as a correctness backstop: a branch this pass leaves
+// short is still widened during emission if it turns out not to fit.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BOLT_PASSES_BRANCHRELAXATION_H
+#define BOLT_PASSES_BRANCHRELAXATION_H
+
+#include "bolt/Passes/BinaryPasses.h"
+
+namespace llvm {
+
+class MCAsmBackend;
+
+namespace bolt {
+
+class BranchRelaxationPass : public BinaryFunctionPass {
+  /// Stats: the number of branches that were widened.
+  std::atomic<uint64_t> NumRelaxed{0};
+
+  /// Relax the branches of \p BF using \p MAB for the target encoding rules
+  /// and \p Emitter for exact instruction sizes. Returns the number of
+  /// branches that were widened.
+  uint64_t runOnFunction(BinaryFunction &BF, const MCAsmBackend &MAB,
+                         const MCCodeEmitter *Emitter);
+
+public:
+  explicit BranchRelaxationPass() : BinaryFunctionPass(false) {}
+
+  const char *getName() const override { return "branch-relaxation"; }
+
+  /// Pass entry point
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -13,17 +13,29 @@
 #ifndef BOLT_PASSES_CACHEMETRICS_H
 #define BOLT_PASSES_CACHEMETRICS_H
 
+#include "llvm/ADT/ArrayRef.h"
 #include <cstdint>
 #include <vector>
 
 namespace llvm {
+class MCCodeEmitter;
+
 namespace bolt {
+class BinaryBasicBlock;
 class BinaryFunction;
 namespace CacheMetrics {
 
 /// Calculate various metrics related to instruction cache performance.
 void printAll(const std::vector<BinaryFunction *> &BinaryFunctions);
 
+/// Calculate the Extended-TSP score of a candidate basic block ordering
+/// \p Order of a function using estimated basic block sizes. The score
+/// makes it possible to compare layouts produced by different algorithms
+/// before the function is emitted. \p Emitter may be supplied for lock-free
+/// size estimation in multi-threaded context.
+double scoreLayout(ArrayRef<BinaryBasicBlock *> Order,
+                   const MCCodeEmitter *Emitter = nullptr);
+
 /// Calculate Extended-TSP metric, which quantifies the expected number of
 /// i-cache misses for a given pair of basic blocks. The parameters are:
 /// - SrcAddr is the address of the source block;
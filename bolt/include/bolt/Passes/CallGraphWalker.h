@@ -32,6 +32,11 @@ class CallGraphWalker {
   typedef std::function<bool(BinaryFunction *)> CallbackTy;
   std::vector<CallbackTy> Visitors;
 
+  /// Stores callbacks used to saturate the tracked properties of functions
+  /// that failed to converge within the revisit budget
+  typedef std::function<void(BinaryFunction *)> FallbackTy;
+  std::vector<FallbackTy> Fallbacks;
+
   /// Do the bottom-up traversal
   void traverseCG();
 
@@ -46,6 +51,15 @@ public:
   /// call graph walk will never finish.
   void registerVisitor(CallbackTy Callback) { Visitors.emplace_back(Callback); }
 
+  /// Register a callback to be invoked for a function that keeps changing
+  /// after the revisit budget is exhausted, which only happens inside call
+  /// graph cycles. The callback must set the property tracked by the
+  /// corresponding visitor to its most conservative value. The function is
+  /// then propagated to its callers one last time and never revisited. When
+  /// no fallback is registered, the walk iterates to a fixed point without a
+  /// budget.
+  void registerFallback(FallbackTy Callback) { Fallbacks.emplace_back(Callback); }
+
   /// Build the call graph, establish a traversal order and traverse it.
   void walk();
 };
@@ -0,0 +1,42 @@
+//===- bolt/Passes/ColdPrefetch.h -------------------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BOLT_PASSES_COLDPREFETCH_H
+#define BOLT_PASSES_COLDPREFETCH_H
+
+#include "bolt/Passes/BinaryPasses.h"
+
+namespace llvm {
+namespace bolt {
+
+/// Insert software prefetches of cold fragment code at hot->cold transition
+/// sites after function splitting. Cold code that still fires occasionally,
+/// such as exception paths, takes a burst of i-cache misses on entry;
+/// prefetching the start of the cold target from the hot side when the
+/// transition carries enough profile weight hides part of that burst.
+class ColdPrefetch : public BinaryFunctionPass {
+  /// Number of prefetch instructions inserted.
+  uint64_t NumPrefetches = 0;
+
+  /// Set when the target does not support prefetch injection.
+  bool Unsupported = false;
+
+  void runOnFunction(BinaryFunction &Function);
+
+public:
+  explicit ColdPrefetch() : BinaryFunctionPass(false) {}
+
+  const char *getName() const override { return "cold-prefetch"; }
+
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -0,0 +1,35 @@
+//===- bolt/Passes/ConstantIslandDedupPass.h --------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the ConstantIslandDedupPass class, which folds
+// byte-identical constant islands of nearby functions into a single copy.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BOLT_PASSES_CONSTANT_ISLAND_DEDUP_PASS_H
+#define BOLT_PASSES_CONSTANT_ISLAND_DEDUP_PASS_H
+
+#include "bolt/Passes/BinaryPasses.h"
+
+namespace llvm {
+namespace bolt {
+
+class ConstantIslandDedupPass : public BinaryFunctionPass {
+public:
+  explicit ConstantIslandDedupPass() : BinaryFunctionPass(false) {}
+
+  const char *getName() const override { return "constant-island-dedup"; }
+
+  /// Pass entry point
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -0,0 +1,40 @@
+//===- bolt/Passes/ConstantIslandPlacementPass.h ----------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the ConstantIslandPlacementPass class, which chooses an
+// emission point for a function's constant islands next to the hottest block
+// referencing them instead of past the last block of the hot fragment.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BOLT_PASSES_CONSTANT_ISLAND_PLACEMENT_PASS_H
+#define BOLT_PASSES_CONSTANT_ISLAND_PLACEMENT_PASS_H
+
+#include "bolt/Passes/BinaryPasses.h"
+
+namespace llvm {
+namespace bolt {
+
+class ConstantIslandPlacementPass : public BinaryFunctionPass {
+public:
+  explicit ConstantIslandPlacementPass() : BinaryFunctionPass(false) {}
+
+  const char *getName() const override { return "constant-island-placement"; }
+
+  /// Pass entry point
+  void runOnFunctions(BinaryContext &BC) override;
+
+  /// Select the island anchor block for \p BF. Return true if the islands
+  /// were moved from their default position.
+  bool runOnFunction(BinaryFunction &BF);
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
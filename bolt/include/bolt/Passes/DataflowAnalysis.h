@@ -11,8 +11,10 @@
 
 #include "bolt/Core/BinaryContext.h"
 #include "bolt/Core/BinaryFunction.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/Support/Errc.h"
-#include <queue>
+#include <deque>
 
 namespace llvm {
 namespace bolt {
@@ -168,9 +170,28 @@ protected:
   /// Map a point to its previous (succeeding) point if the direction of the
   /// dataflow is forward (backward). This is used to support convenience
   /// methods to access the resulting state before (after) a given instruction,
-  /// otherwise our clients need to keep "prev" pointers themselves.
+  /// otherwise our clients need to keep "prev" pointers themselves. Not
+  /// populated when only block-boundary states are kept.
   DenseMap<const MCInst *, ProgramPoint> PrevPoint;
 
+  /// When set, per-instruction states are not materialized as annotations:
+  /// only the states at basic block boundaries are kept and states inside a
+  /// block are recomputed on demand by replaying the transfer functions from
+  /// the block boundary. Trades a little CPU for an order of magnitude less
+  /// memory on analyses with large per-instruction states.
+  const bool KeepBoundaryStatesOnly{false};
+  /// State at the iteration-boundary instruction of each block: the last
+  /// instruction in a forward dataflow, the first one in a backward dataflow.
+  /// Only used when KeepBoundaryStatesOnly is set.
+  std::unordered_map<const BinaryBasicBlock *, StateTy> StateAtBBExit;
+  /// Owning block of every instruction, needed for on-demand recomputation.
+  /// Takes the place of PrevPoint when KeepBoundaryStatesOnly is set.
+  DenseMap<const MCInst *, BinaryBasicBlock *> InsnToBB;
+  /// Scratch storage backing the result of on-demand state queries. The
+  /// reference returned by getStateAt()/getStateBefore() for an instruction
+  /// is only valid until the next query when KeepBoundaryStatesOnly is set.
+  mutable StateTy RecomputedState;
+
   /// Perform any bookkeeping before dataflow starts
   void preflight() { llvm_unreachable("Unimplemented method"); }
 
@@ -241,119 +262,130 @@ protected:
     return getOrCreateStateAt(*Point.getInst());
   }
 
-public:
-  /// Return the allocator id
-  unsigned getAllocatorId() { return AllocatorId; }
-
-  /// If the direction of the dataflow is forward, operates on the last
-  /// instruction of all predecessors when performing an iteration of the
-  /// dataflow equation for the start of this BB.  If backwards, operates on
-  /// the first instruction of all successors.
-  void doForAllSuccsOrPreds(const BinaryBasicBlock &BB,
-                            std::function<void(ProgramPoint)> Task) {
-    if (!Backward)
-      return doForAllPreds(BB, Task);
-    return doForAllSuccs(BB, Task);
-  }
-
-  /// We need the current binary context and the function that will be processed
-  /// in this dataflow analysis.
-  DataflowAnalysis(BinaryFunction &BF,
-                   MCPlusBuilder::AllocatorIdTy AllocatorId = 0)
-      : BC(BF.getBinaryContext()), Func(BF), AllocatorId(AllocatorId) {}
-
-  virtual ~DataflowAnalysis() { cleanAnnotations(); }
-
-  /// Track the state at basic block start (end) if direction of the dataflow
-  /// is forward (backward).
-  ErrorOr<const StateTy &> getStateAt(const BinaryBasicBlock &BB) const {
-    auto Iter = StateAtBBEntry.find(&BB);
-    if (Iter == StateAtBBEntry.end())
-      return make_error_code(errc::result_out_of_range);
-    return Iter->second;
-  }
-
-  /// Track the state at the end (start) of each MCInst in this function if
-  /// the direction of the dataflow is forward (backward).
-  ErrorOr<const StateTy &> getStateAt(const MCInst &Point) const {
-    return BC.MIB->tryGetAnnotationAs<StateTy>(
-        Point, const_derived().getAnnotationIndex());
+  /// Return the instruction holding the block-boundary state of \p BB, i.e.
+  /// the last instruction visited when iterating over the block in dataflow
+  /// order, or nullptr if the block is empty.
+  const MCInst *getBoundaryInst(const BinaryBasicBlock &BB) const {
+    if (BB.empty())
+      return nullptr;
+    return !Backward ? &*BB.rbegin() : &*BB.begin();
   }
 
-  /// Return the out set (in set) of a given program point if the direction of
-  /// the dataflow is forward (backward).
-  ErrorOr<const StateTy &> getStateAt(ProgramPoint Point) const {
-    if (Point.isBB())
-      return getStateAt(*Point.getBB());
-    return getStateAt(*Point.getInst());
-  }
-
-  /// Relies on a ptr map to fetch the previous instruction and then retrieve
-  /// state. WARNING: Watch out for invalidated pointers. Do not use this
-  /// function if you invalidated pointers after the analysis has been completed
-  ErrorOr<const StateTy &> getStateBefore(const MCInst &Point) {
-    return getStateAt(PrevPoint[&Point]);
+  /// Return mutable storage for the state of the first instruction \p First
+  /// of block \p BB as seen by a backward dataflow, which is the block's
+  /// boundary state when only boundary states are kept.
+  StateTy &getOrCreateBoundaryStateAt(BinaryBasicBlock &BB, MCInst &First) {
+    if (KeepBoundaryStatesOnly)
+      return StateAtBBExit[&BB];
+    return getOrCreateStateAt(First);
   }
 
-  ErrorOr<const StateTy &> getStateBefore(ProgramPoint Point) {
-    if (Point.isBB())
-      return getStateAt(*Point.getBB());
-    return getStateAt(PrevPoint[Point.getInst()]);
-  }
+  /// Recompute the state at (or, if \p Before is set, right before) \p Point
+  /// by replaying the transfer functions over its block starting from the
+  /// stored boundary state. Only used when KeepBoundaryStatesOnly is set.
+  ErrorOr<const StateTy &> recomputeStateAt(const MCInst &Point,
+                                            bool Before) const {
+    auto BBIter = InsnToBB.find(&Point);
+    if (BBIter == InsnToBB.end())
+      return make_error_code(errc::result_out_of_range);
+    BinaryBasicBlock *BB = BBIter->second;
 
-  /// Remove any state annotations left by this analysis
-  void cleanAnnotations() {
-    for (BinaryBasicBlock &BB : Func) {
-      for (MCInst &Inst : BB) {
-        BC.MIB->removeAnnotation(Inst, derived().getAnnotationIndex());
-      }
+    if (!Before && &Point == getBoundaryInst(*BB)) {
+      auto ExitIter = StateAtBBExit.find(BB);
+      if (ExitIter == StateAtBBExit.end())
+        return make_error_code(errc::result_out_of_range);
+      return ExitIter->second;
     }
-  }
 
-  /// Public entry point that will perform the entire analysis form start to
-  /// end.
-  void run() {
-    derived().preflight();
+    auto EntryIter = StateAtBBEntry.find(BB);
+    if (EntryIter == StateAtBBEntry.end())
+      return make_error_code(errc::result_out_of_range);
 
-    // Initialize state for all points of the function
-    for (BinaryBasicBlock &BB : Func) {
-      StateTy &St = getOrCreateStateAt(BB);
-      St = derived().getStartingStateAtBB(BB);
-      for (MCInst &Inst : BB) {
-        StateTy &St = getOrCreateStateAt(Inst);
-        St = derived().getStartingStateAtPoint(Inst);
+    // The transfer functions are not required to be const: replay them
+    // through a non-const view of the analysis.
+    auto &Self = const_cast<DataflowAnalysis &>(*this);
+    RecomputedState = EntryIter->second;
+    auto Step = [&](MCInst &Inst) {
+      RecomputedState = Self.derived().computeNext(Inst, RecomputedState);
+      if (Backward && BC.MIB->isInvoke(Inst)) {
+        if (BinaryBasicBlock *LBB = Self.Func.getLandingPadBBFor(*BB, Inst)) {
+          auto First = LBB->begin();
+          if (First != LBB->end())
+            Self.derived().doConfluenceWithLP(
+                RecomputedState, Self.getOrCreateBoundaryStateAt(*LBB, *First),
+                Inst);
+          else
+            Self.derived().doConfluenceWithLP(
+                RecomputedState, Self.getOrCreateStateAt(LBB), Inst);
+        }
+      }
+    };
+    if (!Backward) {
+      for (MCInst &Inst : *BB) {
+        if (Before && &Inst == &Point)
+          break;
+        Step(Inst);
+        if (&Inst == &Point)
+          break;
+      }
+    } else {
+      for (auto I = BB->rbegin(), E = BB->rend(); I != E; ++I) {
+        if (Before && &*I == &Point)
+          break;
+        Step(*I);
+        if (&*I == &Point)
+          break;
       }
     }
-    assert(Func.begin() != Func.end() && "Unexpected empty function");
-
-    std::queue<BinaryBasicBlock *> Worklist;
-    // TODO: Pushing this in a DFS ordering will greatly speed up the dataflow
-    // performance.
+    return RecomputedState;
+  }
+
+  /// Reset the state of every program point in \p BB to its starting state
+  /// and rebuild the PrevPoint links for the block.
+  void initBlock(BinaryBasicBlock &BB) {
+    StateTy &St = getOrCreateStateAt(BB);
+    St = derived().getStartingStateAtBB(BB);
+    if (KeepBoundaryStatesOnly) {
+      for (MCInst &Inst : BB)
+        InsnToBB[&Inst] = &BB;
+      if (const MCInst *Boundary = getBoundaryInst(BB))
+        StateAtBBExit[&BB] = derived().getStartingStateAtPoint(*Boundary);
+      return;
+    }
+    for (MCInst &Inst : BB) {
+      StateTy &St = getOrCreateStateAt(Inst);
+      St = derived().getStartingStateAtPoint(Inst);
+    }
+    MCInst *Prev = nullptr;
     if (!Backward) {
-      for (BinaryBasicBlock &BB : Func) {
-        Worklist.push(&BB);
-        MCInst *Prev = nullptr;
-        for (MCInst &Inst : BB) {
-          PrevPoint[&Inst] = Prev ? ProgramPoint(Prev) : ProgramPoint(&BB);
-          Prev = &Inst;
-        }
+      for (MCInst &Inst : BB) {
+        PrevPoint[&Inst] = Prev ? ProgramPoint(Prev) : ProgramPoint(&BB);
+        Prev = &Inst;
       }
     } else {
-      for (auto I = Func.rbegin(), E = Func.rend(); I != E; ++I) {
-        Worklist.push(&*I);
-        MCInst *Prev = nullptr;
-        for (auto J = (*I).rbegin(), E2 = (*I).rend(); J != E2; ++J) {
-          MCInst &Inst = *J;
-          PrevPoint[&Inst] = Prev ? ProgramPoint(Prev) : ProgramPoint(&*I);
-          Prev = &Inst;
-        }
+      for (auto J = BB.rbegin(), E = BB.rend(); J != E; ++J) {
+        PrevPoint[&*J] = Prev ? ProgramPoint(Prev) : ProgramPoint(&BB);
+        Prev = &*J;
       }
     }
+  }
+
+  /// Iterate the dataflow equations over the blocks seeded in \p Worklist
+  /// until a fixed point is reached.
+  void propagate(std::deque<BinaryBasicBlock *> &Worklist) {
+    // Avoid scheduling a block that is already pending: under FIFO order,
+    // processing its duplicate entries is pure waste.
+    DenseSet<const BinaryBasicBlock *> InQueue(Worklist.begin(),
+                                               Worklist.end());
+    auto schedule = [&](BinaryBasicBlock *BB) {
+      if (InQueue.insert(BB).second)
+        Worklist.push_back(BB);
+    };
 
-    // Main dataflow loop
     while (!Worklist.empty()) {
       BinaryBasicBlock *BB = Worklist.front();
-      Worklist.pop();
+      Worklist.pop_front();
+      InQueue.erase(BB);
 
       // Calculate state at the entry of first instruction in BB
       StateTy StateAtEntry = getOrCreateStateAt(*BB);
@@ -380,6 +412,7 @@ public:
 
       // Propagate information from first instruction down to the last one
       StateTy *PrevState = &St;
+      StateTy ScratchState;
       const MCInst *LAST = nullptr;
       if (!Backward)
         LAST = &*BB->rbegin();
@@ -394,15 +427,25 @@ public:
           if (LBB) {
             auto First = LBB->begin();
             if (First != LBB->end())
-              derived().doConfluenceWithLP(CurState,
-                                           getOrCreateStateAt(&*First), Inst);
+              derived().doConfluenceWithLP(
+                  CurState, getOrCreateBoundaryStateAt(*LBB, *First), Inst);
             else
               derived().doConfluenceWithLP(CurState, getOrCreateStateAt(LBB),
                                            Inst);
           }
         }
 
-        StateTy &St = getOrCreateStateAt(Inst);
+        // In boundary-states-only mode intermediate states are transient:
+        // only the state reaching the boundary instruction is persisted.
+        if (KeepBoundaryStatesOnly && &Inst != LAST) {
+          ScratchState = std::move(CurState);
+          PrevState = &ScratchState;
+          return;
+        }
+
+        StateTy &St = KeepBoundaryStatesOnly
+                          ? StateAtBBExit[&BB]
+                          : getOrCreateStateAt(Inst);
         if (St != CurState) {
           St = CurState;
           if (&Inst == LAST)
@@ -421,18 +464,160 @@ public:
       if (Changed) {
         if (!Backward) {
           for (BinaryBasicBlock *Succ : BB->successors())
-            Worklist.push(Succ);
+            schedule(Succ);
           for (BinaryBasicBlock *LandingPad : BB->landing_pads())
-            Worklist.push(LandingPad);
+            schedule(LandingPad);
         } else {
           for (BinaryBasicBlock *Pred : BB->predecessors())
-            Worklist.push(Pred);
+            schedule(Pred);
           for (BinaryBasicBlock *Thrower : BB->throwers())
-            Worklist.push(Thrower);
+            schedule(Thrower);
         }
       }
     } // end while (!Worklist.empty())
   }
+
+public:
+  /// Return the allocator id
+  unsigned getAllocatorId() { return AllocatorId; }
+
+  /// If the direction of the dataflow is forward, operates on the last
+  /// instruction of all predecessors when performing an iteration of the
+  /// dataflow equation for the start of this BB.  If backwards, operates on
+  /// the first instruction of all successors.
+  void doForAllSuccsOrPreds(const BinaryBasicBlock &BB,
+                            std::function<void(ProgramPoint)> Task) {
+    if (!Backward)
+      return doForAllPreds(BB, Task);
+    return doForAllSuccs(BB, Task);
+  }
+
+  /// We need the current binary context and the function that will be processed
+  /// in this dataflow analysis.
+  DataflowAnalysis(BinaryFunction &BF,
+                   MCPlusBuilder::AllocatorIdTy AllocatorId = 0,
+                   bool KeepBoundaryStatesOnly = false)
+      : BC(BF.getBinaryContext()), Func(BF), AllocatorId(AllocatorId),
+        KeepBoundaryStatesOnly(KeepBoundaryStatesOnly) {}
+
+  virtual ~DataflowAnalysis() { cleanAnnotations(); }
+
+  /// Track the state at basic block start (end) if direction of the dataflow
+  /// is forward (backward).
+  ErrorOr<const StateTy &> getStateAt(const BinaryBasicBlock &BB) const {
+    auto Iter = StateAtBBEntry.find(&BB);
+    if (Iter == StateAtBBEntry.end())
+      return make_error_code(errc::result_out_of_range);
+    return Iter->second;
+  }
+
+  /// Track the state at the end (start) of each MCInst in this function if
+  /// the direction of the dataflow is forward (backward).
+  ErrorOr<const StateTy &> getStateAt(const MCInst &Point) const {
+    if (KeepBoundaryStatesOnly)
+      return recomputeStateAt(Point, /*Before=*/false);
+    return BC.MIB->tryGetAnnotationAs<StateTy>(
+        Point, const_derived().getAnnotationIndex());
+  }
+
+  /// Return the out set (in set) of a given program point if the direction of
+  /// the dataflow is forward (backward).
+  ErrorOr<const StateTy &> getStateAt(ProgramPoint Point) const {
+    if (Point.isBB())
+      return getStateAt(*Point.getBB());
+    return getStateAt(*Point.getInst());
+  }
+
+  /// Relies on a ptr map to fetch the previous instruction and then retrieve
+  /// state. WARNING: Watch out for invalidated pointers. Do not use this
+  /// function if you invalidated pointers after the analysis has been completed
+  ErrorOr<const StateTy &> getStateBefore(const MCInst &Point) {
+    if (KeepBoundaryStatesOnly)
+      return recomputeStateAt(Point, /*Before=*/true);
+    return getStateAt(PrevPoint[&Point]);
+  }
+
+  ErrorOr<const StateTy &> getStateBefore(ProgramPoint Point) {
+    if (Point.isBB())
+      return getStateAt(*Point.getBB());
+    if (KeepBoundaryStatesOnly)
+      return recomputeStateAt(*Point.getInst(), /*Before=*/true);
+    return getStateAt(PrevPoint[Point.getInst()]);
+  }
+
+  /// Remove any state annotations left by this analysis
+  void cleanAnnotations() {
+    for (BinaryBasicBlock &BB : Func) {
+      for (MCInst &Inst : BB) {
+        BC.MIB->removeAnnotation(Inst, derived().getAnnotationIndex());
+      }
+    }
+  }
+
+  /// Public entry point that will perform the entire analysis form start to
+  /// end.
+  void run() {
+    derived().preflight();
+
+    assert(Func.begin() != Func.end() && "Unexpected empty function");
+
+    // Initialize state for all points of the function
+    std::deque<BinaryBasicBlock *> Worklist;
+    // TODO: Pushing this in a DFS ordering will greatly speed up the dataflow
+    // performance.
+    if (!Backward) {
+      for (BinaryBasicBlock &BB : Func) {
+        initBlock(BB);
+        Worklist.push_back(&BB);
+      }
+    } else {
+      for (auto I = Func.rbegin(), E = Func.rend(); I != E; ++I) {
+        initBlock(*I);
+        Worklist.push_back(&*I);
+      }
+    }
+
+    propagate(Worklist);
+  }
+
+  /// Refresh the analysis after instructions were inserted into or removed
+  /// from \p EditedBBs. Only the blocks whose input may have changed -- those
+  /// reachable from the edited blocks along the direction of the dataflow --
+  /// are re-initialized and re-propagated; states of all other blocks are
+  /// left untouched and remain valid, so confluence at the region boundary
+  /// starts from them.
+  ///
+  /// Only legal when the edit did not change the CFG and the analysis state
+  /// does not reference individual instructions (e.g. register or
+  /// stack-offset domains). Analyses whose expression numbering is built from
+  /// the instruction stream must be recomputed from scratch instead.
+  void rerun(ArrayRef<BinaryBasicBlock *> EditedBBs) {
+    DenseSet<const BinaryBasicBlock *> Affected(EditedBBs.begin(),
+                                                EditedBBs.end());
+    std::deque<BinaryBasicBlock *> Region(EditedBBs.begin(), EditedBBs.end());
+    for (size_t I = 0; I < Region.size(); ++I) {
+      auto Visit = [&](BinaryBasicBlock *Next) {
+        if (Affected.insert(Next).second)
+          Region.push_back(Next);
+      };
+      if (!Backward) {
+        for (BinaryBasicBlock *Succ : Region[I]->successors())
+          Visit(Succ);
+        for (BinaryBasicBlock *LandingPad : Region[I]->landing_pads())
+          Visit(LandingPad);
+      } else {
+        for (BinaryBasicBlock *Pred : Region[I]->predecessors())
+          Visit(Pred);
+        for (BinaryBasicBlock *Thrower : Region[I]->throwers())
+          Visit(Thrower);
+      }
+    }
+
+    for (BinaryBasicBlock *BB : Region)
+      initBlock(*BB);
+
+    propagate(Region);
+  }
 };
 
 /// Define an iterator for navigating the expressions calculated by a
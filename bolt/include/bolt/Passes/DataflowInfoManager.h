@@ -84,6 +84,13 @@ public:
   std::unordered_map<const MCInst *, BinaryBasicBlock *> &getInsnToBBMap();
   void invalidateInsnToBBMap();
   void invalidateAll();
+
+  /// Refresh the managed analyses after a pass inserted or removed individual
+  /// instructions in \p EditedBBs without changing the CFG. Analyses whose
+  /// state does not reference individual instructions (liveness, stack
+  /// pointer tracking) are incrementally re-propagated over the affected
+  /// blocks only; all others are invalidated and recomputed on demand.
+  void rerunAfterLocalEdits(ArrayRef<BinaryBasicBlock *> EditedBBs);
 };
 
 } // end namespace bolt
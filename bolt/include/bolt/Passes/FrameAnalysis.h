@@ -10,6 +10,9 @@
 #define BOLT_PASSES_FRAMEANALYSIS_H
 
 #include "bolt/Passes/StackPointerTracking.h"
+#include "llvm/ADT/DenseMap.h"
+#include <deque>
+#include <mutex>
 
 namespace llvm {
 namespace bolt {
@@ -107,10 +110,44 @@ raw_ostream &operator<<(raw_ostream &OS, const FrameIndexEntry &FIE);
 ///    }
 ///
 class FrameAnalysis {
+public:
+  /// Summary of the frame accesses of one fully analyzed function,
+  /// aggregated while the FrameIndexEntry annotations are attached in
+  /// restoreFrameIndex(). Consumers that only need to know whether a
+  /// category of access exists can check the summary instead of re-scanning
+  /// the instruction stream.
+  struct FunctionSummary {
+    /// Number of instructions with frame-access annotations.
+    uint32_t NumFrameAccesses{0};
+    /// A simple load from below the CFA: candidate for redundant-load
+    /// removal.
+    bool HasSimpleLoad{false};
+    /// A simple store to below the CFA: candidate for unused-store removal.
+    bool HasSimpleStore{false};
+    /// A simple register store below the CFA: the shape of a callee-saved
+    /// register save and the prerequisite for shrink wrapping.
+    bool HasSpillCandidate{false};
+  };
+
+private:
   BinaryContext &BC;
 
+  /// When non-null, restricts the expensive per-function analyses to this
+  /// set of functions. Functions outside the set are assumed to touch every
+  /// caller stack position and to require an aligned stack, so the set must
+  /// be closed under the call relation for the results inside it to be
+  /// precise: a caller may only be in the set if all its known callees are.
+  const DenseSet<const BinaryFunction *> *AnalysisScope{nullptr};
+
+  /// Return true if \p BF should be fully analyzed.
+  bool isWithinScope(const BinaryFunction &BF) const {
+    return !AnalysisScope || AnalysisScope->count(&BF);
+  }
+
   /// Map functions to the set of <stack offsets, size> tuples representing
-  /// accesses to stack positions that belongs to caller
+  /// accesses to stack positions that belongs to caller. Entries for all
+  /// functions are created before the call graph traversal so concurrent
+  /// visitors can update their own entry while reading their callees'.
   std::map<const BinaryFunction *, std::set<std::pair<int64_t, uint8_t>>>
       ArgsTouchedMap;
 
@@ -118,13 +155,22 @@ class FrameAnalysis {
   /// restoring frame indexes for all load/store instructions.
   DenseSet<const BinaryFunction *> AnalyzedFunctions;
 
-  /// Set of functions that require the stack to be 16B aligned
-  DenseSet<const BinaryFunction *> FunctionsRequireAlignment;
+  /// Functions that require the stack to be 16B aligned. Entries for all
+  /// functions are created before the call graph traversal, like in
+  /// ArgsTouchedMap.
+  DenseMap<const BinaryFunction *, bool> FunctionsRequireAlignment;
+
+  /// Frame-access summaries of the functions in AnalyzedFunctions.
+  DenseMap<const BinaryFunction *, FunctionSummary> SummaryMap;
 
   /// Owns ArgAccesses for all instructions. References to elements are
-  /// attached to instructions as indexes to this vector, in MCAnnotations.
-  std::vector<ArgAccesses> ArgAccessesVector;
-  /// Same for FrameIndexEntries.
+  /// attached to instructions as indexes to this deque, in MCAnnotations.
+  /// A deque keeps element addresses stable while concurrent call graph
+  /// visitors append entries under ArgAccessesMutex.
+  std::deque<ArgAccesses> ArgAccessesVector;
+  /// Protects growth of and index lookups into ArgAccessesVector.
+  mutable std::mutex ArgAccessesMutex;
+  /// Same for FrameIndexEntries, only written after the parallel phase.
   std::vector<FrameIndexEntry> FIEVector;
 
   /// Analysis stats counters
@@ -136,25 +182,39 @@ class FrameAnalysis {
 
   /// Convenience functions for appending MCAnnotations to instructions with
   /// our specific data
-  void addArgAccessesFor(MCInst &Inst, ArgAccesses &&AA);
-  void addArgInStackAccessFor(MCInst &Inst, const ArgInStackAccess &Arg);
+  void addArgAccessesFor(MCInst &Inst, ArgAccesses &&AA,
+                         MCPlusBuilder::AllocatorIdTy AllocId = 0);
+  void addArgInStackAccessFor(MCInst &Inst, const ArgInStackAccess &Arg,
+                              MCPlusBuilder::AllocatorIdTy AllocId = 0);
   void addFIEFor(MCInst &Inst, const FrameIndexEntry &FIE);
 
+  /// Flag \p BF as requiring an aligned stack. Returns true if the flag was
+  /// not set before. The entry is pre-created, so concurrent visitors only
+  /// ever write their own flag.
+  bool markRequiresAlignment(const BinaryFunction &BF);
+
   /// Perform the step of building the set of registers clobbered by each
   /// function execution, populating RegsKilledMap and RegsGenMap.
   void traverseCG(BinaryFunctionCallGraph &CG);
 
+  /// Parallel version of the bottom-up call graph traversal: strongly
+  /// connected components whose callees have all been analyzed are
+  /// dispatched to worker threads, one component at a time.
+  void traverseCGInParallel(BinaryFunctionCallGraph &CG);
+
   /// Analyzes an instruction and if it is a call, checks the called function
   /// to record which args in stack are accessed, if any. Returns true if
   /// the args data associated with this instruction were updated.
   bool updateArgsTouchedFor(const BinaryFunction &BF, MCInst &Inst,
-                            int CurOffset);
+                            int CurOffset,
+                            MCPlusBuilder::AllocatorIdTy AllocId);
 
   /// Performs a pass over \p BF to check for accesses to arguments in stack,
   /// flagging those as accessing the caller stack frame. All functions called
   /// by \p BF must have been previously analyzed. Returns true if updated
   /// args data about this function.
-  bool computeArgsAccessed(BinaryFunction &BF);
+  bool computeArgsAccessed(BinaryFunction &BF,
+                           MCPlusBuilder::AllocatorIdTy AllocId = 0);
 
   /// Alias analysis to disambiguate which frame position is accessed by each
   /// instruction in function \p BF. Add MCAnnotation<FrameIndexEntry> to
@@ -172,7 +232,11 @@ class FrameAnalysis {
   std::vector<MCPlusBuilder::AllocatorIdTy> SPTAllocatorsId;
 
 public:
-  explicit FrameAnalysis(BinaryContext &BC, BinaryFunctionCallGraph &CG);
+  /// If \p AnalysisScope is non-null, only the functions it contains are
+  /// fully analyzed; see the field comment for the closure requirement.
+  explicit FrameAnalysis(
+      BinaryContext &BC, BinaryFunctionCallGraph &CG,
+      const DenseSet<const BinaryFunction *> *AnalysisScope = nullptr);
 
   /// Return true if we could fully analyze \p Func
   bool hasFrameInfo(const BinaryFunction &Func) const {
@@ -181,7 +245,14 @@ public:
 
   /// Return true if \p Func cannot operate with a misaligned CFA
   bool requiresAlignment(const BinaryFunction &Func) const {
-    return FunctionsRequireAlignment.count(&Func);
+    return FunctionsRequireAlignment.lookup(&Func);
+  }
+
+  /// Return the frame-access summary of \p Func, or nullptr if the function
+  /// was not fully analyzed.
+  const FunctionSummary *getSummaryFor(const BinaryFunction &Func) const {
+    auto It = SummaryMap.find(&Func);
+    return It == SummaryMap.end() ? nullptr : &It->second;
   }
 
   /// Functions for retrieving our specific MCAnnotation data from instructions
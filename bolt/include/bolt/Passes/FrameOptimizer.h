@@ -75,11 +75,11 @@ class RegAnalysis;
 ///
 class FrameOptimizerPass : public BinaryFunctionPass {
   /// Stats aggregating variables
-  uint64_t NumRedundantLoads{0};
-  uint64_t NumRedundantStores{0};
-  uint64_t NumLoadsChangedToReg{0};
-  uint64_t NumLoadsChangedToImm{0};
-  uint64_t NumLoadsDeleted{0};
+  std::atomic<uint64_t> NumRedundantLoads{0};
+  std::atomic<uint64_t> NumRedundantStores{0};
+  std::atomic<uint64_t> NumLoadsChangedToReg{0};
+  std::atomic<uint64_t> NumLoadsChangedToImm{0};
+  std::atomic<uint64_t> NumLoadsDeleted{0};
 
   DenseSet<const BinaryFunction *> FuncsChanged;
 
@@ -89,10 +89,12 @@ class FrameOptimizerPass : public BinaryFunctionPass {
   /// the frame. Use the analysis to convert memory loads to register moves or
   /// immediate loads. Delete redundant register moves.
   void removeUnnecessaryLoads(const RegAnalysis &RA, const FrameAnalysis &FA,
-                              BinaryFunction &BF);
+                              BinaryFunction &BF,
+                              MCPlusBuilder::AllocatorIdTy AllocatorId);
 
   /// Use information from stack frame usage to delete unused stores.
-  void removeUnusedStores(const FrameAnalysis &FA, BinaryFunction &BF);
+  void removeUnusedStores(const FrameAnalysis &FA, BinaryFunction &BF,
+                          MCPlusBuilder::AllocatorIdTy AllocatorId);
 
   /// Perform shrinkwrapping step
   void performShrinkWrapping(const RegAnalysis &RA, const FrameAnalysis &FA,
@@ -171,6 +171,10 @@ class IndirectCallPromotion : public BinaryFunctionPass {
   // Total number of jump table sites that use hot indices.
   uint64_t TotalIndexBasedJumps{0};
 
+  // Total number of jump table callsites promoted with a binary-searched
+  // compare ladder instead of a sequential compare chain.
+  uint64_t TotalLadderCallsites{0};
+
   void printDecision(llvm::raw_ostream &OS,
                      std::vector<IndirectCallPromotion::Callsite> &Targets,
                      unsigned N) const;
@@ -182,6 +186,11 @@ class IndirectCallPromotion : public BinaryFunctionPass {
                             const std::vector<Callsite> &Targets,
                             uint64_t NumCalls);
 
+  /// Normalized entropy (0 to 1) of the taken-branch histogram over Targets.
+  /// A value close to 1 means the callsite is megamorphic: branches are
+  /// spread evenly over its targets.
+  static double computeTargetEntropy(const std::vector<Callsite> &Targets);
+
   void printCallsiteInfo(const BinaryBasicBlock &BB, const MCInst &Inst,
                          const std::vector<Callsite> &Targets, const size_t N,
                          uint64_t NumCalls) const;
@@ -196,6 +205,11 @@ class IndirectCallPromotion : public BinaryFunctionPass {
                                        MCInst &Inst,
                                        MCInst *&TargetFetchInst) const;
 
+  SymTargetsType findLadderCallTargetSymbols(const std::vector<Callsite> &Targets,
+                                             const size_t N,
+                                             BinaryBasicBlock &BB, MCInst &Inst,
+                                             MCInst *&TargetFetchInst) const;
+
   MethodInfoType maybeGetVtableSyms(BinaryBasicBlock &BB, MCInst &Inst,
                                     const SymTargetsType &SymTargets) const;
 
@@ -206,7 +220,7 @@ class IndirectCallPromotion : public BinaryFunctionPass {
 
   BinaryBasicBlock *fixCFG(BinaryBasicBlock &IndCallBlock,
                            const bool IsTailCall, const bool IsJumpTable,
-                           BasicBlocksVector &&NewBBs,
+                           const bool IsLadder, BasicBlocksVector &&NewBBs,
                            const std::vector<Callsite> &Targets) const;
 
 public:
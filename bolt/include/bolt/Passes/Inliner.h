@@ -64,6 +64,13 @@ private:
 
   void findInliningCandidates(BinaryContext &BC);
 
+  /// If \p Inst is a call site in \p Function that is eligible for inlining,
+  /// return the target function and set \p SizeAfterInlining to the expected
+  /// net size change of the caller. Return nullptr otherwise.
+  BinaryFunction *getEligibleCallTarget(const BinaryFunction &Function,
+                                        const MCInst &Inst,
+                                        int64_t &SizeAfterInlining);
+
   bool inlineCallsInFunction(BinaryFunction &Function);
 
   /// Inline a function call \p CallInst to function \p Callee.
@@ -19,6 +19,7 @@
 
 #include "bolt/Passes/BinaryPasses.h"
 #include "bolt/Passes/InstrumentationSummary.h"
+#include "llvm/ADT/DenseMap.h"
 
 namespace llvm {
 namespace bolt {
@@ -35,6 +36,31 @@ public:
   const char *getName() const override { return "instrumentation"; }
 
 private:
+  /// Data collected for a single function during the parallel phase of the
+  /// pass. Counters, indirect call sites and string table references are
+  /// numbered locally and rebased when the data is merged into \p Summary in
+  /// function address order, so the final tables and the counter section
+  /// layout do not depend on thread scheduling.
+  struct FunctionInstrumentationData {
+    FunctionDescription FuncDesc;
+    /// Counters allocated for this function, in creation order.
+    std::vector<MCSymbol *> Counters;
+    std::vector<IndCallDescription> IndCallDescriptions;
+    std::vector<IndCallTargetDescription> IndCallTargetDescriptions;
+    /// Functions referenced by the descriptions above in first-use order,
+    /// together with the local string table offset assigned to each.
+    std::vector<std::pair<const BinaryFunction *, uint32_t>> ReferencedNames;
+    DenseMap<const BinaryFunction *, uint32_t> FuncToLocalIdx;
+    /// Running size of the local string table.
+    uint32_t StringTableSize{0};
+    /// First global indirect call site ID assigned to this function.
+    uint32_t FirstIndCallSiteID{0};
+    /// Statistics on counters.
+    uint32_t DirectCallCounters{0};
+    uint32_t BranchCounters{0};
+    uint32_t LeafNodeCounters{0};
+  };
+
   void instrumentFunction(BinaryFunction &Function,
                           MCPlusBuilder::AllocatorIdTy = 0);
 
@@ -45,26 +71,36 @@ private:
   /// be inserted and its index returned.
   uint32_t getFunctionNameIndex(const BinaryFunction &Function);
 
+  /// Same as above against the local string table of \p Data. The local
+  /// offsets are translated into offsets in the merged string table when
+  /// \p Data is folded into \p Summary.
+  uint32_t getFunctionNameIndex(const BinaryFunction &Function,
+                                FunctionInstrumentationData &Data);
+
   /// Metadata creation methods
-  void createIndCallDescription(const BinaryFunction &FromFunction,
+  void createIndCallDescription(FunctionInstrumentationData &Data,
+                                const BinaryFunction &FromFunction,
                                 uint32_t From);
-  void createIndCallTargetDescription(const BinaryFunction &ToFunction,
+  void createIndCallTargetDescription(FunctionInstrumentationData &Data,
+                                      const BinaryFunction &ToFunction,
                                       uint32_t To);
-  bool createCallDescription(FunctionDescription &FuncDesc,
+  bool createCallDescription(FunctionInstrumentationData &Data,
                              const BinaryFunction &FromFunction, uint32_t From,
                              uint32_t FromNodeID,
                              const BinaryFunction &ToFunction, uint32_t To,
                              bool IsInvoke);
-  bool createEdgeDescription(FunctionDescription &FuncDesc,
+  bool createEdgeDescription(FunctionInstrumentationData &Data,
                              const BinaryFunction &FromFunction, uint32_t From,
                              uint32_t FromNodeID,
                              const BinaryFunction &ToFunction, uint32_t To,
                              uint32_t ToNodeID, bool Instrumented);
-  void createLeafNodeDescription(FunctionDescription &FuncDesc, uint32_t Node);
+  void createLeafNodeDescription(FunctionInstrumentationData &Data,
+                                 uint32_t Node);
 
   /// Create the sequence of instructions to increment a counter
-  InstructionListType createInstrumentationSnippet(BinaryContext &BC,
-                                                   bool IsLeaf);
+  InstructionListType
+  createInstrumentationSnippet(BinaryContext &BC, bool IsLeaf,
+                               FunctionInstrumentationData &Data);
 
   // Critical edges worklist
   // This worklist keeps track of CFG edges <From-To> that needs to be split.
@@ -87,16 +123,17 @@ private:
                            BinaryBasicBlock &FromBB, uint32_t From,
                            BinaryFunction &ToFunc, BinaryBasicBlock *TargetBB,
                            uint32_t ToOffset, bool IsLeaf, bool IsInvoke,
-                           FunctionDescription *FuncDesc, uint32_t FromNodeID,
-                           uint32_t ToNodeID = 0);
+                           FunctionInstrumentationData &Data,
+                           uint32_t FromNodeID, uint32_t ToNodeID = 0);
 
   void instrumentLeafNode(BinaryBasicBlock &BB, BinaryBasicBlock::iterator Iter,
-                          bool IsLeaf, FunctionDescription &FuncDesc,
+                          bool IsLeaf, FunctionInstrumentationData &Data,
                           uint32_t Node);
 
   void instrumentIndirectTarget(BinaryBasicBlock &BB,
                                 BinaryBasicBlock::iterator &Iter,
-                                BinaryFunction &FromFunction, uint32_t From);
+                                BinaryFunction &FromFunction, uint32_t From,
+                                FunctionInstrumentationData &Data);
 
   void createAuxiliaryFunctions(BinaryContext &BC);
 
@@ -109,7 +146,10 @@ private:
   /// strtab indices in StringTable for each function name
   std::unordered_map<const BinaryFunction *, uint32_t> FuncToStringIdx;
 
-  mutable std::shared_timed_mutex FDMutex;
+  /// Per-function data collected during the parallel phase of the pass.
+  /// Entries are created up front, so worker threads only ever touch their
+  /// own function's slot.
+  DenseMap<const BinaryFunction *, FunctionInstrumentationData> FuncData;
 
   /// The data generated during Instrumentation pass that needs to
   /// be passed to the Instrument runtime library.
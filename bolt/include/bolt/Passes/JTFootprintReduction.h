@@ -22,7 +22,9 @@ class DataflowInfoManager;
 /// This pass identify indirect jumps to jump tables and reduce their entries
 /// size from 8 to 4 bytes. For PIC jump tables, it will remove the PIC code
 /// (since BOLT only process static code and it makes no sense to use expensive
-/// PIC-style jumps in static code).
+/// PIC-style jumps in static code). With a hot threshold set, only tables hot
+/// enough according to the profile are shrunk and cache-line aligned, while
+/// colder tables are left in place.
 class JTFootprintReduction : public BinaryFunctionPass {
   uint64_t TotalJTScore{0};
   uint64_t TotalJTs{0};
@@ -32,6 +34,9 @@ class JTFootprintReduction : public BinaryFunctionPass {
   uint64_t IndJmpsDenied{0};
   uint64_t NumJTsBadMatch{0};
   uint64_t NumJTsNoReg{0};
+  uint64_t NumJTsColdTier{0};
+  uint64_t HotTierEntries{0};
+  uint64_t TotalTierEntries{0};
   uint64_t BytesSaved{0};
   DenseSet<JumpTable *> BlacklistedJTs;
   DenseSet<const BinaryFunction *> Modified;
@@ -15,6 +15,7 @@
 
 namespace opts {
 extern llvm::cl::opt<bool> AssumeABI;
+extern llvm::cl::opt<bool> CompactLiveness;
 extern llvm::cl::opt<bool> TimeOpts;
 } // namespace opts
 
@@ -31,8 +32,8 @@ class LivenessAnalysis : public DataflowAnalysis<LivenessAnalysis, BitVector,
 public:
   LivenessAnalysis(const RegAnalysis &RA, BinaryFunction &BF,
                    MCPlusBuilder::AllocatorIdTy AllocId)
-      : Parent(BF, AllocId), RA(RA),
-        NumRegs(BF.getBinaryContext().MRI->getNumRegs()) {}
+      : Parent(BF, AllocId, /*KeepBoundaryStatesOnly=*/opts::CompactLiveness),
+        RA(RA), NumRegs(BF.getBinaryContext().MRI->getNumRegs()) {}
   virtual ~LivenessAnalysis();
 
   bool isAlive(ProgramPoint PP, MCPhysReg Reg) const {
@@ -141,10 +142,8 @@ protected:
         Used |= BC.MIB->getAliases(Point.getOperand(I).getReg(),
                                    /*OnlySmaller=*/false);
       }
-      for (auto I = InstInfo.getImplicitUses(),
-                E = InstInfo.getImplicitUses() + InstInfo.getNumImplicitUses();
-           I != E; ++I)
-        Used |= BC.MIB->getAliases(*I, false);
+      Used |= BC.MIB->getImplicitUseAliases(Point.getOpcode(),
+                                            /*OnlySmaller=*/false);
       if (IsCall &&
           (!BC.MIB->isTailCall(Point) || !BC.MIB->isConditionalBranch(Point))) {
         // Never gen FLAGS from a non-conditional call... this is overly
@@ -133,6 +133,10 @@ class LongJmpPass : public BinaryFunctionPass {
   /// Expand the range of the stub in StubBB if necessary
   bool relaxStub(BinaryBasicBlock &StubBB);
 
+  /// True if relaxStub() would expand the stub in \p StubBB under the current
+  /// tentative layout
+  bool stubNeedsRelaxation(const BinaryBasicBlock &StubBB) const;
+
   /// Helper to resolve a symbol address according to our tentative layout
   uint64_t getSymbolAddress(const BinaryContext &BC, const MCSymbol *Target,
                             const BinaryBasicBlock *TgtBB) const;
@@ -140,6 +144,12 @@ class LongJmpPass : public BinaryFunctionPass {
   /// Relax function by adding necessary stubs or relaxing existing stubs
   bool relax(BinaryFunction &BF);
 
+  /// Read-only check of whether relax() would modify \p Func under the
+  /// current tentative layout. Only inspects this pass's maps and the
+  /// tentative addresses, so it is safe to run concurrently for different
+  /// functions.
+  bool needsRelaxation(const BinaryFunction &Func) const;
+
 public:
   /// BinaryPass public interface
 
@@ -51,6 +51,14 @@ public:
   /// Pass entry point
   void runOnFunctions(BinaryContext &BC) override;
   bool runOnFunction(BinaryFunction &Function);
+
+  /// Rotate innermost loops that are laid out contiguously so that the
+  /// hottest edge of the loop cycle becomes a fall-through. Block reordering
+  /// always lays out the header first, which turns every back edge into a
+  /// taken branch; when back edges dominate the loop entries it is cheaper
+  /// to jump into the rotated body once per entry instead. Returns the
+  /// number of loops rotated.
+  unsigned rotateLoops(BinaryFunction &Function);
 };
 
 } // namespace bolt
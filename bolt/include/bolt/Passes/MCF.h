@@ -9,9 +9,12 @@
 #ifndef BOLT_PASSES_MCF_H
 #define BOLT_PASSES_MCF_H
 
+#include <functional>
+
 namespace llvm {
 namespace bolt {
 
+class BinaryContext;
 class BinaryFunction;
 
 enum MCFCostFunction : char {
@@ -26,6 +29,13 @@ enum MCFCostFunction : char {
 /// we only have bb count.
 void estimateEdgeCounts(BinaryFunction &BF);
 
+/// Run estimateEdgeCounts over all functions in \p BC, except those rejected
+/// by \p SkipFunction, dispatching independent per-function work to worker
+/// threads. Functions whose block and edge counts already obey the flow
+/// equations are skipped without running the inference.
+void estimateEdgeCounts(BinaryContext &BC,
+                        std::function<bool(const BinaryFunction &BF)> SkipFunction);
+
 /// Entry point for computing a min-cost flow for the CFG with the goal
 /// of fixing the flow of the CFG edges, that is, making sure it obeys the
 /// flow-conservation equation  SumInEdges = SumOutEdges.
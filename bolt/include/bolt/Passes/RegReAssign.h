@@ -9,15 +9,16 @@
 #ifndef BOLT_PASSES_REGREASSIGN_H
 #define BOLT_PASSES_REGREASSIGN_H
 
+#include "bolt/Core/MCPlusBuilder.h"
 #include "bolt/Passes/BinaryPasses.h"
 #include "bolt/Passes/RegAnalysis.h"
+#include <atomic>
+#include <mutex>
 
 namespace llvm {
 namespace bolt {
 
 class RegReAssign : public BinaryFunctionPass {
-  std::vector<int64_t> RegScore;
-  std::vector<size_t> RankedRegs;
   BitVector ClassicRegs;
   BitVector CalleeSaved;
   BitVector ClassicCSR;
@@ -28,14 +29,21 @@ class RegReAssign : public BinaryFunctionPass {
   std::unique_ptr<RegAnalysis> RA;
   std::unique_ptr<BinaryFunctionCallGraph> CG;
 
-  /// Stats
+  /// Stats. Functions are processed in parallel, so the counters are atomic
+  /// and the set of rewritten functions is guarded by a mutex.
   DenseSet<const BinaryFunction *> FuncsChanged;
-  int64_t StaticBytesSaved{0};
-  int64_t DynBytesSaved{0};
+  std::mutex FuncsChangedMutex;
+  std::atomic<int64_t> StaticBytesSaved{0};
+  std::atomic<int64_t> DynBytesSaved{0};
 
   void swap(BinaryFunction &Function, MCPhysReg A, MCPhysReg B);
-  void rankRegisters(BinaryFunction &Function);
-  void aggressivePassOverFunction(BinaryFunction &Function);
+
+  /// Compute per-register utilization scores for \p Function, weighted by
+  /// block execution counts, into the caller-provided scratch vectors.
+  void rankRegisters(BinaryFunction &Function, std::vector<int64_t> &RegScore,
+                     std::vector<size_t> &RankedRegs);
+  void aggressivePassOverFunction(BinaryFunction &Function,
+                                  MCPlusBuilder::AllocatorIdTy AllocId);
   bool conservativePassOverFunction(BinaryFunction &Function);
   void setupAggressivePass(BinaryContext &BC,
                            std::map<uint64_t, BinaryFunction> &BFs);
@@ -10,6 +10,7 @@
 #define BOLT_PASSES_REORDER_DATA_H
 
 #include "bolt/Passes/BinaryPasses.h"
+#include <set>
 #include <unordered_map>
 
 namespace llvm {
@@ -35,6 +36,16 @@ private:
   sortedByFunc(BinaryContext &BC, const BinarySection &Section,
                std::map<uint64_t, BinaryFunction> &BFs) const;
 
+  /// Sort symbols so that data accessed by the same hot function is
+  /// contiguous and can be packed into shared cache lines.
+  std::pair<DataOrder, unsigned>
+  sortedByCacheLines(BinaryContext &BC, const BinarySection &Section,
+                     std::map<uint64_t, BinaryFunction> &BFs);
+
+  /// Symbols starting a new run of cache lines in the order produced by
+  /// sortedByCacheLines().
+  std::set<const BinaryData *> LineGroupLeaders;
+
   void printOrder(const BinarySection &Section, DataOrder::const_iterator Begin,
                   DataOrder::const_iterator End) const;
 
@@ -51,6 +62,11 @@ public:
 
   const char *getName() const override { return "reorder-data"; }
 
+  // Data reordering rewrites section contents and symbol order, but leaves
+  // the code untouched.
+  unsigned getStateRead() const override { return SC_CFG | SC_SECTIONS; }
+  unsigned getStateWritten() const override { return SC_SECTIONS; }
+
   void runOnFunctions(BinaryContext &BC) override;
 };
 
@@ -516,6 +516,14 @@ public:
 
   bool perform();
 
+  /// Quick pre-screen that detects, using only the frame-access annotations
+  /// computed by \p FA, whether \p BF contains a store that could qualify as
+  /// a callee-saved register save. Functions failing this check have no
+  /// spills for the pass to move, so callers may skip them without
+  /// constructing any dataflow state.
+  static bool hasSpillCandidates(const FrameAnalysis &FA,
+                                 const BinaryFunction &BF);
+
   static void printStats();
 };
 
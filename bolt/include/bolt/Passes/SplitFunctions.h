@@ -33,6 +33,8 @@ private:
 
   std::atomic<uint64_t> SplitBytesHot{0ull};
   std::atomic<uint64_t> SplitBytesCold{0ull};
+  std::atomic<uint64_t> NumWarmFragments{0ull};
+  std::atomic<uint64_t> NumColdFragments{0ull};
 
 public:
   explicit SplitFunctions(const cl::opt<bool> &PrintPass)
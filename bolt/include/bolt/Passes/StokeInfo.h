@@ -69,8 +69,8 @@ struct StokeFuncInfo {
     LiveOut.clear();
   }
 
-  void printCsvHeader(std::ofstream &Outfile) {
-    if (Outfile.is_open())
+  void printCsvHeader(std::ostream &Outfile) {
+    if (Outfile)
       Outfile << "FuncName,Offset,Size,NumInstrs,NumBlocks,"
               << "IsLoopFree,NumLoops,MaxLoopDepth,"
               << "HotSize,TotalSize,"
@@ -81,8 +81,8 @@ struct StokeFuncInfo {
               << "Omitted\n";
   }
 
-  void printData(std::ofstream &Outfile) {
-    if (Outfile.is_open()) {
+  void printData(std::ostream &Outfile) {
+    if (Outfile) {
       Outfile << FuncName << "," << Offset << "," << Size << "," << NumInstrs
               << "," << NumBlocks << "," << IsLoopFree << "," << NumLoops << ","
               << MaxLoopDepth << "," << HotSize << "," << TotalSize << ","
@@ -0,0 +1,40 @@
+//===- bolt/Passes/TailCallFlattening.h -------------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BOLT_PASSES_TAIL_CALL_FLATTENING_H
+#define BOLT_PASSES_TAIL_CALL_FLATTENING_H
+
+#include "bolt/Passes/BinaryPasses.h"
+
+namespace llvm {
+namespace bolt {
+
+/// Redirect direct callers past tail-call-only forwarding functions.
+///
+/// Compiler-split functions and shims frequently reduce to a single
+/// unconditional tail call to another function, so a hot call travels
+/// through a chain of jumps before reaching the code that does the work.
+/// This pass detects such forwarders that were executed according to the
+/// profile and retargets their direct call sites at the final destination
+/// of the chain, saving a branch per hop and the corresponding branch
+/// predictor entries. The forwarders themselves are left in place since
+/// their address may be taken.
+class TailCallFlattening : public BinaryFunctionPass {
+public:
+  explicit TailCallFlattening(const cl::opt<bool> &PrintPass)
+      : BinaryFunctionPass(PrintPass) {}
+
+  const char *getName() const override { return "tail-call-flattening"; }
+
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif // BOLT_PASSES_TAIL_CALL_FLATTENING_H
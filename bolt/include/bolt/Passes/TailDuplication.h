@@ -63,6 +63,12 @@ class TailDuplication : public BinaryFunctionPass {
   /// Record the number of instructions deleted because of propagation
   uint64_t DynamicInstructionDeletionCount = 0;
 
+  /// Record the number of candidates rejected by the cost model.
+  uint64_t DuplicationsRejectedByCostModel = 0;
+
+  /// Record the number of bytes of code created by duplication.
+  uint64_t BytesDuplicatedTotal = 0;
+
   /// Sets Regs with the caller saved registers
   void getCallerSavedRegs(const MCInst &Inst, BitVector &Regs,
                           BinaryContext &BC) const;
@@ -91,6 +97,15 @@ class TailDuplication : public BinaryFunctionPass {
   bool isInCacheLine(const BinaryBasicBlock &BB,
                      const BinaryBasicBlock &Succ) const;
 
+  /// True if duplicating \p BlocksToDuplicate after \p BB buys enough
+  /// dynamically to justify \p DuplicationByteCount bytes of new code.
+  /// The benefit is the count of unconditional branches removed on the path
+  /// through BB plus the mispredicted conditional branches whose history
+  /// the duplication separates from other predecessors.
+  bool isProfitable(const BinaryBasicBlock &BB,
+                    const std::vector<BinaryBasicBlock *> &BlocksToDuplicate,
+                    uint64_t DuplicationByteCount) const;
+
   /// Duplicates BlocksToDuplicate and places them after BB.
   std::vector<BinaryBasicBlock *>
   tailDuplicate(BinaryBasicBlock &BB,
@@ -16,17 +16,28 @@ namespace bolt {
 
 /// Pass for optimizing a three way branch namely a single comparison and 2
 /// conditional jumps by reordering blocks, replacing successors, and replacing
-/// jump conditions and destinations
+/// jump conditions and destinations. The pass also restructures longer N-way
+/// equality-comparison ladders by reordering their rungs in order of
+/// decreasing profile probability, minimizing the expected number of
+/// comparisons executed on the hot path.
 class ThreeWayBranch : public BinaryFunctionPass {
   /// Record how many 3 way branches were adjusted
   uint64_t BranchesAltered = 0;
 
+  /// Record how many comparison ladders were reordered
+  uint64_t LaddersAltered = 0;
+
   /// Returns true if this pass should run on Function
   bool shouldRunOnFunction(BinaryFunction &Function);
 
   /// Runs pass on Function
   void runOnFunction(BinaryFunction &Function);
 
+  /// If \p Entry starts an equality-comparison ladder whose rungs are not
+  /// ordered by decreasing execution count, reorder the rungs and return
+  /// true.
+  bool rebalanceLadder(BinaryFunction &Function, BinaryBasicBlock *Entry);
+
 public:
   explicit ThreeWayBranch() : BinaryFunctionPass(false) {}
 
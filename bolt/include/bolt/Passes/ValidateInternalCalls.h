@@ -54,6 +54,10 @@ public:
 
   const char *getName() const override { return "validate-internal-calls"; }
 
+  // The ProcessedInternalCall markers are removed before the pass finishes,
+  // so their values can be reclaimed with the pass's annotation region.
+  bool useAnnotationRegion() const override { return true; }
+
   void runOnFunctions(BinaryContext &BC) override;
 
 private:
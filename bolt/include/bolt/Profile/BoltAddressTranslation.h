@@ -9,12 +9,15 @@
 #ifndef BOLT_PROFILE_BOLTADDRESSTRANSLATION_H
 #define BOLT_PROFILE_BOLTADDRESSTRANSLATION_H
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
 #include <cstdint>
 #include <map>
 #include <system_error>
+#include <utility>
+#include <vector>
 
 namespace llvm {
 class raw_ostream;
@@ -64,6 +67,21 @@ class BinaryFunction;
 /// because they can be a target of a jump (To address in the LBR) and also to
 /// recreate the BB layout of this function. We use the BB layout map to
 /// recreate fall-through jumps in the profile, given an LBR trace.
+///
+/// The serialized table starts with a 32-bit function count followed by a
+/// directory of fixed-size records, sorted by function output address, each
+/// holding the address, the byte offset of the function's data in the entry
+/// pool and the number of translation entries. Each function's slice of the
+/// pool starts with a skip index - one fixed-size record per block of
+/// entries holding the absolute output offset of the block's first entry
+/// and its byte position in the delta stream - followed by the entries as
+/// ULEB128-encoded deltas: the output offset is encoded relative to the
+/// previous entry and the input offset relative to the entry's own output
+/// offset. Cold fragments are serialized under their own directory records
+/// keyed by the fragment address, so their streams are independent of the
+/// hot parts. The table ends with the cold-to-hot part mappings. perf2bolt
+/// binary-searches the directory and the skip index directly in the
+/// mmapped section and decodes a single block per point lookup.
 class BoltAddressTranslation {
 public:
   // In-memory representation of the address translation table
@@ -76,10 +94,15 @@ public:
   /// output binary
   static const char *SECTION_NAME;
 
-  BoltAddressTranslation(BinaryContext &BC) : BC(BC) {}
+  /// Construct a standalone instance that can only parse and query a
+  /// serialized table. Used by tools operating on a bolted binary without
+  /// a binary context.
+  BoltAddressTranslation() = default;
+
+  BoltAddressTranslation(BinaryContext &BC) : BC(&BC) {}
 
   /// Write the serialized address translation tables for each reordered
-  /// function
+  /// function. Requires a binary context.
   void write(raw_ostream &OS);
 
   /// Read the serialized address translation tables and load them internally
@@ -103,6 +126,25 @@ public:
   /// at \p Address. Return 0 otherwise.
   uint64_t fetchParentAddress(uint64_t Address) const;
 
+  /// Result of a standalone lookup: the output address of the hot part of
+  /// the function containing the queried address and the input offset
+  /// relative to the original function start.
+  struct AddressMapping {
+    uint64_t FuncAddress;
+    uint64_t InputOffset;
+  };
+
+  /// Translate an absolute code address in the output binary using only
+  /// the parsed table, without a binary context. Return None for addresses
+  /// below any function with a translation table - such code was emitted
+  /// unmodified and the address maps to itself. The directory records no
+  /// function sizes, so an address past the covered range of a translated
+  /// function is attributed to its last entry; callers are expected to
+  /// pass sample addresses that land inside functions. Safe to call
+  /// concurrently: the lookup decodes a single entry block in place and
+  /// does not populate the memoization caches.
+  Optional<AddressMapping> translateAddress(uint64_t Address) const;
+
   /// True if the input binary has a translation table we can use to convert
   /// addresses when aggregating profile
   bool enabledFor(llvm::object::ELFObjectFileBase *InputFile) const;
@@ -115,10 +157,50 @@ private:
   void writeEntriesForBB(MapTy &Map, const BinaryBasicBlock &BB,
                          uint64_t FuncAddress);
 
-  BinaryContext &BC;
-
+  /// Serialized data of one function: the region of the entry pool holding
+  /// its skip index and delta stream, and the number of entries encoded in
+  /// the stream.
+  struct EntryRegion {
+    StringRef Data;
+    uint32_t NumEntries;
+  };
+
+  /// Find the directory record for the function at output \p Address and
+  /// return the region of the entry pool holding its translation data,
+  /// or None if the function has no translation table.
+  Optional<EntryRegion> getEntriesForAddress(uint64_t Address) const;
+
+  /// Return the fully decoded translation map of the function at output
+  /// \p Address, materializing it on first use, or nullptr if the function
+  /// has no translation table. Entry values carry the BRANCHENTRY bit.
+  const std::vector<std::pair<uint32_t, uint32_t>> *
+  getDecodedMap(uint64_t Address) const;
+
+  /// Binary context of the rewrite pipeline. Null in standalone instances,
+  /// which can only parse and query serialized tables.
+  BinaryContext *BC{nullptr};
+
+  /// Translation maps in the order they are serialized. Only populated when
+  /// writing the tables.
   std::map<uint64_t, MapTy> Maps;
 
+  /// Function directory and translation entry pool regions of the parsed
+  /// BAT section. They reference the mmapped input binary and stay valid
+  /// for as long as it does.
+  StringRef FuncTable;
+  StringRef EntryPool;
+
+  /// Cache of completed translations. LBR samples repeat the same addresses
+  /// heavily, so memoizing the lookups pays for itself quickly. Keyed by
+  /// absolute output address and the branch-source flag.
+  mutable DenseMap<std::pair<uint64_t, uint64_t>, uint64_t> TranslationCache;
+
+  /// Fully decoded translation maps, materialized lazily for the functions
+  /// traversed by getFallthroughsInTrace(). Point lookups in translate()
+  /// decode a single block instead and do not populate this cache.
+  mutable DenseMap<uint64_t, std::vector<std::pair<uint32_t, uint32_t>>>
+      DecodedMaps;
+
   /// Links outlined cold bocks to their original function
   std::map<uint64_t, uint64_t> ColdPartSource;
 
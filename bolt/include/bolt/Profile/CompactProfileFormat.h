@@ -0,0 +1,92 @@
+//===- bolt/Profile/CompactProfileFormat.h - Compact profile ---*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// On-disk layout of the compact profile container, the binary successor to
+// the YAML profile serialization. The container keeps a fixed-width function
+// index up front, so a reader can match the profile against the functions
+// present in the binary being optimized and decode block data for matched
+// functions only, instead of materializing the whole profile.
+//
+// Layout (all fixed-width fields little-endian):
+//
+//   CompactProfileHeader
+//   NumFunctions x CompactProfileFunctionRecord
+//   per-function block payloads
+//   string table: NUL-terminated names
+//
+// A block payload is a ULEB128 stream, deflated with zlib when that shrinks
+// it (CompressedSize != UncompressedSize means the payload is deflated). For
+// every profiled block the stream holds:
+//
+//   block index, instruction count, blended block hash, execution count,
+//   event count,
+//   call-site count, successor count,
+//   per call site: offset delta from the previous call site, destination
+//                  function id, entry discriminator, count, mispredictions,
+//   per successor: block index, count, mispredictions.
+//
+// This header is shared by YAMLProfileWriter and YAMLProfileReader and must
+// stay free of dependencies beyond LLVM Support.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BOLT_PROFILE_COMPACT_PROFILE_FORMAT_H
+#define BOLT_PROFILE_COMPACT_PROFILE_FORMAT_H
+
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+
+namespace llvm {
+namespace bolt {
+
+/// Magic bytes at the start of a compact profile file.
+const char CompactProfileMagic[] = "BOLTCPRF";
+const size_t CompactProfileMagicSize = 8;
+
+/// Current version of the container format. Version 2 added the blended
+/// block hash to the block payload stream.
+const uint32_t CompactProfileVersion = 2;
+
+/// File header. Offsets of the variable-sized parts are relative to the
+/// start of the file; string offsets are relative to the string table.
+struct CompactProfileHeader {
+  char Magic[CompactProfileMagicSize];
+  uint32_t Version;
+  uint32_t Flags;            // BinaryFunction::PF_* profile flags.
+  uint64_t NumFunctions;
+  uint64_t StringTableOffset;
+  uint64_t StringTableSize;
+  uint32_t FileNameOffset;   // Name of the profiled binary.
+  uint32_t IdOffset;         // BuildID.
+  uint32_t OriginOffset;     // How the profile was obtained.
+  uint32_t EventNamesOffset; // Events used for sample profile.
+};
+
+/// Function index entry. The block payload of the function occupies
+/// [DataOffset, DataOffset + CompressedSize) in the file and inflates to
+/// UncompressedSize bytes; equal sizes mean the payload is stored raw.
+struct CompactProfileFunctionRecord {
+  uint32_t NameOffset;
+  uint32_t Id;
+  uint64_t Hash;
+  uint64_t ExecCount;
+  uint32_t NumBasicBlocks;
+  uint32_t NumProfiledBlocks;
+  uint64_t DataOffset;
+  uint32_t CompressedSize;
+  uint32_t UncompressedSize;
+};
+
+inline StringRef getCompactProfileMagic() {
+  return StringRef(CompactProfileMagic, CompactProfileMagicSize);
+}
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
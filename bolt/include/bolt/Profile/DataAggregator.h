@@ -15,6 +15,7 @@
 #define BOLT_PROFILE_DATA_AGGREGATOR_H
 
 #include "bolt/Profile/DataReader.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Support/Program.h"
@@ -26,6 +27,7 @@ namespace bolt {
 class BinaryFunction;
 class BinaryContext;
 class BoltAddressTranslation;
+class PerfDataReader;
 
 /// DataAggregator inherits all parsing logic from DataReader as well as
 /// its data structures used to represent aggregated profile data in memory.
@@ -131,6 +133,37 @@ private:
   /// and use them later for processing and assigning profile.
   std::unordered_map<Trace, BranchInfo, TraceHash> BranchLBRs;
   std::unordered_map<Trace, FTInfo, TraceHash> FallthroughLBRs;
+
+  /// Fallthrough counts keyed by absolute output addresses, coalesced across
+  /// traces by processBranchEventsBAT() so that each unique basic block pair
+  /// is translated and recorded only once.
+  std::unordered_map<Trace, uint64_t, TraceHash> BATFallthroughCounts;
+
+  /// Per-time-slice views of BranchLBRs and FallthroughLBRs, filled when
+  /// -time-slices is active. Slice I covers samples with timestamps in
+  /// [SliceTimeBase + I * SliceTimeWidth, SliceTimeBase + (I + 1) *
+  /// SliceTimeWidth) microseconds; the counts of all slices sum up to the
+  /// combined profile.
+  std::vector<std::unordered_map<Trace, BranchInfo, TraceHash>>
+      SlicedBranchLBRs;
+  std::vector<std::unordered_map<Trace, FTInfo, TraceHash>>
+      SlicedFallthroughLBRs;
+
+  /// Number of time slices to aggregate into, zero when slicing is disabled.
+  unsigned NumTimeSlices{0};
+
+  /// Set when the branch-events perf script was launched with the time
+  /// field. parseBranchSample() must consume the field whenever it is
+  /// present, even if slicing got disabled later.
+  bool BranchSampleHasTime{false};
+
+  /// Start of the collection time window and width of one slice, in
+  /// microseconds of perf sample time.
+  uint64_t SliceTimeBase{0};
+  uint64_t SliceTimeWidth{0};
+
+  /// Slice index of the branch sample being parsed.
+  unsigned CurrentSlice{0};
   std::vector<AggregatedLBREntry> AggregatedLBRs;
   std::unordered_map<uint64_t, uint64_t> BasicSamples;
   std::vector<PerfMemSample> MemSamples;
@@ -143,9 +176,16 @@ private:
   /// Perf utility full path name
   std::string PerfPath;
 
+  /// Native perf.data decoder. Non-null when samples are read directly from
+  /// the file instead of being piped through 'perf script'.
+  std::unique_ptr<PerfDataReader> NativeReader;
+
   /// Perf process spawning bookkeeping
   struct PerfProcessInfo {
     bool IsFinished{false};
+    /// Set when the output is streamed through a FIFO instead of being
+    /// buffered in a temporary file.
+    bool IsPipe{false};
     sys::ProcessInfo PI;
     SmallVector<char, 256> StdoutPath;
     SmallVector<char, 256> StderrPath;
@@ -161,9 +201,16 @@ private:
   /// https://www.kernel.org/doc/Documentation/x86/x86_64/mm.txt
   static constexpr uint64_t KernelBaseAddr = 0xffff800000000000;
 
+  /// Minimum perf script output size for parallel parsing to pay off.
+  static constexpr uint64_t MinBufferSizeForParallelParsing = 16ULL << 20;
+
   /// Current list of created temporary files
   std::vector<std::string> TempFiles;
 
+  /// Additional perf.data inputs to merge into the heat map, e.g. segments
+  /// of a rolling collection or profiles recorded on other hosts.
+  std::vector<std::string> HeatmapSegments;
+
   /// Name of the binary with matching build-id from perf.data if different
   /// from the file name in BC.
   std::string BuildIDBinaryName;
@@ -230,9 +277,21 @@ private:
   void findPerfExecutable();
 
   /// Launch a perf subprocess with given args and save output for later
-  /// parsing.
+  /// parsing. With \p PipeStdout set, the output is redirected to a FIFO so
+  /// that it can be consumed incrementally while the subprocess is running.
   void launchPerfProcess(StringRef Name, PerfProcessInfo &PPI,
-                         const char *ArgsString, bool Wait);
+                         const char *ArgsString, bool Wait,
+                         bool PipeStdout = false);
+
+  /// Wait for the perf subprocess \p Process to finish and set up the parser
+  /// buffer over its output.
+  void prepareToParse(StringRef Name, PerfProcessInfo &Process);
+
+  /// Consume the output of the perf subprocess \p Process through a bounded
+  /// memory window, invoking \p ParseFn whenever a batch of complete lines
+  /// is available in the parser buffer.
+  std::error_code streamPerfOutput(PerfProcessInfo &Process,
+                                   function_ref<std::error_code()> ParseFn);
 
   /// Delete all temporary files created to hold the output generated by spawned
   /// subprocesses during the aggregation job
@@ -240,6 +299,19 @@ private:
 
   // Semantic pass helpers
 
+  /// Flat direct-mapped cache in front of getBinaryFunctionContainingAddress.
+  /// Each LBR stack queries the containing function for a handful of hot
+  /// branch endpoints that repeat across millions of samples, so most lookups
+  /// are served from here instead of the interval search in BinaryContext.
+  /// An entry with a zero address is empty; a conflicting address overwrites
+  /// its slot.
+  struct FunctionLookupEntry {
+    uint64_t Address{0};
+    BinaryFunction *Function{nullptr};
+  };
+  static constexpr size_t FunctionLookupCacheSize = 1 << 16;
+  mutable std::vector<FunctionLookupEntry> FunctionLookupCache;
+
   /// Look up which function contains an address by using out map of
   /// disassembled BinaryFunctions
   BinaryFunction *getBinaryFunctionContainingAddress(uint64_t Address) const;
@@ -316,9 +388,65 @@ private:
   /// Parse and pre-aggregate branch events.
   std::error_code parseBranchEvents();
 
+  /// Determine the time window covered by the buffered branch samples and
+  /// size the per-slice maps. Return false if no sample timestamps could be
+  /// found, in which case slicing must be disabled.
+  bool initTimeSlices();
+
+  /// Run each time slice through the regular trace attribution pipeline and
+  /// write it as a standalone fdata file tagged with the slice index:
+  /// <OutputFilename>-slice<I>.fdata.
+  std::error_code writeTimeSlicedFiles(StringRef OutputFilename);
+
+  /// Branch sample counts gathered while parsing branch events.
+  struct BranchEventStats {
+    uint64_t NumTotalSamples{0};
+    uint64_t NumSamples{0};
+    uint64_t NumSamplesNoLBR{0};
+    uint64_t NumEntries{0};
+    uint64_t NumTraces{0};
+  };
+
+  /// Parse branch events from ParsingBuf into the intermediate maps of this
+  /// aggregator, recording sample counts in \p Stats.
+  std::error_code parseBranchEventsImpl(BranchEventStats &Stats);
+
+  /// Parse branch events on the thread pool. The input buffer is split at
+  /// sample boundaries and each shard is parsed by a private aggregator;
+  /// per-shard maps are merged at the end.
+  std::error_code parseBranchEventsParallel(BranchEventStats &Stats);
+
+  /// Tag for constructing shard aggregators used for parallel sample
+  /// parsing. Shards reuse the parsing logic but never spawn perf.
+  struct ShardTag {};
+  DataAggregator(StringRef Filename, ShardTag) : DataReader(Filename) {}
+
+  /// Aggregate branches and fall-through traces of a single LBR sample into
+  /// BranchLBRs and FallthroughLBRs. Common to the perf script and native
+  /// perf.data paths.
+  void aggregateBranchSample(const PerfBranchSample &Sample,
+                             bool NeedsSkylakeFix, uint64_t &NumTraces);
+
+  /// Report branch sample statistics and mark functions with recorded
+  /// branch activity as having a profile available.
+  void printBranchSamplesDiagnostics(uint64_t NumTotalSamples,
+                                     uint64_t NumSamples,
+                                     uint64_t NumSamplesNoLBR,
+                                     uint64_t NumEntries, uint64_t NumTraces);
+
+  /// Decode perf.data records directly and pre-aggregate branch events,
+  /// bypassing the perf script text pipeline.
+  std::error_code parsePerfData();
+
   /// Process all branch events.
   void processBranchEvents();
 
+  /// Batched counterpart of processBranchEvents() used when aggregating
+  /// against a BOLT-processed binary. Visits the aggregated LBRs grouped by
+  /// address page so consecutive BAT lookups stay local, and coalesces
+  /// fallthroughs repeated across traces before recording them.
+  void processBranchEventsBAT();
+
   /// This member function supports generating data for AutoFDO LLVM tools.
   std::error_code writeAutoFDOData(StringRef OutputFilename);
 
@@ -411,6 +539,14 @@ private:
   /// an external tool.
   std::error_code parsePreAggregatedLBRSamples();
 
+  /// Parse pre-aggregated LBR samples from ParsingBuf into AggregatedLBRs.
+  std::error_code parsePreAggregatedLBRSamplesImpl();
+
+  /// Parse pre-aggregated LBR samples on the thread pool. The input buffer
+  /// is split at record boundaries and each shard is parsed by a private
+  /// aggregator; per-shard records are concatenated at the end.
+  std::error_code parsePreAggregatedLBRSamplesParallel();
+
   /// Process parsed pre-aggregated data.
   void processPreAggregated();
 
@@ -137,6 +137,14 @@ struct FuncBranchData {
   /// from the entry of this function.
   void appendFrom(const FuncBranchData &FBD, uint64_t Offset);
 
+  /// Release the memory held by the branch records. Called once the records
+  /// were absorbed, rebased, by another function's profile via appendFrom()
+  /// and this copy will no longer be read.
+  void clearRecords() {
+    ContainerTy().swap(Data);
+    ContainerTy().swap(EntryData);
+  }
+
   /// Returns the total number of executed branches in this function
   /// by counting the number of executed branches for each BranchInfo
   uint64_t getNumExecutedBranches() const;
@@ -294,6 +302,16 @@ protected:
   /// blocks.
   void matchProfileData(BinaryFunction &BF);
 
+  /// Load the cross-binary profile match cache (-profile-match-cache). The
+  /// cache maps the content hash of a function to the name of the profile
+  /// record that matched it exactly in a previous run on a binary sharing
+  /// the code. Entries recorded against a different profile are discarded.
+  void loadProfileMatchCache();
+
+  /// Record the exact matches made in this run into the profile match cache
+  /// and write it back to disk.
+  void saveProfileMatchCache(BinaryContext &BC);
+
   /// Find the best matching memory data profile for a function before the
   /// creation of basic blocks.
   void matchProfileMemData(BinaryFunction &BF);
@@ -477,11 +495,23 @@ protected:
   }
   ErrorOr<BranchInfo> parseBranchInfo();
   ErrorOr<SampleInfo> parseSampleInfo();
+  /// Load profile from the binary fdata container (see
+  /// bolt/Profile/ProfileBinaryFormat.h). The file is memory-mapped and
+  /// symbol names reference the mapped string table directly.
+  std::error_code parseBinaryFdata();
+
   ErrorOr<MemInfo> parseMemInfo();
   ErrorOr<bool> maybeParseNoLBRFlag();
   ErrorOr<bool> maybeParseBATFlag();
   bool hasBranchData();
   bool hasMemData();
+  /// Return true if the parsing buffer is positioned at a first-touch record:
+  ///
+  /// first_touch <function name> <timestamp>
+  ///
+  /// The timestamp orders functions by their first execution during startup.
+  bool hasFirstTouchData();
+  std::error_code parseFirstTouchEntry();
 
   /// An in-memory copy of the input data file - owns strings used in reader.
   std::unique_ptr<MemoryBuffer> FileBuf;
@@ -502,6 +532,18 @@ protected:
   /// Maps of common LTO names to possible matching profiles.
   StringMap<std::vector<FuncBranchData *>> LTOCommonNameMap;
   StringMap<std::vector<FuncMemData *>> LTOCommonNameMemMap;
+
+  /// First-touch timestamps from the profile, by function name.
+  StringMap<uint64_t> NamesToFirstTouch;
+
+  /// Cross-binary profile match cache: function content hash to the name of
+  /// the exactly-matching profile record (see -profile-match-cache).
+  DenseMap<uint64_t, std::string> ProfileMatchCache;
+  bool ProfileMatchCacheActive{false};
+  uint64_t ProfileMatchCacheHits{0};
+  /// Hash of the profile contents acting as the cache version: entries from
+  /// a run on a different profile are not reused.
+  uint64_t ProfileContentsHash{0};
 };
 
 } // namespace bolt
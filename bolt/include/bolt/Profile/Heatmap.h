@@ -9,9 +9,11 @@
 #ifndef BOLT_PROFILE_HEATMAP_H
 #define BOLT_PROFILE_HEATMAP_H
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/StringRef.h"
 #include <cstdint>
 #include <map>
+#include <system_error>
 
 namespace llvm {
 class raw_ostream;
@@ -65,6 +67,28 @@ public:
 
   void printCDF(raw_ostream &OS) const;
 
+  /// Write the heat map in the compact binary format. In addition to the
+  /// native bucket resolution, the file stores the map re-bucketed at every
+  /// coarser standard resolution (4KB pages and 2MB huge pages), so
+  /// consumers comparing many heat maps can pick the granularity they need
+  /// without access to the original samples.
+  void writeBinary(StringRef FileName) const;
+
+  void writeBinary(raw_ostream &OS) const;
+
+  /// Compute and print the divergence between two binary heat map files at
+  /// every bucket resolution the files have in common. Streams over the
+  /// sorted bucket entries of both files, using memory independent of their
+  /// size.
+  static std::error_code diffBinaryFiles(StringRef FileNameA,
+                                         StringRef FileNameB, raw_ostream &OS);
+
+  /// Merge binary heat map files bucket-by-bucket into \p OutputFileName.
+  /// All inputs must store the same bucket resolutions. Streams over the
+  /// inputs, using memory proportional to their number, not their size.
+  static std::error_code mergeBinaryFiles(ArrayRef<StringRef> InputFileNames,
+                                          StringRef OutputFileName);
+
   size_t size() const { return Map.size(); }
 };
 
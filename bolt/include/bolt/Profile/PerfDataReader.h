@@ -0,0 +1,123 @@
+//===- bolt/Profile/PerfDataReader.h - Native perf.data reader --*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Decoder for the perf.data file format that reads kernel-generated records
+// directly from a memory-mapped file. It serves as a fast replacement for the
+// "perf script" text pipeline used by DataAggregator: no subprocess is
+// spawned and no text is formatted or re-parsed.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BOLT_PROFILE_PERF_DATA_READER_H
+#define BOLT_PROFILE_PERF_DATA_READER_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <functional>
+#include <memory>
+
+namespace llvm {
+namespace bolt {
+
+/// Reads a perf.data file and invokes user callbacks for decoded records.
+///
+/// Only the record types DataAggregator cares about are surfaced: samples
+/// (with optional branch stacks), memory mappings, and forks. All other
+/// records are skipped using the size stored in their headers. The reader
+/// intentionally avoids interpreting perf feature sections beyond the event
+/// attributes needed to lay out sample records.
+class PerfDataReader {
+public:
+  /// A single entry of a PERF_SAMPLE_BRANCH_STACK record.
+  struct BranchStackEntry {
+    uint64_t From;
+    uint64_t To;
+    bool Mispred;
+  };
+
+  /// Decoded PERF_RECORD_SAMPLE.
+  struct SampleRecord {
+    int32_t PID{-1};
+    uint64_t IP{0};
+    uint64_t Time{0};
+    SmallVector<BranchStackEntry, 32> BranchStack;
+  };
+
+  /// Decoded PERF_RECORD_MMAP or PERF_RECORD_MMAP2.
+  struct MMapRecord {
+    int32_t PID{-1};
+    uint64_t Address{0};
+    uint64_t Size{0};
+    uint64_t PageOffset{0};
+    uint64_t Time{0};
+    StringRef Filename;
+  };
+
+  /// Decoded PERF_RECORD_FORK.
+  struct ForkRecord {
+    int32_t ParentPID{-1};
+    int32_t ChildPID{-1};
+    uint64_t Time{0};
+  };
+
+  /// Decoded 'PERF_RECORD_COMM exec' event.
+  struct CommExecRecord {
+    int32_t PID{-1};
+  };
+
+  using SampleCallbackTy = std::function<void(const SampleRecord &)>;
+  using MMapCallbackTy = std::function<void(const MMapRecord &)>;
+  using ForkCallbackTy = std::function<void(const ForkRecord &)>;
+  using CommExecCallbackTy = std::function<void(const CommExecRecord &)>;
+
+  /// Map \p Filename and verify the perf.data header. Returns an error if the
+  /// file cannot be read or uses features this reader does not support (e.g.
+  /// PERF_SAMPLE_READ group samples), in which case the caller should fall
+  /// back to the perf script pipeline.
+  static Expected<std::unique_ptr<PerfDataReader>> create(StringRef Filename);
+
+  /// Decode all records in file order. Records appear in the order perf
+  /// emitted them, i.e. synthesized mmaps first, then time-ordered events.
+  Error parse(SampleCallbackTy SampleCB, MMapCallbackTy MMapCB,
+              ForkCallbackTy ForkCB, CommExecCallbackTy CommExecCB);
+
+private:
+  explicit PerfDataReader(std::unique_ptr<MemoryBuffer> Buffer)
+      : DataBuffer(std::move(Buffer)) {}
+
+  /// Parse the file header and event attributes. Populates SampleType and
+  /// the location of the data section.
+  Error parseHeader();
+
+  /// Decode a single record starting at \p Offset. Returns the size of the
+  /// record or an error if it is malformed.
+  Expected<uint64_t> parseRecord(uint64_t Offset, SampleCallbackTy &SampleCB,
+                                 MMapCallbackTy &MMapCB, ForkCallbackTy &ForkCB,
+                                 CommExecCallbackTy &CommExecCB);
+
+  /// Memory-mapped contents of perf.data.
+  std::unique_ptr<MemoryBuffer> DataBuffer;
+
+  /// Union of perf_event_attr::sample_type over all events in the file.
+  /// Required to compute field offsets inside sample records.
+  uint64_t SampleType{0};
+
+  /// Whether non-sample records carry a trailing sample_id block.
+  bool SampleIDAll{false};
+
+  /// Location of the data section holding the records.
+  uint64_t DataSectionOffset{0};
+  uint64_t DataSectionSize{0};
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -0,0 +1,80 @@
+//===- bolt/Profile/ProfileBinaryFormat.h - Binary fdata format -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// On-disk layout of the binary fdata profile container. The container holds
+// the same aggregated branch data as the legacy text fdata format, but uses
+// fixed-width little-endian records and a string table so readers can
+// memory-map the file and use the records in place instead of tokenizing
+// text on every invocation.
+//
+// Layout (all fields little-endian):
+//
+//   ProfileBinaryHeader
+//   NumBranchEntries x ProfileBinaryBranchRecord
+//   string table: NUL-terminated symbol names
+//
+// This header is shared by DataReader and merge-fdata and must stay free of
+// dependencies beyond LLVM Support.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BOLT_PROFILE_PROFILE_BINARY_FORMAT_H
+#define BOLT_PROFILE_PROFILE_BINARY_FORMAT_H
+
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+
+namespace llvm {
+namespace bolt {
+
+/// Magic bytes at the start of a binary fdata file.
+const char ProfileBinaryMagic[] = "BOLTFDAT";
+const size_t ProfileBinaryMagicSize = 8;
+
+/// Current version of the container format.
+const uint32_t ProfileBinaryVersion = 1;
+
+/// ProfileBinaryHeader::Flags bits.
+enum ProfileBinaryFlags : uint32_t {
+  /// Profile was collected on a binary already processed by BOLT.
+  PBF_BOLTED_COLLECTION = 1U << 0,
+};
+
+/// File header. Offsets are relative to the start of the file.
+struct ProfileBinaryHeader {
+  char Magic[ProfileBinaryMagicSize];
+  uint32_t Version;
+  uint32_t Flags;
+  uint64_t NumBranchEntries;
+  uint64_t StringTableOffset;
+  uint64_t StringTableSize;
+};
+
+/// A single aggregated branch. Name fields are byte offsets of
+/// NUL-terminated strings in the string table; UnknownNameOffset marks a
+/// location outside any known symbol, in which case the offset field holds
+/// an absolute address.
+struct ProfileBinaryBranchRecord {
+  static const uint32_t UnknownNameOffset = ~0U;
+
+  uint32_t FromName;
+  uint32_t ToName;
+  uint64_t FromOffset;
+  uint64_t ToOffset;
+  uint64_t Mispreds;
+  uint64_t Count;
+};
+
+inline StringRef getProfileBinaryMagic() {
+  return StringRef(ProfileBinaryMagic, ProfileBinaryMagicSize);
+}
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -0,0 +1,80 @@
+//===- bolt/Profile/StaleProfileMatching.h - Fuzzy block hashes -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Locality-sensitive hashing of basic blocks, used to match the profile of a
+// function to its CFG after the code has drifted since profile collection.
+// The profile writer stores one blended hash per block; the reader compares
+// the stored hashes against the hashes of the optimized binary's blocks when
+// the function hash check fails.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BOLT_PROFILE_STALE_PROFILE_MATCHING_H
+#define BOLT_PROFILE_STALE_PROFILE_MATCHING_H
+
+#include "llvm/ADT/DenseMap.h"
+#include <cstdint>
+
+namespace llvm {
+namespace bolt {
+
+class BinaryBasicBlock;
+class BinaryFunction;
+
+/// A blended hash of one basic block: four 16-bit features packed into the
+/// 64-bit value stored with the block profile. The features differ in how
+/// much code drift they survive, so the matcher compares them in order of
+/// strictness instead of comparing the packed value directly.
+struct BlendedBlockHash {
+  /// Offset of the block from the function start in the input binary,
+  /// saturated to 16 bits. The loosest feature; only breaks ties between
+  /// otherwise equally good candidates.
+  uint16_t Offset{0};
+
+  /// Hash of the overlapping pairs (shingles) of instruction opcodes in the
+  /// block. An inserted or deleted instruction perturbs only the adjacent
+  /// pairs, and blocks are bucketed by this feature during matching.
+  uint16_t OpcodeHash{0};
+
+  /// Hash of the instructions including their register and immediate
+  /// operands. The strictest feature.
+  uint16_t InstrHash{0};
+
+  /// Hash of the opcode hashes of the block's CFG successors and
+  /// predecessors, capturing the shape of the CFG around the block.
+  uint16_t NeighborHash{0};
+
+  /// Pack the features into the value stored in a profile.
+  uint64_t combine() const {
+    return static_cast<uint64_t>(Offset) << 48 |
+           static_cast<uint64_t>(OpcodeHash) << 32 |
+           static_cast<uint64_t>(InstrHash) << 16 |
+           static_cast<uint64_t>(NeighborHash);
+  }
+
+  /// Unpack a value stored in a profile.
+  static BlendedBlockHash parse(uint64_t Hash) {
+    BlendedBlockHash Blended;
+    Blended.Offset = Hash >> 48;
+    Blended.OpcodeHash = Hash >> 32;
+    Blended.InstrHash = Hash >> 16;
+    Blended.NeighborHash = Hash;
+    return Blended;
+  }
+};
+
+/// Compute the blended hash of every basic block of \p BF. The profile
+/// writer and the stale-profile matcher share this computation, so the
+/// hashes they produce are comparable across builds of the profiled binary.
+DenseMap<const BinaryBasicBlock *, BlendedBlockHash>
+computeBlockHashes(const BinaryFunction &BF);
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -11,6 +11,7 @@
 
 #include "bolt/Profile/ProfileReaderBase.h"
 #include "bolt/Profile/ProfileYAMLMapping.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include <unordered_set>
 
 namespace llvm {
@@ -40,6 +41,9 @@ public:
   /// Check if the file contains YAML.
   static bool isYAML(StringRef Filename);
 
+  /// Check if the file contains a compact binary profile.
+  static bool isCompact(StringRef Filename);
+
 private:
   /// Adjustments for basic samples profiles (without LBR).
   bool NormalizeByInsnCount{false};
@@ -48,6 +52,28 @@ private:
   /// Binary profile in YAML format.
   yaml::bolt::BinaryProfile YamlBP;
 
+  /// Buffer the compact input format is decoded from. Unset for YAML input.
+  std::unique_ptr<MemoryBuffer> CompactBuffer;
+
+  /// Encoded block profile of one function in the compact input format.
+  struct CompactPayload {
+    StringRef Data;
+    uint32_t UncompressedSize{0};
+    uint32_t NumProfiledBlocks{0};
+  };
+
+  /// Block payloads parallel to YamlBP.Functions. Decoded on demand for
+  /// functions with a matched profile only.
+  std::vector<CompactPayload> CompactPayloads;
+
+  /// Populate YamlBP header and function index from the compact container
+  /// in CompactBuffer, leaving block profiles encoded.
+  Error parseCompactProfile();
+
+  /// Decode block profiles of the function at \p Index in YamlBP.Functions.
+  /// A no-op for YAML input and for already-decoded functions.
+  Error decodeFunctionProfile(size_t Index);
+
   /// Map a function ID from a YAML profile to a BinaryFunction object.
   std::vector<BinaryFunction *> YamlProfileToFunction;
 
@@ -70,6 +96,12 @@ private:
   bool parseFunctionProfile(BinaryFunction &Function,
                             const yaml::bolt::BinaryFunctionProfile &YamlBF);
 
+  /// Infer the profile of \p Function from stale \p YamlBF by matching
+  /// profiled blocks to the function's blocks via their blended hashes.
+  /// Defined in StaleProfileMatching.cpp. Returns true on success.
+  bool inferStaleProfile(BinaryFunction &Function,
+                         const yaml::bolt::BinaryFunctionProfile &YamlBF);
+
   /// Initialize maps for profile matching.
   void buildNameMaps(std::map<uint64_t, BinaryFunction> &Functions);
 
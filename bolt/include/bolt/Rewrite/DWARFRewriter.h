@@ -31,9 +31,45 @@ class DWARFRewriter {
 
   std::mutex DebugInfoPatcherMutex;
 
-  /// Stores and serializes information that will be put into the
-  /// .debug_ranges DWARF section.
-  std::unique_ptr<DebugRangesSectionWriter> RangesSectionWriter;
+  /// A patch for .debug_info with a value that is an offset into the output
+  /// .debug_ranges section. The value is relative to the ranges written for
+  /// a single compile unit and is finalized once per-unit ranges buffers are
+  /// concatenated.
+  struct DebugRangesOffsetPatch {
+    /// Offset of the value to patch in .debug_info.
+    uint64_t InfoOffset;
+    /// Offset relative to the unit's ranges buffer.
+    uint64_t RangesOffset;
+    /// Size of the value being replaced.
+    uint32_t OldValueSize;
+    /// True if the value is encoded as ULEB128.
+    bool IsULEB128;
+  };
+
+  /// Ranges created for a single compile unit: the unit's portion of the
+  /// output .debug_ranges section together with the .debug_info patches
+  /// whose values are offsets into that portion. Per-unit portions are
+  /// concatenated in the input unit order in finalizeDebugSections(), where
+  /// the patches are finalized. Writing ranges of concurrently processed
+  /// units into separate buffers makes the contents of .debug_ranges
+  /// independent of the order in which units are processed.
+  struct UnitRangesWriter {
+    /// Serializes the unit's portion of .debug_ranges.
+    DebugRangesSectionWriter Writer;
+    /// Patches to finalize when the portion's section offset is known.
+    std::vector<DebugRangesOffsetPatch> InfoPatches;
+  };
+
+  using RangesWriters =
+      std::unordered_map<uint64_t, std::unique_ptr<UnitRangesWriter>>;
+  /// Use a separate ranges writer for each compilation unit.
+  RangesWriters RangesWritersByCU;
+
+  /// True if the contents of the input .debug_ranges and .debug_loc sections
+  /// are carried over to the output. Set when some units keep their debug
+  /// info unchanged, so that section references from these units remain
+  /// valid.
+  bool KeepInputDebugSections{false};
 
   /// Stores and serializes information that will be put into the
   /// .debug_aranges DWARF section.
@@ -73,6 +109,7 @@ class DWARFRewriter {
                            DebugInfoBinaryPatcher &DebugInfoPatcher,
                            DebugAbbrevWriter &AbbrevWriter,
                            DebugLocWriter &DebugLocWriter,
+                           UnitRangesWriter &RangesWriter,
                            Optional<uint64_t> RangesBase = None);
 
   /// Patches the binary for an object's address ranges to be updated.
@@ -88,6 +125,7 @@ class DWARFRewriter {
                                       uint64_t DebugRangesOffset,
                                       SimpleBinaryPatcher &DebugInfoPatcher,
                                       DebugAbbrevWriter &AbbrevWriter,
+                                      UnitRangesWriter &RangesWriter,
                                       Optional<uint64_t> RangesBase = None);
 
   std::unique_ptr<DebugBufferVector>
@@ -150,11 +188,13 @@ class DWARFRewriter {
   /// function above.
   void convertToRangesPatchDebugInfo(DWARFDie DIE, uint64_t RangesSectionOffset,
                                      SimpleBinaryPatcher &DebugInfoPatcher,
+                                     UnitRangesWriter &RangesWriter,
                                      Optional<uint64_t> RangesBase = None);
 
   /// Same as above, but takes a vector of \p Ranges as a parameter.
   void convertToRanges(DWARFDie DIE, const DebugAddressRangesVector &Ranges,
-                       SimpleBinaryPatcher &DebugInfoPatcher);
+                       SimpleBinaryPatcher &DebugInfoPatcher,
+                       UnitRangesWriter &RangesWriter);
 
   /// Patch DW_AT_(low|high)_pc values for the \p DIE based on \p Range.
   void patchLowHigh(DWARFDie DIE, DebugAddressRange Range,
@@ -164,7 +204,8 @@ class DWARFRewriter {
   void convertPending(const DWARFUnit &Unit,
                       const DWARFAbbreviationDeclaration *Abbrev,
                       SimpleBinaryPatcher &DebugInfoPatcher,
-                      DebugAbbrevWriter &AbbrevWriter);
+                      DebugAbbrevWriter &AbbrevWriter,
+                      UnitRangesWriter &RangesWriter);
 
   /// Adds to Pending Ranges.
   /// For Debug Fission also adding to .debug_addr to take care of a case where
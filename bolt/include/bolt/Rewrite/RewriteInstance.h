@@ -50,6 +50,15 @@ public:
   /// Run all the necessary steps to read, optimize and rewrite the binary.
   void run();
 
+  /// Print the predicted hot function set for the profile set via
+  /// setProfile() to \p OS without rewriting the binary. Only function
+  /// discovery, profile pre-processing, and function selection are
+  /// performed, making a query considerably cheaper than run(). Like
+  /// run(), may be invoked at most once per instance. The selection obeys
+  /// the same options as the rewriting pipeline (-lite, -lite-threshold-*,
+  /// -lite-coverage-pct, -funcs, -skip-funcs).
+  void predictHotFunctions(raw_ostream &OS);
+
   /// Diff this instance against another one. Non-const since we may run passes
   /// to fold identical functions.
   void compare(RewriteInstance &RI2);
@@ -86,6 +95,30 @@ private:
   /// from meta data in the file.
   void discoverFileObjects();
 
+  /// Analyze the input symbol table: create functions, register names and
+  /// data objects. Populates \p MarkerSymbols with AArch64 mapping symbols
+  /// to be processed once function boundaries are known, and
+  /// \p SecondaryEntryPoints with pairs of function and entry address for
+  /// the entry points found during the analysis.
+  void discoverSymbolTableObjects(
+      std::vector<std::pair<uint64_t, object::SymbolRef>> &MarkerSymbols,
+      std::vector<std::pair<uint64_t, uint64_t>> &SecondaryEntryPoints,
+      bool &SeenFileName);
+
+  /// Save the result of the symbol table analysis to \p FileName so that
+  /// other tools processing the same input binary can replay it instead of
+  /// re-running the analysis.
+  void writeDiscoverySnapshot(
+      StringRef FileName,
+      ArrayRef<std::pair<uint64_t, uint64_t>> SecondaryEntryPoints,
+      bool SeenFileName);
+
+  /// Replay a symbol table analysis saved by writeDiscoverySnapshot().
+  /// Returns true on success. On any mismatch with the input binary the
+  /// partially replayed state is discarded and false is returned so that
+  /// the caller falls back to the full analysis.
+  bool loadDiscoverySnapshot(StringRef FileName, bool &SeenFileName);
+
   /// Read info from special sections. E.g. eh_frame and .gcc_except_table
   /// for exception and stack unwinding information.
   void readSpecialSections();
@@ -152,9 +185,26 @@ private:
 
   void postProcessFunctions();
 
+  /// Check the process memory usage against the -max-memory budget at the
+  /// phase boundary named \p Phase and, if the budget is exceeded, degrade
+  /// processing instead of risking an OOM kill: drop the CFGs of functions
+  /// without profile, fall back to single-threaded processing, and - while
+  /// function selection has not happened yet (\p BeforeFunctionSelection) -
+  /// switch to lite mode.
+  void enforceMemoryLimit(StringRef Phase,
+                          bool BeforeFunctionSelection = false);
+
+  /// Set once enforceMemoryLimit() has released the CFGs of functions
+  /// without profile.
+  bool DroppedColdCFGs{false};
+
   /// Run optimizations that operate at the binary, or post-linker, level.
   void runOptimizationPasses();
 
+  /// Report the estimated layout produced by the optimization passes without
+  /// emitting or rewriting the binary (-dry-run).
+  void printDryRunReport();
+
   /// Write code and data into an intermediary object file, map virtual to real
   /// addresses and link the object file, resolving all relocations and
   /// performing final relaxation.
@@ -197,6 +247,19 @@ private:
   /// disassembleFunctions(), also preserve the original version.
   void rewriteFile();
 
+  /// Copy \p Size bytes of the input file starting at \p InputOffset to the
+  /// current position of the output stream without staging the data in user
+  /// space, and advance the stream past the copied range. Return false if the
+  /// copy cannot be performed, in which case the caller is expected to write
+  /// the range through the output stream.
+  bool copyInputRangeToOutput(uint64_t InputOffset, uint64_t Size);
+
+  /// Write \p Size bytes of \p Data to the output file at \p FileOffset.
+  /// With -sparse-output, long all-zero regions are deallocated with
+  /// fallocate(2) instead of being written, turning section padding into
+  /// holes in the output file.
+  void writeOutputData(const char *Data, uint64_t Size, uint64_t FileOffset);
+
   /// Return address of a function in the new binary corresponding to
   /// \p OldAddress address in the original binary.
   uint64_t getNewFunctionAddress(uint64_t OldAddress);
@@ -228,9 +291,20 @@ private:
   /// Rewrite non-allocatable sections with modifications.
   void rewriteNoteSections();
 
+  /// Replace the contents of the output debug sections with their
+  /// SHF_COMPRESSED form. The sections are compressed concurrently on the
+  /// thread pool. Called from rewriteNoteSections() before the
+  /// non-allocatable sections are laid out, so the file offsets are
+  /// assigned from the compressed sizes.
+  void compressDebugSections(const object::ELFFile<object::ELF64LE> &Obj);
+
   /// Write .eh_frame_hdr.
   void writeEHFrameHeader();
 
+  /// Write contents of the cold code section compressed, leaving a header
+  /// for the runtime library to restore the original bytes on startup.
+  void writeCompressedColdSection(BinarySection &Section);
+
   /// Disassemble and create function entries for PLT.
   void disassemblePLT();
 
@@ -309,8 +383,9 @@ private:
   /// purpose of generating BOLT profile data for the input binary.
   void addBATSection();
 
-  /// Loop over now emitted functions to write translation maps
-  void encodeBATSection();
+  /// Register the encoded translation maps \p DescStr as the BAT section
+  /// contents.
+  void encodeBATSection(StringRef DescStr);
 
   /// Update the ELF note section containing the binary build-id to reflect
   /// a new build-id, so tools can differentiate between the old and the
@@ -409,9 +484,18 @@ private:
   /// optimized code for selected functions.
   std::unique_ptr<ToolOutputFile> Out;
 
+  /// File descriptors for the input binary and the output file used to copy
+  /// unchanged data between the two in the kernel with -zero-copy-output.
+  int InputFD{-1};
+  int OutputFD{-1};
+
   /// Offset in the input file where non-allocatable sections start.
   uint64_t FirstNonAllocatableOffset{0};
 
+  /// True if the input binary carries debug info sections. Determined during
+  /// the section scan in discoverStorage().
+  bool InputHasDebugInfo{false};
+
   /// Information about program header table.
   uint64_t PHDRTableAddress{0};
   uint64_t PHDRTableOffset{0};
@@ -0,0 +1,61 @@
+//===- bolt/RuntimeLibs/ColdCompressRuntimeLibrary.h - Cold Code -*- C++ -*===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file contains the declaration of the ColdCompressRuntimeLibrary class.
+// The library stores the cold code section compressed in the output binary
+// and restores it before the binary starts executing.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BOLT_RUNTIMELIBS_COLD_COMPRESS_RUNTIME_LIBRARY_H
+#define BOLT_RUNTIMELIBS_COLD_COMPRESS_RUNTIME_LIBRARY_H
+
+#include "bolt/RuntimeLibs/RuntimeLibrary.h"
+#include "llvm/ADT/SmallVector.h"
+
+namespace llvm {
+namespace bolt {
+
+class ColdCompressRuntimeLibrary : public RuntimeLibrary {
+public:
+  /// Magic value that starts the header of a compressed cold code section.
+  /// Reads "BOLTCC01" in the file. Must be kept in sync with the runtime
+  /// decompressor in bolt/runtime/coldcompress.cpp.
+  static constexpr uint64_t Magic = 0x31304343544c4f42ULL;
+
+  /// Size of the section header: magic, compressed size, uncompressed size.
+  static constexpr uint64_t HeaderSize = 3 * sizeof(uint64_t);
+
+  /// Add custom section names generated by the runtime libraries to \p
+  /// SecNames.
+  void addRuntimeLibSections(std::vector<std::string> &SecNames) const final {
+    SecNames.push_back(".bolt.coldcompress");
+  }
+
+  void adjustCommandLineOptions(const BinaryContext &BC) const final;
+
+  void emitBinary(BinaryContext &BC, MCStreamer &Streamer) final;
+
+  void link(BinaryContext &BC, StringRef ToolPath, RuntimeDyld &RTDyld,
+            std::function<void(RuntimeDyld &)> OnLoad) final;
+
+  std::string getLibraryPath(StringRef ToolPath) const final;
+
+  void linkFromCachedImage(BinaryContext &BC, StringRef ToolPath,
+                           function_ref<uint64_t(StringRef)> GetAddress) final;
+
+  /// Compress \p Data into \p Out using the byte-oriented LZ scheme the
+  /// runtime library knows how to decode. The output does not include the
+  /// section header.
+  static void compress(StringRef Data, SmallVectorImpl<char> &Out);
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -32,6 +32,11 @@ public:
 
   void link(BinaryContext &BC, StringRef ToolPath, RuntimeDyld &RTDyld,
             std::function<void(RuntimeDyld &)> OnLoad) final;
+
+  std::string getLibraryPath(StringRef ToolPath) const final;
+
+  void linkFromCachedImage(BinaryContext &BC, StringRef ToolPath,
+                           function_ref<uint64_t(StringRef)> GetAddress) final;
 };
 
 } // namespace bolt
@@ -37,7 +37,17 @@ public:
   void link(BinaryContext &BC, StringRef ToolPath, RuntimeDyld &RTDyld,
             std::function<void(RuntimeDyld &)> OnLoad) final;
 
+  std::string getLibraryPath(StringRef ToolPath) const final;
+
+  void linkFromCachedImage(BinaryContext &BC, StringRef ToolPath,
+                           function_ref<uint64_t(StringRef)> GetAddress) final;
+
 private:
+  /// Post-link work shared by link() and linkFromCachedImage(): record the
+  /// runtime entry points and emit the data tables the runtime reads.
+  void completeLink(BinaryContext &BC, StringRef LibPath,
+                    function_ref<uint64_t(StringRef)> GetAddress);
+
   std::string buildTables(BinaryContext &BC);
 
   /// Create a non-allocatable ELF section with read-only tables necessary for
@@ -0,0 +1,92 @@
+//===- bolt/RuntimeLibs/RuntimeImageCache.h - Runtime image cache -*-C++-*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// An on-disk cache of resolved runtime library images. Linking a runtime
+// library resolves its relocations against concrete addresses: the load
+// addresses of its own sections and the global symbols of the binary it is
+// linked into. The resulting bytes are therefore reusable whenever all of
+// those addresses come out the same, which is the common case for repeated
+// instrumentation runs over the same input binary. The cache stores the
+// finalized section bytes together with everything needed to prove a later
+// run resolves identically, letting it skip the RuntimeDyld work.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BOLT_RUNTIMELIBS_RUNTIME_IMAGE_CACHE_H
+#define BOLT_RUNTIMELIBS_RUNTIME_IMAGE_CACHE_H
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+namespace bolt {
+
+class RuntimeImageCache {
+public:
+  /// One finalized section of a resolved image.
+  struct Section {
+    std::string Name;
+    /// Address the section bytes were resolved for.
+    uint64_t Address{0};
+    uint64_t Size{0};
+    uint32_t Alignment{1};
+    bool IsCode{false};
+    bool IsReadOnly{false};
+    /// Section bytes with all relocations applied.
+    std::string Contents;
+  };
+
+  /// A resolved runtime library image.
+  struct Image {
+    /// Addresses the symbols external to the link resolved to. The image is
+    /// only reusable when every one of them resolves to the same address
+    /// again.
+    std::vector<std::pair<std::string, uint64_t>> ExternalSymbols;
+
+    /// Global symbols available after the link, including the entry points
+    /// the runtime library needs to look up.
+    std::vector<std::pair<std::string, uint64_t>> Symbols;
+
+    /// Image sections ordered by address.
+    std::vector<Section> Sections;
+  };
+
+  explicit RuntimeImageCache(StringRef Directory) : Directory(Directory) {}
+
+  /// Cache key of one resolved image: a hash of the library file contents,
+  /// the target triple, the address the image will be loaded at, and the
+  /// global symbol table of the binary the image is linked into. Everything
+  /// the resolved bytes can depend on is either part of the key or recorded
+  /// in the image for validation at lookup time.
+  static std::string
+  computeKey(StringRef LibraryContents, StringRef Triple, uint64_t LoadAddress,
+             const std::map<StringRef, JITEvaluatedSymbol> &SymbolTable);
+
+  /// Read the image stored under \p Key. Returns None when no entry exists
+  /// or the entry cannot be parsed.
+  Optional<Image> lookup(StringRef Key) const;
+
+  /// Store \p Image under \p Key. The entry is written atomically so that
+  /// concurrent jobs sharing the cache directory never observe a partial
+  /// image. Failures are reported as warnings: the cache is an optimization,
+  /// not a correctness requirement.
+  void store(StringRef Key, const Image &Image) const;
+
+private:
+  std::string Directory;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
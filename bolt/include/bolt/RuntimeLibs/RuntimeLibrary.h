@@ -15,6 +15,7 @@
 #ifndef BOLT_RUNTIMELIBS_RUNTIME_LIBRARY_H
 #define BOLT_RUNTIMELIBS_RUNTIME_LIBRARY_H
 
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/StringRef.h"
 #include <functional>
 #include <vector>
@@ -54,6 +55,17 @@ public:
   virtual void link(BinaryContext &BC, StringRef ToolPath, RuntimeDyld &RTDyld,
                     std::function<void(RuntimeDyld &)> OnLoad) = 0;
 
+  /// Full path of the library file that link() will load.
+  virtual std::string getLibraryPath(StringRef ToolPath) const = 0;
+
+  /// Finish linking against a resolved image of the library restored from
+  /// the runtime image cache instead of being linked by RTDyld. The image
+  /// sections are already registered with \p BC; \p GetAddress returns the
+  /// address of a global symbol of the image, or zero if unknown.
+  virtual void
+  linkFromCachedImage(BinaryContext &BC, StringRef ToolPath,
+                      function_ref<uint64_t(StringRef)> GetAddress) = 0;
+
 protected:
   /// The fini and init address set by the runtime library.
   uint64_t RuntimeFiniAddress{0};
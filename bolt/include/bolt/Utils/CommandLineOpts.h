@@ -33,17 +33,22 @@ extern llvm::cl::SubCommand HeatmapCommand;
 extern llvm::cl::opt<unsigned> AlignText;
 extern llvm::cl::opt<bool> AggregateOnly;
 extern llvm::cl::opt<unsigned> BucketsPerLine;
+extern llvm::cl::opt<bool> ColdCompress;
 extern llvm::cl::opt<bool> DiffOnly;
 extern llvm::cl::opt<bool> EnableBAT;
 extern llvm::cl::opt<bool> RemoveSymtab;
 extern llvm::cl::opt<unsigned> ExecutionCountThreshold;
+extern llvm::cl::opt<bool> HeatmapBinary;
 extern llvm::cl::opt<unsigned> HeatmapBlock;
+extern llvm::cl::opt<std::string> HeatmapDiff;
 extern llvm::cl::opt<std::string> HeatmapFile;
 extern llvm::cl::opt<unsigned long long> HeatmapMaxAddress;
+extern llvm::cl::opt<std::string> HeatmapMerge;
 extern llvm::cl::opt<unsigned long long> HeatmapMinAddress;
 extern llvm::cl::opt<bool> HotData;
 extern llvm::cl::opt<bool> HotFunctionsAtEnd;
 extern llvm::cl::opt<bool> HotText;
+extern llvm::cl::opt<bool> HugifyData;
 extern llvm::cl::opt<std::string> InputFilename;
 extern llvm::cl::opt<bool> Instrument;
 extern llvm::cl::opt<std::string> OutputFilename;
@@ -51,11 +56,22 @@ extern llvm::cl::opt<std::string> PerfData;
 extern llvm::cl::opt<bool> PrintCacheMetrics;
 extern llvm::cl::opt<bool> PrintSections;
 extern llvm::cl::opt<bool> SplitEH;
+extern llvm::cl::opt<bool> SplitRegions;
 extern llvm::cl::opt<bool> StrictMode;
 extern llvm::cl::opt<bool> TimeOpts;
 extern llvm::cl::opt<bool> UseOldText;
 extern llvm::cl::opt<bool> UpdateDebugSections;
 
+/// How much internal consistency checking to perform during processing.
+enum ValidationLevel : char {
+  VL_OFF = 0,  /// Skip optional validation.
+  VL_FAST = 1, /// Cheap checks everywhere; expensive checks only on functions
+               /// modified by the current run.
+  VL_FULL = 2  /// Run all checks on all functions.
+};
+
+extern llvm::cl::opt<ValidationLevel> Validate;
+
 // The default verbosity level (0) is pretty terse, level 1 is fairly
 // verbose and usually prints some informational message for every
 // function processed.  Level 2 is for the noisiest of messages and
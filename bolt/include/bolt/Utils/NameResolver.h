@@ -34,6 +34,19 @@ public:
     return (Name + Twine(Sep) + Twine(ID)).str();
   }
 
+  /// Adjust the counters for an externally supplied \p Name that is already
+  /// in the uniquified form, so that future calls to uniquify() do not
+  /// produce clashing names. Names without a numeric suffix are ignored.
+  void reserve(StringRef Name) {
+    StringRef Prefix, IDStr;
+    std::tie(Prefix, IDStr) = Name.rsplit(Sep);
+    uint64_t ID;
+    if (!IDStr.getAsInteger(10, ID)) {
+      uint64_t &Counter = Counters[Prefix];
+      Counter = std::max(Counter, ID);
+    }
+  }
+
   /// For uniquified \p Name, return the original form (that may no longer be
   /// unique).
   static StringRef restore(StringRef Name) {
@@ -0,0 +1,69 @@
+//===- bolt/Aggregate/LBRAggregator.cpp -----------------------------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the LBRAggregator class.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bolt/Aggregate/LBRAggregator.h"
+#include "llvm/ADT/Twine.h"
+#include <algorithm>
+#include <vector>
+
+namespace llvm {
+namespace bolt {
+
+void LBRAggregator::addSample(ArrayRef<LBREntry> LBR) {
+  // LBR entries are stored in reverse execution order. NextPC refers to the
+  // next recorded executed PC, known from the more recent entry: the code
+  // fell through from the older entry's branch target up to the point where
+  // the more recent branch was taken.
+  uint64_t NextPC = 0;
+  for (const LBREntry &Entry : LBR) {
+    if (NextPC)
+      addFallthrough(Entry.To, NextPC);
+    NextPC = Entry.From;
+
+    addBranch(Entry.From, Entry.To, Entry.Mispred);
+    ++NumEntries;
+  }
+}
+
+void LBRAggregator::merge(const LBRAggregator &Other) {
+  for (const auto &KV : Other.Branches) {
+    BranchInfo &Info = Branches[KV.first];
+    Info.TakenCount += KV.second.TakenCount;
+    Info.MispredCount += KV.second.MispredCount;
+  }
+  for (const auto &KV : Other.Fallthroughs)
+    Fallthroughs[KV.first] += KV.second;
+  NumEntries += Other.NumEntries;
+}
+
+void LBRAggregator::write(raw_ostream &OS) const {
+  std::vector<std::pair<std::pair<uint64_t, uint64_t>, uint64_t>> FTRecords(
+      Fallthroughs.begin(), Fallthroughs.end());
+  std::sort(FTRecords.begin(), FTRecords.end());
+  for (const auto &Record : FTRecords)
+    OS << "F " << Twine::utohexstr(Record.first.first) << ' '
+       << Twine::utohexstr(Record.first.second) << ' ' << Record.second
+       << '\n';
+
+  std::vector<std::pair<std::pair<uint64_t, uint64_t>, BranchInfo>> BRecords(
+      Branches.begin(), Branches.end());
+  std::sort(BRecords.begin(), BRecords.end(),
+            [](const auto &A, const auto &B) { return A.first < B.first; });
+  for (const auto &Record : BRecords)
+    OS << "B " << Twine::utohexstr(Record.first.first) << ' '
+       << Twine::utohexstr(Record.first.second) << ' '
+       << Record.second.TakenCount << ' ' << Record.second.MispredCount
+       << '\n';
+}
+
+} // namespace bolt
+} // namespace llvm
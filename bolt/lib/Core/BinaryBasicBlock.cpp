@@ -25,6 +25,11 @@ namespace bolt {
 
 constexpr uint32_t BinaryBasicBlock::INVALID_OFFSET;
 
+void *allocateEdgeListStorage(BinaryFunction &BF, size_t Bytes,
+                              size_t Alignment) {
+  return BF.allocateEdgeListStorage(Bytes, Alignment);
+}
+
 bool operator<(const BinaryBasicBlock &LHS, const BinaryBasicBlock &RHS) {
   return LHS.Index < RHS.Index;
 }
@@ -260,16 +265,15 @@ int32_t BinaryBasicBlock::getCFIStateAtInstr(const MCInst *Instr) const {
 
 void BinaryBasicBlock::addSuccessor(BinaryBasicBlock *Succ, uint64_t Count,
                                     uint64_t MispredictedCount) {
-  Successors.push_back(Succ);
-  BranchInfo.push_back({Count, MispredictedCount});
-  Succ->Predecessors.push_back(this);
+  Successors.push_back(*Function, Succ);
+  BranchInfo.push_back(*Function, {Count, MispredictedCount});
+  Succ->addPredecessor(this, Successors.size() - 1);
 }
 
 void BinaryBasicBlock::replaceSuccessor(BinaryBasicBlock *Succ,
                                         BinaryBasicBlock *NewSucc,
                                         uint64_t Count,
                                         uint64_t MispredictedCount) {
-  Succ->removePredecessor(this, /*Multiple=*/false);
   auto I = succ_begin();
   auto BI = BranchInfo.begin();
   for (; I != succ_end(); ++I) {
@@ -280,9 +284,11 @@ void BinaryBasicBlock::replaceSuccessor(BinaryBasicBlock *Succ,
   }
   assert(I != succ_end() && "no such successor!");
 
+  const uint32_t EdgeIndex = I - succ_begin();
+  Succ->removePredecessorEdge(this, EdgeIndex);
   *I = NewSucc;
   *BI = BinaryBranchInfo{Count, MispredictedCount};
-  NewSucc->addPredecessor(this);
+  NewSucc->addPredecessor(this, EdgeIndex);
 }
 
 void BinaryBasicBlock::removeAllSuccessors() {
@@ -294,7 +300,6 @@ void BinaryBasicBlock::removeAllSuccessors() {
 }
 
 void BinaryBasicBlock::removeSuccessor(BinaryBasicBlock *Succ) {
-  Succ->removePredecessor(this, /*Multiple=*/false);
   auto I = succ_begin();
   auto BI = BranchInfo.begin();
   for (; I != succ_end(); ++I) {
@@ -305,31 +310,70 @@ void BinaryBasicBlock::removeSuccessor(BinaryBasicBlock *Succ) {
   }
   assert(I != succ_end() && "no such successor!");
 
+  const uint32_t EdgeIndex = I - succ_begin();
+  Succ->removePredecessorEdge(this, EdgeIndex);
   Successors.erase(I);
   BranchInfo.erase(BI);
+
+  // Erasing the slot shifted all higher slots down by one. Renumber the
+  // edge ids recorded on the predecessor side of the affected successors.
+  SmallPtrSet<BinaryBasicBlock *, 2> Renumbered;
+  for (auto SI = succ_begin() + EdgeIndex; SI != succ_end(); ++SI) {
+    BinaryBasicBlock *SuccessorBB = *SI;
+    if (!Renumbered.insert(SuccessorBB).second)
+      continue;
+    for (size_t J = 0, E = SuccessorBB->Predecessors.size(); J != E; ++J)
+      if (SuccessorBB->Predecessors[J] == this &&
+          SuccessorBB->PredEdgeIndices[J] > EdgeIndex)
+        --SuccessorBB->PredEdgeIndices[J];
+  }
 }
 
-void BinaryBasicBlock::addPredecessor(BinaryBasicBlock *Pred) {
-  Predecessors.push_back(Pred);
+void BinaryBasicBlock::addPredecessor(BinaryBasicBlock *Pred,
+                                      uint32_t EdgeIndex) {
+  Predecessors.push_back(*Function, Pred);
+  PredEdgeIndices.push_back(*Function, EdgeIndex);
 }
 
-void BinaryBasicBlock::removePredecessor(BinaryBasicBlock *Pred,
-                                         bool Multiple) {
+void BinaryBasicBlock::removePredecessor(BinaryBasicBlock *Pred) {
   // Note: the predecessor could be listed multiple times.
   bool Erased = false;
-  for (auto PredI = Predecessors.begin(); PredI != Predecessors.end();) {
-    if (*PredI == Pred) {
+  for (size_t I = 0; I < Predecessors.size();) {
+    if (Predecessors[I] == Pred) {
       Erased = true;
-      PredI = Predecessors.erase(PredI);
-      if (!Multiple)
-        return;
+      Predecessors.erase(Predecessors.begin() + I);
+      PredEdgeIndices.erase(PredEdgeIndices.begin() + I);
     } else {
-      ++PredI;
+      ++I;
     }
   }
   assert(Erased && "Pred is not a predecessor of this block!");
 }
 
+void BinaryBasicBlock::removePredecessorEdge(BinaryBasicBlock *Pred,
+                                             uint32_t EdgeIndex) {
+  for (size_t I = 0, E = Predecessors.size(); I != E; ++I) {
+    if (Predecessors[I] == Pred && PredEdgeIndices[I] == EdgeIndex) {
+      Predecessors.erase(Predecessors.begin() + I);
+      PredEdgeIndices.erase(PredEdgeIndices.begin() + I);
+      return;
+    }
+  }
+  llvm_unreachable("no predecessor entry for the edge");
+}
+
+void BinaryBasicBlock::updatePredEdgeIndex(BinaryBasicBlock *Pred,
+                                           uint32_t OldIndex,
+                                           uint32_t NewIndex) {
+  for (size_t I = 0, E = Predecessors.size(); I != E; ++I) {
+    if (Predecessors[I] == Pred && PredEdgeIndices[I] == OldIndex) {
+      PredEdgeIndices[I] = NewIndex;
+      return;
+    }
+  }
+  llvm_unreachable("no predecessor entry for the edge");
+}
+
 void BinaryBasicBlock::removeDuplicateConditionalSuccessor(MCInst *CondBranch) {
   assert(succ_size() == 2 && Successors[0] == Successors[1] &&
          "conditional successors expected");
@@ -343,12 +387,18 @@ void BinaryBasicBlock::removeDuplicateConditionalSuccessor(MCInst *CondBranch) {
   Successors.clear();
   BranchInfo.clear();
 
-  Successors.push_back(Succ);
+  Successors.push_back(*Function, Succ);
 
   uint64_t Count = COUNT_NO_PROFILE;
   if (CondBI.Count != COUNT_NO_PROFILE && UncondBI.Count != COUNT_NO_PROFILE)
     Count = CondBI.Count + UncondBI.Count;
-  BranchInfo.push_back({Count, 0});
+  BranchInfo.push_back(*Function, {Count, 0});
+
+  // Both predecessor entries for this block remain in Succ. Point them at
+  // the single remaining edge.
+  for (size_t I = 0, E = Succ->Predecessors.size(); I != E; ++I)
+    if (Succ->Predecessors[I] == this)
+      Succ->PredEdgeIndices[I] = 0;
 }
 
 void BinaryBasicBlock::adjustExecutionCount(double Ratio) {
@@ -451,6 +501,12 @@ bool BinaryBasicBlock::swapConditionalSuccessors() {
   if (succ_size() != 2)
     return false;
 
+  // Swap the edge ids recorded on the predecessor side. When both edges
+  // lead to the same block, the set of ids does not change.
+  if (Successors[0] != Successors[1]) {
+    Successors[0]->updatePredEdgeIndex(this, 0, 1);
+    Successors[1]->updatePredEdgeIndex(this, 1, 0);
+  }
   std::swap(Successors[0], Successors[1]);
   std::swap(BranchInfo[0], BranchInfo[1]);
   return true;
@@ -550,6 +606,22 @@ uint64_t BinaryBasicBlock::estimateSize(const MCCodeEmitter *Emitter) const {
 
 BinaryBasicBlock::BinaryBranchInfo &
 BinaryBasicBlock::getBranchInfo(const BinaryBasicBlock &Succ) {
+  // Scan whichever side of the edge has fewer entries. The predecessor side
+  // records the id of each incoming edge, so the lookup does not depend on
+  // this block's out-degree - important when the block is a high-out-degree
+  // jump-table dispatcher and the lookup runs inside a loop over its
+  // successors or their predecessors.
+  if (succ_size() > Succ.pred_size()) {
+    for (size_t I = 0, E = Succ.Predecessors.size(); I != E; ++I) {
+      if (Succ.Predecessors[I] == this) {
+        const uint32_t EdgeIndex = Succ.PredEdgeIndices[I];
+        assert(Successors[EdgeIndex] == &Succ && "stale predecessor edge id");
+        return BranchInfo[EdgeIndex];
+      }
+    }
+    llvm_unreachable("Invalid successor");
+  }
+
   auto BI = branch_info_begin();
   for (BinaryBasicBlock *BB : successors()) {
     if (&Succ == BB)
@@ -13,6 +13,7 @@
 #include "bolt/Core/BinaryContext.h"
 #include "bolt/Core/BinaryEmitter.h"
 #include "bolt/Core/BinaryFunction.h"
+#include "bolt/Core/ParallelUtilities.h"
 #include "bolt/Utils/CommandLineOpts.h"
 #include "bolt/Utils/NameResolver.h"
 #include "bolt/Utils/Utils.h"
@@ -30,7 +31,10 @@
 #include "llvm/MC/MCStreamer.h"
 #include "llvm/MC/MCSymbol.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/Regex.h"
+#include "llvm/Support/ThreadPool.h"
 #include <algorithm>
 #include <functional>
 #include <iterator>
@@ -76,6 +80,117 @@ PrintMemData("print-mem-data",
 namespace llvm {
 namespace bolt {
 
+/// Reusable machinery for sizing a function by emitting its code. Creating an
+/// MC context, assembler back-end and object streamer for every sizing
+/// request is costly, so each FunctionSizer builds the stack once and resets
+/// it between functions. Instances are not thread-safe; BinaryContext keeps
+/// them in a pool and hands each one out to a single thread at a time.
+class FunctionSizer {
+  const BinaryContext &BC;
+  std::unique_ptr<MCObjectFileInfo> LocalMOFI;
+  std::unique_ptr<MCContext> LocalCtx;
+  SmallString<256> Code;
+  raw_svector_ostream VecOS{Code};
+  std::unique_ptr<MCStreamer> Streamer;
+  bool NeedsReset{false};
+
+  /// Drop all state accumulated while sizing the previous function.
+  void reset() {
+    Streamer->reset();
+    LocalCtx->reset();
+    // Section pointers cached by MOFI were freed by the context reset.
+    LocalMOFI->initMCObjectFileInfo(*LocalCtx, /*PIC=*/!BC.HasFixedLoadAddress);
+  }
+
+public:
+  FunctionSizer(const BinaryContext &BC) : BC(BC) {
+    LocalCtx.reset(
+        new MCContext(*BC.TheTriple, BC.AsmInfo.get(), BC.MRI.get(),
+                      BC.STI.get()));
+    LocalMOFI.reset(BC.TheTarget->createMCObjectFileInfo(
+        *LocalCtx, /*PIC=*/!BC.HasFixedLoadAddress));
+    LocalCtx->setObjectFileInfo(LocalMOFI.get());
+    MCCodeEmitter *MCE =
+        BC.TheTarget->createMCCodeEmitter(*BC.MII, *BC.MRI, *LocalCtx);
+    MCAsmBackend *MAB =
+        BC.TheTarget->createMCAsmBackend(*BC.STI, *BC.MRI, MCTargetOptions());
+    Streamer.reset(BC.TheTarget->createMCObjectStreamer(
+        *BC.TheTriple, *LocalCtx, std::unique_ptr<MCAsmBackend>(MAB),
+        MAB->createObjectWriter(VecOS), std::unique_ptr<MCCodeEmitter>(MCE),
+        *BC.STI,
+        /*RelaxAll=*/false,
+        /*IncrementalLinkerCompatible=*/false,
+        /*DWARFMustBeAtTheEnd=*/false));
+  }
+
+  /// Emit code of \p BF and return the sizes of the hot and the cold parts.
+  std::pair<size_t, size_t> calculateSize(BinaryFunction &BF) {
+    if (NeedsReset)
+      reset();
+    NeedsReset = true;
+
+    Streamer->initSections(false, *BC.STI);
+
+    MCSection *Section = LocalMOFI->getTextSection();
+    Section->setHasInstructions(true);
+
+    // Create symbols in the LocalCtx so that they get destroyed with it.
+    MCSymbol *StartLabel = LocalCtx->createTempSymbol();
+    MCSymbol *EndLabel = LocalCtx->createTempSymbol();
+    MCSymbol *ColdStartLabel = LocalCtx->createTempSymbol();
+    MCSymbol *ColdEndLabel = LocalCtx->createTempSymbol();
+
+    Streamer->SwitchSection(Section);
+    Streamer->emitLabel(StartLabel);
+    emitFunctionBody(*Streamer, BF, /*EmitColdPart=*/false,
+                     /*EmitCodeOnly=*/true);
+    Streamer->emitLabel(EndLabel);
+
+    if (BF.isSplit()) {
+      MCSectionELF *ColdSection = LocalCtx->getELFSection(
+          BF.getColdCodeSectionName(), ELF::SHT_PROGBITS,
+          ELF::SHF_EXECINSTR | ELF::SHF_ALLOC);
+      ColdSection->setHasInstructions(true);
+
+      Streamer->SwitchSection(ColdSection);
+      Streamer->emitLabel(ColdStartLabel);
+      emitFunctionBody(*Streamer, BF, /*EmitColdPart=*/true,
+                       /*EmitCodeOnly=*/true);
+      Streamer->emitLabel(ColdEndLabel);
+      // To avoid calling MCObjectStreamer::flushPendingLabels() which is
+      // private
+      Streamer->emitBytes(StringRef(""));
+      Streamer->SwitchSection(Section);
+    }
+
+    // To avoid calling MCObjectStreamer::flushPendingLabels() which is private
+    // or MCStreamer::Finish(), which does more than we want
+    Streamer->emitBytes(StringRef(""));
+
+    MCAssembler &Assembler =
+        static_cast<MCObjectStreamer *>(Streamer.get())->getAssembler();
+    MCAsmLayout Layout(Assembler);
+    Assembler.layout(Layout);
+
+    const uint64_t HotSize =
+        Layout.getSymbolOffset(*EndLabel) - Layout.getSymbolOffset(*StartLabel);
+    const uint64_t ColdSize = BF.isSplit()
+                                  ? Layout.getSymbolOffset(*ColdEndLabel) -
+                                        Layout.getSymbolOffset(*ColdStartLabel)
+                                  : 0ULL;
+
+    // Clean-up the effect of the code emission on symbols from the main
+    // context (basic block labels of \p BF get defined during the emission).
+    for (const MCSymbol &Symbol : Assembler.symbols()) {
+      MCSymbol *MutableSymbol = const_cast<MCSymbol *>(&Symbol);
+      MutableSymbol->setUndefined();
+      MutableSymbol->setIsRegistered(false);
+    }
+
+    return std::make_pair(HotSize, ColdSize);
+  }
+};
+
 BinaryContext::BinaryContext(std::unique_ptr<MCContext> Ctx,
                              std::unique_ptr<DWARFContext> DwCtx,
                              std::unique_ptr<Triple> TheTriple,
@@ -406,7 +521,7 @@ BinaryContext::handleAddressRef(uint64_t Address, BinaryFunction &BF,
             BF.addEntryPointAtOffset(Address - BF.getAddress()), Addend);
       }
     } else {
-      BF.InterproceduralReferences.insert(Address);
+      BF.InterproceduralReferences.push_back(Address);
     }
   }
 
@@ -505,20 +620,39 @@ bool BinaryContext::analyzeJumpTable(const uint64_t Address,
     // Nothing to do if we failed to identify the containing function.
     if (!TargetBF)
       return false;
+    // Fragment links are decided based on the function name matching
+    // heuristic. Actually linking the fragments mutates both functions, so
+    // it is deferred until no other thread can be disassembling them.
+    //
     // Case 1: check if BF is a fragment and TargetBF is its parent.
     if (BF.isFragment()) {
       // Parent function may or may not be already registered.
-      // Set parent link based on function name matching heuristic.
-      return registerFragment(BF, *TargetBF);
+      if (!isPotentialFragmentByName(BF, *TargetBF))
+        return false;
+      BF.FragmentsToRegister.emplace_back(&BF, TargetBF);
+      return true;
     }
     // Case 2: check if TargetBF is a fragment and BF is its parent.
-    return TargetBF->isFragment() && registerFragment(*TargetBF, BF);
+    if (!TargetBF->isFragment() || !isPotentialFragmentByName(*TargetBF, BF))
+      return false;
+    BF.FragmentsToRegister.emplace_back(TargetBF, &BF);
+    return true;
   };
 
   ErrorOr<BinarySection &> Section = getSectionForAddress(Address);
   if (!Section)
     return false;
 
+  // Fast rejection through the pre-computed candidate index: if the first
+  // entry's target cannot fall inside any function, the scan below would
+  // fail on the first entry anyway.
+  if (!Section->isJumpTableCandidate(Address, Type == JumpTable::JTT_PIC)) {
+    LLVM_DEBUG(dbgs() << "BOLT-DEBUG: analyzeJumpTable in " << BF.getPrintName()
+                      << ": no candidate at 0x" << Twine::utohexstr(Address)
+                      << '\n');
+    return false;
+  }
+
   // The upper bound is defined by containing object, section limits, and
   // the next jump table in memory.
   uint64_t UpperBound = Section->getEndAddress();
@@ -533,6 +667,12 @@ bool BinaryContext::analyzeJumpTable(const uint64_t Address,
 
   LLVM_DEBUG(dbgs() << "BOLT-DEBUG: analyzeJumpTable in " << BF.getPrintName()
                     << '\n');
+  // All candidate entries lie in the section resolved above: read them
+  // through a single extractor instead of re-resolving the section and
+  // rebuilding an extractor for every access.
+  const bool IsVirtualSection = Section->isVirtual();
+  DataExtractor DE(Section->getContents(), AsmInfo->isLittleEndian(),
+                   AsmInfo->getCodePointerSize());
   const uint64_t EntrySize = getJumpTableEntrySize(Type);
   for (uint64_t EntryAddress = Address; EntryAddress <= UpperBound - EntrySize;
        EntryAddress += EntrySize) {
@@ -554,10 +694,15 @@ bool BinaryContext::analyzeJumpTable(const uint64_t Address,
       }
     }
 
+    uint64_t ValueOffset = EntryAddress - Section->getAddress();
     const uint64_t Value =
         (Type == JumpTable::JTT_PIC)
-            ? Address + *getSignedValueAtAddress(EntryAddress, EntrySize)
-            : *getPointerAtAddress(EntryAddress);
+            ? Address +
+                  (IsVirtualSection ? 0 : DE.getSigned(&ValueOffset, EntrySize))
+            : (IsVirtualSection
+                   ? 0
+                   : DE.getUnsigned(&ValueOffset,
+                                    AsmInfo->getCodePointerSize()));
 
     // __builtin_unreachable() case.
     if (Value == BF.getAddress() + BF.getSize()) {
@@ -651,6 +796,13 @@ void BinaryContext::populateJumpTables() {
       llvm_unreachable("jump table heuristic failure");
     }
 
+    // Jump table analysis runs sequentially at this point, so fragment links
+    // it discovered can be registered right away.
+    for (std::pair<BinaryFunction *, BinaryFunction *> &Link :
+         BF.FragmentsToRegister)
+      registerFragment(*Link.first, *Link.second);
+    clearList(BF.FragmentsToRegister);
+
     for (uint64_t EntryOffset : JT->OffsetEntries) {
       if (EntryOffset == BF.getSize())
         BF.IgnoredBranches.emplace_back(EntryOffset, BF.getSize());
@@ -683,6 +835,69 @@ void BinaryContext::populateJumpTables() {
     assert(0 && "unclaimed PC-relative relocations left in data\n");
   }
   clearList(DataPCRelocations);
+
+  buildJumpTableIndex();
+}
+
+void BinaryContext::buildJumpTableIndex() {
+  JumpTableIndex.clear();
+  JumpTableIndex.reserve(JumpTables.size());
+  for (const std::pair<const uint64_t, JumpTable *> &JTI : JumpTables)
+    JumpTableIndex.emplace_back(JTI.first, JTI.second);
+  JumpTableIndexValid = true;
+}
+
+void BinaryContext::buildJumpTableCandidateIndex() {
+  if (!isX86() || AsmInfo->getCodePointerSize() != 8 ||
+      BinaryFunctions.empty())
+    return;
+
+  // The set of addresses jump table entries may resolve to: any address
+  // inside a function, plus the past-the-end address of a function used to
+  // encode __builtin_unreachable() targets.
+  const uint64_t TextLow = BinaryFunctions.begin()->second.getAddress();
+  uint64_t TextHigh = 0;
+  for (std::pair<const uint64_t, BinaryFunction> &BFI : BinaryFunctions)
+    TextHigh = std::max(TextHigh,
+                        BFI.second.getAddress() + BFI.second.getSize());
+
+  auto indexSection = [TextLow, TextHigh](BinarySection &Section) {
+    const StringRef Contents = Section.getContents();
+    const size_t NumWords = Contents.size() / 4;
+    BitVector PICCandidates(NumWords);
+    BitVector AbsCandidates(NumWords);
+    const uint64_t SectionAddress = Section.getAddress();
+    for (size_t I = 0; I < NumWords; ++I) {
+      const char *Data = Contents.data() + I * 4;
+      // A PIC entry is a signed 32-bit offset from the table start, which
+      // for the first entry is the address of the entry itself.
+      const uint64_t PICTarget =
+          SectionAddress + I * 4 +
+          int64_t(int32_t(support::endian::read32le(Data)));
+      if (PICTarget >= TextLow && PICTarget <= TextHigh)
+        PICCandidates.set(I);
+      // An absolute entry holds a full code pointer.
+      if (I * 4 + 8 <= Contents.size()) {
+        const uint64_t AbsTarget = support::endian::read64le(Data);
+        if (AbsTarget >= TextLow && AbsTarget <= TextHigh)
+          AbsCandidates.set(I);
+      }
+    }
+    Section.setJumpTableCandidates(std::move(PICCandidates),
+                                   std::move(AbsCandidates));
+  };
+
+  for (BinarySection &Section : allocatableSections()) {
+    if (Section.isText() || Section.isVirtual() || Section.getSize() < 4)
+      continue;
+    if (opts::NoThreads)
+      indexSection(Section);
+    else
+      ParallelUtilities::getThreadPool().async(indexSection,
+                                               std::ref(Section));
+  }
+  if (!opts::NoThreads)
+    ParallelUtilities::getThreadPool().wait();
 }
 
 void BinaryContext::skipMarkedFragments() {
@@ -725,7 +940,11 @@ MCSymbol *BinaryContext::getOrCreateGlobalSymbol(uint64_t Address, Twine Prefix,
     return Itr->second->getSymbol();
   }
 
-  std::string Name = (Prefix + "0x" + Twine::utohexstr(Address)).str();
+  // Synthesize the name on the stack: it is derived from the address and is
+  // neither stored nor indexed outside of MCContext.
+  SmallString<32> NameBuf;
+  const StringRef Name =
+      (Prefix + "0x" + Twine::utohexstr(Address)).toStringRef(NameBuf);
   assert(!GlobalSymbols.count(Name) && "created name is not unique");
   return registerNameAtAddress(Name, Address, Size, Alignment, Flags);
 }
@@ -779,6 +998,7 @@ BinaryContext::getOrCreateJumpTable(BinaryFunction &Function, uint64_t Address,
                                 JumpTable::LabelMapType{{0, JTLabel}}, Function,
                                 *getSectionForAddress(Address));
   JumpTables.emplace(Address, JT);
+  JumpTableIndexValid = false;
 
   // Duplicate the entry for the parent function for easy access.
   Function.JumpTables.emplace(Address, JT);
@@ -812,6 +1032,7 @@ BinaryContext::duplicateJumpTable(BinaryFunction &Function, JumpTable *JT,
   // addresses in the input binary memory space
   JumpTableID = ~JumpTableID;
   JumpTables.emplace(JumpTableID, NewJT);
+  JumpTableIndexValid = false;
   Function.JumpTables.emplace(JumpTableID, NewJT);
   return std::make_pair(JumpTableID, NewLabel);
 }
@@ -952,12 +1173,16 @@ MCSymbol *BinaryContext::registerNameAtAddress(StringRef Name, uint64_t Address,
     BD = new BinaryData(*Symbol, Address, Size, Alignment ? Alignment : 1,
                         Section, Flags);
     GAI = BinaryDataMap.emplace(Address, BD).first;
-    GlobalSymbols[Name] = BD;
+    // Internally generated names encode the address and are resolved through
+    // BinaryDataMap instead of being indexed by name.
+    if (!isInternalSymbolName(Name))
+      GlobalSymbols[Name] = BD;
     updateObjectNesting(GAI);
   } else {
     BD = GAI->second;
     if (!BD->hasName(Name)) {
-      GlobalSymbols[Name] = BD;
+      if (!isInternalSymbolName(Name))
+        GlobalSymbols[Name] = BD;
       BD->Symbols.push_back(Symbol);
     }
   }
@@ -1090,7 +1315,19 @@ bool BinaryContext::registerFragment(BinaryFunction &TargetFunction,
 }
 
 void BinaryContext::processInterproceduralReferences(BinaryFunction &Function) {
-  for (uint64_t Address : Function.InterproceduralReferences) {
+  // Link function fragments discovered during jump table analysis.
+  for (std::pair<BinaryFunction *, BinaryFunction *> &Link :
+       Function.FragmentsToRegister)
+    registerFragment(*Link.first, *Link.second);
+  clearList(Function.FragmentsToRegister);
+
+  // References are accumulated without deduplication during the disassembly.
+  SmallVector<uint64_t, 0> &References = Function.InterproceduralReferences;
+  std::sort(References.begin(), References.end());
+  References.erase(std::unique(References.begin(), References.end()),
+                   References.end());
+
+  for (uint64_t Address : References) {
     if (!Address)
       continue;
 
@@ -1147,6 +1384,15 @@ void BinaryContext::processInterproceduralReferences(BinaryFunction &Function) {
   }
 
   clearList(Function.InterproceduralReferences);
+
+  // Ignore targets of unsupported branches now that no other thread can be
+  // disassembling them.
+  for (uint64_t Address : Function.UnsupportedBranchTargets)
+    if (BinaryFunction *TargetFunction =
+            getBinaryFunctionContainingAddress(Address))
+      TargetFunction->setIgnored();
+
+  clearList(Function.UnsupportedBranchTargets);
 }
 
 void BinaryContext::postProcessSymbolTable() {
@@ -1173,17 +1419,13 @@ void BinaryContext::foldFunction(BinaryFunction &ChildBF,
 
   std::unique_lock<std::shared_timed_mutex> WriteCtxLock(CtxMutex,
                                                          std::defer_lock);
-  std::unique_lock<std::shared_timed_mutex> WriteSymbolMapLock(
-      SymbolToFunctionMapMutex, std::defer_lock);
 
   const StringRef ChildName = ChildBF.getOneName();
 
   // Move symbols over and update bookkeeping info.
   for (MCSymbol *Symbol : ChildBF.getSymbols()) {
     ParentBF.getSymbols().push_back(Symbol);
-    WriteSymbolMapLock.lock();
-    SymbolToFunctionMap[Symbol] = &ParentBF;
-    WriteSymbolMapLock.unlock();
+    setSymbolToFunctionMap(Symbol, &ParentBF);
     // NB: there's no need to update BinaryDataMap and GlobalSymbols.
   }
   ChildBF.getSymbols().clear();
@@ -1316,6 +1558,141 @@ void BinaryContext::printGlobalSymbols(raw_ostream &OS) const {
   }
 }
 
+void BinaryContext::printMemoryStats(raw_ostream &OS, StringRef Phase) const {
+  uint64_t NumInstructions = 0;
+  uint64_t NumBasicBlocks = 0;
+  for (const auto &BFI : BinaryFunctions) {
+    const BinaryFunction &BF = BFI.second;
+    NumBasicBlocks += BF.size();
+    if (BF.hasCFG())
+      for (const BinaryBasicBlock &BB : BF)
+        NumInstructions += BB.size();
+    else
+      NumInstructions += BF.Instructions.size();
+  }
+  // MCInst stores a small number of operands inline; approximate per-node
+  // container overhead with four pointers.
+  const uint64_t InstructionBytes =
+      NumInstructions * (sizeof(MCInst) + 4 * sizeof(void *)) +
+      NumBasicBlocks * sizeof(BinaryBasicBlock);
+
+  const uint64_t AnnotationBytes = MIB ? MIB->getAnnotationsMemory() : 0;
+
+  uint64_t SectionBytes = 0;
+  for (const BinarySection &Section : sections())
+    SectionBytes += Section.getAllocatedMemory();
+
+  uint64_t JumpTableBytes = 0;
+  for (const auto &JTI : JumpTables) {
+    const JumpTable &JT = *JTI.second;
+    JumpTableBytes += sizeof(JumpTable) +
+                      JT.Entries.capacity() * sizeof(MCSymbol *) +
+                      JT.OffsetEntries.capacity() * sizeof(uint64_t);
+  }
+
+  auto InMB = [](uint64_t Bytes) { return double(Bytes) / (1024 * 1024); };
+  OS << "BOLT-INFO: memory after " << Phase << ": "
+     << format("total %.1fMB, instructions %.1fMB (%" PRIu64
+               " in %" PRIu64 " blocks), annotations %.1fMB, "
+               "sections %.1fMB, jump tables %.1fMB",
+               InMB(sys::Process::GetMallocUsage()), InMB(InstructionBytes),
+               NumInstructions, NumBasicBlocks, InMB(AnnotationBytes),
+               InMB(SectionBytes), InMB(JumpTableBytes))
+     << '\n';
+}
+
+void BinaryContext::printInstructionFootprint(raw_ostream &OS) const {
+  // MCInst stores up to InlineOps operands inline and spills larger operand
+  // lists to the heap. Most post-link instructions need far fewer operands,
+  // so a storage tier with a smaller inline capacity would shrink the
+  // per-instruction footprint. Measure the actual operand-count mix,
+  // including the extra operand BOLT appends to carry annotations, to size
+  // such a tier.
+  constexpr unsigned InlineOps = 8;
+  uint64_t NumInsts = 0;
+  uint64_t NumPrimeOps = 0;
+  uint64_t NumAnnotated = 0;
+  uint64_t NumAnnotationValues = 0;
+  uint64_t NumSpilled = 0;
+  // Bucket InlineOps + 1 counts instructions already spilling to the heap.
+  uint64_t Histogram[InlineOps + 2] = {};
+  uint64_t SumOps[InlineOps + 2] = {};
+
+  auto countInstruction = [&](const MCInst &Inst) {
+    ++NumInsts;
+    const unsigned NumOps = Inst.getNumOperands();
+    const unsigned PrimeOps = MCPlus::getNumPrimeOperands(Inst);
+    NumPrimeOps += PrimeOps;
+    if (NumOps != PrimeOps) {
+      ++NumAnnotated;
+      NumAnnotationValues += std::prev(Inst.end())->getInst()->getNumOperands();
+    }
+    const unsigned Bucket = std::min(NumOps, InlineOps + 1);
+    ++Histogram[Bucket];
+    SumOps[Bucket] += NumOps;
+    if (NumOps > InlineOps)
+      ++NumSpilled;
+  };
+
+  for (const auto &BFI : BinaryFunctions) {
+    const BinaryFunction &BF = BFI.second;
+    if (BF.hasCFG()) {
+      for (const BinaryBasicBlock &BB : BF)
+        for (const MCInst &Inst : BB)
+          countInstruction(Inst);
+    } else {
+      for (const auto &II : BF.Instructions)
+        countInstruction(II.second);
+    }
+  }
+
+  if (!NumInsts)
+    return;
+
+  OS << "BOLT-INFO: instruction footprint: " << NumInsts
+     << format(" instruction(s), sizeof(MCInst) = %zu bytes, "
+               "inline capacity %u operand(s)\n",
+               sizeof(MCInst), InlineOps);
+  OS << "BOLT-INFO: operand count distribution (including the annotation "
+        "operand):";
+  for (unsigned I = 0; I <= InlineOps + 1; ++I) {
+    if (!Histogram[I])
+      continue;
+    OS << ' ' << I << (I == InlineOps + 1 ? "+: " : ": ")
+       << format("%.1f%%", 100.0 * Histogram[I] / NumInsts);
+  }
+  OS << '\n';
+  OS << "BOLT-INFO: "
+     << format("%.1f%% of instructions carry an annotation operand "
+               "referencing %" PRIu64 " annotation value(s); %" PRIu64
+               " instruction(s) spill operands to the heap\n",
+               100.0 * NumAnnotated / NumInsts, NumAnnotationValues,
+               NumSpilled);
+
+  // For each candidate inline capacity, report how many instructions still
+  // fit and the projected net storage change: bytes freed by the smaller
+  // inline buffer minus the operands newly pushed out to the heap.
+  const uint64_t CurrentBytes = NumInsts * sizeof(MCInst);
+  for (unsigned Capacity : {2, 3, 4, 6}) {
+    uint64_t Covered = 0;
+    uint64_t NewHeapOps = 0;
+    for (unsigned I = 0; I <= InlineOps + 1; ++I) {
+      if (I <= Capacity)
+        Covered += Histogram[I];
+      else if (I <= InlineOps)
+        NewHeapOps += SumOps[I];
+    }
+    const uint64_t SavedInline =
+        NumInsts * (InlineOps - Capacity) * sizeof(MCOperand);
+    const int64_t Net = (int64_t)SavedInline - NewHeapOps * sizeof(MCOperand);
+    OS << "BOLT-INFO: "
+       << format("inline capacity %u fits %.1f%% of instructions; projected "
+                 "storage change: %+.1fMB (%+.1f%%)\n",
+                 Capacity, 100.0 * Covered / NumInsts,
+                 -double(Net) / (1024 * 1024), -100.0 * Net / CurrentBytes);
+  }
+}
+
 Expected<unsigned>
 BinaryContext::getDwarfFile(StringRef Directory, StringRef FileName,
                             unsigned FileNumber,
@@ -1632,6 +2009,8 @@ void BinaryContext::printInstruction(raw_ostream &OS, const MCInst &Instruction,
       OS << " # UNKNOWN CONTROL FLOW";
     }
   }
+  if (Optional<uint32_t> InputOffset = MIB->getOffset(Instruction))
+    OS << " # Offset: " << *InputOffset;
 
   MIB->printAnnotations(Instruction, OS);
 
@@ -1891,9 +2270,10 @@ void BinaryContext::markAmbiguousRelocations(BinaryData &BD,
 
 BinaryFunction *BinaryContext::getFunctionForSymbol(const MCSymbol *Symbol,
                                                     uint64_t *EntryDesc) {
-  std::shared_lock<std::shared_timed_mutex> Lock(SymbolToFunctionMapMutex);
-  auto BFI = SymbolToFunctionMap.find(Symbol);
-  if (BFI == SymbolToFunctionMap.end())
+  const SymbolToFunctionMapShard &Shard = getSymbolToFunctionMapShard(Symbol);
+  std::shared_lock<std::shared_timed_mutex> Lock(Shard.Mutex);
+  auto BFI = Shard.Map.find(Symbol);
+  if (BFI == Shard.Map.end())
     return nullptr;
 
   BinaryFunction *BF = BFI->second;
@@ -1938,80 +2318,25 @@ BinaryContext::calculateEmittedSize(BinaryFunction &BF, bool FixBranches) {
   if (FixBranches)
     BF.fixBranches();
 
-  // Create local MC context to isolate the effect of ephemeral code emission.
-  IndependentCodeEmitter MCEInstance = createIndependentMCCodeEmitter();
-  MCContext *LocalCtx = MCEInstance.LocalCtx.get();
-  MCAsmBackend *MAB =
-      TheTarget->createMCAsmBackend(*STI, *MRI, MCTargetOptions());
-
-  SmallString<256> Code;
-  raw_svector_ostream VecOS(Code);
-
-  std::unique_ptr<MCObjectWriter> OW = MAB->createObjectWriter(VecOS);
-  std::unique_ptr<MCStreamer> Streamer(TheTarget->createMCObjectStreamer(
-      *TheTriple, *LocalCtx, std::unique_ptr<MCAsmBackend>(MAB), std::move(OW),
-      std::unique_ptr<MCCodeEmitter>(MCEInstance.MCE.release()), *STI,
-      /*RelaxAll=*/false,
-      /*IncrementalLinkerCompatible=*/false,
-      /*DWARFMustBeAtTheEnd=*/false));
-
-  Streamer->initSections(false, *STI);
-
-  MCSection *Section = MCEInstance.LocalMOFI->getTextSection();
-  Section->setHasInstructions(true);
-
-  // Create symbols in the LocalCtx so that they get destroyed with it.
-  MCSymbol *StartLabel = LocalCtx->createTempSymbol();
-  MCSymbol *EndLabel = LocalCtx->createTempSymbol();
-  MCSymbol *ColdStartLabel = LocalCtx->createTempSymbol();
-  MCSymbol *ColdEndLabel = LocalCtx->createTempSymbol();
-
-  Streamer->SwitchSection(Section);
-  Streamer->emitLabel(StartLabel);
-  emitFunctionBody(*Streamer, BF, /*EmitColdPart=*/false,
-                   /*EmitCodeOnly=*/true);
-  Streamer->emitLabel(EndLabel);
-
-  if (BF.isSplit()) {
-    MCSectionELF *ColdSection =
-        LocalCtx->getELFSection(BF.getColdCodeSectionName(), ELF::SHT_PROGBITS,
-                                ELF::SHF_EXECINSTR | ELF::SHF_ALLOC);
-    ColdSection->setHasInstructions(true);
-
-    Streamer->SwitchSection(ColdSection);
-    Streamer->emitLabel(ColdStartLabel);
-    emitFunctionBody(*Streamer, BF, /*EmitColdPart=*/true,
-                     /*EmitCodeOnly=*/true);
-    Streamer->emitLabel(ColdEndLabel);
-    // To avoid calling MCObjectStreamer::flushPendingLabels() which is private
-    Streamer->emitBytes(StringRef(""));
-    Streamer->SwitchSection(Section);
+  // Grab a sizing emitter from the pool, or build a new one if all are in
+  // use. Reusing the emitter avoids setting up the MC machinery on every
+  // call.
+  std::unique_ptr<FunctionSizer> Sizer;
+  {
+    std::lock_guard<std::mutex> Lock(SizerPoolMutex);
+    if (!SizerPool.empty()) {
+      Sizer = std::move(SizerPool.back());
+      SizerPool.pop_back();
+    }
   }
+  if (!Sizer)
+    Sizer = std::make_unique<FunctionSizer>(*this);
 
-  // To avoid calling MCObjectStreamer::flushPendingLabels() which is private or
-  // MCStreamer::Finish(), which does more than we want
-  Streamer->emitBytes(StringRef(""));
-
-  MCAssembler &Assembler =
-      static_cast<MCObjectStreamer *>(Streamer.get())->getAssembler();
-  MCAsmLayout Layout(Assembler);
-  Assembler.layout(Layout);
-
-  const uint64_t HotSize =
-      Layout.getSymbolOffset(*EndLabel) - Layout.getSymbolOffset(*StartLabel);
-  const uint64_t ColdSize = BF.isSplit()
-                                ? Layout.getSymbolOffset(*ColdEndLabel) -
-                                      Layout.getSymbolOffset(*ColdStartLabel)
-                                : 0ULL;
-
-  // Clean-up the effect of the code emission.
-  for (const MCSymbol &Symbol : Assembler.symbols()) {
-    MCSymbol *MutableSymbol = const_cast<MCSymbol *>(&Symbol);
-    MutableSymbol->setUndefined();
-    MutableSymbol->setIsRegistered(false);
-  }
+  const std::pair<size_t, size_t> Sizes = Sizer->calculateSize(BF);
 
-  return std::make_pair(HotSize, ColdSize);
+  std::lock_guard<std::mutex> Lock(SizerPoolMutex);
+  SizerPool.push_back(std::move(Sizer));
+  return Sizes;
 }
 
 bool BinaryContext::validateEncoding(const MCInst &Inst,
@@ -17,10 +17,12 @@
 #include "bolt/Core/DebugData.h"
 #include "bolt/Utils/CommandLineOpts.h"
 #include "bolt/Utils/Utils.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/MC/MCSection.h"
 #include "llvm/MC/MCStreamer.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/LEB128.h"
+#include "llvm/Support/Regex.h"
 #include "llvm/Support/SMLoc.h"
 
 #define DEBUG_TYPE "bolt"
@@ -91,7 +93,9 @@ X86AlignBranchBoundaryHotOnly("x86-align-branch-boundary-hot-only",
   cl::cat(BoltOptCategory));
 
 size_t padFunction(const BinaryFunction &Function) {
-  static std::map<std::string, size_t> FunctionPadding;
+  // Patterns compiled from the pad spec on the first call. The first
+  // matching entry, in command line order, wins.
+  static std::vector<std::pair<Regex, size_t>> FunctionPadding;
 
   if (FunctionPadding.empty() && !FunctionPadSpec.empty()) {
     for (std::string &Spec : FunctionPadSpec) {
@@ -100,15 +104,14 @@ size_t padFunction(const BinaryFunction &Function) {
         continue;
       std::string Name = Spec.substr(0, N);
       size_t Padding = std::stoull(Spec.substr(N + 1));
-      FunctionPadding[Name] = Padding;
+      FunctionPadding.emplace_back(BinaryFunction::buildNameRegex(Name),
+                                   Padding);
     }
   }
 
-  for (auto &FPI : FunctionPadding) {
-    std::string Name = FPI.first;
-    size_t Padding = FPI.second;
-    if (Function.hasNameRegex(Name))
-      return Padding;
+  for (const std::pair<Regex, size_t> &FPI : FunctionPadding) {
+    if (Function.hasNameRegex(FPI.first))
+      return FPI.second;
   }
 
   return 0;
@@ -223,6 +226,12 @@ void BinaryEmitter::emitAll(StringRef OrgSecPrefix) {
 }
 
 void BinaryEmitter::emitFunctions() {
+  // Note that emission has to go through the single object streamer: function
+  // and basic block symbols live in the shared MCContext, exception handling
+  // info accumulates into one .eh_frame, and final symbol values are taken
+  // from the layout of a single assembler. Splitting the work across several
+  // streamers would require cloning the context per shard and merging the
+  // resulting fragments, sections, and layouts afterwards.
   auto emit = [&](const std::vector<BinaryFunction *> &Functions) {
     const bool HasProfile = BC.NumProfiledFuncs > 0;
     const bool OriginalAllowAutoPadding = Streamer.getAllowAutoPadding();
@@ -261,6 +270,17 @@ void BinaryEmitter::emitFunctions() {
     Streamer.emitLabel(BC.getHotTextStartSymbol());
   }
 
+  // Mark the start of cold text for the decompression runtime. The label has
+  // to precede any cold code in the section. With region splitting, the
+  // compressed store holds the frozen code instead.
+  const char *CompressedSectionName = opts::SplitRegions
+                                          ? BC.getFrozenCodeSectionName()
+                                          : BC.getColdCodeSectionName();
+  if (opts::ColdCompress) {
+    Streamer.SwitchSection(BC.getCodeSection(CompressedSectionName));
+    Streamer.emitLabel(BC.getColdTextStartSymbol());
+  }
+
   // Emit functions in sorted order.
   std::vector<BinaryFunction *> SortedFunctions = BC.getSortedFunctions();
   emit(SortedFunctions);
@@ -273,6 +293,12 @@ void BinaryEmitter::emitFunctions() {
     Streamer.SwitchSection(BC.getTextSection());
     Streamer.emitLabel(BC.getHotTextEndSymbol());
   }
+
+  // Mark the end of cold text.
+  if (opts::ColdCompress) {
+    Streamer.SwitchSection(BC.getCodeSection(CompressedSectionName));
+    Streamer.emitLabel(BC.getColdTextEndSymbol());
+  }
 }
 
 bool BinaryEmitter::emitFunction(BinaryFunction &Function, bool EmitColdPart) {
@@ -347,8 +373,15 @@ bool BinaryEmitter::emitFunction(BinaryFunction &Function, bool EmitColdPart) {
 
   // Emit UD2 at the beginning if requested by user.
   if (!opts::BreakFunctionNames.empty()) {
-    for (std::string &Name : opts::BreakFunctionNames) {
-      if (Function.hasNameRegex(Name)) {
+    static const std::vector<Regex> BreakNameRegexes = [] {
+      std::vector<Regex> Regexes;
+      Regexes.reserve(opts::BreakFunctionNames.size());
+      for (const std::string &Name : opts::BreakFunctionNames)
+        Regexes.push_back(BinaryFunction::buildNameRegex(Name));
+      return Regexes;
+    }();
+    for (const Regex &MatchName : BreakNameRegexes) {
+      if (Function.hasNameRegex(MatchName)) {
         Streamer.emitIntValue(0x0B0F, 2); // UD2: 0F 0B
         break;
       }
@@ -358,11 +391,13 @@ bool BinaryEmitter::emitFunction(BinaryFunction &Function, bool EmitColdPart) {
   // Emit code.
   emitFunctionBody(Function, EmitColdPart, /*EmitCodeOnly=*/false);
 
-  // Emit padding if requested.
+  // Emit padding if requested. Use target nops instead of a byte fill so
+  // that the sled decodes as few instructions instead of one per byte if
+  // it is ever executed.
   if (size_t Padding = opts::padFunction(Function)) {
     LLVM_DEBUG(dbgs() << "BOLT-DEBUG: padding function " << Function << " with "
                       << Padding << " bytes\n");
-    Streamer.emitFill(Padding, MAI->getTextAlignFillValue());
+    Streamer.emitNops(Padding, /*ControlledNopLength=*/0, SMLoc(), *BC.STI);
   }
 
   if (opts::MarkFuncs)
@@ -402,6 +437,7 @@ void BinaryEmitter::emitFunctionBody(BinaryFunction &BF, bool EmitColdPart,
 
   // Track the first emitted instruction with debug info.
   bool FirstInstr = true;
+  bool EmittedIslands = false;
   for (BinaryBasicBlock *BB : BF.layout()) {
     if (EmitColdPart != BB->isCold())
       continue;
@@ -468,8 +504,8 @@ void BinaryEmitter::emitFunctionBody(BinaryFunction &BF, bool EmitColdPart,
       // Prepare to tag this location with a label if we need to keep track of
       // the location of calls/returns for BOLT address translation maps
       if (!EmitCodeOnly && BF.requiresAddressTranslation() &&
-          BC.MIB->hasAnnotation(Instr, "Offset")) {
-        const auto Offset = BC.MIB->getAnnotationAs<uint32_t>(Instr, "Offset");
+          BC.MIB->getOffset(Instr)) {
+        const uint32_t Offset = *BC.MIB->getOffset(Instr);
         MCSymbol *LocSym = BC.Ctx->createTempSymbol();
         Streamer.emitLabel(LocSym);
         BB->getLocSyms().emplace_back(Offset, LocSym);
@@ -478,9 +514,20 @@ void BinaryEmitter::emitFunctionBody(BinaryFunction &BF, bool EmitColdPart,
       Streamer.emitInstruction(Instr, *BC.STI);
       LastIsPrefix = BC.MIB->isPrefix(Instr);
     }
+
+    // Emit islands at their anchor point if one was selected. The anchor
+    // never falls through to its layout successor, and the following code
+    // has to be realigned after the data. Anchors are only used on AArch64,
+    // hence the 4-byte instruction alignment.
+    if (!EmitCodeOnly && !EmitColdPart && BF.hasIslandsInfo() &&
+        BF.getIslandInfo().AnchorBlock == BB) {
+      emitConstantIslands(BF, EmitColdPart);
+      Streamer.emitCodeAlignment(4, &*BC.STI);
+      EmittedIslands = true;
+    }
   }
 
-  if (!EmitCodeOnly)
+  if (!EmitCodeOnly && !EmittedIslands)
     emitConstantIslands(BF, EmitColdPart);
 }
 
@@ -493,6 +540,12 @@ void BinaryEmitter::emitConstantIslands(BinaryFunction &BF, bool EmitColdPart,
   if (Islands.DataOffsets.empty() && Islands.Dependency.empty())
     return;
 
+  // Islands folded into a byte-identical island of another function are
+  // emitted there, labels included. Proxy copies requested by functions
+  // depending on these islands are still emitted on their behalf.
+  if (!OnBehalfOf && Islands.MergedInto)
+    return;
+
   if (!OnBehalfOf) {
     if (!EmitColdPart)
       Streamer.emitLabel(BF.getFunctionConstantIslandLabel());
@@ -516,7 +569,19 @@ void BinaryEmitter::emitConstantIslands(BinaryFunction &BF, bool EmitColdPart,
     outs() << "BOLT-INFO: emitting constant island for function " << BF << "\n";
 
   // We split the island into smaller blocks and output labels between them.
-  auto IS = Islands.Offsets.begin();
+  // Next to the function's own island symbols, define the symbols of
+  // byte-identical islands folded into this one by the dedup pass.
+  SmallVector<std::pair<uint64_t, MCSymbol *>, 8> LabelOffsets(
+      Islands.Offsets.begin(), Islands.Offsets.end());
+  if (!OnBehalfOf && !EmitColdPart)
+    LabelOffsets.append(Islands.MergedSymbols.begin(),
+                        Islands.MergedSymbols.end());
+  llvm::stable_sort(LabelOffsets,
+                    [](const std::pair<uint64_t, MCSymbol *> &A,
+                       const std::pair<uint64_t, MCSymbol *> &B) {
+                      return A.first < B.first;
+                    });
+  auto IS = LabelOffsets.begin();
   for (auto DataIter = Islands.DataOffsets.begin();
        DataIter != Islands.DataOffsets.end(); ++DataIter) {
     uint64_t FunctionOffset = *DataIter;
@@ -572,13 +637,13 @@ void BinaryEmitter::emitConstantIslands(BinaryFunction &BF, bool EmitColdPart,
     };
 
     // Emit labels, relocs and data
-    while (IS != Islands.Offsets.end() && IS->first < EndOffset) {
+    while (IS != LabelOffsets.end() && IS->first < EndOffset) {
       auto NextLabelOffset =
-          IS == Islands.Offsets.end() ? EndOffset : IS->first;
+          IS == LabelOffsets.end() ? EndOffset : IS->first;
       auto NextStop = std::min(NextLabelOffset, EndOffset);
       assert(NextStop <= EndOffset && "internal overflow error");
       emitCI(FunctionOffset, NextStop);
-      if (IS != Islands.Offsets.end() && FunctionOffset == IS->first) {
+      if (IS != LabelOffsets.end() && FunctionOffset == IS->first) {
         // This is a slightly complex code to decide which label to emit. We
         // have 4 cases to handle: regular symbol, cold symbol, regular or cold
         // symbol being emitted on behalf of an external function.
@@ -618,7 +683,7 @@ void BinaryEmitter::emitConstantIslands(BinaryFunction &BF, bool EmitColdPart,
     assert(FunctionOffset <= EndOffset && "overflow error");
     emitCI(FunctionOffset, EndOffset);
   }
-  assert(IS == Islands.Offsets.end() && "some symbols were not emitted!");
+  assert(IS == LabelOffsets.end() && "some symbols were not emitted!");
 
   if (OnBehalfOf)
     return;
@@ -714,6 +779,26 @@ void BinaryEmitter::emitJumpTables(const BinaryFunction &BF) {
   if (opts::PrintJumpTables)
     outs() << "BOLT-INFO: jump tables for function " << BF << ":\n";
 
+  // Determine which fragments of a split function reference each jump table.
+  // A table used only by cold blocks belongs with the cold data even when
+  // its counts are non-zero: the counts predate splitting decisions and the
+  // dispatch that consumes the table was itself judged cold.
+  DenseMap<const JumpTable *, bool> ColdOnlyUse;
+  if (BF.isSimple() && BF.hasCFG() && BF.isSplit()) {
+    for (const BinaryBasicBlock *BB : BF.layout()) {
+      for (const MCInst &Inst : *BB) {
+        const uint64_t JTAddress = BC.MIB->getJumpTable(Inst);
+        if (!JTAddress)
+          continue;
+        if (const JumpTable *JT = BF.getJumpTableContainingAddress(JTAddress)) {
+          auto Itr = ColdOnlyUse.insert(std::make_pair(JT, BB->isCold()));
+          if (!Itr.second)
+            Itr.first->second &= BB->isCold();
+        }
+      }
+    }
+  }
+
   for (auto &JTI : BF.jumpTables()) {
     JumpTable &JT = *JTI.second;
     if (opts::PrintJumpTables)
@@ -739,6 +824,8 @@ void BinaryEmitter::emitJumpTables(const BinaryFunction &BF) {
         if (BF.isSimple()) {
           HotSection = ReadOnlySection;
           ColdSection = ReadOnlyColdSection;
+          if (ColdOnlyUse.lookup(&JT))
+            HotSection = ColdSection;
         } else {
           HotSection = BF.hasProfile() ? ReadOnlySection : ReadOnlyColdSection;
           ColdSection = HotSection;
@@ -754,8 +841,14 @@ void BinaryEmitter::emitJumpTable(const JumpTable &JT, MCSection *HotSection,
   // Pre-process entries for aggressive splitting.
   // Each label represents a separate switch table and gets its own count
   // determining its destination.
+  const unsigned Alignment = JT.OutputAlignment ? JT.OutputAlignment
+                                                : JT.EntrySize;
   std::map<MCSymbol *, uint64_t> LabelCounts;
-  if (opts::JumpTables > JTS_SPLIT && !JT.Counts.empty()) {
+  const bool SplitByLabel =
+      opts::JumpTables > JTS_SPLIT ||
+      (opts::JumpTables == JTS_SPLIT && JT.Labels.size() > 1 &&
+       HotSection != ColdSection);
+  if (SplitByLabel && !JT.Counts.empty()) {
     MCSymbol *CurrentLabel = JT.Labels.at(0);
     uint64_t CurrentLabelCount = 0;
     for (unsigned Index = 0; Index < JT.Entries.size(); ++Index) {
@@ -768,9 +861,22 @@ void BinaryEmitter::emitJumpTable(const JumpTable &JT, MCSection *HotSection,
       CurrentLabelCount += JT.Counts[Index].Count;
     }
     LabelCounts[CurrentLabel] = CurrentLabelCount;
-  } else {
+    // At JTS_SPLIT, break the table up only when the profile shows both used
+    // and unused sub-tables: the split pays by evicting dead entries from
+    // the hot section, while splitting a uniformly-hot table just costs
+    // alignment padding and an extra cache line.
+    if (opts::JumpTables == JTS_SPLIT) {
+      bool HasHotLabel = false;
+      bool HasColdLabel = false;
+      for (const std::pair<MCSymbol *const, uint64_t> &LC : LabelCounts)
+        (LC.second > 0 ? HasHotLabel : HasColdLabel) = true;
+      if (!HasHotLabel || !HasColdLabel)
+        LabelCounts.clear();
+    }
+  }
+  if (LabelCounts.empty()) {
     Streamer.SwitchSection(JT.Count > 0 ? HotSection : ColdSection);
-    Streamer.emitValueToAlignment(JT.EntrySize);
+    Streamer.emitValueToAlignment(Alignment);
   }
   MCSymbol *LastLabel = nullptr;
   uint64_t Offset = 0;
@@ -789,7 +895,7 @@ void BinaryEmitter::emitJumpTable(const JumpTable &JT, MCSection *HotSection,
           Streamer.SwitchSection(HotSection);
         else
           Streamer.SwitchSection(ColdSection);
-        Streamer.emitValueToAlignment(JT.EntrySize);
+        Streamer.emitValueToAlignment(Alignment);
       }
       Streamer.emitLabel(LI->second);
       LastLabel = LI->second;
@@ -936,30 +1042,39 @@ void BinaryEmitter::emitLSDA(BinaryFunction &BF, bool EmitColdPart) {
     };
   }
 
-  Streamer.emitIntValue(TTypeEncoding, 1); // TType format
-
-  // See the comment in EHStreamer::emitExceptionTable() on to use
-  // uleb128 encoding (which can use variable number of bytes to encode the same
-  // value) to ensure type info table is properly aligned at 4 bytes without
-  // iteratively fixing sizes of the tables.
-  unsigned CallSiteTableLengthSize = getULEB128Size(CallSiteTableLength);
-  unsigned TTypeBaseOffset =
-      sizeof(int8_t) +                 // Call site format
-      CallSiteTableLengthSize +        // Call site table length size
-      CallSiteTableLength +            // Call site table length
-      BF.getLSDAActionTable().size() + // Actions table size
-      BF.getLSDATypeTable().size() * TTypeEncodingSize; // Types table size
-  unsigned TTypeBaseOffsetSize = getULEB128Size(TTypeBaseOffset);
-  unsigned TotalSize = sizeof(int8_t) +      // LPStart format
-                       sizeof(int8_t) +      // TType format
-                       TTypeBaseOffsetSize + // TType base offset size
-                       TTypeBaseOffset;      // TType base offset
-  unsigned SizeAlign = (4 - TotalSize) & 3;
-
-  // Account for any extra padding that will be added to the call site table
-  // length.
-  Streamer.emitULEB128IntValue(TTypeBaseOffset,
-                               /*PadTo=*/TTypeBaseOffsetSize + SizeAlign);
+  // Functions that only run cleanups carry no type infos and no exception
+  // specifications. Following EHStreamer, omit the type table portion of the
+  // header for them instead of emitting a base offset to an empty table.
+  const bool HaveTTData =
+      !BF.getLSDATypeTable().empty() || !BF.getLSDATypeIndexTable().empty();
+  if (!HaveTTData) {
+    Streamer.emitIntValue(dwarf::DW_EH_PE_omit, 1); // TType format
+  } else {
+    Streamer.emitIntValue(TTypeEncoding, 1); // TType format
+
+    // See the comment in EHStreamer::emitExceptionTable() on to use
+    // uleb128 encoding (which can use variable number of bytes to encode the
+    // same value) to ensure type info table is properly aligned at 4 bytes
+    // without iteratively fixing sizes of the tables.
+    unsigned CallSiteTableLengthSize = getULEB128Size(CallSiteTableLength);
+    unsigned TTypeBaseOffset =
+        sizeof(int8_t) +                 // Call site format
+        CallSiteTableLengthSize +        // Call site table length size
+        CallSiteTableLength +            // Call site table length
+        BF.getLSDAActionTable().size() + // Actions table size
+        BF.getLSDATypeTable().size() * TTypeEncodingSize; // Types table size
+    unsigned TTypeBaseOffsetSize = getULEB128Size(TTypeBaseOffset);
+    unsigned TotalSize = sizeof(int8_t) +      // LPStart format
+                         sizeof(int8_t) +      // TType format
+                         TTypeBaseOffsetSize + // TType base offset size
+                         TTypeBaseOffset;      // TType base offset
+    unsigned SizeAlign = (4 - TotalSize) & 3;
+
+    // Account for any extra padding that will be added to the call site table
+    // length.
+    Streamer.emitULEB128IntValue(TTypeBaseOffset,
+                                 /*PadTo=*/TTypeBaseOffsetSize + SizeAlign);
+  }
 
   // Emit the landing pad call site table. We use signed data4 since we can emit
   // a landing pad in a different part of the split function that could appear
@@ -990,8 +1105,12 @@ void BinaryEmitter::emitLSDA(BinaryFunction &BF, bool EmitColdPart) {
   //
   // For type table we (re-)encode the table using TTypeEncoding matching
   // the current assembler mode.
-  for (uint8_t const &Byte : BF.getLSDAActionTable())
-    Streamer.emitIntValue(Byte, 1);
+  //
+  // Action and type index tables are pre-serialized byte sequences, so they
+  // are emitted in bulk instead of one streamer call per byte.
+  const ArrayRef<uint8_t> ActionTable = BF.getLSDAActionTable();
+  Streamer.emitBytes(StringRef(
+      reinterpret_cast<const char *>(ActionTable.data()), ActionTable.size()));
 
   const BinaryFunction::LSDATypeTableTy &TypeTable =
       (TTypeEncoding & dwarf::DW_EH_PE_indirect) ? BF.getLSDATypeAddressTable()
@@ -1024,8 +1143,10 @@ void BinaryEmitter::emitLSDA(BinaryFunction &BF, bool EmitColdPart) {
     }
     }
   }
-  for (uint8_t const &Byte : BF.getLSDATypeIndexTable())
-    Streamer.emitIntValue(Byte, 1);
+  const ArrayRef<uint8_t> TypeIndexTable = BF.getLSDATypeIndexTable();
+  Streamer.emitBytes(StringRef(reinterpret_cast<const char *>(
+                                   TypeIndexTable.data()),
+                               TypeIndexTable.size()));
 }
 
 void BinaryEmitter::emitDebugLineInfoForOriginalFunctions() {
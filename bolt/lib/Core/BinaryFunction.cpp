@@ -13,9 +13,11 @@
 #include "bolt/Core/BinaryFunction.h"
 #include "bolt/Core/BinaryBasicBlock.h"
 #include "bolt/Core/DynoStats.h"
+#include "bolt/Core/HashUtilities.h"
 #include "bolt/Core/MCPlusBuilder.h"
 #include "bolt/Utils/NameResolver.h"
 #include "bolt/Utils/NameShortener.h"
+#include "bolt/Utils/ThreadTimer.h"
 #include "bolt/Utils/Utils.h"
 #include "llvm/ADT/SmallSet.h"
 #include "llvm/ADT/StringRef.h"
@@ -35,7 +37,6 @@
 #include "llvm/Support/GraphWriter.h"
 #include "llvm/Support/LEB128.h"
 #include "llvm/Support/Regex.h"
-#include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 #include <functional>
 #include <limits>
@@ -158,8 +159,18 @@ bool shouldPrint(const BinaryFunction &Function) {
   if (PrintOnly.empty())
     return true;
 
-  for (std::string &Name : opts::PrintOnly) {
-    if (Function.hasNameRegex(Name)) {
+  // The list does not change after command line parsing. Compile the
+  // patterns once instead of on every call.
+  static const std::vector<Regex> NameRegexes = [] {
+    std::vector<Regex> Regexes;
+    Regexes.reserve(PrintOnly.size());
+    for (const std::string &Name : PrintOnly)
+      Regexes.push_back(BinaryFunction::buildNameRegex(Name));
+    return Regexes;
+  }();
+
+  for (const Regex &MatchName : NameRegexes) {
+    if (Function.hasNameRegex(MatchName)) {
       return true;
     }
   }
@@ -180,39 +191,80 @@ template <typename R> bool emptyRange(const R &Range) {
   return Range.begin() == Range.end();
 }
 
-/// Gets debug line information for the instruction located at the given
-/// address in the original binary. The SMLoc's pointer is used
-/// to point to this information, which is represented by a
-/// DebugLineTableRowRef. The returned pointer is null if no debug line
-/// information for this instruction was found.
-SMLoc findDebugLineInformationForInstructionAt(
-    uint64_t Address, DWARFUnit *Unit,
-    const DWARFDebugLine::LineTable *LineTable) {
-  // We use the pointer in SMLoc to store an instance of DebugLineTableRowRef,
-  // which occupies 64 bits. Thus, we can only proceed if the struct fits into
-  // the pointer itself.
-  assert(sizeof(decltype(SMLoc().getPointer())) >=
-             sizeof(DebugLineTableRowRef) &&
-         "Cannot fit instruction debug line information into SMLoc's pointer");
-
-  SMLoc NullResult = DebugLineTableRowRef::NULL_ROW.toSMLoc();
-  uint32_t RowIndex = LineTable->lookupAddress(
-      {Address, object::SectionedAddress::UndefSection});
-  if (RowIndex == LineTable->UnknownRowIndex)
-    return NullResult;
-
-  assert(RowIndex < LineTable->Rows.size() &&
-         "Line Table lookup returned invalid index.");
-
-  decltype(SMLoc().getPointer()) Ptr;
-  DebugLineTableRowRef *InstructionLocation =
-      reinterpret_cast<DebugLineTableRowRef *>(&Ptr);
-
-  InstructionLocation->DwCompileUnitIndex = Unit->getOffset();
-  InstructionLocation->RowIndex = RowIndex + 1;
-
-  return SMLoc::getFromPointer(Ptr);
-}
+/// Resolves debug line information for the instructions of one function. The
+/// result for an address is an SMLoc whose pointer stores a
+/// DebugLineTableRowRef, or a null row reference if no debug line information
+/// for the instruction was found.
+///
+/// Instructions are disassembled in increasing address order, so the row
+/// found for the previous instruction serves as a cursor into the line
+/// table: queries that stay inside the current instruction sequence are
+/// answered by advancing the cursor over at most a few rows, and the full
+/// binary search of lookupAddress() only runs when an address leaves the
+/// sequence.
+class DebugLineTableCursor {
+  DWARFUnit *Unit;
+  const DWARFDebugLine::LineTable *LineTable;
+  /// Sequence containing the current cursor position, or nullptr when the
+  /// cursor has to be re-seeded with a full lookup.
+  const DWARFDebugLine::Sequence *Seq{nullptr};
+  uint32_t RowIndex{0};
+
+public:
+  DebugLineTableCursor(DWARFUnit *Unit,
+                       const DWARFDebugLine::LineTable *LineTable)
+      : Unit(Unit), LineTable(LineTable) {}
+
+  SMLoc find(uint64_t Address) {
+    // We use the pointer in SMLoc to store an instance of
+    // DebugLineTableRowRef, which occupies 64 bits. Thus, we can only proceed
+    // if the struct fits into the pointer itself.
+    assert(sizeof(decltype(SMLoc().getPointer())) >=
+               sizeof(DebugLineTableRowRef) &&
+           "Cannot fit instruction debug line information into SMLoc's "
+           "pointer");
+
+    SMLoc NullResult = DebugLineTableRowRef::NULL_ROW.toSMLoc();
+
+    if (Seq && Address >= LineTable->Rows[RowIndex].Address.Address &&
+        Address < Seq->HighPC) {
+      // Advance to the last row covering Address. The end-of-sequence row is
+      // never a lookup result, matching findRowInSeq().
+      const uint32_t LastValidRow = Seq->LastRowIndex - 2;
+      while (RowIndex < LastValidRow &&
+             LineTable->Rows[RowIndex + 1].Address.Address <= Address)
+        ++RowIndex;
+    } else {
+      Seq = nullptr;
+      RowIndex = LineTable->lookupAddress(
+          {Address, object::SectionedAddress::UndefSection});
+      if (RowIndex == LineTable->UnknownRowIndex)
+        return NullResult;
+
+      // Seed the cursor with the sequence containing the row.
+      auto SeqIt = std::upper_bound(
+          LineTable->Sequences.begin(), LineTable->Sequences.end(), RowIndex,
+          [](uint32_t Idx, const DWARFDebugLine::Sequence &S) {
+            return Idx < S.LastRowIndex;
+          });
+      if (SeqIt != LineTable->Sequences.end() &&
+          SeqIt->FirstRowIndex <= RowIndex && RowIndex < SeqIt->LastRowIndex)
+        Seq = &*SeqIt;
+    }
+
+    assert(RowIndex < LineTable->Rows.size() &&
+           "Line Table lookup returned invalid index.");
+
+    decltype(SMLoc().getPointer()) Ptr;
+    DebugLineTableRowRef *InstructionLocation =
+        reinterpret_cast<DebugLineTableRowRef *>(&Ptr);
+
+    InstructionLocation->DwCompileUnitIndex = Unit->getOffset();
+    InstructionLocation->RowIndex = RowIndex + 1;
+
+    return SMLoc::getFromPointer(Ptr);
+  }
+};
 
 std::string buildSectionName(StringRef Prefix, StringRef Name,
                              const BinaryContext &BC) {
@@ -250,13 +302,18 @@ std::string BinaryFunction::buildColdCodeSectionName(StringRef Name,
 
 uint64_t BinaryFunction::Count = 0;
 
+Regex BinaryFunction::buildNameRegex(StringRef NameRegex) {
+  return Regex((Twine("^") + NameRegex + "$").str());
+}
+
 Optional<StringRef> BinaryFunction::hasNameRegex(const StringRef Name) const {
-  const std::string RegexName = (Twine("^") + StringRef(Name) + "$").str();
-  Regex MatchName(RegexName);
-  Optional<StringRef> Match = forEachName(
-      [&MatchName](StringRef Name) { return MatchName.match(Name); });
+  const Regex MatchName = buildNameRegex(Name);
+  return hasNameRegex(MatchName);
+}
 
-  return Match;
+Optional<StringRef> BinaryFunction::hasNameRegex(const Regex &MatchName) const {
+  return forEachName(
+      [&MatchName](StringRef Name) { return MatchName.match(Name); });
 }
 
 Optional<StringRef>
@@ -501,7 +558,7 @@ void BinaryFunction::print(raw_ostream &OS, std::string Annotation,
 
   if (BasicBlocks.empty() && !Instructions.empty()) {
     // Print before CFG was built.
-    for (const std::pair<const uint32_t, MCInst> &II : Instructions) {
+    for (const std::pair<uint32_t, MCInst> &II : Instructions) {
       Offset = II.first;
 
       // Print label if exists at this offset.
@@ -773,8 +830,8 @@ const MCCFIInstruction *BinaryFunction::mutateCFIOffsetFor(const MCInst &Instr,
 
 IndirectBranchType
 BinaryFunction::processIndirectBranch(MCInst &Instruction, unsigned Size,
-                                      uint64_t Offset,
-                                      uint64_t &TargetAddress) {
+                                      uint64_t Offset, uint64_t &TargetAddress,
+                                      MCPlusBuilder::AllocatorIdTy AllocId) {
   const unsigned PtrSize = BC.AsmInfo->getCodePointerSize();
 
   // The instruction referencing memory used by the branch instruction.
@@ -853,6 +910,11 @@ BinaryFunction::processIndirectBranch(MCInst &Instruction, unsigned Size,
     return IndirectBranchType::UNKNOWN;
   }
 
+  // The rest of the analysis examines and updates memory contents info and
+  // jump tables registered with BinaryContext and has to be serialized with
+  // other threads disassembling in parallel.
+  auto L = BC.scopeLock();
+
   // RIP-relative addressing should be converted to symbol form by now
   // in processed instructions (but not in jump).
   if (DispExpr) {
@@ -947,7 +1009,7 @@ BinaryFunction::processIndirectBranch(MCInst &Instruction, unsigned Size,
   // Convert the instruction into jump table branch.
   const MCSymbol *JTLabel = BC.getOrCreateJumpTable(*this, ArrayStart, JTType);
   BC.MIB->replaceMemOperandDisp(*MemLocInstr, JTLabel, BC.Ctx.get());
-  BC.MIB->setJumpTable(Instruction, ArrayStart, IndexRegNum);
+  BC.MIB->setJumpTable(Instruction, ArrayStart, IndexRegNum, AllocId);
 
   JTSites.emplace_back(Offset, ArrayStart);
 
@@ -1024,9 +1086,12 @@ bool BinaryFunction::isZeroPaddingAt(uint64_t Offset) const {
   return true;
 }
 
-bool BinaryFunction::disassemble() {
-  NamedRegionTimer T("disassemble", "Disassemble function", "buildfuncs",
-                     "Build Binary Functions", opts::TimeBuild);
+bool BinaryFunction::disassemble(MCPlusBuilder::AllocatorIdTy AllocatorId) {
+  // This region runs on every worker thread; NamedRegionTimer would
+  // serialize the workers on the global timer-group mutex.
+  static ThreadTimer DisassembleTimer("disassemble", "Disassemble function",
+                                      "Build Binary Functions");
+  ThreadTimer::Scope T(DisassembleTimer, opts::TimeBuild);
   ErrorOr<ArrayRef<uint8_t>> ErrorOrFunctionData = getData();
   assert(ErrorOrFunctionData && "function data is not available");
   ArrayRef<uint8_t> FunctionData = *ErrorOrFunctionData;
@@ -1038,7 +1103,10 @@ bool BinaryFunction::disassemble() {
 
   // Insert a label at the beginning of the function. This will be our first
   // basic block.
-  Labels[0] = Ctx->createNamedTempSymbol("BB0");
+  {
+    auto L = BC.scopeLock();
+    Labels[0] = Ctx->createNamedTempSymbol("BB0");
+  }
 
   auto handlePCRelOperand = [&](MCInst &Instruction, uint64_t Address,
                                 uint64_t Size) {
@@ -1065,6 +1133,7 @@ bool BinaryFunction::disassemble() {
 
     const MCSymbol *TargetSymbol;
     uint64_t TargetOffset;
+    auto L = BC.scopeLock();
     std::tie(TargetSymbol, TargetOffset) =
         BC.handleAddressRef(TargetAddress, *this, /*IsPCRel*/ true);
     const MCExpr *Expr = MCSymbolRefExpr::create(
@@ -1085,6 +1154,7 @@ bool BinaryFunction::disassemble() {
                            uint64_t Target) {
     const MCSymbol *TargetSymbol;
     uint64_t Addend = 0;
+    auto L = BC.scopeLock();
     std::tie(TargetSymbol, Addend) = BC.handleAddressRef(Target, *this, true);
 
     int64_t Val;
@@ -1100,7 +1170,12 @@ bool BinaryFunction::disassemble() {
     const bool IsCondBranch = MIB->isConditionalBranch(Instruction);
     const uint64_t AbsoluteInstrAddr = getAddress() + Offset;
     MCSymbol *TargetSymbol = nullptr;
-    InterproceduralReferences.insert(TargetAddress);
+    // The references list is local to this function and is merged after the
+    // disassembly phase, so no lock is needed to grow it.
+    InterproceduralReferences.push_back(TargetAddress);
+    // Most of the referenced state in BinaryContext is shared between
+    // functions disassembled in parallel.
+    auto L = BC.scopeLock();
     if (opts::Verbosity >= 2 && !IsCall && Size == 2 && !BC.HasRelocations) {
       errs() << "BOLT-WARNING: relaxed tail call detected at 0x"
              << Twine::utohexstr(AbsoluteInstrAddr) << " in function " << *this
@@ -1140,12 +1215,13 @@ bool BinaryFunction::disassemble() {
   auto handleIndirectBranch = [&](MCInst &Instruction, uint64_t Size,
                                   uint64_t Offset) {
     uint64_t IndirectTarget = 0;
-    IndirectBranchType Result =
-        processIndirectBranch(Instruction, Size, Offset, IndirectTarget);
+    IndirectBranchType Result = processIndirectBranch(
+        Instruction, Size, Offset, IndirectTarget, AllocatorId);
     switch (Result) {
     default:
       llvm_unreachable("unexpected result");
     case IndirectBranchType::POSSIBLE_TAIL_CALL: {
+      auto L = BC.scopeLock();
       bool Result = MIB->convertJmpToTailCall(Instruction);
       (void)Result;
       assert(Result);
@@ -1158,14 +1234,19 @@ bool BinaryFunction::disassemble() {
       break;
     case IndirectBranchType::POSSIBLE_FIXED_BRANCH: {
       if (containsAddress(IndirectTarget)) {
-        const MCSymbol *TargetSymbol = getOrCreateLocalLabel(IndirectTarget);
-        Instruction.clear();
-        MIB->createUncondBranch(Instruction, TargetSymbol, BC.Ctx.get());
+        const MCSymbol *TargetSymbol;
+        {
+          auto L = BC.scopeLock();
+          TargetSymbol = getOrCreateLocalLabel(IndirectTarget);
+          Instruction.clear();
+          MIB->createUncondBranch(Instruction, TargetSymbol, BC.Ctx.get());
+        }
         TakenBranches.emplace_back(Offset, IndirectTarget - getAddress());
         HasFixedIndirectBranch = true;
       } else {
+        InterproceduralReferences.push_back(IndirectTarget);
+        auto L = BC.scopeLock();
         MIB->convertJmpToTailCall(Instruction);
-        InterproceduralReferences.insert(IndirectTarget);
       }
       break;
     }
@@ -1186,18 +1267,31 @@ bool BinaryFunction::disassemble() {
     if (MIB->matchLinkerVeneer(Instructions.begin(), Instructions.end(),
                                AbsoluteInstrAddr, Instruction, TargetHiBits,
                                TargetLowBits, TargetAddress)) {
-      MIB->addAnnotation(Instruction, "AArch64Veneer", true);
+      MIB->addAnnotation(Instruction, MCPlus::MCAnnotation::kAArch64Veneer,
+                         true, AllocatorId);
 
       uint8_t Counter = 0;
       for (auto It = std::prev(Instructions.end()); Counter != 2;
            --It, ++Counter) {
-        MIB->addAnnotation(It->second, "AArch64Veneer", true);
+        MIB->addAnnotation(It->second, MCPlus::MCAnnotation::kAArch64Veneer,
+                           true, AllocatorId);
       }
 
       fixStubTarget(*TargetLowBits, *TargetHiBits, TargetAddress);
     }
   };
 
+  // Instruction offsets increase monotonically, so a single pass over the
+  // function-local sorted relocation span replaces two map searches per
+  // instruction.
+  auto NextRelI = Relocations.begin();
+
+  // Instruction addresses also increase monotonically, which lets the line
+  // table cursor serve most lookups without a binary search.
+  Optional<DebugLineTableCursor> LineCursor;
+  if (getDWARFLineTable())
+    LineCursor.emplace(getDWARFUnit(), getDWARFLineTable());
+
   uint64_t Size = 0; // instruction size
   for (uint64_t Offset = 0; Offset < getSize(); Offset += Size) {
     MCInst Instruction;
@@ -1224,6 +1318,7 @@ bool BinaryFunction::disassemble() {
       // Some AVX-512 instructions could not be disassembled at all.
       if (BC.HasRelocations && opts::TrapOnAVX512 && BC.isX86()) {
         setTrapOnEntry();
+        auto L = BC.scopeLock();
         BC.TrappedFunctions.push_back(this);
       } else {
         setIgnored();
@@ -1235,6 +1330,8 @@ bool BinaryFunction::disassemble() {
     // Check integrity of LLVM assembler/disassembler.
     if (opts::CheckEncoding && !BC.MIB->isBranch(Instruction) &&
         !BC.MIB->isCall(Instruction) && !BC.MIB->isNoop(Instruction)) {
+      // Re-encoding uses the shared code emitter.
+      auto L = BC.scopeLock();
       if (!BC.validateEncoding(Instruction, FunctionData.slice(Offset, Size))) {
         errs() << "BOLT-WARNING: mismatching LLVM encoding detected in "
                << "function " << *this << " for instruction :\n";
@@ -1247,11 +1344,13 @@ bool BinaryFunction::disassemble() {
     if (MIB->hasEVEXEncoding(Instruction)) {
       if (BC.HasRelocations && opts::TrapOnAVX512) {
         setTrapOnEntry();
+        auto L = BC.scopeLock();
         BC.TrappedFunctions.push_back(this);
         break;
       }
 
       // Check if our disassembly is correct and matches the assembler output.
+      auto L = BC.scopeLock();
       if (!BC.validateEncoding(Instruction, FunctionData.slice(Offset, Size))) {
         if (opts::Verbosity >= 1) {
           errs() << "BOLT-WARNING: internal assembler/disassembler error "
@@ -1267,10 +1366,11 @@ bool BinaryFunction::disassemble() {
 
     // Check if there's a relocation associated with this instruction.
     bool UsedReloc = false;
-    for (auto Itr = Relocations.lower_bound(Offset),
-              ItrE = Relocations.lower_bound(Offset + Size);
-         Itr != ItrE; ++Itr) {
-      const Relocation &Relocation = Itr->second;
+    while (NextRelI != Relocations.end() && NextRelI->first < Offset)
+      ++NextRelI;
+    for (; NextRelI != Relocations.end() && NextRelI->first < Offset + Size;
+         ++NextRelI) {
+      const Relocation &Relocation = NextRelI->second;
 
       LLVM_DEBUG(dbgs() << "BOLT-DEBUG: replacing immediate 0x"
                         << Twine::utohexstr(Relocation.Value)
@@ -1281,6 +1381,8 @@ bool BinaryFunction::disassemble() {
                         << " for instruction at offset 0x"
                         << Twine::utohexstr(Offset) << '\n');
 
+      auto L = BC.scopeLock();
+
       // Process reference to the primary symbol.
       if (!Relocation.isPCRelative())
         BC.handleAddressRef(Relocation.Value - Relocation.Addend, *this,
@@ -1325,9 +1427,9 @@ bool BinaryFunction::disassemble() {
 
         if (BC.MIB->isUnsupportedBranch(Instruction.getOpcode())) {
           setIgnored();
-          if (BinaryFunction *TargetFunc =
-                  BC.getBinaryFunctionContainingAddress(TargetAddress))
-            TargetFunc->setIgnored();
+          // The target function could be disassembled on another thread.
+          // Defer ignoring it until the disassembly phase is over.
+          UnsupportedBranchTargets.push_back(TargetAddress);
         }
 
         if (IsCall && containsAddress(TargetAddress)) {
@@ -1351,6 +1453,7 @@ bool BinaryFunction::disassemble() {
         if (!TargetSymbol) {
           // Create either local label or external symbol.
           if (containsAddress(TargetAddress)) {
+            auto L = BC.scopeLock();
             TargetSymbol = getOrCreateLocalLabel(TargetAddress);
           } else {
             if (TargetAddress == getAddress() + getSize() &&
@@ -1377,11 +1480,14 @@ bool BinaryFunction::disassemble() {
           // Add taken branch info.
           TakenBranches.emplace_back(Offset, TargetAddress - getAddress());
         }
-        BC.MIB->replaceBranchTarget(Instruction, TargetSymbol, &*Ctx);
+        {
+          auto L = BC.scopeLock();
+          BC.MIB->replaceBranchTarget(Instruction, TargetSymbol, &*Ctx);
 
-        // Mark CTC.
-        if (IsCondBranch && IsCall)
-          MIB->setConditionalTailCall(Instruction, TargetAddress);
+          // Mark CTC.
+          if (IsCondBranch && IsCall)
+            MIB->setConditionalTailCall(Instruction, TargetAddress);
+        }
       } else {
         // Could not evaluate branch. Should be an indirect call or an
         // indirect branch. Bail out on the latter case.
@@ -1399,20 +1505,20 @@ bool BinaryFunction::disassemble() {
     }
 
 add_instruction:
-    if (getDWARFLineTable()) {
-      Instruction.setLoc(findDebugLineInformationForInstructionAt(
-          AbsoluteInstrAddr, getDWARFUnit(), getDWARFLineTable()));
-    }
+    if (LineCursor)
+      Instruction.setLoc(LineCursor->find(AbsoluteInstrAddr));
 
     // Record offset of the instruction for profile matching.
     if (BC.keepOffsetForInstruction(Instruction))
-      MIB->addAnnotation(Instruction, "Offset", static_cast<uint32_t>(Offset));
+      MIB->setOffset(Instruction, static_cast<uint32_t>(Offset),
+                     AllocatorId);
 
     if (BC.MIB->isNoop(Instruction)) {
       // NOTE: disassembly loses the correct size information for noops.
       //       E.g. nopw 0x0(%rax,%rax,1) is 9 bytes, but re-encoded it's only
       //       5 bytes. Preserve the size info using annotations.
-      MIB->addAnnotation(Instruction, "Size", static_cast<uint32_t>(Size));
+      MIB->addAnnotation(Instruction, MCPlus::MCAnnotation::kSize,
+                         static_cast<uint32_t>(Size), AllocatorId);
     }
 
     addInstruction(Offset, std::move(Instruction));
@@ -1457,6 +1563,10 @@ bool BinaryFunction::scanExternalRefs() {
   assert(FunctionData.size() == getMaxSize() &&
          "function size does not match raw data size");
 
+  // See the matching iterator in disassemble(): offsets are monotonic, so
+  // advancing a single iterator covers all per-instruction relocation spans.
+  auto NextRelI = Relocations.begin();
+
   uint64_t Size = 0; // instruction size
   for (uint64_t Offset = 0; Offset < getSize(); Offset += Size) {
     // Check for data inside code and ignore it
@@ -1561,10 +1671,11 @@ bool BinaryFunction::scanExternalRefs() {
 
     // Create more relocations based on input file relocations.
     bool HasRel = false;
-    for (auto Itr = Relocations.lower_bound(Offset),
-              ItrE = Relocations.lower_bound(Offset + Size);
-         Itr != ItrE; ++Itr) {
-      Relocation &Relocation = Itr->second;
+    while (NextRelI != Relocations.end() && NextRelI->first < Offset)
+      ++NextRelI;
+    for (; NextRelI != Relocations.end() && NextRelI->first < Offset + Size;
+         ++NextRelI) {
+      Relocation &Relocation = NextRelI->second;
       if (ignoreReference(Relocation.Symbol))
         continue;
 
@@ -1922,8 +2033,8 @@ void BinaryFunction::recomputeLandingPads() {
       BinaryBasicBlock *LPBlock = getBasicBlockForLabel(EHInfo->first);
       if (!BBLandingPads.count(LPBlock)) {
         BBLandingPads.insert(LPBlock);
-        BB->LandingPads.emplace_back(LPBlock);
-        LPBlock->Throwers.emplace_back(BB);
+        BB->LandingPads.push_back(*this, LPBlock);
+        LPBlock->Throwers.push_back(*this, BB);
       }
     }
   }
@@ -1989,9 +2100,8 @@ bool BinaryFunction::buildCFG(MCPlusBuilder::AllocatorIdTy AllocatorId) {
         break;
       }
     }
-    if (LastNonNop && !MIB->hasAnnotation(*LastNonNop, "Offset"))
-      MIB->addAnnotation(*LastNonNop, "Offset", static_cast<uint32_t>(Offset),
-                         AllocatorId);
+    if (LastNonNop && !MIB->getOffset(*LastNonNop))
+      MIB->setOffset(*LastNonNop, static_cast<uint32_t>(Offset), AllocatorId);
   };
 
   for (auto I = Instructions.begin(), E = Instructions.end(); I != E; ++I) {
@@ -2014,14 +2124,14 @@ bool BinaryFunction::buildCFG(MCPlusBuilder::AllocatorIdTy AllocatorId) {
     bool IsLKMarker = BC.LKMarkers.count(InstrInputAddr);
     // Mark all nops with Offset for profile tracking purposes.
     if (MIB->isNoop(Instr) || IsLKMarker) {
-      if (!MIB->hasAnnotation(Instr, "Offset"))
-        MIB->addAnnotation(Instr, "Offset", static_cast<uint32_t>(Offset),
-                           AllocatorId);
+      if (!MIB->getOffset(Instr))
+        MIB->setOffset(Instr, static_cast<uint32_t>(Offset), AllocatorId);
       if (IsSDTMarker || IsLKMarker)
         HasSDTMarker = true;
       else
         // Annotate ordinary nops, so we can safely delete them if required.
-        MIB->addAnnotation(Instr, "NOP", static_cast<uint32_t>(1), AllocatorId);
+        MIB->addAnnotation(Instr, MCPlus::MCAnnotation::kNOP,
+                           static_cast<uint32_t>(1), AllocatorId);
     }
 
     if (!InsertBB) {
@@ -2216,7 +2326,7 @@ void BinaryFunction::postProcessCFG() {
   if (!requiresAddressTranslation() && !opts::Instrument) {
     for (BinaryBasicBlock *BB : layout())
       for (MCInst &Inst : *BB)
-        BC.MIB->removeAnnotation(Inst, "Offset");
+        BC.MIB->clearOffset(Inst);
   }
 
   assert((!isSimple() || validateCFG()) &&
@@ -2233,8 +2343,7 @@ void BinaryFunction::calculateMacroOpFusionStats() {
 
     // Check offset of the second instruction.
     // FIXME: arch-specific.
-    const uint32_t Offset =
-        BC.MIB->getAnnotationWithDefault<uint32_t>(*std::next(II), "Offset", 0);
+    const uint32_t Offset = BC.MIB->getOffsetWithDefault(*std::next(II), 0);
     if (!Offset || (getAddress() + Offset) % 64)
       continue;
 
@@ -2283,9 +2392,9 @@ void BinaryFunction::removeConditionalTailCalls() {
     uint64_t CTCMispredCount = BinaryBasicBlock::COUNT_NO_PROFILE;
     if (hasValidProfile()) {
       CTCTakenCount = BC.MIB->getAnnotationWithDefault<uint64_t>(
-          *CTCInstr, "CTCTakenCount");
+          *CTCInstr, MCPlus::MCAnnotation::kCTCTakenCount);
       CTCMispredCount = BC.MIB->getAnnotationWithDefault<uint64_t>(
-          *CTCInstr, "CTCMispredCount");
+          *CTCInstr, MCPlus::MCAnnotation::kCTCMispredCount);
     }
 
     // Assert that the tail call does not throw.
@@ -2297,12 +2406,17 @@ void BinaryFunction::removeConditionalTailCalls() {
     const MCSymbol *CTCTargetLabel = BC.MIB->getTargetSymbol(*CTCInstr);
     assert(CTCTargetLabel && "symbol expected for conditional tail call");
     MCInst TailCallInstr;
-    BC.MIB->createTailCall(TailCallInstr, CTCTargetLabel, BC.Ctx.get());
-    // Link new BBs to the original input offset of the BB where the CTC
-    // is, so we can map samples recorded in new BBs back to the original BB
-    // seem in the input binary (if using BAT)
-    std::unique_ptr<BinaryBasicBlock> TailCallBB = createBasicBlock(
-        BB.getInputOffset(), BC.Ctx->createNamedTempSymbol("TC"));
+    std::unique_ptr<BinaryBasicBlock> TailCallBB;
+    {
+      // Instruction and label creation allocate in the shared MCContext.
+      auto L = BC.scopeLock();
+      BC.MIB->createTailCall(TailCallInstr, CTCTargetLabel, BC.Ctx.get());
+      // Link new BBs to the original input offset of the BB where the CTC
+      // is, so we can map samples recorded in new BBs back to the original
+      // BB seem in the input binary (if using BAT)
+      TailCallBB = createBasicBlock(BB.getInputOffset(),
+                                    BC.Ctx->createNamedTempSymbol("TC"));
+    }
     TailCallBB->addInstruction(TailCallInstr);
     TailCallBB->setCFIState(CFIStateBeforeCTC);
 
@@ -2314,8 +2428,11 @@ void BinaryFunction::removeConditionalTailCalls() {
 
     BC.MIB->convertTailCallToJmp(*CTCInstr);
 
-    BC.MIB->replaceBranchTarget(*CTCInstr, TailCallBB->getLabel(),
-                                BC.Ctx.get());
+    {
+      auto L = BC.scopeLock();
+      BC.MIB->replaceBranchTarget(*CTCInstr, TailCallBB->getLabel(),
+                                  BC.Ctx.get());
+    }
 
     // Add basic block to the list that will be added to the end.
     NewBlocks.emplace_back(std::move(TailCallBB));
@@ -2406,8 +2523,6 @@ void BinaryFunction::annotateCFIState() {
   assert(StateStack.empty() && "corrupt CFI stack");
 }
 
-namespace {
-
 /// Our full interpretation of a DWARF CFI machine state at a given point
 struct CFISnapshot {
   /// CFA register number and offset defining the canonical frame at this
@@ -2623,17 +2738,58 @@ struct CFISnapshotDiff : public CFISnapshot {
   }
 };
 
-} // end anonymous namespace
+/// Reconstructs CFI state machine snapshots on demand. Building a CFISnapshot
+/// replays the FDE program from its start, which makes CFI fix-up after
+/// layout changes quadratic in the program size when every basic block
+/// requests a snapshot. The cache keeps periodic checkpoints of the state
+/// machine and materializes a requested state by copying the nearest
+/// checkpoint and advancing it forward.
+class CFISnapshotCache {
+  const BinaryFunction::CFIInstrMapType &CIE;
+  const BinaryFunction::CFIInstrMapType &FDE;
+  const DenseMap<int32_t, SmallVector<int32_t, 4>> &FrameRestoreEquivalents;
+
+  /// Distance between consecutive checkpoints. Reconstruction replays at
+  /// most this many CFIs on top of a checkpoint.
+  static constexpr int32_t CheckpointInterval = 64;
+
+  /// Checkpoints[N] is the state machine after executing the first
+  /// N * CheckpointInterval FDE instructions.
+  std::vector<CFISnapshot> Checkpoints;
 
-bool BinaryFunction::replayCFIInstrs(int32_t FromState, int32_t ToState,
+public:
+  CFISnapshotCache(
+      const BinaryFunction::CFIInstrMapType &CIE,
+      const BinaryFunction::CFIInstrMapType &FDE,
+      const DenseMap<int32_t, SmallVector<int32_t, 4>> &FrameRestoreEquivalents)
+      : CIE(CIE), FDE(FDE), FrameRestoreEquivalents(FrameRestoreEquivalents) {}
+
+  /// Return a snapshot of the CFI state machine at \p State.
+  CFISnapshot get(int32_t State) {
+    assert(State >= 0 && "invalid CFI state");
+    if (Checkpoints.empty())
+      Checkpoints.push_back(CFISnapshot(CIE, FDE, FrameRestoreEquivalents, 0));
+    const size_t Index = State / CheckpointInterval;
+    while (Checkpoints.size() <= Index) {
+      CFISnapshot Next = Checkpoints.back();
+      Next.advanceTo(Checkpoints.size() * CheckpointInterval);
+      Checkpoints.push_back(std::move(Next));
+    }
+    CFISnapshot Snapshot = Checkpoints[Index];
+    Snapshot.advanceTo(State);
+    return Snapshot;
+  }
+};
+
+bool BinaryFunction::replayCFIInstrs(CFISnapshotCache &Cache,
+                                     int32_t FromState, int32_t ToState,
                                      BinaryBasicBlock *InBB,
                                      BinaryBasicBlock::iterator InsertIt) {
   if (FromState == ToState)
     return true;
   assert(FromState < ToState && "can only replay CFIs forward");
 
-  CFISnapshotDiff CFIDiff(CIEFrameInstructions, FrameInstructions,
-                          FrameRestoreEquivalents, FromState);
+  CFISnapshotDiff CFIDiff(Cache.get(FromState));
 
   std::vector<uint32_t> NewCFIs;
   for (int32_t CurState = FromState; CurState < ToState; ++CurState) {
@@ -2660,13 +2816,12 @@ bool BinaryFunction::replayCFIInstrs(int32_t FromState, int32_t ToState,
 }
 
 SmallVector<int32_t, 4>
-BinaryFunction::unwindCFIState(int32_t FromState, int32_t ToState,
-                               BinaryBasicBlock *InBB,
+BinaryFunction::unwindCFIState(CFISnapshotCache &Cache, int32_t FromState,
+                               int32_t ToState, BinaryBasicBlock *InBB,
                                BinaryBasicBlock::iterator &InsertIt) {
   SmallVector<int32_t, 4> NewStates;
 
-  CFISnapshot ToCFITable(CIEFrameInstructions, FrameInstructions,
-                         FrameRestoreEquivalents, ToState);
+  CFISnapshot ToCFITable = Cache.get(ToState);
   CFISnapshotDiff FromCFITable(ToCFITable);
   FromCFITable.advanceTo(FromState);
 
@@ -2791,6 +2946,8 @@ void BinaryFunction::normalizeCFIState() {
   // equivalent unwindCFIState sequence required at that point to achieve the
   // same effect of the restore. All remember state are then just ignored.
   std::stack<int32_t> Stack;
+  CFISnapshotCache Cache(CIEFrameInstructions, FrameInstructions,
+                         FrameRestoreEquivalents);
   for (BinaryBasicBlock *CurBB : BasicBlocksLayout) {
     for (auto II = CurBB->begin(); II != CurBB->end(); ++II) {
       if (const MCCFIInstruction *CFI = getCFIFor(*II)) {
@@ -2802,7 +2959,7 @@ void BinaryFunction::normalizeCFIState() {
           const int32_t RememberState = Stack.top();
           const int32_t CurState = II->getOperand(0).getImm();
           FrameRestoreEquivalents[CurState] =
-              unwindCFIState(CurState, RememberState, CurBB, II);
+              unwindCFIState(Cache, CurState, RememberState, CurBB, II);
           Stack.pop();
         }
       }
@@ -2818,6 +2975,8 @@ bool BinaryFunction::finalizeCFIState() {
 
   int32_t State = 0;
   bool SeenCold = false;
+  CFISnapshotCache Cache(CIEFrameInstructions, FrameInstructions,
+                         FrameRestoreEquivalents);
   const char *Sep = "";
   (void)Sep;
   for (BinaryBasicBlock *BB : BasicBlocksLayout) {
@@ -2837,13 +2996,13 @@ bool BinaryFunction::finalizeCFIState() {
       // to be. To solve this, we need to insert CFI instructions to undo
       // the effect of all CFI from BB's state to current State.
       auto InsertIt = BB->begin();
-      unwindCFIState(State, BB->getCFIState(), BB, InsertIt);
+      unwindCFIState(Cache, State, BB->getCFIState(), BB, InsertIt);
     } else if (BB->getCFIState() > State) {
       // If BB's CFI state is greater than State, it means we are behind in the
       // state. Just emit all instructions to reach this state at the
       // beginning of this BB. If this sequence of instructions involve
       // remember state or restore state, bail out.
-      if (!replayCFIInstrs(State, BB->getCFIState(), BB, BB->begin()))
+      if (!replayCFIInstrs(Cache, State, BB->getCFIState(), BB, BB->begin()))
         return false;
     }
 
@@ -3577,13 +3736,12 @@ size_t BinaryFunction::computeHash(bool UseDFS,
 
   const BasicBlockOrderType &Order = UseDFS ? dfs() : BasicBlocksLayout;
 
-  // The hash is computed by creating a string of all instruction opcodes and
-  // possibly their operands and then hashing that string with std::hash.
-  std::string HashString;
+  // The hash is computed by streaming all instruction opcodes and possibly
+  // their operands through a block hasher. No intermediate string is
+  // materialized.
+  StreamingHash64 Hasher;
   for (const BinaryBasicBlock *BB : Order) {
     for (const MCInst &Inst : *BB) {
-      unsigned Opcode = Inst.getOpcode();
-
       if (BC.MIB->isPseudo(Inst))
         continue;
 
@@ -3593,21 +3751,14 @@ size_t BinaryFunction::computeHash(bool UseDFS,
       if (BC.MIB->isUnconditionalBranch(Inst))
         continue;
 
-      if (Opcode == 0)
-        HashString.push_back(0);
-
-      while (Opcode) {
-        uint8_t LSB = Opcode & 0xff;
-        HashString.push_back(LSB);
-        Opcode = Opcode >> 8;
-      }
+      Hasher.add(static_cast<uint64_t>(Inst.getOpcode()));
 
       for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E; ++I)
-        HashString.append(OperandHashFunc(Inst.getOperand(I)));
+        OperandHashFunc(Inst.getOperand(I), Hasher);
     }
   }
 
-  return Hash = std::hash<std::string>{}(HashString);
+  return Hash = Hasher.finalize();
 }
 
 void BinaryFunction::insertBasicBlocks(
@@ -4325,14 +4476,13 @@ MCInst *BinaryFunction::getInstructionAtOffset(uint64_t Offset) {
 
     for (MCInst &Inst : *BB) {
       constexpr uint32_t InvalidOffset = std::numeric_limits<uint32_t>::max();
-      if (Offset == BC.MIB->getAnnotationWithDefault<uint32_t>(Inst, "Offset",
-                                                               InvalidOffset))
+      if (Offset == BC.MIB->getOffsetWithDefault(Inst, InvalidOffset))
         return &Inst;
     }
 
     if (MCInst *LastInstr = BB->getLastNonPseudoInstr()) {
-      const uint32_t Size =
-          BC.MIB->getAnnotationWithDefault<uint32_t>(*LastInstr, "Size");
+      const uint32_t Size = BC.MIB->getAnnotationWithDefault<uint32_t>(
+          *LastInstr, MCPlus::MCAnnotation::kSize);
       if (BB->getEndOffset() - Offset == Size)
         return LastInstr;
     }
@@ -4486,7 +4636,7 @@ bool BinaryFunction::isAArch64Veneer() const {
     return false;
 
   for (MCInst &Inst : BB)
-    if (!BC.MIB->hasAnnotation(Inst, "AArch64Veneer"))
+    if (!BC.MIB->hasAnnotation(Inst, MCPlus::MCAnnotation::kAArch64Veneer))
       return false;
 
   return true;
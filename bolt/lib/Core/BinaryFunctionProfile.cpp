@@ -76,8 +76,12 @@ void BinaryFunction::postProcessProfile() {
     return;
   }
 
-  if (!(getProfileFlags() & PF_LBR))
+  if (!(getProfileFlags() & PF_LBR)) {
+    // Non-LBR sample counts are approximations to begin with.
+    for (BinaryBasicBlock *BB : BasicBlocks)
+      BB->setProfileConfidence(BinaryBasicBlock::PROF_CONF_INFERRED);
     return;
+  }
 
   // If we have at least some branch data for the function indicate that it
   // was executed.
@@ -102,6 +106,16 @@ void BinaryFunction::postProcessProfile() {
     }
   }
 
+  // Seed per-block count confidence: with a fully matched profile, the
+  // preliminary counts are direct aggregates of LBR records. The fix-ups and
+  // the inference below downgrade the blocks whose counts they adjust, while
+  // a partially matched profile makes every count a guess.
+  const BinaryBasicBlock::ProfileConfidenceLevel SeedConfidence =
+      ProfileMatchRatio < 1.0f ? BinaryBasicBlock::PROF_CONF_GUESSED
+                               : BinaryBasicBlock::PROF_CONF_EXACT;
+  for (BinaryBasicBlock *BB : BasicBlocks)
+    BB->setProfileConfidence(SeedConfidence);
+
   // Fix for old profiles.
   for (BinaryBasicBlock *BB : BasicBlocks) {
     if (BB->size() != 1 || BB->succ_size() != 1)
@@ -112,7 +126,7 @@ void BinaryFunction::postProcessProfile() {
 
     MCInst *Instr = BB->getFirstNonPseudoInstr();
     assert(Instr && "expected non-pseudo instr");
-    if (!BC.MIB->hasAnnotation(*Instr, "NOP"))
+    if (!BC.MIB->hasAnnotation(*Instr, MCPlus::MCAnnotation::kNOP))
       continue;
 
     BinaryBasicBlock *FTSuccessor = BB->getSuccessor();
@@ -121,6 +135,8 @@ void BinaryFunction::postProcessProfile() {
       BI.Count = BB->getKnownExecutionCount();
       FTSuccessor->setExecutionCount(FTSuccessor->getKnownExecutionCount() +
                                      BI.Count);
+      FTSuccessor->downgradeProfileConfidence(
+          BinaryBasicBlock::PROF_CONF_INFERRED);
     }
   }
 
@@ -132,8 +148,16 @@ void BinaryFunction::postProcessProfile() {
       for (BinaryBasicBlock *Succ : BB->successors()) {
         uint64_t Count = SuccBIIter->Count;
         if (Count != BinaryBasicBlock::COUNT_NO_PROFILE && Count > 0) {
-          Succ->setExecutionCount(std::max(Succ->getExecutionCount(), Count));
-          BB->setExecutionCount(std::max(BB->getExecutionCount(), Count));
+          if (Count > Succ->getExecutionCount()) {
+            Succ->setExecutionCount(Count);
+            Succ->downgradeProfileConfidence(
+                BinaryBasicBlock::PROF_CONF_INFERRED);
+          }
+          if (Count > BB->getExecutionCount()) {
+            BB->setExecutionCount(Count);
+            BB->downgradeProfileConfidence(
+                BinaryBasicBlock::PROF_CONF_INFERRED);
+          }
         }
         ++SuccBIIter;
       }
@@ -144,9 +168,13 @@ void BinaryFunction::postProcessProfile() {
         if (!BC.MIB->isCall(Inst))
           continue;
 
-        auto CountAnnt = BC.MIB->tryGetAnnotationAs<uint64_t>(Inst, "Count");
-        if (CountAnnt)
-          BB->setExecutionCount(std::max(BB->getExecutionCount(), *CountAnnt));
+        auto CountAnnt = BC.MIB->tryGetAnnotationAs<uint64_t>(
+            Inst, MCPlus::MCAnnotation::kCount);
+        if (CountAnnt && *CountAnnt > BB->getExecutionCount()) {
+          BB->setExecutionCount(*CountAnnt);
+          BB->downgradeProfileConfidence(
+              BinaryBasicBlock::PROF_CONF_INFERRED);
+        }
       }
     }
   }
@@ -223,6 +251,7 @@ void BinaryFunction::mergeProfileDataInto(BinaryFunction &BF) const {
     if (BB->getExecutionCount() != BinaryBasicBlock::COUNT_NO_PROFILE) {
       BBMerge->setExecutionCount(BBMerge->getKnownExecutionCount() +
                                  BB->getExecutionCount());
+      BBMerge->downgradeProfileConfidence(BB->getProfileConfidence());
     }
 
     // Update edge count for successors of this basic block.
@@ -302,7 +331,7 @@ void BinaryFunction::inferFallThroughCounts() {
     const MCInst *CTCInstr = BB->getLastNonPseudoInstr();
     if (CTCInstr && BC.MIB->getConditionalTailCall(*CTCInstr)) {
       CTCTakenCount = BC.MIB->getAnnotationWithDefault<uint64_t>(
-          *CTCInstr, "CTCTakenCount");
+          *CTCInstr, MCPlus::MCAnnotation::kCTCTakenCount);
     }
 
     // Calculate frequency of throws from this node according to LBR data
@@ -343,6 +372,9 @@ void BinaryFunction::inferFallThroughCounts() {
         SuccBI.Count = Inferred;
         SuccBI.MispredictedCount = BinaryBasicBlock::COUNT_INFERRED;
         Succ->ExecutionCount += Inferred;
+        if (Inferred > 0)
+          Succ->downgradeProfileConfidence(
+              BinaryBasicBlock::PROF_CONF_INFERRED);
       }
     }
   }
@@ -355,6 +387,7 @@ void BinaryFunction::clearProfile() {
   // counts.
   for (BinaryBasicBlock *BB : BasicBlocks) {
     BB->ExecutionCount = 0;
+    BB->setProfileConfidence(BinaryBasicBlock::PROF_CONF_GUESSED);
     for (BinaryBasicBlock::BinaryBranchInfo &BI : BB->branch_info()) {
       BI.Count = 0;
       BI.MispredictedCount = 0;
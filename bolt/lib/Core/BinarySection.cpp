@@ -167,11 +167,8 @@ BinarySection::~BinarySection() {
     return;
   }
 
-  if (!isAllocatable() &&
-      (!hasSectionRef() ||
-       OutputContents.data() != getContents(Section).data())) {
+  if (OwnsOutputContents)
     delete[] getOutputData();
-  }
 }
 
 void BinarySection::clearRelocations() { clearList(Relocations); }
@@ -239,8 +236,8 @@ void BinarySection::reorderContents(const std::vector<BinaryData *> &Order,
     const uint64_t SrcOffset = BD->getAddress() - getAddress();
     assert(SrcOffset < Contents.size());
     assert(SrcOffset == BD->getOffset());
-    while (OS.tell() < BD->getOutputOffset())
-      OS.write((unsigned char)0);
+    if (OS.tell() < BD->getOutputOffset())
+      OS.write_zeros(BD->getOutputOffset() - OS.tell());
     LLVM_DEBUG(dbgs() << "BOLT-DEBUG: " << BD->getName() << " @ " << OS.tell()
                       << "\n");
     OS.write(&Src[SrcOffset], BD->getOutputSize());
@@ -323,16 +323,14 @@ void DebugLocWriter::finalize(uint64_t SectionOffset,
   }
 
   for (uint64_t DebugInfoAttrOffset : EmptyAttrLists)
-    DebugInfoPatcher.addLE32Patch(DebugInfoAttrOffset,
-                                  DebugLocWriter::EmptyListOffset);
+    DebugInfoPatcher.addLE32Patch(DebugInfoAttrOffset, EmptyListOffset);
 }
 
 void DebugLoclistWriter::finalize(uint64_t SectionOffset,
                                   SimpleBinaryPatcher &DebugInfoPatcher) {
   for (LocPatch &Patch : Patches) {
     if (Patch.LocList.empty()) {
-      DebugInfoPatcher.addLE32Patch(Patch.AttrOffset,
-                                    DebugLocWriter::EmptyListOffset);
+      DebugInfoPatcher.addLE32Patch(Patch.AttrOffset, EmptyListOffset);
       continue;
     }
     const uint32_t EntryOffset = LocBuffer->size();
@@ -13,11 +13,14 @@
 #include "bolt/Core/DynoStats.h"
 #include "bolt/Core/BinaryBasicBlock.h"
 #include "bolt/Core/BinaryFunction.h"
+#include "bolt/Core/ParallelUtilities.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
 #include <algorithm>
+#include <atomic>
 #include <string>
 
 #undef  DEBUG_TYPE
@@ -217,19 +220,24 @@ DynoStats getDynoStats(const BinaryFunction &BF) {
         }
       }
 
-      if (BC.MIB->isStore(Instr)) {
+      const uint8_t OpcodeInfo = BC.MIB->getOpcodeInfoBits(Instr.getOpcode());
+      if (OpcodeInfo & MCPlusBuilder::OpcodeInfoStore) {
         Stats[DynoStats::STORES] += BBExecutionCount;
       }
-      if (BC.MIB->isLoad(Instr)) {
+      if (OpcodeInfo & MCPlusBuilder::OpcodeInfoLoad) {
         Stats[DynoStats::LOADS] += BBExecutionCount;
       }
-      if (!BC.MIB->isCall(Instr))
+      // Tail calls are branch opcodes flagged by annotation and are not
+      // covered by the per-opcode call bit.
+      if (!(OpcodeInfo & MCPlusBuilder::OpcodeInfoCall) &&
+          !((OpcodeInfo & MCPlusBuilder::OpcodeInfoBranch) &&
+            BC.MIB->isTailCall(Instr)))
         continue;
 
       uint64_t CallFreq = BBExecutionCount;
       if (BC.MIB->getConditionalTailCall(Instr)) {
-        CallFreq =
-            BC.MIB->getAnnotationWithDefault<uint64_t>(Instr, "CTCTakenCount");
+        CallFreq = BC.MIB->getAnnotationWithDefault<uint64_t>(
+            Instr, MCPlus::MCAnnotation::kCTCTakenCount);
       }
       Stats[DynoStats::FUNCTION_CALLS] += CallFreq;
       if (BC.MIB->isIndirectCall(Instr)) {
@@ -255,6 +263,11 @@ DynoStats getDynoStats(const BinaryFunction &BF) {
 
     Stats[DynoStats::INSTRUCTIONS] += BB->getNumNonPseudos() * BBExecutionCount;
 
+    // Count branch pairs eligible for macro-op fusion (X86 only; the check
+    // returns end() on other targets).
+    if (BB->getMacroOpFusionPair() != BB->end())
+      Stats[DynoStats::MACRO_FUSION_PAIRS] += BBExecutionCount;
+
     // Jump tables.
     const MCInst *LastInstr = BB->getLastNonPseudoInstr();
     if (BC.MIB->getJumpTable(*LastInstr)) {
@@ -326,5 +339,48 @@ DynoStats getDynoStats(const BinaryFunction &BF) {
   return Stats;
 }
 
+DynoStats getDynoStats(const BinaryContext &BC) {
+  DynoStats Stats(/*PrintAArch64Stats*/ BC.isAArch64());
+
+  std::vector<const BinaryFunction *> Functions;
+  for (const auto &BFI : BC.getBinaryFunctions())
+    if (BFI.second.isSimple())
+      Functions.push_back(&BFI.second);
+
+  if (opts::NoThreads || Functions.size() < 2) {
+    for (const BinaryFunction *BF : Functions)
+      Stats += getDynoStats(*BF);
+    return Stats;
+  }
+
+  // Build the opcode classification table before the workers race to
+  // initialize it.
+  BC.MIB->getOpcodeInfoBits(/*Opcode=*/0);
+
+  // Workers pull functions off a shared index and accumulate into their own
+  // stats, merged once all of them are done.
+  const size_t WorkerCount =
+      std::min<size_t>(opts::ThreadCount, Functions.size());
+  std::vector<DynoStats> WorkerStats(WorkerCount,
+                                     DynoStats(BC.isAArch64()));
+  std::atomic<size_t> NextFunction{0};
+  auto runWorker = [&](size_t WorkerId) {
+    while (true) {
+      const size_t I = NextFunction.fetch_add(1, std::memory_order_relaxed);
+      if (I >= Functions.size())
+        break;
+      WorkerStats[WorkerId] += getDynoStats(*Functions[I]);
+    }
+  };
+  ThreadPool &Pool = ParallelUtilities::getThreadPool();
+  for (size_t W = 0; W < WorkerCount; ++W)
+    Pool.async(runWorker, W);
+  Pool.wait();
+
+  for (const DynoStats &WS : WorkerStats)
+    Stats += WS;
+  return Stats;
+}
+
 } // namespace bolt
 } // namespace llvm
@@ -124,6 +124,29 @@ void MCPlusBuilder::setTailCall(MCInst &Inst) {
   setAnnotationOpValue(Inst, MCAnnotation::kTailCall, true);
 }
 
+void MCPlusBuilder::buildOpcodeInfoBitsTable() const {
+  OpcodeInfoBitsTable.resize(Info->getNumOpcodes(), 0);
+  MCInst Probe;
+  for (unsigned Opcode = 0; Opcode < OpcodeInfoBitsTable.size(); ++Opcode) {
+    Probe.setOpcode(Opcode);
+    uint8_t Bits = 0;
+    // The load/store/call predicates of all targets consult the opcode and
+    // its MCInstrDesc only, so an operand-less probe yields their answer for
+    // every instruction of this opcode. The probe carries no annotations,
+    // hence isCall() answers for the opcode alone and tail calls are left to
+    // a per-instruction check on branch opcodes.
+    if (isLoad(Probe))
+      Bits |= OpcodeInfoLoad;
+    if (isStore(Probe))
+      Bits |= OpcodeInfoStore;
+    if (isCall(Probe))
+      Bits |= OpcodeInfoCall;
+    if (Info->get(Opcode).isBranch())
+      Bits |= OpcodeInfoBranch;
+    OpcodeInfoBitsTable[Opcode] = Bits;
+  }
+}
+
 bool MCPlusBuilder::isTailCall(const MCInst &Inst) const {
   if (hasAnnotation(Inst, MCAnnotation::kTailCall))
     return true;
@@ -184,7 +207,7 @@ uint64_t MCPlusBuilder::getJumpTable(const MCInst &Inst) const {
 }
 
 uint16_t MCPlusBuilder::getJumpTableIndexReg(const MCInst &Inst) const {
-  return getAnnotationAs<uint16_t>(Inst, "JTIndexReg");
+  return getAnnotationAs<uint16_t>(Inst, MCAnnotation::kJTIndexReg);
 }
 
 bool MCPlusBuilder::setJumpTable(MCInst &Inst, uint64_t Value,
@@ -192,7 +215,8 @@ bool MCPlusBuilder::setJumpTable(MCInst &Inst, uint64_t Value,
   if (!isIndirectBranch(Inst))
     return false;
   setAnnotationOpValue(Inst, MCAnnotation::kJumpTable, Value, AllocId);
-  getOrCreateAnnotationAs<uint16_t>(Inst, "JTIndexReg", AllocId) = IndexReg;
+  getOrCreateAnnotationAs<uint16_t>(Inst, MCAnnotation::kJTIndexReg,
+                                    AllocId) = IndexReg;
   return true;
 }
 
@@ -200,7 +224,7 @@ bool MCPlusBuilder::unsetJumpTable(MCInst &Inst) {
   if (!getJumpTable(Inst))
     return false;
   removeAnnotation(Inst, MCAnnotation::kJumpTable);
-  removeAnnotation(Inst, "JTIndexReg");
+  removeAnnotation(Inst, MCAnnotation::kJTIndexReg);
   return true;
 }
 
@@ -228,6 +252,33 @@ bool MCPlusBuilder::unsetConditionalTailCall(MCInst &Inst) {
   return true;
 }
 
+Optional<uint32_t> MCPlusBuilder::getOffset(const MCInst &Inst) const {
+  Optional<int64_t> Value = getAnnotationOpValue(Inst, MCAnnotation::kOffset);
+  if (!Value)
+    return NoneType();
+  return static_cast<uint32_t>(*Value);
+}
+
+uint32_t MCPlusBuilder::getOffsetWithDefault(const MCInst &Inst,
+                                             uint32_t Default) const {
+  if (Optional<uint32_t> Offset = getOffset(Inst))
+    return *Offset;
+  return Default;
+}
+
+bool MCPlusBuilder::setOffset(MCInst &Inst, uint32_t Offset,
+                              AllocatorIdTy AllocatorId) {
+  setAnnotationOpValue(Inst, MCAnnotation::kOffset, Offset, AllocatorId);
+  return true;
+}
+
+bool MCPlusBuilder::clearOffset(MCInst &Inst) {
+  if (!hasAnnotation(Inst, MCAnnotation::kOffset))
+    return false;
+  removeAnnotation(Inst, MCAnnotation::kOffset);
+  return true;
+}
+
 bool MCPlusBuilder::hasAnnotation(const MCInst &Inst, unsigned Index) const {
   const MCInst *AnnotationInst = getAnnotationInst(Inst);
   if (!AnnotationInst)
@@ -293,9 +344,7 @@ void MCPlusBuilder::getClobberedRegs(const MCInst &Inst,
 
   const MCInstrDesc &InstInfo = Info->get(Inst.getOpcode());
 
-  const MCPhysReg *ImplicitDefs = InstInfo.getImplicitDefs();
-  for (unsigned I = 0, E = InstInfo.getNumImplicitDefs(); I != E; ++I)
-    Regs |= getAliases(ImplicitDefs[I], /*OnlySmaller=*/false);
+  Regs |= getImplicitDefAliases(Inst.getOpcode(), /*OnlySmaller=*/false);
 
   for (unsigned I = 0, E = InstInfo.getNumDefs(); I != E; ++I) {
     const MCOperand &Operand = Inst.getOperand(I);
@@ -308,14 +357,8 @@ void MCPlusBuilder::getTouchedRegs(const MCInst &Inst, BitVector &Regs) const {
   if (isPrefix(Inst) || isCFI(Inst))
     return;
 
-  const MCInstrDesc &InstInfo = Info->get(Inst.getOpcode());
-
-  const MCPhysReg *ImplicitDefs = InstInfo.getImplicitDefs();
-  for (unsigned I = 0, E = InstInfo.getNumImplicitDefs(); I != E; ++I)
-    Regs |= getAliases(ImplicitDefs[I], /*OnlySmaller=*/false);
-  const MCPhysReg *ImplicitUses = InstInfo.getImplicitUses();
-  for (unsigned I = 0, E = InstInfo.getNumImplicitUses(); I != E; ++I)
-    Regs |= getAliases(ImplicitUses[I], /*OnlySmaller=*/false);
+  Regs |= getImplicitDefAliases(Inst.getOpcode(), /*OnlySmaller=*/false);
+  Regs |= getImplicitUseAliases(Inst.getOpcode(), /*OnlySmaller=*/false);
 
   for (unsigned I = 0, E = Inst.getNumOperands(); I != E; ++I) {
     if (!Inst.getOperand(I).isReg())
@@ -330,9 +373,7 @@ void MCPlusBuilder::getWrittenRegs(const MCInst &Inst, BitVector &Regs) const {
 
   const MCInstrDesc &InstInfo = Info->get(Inst.getOpcode());
 
-  const MCPhysReg *ImplicitDefs = InstInfo.getImplicitDefs();
-  for (unsigned I = 0, E = InstInfo.getNumImplicitDefs(); I != E; ++I)
-    Regs |= getAliases(ImplicitDefs[I], /*OnlySmaller=*/true);
+  Regs |= getImplicitDefAliases(Inst.getOpcode(), /*OnlySmaller=*/true);
 
   for (unsigned I = 0, E = InstInfo.getNumDefs(); I != E; ++I) {
     const MCOperand &Operand = Inst.getOperand(I);
@@ -345,11 +386,7 @@ void MCPlusBuilder::getUsedRegs(const MCInst &Inst, BitVector &Regs) const {
   if (isPrefix(Inst) || isCFI(Inst))
     return;
 
-  const MCInstrDesc &InstInfo = Info->get(Inst.getOpcode());
-
-  const MCPhysReg *ImplicitUses = InstInfo.getImplicitUses();
-  for (unsigned I = 0, E = InstInfo.getNumImplicitUses(); I != E; ++I)
-    Regs |= getAliases(ImplicitUses[I], /*OnlySmaller=*/true);
+  Regs |= getImplicitUseAliases(Inst.getOpcode(), /*OnlySmaller=*/true);
 
   for (unsigned I = 0, E = Inst.getNumOperands(); I != E; ++I) {
     if (!Inst.getOperand(I).isReg())
@@ -380,9 +417,7 @@ void MCPlusBuilder::getSrcRegs(const MCInst &Inst, BitVector &Regs) const {
 
   const MCInstrDesc &InstInfo = Info->get(Inst.getOpcode());
 
-  const MCPhysReg *ImplicitUses = InstInfo.getImplicitUses();
-  for (unsigned I = 0, E = InstInfo.getNumImplicitUses(); I != E; ++I)
-    Regs |= getAliases(ImplicitUses[I], /*OnlySmaller=*/true);
+  Regs |= getImplicitUseAliases(Inst.getOpcode(), /*OnlySmaller=*/true);
 
   for (unsigned I = InstInfo.getNumDefs(), E = InstInfo.getNumOperands();
        I != E; ++I) {
@@ -473,6 +508,43 @@ const BitVector &MCPlusBuilder::getAliases(MCPhysReg Reg,
   return AliasMap[SuperReg[Reg]];
 }
 
+const BitVector &MCPlusBuilder::getImplicitDefAliases(unsigned Opcode,
+                                                      bool OnlySmaller) const {
+  // DefMap caches, per opcode, the union of alias sets of all implicit defs,
+  // turning the per-register expansion done by the dataflow transfer
+  // functions into a single OR. Built eagerly for all opcodes on first use,
+  // like the alias map in getAliases().
+  static std::vector<BitVector> DefMap[2];
+  std::vector<BitVector> &Map = DefMap[OnlySmaller];
+  if (Map.empty()) {
+    Map.resize(Info->getNumOpcodes(), BitVector(RegInfo->getNumRegs(), false));
+    for (unsigned Opc = 0, E = Info->getNumOpcodes(); Opc != E; ++Opc) {
+      const MCInstrDesc &InstInfo = Info->get(Opc);
+      const MCPhysReg *ImplicitDefs = InstInfo.getImplicitDefs();
+      for (unsigned I = 0, N = InstInfo.getNumImplicitDefs(); I != N; ++I)
+        Map[Opc] |= getAliases(ImplicitDefs[I], OnlySmaller);
+    }
+  }
+  return Map[Opcode];
+}
+
+const BitVector &MCPlusBuilder::getImplicitUseAliases(unsigned Opcode,
+                                                      bool OnlySmaller) const {
+  // See getImplicitDefAliases().
+  static std::vector<BitVector> UseMap[2];
+  std::vector<BitVector> &Map = UseMap[OnlySmaller];
+  if (Map.empty()) {
+    Map.resize(Info->getNumOpcodes(), BitVector(RegInfo->getNumRegs(), false));
+    for (unsigned Opc = 0, E = Info->getNumOpcodes(); Opc != E; ++Opc) {
+      const MCInstrDesc &InstInfo = Info->get(Opc);
+      const MCPhysReg *ImplicitUses = InstInfo.getImplicitUses();
+      for (unsigned I = 0, N = InstInfo.getNumImplicitUses(); I != N; ++I)
+        Map[Opc] |= getAliases(ImplicitUses[I], OnlySmaller);
+    }
+  }
+  return Map[Opcode];
+}
+
 uint8_t MCPlusBuilder::getRegSize(MCPhysReg Reg) const {
   // SizeMap caches a mapping of registers to their sizes
   static std::vector<uint8_t> SizeMap;
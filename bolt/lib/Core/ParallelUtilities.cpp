@@ -13,10 +13,18 @@
 #include "bolt/Core/ParallelUtilities.h"
 #include "bolt/Core/BinaryContext.h"
 #include "bolt/Core/BinaryFunction.h"
+#include "bolt/Utils/CommandLineOpts.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/CrashRecoveryContext.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/Timer.h"
-#include <mutex>
-#include <shared_mutex>
+#include <algorithm>
+#include <atomic>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #define DEBUG_TYPE "par-utils"
 
@@ -41,6 +49,23 @@ TaskCount("tasks-per-thread",
   cl::init(20),
   cl::cat(BoltCategory));
 
+static cl::opt<bool>
+IsolatePassFailures("isolate-pass-failures",
+  cl::desc("run per-function pass work under crash recovery: a function that "
+           "makes a pass crash or assert is excluded from further processing "
+           "and emitted unmodified instead of aborting the whole run"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
+static cl::opt<bool>
+NumaAware("numa-aware",
+  cl::desc("partition parallel work across NUMA nodes and pin worker threads "
+           "to their node (Linux only)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 } // namespace opts
 
 namespace llvm {
@@ -51,15 +76,14 @@ namespace {
 /// A single thread pool that is used to run parallel tasks
 std::unique_ptr<ThreadPool> ThreadPoolPtr;
 
+/// Estimate the cost of running the work function on \p BF. The caller is
+/// expected to have applied the skip predicate already - the predicate may
+/// be arbitrarily expensive and should be evaluated once per function.
 unsigned computeCostFor(const BinaryFunction &BF,
-                        const PredicateTy &SkipPredicate,
                         const SchedulingPolicy &SchedPolicy) {
   if (SchedPolicy == SchedulingPolicy::SP_TRIVIAL)
     return 1;
 
-  if (SkipPredicate && SkipPredicate(BF))
-    return 0;
-
   switch (SchedPolicy) {
   case SchedulingPolicy::SP_CONSTANT:
     return 1;
@@ -76,27 +100,223 @@ unsigned computeCostFor(const BinaryFunction &BF,
   }
 }
 
-inline unsigned estimateTotalCost(const BinaryContext &BC,
-                                  const PredicateTy &SkipPredicate,
-                                  SchedulingPolicy &SchedPolicy) {
-  if (SchedPolicy == SchedulingPolicy::SP_TRIVIAL)
-    return BC.getBinaryFunctions().size();
-
-  unsigned TotalCost = 0;
+/// Collect the functions that are not rejected by \p SkipPredicate, ordered
+/// by decreasing estimated cost. Workers pull functions off this queue, so
+/// the most expensive function starts first while the remaining workers
+/// drain the tail, and the latency of a parallel phase tracks the largest
+/// single function instead of the unluckiest fixed partition.
+std::vector<BinaryFunction *> buildWorkQueue(BinaryContext &BC,
+                                             const PredicateTy &SkipPredicate,
+                                             const SchedulingPolicy &SchedPolicy) {
+  std::vector<std::pair<unsigned, BinaryFunction *>> Costs;
+  Costs.reserve(BC.getBinaryFunctions().size());
   for (auto &BFI : BC.getBinaryFunctions()) {
-    const BinaryFunction &BF = BFI.second;
-    TotalCost += computeCostFor(BF, SkipPredicate, SchedPolicy);
+    BinaryFunction &BF = BFI.second;
+    if (SkipPredicate && SkipPredicate(BF))
+      continue;
+    Costs.emplace_back(computeCostFor(BF, SchedPolicy), &BF);
+  }
+
+  // Keep the address order among functions of equal cost for determinism.
+  std::stable_sort(Costs.begin(), Costs.end(),
+                   [](const std::pair<unsigned, BinaryFunction *> &A,
+                      const std::pair<unsigned, BinaryFunction *> &B) {
+                     return A.first > B.first;
+                   });
+
+  std::vector<BinaryFunction *> Queue;
+  Queue.reserve(Costs.size());
+  for (const std::pair<unsigned, BinaryFunction *> &Cost : Costs)
+    Queue.push_back(Cost.second);
+  return Queue;
+}
+
+/// Run \p Work for \p BF, under crash recovery when -isolate-pass-failures
+/// is on. A crash or assertion failure inside the work function is contained
+/// to the function that triggered it: the function is marked ignored so it
+/// is emitted unmodified, the failure is reported, and the rest of the run
+/// proceeds. A failure may leave locks held or shared state half-updated, so
+/// this is a best-effort containment, not a correctness guarantee - hence
+/// off by default.
+void invokeWorkFunction(BinaryFunction &BF, StringRef LogName,
+                        function_ref<void()> Work) {
+  if (!opts::IsolatePassFailures) {
+    Work();
+    return;
+  }
+
+  // Install the recovery signal handlers once.
+  static const bool Enabled = [] {
+    CrashRecoveryContext::Enable();
+    return true;
+  }();
+  (void)Enabled;
+
+  CrashRecoveryContext CRC;
+  if (CRC.RunSafely(Work))
+    return;
+
+  errs() << "BOLT-WARNING: " << LogName << " failed for function " << BF
+         << "; the function will be ignored and emitted unmodified\n";
+  if (opts::processAllFunctions()) {
+    errs() << "BOLT-ERROR: cannot skip individual functions in the current "
+              "processing mode\n";
+    exit(1);
+  }
+  BF.setIgnored();
+}
+
+/// CPUs belonging to one NUMA node, in the order reported by the kernel.
+struct NumaNode {
+  std::vector<unsigned> CPUs;
+};
+
+/// Read the NUMA topology from sysfs. Returns an empty vector when the
+/// topology is unavailable (non-Linux hosts).
+std::vector<NumaNode> readNumaTopology() {
+  std::vector<NumaNode> Nodes;
+#ifdef __linux__
+  for (unsigned Id = 0;; ++Id) {
+    SmallString<64> Path;
+    raw_svector_ostream(Path) << "/sys/devices/system/node/node" << Id
+                              << "/cpulist";
+    ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(Path);
+    if (!MB)
+      break;
+
+    NumaNode Node;
+    SmallVector<StringRef, 8> Ranges;
+    MB.get()->getBuffer().trim().split(Ranges, ',');
+    for (StringRef Range : Ranges) {
+      Range = Range.trim();
+      if (Range.empty())
+        continue;
+      const std::pair<StringRef, StringRef> Split = Range.split('-');
+      unsigned Lo;
+      if (Split.first.getAsInteger(10, Lo))
+        continue;
+      unsigned Hi = Lo;
+      if (!Split.second.empty() && Split.second.getAsInteger(10, Hi))
+        continue;
+      for (unsigned CPU = Lo; CPU <= Hi; ++CPU)
+        Node.CPUs.push_back(CPU);
+    }
+    // Skip memory-only nodes with no CPUs attached.
+    if (!Node.CPUs.empty())
+      Nodes.push_back(std::move(Node));
   }
+#endif
+  return Nodes;
+}
 
-  // Switch to trivial scheduling if total estimated work is zero
-  if (TotalCost == 0) {
-    outs() << "BOLT-WARNING: Running parallel work of 0 estimated cost, will "
-              "switch to  trivial scheduling.\n";
+const std::vector<NumaNode> &getNumaTopology() {
+  static const std::vector<NumaNode> Nodes = readNumaTopology();
+  return Nodes;
+}
+
+#ifdef __linux__
+/// Restrict the calling thread to \p CPUs, saving the previous mask in
+/// \p SavedMask. Returns false if the affinity could not be changed.
+bool pinToCPUs(const std::vector<unsigned> &CPUs, cpu_set_t &SavedMask) {
+  if (sched_getaffinity(0, sizeof(SavedMask), &SavedMask) != 0)
+    return false;
+  cpu_set_t Mask;
+  CPU_ZERO(&Mask);
+  for (unsigned CPU : CPUs)
+    CPU_SET(CPU, &Mask);
+  return sched_setaffinity(0, sizeof(Mask), &Mask) == 0;
+}
+#endif
+
+/// Dispatch \p WorkerCount workers over the cost-ordered \p Queue and wait
+/// for completion. \p ProcessFn receives the function to process and the
+/// worker index in [0, WorkerCount).
+///
+/// With -numa-aware on a multi-node host, the queue is dealt round-robin into
+/// per-node queues (balancing total cost, since the input is sorted by
+/// decreasing cost), workers are pinned to the CPUs of their node for the
+/// duration of the phase, and a worker steals from other nodes only once its
+/// own node's queue is empty. Pinned workers fault in their working set
+/// node-locally via the kernel's first-touch policy.
+void dispatchWorkers(
+    const std::vector<BinaryFunction *> &Queue, size_t WorkerCount,
+    const std::string &LogName,
+    const std::function<void(BinaryFunction &, unsigned)> &ProcessFn) {
+  ThreadPool &Pool = getThreadPool();
+  const std::vector<NumaNode> &Nodes = getNumaTopology();
+
+  if (!opts::NumaAware || Nodes.size() < 2) {
+    std::atomic<size_t> NextItem{0};
+    auto runWorker = [&](unsigned WorkerId) {
+      Timer T(LogName, LogName);
+      LLVM_DEBUG(T.startTimer());
+      while (true) {
+        const size_t I = NextItem.fetch_add(1, std::memory_order_relaxed);
+        if (I >= Queue.size())
+          break;
+        ProcessFn(*Queue[I], WorkerId);
+      }
+      LLVM_DEBUG(T.stopTimer());
+    };
+    for (unsigned I = 0; I < WorkerCount; ++I)
+      Pool.async(runWorker, I);
+    Pool.wait();
+    return;
+  }
 
-    SchedPolicy = SP_TRIVIAL;
-    TotalCost = BC.getBinaryFunctions().size();
+  const size_t NumNodes = Nodes.size();
+  std::vector<std::vector<BinaryFunction *>> NodeQueues(NumNodes);
+  for (size_t I = 0; I < Queue.size(); ++I)
+    NodeQueues[I % NumNodes].push_back(Queue[I]);
+  std::unique_ptr<std::atomic<size_t>[]> NextItem(
+      new std::atomic<size_t>[NumNodes]);
+  for (size_t N = 0; N < NumNodes; ++N)
+    NextItem[N] = 0;
+
+  // Assign workers to nodes proportionally to each node's CPU count.
+  std::vector<unsigned> WorkerNodeIds;
+  WorkerNodeIds.reserve(WorkerCount);
+  std::vector<size_t> Assigned(NumNodes, 0);
+  for (size_t W = 0; W < WorkerCount; ++W) {
+    size_t Best = 0;
+    for (size_t N = 1; N < NumNodes; ++N)
+      if (Assigned[N] * Nodes[Best].CPUs.size() <
+          Assigned[Best] * Nodes[N].CPUs.size())
+        Best = N;
+    WorkerNodeIds.push_back(Best);
+    ++Assigned[Best];
   }
-  return TotalCost;
+
+  auto runWorker = [&](unsigned WorkerId) {
+    const unsigned NodeId = WorkerNodeIds[WorkerId];
+#ifdef __linux__
+    cpu_set_t SavedMask;
+    const bool Pinned = pinToCPUs(Nodes[NodeId].CPUs, SavedMask);
+#endif
+    Timer T(LogName, LogName);
+    LLVM_DEBUG(T.startTimer());
+    // Drain the home node's queue first; steal from the other nodes only
+    // after it is exhausted.
+    for (size_t Offset = 0; Offset < NumNodes; ++Offset) {
+      const size_t N = (NodeId + Offset) % NumNodes;
+      while (true) {
+        const size_t I = NextItem[N].fetch_add(1, std::memory_order_relaxed);
+        if (I >= NodeQueues[N].size())
+          break;
+        ProcessFn(*NodeQueues[N][I], WorkerId);
+      }
+    }
+    LLVM_DEBUG(T.stopTimer());
+#ifdef __linux__
+    // Pool threads outlive this phase - restore the original mask.
+    if (Pinned)
+      sched_setaffinity(0, sizeof(SavedMask), &SavedMask);
+#endif
+  };
+
+  for (unsigned I = 0; I < WorkerCount; ++I)
+    Pool.async(runWorker, I);
+  Pool.wait();
 }
 
 } // namespace
@@ -127,7 +347,7 @@ void runOnEachFunction(BinaryContext &BC, SchedulingPolicy SchedPolicy,
       if (SkipPredicate && SkipPredicate(BF))
         continue;
 
-      WorkFunction(BF);
+      invokeWorkFunction(BF, LogName, [&] { WorkFunction(BF); });
     }
     LLVM_DEBUG(T.stopTimer());
   };
@@ -137,30 +357,19 @@ void runOnEachFunction(BinaryContext &BC, SchedulingPolicy SchedPolicy,
     return;
   }
 
-  // Estimate the overall runtime cost using the scheduling policy
-  const unsigned TotalCost = estimateTotalCost(BC, SkipPredicate, SchedPolicy);
-  const unsigned BlocksCount = TasksPerThread * opts::ThreadCount;
-  const unsigned BlockCost =
-      TotalCost > BlocksCount ? TotalCost / BlocksCount : 1;
+  // Schedule dynamically: workers pull the next unprocessed function from a
+  // queue ordered by decreasing estimated cost.
+  const std::vector<BinaryFunction *> Queue =
+      buildWorkQueue(BC, SkipPredicate, SchedPolicy);
+  if (Queue.empty())
+    return;
 
-  // Divide work into blocks of equal cost
-  ThreadPool &Pool = getThreadPool();
-  auto BlockBegin = BC.getBinaryFunctions().begin();
-  unsigned CurrentCost = 0;
-
-  for (auto It = BC.getBinaryFunctions().begin();
-       It != BC.getBinaryFunctions().end(); ++It) {
-    BinaryFunction &BF = It->second;
-    CurrentCost += computeCostFor(BF, SkipPredicate, SchedPolicy);
-
-    if (CurrentCost >= BlockCost) {
-      Pool.async(runBlock, BlockBegin, std::next(It));
-      BlockBegin = std::next(It);
-      CurrentCost = 0;
-    }
-  }
-  Pool.async(runBlock, BlockBegin, BC.getBinaryFunctions().end());
-  Pool.wait();
+  const size_t WorkerCount =
+      std::min<size_t>(opts::ThreadCount, Queue.size());
+  dispatchWorkers(Queue, WorkerCount, LogName,
+                  [&](BinaryFunction &BF, unsigned) {
+                    invokeWorkFunction(BF, LogName, [&] { WorkFunction(BF); });
+                  });
 }
 
 void runOnEachFunctionWithUniqueAllocId(
@@ -170,19 +379,17 @@ void runOnEachFunctionWithUniqueAllocId(
   if (BC.getBinaryFunctions().size() == 0)
     return;
 
-  std::shared_timed_mutex MainLock;
   auto runBlock = [&](std::map<uint64_t, BinaryFunction>::iterator BlockBegin,
                       std::map<uint64_t, BinaryFunction>::iterator BlockEnd,
                       MCPlusBuilder::AllocatorIdTy AllocId) {
     Timer T(LogName, LogName);
     LLVM_DEBUG(T.startTimer());
-    std::shared_lock<std::shared_timed_mutex> Lock(MainLock);
     for (auto It = BlockBegin; It != BlockEnd; ++It) {
       BinaryFunction &BF = It->second;
       if (SkipPredicate && SkipPredicate(BF))
         continue;
 
-      WorkFunction(BF, AllocId);
+      invokeWorkFunction(BF, LogName, [&] { WorkFunction(BF, AllocId); });
     }
     LLVM_DEBUG(T.stopTimer());
   };
@@ -191,49 +398,34 @@ void runOnEachFunctionWithUniqueAllocId(
     runBlock(BC.getBinaryFunctions().begin(), BC.getBinaryFunctions().end(), 0);
     return;
   }
-  // This lock is used to postpone task execution
-  std::unique_lock<std::shared_timed_mutex> Lock(MainLock);
 
-  // Estimate the overall runtime cost using the scheduling policy
-  const unsigned TotalCost = estimateTotalCost(BC, SkipPredicate, SchedPolicy);
-  const unsigned BlocksCount = TasksPerThread * opts::ThreadCount;
-  const unsigned BlockCost =
-      TotalCost > BlocksCount ? TotalCost / BlocksCount : 1;
+  // Schedule dynamically: workers pull the next unprocessed function from a
+  // queue ordered by decreasing estimated cost. Each worker owns a unique
+  // annotation allocator for its lifetime instead of one allocator per fixed
+  // block.
+  const std::vector<BinaryFunction *> Queue =
+      buildWorkQueue(BC, SkipPredicate, SchedPolicy);
+  if (Queue.empty())
+    return;
 
-  // Divide work into blocks of equal cost
-  ThreadPool &Pool = getThreadPool();
-  auto BlockBegin = BC.getBinaryFunctions().begin();
-  unsigned CurrentCost = 0;
-  unsigned AllocId = 1;
-  for (auto It = BC.getBinaryFunctions().begin();
-       It != BC.getBinaryFunctions().end(); ++It) {
-    BinaryFunction &BF = It->second;
-    CurrentCost += computeCostFor(BF, SkipPredicate, SchedPolicy);
-
-    if (CurrentCost >= BlockCost) {
-      if (!BC.MIB->checkAllocatorExists(AllocId)) {
-        MCPlusBuilder::AllocatorIdTy Id =
-            BC.MIB->initializeNewAnnotationAllocator();
-        (void)Id;
-        assert(AllocId == Id && "unexpected allocator id created");
-      }
-      Pool.async(runBlock, BlockBegin, std::next(It), AllocId);
-      AllocId++;
-      BlockBegin = std::next(It);
-      CurrentCost = 0;
-    }
-  }
+  const size_t WorkerCount =
+      std::min<size_t>(opts::ThreadCount, Queue.size());
 
-  if (!BC.MIB->checkAllocatorExists(AllocId)) {
-    MCPlusBuilder::AllocatorIdTy Id =
-        BC.MIB->initializeNewAnnotationAllocator();
-    (void)Id;
-    assert(AllocId == Id && "unexpected allocator id created");
+  // Create all annotation allocators before any worker runs.
+  for (unsigned AllocId = 1; AllocId <= WorkerCount; ++AllocId) {
+    if (!BC.MIB->checkAllocatorExists(AllocId)) {
+      MCPlusBuilder::AllocatorIdTy Id =
+          BC.MIB->initializeNewAnnotationAllocator();
+      (void)Id;
+      assert(AllocId == Id && "unexpected allocator id created");
+    }
   }
 
-  Pool.async(runBlock, BlockBegin, BC.getBinaryFunctions().end(), AllocId);
-  Lock.unlock();
-  Pool.wait();
+  dispatchWorkers(Queue, WorkerCount, LogName,
+                  [&](BinaryFunction &BF, unsigned WorkerId) {
+                    invokeWorkFunction(
+                        BF, LogName, [&] { WorkFunction(BF, WorkerId + 1); });
+                  });
 }
 
 } // namespace ParallelUtilities
@@ -24,6 +24,18 @@ extern cl::OptionCategory BoltOptCategory;
 extern cl::opt<bool> AlignBlocks;
 extern cl::opt<bool> PreserveBlocksAlignment;
 
+cl::opt<unsigned>
+AlignBlocksBudget("align-blocks-budget",
+  cl::desc("total number of padding bytes the basic block aligner may insert "
+           "into the binary. Blocks are aligned in the order of the "
+           "profile-weighted benefit of aligning them until the budget is "
+           "spent, instead of applying -align-blocks-threshold to every "
+           "function independently. A value of 0 disables the budget."),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 cl::opt<unsigned>
 AlignBlocksMinSize("align-blocks-min-size",
   cl::desc("minimal size of the basic block that should be aligned"),
@@ -57,6 +69,22 @@ AlignFunctionsMaxBytes("align-functions-max-bytes",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+cl::opt<bool>
+AlignHotTargets("align-hot-targets",
+  cl::desc("align hot branch targets to fetch-block boundaries when the "
+           "profile-weighted benefit outweighs the padding cost"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+cl::opt<bool>
+AlignLoops("align-loops",
+  cl::desc("align hot innermost loops and keep loops that fit into a single "
+           "fetch block from crossing its boundary"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 cl::opt<unsigned>
 BlockAlignment("block-alignment",
   cl::desc("boundary to use for alignment of basic blocks"),
@@ -64,6 +92,14 @@ BlockAlignment("block-alignment",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+cl::opt<unsigned>
+FetchBlockSize("fetch-block-size",
+  cl::desc("size of the instruction fetch block in bytes"),
+  cl::init(64),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 cl::opt<bool>
 UseCompactAligner("use-compact-aligner",
   cl::desc("Use compact approach for aligning functions"),
@@ -162,6 +198,223 @@ void AlignerPass::alignBlocks(BinaryFunction &Function,
   }
 }
 
+void AlignerPass::collectBudgetCandidates(BinaryFunction &Function,
+                                          const MCCodeEmitter *Emitter) {
+  if (!Function.hasValidProfile() || !Function.isSimple())
+    return;
+
+  const BinaryContext &BC = Function.getBinaryContext();
+
+  BinaryBasicBlock *PrevBB = nullptr;
+  for (BinaryBasicBlock *BB : Function.layout()) {
+    const uint64_t Count = BB->getKnownExecutionCount();
+
+    uint64_t FTCount = 0;
+    if (PrevBB && PrevBB->getFallthrough() == BB)
+      FTCount = PrevBB->getBranchInfo(*BB).Count;
+    PrevBB = BB;
+
+    // Only entries via taken branches benefit from the alignment, while
+    // fall-through entries execute the inserted padding. A mostly
+    // fall-through block is never worth aligning.
+    if (BB->isCold() || Count < FTCount * 2)
+      continue;
+    const uint64_t TakenCount = Count - FTCount;
+    if (TakenCount == 0)
+      continue;
+
+    const uint64_t BlockSize =
+        BC.computeCodeSize(BB->begin(), BB->end(), Emitter);
+    if (opts::AlignBlocksMinSize && BlockSize < opts::AlignBlocksMinSize)
+      continue;
+
+    BudgetCandidate Candidate;
+    // The misfetch penalty of an unaligned target is roughly constant per
+    // taken entry, so candidates are ranked by the taken entry count alone.
+    Candidate.Score = TakenCount;
+    Candidate.MaxBytes = std::min<uint64_t>(opts::BlockAlignment - 1,
+                                            BlockSize);
+    Candidate.FunctionAddress = Function.getAddress();
+    Candidate.InputOffset = BB->getInputOffset();
+    Candidate.BB = BB;
+
+    std::lock_guard<std::mutex> Lock(BudgetCandidatesMtx);
+    BudgetCandidates.emplace_back(Candidate);
+  }
+}
+
+void AlignerPass::applyAlignmentBudget() {
+  // Candidates are collected in parallel; impose a deterministic order
+  // before allocating the budget.
+  std::stable_sort(BudgetCandidates.begin(), BudgetCandidates.end(),
+                   [](const BudgetCandidate &A, const BudgetCandidate &B) {
+                     if (A.Score != B.Score)
+                       return A.Score > B.Score;
+                     if (A.FunctionAddress != B.FunctionAddress)
+                       return A.FunctionAddress < B.FunctionAddress;
+                     return A.InputOffset < B.InputOffset;
+                   });
+
+  uint64_t BytesLeft = opts::AlignBlocksBudget;
+  uint64_t NumAligned = 0;
+  for (const BudgetCandidate &Candidate : BudgetCandidates) {
+    // Keep the decisions of the loop-aware alignment, which ran earlier and
+    // takes precedence for blocks that are part of hot loops.
+    if (Candidate.BB->getAlignment() > 1)
+      continue;
+
+    // Charge the worst case since the final block offsets are unknown until
+    // emission. Cheaper candidates may still fit after a skip.
+    if (Candidate.MaxBytes > BytesLeft)
+      continue;
+    BytesLeft -= Candidate.MaxBytes;
+
+    Candidate.BB->setAlignment(opts::BlockAlignment);
+    Candidate.BB->setAlignmentMaxBytes(Candidate.MaxBytes);
+    ++NumAligned;
+
+    LLVM_DEBUG(
+      AlignHistogram[Candidate.MaxBytes]++;
+      AlignedBlocksCount += Candidate.BB->getKnownExecutionCount();
+    );
+  }
+
+  outs() << "BOLT-INFO: budgeted block alignment aligned " << NumAligned
+         << " out of " << BudgetCandidates.size() << " candidate blocks "
+         << "reserving " << (opts::AlignBlocksBudget - BytesLeft) << " out of "
+         << opts::AlignBlocksBudget << " padding bytes\n";
+}
+
+void AlignerPass::alignFetchBlocks(BinaryFunction &Function,
+                                   const MCCodeEmitter *Emitter) {
+  if (!Function.hasValidProfile() || !Function.isSimple())
+    return;
+
+  const BinaryContext &BC = Function.getBinaryContext();
+  const uint64_t FBS = opts::FetchBlockSize;
+
+  // Offsets are relative to the function start, which is fetch-block aligned
+  // in relocation mode unless alignment was capped by max-alignment-bytes.
+  // Since the pass runs after block reordering, the sizes measured here match
+  // the layout that will be emitted.
+  uint64_t Offset = 0;
+  BinaryBasicBlock *PrevBB = nullptr;
+  for (BinaryBasicBlock *BB : Function.layout()) {
+    // The cold part is emitted separately and is not fetch-critical.
+    if (BB->isCold())
+      break;
+
+    const uint64_t BlockSize =
+        BC.computeCodeSize(BB->begin(), BB->end(), Emitter);
+    const uint64_t Count = BB->getKnownExecutionCount();
+
+    uint64_t FTCount = 0;
+    if (PrevBB && PrevBB->getFallthrough() == BB)
+      FTCount = PrevBB->getBranchInfo(*BB).Count;
+    PrevBB = BB;
+
+    const uint64_t Padding = (FBS - Offset % FBS) % FBS;
+    Offset += BlockSize;
+
+    if (Padding == 0)
+      continue;
+
+    // Entries via taken branches start a new fetch. They save one fetch block
+    // each if the target stops straddling a boundary within its first FBS
+    // bytes. Fall-through entries pay for the padding instead, fetching the
+    // inserted nops. Require the weighted benefit to clearly dominate.
+    const bool Straddles =
+        ((Offset - BlockSize) % FBS) + std::min(BlockSize, FBS) > FBS;
+    const uint64_t TakenCount = Count > FTCount ? Count - FTCount : 0;
+    if (!Straddles || TakenCount * FBS <= 2 * FTCount * Padding)
+      continue;
+
+    BB->setAlignment(FBS);
+    BB->setAlignmentMaxBytes(Padding);
+
+    // Block offsets are exact again after an alignment point.
+    Offset += Padding;
+
+    FetchAlignedCount++;
+    FetchPaddingBytes += Padding;
+    FetchCrossingsSaved += TakenCount;
+  }
+}
+
+void AlignerPass::alignLoops(BinaryFunction &Function,
+                             const MCCodeEmitter *Emitter) {
+  if (!Function.hasValidProfile() || !Function.isSimple())
+    return;
+
+  const BinaryContext &BC = Function.getBinaryContext();
+  const uint64_t FBS = opts::FetchBlockSize;
+  const uint64_t FuncCount =
+      std::max<uint64_t>(1, Function.getKnownExecutionCount());
+
+  Function.calculateLoopInfo();
+  if (Function.getLoopInfo().empty())
+    return;
+  Function.updateLayoutIndices();
+
+  const BinaryFunction::BasicBlockOrderType Layout = Function.getLayout();
+
+  SmallVector<const BinaryLoop *, 8> Worklist;
+  for (auto I = Function.getLoopInfo().begin(),
+            E = Function.getLoopInfo().end();
+       I != E; ++I)
+    Worklist.push_back(*I);
+
+  while (!Worklist.empty()) {
+    const BinaryLoop *L = Worklist.pop_back_val();
+    for (const BinaryLoop *Inner : *L)
+      Worklist.push_back(Inner);
+
+    BinaryBasicBlock *Header = L->getHeader();
+    if (Header->isCold() ||
+        Header->getKnownExecutionCount() <=
+            FuncCount * opts::AlignBlocksThreshold / 100)
+      continue;
+
+    // Whole-loop containment only makes sense for an innermost loop that is
+    // laid out contiguously in the hot part.
+    bool IsContiguous = L->isInnermost();
+    unsigned MinIndex = UINT_MAX;
+    unsigned MaxIndex = 0;
+    uint64_t LoopSize = 0;
+    if (IsContiguous) {
+      for (BinaryBasicBlock *BB : L->blocks()) {
+        if (BB->isCold()) {
+          IsContiguous = false;
+          break;
+        }
+        MinIndex = std::min(MinIndex, BB->getLayoutIndex());
+        MaxIndex = std::max(MaxIndex, BB->getLayoutIndex());
+        LoopSize += BC.computeCodeSize(BB->begin(), BB->end(), Emitter);
+      }
+      IsContiguous &= MaxIndex - MinIndex + 1 == L->getNumBlocks();
+    }
+
+    if (IsContiguous && LoopSize <= FBS) {
+      // Pad in front of the first block of the loop region so that the whole
+      // loop shares one fetch block. The padding is only executed when the
+      // loop is entered by falling through, while every iteration benefits.
+      BinaryBasicBlock *First = Layout[MinIndex];
+      First->setAlignment(FBS);
+      First->setAlignmentMaxBytes(std::min<uint64_t>(FBS - 1, LoopSize));
+      ++ContainedLoopsCount;
+      continue;
+    }
+
+    // The loop does not fit; align just the header like a hot branch target.
+    const uint64_t HeaderSize =
+        BC.computeCodeSize(Header->begin(), Header->end(), Emitter);
+    Header->setAlignment(opts::BlockAlignment);
+    Header->setAlignmentMaxBytes(
+        std::min<uint64_t>(opts::BlockAlignment - 1, HeaderSize));
+    ++AlignedLoopHeadersCount;
+  }
+}
+
 void AlignerPass::runOnFunctions(BinaryContext &BC) {
   if (!BC.HasRelocations)
     return;
@@ -178,14 +431,28 @@ void AlignerPass::runOnFunctions(BinaryContext &BC) {
     else
       alignMaxBytes(BF);
 
-    if (opts::AlignBlocks && !opts::PreserveBlocksAlignment)
-      alignBlocks(BF, Emitter.MCE.get());
+    if (!opts::PreserveBlocksAlignment) {
+      if (opts::AlignHotTargets)
+        alignFetchBlocks(BF, Emitter.MCE.get());
+      else if (opts::AlignBlocks && opts::AlignBlocksBudget)
+        collectBudgetCandidates(BF, Emitter.MCE.get());
+      else if (opts::AlignBlocks)
+        alignBlocks(BF, Emitter.MCE.get());
+      // Loop-aware alignment runs last so that its decisions take precedence
+      // for blocks that are part of hot loops.
+      if (opts::AlignLoops)
+        alignLoops(BF, Emitter.MCE.get());
+    }
   };
 
   ParallelUtilities::runOnEachFunction(
       BC, ParallelUtilities::SchedulingPolicy::SP_TRIVIAL, WorkFun,
       ParallelUtilities::PredicateTy(nullptr), "AlignerPass");
 
+  if (!opts::PreserveBlocksAlignment && !opts::AlignHotTargets &&
+      opts::AlignBlocks && opts::AlignBlocksBudget)
+    applyAlignmentBudget();
+
   LLVM_DEBUG(
     dbgs() << "BOLT-DEBUG: max bytes per basic block alignment distribution:\n";
     for (unsigned I = 1; I < AlignHistogram.size(); ++I)
@@ -194,6 +461,19 @@ void AlignerPass::runOnFunctions(BinaryContext &BC) {
     dbgs() << "BOLT-DEBUG: total execution count of aligned blocks: "
            << AlignedBlocksCount << '\n';
   );
+
+  if (opts::AlignLoops && (ContainedLoopsCount || AlignedLoopHeadersCount))
+    outs() << "BOLT-INFO: placed " << ContainedLoopsCount
+           << " innermost loops within a single " << opts::FetchBlockSize
+           << "-byte fetch block and aligned " << AlignedLoopHeadersCount
+           << " hot loop headers\n";
+
+  if (opts::AlignHotTargets && FetchAlignedCount)
+    outs() << "BOLT-INFO: aligned " << FetchAlignedCount
+           << " hot branch targets to " << opts::FetchBlockSize
+           << "-byte fetch blocks using " << FetchPaddingBytes
+           << " bytes of padding. Expect " << FetchCrossingsSaved
+           << " fewer dynamic fetch-block crossings.\n";
 }
 
 } // end namespace bolt
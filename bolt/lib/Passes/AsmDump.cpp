@@ -11,6 +11,8 @@
 //===----------------------------------------------------------------------===//
 
 #include "bolt/Passes/AsmDump.h"
+#include "bolt/Core/ParallelUtilities.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/CodeGen/AsmPrinter.h"
 #include "llvm/MC/TargetRegistry.h"
 #include "llvm/Support/FileSystem.h"
@@ -74,7 +76,8 @@ void dumpTailCallFdata(raw_ostream &OS, const BinaryFunction &BF,
                        const MCInst &Instr, const std::string &BranchLabel) {
   const BinaryContext &BC = BF.getBinaryContext();
   StringRef FunctionName = BF.getOneName();
-  auto CallFreq = BC.MIB->getAnnotationWithDefault<uint64_t>(Instr, "Count");
+  auto CallFreq = BC.MIB->getAnnotationWithDefault<uint64_t>(
+      Instr, MCPlus::MCAnnotation::kCount);
   const MCSymbol *Target = BC.MIB->getTargetSymbol(Instr);
   const BinaryFunction *TargetBF = BC.getFunctionForSymbol(Target);
   if (!TargetBF)
@@ -128,15 +131,6 @@ void dumpFunction(const BinaryFunction &BF) {
   if (!opts::shouldPrint(BF))
     return;
 
-  // Make sure the new directory exists, creating it if necessary.
-  if (!opts::AsmDump.empty()) {
-    if (std::error_code EC = sys::fs::create_directories(opts::AsmDump)) {
-      errs() << "BOLT-ERROR: could not create directory '" << opts::AsmDump
-             << "': " << EC.message() << '\n';
-      exit(1);
-    }
-  }
-
   std::string PrintName = BF.getPrintName();
   std::replace(PrintName.begin(), PrintName.end(), '/', '-');
   std::string Filename =
@@ -144,7 +138,8 @@ void dumpFunction(const BinaryFunction &BF) {
           ? (PrintName + ".s")
           : (opts::AsmDump + sys::path::get_separator() + PrintName + ".s")
                 .str();
-  outs() << "BOLT-INFO: Dumping function assembly to " << Filename << "\n";
+  if (opts::Verbosity >= 1)
+    outs() << "BOLT-INFO: Dumping function assembly to " << Filename << "\n";
 
   std::error_code EC;
   raw_fd_ostream OS(Filename, EC, sys::fs::OF_None);
@@ -231,7 +226,7 @@ void dumpFunction(const BinaryFunction &BF) {
       if (&Instr == LastInst && (BB->succ_size() || IsCall))
         OS << BranchLabel << ":\n";
 
-      BC.InstPrinter->printInst(&Instr, 0, "", *BC.STI, OS);
+      InstructionPrinter->printInst(&Instr, 0, "", *BC.STI, OS);
       OS << '\n';
 
       // Dump profile data in FDATA format (as parsed by link_fdata).
@@ -275,8 +270,38 @@ void dumpFunction(const BinaryFunction &BF) {
 }
 
 void AsmDumpPass::runOnFunctions(BinaryContext &BC) {
-  for (const auto &BFIt : BC.getBinaryFunctions())
-    dumpFunction(BFIt.second);
+  // Make sure the dump directory exists before the workers write to it.
+  if (!opts::AsmDump.empty()) {
+    if (std::error_code EC = sys::fs::create_directories(opts::AsmDump)) {
+      errs() << "BOLT-ERROR: could not create directory '" << opts::AsmDump
+             << "': " << EC.message() << '\n';
+      exit(1);
+    }
+  }
+
+  // Every function is dumped into its own file, and dumpFunction() creates
+  // its own MC context, streamer and instruction printer, so the workers
+  // share no output state and can run concurrently.
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
+    dumpFunction(BF);
+  };
+
+  ParallelUtilities::PredicateTy SkipPredicate =
+      [&](const BinaryFunction &BF) { return !opts::shouldPrint(BF); };
+
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+      SkipPredicate, "AsmDump");
+
+  const size_t NumDumped =
+      llvm::count_if(BC.getBinaryFunctions(),
+                     [](const std::pair<const uint64_t, BinaryFunction> &BFI) {
+                       return opts::shouldPrint(BFI.second);
+                     });
+  outs() << "BOLT-INFO: dumped assembly of " << NumDumped << " function(s)";
+  if (!opts::AsmDump.empty())
+    outs() << " to directory " << opts::AsmDump;
+  outs() << '\n';
 }
 
 } // namespace bolt
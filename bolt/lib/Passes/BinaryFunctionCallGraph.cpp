@@ -175,9 +175,10 @@ buildCallGraph(BinaryContext &BC, CgFilterFunction Filter, bool CgFromPerfData,
       const MCSymbol *DstSym = BC.MIB->getTargetSymbol(Inst);
 
       // If this is an indirect call use perf data directly.
-      if (!DstSym && BC.MIB->hasAnnotation(Inst, "CallProfile")) {
+      if (!DstSym &&
+          BC.MIB->hasAnnotation(Inst, MCPlus::MCAnnotation::kCallProfile)) {
         const auto &ICSP = BC.MIB->getAnnotationAs<IndirectCallSiteProfile>(
-            Inst, "CallProfile");
+            Inst, MCPlus::MCAnnotation::kCallProfile);
         for (const IndirectCallProfile &CSI : ICSP)
           if (CSI.Symbol)
             Counts.emplace_back(CSI.Symbol, CSI.Count);
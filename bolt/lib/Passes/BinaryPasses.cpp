@@ -12,11 +12,23 @@
 
 #include "bolt/Passes/BinaryPasses.h"
 #include "bolt/Core/ParallelUtilities.h"
+#include "bolt/Passes/BinaryFunctionCallGraph.h"
+#include "bolt/Passes/CacheMetrics.h"
 #include "bolt/Passes/ReorderAlgorithm.h"
 #include "bolt/Passes/ReorderFunctions.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
 
+#include <algorithm>
+#include <array>
+#include <mutex>
 #include <numeric>
+#include <unordered_map>
 #include <vector>
 
 #define DEBUG_TYPE "bolt-opts"
@@ -61,6 +73,7 @@ extern cl::opt<bolt::MacroFusionType> AlignMacroOpFusion;
 extern cl::opt<unsigned> Verbosity;
 extern cl::opt<bool> EnableBAT;
 extern cl::opt<unsigned> ExecutionCountThreshold;
+extern cl::opt<bool> SplitRegions;
 extern cl::opt<bool> UpdateDebugSections;
 extern cl::opt<bolt::ReorderFunctions::ReorderType> ReorderFunctions;
 
@@ -77,6 +90,24 @@ DynoStatsSortOrderOpt("print-sorted-by-order",
   cl::init(DynoStatsSortOrder::Descending),
   cl::cat(BoltOptCategory));
 
+static cl::list<std::string>
+DynoStatsThresholds("dyno-stats-threshold",
+  cl::CommaSeparated,
+  cl::desc("fail the run when a program-wide dyno stats metric is predicted "
+           "to regress by more than the given percentage, e.g. "
+           "taken-branches=0,instructions=2. Metric names match the "
+           "-print-sorted-by keys; 'all' sets a default for every metric"),
+  cl::value_desc("metric=pct,..."),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<std::string>
+DynoStatsVerdictFile("dyno-stats-verdict-file",
+  cl::desc("write the per-metric dyno stats delta and the verdict in JSON "
+           "to <file> ('-' for stdout)"),
+  cl::value_desc("file"),
+  cl::cat(BoltOptCategory));
+
 cl::list<std::string>
 HotTextMoveSections("hot-text-move-sections",
   cl::desc("list of sections containing functions used for hugifying hot text. "
@@ -129,6 +160,30 @@ Peepholes("peepholes",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::list<std::string>
+BlockLayoutCacheFile("block-layout-cache",
+  cl::desc("file caching optimized basic block layouts keyed by function "
+           "hash. Incremental runs reuse the layout of functions whose code "
+           "and profile did not change. May be given multiple times to merge "
+           "caches produced by -block-layout-shard runs; the updated cache "
+           "is written to the first file"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<std::string>
+BlockLayoutShard("block-layout-shard",
+  cl::desc("compute block layouts for one shard of the functions only, given "
+           "as <n>/<m> with shards numbered from 1. Each shard run saves its "
+           "layouts to its -block-layout-cache file, so the layout work for "
+           "one binary can be spread over several machines and a final run "
+           "merges the shard caches"),
+  cl::value_desc("n/m"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<unsigned>
 PrintFuncStat("print-function-statistics",
   cl::desc("print statistics about basic block ordering"),
@@ -153,6 +208,14 @@ PrintSortedBy("print-sorted-by",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+GCFunctions("gc-functions",
+  cl::desc("place functions that are provably unreachable from exported or "
+           "address-taken code with the never-executed code"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 PrintUnknown("print-unknown",
   cl::desc("print names of functions with unknown control flow"),
@@ -191,7 +254,10 @@ cl::opt<bolt::ReorderBasicBlocks::LayoutType> ReorderBlocks(
         clEnumValN(bolt::ReorderBasicBlocks::LT_OPTIMIZE_EXT_TSP, "ext-tsp",
                    "perform layout optimizing I-cache behavior"),
         clEnumValN(bolt::ReorderBasicBlocks::LT_OPTIMIZE_SHUFFLE,
-                   "cluster-shuffle", "perform random layout of clusters")),
+                   "cluster-shuffle", "perform random layout of clusters"),
+        clEnumValN(bolt::ReorderBasicBlocks::LT_OPTIMIZE_BEST, "best",
+                   "evaluate the layout algorithms on every function and "
+                   "keep the one with the best extended TSP score")),
     cl::ZeroOrMore, cl::cat(BoltOptCategory));
 
 static cl::opt<unsigned>
@@ -271,6 +337,108 @@ bool BinaryFunctionPass::shouldPrint(const BinaryFunction &BF) const {
   return BF.isSimple() && !BF.isIgnored();
 }
 
+bool DynoStatsVerdictPass::isEnabled() {
+  return !opts::DynoStatsThresholds.empty() ||
+         !opts::DynoStatsVerdictFile.empty();
+}
+
+void DynoStatsVerdictPass::runOnFunctions(BinaryContext &BC) {
+  // Thresholds are keyed by the hyphenated metric names used by
+  // -print-sorted-by; "all" sets the default for every metric.
+  Optional<double> DefaultThreshold;
+  StringMap<double> Thresholds;
+  for (const std::string &Entry : opts::DynoStatsThresholds) {
+    const std::pair<StringRef, StringRef> Parts = StringRef(Entry).split('=');
+    double Percent;
+    if (Parts.first.empty() || Parts.second.getAsDouble(Percent)) {
+      errs() << "BOLT-ERROR: malformed -dyno-stats-threshold entry \"" << Entry
+             << "\", expected <metric>=<percent>\n";
+      exit(1);
+    }
+    if (Parts.first == "all")
+      DefaultThreshold = Percent;
+    else
+      Thresholds[Parts.first] = Percent;
+  }
+
+  const DynoStats NewDynoStats = getDynoStats(BC.getBinaryFunctions());
+  std::vector<StringRef> Regressions;
+  json::Array Metrics;
+  for (auto Stat = DynoStats::FIRST_DYNO_STAT + 1;
+       Stat < DynoStats::LAST_DYNO_STAT; ++Stat) {
+    const auto Category = static_cast<DynoStats::Category>(Stat);
+    if (Category == DynoStats::VENEER_CALLS_AARCH64 && !BC.isAArch64())
+      continue;
+
+    const StringRef Name = dynoStatsOptName(Category);
+    const uint64_t Before = PrevDynoStats[Category];
+    const uint64_t After = NewDynoStats[Category];
+    Optional<double> Threshold = DefaultThreshold;
+    const auto ThresholdIt = Thresholds.find(Name);
+    if (ThresholdIt != Thresholds.end()) {
+      Threshold = ThresholdIt->second;
+      Thresholds.erase(ThresholdIt);
+    }
+
+    // A higher count predicts a regression for every metric except fused
+    // pairs, where a drop means branches lost their fusion partner. A
+    // metric starting at zero regresses on any movement in the wrong
+    // direction regardless of the threshold.
+    const bool HigherIsBetter = Category == DynoStats::MACRO_FUSION_PAIRS;
+    const bool Regressed =
+        Threshold &&
+        (HigherIsBetter
+             ? (double)After < (double)Before * (1.0 - *Threshold / 100.0)
+             : (double)After > (double)Before * (1.0 + *Threshold / 100.0));
+    if (Regressed)
+      Regressions.push_back(Name);
+
+    json::Object Metric;
+    Metric["name"] = Name;
+    Metric["before"] = Before;
+    Metric["after"] = After;
+    if (Before)
+      Metric["change-pct"] =
+          100.0 * ((double)After - (double)Before) / (double)Before;
+    if (Threshold) {
+      Metric["threshold-pct"] = *Threshold;
+      Metric["regressed"] = Regressed;
+    }
+    Metrics.push_back(std::move(Metric));
+  }
+
+  if (!Thresholds.empty()) {
+    errs() << "BOLT-ERROR: unknown dyno stats metric \""
+           << Thresholds.begin()->first() << "\" in -dyno-stats-threshold\n";
+    exit(1);
+  }
+
+  json::Object Verdict;
+  Verdict["verdict"] = Regressions.empty() ? "pass" : "fail";
+  Verdict["metrics"] = std::move(Metrics);
+
+  if (!opts::DynoStatsVerdictFile.empty()) {
+    std::error_code EC;
+    raw_fd_ostream OS(opts::DynoStatsVerdictFile, EC, sys::fs::OF_None);
+    if (EC) {
+      errs() << "BOLT-ERROR: cannot write dyno stats verdict to "
+             << opts::DynoStatsVerdictFile << ": " << EC.message() << '\n';
+      exit(1);
+    }
+    OS << json::Value(std::move(Verdict)) << '\n';
+  }
+
+  if (!Regressions.empty()) {
+    errs() << "BOLT-ERROR: dyno stats verdict: predicted regression in";
+    for (const StringRef Name : Regressions)
+      errs() << ' ' << Name;
+    errs() << '\n';
+    exit(1);
+  }
+
+  outs() << "BOLT-INFO: dyno stats verdict: pass\n";
+}
+
 void NormalizeCFG::runOnFunction(BinaryFunction &BF) {
   uint64_t NumRemoved = 0;
   uint64_t NumDuplicateEdges = 0;
@@ -406,14 +574,183 @@ bool ReorderBasicBlocks::shouldOptimize(const BinaryFunction &BF) const {
   return BinaryFunctionPass::shouldOptimize(BF);
 }
 
+namespace {
+
+using BlockLayoutCacheTy = std::unordered_map<uint64_t, std::vector<uint32_t>>;
+
+/// Compute a key identifying the code and the profile of \p BF for looking up
+/// its cached block layout. The key is based on the DFS order of basic blocks
+/// so that it does not depend on the current layout.
+uint64_t computeLayoutCacheKey(const BinaryFunction &BF) {
+  hash_code Key(BF.computeHash(/*UseDFS=*/true));
+  for (const BinaryBasicBlock *BB : BF.dfs()) {
+    Key = hash_combine(Key, BB->getKnownExecutionCount());
+    for (const BinaryBasicBlock::BinaryBranchInfo &BI : BB->branch_info())
+      Key = hash_combine(Key, BI.Count);
+  }
+  return static_cast<uint64_t>(Key);
+}
+
+/// Return input offsets of basic blocks in the current layout of \p BF, or
+/// None if the layout contains blocks that cannot be identified on reload.
+Optional<std::vector<uint32_t>> serializeBlockLayout(const BinaryFunction &BF) {
+  std::vector<uint32_t> Offsets;
+  Offsets.reserve(BF.layout_size());
+  for (const BinaryBasicBlock *BB : BF.layout()) {
+    if (BB->getInputOffset() == BinaryBasicBlock::INVALID_OFFSET)
+      return None;
+    Offsets.push_back(BB->getInputOffset());
+  }
+  return Offsets;
+}
+
+/// Reorder basic blocks of \p BF according to the cached sequence of input
+/// \p Offsets. Return false if the cached layout does not match the function.
+bool applyBlockLayout(BinaryFunction &BF, const std::vector<uint32_t> &Offsets) {
+  if (Offsets.empty() || Offsets.size() != BF.layout_size())
+    return false;
+
+  DenseMap<uint32_t, BinaryBasicBlock *> OffsetToBlock;
+  for (BinaryBasicBlock *BB : BF.layout())
+    if (BB->getInputOffset() == BinaryBasicBlock::INVALID_OFFSET ||
+        !OffsetToBlock.insert(std::make_pair(BB->getInputOffset(), BB)).second)
+      return false;
+
+  BinaryFunction::BasicBlockOrderType NewLayout;
+  NewLayout.reserve(Offsets.size());
+  for (uint32_t Offset : Offsets) {
+    BinaryBasicBlock *BB = OffsetToBlock.lookup(Offset);
+    if (!BB)
+      return false;
+    NewLayout.push_back(BB);
+  }
+
+  // The entry block must stay first.
+  if (NewLayout.front() != *BF.layout_begin())
+    return false;
+
+  BF.updateBasicBlockLayout(NewLayout);
+  return true;
+}
+
+/// Read the block layout cache from \p FileName into \p LayoutCache. Missing
+/// or malformed files contribute no entries.
+void readBlockLayoutCache(StringRef FileName, BlockLayoutCacheTy &LayoutCache) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(FileName);
+  if (!MB)
+    return;
+
+  StringRef Buffer = (*MB)->getBuffer();
+  while (!Buffer.empty()) {
+    StringRef Line;
+    std::tie(Line, Buffer) = Buffer.split('\n');
+    if (Line.empty())
+      continue;
+    SmallVector<StringRef, 32> Fields;
+    Line.split(Fields, ' ');
+    uint64_t Key;
+    if (Fields.size() < 2 || Fields[0].getAsInteger(16, Key))
+      continue;
+    std::vector<uint32_t> Offsets;
+    Offsets.reserve(Fields.size() - 1);
+    for (StringRef Field : makeArrayRef(Fields).drop_front()) {
+      uint32_t Offset;
+      if (Field.getAsInteger(16, Offset)) {
+        Offsets.clear();
+        break;
+      }
+      Offsets.push_back(Offset);
+    }
+    if (!Offsets.empty())
+      LayoutCache.emplace(Key, std::move(Offsets));
+  }
+}
+
+/// Parse the -block-layout-shard specification. Returns the zero-based shard
+/// index and the shard count, or None if the option is not set.
+Optional<std::pair<unsigned, unsigned>> parseLayoutShard() {
+  if (opts::BlockLayoutShard.empty())
+    return None;
+  StringRef Index, Count;
+  std::tie(Index, Count) = StringRef(opts::BlockLayoutShard).split('/');
+  unsigned N, M;
+  if (Index.getAsInteger(10, N) || Count.getAsInteger(10, M) || N == 0 ||
+      M == 0 || N > M) {
+    errs() << "BOLT-ERROR: invalid -block-layout-shard value '"
+           << opts::BlockLayoutShard << "', expected <n>/<m> with 1 <= n <= m\n";
+    exit(1);
+  }
+  return std::make_pair(N - 1, M);
+}
+
+/// Return true if \p BF belongs to \p Shard. The partition is derived from
+/// the input address, so every process working on the same binary agrees on
+/// it. Block layout is a function-local decision, which makes any disjoint
+/// partition valid.
+bool isInLayoutShard(const BinaryFunction &BF,
+                     const std::pair<unsigned, unsigned> &Shard) {
+  return hash_value(BF.getAddress()) % Shard.second == Shard.first;
+}
+
+} // end anonymous namespace
+
+/// Candidate layout algorithms evaluated by LT_OPTIMIZE_BEST, with names
+/// matching the corresponding -reorder-blocks values. Index zero stands for
+/// the input layout and does not run an algorithm.
+static const std::pair<ReorderBasicBlocks::LayoutType, const char *>
+    BestLayoutCandidates[] = {
+        {ReorderBasicBlocks::LT_NONE, "input"},
+        {ReorderBasicBlocks::LT_OPTIMIZE, "normal"},
+        {ReorderBasicBlocks::LT_OPTIMIZE_BRANCH, "branch-predictor"},
+        {ReorderBasicBlocks::LT_OPTIMIZE_CACHE, "cache"},
+        {ReorderBasicBlocks::LT_OPTIMIZE_EXT_TSP, "ext-tsp"},
+};
+
 void ReorderBasicBlocks::runOnFunctions(BinaryContext &BC) {
   if (opts::ReorderBlocks == ReorderBasicBlocks::LT_NONE)
     return;
 
+  const Optional<std::pair<unsigned, unsigned>> Shard = parseLayoutShard();
+  if (Shard && opts::BlockLayoutCacheFile.empty()) {
+    errs() << "BOLT-ERROR: -block-layout-shard requires -block-layout-cache "
+              "to store the shard's layouts\n";
+    exit(1);
+  }
+
+  // Load block layouts produced by a previous run of BOLT or by shard runs
+  // on other machines.
+  BlockLayoutCacheTy LayoutCache;
+  for (const std::string &FileName : opts::BlockLayoutCacheFile)
+    readBlockLayoutCache(FileName, LayoutCache);
+
   std::atomic<uint64_t> ModifiedFuncCount{0};
+  std::atomic<uint64_t> ReusedLayoutCount{0};
+  std::array<std::atomic<uint64_t>, array_lengthof(BestLayoutCandidates)>
+      LayoutWins{};
 
   ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
-    modifyFunctionLayout(BF, opts::ReorderBlocks, opts::MinBranchClusters);
+    // In a shard run only this shard's functions get a fresh layout; the
+    // remaining functions are covered by the caches of the other shards.
+    if (Shard && !isInLayoutShard(BF, *Shard))
+      return;
+
+    if (!LayoutCache.empty()) {
+      auto CacheIt = LayoutCache.find(computeLayoutCacheKey(BF));
+      if (CacheIt != LayoutCache.end() &&
+          applyBlockLayout(BF, CacheIt->second)) {
+        ++ReusedLayoutCount;
+        if (BF.hasLayoutChanged())
+          ++ModifiedFuncCount;
+        return;
+      }
+    }
+
+    if (opts::ReorderBlocks == LT_OPTIMIZE_BEST) {
+      if (BF.size() > 0 && BF.hasValidProfile())
+        ++LayoutWins[selectBestFunctionLayout(BF, opts::MinBranchClusters)];
+    } else {
+      modifyFunctionLayout(BF, opts::ReorderBlocks, opts::MinBranchClusters);
+    }
     if (BF.hasLayoutChanged())
       ++ModifiedFuncCount;
   };
@@ -426,6 +763,46 @@ void ReorderBasicBlocks::runOnFunctions(BinaryContext &BC) {
       BC, ParallelUtilities::SchedulingPolicy::SP_BB_LINEAR, WorkFun, SkipFunc,
       "ReorderBasicBlocks");
 
+  // Store the new layouts for the next incremental run or for the merging
+  // run of a sharded layout computation.
+  if (!opts::BlockLayoutCacheFile.empty()) {
+    const std::string &OutputFileName = opts::BlockLayoutCacheFile.front();
+    std::error_code EC;
+    raw_fd_ostream OS(OutputFileName, EC, sys::fs::OF_None);
+    if (EC) {
+      errs() << "BOLT-WARNING: cannot write block layout cache to "
+             << OutputFileName << ": " << EC.message() << '\n';
+    } else {
+      for (auto &BFI : BC.getBinaryFunctions()) {
+        BinaryFunction &BF = BFI.second;
+        if (!shouldOptimize(BF) || !BF.hasValidProfile())
+          continue;
+        if (Shard && !isInLayoutShard(BF, *Shard))
+          continue;
+        Optional<std::vector<uint32_t>> Offsets = serializeBlockLayout(BF);
+        if (!Offsets)
+          continue;
+        OS << Twine::utohexstr(computeLayoutCacheKey(BF));
+        for (uint32_t Offset : *Offsets)
+          OS << ' ' << Twine::utohexstr(Offset);
+        OS << '\n';
+      }
+    }
+    outs() << "BOLT-INFO: reused cached block layout for " << ReusedLayoutCount
+           << " functions\n";
+  }
+
+  if (opts::ReorderBlocks == LT_OPTIMIZE_BEST) {
+    outs() << "BOLT-INFO: best layout algorithm per function:";
+    const char *Sep = " ";
+    for (size_t I = 0; I < array_lengthof(BestLayoutCandidates); ++I) {
+      outs() << Sep << BestLayoutCandidates[I].second << ": "
+             << LayoutWins[I].load();
+      Sep = ", ";
+    }
+    outs() << '\n';
+  }
+
   outs() << "BOLT-INFO: basic block reordering modified layout of "
          << format("%zu (%.2lf%%) functions\n", ModifiedFuncCount.load(),
                    100.0 * ModifiedFuncCount.load() /
@@ -466,6 +843,37 @@ void ReorderBasicBlocks::runOnFunctions(BinaryContext &BC) {
   }
 }
 
+/// Instantiate the heuristic reorder algorithm for the given layout type.
+static std::unique_ptr<ReorderAlgorithm>
+createReorderAlgorithm(ReorderBasicBlocks::LayoutType Type,
+                       bool MinBranchClusters) {
+  std::unique_ptr<ClusterAlgorithm> CAlgo;
+  if (MinBranchClusters)
+    CAlgo.reset(new MinBranchGreedyClusterAlgorithm());
+  else
+    CAlgo.reset(new PHGreedyClusterAlgorithm());
+
+  switch (Type) {
+  case ReorderBasicBlocks::LT_OPTIMIZE:
+    return std::make_unique<OptimizeReorderAlgorithm>(std::move(CAlgo));
+
+  case ReorderBasicBlocks::LT_OPTIMIZE_BRANCH:
+    return std::make_unique<OptimizeBranchReorderAlgorithm>(std::move(CAlgo));
+
+  case ReorderBasicBlocks::LT_OPTIMIZE_CACHE:
+    return std::make_unique<OptimizeCacheReorderAlgorithm>(std::move(CAlgo));
+
+  case ReorderBasicBlocks::LT_OPTIMIZE_EXT_TSP:
+    return std::make_unique<ExtTSPReorderAlgorithm>();
+
+  case ReorderBasicBlocks::LT_OPTIMIZE_SHUFFLE:
+    return std::make_unique<RandomClusterReorderAlgorithm>(std::move(CAlgo));
+
+  default:
+    llvm_unreachable("unexpected layout type");
+  }
+}
+
 void ReorderBasicBlocks::modifyFunctionLayout(BinaryFunction &BF,
                                               LayoutType Type,
                                               bool MinBranchClusters) const {
@@ -487,42 +895,48 @@ void ReorderBasicBlocks::modifyFunctionLayout(BinaryFunction &BF,
     Algo.reset(new TSPReorderAlgorithm());
   } else {
     LLVM_DEBUG(dbgs() << "running block layout heuristics on " << BF << "\n");
+    Algo = createReorderAlgorithm(Type, MinBranchClusters);
+  }
 
-    std::unique_ptr<ClusterAlgorithm> CAlgo;
-    if (MinBranchClusters)
-      CAlgo.reset(new MinBranchGreedyClusterAlgorithm());
-    else
-      CAlgo.reset(new PHGreedyClusterAlgorithm());
-
-    switch (Type) {
-    case LT_OPTIMIZE:
-      Algo.reset(new OptimizeReorderAlgorithm(std::move(CAlgo)));
-      break;
-
-    case LT_OPTIMIZE_BRANCH:
-      Algo.reset(new OptimizeBranchReorderAlgorithm(std::move(CAlgo)));
-      break;
-
-    case LT_OPTIMIZE_CACHE:
-      Algo.reset(new OptimizeCacheReorderAlgorithm(std::move(CAlgo)));
-      break;
-
-    case LT_OPTIMIZE_EXT_TSP:
-      Algo.reset(new ExtTSPReorderAlgorithm());
-      break;
+  Algo->reorderBasicBlocks(BF, NewLayout);
 
-    case LT_OPTIMIZE_SHUFFLE:
-      Algo.reset(new RandomClusterReorderAlgorithm(std::move(CAlgo)));
-      break;
+  BF.updateBasicBlockLayout(NewLayout);
+}
 
-    default:
-      llvm_unreachable("unexpected layout type");
+size_t ReorderBasicBlocks::selectBestFunctionLayout(
+    BinaryFunction &BF, bool MinBranchClusters) const {
+  const BinaryContext &BC = BF.getBinaryContext();
+  // Create a separate MCCodeEmitter to allow lock-free execution
+  BinaryContext::IndependentCodeEmitter Emitter;
+  if (!opts::NoThreads)
+    Emitter = BC.createIndependentMCCodeEmitter();
+
+  const BinaryFunction::BasicBlockOrderType InputOrder(BF.layout_begin(),
+                                                       BF.layout_end());
+  double BestScore = CacheMetrics::scoreLayout(InputOrder, Emitter.MCE.get());
+  size_t BestCandidate = 0;
+  BinaryFunction::BasicBlockOrderType BestOrder;
+
+  for (size_t I = 1; I < array_lengthof(BestLayoutCandidates); ++I) {
+    const std::unique_ptr<ReorderAlgorithm> Algo =
+        createReorderAlgorithm(BestLayoutCandidates[I].first,
+                               MinBranchClusters);
+    BinaryFunction::BasicBlockOrderType Order;
+    Algo->reorderBasicBlocks(BF, Order);
+    if (Order.empty())
+      continue;
+    const double Score = CacheMetrics::scoreLayout(Order, Emitter.MCE.get());
+    if (Score > BestScore) {
+      BestScore = Score;
+      BestCandidate = I;
+      BestOrder = std::move(Order);
     }
   }
 
-  Algo->reorderBasicBlocks(BF, NewLayout);
+  if (BestCandidate != 0)
+    BF.updateBasicBlockLayout(BestOrder);
 
-  BF.updateBasicBlockLayout(NewLayout);
+  return BestCandidate;
 }
 
 void FixupBranches::runOnFunctions(BinaryContext &BC) {
@@ -629,10 +1043,9 @@ void LowerAnnotations::runOnFunctions(BinaryContext &BC) {
 
       // Now record preserved annotations separately and then strip annotations.
       for (auto II = BB->begin(); II != BB->end(); ++II) {
-        if (BF.requiresAddressTranslation() &&
-            BC.MIB->hasAnnotation(*II, "Offset"))
-          PreservedOffsetAnnotations.emplace_back(
-              &(*II), BC.MIB->getAnnotationAs<uint32_t>(*II, "Offset"));
+        if (BF.requiresAddressTranslation() && BC.MIB->getOffset(*II))
+          PreservedOffsetAnnotations.emplace_back(&(*II),
+                                                  *BC.MIB->getOffset(*II));
         BC.MIB->stripAnnotations(*II);
       }
     }
@@ -647,7 +1060,7 @@ void LowerAnnotations::runOnFunctions(BinaryContext &BC) {
 
   // Reinsert preserved annotations we need during code emission.
   for (const std::pair<MCInst *, uint32_t> &Item : PreservedOffsetAnnotations)
-    BC.MIB->addAnnotation<uint32_t>(*Item.first, "Offset", Item.second);
+    BC.MIB->setOffset(*Item.first, Item.second);
 }
 
 namespace {
@@ -665,104 +1078,114 @@ namespace {
 // B0: ...
 //     jmp  B2   (or jcc B2)
 //
-uint64_t fixDoubleJumps(BinaryFunction &Function, bool MarkInvalid) {
+uint64_t fixDoubleJumpsInBlock(BinaryFunction &Function, BinaryBasicBlock &BB,
+                               bool MarkInvalid) {
   uint64_t NumDoubleJumps = 0;
 
-  MCContext *Ctx = Function.getBinaryContext().Ctx.get();
-  MCPlusBuilder *MIB = Function.getBinaryContext().MIB.get();
-  for (BinaryBasicBlock &BB : Function) {
-    auto checkAndPatch = [&](BinaryBasicBlock *Pred, BinaryBasicBlock *Succ,
-                             const MCSymbol *SuccSym) {
-      // Ignore infinite loop jumps or fallthrough tail jumps.
-      if (Pred == Succ || Succ == &BB)
-        return false;
+  BinaryContext &BC = Function.getBinaryContext();
+  MCContext *Ctx = BC.Ctx.get();
+  MCPlusBuilder *MIB = BC.MIB.get();
+  auto checkAndPatch = [&](BinaryBasicBlock *Pred, BinaryBasicBlock *Succ,
+                           const MCSymbol *SuccSym) {
+    // Ignore infinite loop jumps or fallthrough tail jumps.
+    if (Pred == Succ || Succ == &BB)
+      return false;
 
-      if (Succ) {
-        const MCSymbol *TBB = nullptr;
-        const MCSymbol *FBB = nullptr;
-        MCInst *CondBranch = nullptr;
-        MCInst *UncondBranch = nullptr;
-        bool Res = Pred->analyzeBranch(TBB, FBB, CondBranch, UncondBranch);
-        if (!Res) {
-          LLVM_DEBUG(dbgs() << "analyzeBranch failed in peepholes in block:\n";
-                     Pred->dump());
-          return false;
-        }
-        Pred->replaceSuccessor(&BB, Succ);
-
-        // We must patch up any existing branch instructions to match up
-        // with the new successor.
-        assert((CondBranch || (!CondBranch && Pred->succ_size() == 1)) &&
-               "Predecessor block has inconsistent number of successors");
-        if (CondBranch && MIB->getTargetSymbol(*CondBranch) == BB.getLabel()) {
-          MIB->replaceBranchTarget(*CondBranch, Succ->getLabel(), Ctx);
-        } else if (UncondBranch &&
-                   MIB->getTargetSymbol(*UncondBranch) == BB.getLabel()) {
-          MIB->replaceBranchTarget(*UncondBranch, Succ->getLabel(), Ctx);
-        } else if (!UncondBranch) {
-          assert(Function.getBasicBlockAfter(Pred, false) != Succ &&
-                 "Don't add an explicit jump to a fallthrough block.");
-          Pred->addBranchInstruction(Succ);
-        }
+    if (Succ) {
+      const MCSymbol *TBB = nullptr;
+      const MCSymbol *FBB = nullptr;
+      MCInst *CondBranch = nullptr;
+      MCInst *UncondBranch = nullptr;
+      bool Res = Pred->analyzeBranch(TBB, FBB, CondBranch, UncondBranch);
+      if (!Res) {
+        LLVM_DEBUG(dbgs() << "analyzeBranch failed in peepholes in block:\n";
+                   Pred->dump());
+        return false;
+      }
+      Pred->replaceSuccessor(&BB, Succ);
+
+      // We must patch up any existing branch instructions to match up
+      // with the new successor.
+      assert((CondBranch || (!CondBranch && Pred->succ_size() == 1)) &&
+             "Predecessor block has inconsistent number of successors");
+      if (CondBranch && MIB->getTargetSymbol(*CondBranch) == BB.getLabel()) {
+        auto L = BC.scopeLock();
+        MIB->replaceBranchTarget(*CondBranch, Succ->getLabel(), Ctx);
+      } else if (UncondBranch &&
+                 MIB->getTargetSymbol(*UncondBranch) == BB.getLabel()) {
+        auto L = BC.scopeLock();
+        MIB->replaceBranchTarget(*UncondBranch, Succ->getLabel(), Ctx);
+      } else if (!UncondBranch) {
+        assert(Function.getBasicBlockAfter(Pred, false) != Succ &&
+               "Don't add an explicit jump to a fallthrough block.");
+        Pred->addBranchInstruction(Succ);
+      }
+    } else {
+      // Succ will be null in the tail call case.  In this case we
+      // need to explicitly add a tail call instruction.
+      MCInst *Branch = Pred->getLastNonPseudoInstr();
+      if (Branch && MIB->isUnconditionalBranch(*Branch)) {
+        assert(MIB->getTargetSymbol(*Branch) == BB.getLabel());
+        Pred->removeSuccessor(&BB);
+        Pred->eraseInstruction(Pred->findInstruction(Branch));
+        auto L = BC.scopeLock();
+        Pred->addTailCallInstruction(SuccSym);
       } else {
-        // Succ will be null in the tail call case.  In this case we
-        // need to explicitly add a tail call instruction.
-        MCInst *Branch = Pred->getLastNonPseudoInstr();
-        if (Branch && MIB->isUnconditionalBranch(*Branch)) {
-          assert(MIB->getTargetSymbol(*Branch) == BB.getLabel());
-          Pred->removeSuccessor(&BB);
-          Pred->eraseInstruction(Pred->findInstruction(Branch));
-          Pred->addTailCallInstruction(SuccSym);
-        } else {
-          return false;
-        }
+        return false;
       }
+    }
 
-      ++NumDoubleJumps;
-      LLVM_DEBUG(dbgs() << "Removed double jump in " << Function << " from "
-                        << Pred->getName() << " -> " << BB.getName() << " to "
-                        << Pred->getName() << " -> " << SuccSym->getName()
-                        << (!Succ ? " (tail)\n" : "\n"));
+    ++NumDoubleJumps;
+    LLVM_DEBUG(dbgs() << "Removed double jump in " << Function << " from "
+                      << Pred->getName() << " -> " << BB.getName() << " to "
+                      << Pred->getName() << " -> " << SuccSym->getName()
+                      << (!Succ ? " (tail)\n" : "\n"));
 
-      return true;
-    };
+    return true;
+  };
 
-    if (BB.getNumNonPseudos() != 1 || BB.isLandingPad())
-      continue;
+  if (BB.getNumNonPseudos() != 1 || BB.isLandingPad())
+    return NumDoubleJumps;
 
-    MCInst *Inst = BB.getFirstNonPseudoInstr();
-    const bool IsTailCall = MIB->isTailCall(*Inst);
+  MCInst *Inst = BB.getFirstNonPseudoInstr();
+  const bool IsTailCall = MIB->isTailCall(*Inst);
 
-    if (!MIB->isUnconditionalBranch(*Inst) && !IsTailCall)
-      continue;
+  if (!MIB->isUnconditionalBranch(*Inst) && !IsTailCall)
+    return NumDoubleJumps;
 
-    // If we operate after SCTC make sure it's not a conditional tail call.
-    if (IsTailCall && MIB->isConditionalBranch(*Inst))
-      continue;
+  // If we operate after SCTC make sure it's not a conditional tail call.
+  if (IsTailCall && MIB->isConditionalBranch(*Inst))
+    return NumDoubleJumps;
 
-    const MCSymbol *SuccSym = MIB->getTargetSymbol(*Inst);
-    BinaryBasicBlock *Succ = BB.getSuccessor();
+  const MCSymbol *SuccSym = MIB->getTargetSymbol(*Inst);
+  BinaryBasicBlock *Succ = BB.getSuccessor();
 
-    if (((!Succ || &BB == Succ) && !IsTailCall) || (IsTailCall && !SuccSym))
-      continue;
+  if (((!Succ || &BB == Succ) && !IsTailCall) || (IsTailCall && !SuccSym))
+    return NumDoubleJumps;
 
-    std::vector<BinaryBasicBlock *> Preds = {BB.pred_begin(), BB.pred_end()};
+  std::vector<BinaryBasicBlock *> Preds = {BB.pred_begin(), BB.pred_end()};
 
-    for (BinaryBasicBlock *Pred : Preds) {
-      if (Pred->isLandingPad())
-        continue;
+  for (BinaryBasicBlock *Pred : Preds) {
+    if (Pred->isLandingPad())
+      continue;
 
-      if (Pred->getSuccessor() == &BB ||
-          (Pred->getConditionalSuccessor(true) == &BB && !IsTailCall) ||
-          Pred->getConditionalSuccessor(false) == &BB)
-        if (checkAndPatch(Pred, Succ, SuccSym) && MarkInvalid)
-          BB.markValid(BB.pred_size() != 0 || BB.isLandingPad() ||
-                       BB.isEntryPoint());
-    }
+    if (Pred->getSuccessor() == &BB ||
+        (Pred->getConditionalSuccessor(true) == &BB && !IsTailCall) ||
+        Pred->getConditionalSuccessor(false) == &BB)
+      if (checkAndPatch(Pred, Succ, SuccSym) && MarkInvalid)
+        BB.markValid(BB.pred_size() != 0 || BB.isLandingPad() ||
+                     BB.isEntryPoint());
   }
 
   return NumDoubleJumps;
 }
+
+uint64_t fixDoubleJumps(BinaryFunction &Function, bool MarkInvalid) {
+  uint64_t NumDoubleJumps = 0;
+  for (BinaryBasicBlock &BB : Function)
+    NumDoubleJumps += fixDoubleJumpsInBlock(Function, BB, MarkInvalid);
+  return NumDoubleJumps;
+}
 } // namespace
 
 bool SimplifyConditionalTailCalls::shouldRewriteBranch(
@@ -902,8 +1325,8 @@ uint64_t SimplifyConditionalTailCalls::fixTailCalls(BinaryFunction &BF) {
       MIB->setConditionalTailCall(*CondBranch);
       // Add info abount the conditional tail call frequency, otherwise this
       // info will be lost when we delete the associated BranchInfo entry
-      auto &CTCAnnotation =
-          MIB->getOrCreateAnnotationAs<uint64_t>(*CondBranch, "CTCTakenCount");
+      auto &CTCAnnotation = MIB->getOrCreateAnnotationAs<uint64_t>(
+          *CondBranch, MCPlus::MCAnnotation::kCTCTakenCount);
       CTCAnnotation = CTCTakenFreq;
 
       // Remove the unused successor which may be eliminated later
@@ -1052,46 +1475,150 @@ void ShortenInstructions::runOnFunctions(BinaryContext &BC) {
   outs() << "BOLT-INFO: " << NumShortened << " instructions were shortened\n";
 }
 
-void Peepholes::addTailcallTraps(BinaryFunction &Function) {
-  MCPlusBuilder *MIB = Function.getBinaryContext().MIB.get();
-  for (BinaryBasicBlock &BB : Function) {
-    MCInst *Inst = BB.getLastNonPseudoInstr();
-    if (Inst && MIB->isTailCall(*Inst) && MIB->isIndirectBranch(*Inst)) {
-      MCInst Trap;
-      if (MIB->createTrap(Trap)) {
-        BB.addInstruction(Trap);
-        ++TailCallTraps;
-      }
+bool ScheduleMacroFusion::scheduleBlock(BinaryBasicBlock &BB) {
+  const BinaryContext &BC = BB.getFunction()->getBinaryContext();
+
+  // The block has to end with a conditional branch and contain at least one
+  // instruction that could be separated from it.
+  if (BB.getNumNonPseudos() < 3 || BB.succ_size() != 2)
+    return false;
+  if (BB.getMacroOpFusionPair() != BB.end())
+    return false;
+
+  auto RII = BB.getLastNonPseudo();
+  if (BC.MIB->isUnconditionalBranch(*RII))
+    ++RII;
+  if (RII == BB.rend() || !BC.MIB->isConditionalBranch(*RII))
+    return false;
+  const BinaryBasicBlock::iterator CondBranchII = std::prev(RII.base());
+
+  // Walk backwards to the closest instruction touching the flags: it is the
+  // only possible producer of the branch condition. Accumulate the registers
+  // accessed by the instructions in between, as the producer has to move
+  // past them.
+  const MCPhysReg FlagsReg = BC.MIB->getFlagsReg();
+  const unsigned NumRegs = BC.MRI->getNumRegs();
+  BitVector BarrierWritten(NumRegs, false);
+  BitVector BarrierUsed(NumRegs, false);
+  bool BarrierStores = false;
+  bool FoundCandidate = false;
+
+  BinaryBasicBlock::iterator CandII = CondBranchII;
+  while (CandII != BB.begin()) {
+    --CandII;
+    const MCInst &Inst = *CandII;
+    if (BC.MIB->isPseudo(Inst) || BC.MIB->isCFI(Inst))
+      continue;
+    if (BC.MIB->isCall(Inst) || BC.MIB->isBranch(Inst))
+      return false;
+    const MCInstrDesc &Desc = BC.MII->get(Inst.getOpcode());
+    if (Desc.hasUnmodeledSideEffects())
+      return false;
+
+    BitVector Touched(NumRegs, false);
+    BC.MIB->getTouchedRegs(Inst, Touched);
+    if (Touched[FlagsReg]) {
+      FoundCandidate = true;
+      break;
     }
+
+    BC.MIB->getWrittenRegs(Inst, BarrierWritten);
+    BC.MIB->getUsedRegs(Inst, BarrierUsed);
+    BarrierStores |= Desc.mayStore();
   }
-}
+  if (!FoundCandidate)
+    return false;
 
-void Peepholes::removeUselessCondBranches(BinaryFunction &Function) {
-  for (BinaryBasicBlock &BB : Function) {
-    if (BB.succ_size() != 2)
-      continue;
+  // Verify the pair would actually fuse.
+  const MCInst Pair[2] = {*CandII, *CondBranchII};
+  if (!BC.MIB->isMacroOpFusionPair(Pair))
+    return false;
 
-    BinaryBasicBlock *CondBB = BB.getConditionalSuccessor(true);
-    BinaryBasicBlock *UncondBB = BB.getConditionalSuccessor(false);
-    if (CondBB != UncondBB)
-      continue;
+  // Check that moving the producer does not break a dependency: nothing in
+  // between may write a register it accesses, read a register it defines, or
+  // store to memory it may load from. Note that the instructions in between
+  // never touch the flags, or the scan would have stopped earlier.
+  const MCInstrDesc &CandDesc = BC.MII->get(CandII->getOpcode());
+  if (CandDesc.mayStore())
+    return false;
+  if (CandDesc.mayLoad() && BarrierStores)
+    return false;
 
-    const MCSymbol *TBB = nullptr;
-    const MCSymbol *FBB = nullptr;
-    MCInst *CondBranch = nullptr;
-    MCInst *UncondBranch = nullptr;
-    bool Result = BB.analyzeBranch(TBB, FBB, CondBranch, UncondBranch);
+  BitVector CandTouched(NumRegs, false);
+  BC.MIB->getTouchedRegs(*CandII, CandTouched);
+  BitVector CandWritten(NumRegs, false);
+  BC.MIB->getWrittenRegs(*CandII, CandWritten);
+  if (BarrierWritten.anyCommon(CandTouched) ||
+      BarrierUsed.anyCommon(CandWritten))
+    return false;
 
-    // analyzeBranch() can fail due to unusual branch instructions,
-    // e.g. jrcxz, or jump tables (indirect jump).
-    if (!Result || !CondBranch)
-      continue;
+  // Move the producer right before the conditional branch.
+  std::rotate(CandII, std::next(CandII), CondBranchII);
+  return true;
+}
+
+void ScheduleMacroFusion::runOnFunctions(BinaryContext &BC) {
+  if (!BC.isX86())
+    return;
 
-    BB.removeDuplicateConditionalSuccessor(CondBranch);
-    ++NumUselessCondBranches;
+  std::atomic<uint64_t> NumScheduled{0};
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR,
+      [&](BinaryFunction &BF) {
+        for (BinaryBasicBlock &BB : BF) {
+          // Only spend code-motion effort on blocks known to execute.
+          if (!BB.getKnownExecutionCount())
+            continue;
+          if (scheduleBlock(BB))
+            ++NumScheduled;
+        }
+      },
+      [](const BinaryFunction &BF) {
+        return !BF.isSimple() || !BF.shouldOptimize() || !BF.hasValidProfile();
+      },
+      "ScheduleMacroFusion");
+
+  outs() << "BOLT-INFO: " << NumScheduled
+         << " flag-setting instructions were moved next to their conditional"
+            " branches to enable macro-op fusion\n";
+}
+
+void Peepholes::addTailcallTrap(BinaryBasicBlock &BB) {
+  MCPlusBuilder *MIB = BB.getFunction()->getBinaryContext().MIB.get();
+  MCInst *Inst = BB.getLastNonPseudoInstr();
+  if (Inst && MIB->isTailCall(*Inst) && MIB->isIndirectBranch(*Inst)) {
+    MCInst Trap;
+    if (MIB->createTrap(Trap)) {
+      BB.addInstruction(Trap);
+      ++TailCallTraps;
+    }
   }
 }
 
+void Peepholes::removeUselessCondBranch(BinaryBasicBlock &BB) {
+  if (BB.succ_size() != 2)
+    return;
+
+  BinaryBasicBlock *CondBB = BB.getConditionalSuccessor(true);
+  BinaryBasicBlock *UncondBB = BB.getConditionalSuccessor(false);
+  if (CondBB != UncondBB)
+    return;
+
+  const MCSymbol *TBB = nullptr;
+  const MCSymbol *FBB = nullptr;
+  MCInst *CondBranch = nullptr;
+  MCInst *UncondBranch = nullptr;
+  bool Result = BB.analyzeBranch(TBB, FBB, CondBranch, UncondBranch);
+
+  // analyzeBranch() can fail due to unusual branch instructions,
+  // e.g. jrcxz, or jump tables (indirect jump).
+  if (!Result || !CondBranch)
+    return;
+
+  BB.removeDuplicateConditionalSuccessor(CondBranch);
+  ++NumUselessCondBranches;
+}
+
 void Peepholes::runOnFunctions(BinaryContext &BC) {
   const char Opts = std::accumulate(
       opts::Peepholes.begin(), opts::Peepholes.end(), 0,
@@ -1099,18 +1626,37 @@ void Peepholes::runOnFunctions(BinaryContext &BC) {
   if (Opts == opts::PEEP_NONE || !BC.isX86())
     return;
 
-  for (auto &It : BC.getBinaryFunctions()) {
-    BinaryFunction &Function = It.second;
-    if (shouldOptimize(Function)) {
-      if (Opts & opts::PEEP_DOUBLE_JUMPS)
-        NumDoubleJumps += fixDoubleJumps(Function, false);
-      if (Opts & opts::PEEP_TAILCALL_TRAPS)
-        addTailcallTraps(Function);
-      if (Opts & opts::PEEP_USELESS_BRANCHES)
-        removeUselessCondBranches(Function);
-      assert(Function.validateCFG());
-    }
-  }
+  // Table of the enabled per-block peepholes. All patterns are applied
+  // during a single walk over the blocks of a function, so adding a pattern
+  // here costs no additional scan.
+  using PatternFuncTy =
+      std::function<void(BinaryFunction &, BinaryBasicBlock &)>;
+  SmallVector<PatternFuncTy, 4> Patterns;
+  if (Opts & opts::PEEP_DOUBLE_JUMPS)
+    Patterns.push_back([this](BinaryFunction &Function, BinaryBasicBlock &BB) {
+      NumDoubleJumps += fixDoubleJumpsInBlock(Function, BB, false);
+    });
+  if (Opts & opts::PEEP_TAILCALL_TRAPS)
+    Patterns.push_back([this](BinaryFunction &, BinaryBasicBlock &BB) {
+      addTailcallTrap(BB);
+    });
+  if (Opts & opts::PEEP_USELESS_BRANCHES)
+    Patterns.push_back([this](BinaryFunction &, BinaryBasicBlock &BB) {
+      removeUselessCondBranch(BB);
+    });
+
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &Function) {
+    for (BinaryBasicBlock &BB : Function)
+      for (const PatternFuncTy &Pattern : Patterns)
+        Pattern(Function, BB);
+    assert(Function.validateCFG());
+  };
+
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_BB_LINEAR, WorkFun,
+      [&](const BinaryFunction &BF) { return !shouldOptimize(BF); },
+      "Peepholes");
+
   outs() << "BOLT-INFO: Peephole: " << NumDoubleJumps
          << " double jumps patched.\n"
          << "BOLT-INFO: Peephole: " << TailCallTraps
@@ -1215,9 +1761,121 @@ void SimplifyRODataLoads::runOnFunctions(BinaryContext &BC) {
          << "BOLT-INFO: dynamic loads found: " << NumDynamicLoadsFound << "\n";
 }
 
+void GCFunctions::runOnFunctions(BinaryContext &BC) {
+  if (!opts::GCFunctions)
+    return;
+
+  BinaryFunctionCallGraph CG = buildCallGraph(BC);
+
+  std::vector<BinaryFunction *> Worklist;
+  std::vector<bool> Reachable(CG.numNodes(), false);
+  auto markRoot = [&](BinaryFunction *BF) {
+    const CallGraph::NodeId Id = CG.maybeGetNodeId(BF);
+    if (Id == CallGraph::InvalidId || Reachable[Id])
+      return;
+    Reachable[Id] = true;
+    Worklist.push_back(BF);
+  };
+
+  // A function whose behavior we cannot reason about, whose profile shows
+  // execution, or whose (primary) symbol is visible to other modules has to
+  // be treated as a root. Classify functions in parallel; note that the flags
+  // of a BinaryData come from the first symbol registered at its address, so
+  // this errs on the side of keeping aliased functions alive only when their
+  // function symbol was seen first - secondary entry symbols are checked
+  // separately below.
+  std::vector<BinaryFunction *> Roots;
+  std::mutex RootsMutex;
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &Function) {
+    bool IsRoot = !Function.isSimple() || Function.isIgnored() ||
+                  Function.hasValidProfile() ||
+                  Function.getKnownExecutionCount() > 0;
+    if (!IsRoot) {
+      Function.forEachEntryPoint([&](uint64_t Offset, const MCSymbol *Symbol) {
+        const BinaryData *BD =
+            BC.getBinaryDataAtAddress(Function.getAddress() + Offset);
+        if (BD && (BD->getFlags() & SymbolRef::SF_Global))
+          IsRoot = true;
+        return false;
+      });
+    }
+    if (IsRoot) {
+      std::lock_guard<std::mutex> Lock(RootsMutex);
+      Roots.push_back(&Function);
+    }
+  };
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_TRIVIAL, WorkFun, nullptr,
+      "GCFunctions");
+  for (BinaryFunction *Function : Roots)
+    markRoot(Function);
+
+  // Any function referenced from a non-code section or by a dynamic
+  // relocation is address-taken: function pointer tables, vtables,
+  // .init_array and the like. Branch relocations inside code sections are
+  // deliberately not roots - a call from dead code must not keep its target
+  // alive.
+  auto markRelocationTarget = [&](const Relocation &Rel) {
+    if (!Rel.Symbol)
+      return;
+    if (BinaryFunction *Target = BC.getFunctionForSymbol(Rel.Symbol)) {
+      markRoot(Target);
+      return;
+    }
+    const ErrorOr<uint64_t> Value = BC.getSymbolValue(*Rel.Symbol);
+    if (!Value)
+      return;
+    if (BinaryFunction *Target =
+            BC.getBinaryFunctionContainingAddress(*Value + Rel.Addend))
+      markRoot(Target);
+  };
+  for (const BinarySection &Section : BC.allocatableSections()) {
+    if (!Section.isText())
+      for (const Relocation &Rel : Section.relocations())
+        markRelocationTarget(Rel);
+    for (const Relocation &Rel : Section.dynamicRelocations())
+      markRelocationTarget(Rel);
+  }
+
+  // Everything transitively callable from a root stays.
+  while (!Worklist.empty()) {
+    BinaryFunction *Function = Worklist.back();
+    Worklist.pop_back();
+    for (const CallGraph::NodeId SuccId :
+         CG.successors(CG.getNodeId(Function))) {
+      if (Reachable[SuccId])
+        continue;
+      Reachable[SuccId] = true;
+      Worklist.push_back(CG.nodeIdToFunc(SuccId));
+    }
+  }
+
+  uint64_t NumUnreachable = 0;
+  uint64_t UnreachableBytes = 0;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    BinaryFunction &Function = BFI.second;
+    const CallGraph::NodeId Id = CG.maybeGetNodeId(&Function);
+    if (Id == CallGraph::InvalidId || Reachable[Id] || !Function.getSize())
+      continue;
+    Function.setUnreachable();
+    ++NumUnreachable;
+    UnreachableBytes += Function.getSize();
+  }
+
+  outs() << "BOLT-INFO: function GC proved " << NumUnreachable
+         << " functions (" << UnreachableBytes
+         << " bytes) unreachable from any root\n";
+}
+
 void AssignSections::runOnFunctions(BinaryContext &BC) {
   for (BinaryFunction *Function : BC.getInjectedBinaryFunctions()) {
-    Function->setCodeSectionName(BC.getInjectedCodeSectionName());
+    // Injected functions with an execution count attributed to them (e.g.
+    // retpoline thunks serving profiled callsites) go with the main text;
+    // the injected section is ranked with the cold code in the output.
+    if (BC.HasRelocations && Function->getKnownExecutionCount())
+      Function->setCodeSectionName(BC.getMainCodeSectionName());
+    else
+      Function->setCodeSectionName(BC.getInjectedCodeSectionName());
     Function->setColdCodeSectionName(BC.getInjectedColdCodeSectionName());
   }
 
@@ -1236,14 +1894,29 @@ void AssignSections::runOnFunctions(BinaryContext &BC) {
       continue;
     }
 
-    if (!UseColdSection || Function.hasValidIndex() ||
-        Function.hasValidProfile())
+    if (Function.isUnreachable())
+      // Functions proven unreachable by the GC pass are placed with the
+      // never-executed code regardless of their index.
+      Function.setCodeSectionName(opts::SplitRegions
+                                      ? BC.getFrozenCodeSectionName()
+                                      : BC.getColdCodeSectionName());
+    else if (!UseColdSection || Function.hasValidIndex() ||
+             Function.hasValidProfile())
       Function.setCodeSectionName(BC.getMainCodeSectionName());
     else
-      Function.setCodeSectionName(BC.getColdCodeSectionName());
-
-    if (Function.isSplit())
-      Function.setColdCodeSectionName(BC.getColdCodeSectionName());
+      // With region splitting, functions with no execution evidence form
+      // the frozen tier.
+      Function.setCodeSectionName(opts::SplitRegions
+                                      ? BC.getFrozenCodeSectionName()
+                                      : BC.getColdCodeSectionName());
+
+    if (Function.isSplit()) {
+      const char *SectionName = BC.getColdCodeSectionName();
+      if (opts::SplitRegions &&
+          Function.getColdFragmentTier() == BinaryFunction::FT_WARM)
+        SectionName = BC.getWarmCodeSectionName();
+      Function.setColdCodeSectionName(SectionName);
+    }
   }
 }
 
@@ -1695,9 +2368,8 @@ bool SpecializeMemcpy1::shouldOptimize(const BinaryFunction &Function) const {
   if (!BinaryFunctionPass::shouldOptimize(Function))
     return false;
 
-  for (const std::string &FunctionSpec : Spec) {
-    StringRef FunctionName = StringRef(FunctionSpec).split(':').first;
-    if (Function.hasNameRegex(FunctionName))
+  for (const std::pair<Regex, StringRef> &FunctionSpec : SpecRegex) {
+    if (Function.hasNameRegex(FunctionSpec.first))
       return true;
   }
 
@@ -1707,12 +2379,11 @@ bool SpecializeMemcpy1::shouldOptimize(const BinaryFunction &Function) const {
 std::set<size_t> SpecializeMemcpy1::getCallSitesToOptimize(
     const BinaryFunction &Function) const {
   StringRef SitesString;
-  for (const std::string &FunctionSpec : Spec) {
-    StringRef FunctionName;
-    std::tie(FunctionName, SitesString) = StringRef(FunctionSpec).split(':');
-    if (Function.hasNameRegex(FunctionName))
+  for (const std::pair<Regex, StringRef> &FunctionSpec : SpecRegex) {
+    if (Function.hasNameRegex(FunctionSpec.first)) {
+      SitesString = FunctionSpec.second;
       break;
-    SitesString = "";
+    }
   }
 
   std::set<size_t> Sites;
@@ -1733,6 +2404,16 @@ void SpecializeMemcpy1::runOnFunctions(BinaryContext &BC) {
   if (!BC.isX86())
     return;
 
+  // Compile the function patterns once instead of for every function.
+  SpecRegex.clear();
+  SpecRegex.reserve(Spec.size());
+  for (const std::string &FunctionSpec : Spec) {
+    const std::pair<StringRef, StringRef> Parts =
+        StringRef(FunctionSpec).split(':');
+    SpecRegex.emplace_back(BinaryFunction::buildNameRegex(Parts.first),
+                           Parts.second);
+  }
+
   uint64_t NumSpecialized = 0;
   uint64_t NumSpecializedDyno = 0;
   for (auto &BFI : BC.getBinaryFunctions()) {
@@ -1830,7 +2511,8 @@ void RemoveNops::runOnFunction(BinaryFunction &BF) {
   for (BinaryBasicBlock &BB : BF) {
     for (int64_t I = BB.size() - 1; I >= 0; --I) {
       MCInst &Inst = BB.getInstructionAtIndex(I);
-      if (BC.MIB->isNoop(Inst) && BC.MIB->hasAnnotation(Inst, "NOP"))
+      if (BC.MIB->isNoop(Inst) &&
+          BC.MIB->hasAnnotation(Inst, MCPlus::MCAnnotation::kNOP))
         BB.eraseInstructionAtIndex(I);
     }
   }
@@ -0,0 +1,270 @@
+//===- bolt/Passes/BranchRelaxation.cpp -----------------------------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the BranchRelaxationPass class.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bolt/Passes/BranchRelaxation.h"
+#include "bolt/Core/ParallelUtilities.h"
+#include "llvm/MC/MCAsmBackend.h"
+#include "llvm/MC/MCCodeEmitter.h"
+#include "llvm/MC/MCTargetOptions.h"
+#include "llvm/MC/TargetRegistry.h"
+
+#include <limits>
+#include <numeric>
+
+#define DEBUG_TYPE "bolt-branch-relax"
+
+using namespace llvm;
+
+namespace opts {
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<bool> PreRelaxBranches(
+    "pre-relax-branches",
+    cl::desc("select final x86 branch encodings before emission so that "
+             "assembler relaxation converges in a single round"),
+    cl::init(true), cl::ZeroOrMore, cl::Hidden, cl::cat(BoltOptCategory));
+} // namespace opts
+
+namespace {
+
+using namespace llvm;
+
+/// Interval-stabbing index over instruction positions: the span of every
+/// branch is stored in O(log N) nodes of a static segment tree, and a point
+/// query at a position collects the branches whose span contains it.
+class SpanIndex {
+  unsigned NumLeaves;
+  std::vector<SmallVector<uint32_t, 2>> Nodes;
+
+public:
+  explicit SpanIndex(unsigned N)
+      : NumLeaves(std::max(1u, N)), Nodes(2 * NumLeaves) {}
+
+  /// Record branch \p Id whose displacement depends on the sizes of the
+  /// instructions at positions [\p Lo, \p Hi).
+  void insert(unsigned Lo, unsigned Hi, uint32_t Id) {
+    for (Lo += NumLeaves, Hi += NumLeaves; Lo < Hi; Lo >>= 1, Hi >>= 1) {
+      if (Lo & 1)
+        Nodes[Lo++].push_back(Id);
+      if (Hi & 1)
+        Nodes[--Hi].push_back(Id);
+    }
+  }
+
+  /// Collect the branches whose span contains position \p P.
+  void query(unsigned P, SmallVectorImpl<uint32_t> &Out) const {
+    for (P += NumLeaves; P >= 1; P >>= 1)
+      Out.append(Nodes[P].begin(), Nodes[P].end());
+  }
+};
+
+/// Fenwick tree over instruction sizes: exact prefix offsets with O(log N)
+/// point updates when an instruction grows.
+class OffsetTree {
+  std::vector<uint64_t> Tree;
+
+public:
+  explicit OffsetTree(ArrayRef<uint32_t> Sizes) : Tree(Sizes.size() + 1) {
+    for (size_t I = 0; I < Sizes.size(); ++I)
+      Tree[I + 1] = Sizes[I];
+    for (size_t I = 1; I < Tree.size(); ++I) {
+      const size_t Parent = I + (I & -I);
+      if (Parent < Tree.size())
+        Tree[Parent] += Tree[I];
+    }
+  }
+
+  void add(size_t I, uint64_t Delta) {
+    for (++I; I < Tree.size(); I += I & -I)
+      Tree[I] += Delta;
+  }
+
+  /// Return the sum of the sizes of the first \p I instructions.
+  uint64_t prefix(size_t I) const {
+    uint64_t Sum = 0;
+    for (; I; I -= I & -I)
+      Sum += Tree[I];
+    return Sum;
+  }
+};
+
+} // end anonymous namespace
+
+namespace llvm {
+namespace bolt {
+
+uint64_t BranchRelaxationPass::runOnFunction(BinaryFunction &BF,
+                                             const MCAsmBackend &MAB,
+                                             const MCCodeEmitter *Emitter) {
+  const BinaryContext &BC = BF.getBinaryContext();
+
+  auto instructionSize = [&](const MCInst &Inst) -> uint32_t {
+    SmallString<256> Code;
+    SmallVector<MCFixup, 4> Fixups;
+    raw_svector_ostream VecOS(Code);
+    Emitter->encodeInstruction(Inst, VecOS, Fixups, *BC.STI);
+    return Code.size();
+  };
+
+  // Linearize the layout. Block alignment padding never grows during
+  // relaxation, so the worst-case padding is folded into a static prefix;
+  // over-estimating a distance can only widen a branch that the assembler
+  // would have kept short, never the other way around.
+  std::vector<MCInst *> Insts;
+  std::vector<uint32_t> Sizes;
+  std::vector<uint64_t> PadBefore;
+  std::vector<bool> InColdFragment;
+  DenseMap<const BinaryBasicBlock *, unsigned> BlockStartIndex;
+  uint64_t PadSum = 0;
+  for (BinaryBasicBlock *BB : BF.layout()) {
+    if (BB->getAlignment() > 1) {
+      uint64_t MaxPad = BB->getAlignment() - 1;
+      if (BB->getAlignmentMaxBytes())
+        MaxPad = std::min<uint64_t>(MaxPad, BB->getAlignmentMaxBytes());
+      PadSum += MaxPad;
+    }
+    BlockStartIndex[BB] = Insts.size();
+    for (MCInst &Inst : *BB) {
+      if (BC.MIB->isPseudo(Inst))
+        continue;
+      Insts.push_back(&Inst);
+      Sizes.push_back(instructionSize(Inst));
+      PadBefore.push_back(PadSum);
+      InColdFragment.push_back(BB->isCold());
+    }
+  }
+  if (Insts.empty())
+    return 0;
+
+  auto padAt = [&](unsigned Index) {
+    return Index < PadBefore.size() ? PadBefore[Index] : PadSum;
+  };
+
+  // Collect the relaxable branches. A branch whose target is outside the
+  // function or in the other fragment is widened right away: its final
+  // displacement is unknown here and has to be assumed far.
+  struct BranchInfo {
+    uint32_t InstIndex;
+    uint32_t TargetIndex;
+    bool Relaxed{false};
+  };
+  std::vector<BranchInfo> Branches;
+  uint64_t FuncNumRelaxed = 0;
+  for (uint32_t Index = 0; Index < Insts.size(); ++Index) {
+    MCInst &Inst = *Insts[Index];
+    if (!BC.MIB->isBranch(Inst) || !MAB.mayNeedRelaxation(Inst, *BC.STI))
+      continue;
+    const MCSymbol *TargetSymbol = BC.MIB->getTargetSymbol(Inst);
+    const BinaryBasicBlock *TargetBB =
+        TargetSymbol ? BF.getBasicBlockForLabel(TargetSymbol) : nullptr;
+    if (!TargetBB || TargetBB->isCold() != InColdFragment[Index]) {
+      MAB.relaxInstruction(Inst, *BC.STI);
+      Sizes[Index] = instructionSize(Inst);
+      ++FuncNumRelaxed;
+      continue;
+    }
+    Branches.push_back({Index, BlockStartIndex[TargetBB], false});
+  }
+  if (Branches.empty())
+    return FuncNumRelaxed;
+
+  // The displacement of a branch is measured from the end of its encoding,
+  // so it is the sum of the sizes of the instructions at positions
+  // [InstIndex + 1, TargetIndex) for a forward branch and the negated sum
+  // over [TargetIndex, InstIndex + 1) for a backward one. Register each
+  // branch under exactly that span.
+  OffsetTree Offsets(Sizes);
+  SpanIndex Spans(Insts.size());
+  for (uint32_t Id = 0; Id < Branches.size(); ++Id) {
+    const BranchInfo &BI = Branches[Id];
+    const unsigned Lo = std::min(BI.InstIndex + 1, BI.TargetIndex);
+    const unsigned Hi = std::max(BI.InstIndex + 1, BI.TargetIndex);
+    if (Lo < Hi)
+      Spans.insert(Lo, Hi, Id);
+  }
+
+  auto displacement = [&](const BranchInfo &BI) -> int64_t {
+    const int64_t SourceEnd =
+        Offsets.prefix(BI.InstIndex + 1) + padAt(BI.InstIndex);
+    const int64_t Target =
+        Offsets.prefix(BI.TargetIndex) + padAt(BI.TargetIndex);
+    return Target - SourceEnd;
+  };
+
+  // Start from the all-short assignment and widen a branch only when its
+  // exact displacement does not fit into a signed byte. Every growth
+  // re-examines just the branches stabbed at the grown position; branches
+  // only ever grow, so each one is widened at most once and the total work
+  // is near-linear in the number of instructions.
+  std::vector<uint32_t> Worklist(Branches.size());
+  std::iota(Worklist.begin(), Worklist.end(), 0);
+  while (!Worklist.empty()) {
+    const uint32_t Id = Worklist.back();
+    Worklist.pop_back();
+    BranchInfo &BI = Branches[Id];
+    if (BI.Relaxed)
+      continue;
+    const int64_t Disp = displacement(BI);
+    if (Disp >= std::numeric_limits<int8_t>::min() &&
+        Disp <= std::numeric_limits<int8_t>::max())
+      continue;
+
+    MCInst &Inst = *Insts[BI.InstIndex];
+    MAB.relaxInstruction(Inst, *BC.STI);
+    BI.Relaxed = true;
+    ++FuncNumRelaxed;
+
+    const uint32_t NewSize = instructionSize(Inst);
+    if (NewSize <= Sizes[BI.InstIndex])
+      continue;
+    Offsets.add(BI.InstIndex, NewSize - Sizes[BI.InstIndex]);
+    Sizes[BI.InstIndex] = NewSize;
+
+    SmallVector<uint32_t, 8> Stabbed;
+    Spans.query(BI.InstIndex, Stabbed);
+    for (const uint32_t StabbedId : Stabbed)
+      if (!Branches[StabbedId].Relaxed)
+        Worklist.push_back(StabbedId);
+  }
+
+  return FuncNumRelaxed;
+}
+
+void BranchRelaxationPass::runOnFunctions(BinaryContext &BC) {
+  if (!opts::PreRelaxBranches || !BC.isX86())
+    return;
+
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
+    // MCCodeEmitter is not thread safe: give every worker its own emitter
+    // and asm backend.
+    BinaryContext::IndependentCodeEmitter Emitter =
+        BC.createIndependentMCCodeEmitter();
+    std::unique_ptr<MCAsmBackend> MAB(
+        BC.TheTarget->createMCAsmBackend(*BC.STI, *BC.MRI, MCTargetOptions()));
+    NumRelaxed += runOnFunction(BF, *MAB, Emitter.MCE.get());
+  };
+
+  ParallelUtilities::PredicateTy SkipFunc = [&](const BinaryFunction &BF) {
+    return !shouldOptimize(BF);
+  };
+
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+      SkipFunc, "BranchRelaxation");
+
+  if (NumRelaxed)
+    outs() << "BOLT-INFO: " << NumRelaxed
+           << " branches were widened before emission\n";
+}
+
+} // end namespace bolt
+} // end namespace llvm
@@ -15,6 +15,9 @@
 #include "bolt/Core/BinaryBasicBlock.h"
 #include "bolt/Core/BinaryFunction.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
+#include <cmath>
+#include <random>
 #include <unordered_map>
 
 using namespace llvm;
@@ -31,90 +34,122 @@ extern cl::opt<unsigned> BackwardDistance;
 extern cl::opt<unsigned> ITLBPageSize;
 extern cl::opt<unsigned> ITLBEntries;
 
+static cl::opt<unsigned>
+CacheMetricsSampleSize("cache-metrics-sample-size",
+  cl::desc("maximum number of functions sampled per heat stratum when "
+           "computing cache metrics; 0 evaluates all functions"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 } // namespace opts
 
 namespace {
 
+/// Record the position and size of every basic block of \p BF
+void extractBasicBlockInfo(
+    BinaryFunction *BF,
+    std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
+    std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
+  const BinaryContext &BC = BF->getBinaryContext();
+  for (BinaryBasicBlock *BB : BF->layout()) {
+    if (BF->isSimple() || BC.HasRelocations) {
+      // Use addresses/sizes as in the output binary
+      BBAddr[BB] = BB->getOutputAddressRange().first;
+      BBSize[BB] = BB->getOutputSize();
+    } else {
+      // Output ranges should match the input if the body hasn't changed
+      BBAddr[BB] = BB->getInputAddressRange().first + BF->getAddress();
+      BBSize[BB] = BB->getOriginalSize();
+    }
+  }
+}
+
 /// Initialize and return a position map for binary basic blocks
 void extractBasicBlockInfo(
     const std::vector<BinaryFunction *> &BinaryFunctions,
     std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
     std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
+  for (BinaryFunction *BF : BinaryFunctions)
+    extractBasicBlockInfo(BF, BBAddr, BBSize);
+}
 
-  for (BinaryFunction *BF : BinaryFunctions) {
-    const BinaryContext &BC = BF->getBinaryContext();
-    for (BinaryBasicBlock *BB : BF->layout()) {
-      if (BF->isSimple() || BC.HasRelocations) {
-        // Use addresses/sizes as in the output binary
-        BBAddr[BB] = BB->getOutputAddressRange().first;
-        BBSize[BB] = BB->getOutputSize();
-      } else {
-        // Output ranges should match the input if the body hasn't changed
-        BBAddr[BB] = BB->getInputAddressRange().first + BF->getAddress();
-        BBSize[BB] = BB->getOriginalSize();
-      }
+/// Calculate TSP metric for one function, which quantifies the number of
+/// fallthrough jumps in the ordering of basic blocks
+double
+calcTSPScore(BinaryFunction *BF,
+             const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
+             const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
+  double Score = 0;
+  for (BinaryBasicBlock *SrcBB : BF->layout()) {
+    auto BI = SrcBB->branch_info_begin();
+    for (BinaryBasicBlock *DstBB : SrcBB->successors()) {
+      if (SrcBB != DstBB && BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE &&
+          BBAddr.at(SrcBB) + BBSize.at(SrcBB) == BBAddr.at(DstBB))
+        Score += BI->Count;
+      ++BI;
     }
   }
+  return Score;
 }
 
-/// Calculate TSP metric, which quantifies the number of fallthrough jumps in
-/// the ordering of basic blocks
 double
 calcTSPScore(const std::vector<BinaryFunction *> &BinaryFunctions,
              const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
              const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
-
   double Score = 0;
-  for (BinaryFunction *BF : BinaryFunctions) {
-    if (!BF->hasProfile())
-      continue;
-    for (BinaryBasicBlock *SrcBB : BF->layout()) {
-      auto BI = SrcBB->branch_info_begin();
-      for (BinaryBasicBlock *DstBB : SrcBB->successors()) {
-        if (SrcBB != DstBB && BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE &&
-            BBAddr.at(SrcBB) + BBSize.at(SrcBB) == BBAddr.at(DstBB))
-          Score += BI->Count;
-        ++BI;
-      }
+  for (BinaryFunction *BF : BinaryFunctions)
+    if (BF->hasProfile())
+      Score += calcTSPScore(BF, BBAddr, BBSize);
+  return Score;
+}
+
+/// Calculate Ext-TSP metric for one function, which quantifies the expected
+/// number of i-cache misses for a given ordering of basic blocks
+double calcExtTSPScore(
+    BinaryFunction *BF,
+    const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
+    const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
+  double Score = 0.0;
+  for (BinaryBasicBlock *SrcBB : BF->layout()) {
+    auto BI = SrcBB->branch_info_begin();
+    for (BinaryBasicBlock *DstBB : SrcBB->successors()) {
+      if (DstBB != SrcBB)
+        Score += CacheMetrics::extTSPScore(BBAddr.at(SrcBB), BBSize.at(SrcBB),
+                                           BBAddr.at(DstBB), BI->Count);
+      ++BI;
     }
   }
   return Score;
 }
 
-/// Calculate Ext-TSP metric, which quantifies the expected number of i-cache
-/// misses for a given ordering of basic blocks
 double calcExtTSPScore(
     const std::vector<BinaryFunction *> &BinaryFunctions,
     const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
     const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
-
   double Score = 0.0;
-  for (BinaryFunction *BF : BinaryFunctions) {
-    if (!BF->hasProfile())
-      continue;
-    for (BinaryBasicBlock *SrcBB : BF->layout()) {
-      auto BI = SrcBB->branch_info_begin();
-      for (BinaryBasicBlock *DstBB : SrcBB->successors()) {
-        if (DstBB != SrcBB)
-          Score += CacheMetrics::extTSPScore(BBAddr.at(SrcBB), BBSize.at(SrcBB),
-                                             BBAddr.at(DstBB), BI->Count);
-        ++BI;
-      }
-    }
-  }
+  for (BinaryFunction *BF : BinaryFunctions)
+    if (BF->hasProfile())
+      Score += calcExtTSPScore(BF, BBAddr, BBSize);
   return Score;
 }
 
-using Predecessors = std::vector<std::pair<BinaryFunction *, uint64_t>>;
+using Predecessors = std::vector<std::pair<BinaryFunction *, double>>;
 
 /// Build a simplified version of the call graph: For every function, keep
-/// its callers and the frequencies of the calls
-std::unordered_map<const BinaryFunction *, Predecessors>
-extractFunctionCalls(const std::vector<BinaryFunction *> &BinaryFunctions) {
+/// its callers and the frequencies of the calls. When \p Weights is given,
+/// only the listed functions act as callers and each call count is scaled
+/// by the caller's weight.
+std::unordered_map<const BinaryFunction *, Predecessors> extractFunctionCalls(
+    const std::vector<BinaryFunction *> &BinaryFunctions,
+    const std::unordered_map<const BinaryFunction *, double> *Weights =
+        nullptr) {
   std::unordered_map<const BinaryFunction *, Predecessors> Calls;
 
   for (BinaryFunction *SrcFunction : BinaryFunctions) {
     const BinaryContext &BC = SrcFunction->getBinaryContext();
+    const double Weight = Weights ? Weights->at(SrcFunction) : 1.0;
     for (BinaryBasicBlock *BB : SrcFunction->layout()) {
       // Find call instructions and extract target symbols from each one
       for (MCInst &Inst : *BB) {
@@ -135,13 +170,80 @@ extractFunctionCalls(const std::vector<BinaryFunction *> &BinaryFunctions) {
           continue;
 
         // Record the call
-        Calls[DstFunction].emplace_back(SrcFunction, Count);
+        Calls[DstFunction].emplace_back(SrcFunction, Count * Weight);
       }
     }
   }
   return Calls;
 }
 
+/// Partition the profiled functions into strata by the binary logarithm of
+/// their execution count and select up to \p SampleSize functions from each
+/// stratum uniformly at random. Functions of similar heat contribute scores
+/// of similar magnitude, so stratifying by heat keeps the within-stratum
+/// variance, and with it the confidence interval of the estimates, small.
+void sampleFunctionsByHeat(const std::vector<BinaryFunction *> &BinaryFunctions,
+                           unsigned SampleSize,
+                           std::vector<std::vector<BinaryFunction *>> &Samples,
+                           std::vector<size_t> &StrataSizes) {
+  std::vector<std::vector<BinaryFunction *>> Strata(65);
+  for (BinaryFunction *BF : BinaryFunctions) {
+    // Functions without a profile contribute to none of the metrics.
+    if (!BF->hasProfile())
+      continue;
+    const uint64_t Count = BF->getKnownExecutionCount();
+    const unsigned Stratum = Count == 0 ? 0 : 64 - countLeadingZeros(Count);
+    Strata[Stratum].push_back(BF);
+  }
+
+  // A fixed seed keeps the reported metrics reproducible across runs.
+  std::mt19937_64 Gen(20230815);
+  for (std::vector<BinaryFunction *> &Stratum : Strata) {
+    if (Stratum.empty())
+      continue;
+    const size_t Size = std::min<size_t>(SampleSize, Stratum.size());
+    // Partial Fisher-Yates shuffle placing the sample at the front.
+    for (size_t I = 0; I < Size; ++I) {
+      std::uniform_int_distribution<size_t> Distr(I, Stratum.size() - 1);
+      std::swap(Stratum[I], Stratum[Distr(Gen)]);
+    }
+    StrataSizes.push_back(Stratum.size());
+    Stratum.resize(Size);
+    Samples.push_back(std::move(Stratum));
+  }
+}
+
+/// Estimate the total of a per-function metric from a stratified sample.
+/// Return the estimate together with the half-width of its 95% confidence
+/// interval.
+template <typename ScoreFuncTy>
+std::pair<double, double>
+estimateMetric(const std::vector<std::vector<BinaryFunction *>> &Samples,
+               const std::vector<size_t> &StrataSizes, ScoreFuncTy Score) {
+  double Total = 0.0;
+  double Variance = 0.0;
+  for (size_t H = 0; H < Samples.size(); ++H) {
+    const std::vector<BinaryFunction *> &Sample = Samples[H];
+    const double N = StrataSizes[H];
+    const double n = Sample.size();
+    double Sum = 0.0;
+    double SumSq = 0.0;
+    for (BinaryFunction *BF : Sample) {
+      const double X = Score(BF);
+      Sum += X;
+      SumSq += X * X;
+    }
+    Total += N / n * Sum;
+    // Fully enumerated strata add no variance (finite population correction).
+    if (Sample.size() > 1 && n < N) {
+      const double Mean = Sum / n;
+      const double S2 = (SumSq - n * Mean * Mean) / (n - 1);
+      Variance += N * (N - n) * std::max(S2, 0.0) / n;
+    }
+  }
+  return std::make_pair(Total, 1.96 * std::sqrt(Variance));
+}
+
 /// Compute expected hit ratio of the i-TLB cache (optimized by HFSortPlus alg).
 /// Given an assignment of functions to the i-TLB pages), we divide all
 /// functions calls into two categories:
@@ -157,19 +259,19 @@ extractFunctionCalls(const std::vector<BinaryFunction *> &BinaryFunctions) {
 double expectedCacheHitRatio(
     const std::vector<BinaryFunction *> &BinaryFunctions,
     const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
-    const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
+    const std::unordered_map<const BinaryFunction *, Predecessors> &Calls) {
 
   const double PageSize = opts::ITLBPageSize;
   const uint64_t CacheEntries = opts::ITLBEntries;
-  std::unordered_map<const BinaryFunction *, Predecessors> Calls =
-      extractFunctionCalls(BinaryFunctions);
   // Compute 'hotness' of the functions
   double TotalSamples = 0;
   std::unordered_map<BinaryFunction *, double> FunctionSamples;
   for (BinaryFunction *BF : BinaryFunctions) {
     double Samples = 0;
-    for (std::pair<BinaryFunction *, uint64_t> Pair : Calls[BF])
-      Samples += Pair.second;
+    auto CallsIt = Calls.find(BF);
+    if (CallsIt != Calls.end())
+      for (const std::pair<BinaryFunction *, double> &Pair : CallsIt->second)
+        Samples += Pair.second;
     Samples = std::max(Samples, (double)BF->getKnownExecutionCount());
     FunctionSamples[BF] = Samples;
     TotalSamples += Samples;
@@ -196,15 +298,18 @@ double expectedCacheHitRatio(
     double MissProb = pow(1.0 - PageSamples[Page] / TotalSamples, CacheEntries);
 
     // Processing all callers of the function
-    for (std::pair<BinaryFunction *, uint64_t> Pair : Calls[BF]) {
-      BinaryFunction *SrcFunction = Pair.first;
-      double SrcPage = BBAddr.at(SrcFunction->layout_front()) / PageSize;
-      // Is this a 'long' or a 'short' call?
-      if (Page != SrcPage) {
-        // This is a miss
-        Misses += MissProb * Pair.second;
+    auto CallsIt = Calls.find(BF);
+    if (CallsIt != Calls.end()) {
+      for (const std::pair<BinaryFunction *, double> &Pair : CallsIt->second) {
+        BinaryFunction *SrcFunction = Pair.first;
+        double SrcPage = BBAddr.at(SrcFunction->layout_front()) / PageSize;
+        // Is this a 'long' or a 'short' call?
+        if (Page != SrcPage) {
+          // This is a miss
+          Misses += MissProb * Pair.second;
+        }
+        Samples -= Pair.second;
       }
-      Samples -= Pair.second;
     }
     assert(Samples >= 0.0 && "Function samples computed incorrectly");
     // The remaining samples likely come from the jitted code
@@ -214,6 +319,54 @@ double expectedCacheHitRatio(
   return 100.0 * (1.0 - Misses / TotalSamples);
 }
 
+/// Report the padding bytes realized between consecutive blocks of the final
+/// layout, broken down by the heat of the padded-to block. The breakdown
+/// shows whether the alignment budget is spent on hot targets or burned on
+/// lukewarm code that only adds i-TLB pressure.
+void printAlignmentPadding(const std::vector<BinaryFunction *> &BFs) {
+  // Pairs of (execution count, padding bytes) for every padded-to block.
+  std::vector<std::pair<uint64_t, uint64_t>> PaddedBlocks;
+  size_t TotalPadding = 0;
+  for (BinaryFunction *BF : BFs) {
+    const BinaryBasicBlock *PrevBB = nullptr;
+    for (BinaryBasicBlock *BB : BF->layout()) {
+      // The hot and cold parts are emitted into different sections, so a gap
+      // between them is not alignment padding.
+      if (PrevBB && PrevBB->isCold() == BB->isCold() &&
+          BB->getOutputAddressRange().first >
+              PrevBB->getOutputAddressRange().second) {
+        const uint64_t Padding = BB->getOutputAddressRange().first -
+                                 PrevBB->getOutputAddressRange().second;
+        PaddedBlocks.emplace_back(BB->getKnownExecutionCount(), Padding);
+        TotalPadding += Padding;
+      }
+      PrevBB = BB;
+    }
+  }
+
+  if (PaddedBlocks.empty()) {
+    outs() << "  No alignment padding between basic blocks\n";
+    return;
+  }
+
+  // Bucket the padded blocks into deciles by execution count, hottest first.
+  std::sort(PaddedBlocks.begin(), PaddedBlocks.end(),
+            [](const std::pair<uint64_t, uint64_t> &A,
+               const std::pair<uint64_t, uint64_t> &B) {
+              return A.first > B.first;
+            });
+  size_t DecilePadding[10] = {0};
+  for (size_t I = 0; I < PaddedBlocks.size(); ++I)
+    DecilePadding[I * 10 / PaddedBlocks.size()] += PaddedBlocks[I].second;
+
+  outs() << format("  Block alignment padding: %zu bytes over %zu blocks; "
+                   "by heat decile (hottest first):",
+                   TotalPadding, PaddedBlocks.size());
+  for (size_t Padding : DecilePadding)
+    outs() << format(" %zu", Padding);
+  outs() << "\n";
+}
+
 } // namespace
 
 double CacheMetrics::extTSPScore(uint64_t SrcAddr, uint64_t SrcSize,
@@ -243,6 +396,32 @@ double CacheMetrics::extTSPScore(uint64_t SrcAddr, uint64_t SrcSize,
   return 0;
 }
 
+double CacheMetrics::scoreLayout(ArrayRef<BinaryBasicBlock *> Order,
+                                 const MCCodeEmitter *Emitter) {
+  // Lay the blocks out at estimated addresses without emitting the function
+  std::unordered_map<const BinaryBasicBlock *, uint64_t> BBAddr;
+  std::unordered_map<const BinaryBasicBlock *, uint64_t> BBSize;
+  uint64_t Addr = 0;
+  for (BinaryBasicBlock *BB : Order) {
+    const uint64_t Size = BB->estimateSize(Emitter);
+    BBAddr[BB] = Addr;
+    BBSize[BB] = Size;
+    Addr += Size;
+  }
+
+  double Score = 0.0;
+  for (BinaryBasicBlock *SrcBB : Order) {
+    auto BI = SrcBB->branch_info_begin();
+    for (BinaryBasicBlock *DstBB : SrcBB->successors()) {
+      if (DstBB != SrcBB && BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE)
+        Score += extTSPScore(BBAddr.at(SrcBB), BBSize.at(SrcBB),
+                             BBAddr.at(DstBB), BI->Count);
+      ++BI;
+    }
+  }
+  return Score;
+}
+
 void CacheMetrics::printAll(const std::vector<BinaryFunction *> &BFs) {
   // Stats related to hot-cold code splitting
   size_t NumFunctions = 0;
@@ -295,17 +474,61 @@ void CacheMetrics::printAll(const std::vector<BinaryFunction *> &BFs) {
                    100.0 * HotCodeSize / TotalCodeSize, HotCodeSize,
                    TotalCodeSize, double(HotCodeSize) / HugePage2MB);
 
+  printAlignmentPadding(BFs);
+
   // Stats related to expected cache performance
   std::unordered_map<BinaryBasicBlock *, uint64_t> BBAddr;
   std::unordered_map<BinaryBasicBlock *, uint64_t> BBSize;
   extractBasicBlockInfo(BFs, BBAddr, BBSize);
 
-  outs() << "  Expected i-TLB cache hit ratio: "
-         << format("%.2lf%%\n", expectedCacheHitRatio(BFs, BBAddr, BBSize));
+  if (!opts::CacheMetricsSampleSize) {
+    std::unordered_map<const BinaryFunction *, Predecessors> Calls =
+        extractFunctionCalls(BFs);
+
+    outs() << "  Expected i-TLB cache hit ratio: "
+           << format("%.2lf%%\n", expectedCacheHitRatio(BFs, BBAddr, Calls));
+
+    outs() << "  TSP score: "
+           << format("%.0lf\n", calcTSPScore(BFs, BBAddr, BBSize));
 
-  outs() << "  TSP score: "
-         << format("%.0lf\n", calcTSPScore(BFs, BBAddr, BBSize));
+    outs() << "  ExtTSP score: "
+           << format("%.0lf\n", calcExtTSPScore(BFs, BBAddr, BBSize));
+    return;
+  }
 
-  outs() << "  ExtTSP score: "
-         << format("%.0lf\n", calcExtTSPScore(BFs, BBAddr, BBSize));
+  // Estimate the scores from a sample of functions stratified by heat. The
+  // additive TSP metrics come with a confidence interval; the i-TLB hit
+  // ratio mixes the sampled call graph non-linearly, so it is reported as an
+  // approximation without bounds.
+  std::vector<std::vector<BinaryFunction *>> Samples;
+  std::vector<size_t> StrataSizes;
+  sampleFunctionsByHeat(BFs, opts::CacheMetricsSampleSize, Samples,
+                        StrataSizes);
+
+  std::unordered_map<const BinaryFunction *, double> Weights;
+  std::vector<BinaryFunction *> SampledFunctions;
+  for (size_t H = 0; H < Samples.size(); ++H) {
+    for (BinaryFunction *BF : Samples[H]) {
+      Weights[BF] = static_cast<double>(StrataSizes[H]) / Samples[H].size();
+      SampledFunctions.push_back(BF);
+    }
+  }
+
+  std::unordered_map<const BinaryFunction *, Predecessors> Calls =
+      extractFunctionCalls(SampledFunctions, &Weights);
+
+  outs() << "  Expected i-TLB cache hit ratio (sampled): "
+         << format("%.2lf%%\n", expectedCacheHitRatio(BFs, BBAddr, Calls));
+
+  const std::pair<double, double> TSP = estimateMetric(
+      Samples, StrataSizes,
+      [&](BinaryFunction *BF) { return calcTSPScore(BF, BBAddr, BBSize); });
+  outs() << "  TSP score: " << format("%.0lf +- %.0lf (95%% confidence)\n",
+                                      TSP.first, TSP.second);
+
+  const std::pair<double, double> ExtTSP = estimateMetric(
+      Samples, StrataSizes,
+      [&](BinaryFunction *BF) { return calcExtTSPScore(BF, BBAddr, BBSize); });
+  outs() << "  ExtTSP score: " << format("%.0lf +- %.0lf (95%% confidence)\n",
+                                         ExtTSP.first, ExtTSP.second);
 }
@@ -16,9 +16,21 @@
 #include "llvm/Support/Timer.h"
 #include <queue>
 #include <set>
+#include <unordered_map>
 
 namespace opts {
+extern llvm::cl::OptionCategory BoltOptCategory;
 extern llvm::cl::opt<bool> TimeOpts;
+
+static llvm::cl::opt<unsigned>
+CGWalkRevisitBudget("cg-walk-revisit-budget",
+  llvm::cl::desc("maximum number of times a function is re-analyzed during "
+                 "interprocedural call graph traversals before its result is "
+                 "conservatively saturated (0 = iterate to fixed point)"),
+  llvm::cl::init(8),
+  llvm::cl::ZeroOrMore,
+  llvm::cl::Hidden,
+  llvm::cl::cat(BoltOptCategory));
 }
 
 namespace llvm {
@@ -27,34 +39,70 @@ namespace bolt {
 void CallGraphWalker::traverseCG() {
   NamedRegionTimer T1("CG Traversal", "CG Traversal", "CG breakdown",
                       "CG breakdown", opts::TimeOpts);
-  std::queue<BinaryFunction *> Queue;
+  // Position of every function in the bottom-up traversal order. The queue
+  // below is prioritized by this index, so a re-enqueued caller is not
+  // examined before all of its pending callees have settled, which keeps the
+  // number of revisits at a minimum.
+  std::unordered_map<BinaryFunction *, uint32_t> TopoIndex;
+  TopoIndex.reserve(TopologicalCGOrder.size());
+  uint32_t NextIndex = 0;
+  for (BinaryFunction *Func : TopologicalCGOrder)
+    TopoIndex[Func] = NextIndex++;
+
+  auto CalleesFirst = [&](BinaryFunction *A, BinaryFunction *B) {
+    return TopoIndex[A] > TopoIndex[B];
+  };
+  std::priority_queue<BinaryFunction *, std::vector<BinaryFunction *>,
+                      decltype(CalleesFirst)>
+      Queue(CalleesFirst);
   std::set<BinaryFunction *> InQueue;
+  std::unordered_map<BinaryFunction *, unsigned> VisitCount;
+  std::set<BinaryFunction *> Saturated;
 
   for (BinaryFunction *Func : TopologicalCGOrder) {
     Queue.push(Func);
     InQueue.insert(Func);
   }
 
+  const bool EnforceBudget = opts::CGWalkRevisitBudget && !Fallbacks.empty();
+
+  auto enqueueCallers = [&](BinaryFunction *Func) {
+    for (CallGraph::NodeId CallerID : CG.predecessors(CG.getNodeId(Func))) {
+      BinaryFunction *CallerFunc = CG.nodeIdToFunc(CallerID);
+      if (InQueue.count(CallerFunc) || Saturated.count(CallerFunc))
+        continue;
+      Queue.push(CallerFunc);
+      InQueue.insert(CallerFunc);
+    }
+  };
+
   while (!Queue.empty()) {
-    BinaryFunction *Func = Queue.front();
+    BinaryFunction *Func = Queue.top();
     Queue.pop();
     InQueue.erase(Func);
 
+    // Only members of call graph cycles are ever revisited. A function that
+    // keeps changing past the budget has its tracked properties saturated to
+    // their conservative values, is propagated to callers one last time and
+    // drops out of the iteration.
+    if (EnforceBudget && VisitCount[Func] >= opts::CGWalkRevisitBudget) {
+      if (Saturated.insert(Func).second) {
+        for (const FallbackTy &Fallback : Fallbacks)
+          Fallback(Func);
+        enqueueCallers(Func);
+      }
+      continue;
+    }
+    ++VisitCount[Func];
+
     bool Changed = false;
     for (CallbackTy Visitor : Visitors) {
       bool CurVisit = Visitor(Func);
       Changed = Changed || CurVisit;
     }
 
-    if (Changed) {
-      for (CallGraph::NodeId CallerID : CG.predecessors(CG.getNodeId(Func))) {
-        BinaryFunction *CallerFunc = CG.nodeIdToFunc(CallerID);
-        if (InQueue.count(CallerFunc))
-          continue;
-        Queue.push(CallerFunc);
-        InQueue.insert(CallerFunc);
-      }
-    }
+    if (Changed)
+      enqueueCallers(Func);
   }
 }
 
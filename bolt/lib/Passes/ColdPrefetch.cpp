@@ -0,0 +1,92 @@
+//===- bolt/Passes/ColdPrefetch.cpp ---------------------------------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the ColdPrefetch pass.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bolt/Passes/ColdPrefetch.h"
+
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+cl::opt<bool> ColdPrefetch(
+    "cold-prefetch",
+    cl::desc("insert software prefetches of cold fragment code at hot->cold "
+             "transition sites with enough profile weight"),
+    cl::init(false), cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<uint64_t> ColdPrefetchThreshold(
+    "cold-prefetch-threshold",
+    cl::desc("minimum execution count of a hot->cold transition for inserting "
+             "a prefetch (default: 100)"),
+    cl::init(100), cl::Hidden, cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+
+void ColdPrefetch::runOnFunction(BinaryFunction &Function) {
+  BinaryContext &BC = Function.getBinaryContext();
+  for (BinaryBasicBlock *BB : Function.layout()) {
+    if (BB->isCold())
+      continue;
+    for (BinaryBasicBlock *Succ : BB->successors()) {
+      if (!Succ->isCold())
+        continue;
+      const BinaryBasicBlock::BinaryBranchInfo &BI = BB->getBranchInfo(*Succ);
+      if (BI.Count == BinaryBasicBlock::COUNT_NO_PROFILE ||
+          BI.Count < opts::ColdPrefetchThreshold)
+        continue;
+      MCInst Prefetch;
+      if (!BC.MIB->createPrefetch(Prefetch, Succ->getLabel(), BC.Ctx.get())) {
+        Unsupported = true;
+        return;
+      }
+      // Place the prefetch ahead of the terminators so that it issues on
+      // every execution of the block, slightly before the transition can be
+      // taken.
+      auto II = BB->begin();
+      while (II != BB->end() && !BC.MIB->isTerminator(*II))
+        ++II;
+      BB->insertInstruction(II, std::move(Prefetch));
+      ++NumPrefetches;
+      // At most one prefetch per block.
+      break;
+    }
+  }
+}
+
+void ColdPrefetch::runOnFunctions(BinaryContext &BC) {
+  // Instruction creation allocates symbol expressions in the MC context,
+  // which is not thread-safe, and the per-function work is trivial: run
+  // serially.
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    BinaryFunction &Function = BFI.second;
+    if (!shouldOptimize(Function) || !Function.isSplit() ||
+        !Function.hasValidProfile())
+      continue;
+    runOnFunction(Function);
+    if (Unsupported)
+      break;
+  }
+
+  if (Unsupported) {
+    errs() << "BOLT-WARNING: -cold-prefetch is not supported on this target\n";
+    return;
+  }
+  outs() << "BOLT-INFO: cold-prefetch inserted " << NumPrefetches
+         << " prefetches at hot->cold transition sites\n";
+}
+
+} // namespace bolt
+} // namespace llvm
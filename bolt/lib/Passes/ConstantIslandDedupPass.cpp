@@ -0,0 +1,226 @@
+//===- bolt/Passes/ConstantIslandDedupPass.cpp ----------------------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the ConstantIslandDedupPass class. Compilers emit
+// constant pools per function, so the same FP constants and vector masks
+// are repeated in the islands of many functions. The pass hash-indexes the
+// island contents of all emitted functions and folds byte-identical islands
+// placed in the same output section into a single copy: the duplicates are
+// not emitted and their island symbols are defined inside the surviving
+// copy instead, so no instruction has to be rewritten. Folding is limited
+// to functions whose estimated emission addresses are well within the +-1MB
+// reach of literal loads and ADR, keeping the in-range assumptions settled
+// by ADR relaxation and LongJmp intact.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bolt/Passes/ConstantIslandDedupPass.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/StringMap.h"
+
+using namespace llvm;
+
+namespace opts {
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<bool> DedupConstantIslands(
+    "dedup-constant-islands",
+    cl::desc("fold identical constant islands of nearby functions (AArch64)"),
+    cl::init(false), cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned> ConstantIslandMergeDistance(
+    "constant-island-merge-distance",
+    cl::desc("maximum estimated distance, in bytes, bridged when folding "
+             "identical constant islands"),
+    cl::init(0x80000), cl::ZeroOrMore, cl::Hidden, cl::cat(BoltOptCategory));
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+
+namespace {
+
+/// A function's island contents in normalized form: the non-empty data
+/// chunks the emitter will produce, keyed by their offset relative to the
+/// first chunk.
+using IslandChunks = SmallVector<std::pair<uint64_t, StringRef>, 4>;
+
+struct IslandCandidate {
+  BinaryFunction *BF;
+
+  /// Estimated output address of the function within its section.
+  uint64_t EstimatedAddress;
+
+  /// Offset of the first data byte in the input function.
+  uint64_t FirstOffset;
+
+  IslandChunks Chunks;
+  uint64_t Hash;
+};
+
+/// Return true for functions whose islands may be folded away. The islands
+/// of functions depending on other functions' islands stay put since their
+/// emission also triggers the proxy emission of those dependencies. Split
+/// functions are kept out to avoid reasoning about cold island copies.
+bool isEligible(const BinaryFunction &BF) {
+  if (!BF.isSimple() || BF.size() == 0 || BF.isSplit())
+    return false;
+  if (!BF.hasIslandsInfo())
+    return false;
+  const BinaryFunction::IslandInfo &Islands = BF.getIslandInfo();
+  return !Islands.DataOffsets.empty() && Islands.Relocations.empty() &&
+         Islands.Dependency.empty();
+}
+
+/// Compute the normalized island contents of \p BF, mirroring the chunk
+/// boundaries the emitter derives from the data/code markers.
+void computeIslandChunks(const BinaryFunction &BF, IslandChunks &Chunks,
+                         uint64_t &FirstOffset) {
+  const BinaryFunction::IslandInfo &Islands = BF.getIslandInfo();
+  StringRef FunctionContents = BF.getOriginSection()->getContents().substr(
+      BF.getAddress() - BF.getOriginSection()->getAddress(), BF.getMaxSize());
+
+  for (auto DataIter = Islands.DataOffsets.begin();
+       DataIter != Islands.DataOffsets.end(); ++DataIter) {
+    const uint64_t FunctionOffset = *DataIter;
+    uint64_t EndOffset = 0ULL;
+
+    auto NextData = std::next(DataIter);
+    auto CodeIter = Islands.CodeOffsets.lower_bound(*DataIter);
+    if (CodeIter == Islands.CodeOffsets.end() &&
+        NextData == Islands.DataOffsets.end())
+      EndOffset = BF.getMaxSize();
+    else if (CodeIter == Islands.CodeOffsets.end())
+      EndOffset = *NextData;
+    else if (NextData == Islands.DataOffsets.end())
+      EndOffset = *CodeIter;
+    else
+      EndOffset = (*CodeIter > *NextData) ? *NextData : *CodeIter;
+
+    if (FunctionOffset == EndOffset)
+      continue;
+
+    if (Chunks.empty())
+      FirstOffset = FunctionOffset;
+    Chunks.emplace_back(FunctionOffset - FirstOffset,
+                        FunctionContents.slice(FunctionOffset, EndOffset));
+  }
+}
+
+} // anonymous namespace
+
+void ConstantIslandDedupPass::runOnFunctions(BinaryContext &BC) {
+  if (!opts::DedupConstantIslands || !BC.isAArch64() || !BC.HasRelocations)
+    return;
+
+  // Estimate output addresses from the emission order within each section.
+  // The input footprint overestimates the emitted size of most functions,
+  // which errs towards skipping a fold, and the merge distance leaves
+  // enough of the literal load range to absorb code growth.
+  std::vector<IslandCandidate> Candidates;
+  StringMap<uint64_t> SectionOffset;
+  for (BinaryFunction *BF : BC.getSortedFunctions()) {
+    if (!BF->isSimple() || BF->size() == 0)
+      continue;
+    uint64_t &Offset = SectionOffset[BF->getCodeSectionName()];
+    Offset = alignTo(Offset, std::max<uint64_t>(BF->getAlignment(), 1));
+    const uint64_t Address = Offset;
+    Offset += BF->getMaxSize();
+
+    if (!isEligible(*BF))
+      continue;
+
+    IslandCandidate Candidate;
+    Candidate.BF = BF;
+    Candidate.EstimatedAddress = Address;
+    Candidate.FirstOffset = 0;
+    computeIslandChunks(*BF, Candidate.Chunks, Candidate.FirstOffset);
+    if (Candidate.Chunks.empty())
+      continue;
+
+    hash_code Hash = hash_value(Candidate.Chunks.size());
+    for (const std::pair<uint64_t, StringRef> &Chunk : Candidate.Chunks)
+      Hash = hash_combine(Hash, Chunk.first, hash_value(Chunk.second));
+    Candidate.Hash = Hash;
+    Candidates.push_back(std::move(Candidate));
+  }
+
+  std::map<uint64_t, std::vector<IslandCandidate *>> Buckets;
+  for (IslandCandidate &Candidate : Candidates)
+    Buckets[Candidate.Hash].push_back(&Candidate);
+
+  uint64_t NumFolded = 0;
+  uint64_t BytesSaved = 0;
+  for (std::pair<const uint64_t, std::vector<IslandCandidate *>> &KV :
+       Buckets) {
+    std::vector<IslandCandidate *> &Bucket = KV.second;
+    if (Bucket.size() < 2)
+      continue;
+    llvm::sort(Bucket, [](const IslandCandidate *A, const IslandCandidate *B) {
+      if (A->BF->getCodeSectionName() != B->BF->getCodeSectionName())
+        return A->BF->getCodeSectionName() < B->BF->getCodeSectionName();
+      if (A->EstimatedAddress != B->EstimatedAddress)
+        return A->EstimatedAddress < B->EstimatedAddress;
+      return A->BF->getAddress() < B->BF->getAddress();
+    });
+
+    // Greedily fold candidates into the closest preceding copy with the
+    // same contents and section. Once a copy runs out of range it is
+    // replaced by the current candidate, since all remaining candidates
+    // are at least as far away from it.
+    std::vector<IslandCandidate *> Survivors;
+    for (IslandCandidate *Candidate : Bucket) {
+      IslandCandidate **Rep = nullptr;
+      for (IslandCandidate *&Survivor : Survivors) {
+        if (Survivor->Chunks == Candidate->Chunks &&
+            Survivor->BF->getCodeSectionName() ==
+                Candidate->BF->getCodeSectionName()) {
+          Rep = &Survivor;
+          break;
+        }
+      }
+      if (!Rep) {
+        Survivors.push_back(Candidate);
+        continue;
+      }
+      if (Candidate->EstimatedAddress + Candidate->BF->getMaxSize() -
+              (*Rep)->EstimatedAddress >
+          opts::ConstantIslandMergeDistance) {
+        *Rep = Candidate;
+        continue;
+      }
+
+      // Define the duplicate's island symbols at the matching offsets
+      // inside the surviving copy. The references in its body need no
+      // rewriting.
+      BinaryFunction::IslandInfo &RepIslands = (*Rep)->BF->getIslandInfo();
+      BinaryFunction::IslandInfo &Islands = Candidate->BF->getIslandInfo();
+      Islands.MergedInto = (*Rep)->BF;
+      for (const std::pair<const uint64_t, MCSymbol *> &OffSym :
+           Islands.Offsets)
+        RepIslands.MergedSymbols.emplace(
+            OffSym.first - Candidate->FirstOffset + (*Rep)->FirstOffset,
+            OffSym.second);
+      RepIslands.MergedSymbols.emplace(
+          (*Rep)->FirstOffset,
+          Candidate->BF->getFunctionConstantIslandLabel());
+
+      ++NumFolded;
+      for (const std::pair<uint64_t, StringRef> &Chunk : Candidate->Chunks)
+        BytesSaved += Chunk.second.size();
+    }
+  }
+
+  if (NumFolded)
+    outs() << "BOLT-INFO: folded " << NumFolded
+           << " constant islands identical to a nearby copy, saving "
+           << BytesSaved << " bytes\n";
+}
+
+} // end namespace bolt
+} // end namespace llvm
@@ -0,0 +1,119 @@
+//===- bolt/Passes/ConstantIslandPlacementPass.cpp ------------------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the ConstantIslandPlacementPass class. By default the
+// constant islands of a function are emitted past the last block of the hot
+// fragment, so after block reordering hot literal loads may reach across the
+// whole function body. The pass anchors the islands right behind the hottest
+// block referencing them instead. Both positions lie within the function
+// span, so the in-range assumption the ADR relaxation pass makes for local
+// island references still holds.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bolt/Passes/ConstantIslandPlacementPass.h"
+#include "bolt/Core/ParallelUtilities.h"
+#include <atomic>
+
+using namespace llvm;
+
+namespace opts {
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<bool> PlaceConstantIslands(
+    "hot-constant-islands",
+    cl::desc("emit constant islands next to the hottest block referencing "
+             "them (AArch64)"),
+    cl::init(false), cl::ZeroOrMore, cl::cat(BoltOptCategory));
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+
+bool ConstantIslandPlacementPass::runOnFunction(BinaryFunction &BF) {
+  BinaryContext &BC = BF.getBinaryContext();
+  BinaryFunction::IslandInfo &Islands = BF.getIslandInfo();
+  if (Islands.DataOffsets.empty())
+    return false;
+
+  // Find the hottest block referencing one of the function's own islands.
+  // References to other functions' islands do not affect where our data
+  // goes.
+  const BinaryBasicBlock *HottestBB = nullptr;
+  for (const BinaryBasicBlock &BB : BF) {
+    if (!BB.getKnownExecutionCount() || BB.isCold())
+      continue;
+    if (HottestBB &&
+        BB.getKnownExecutionCount() <= HottestBB->getKnownExecutionCount())
+      continue;
+    for (const MCInst &Inst : BB) {
+      bool ReferencesIsland = false;
+      for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E;
+           ++I) {
+        const MCSymbol *Symbol = BC.MIB->getTargetSymbol(Inst, I);
+        if (Symbol && Islands.Symbols.count(Symbol)) {
+          ReferencesIsland = true;
+          break;
+        }
+      }
+      if (ReferencesIsland) {
+        HottestBB = &BB;
+        break;
+      }
+    }
+  }
+  if (!HottestBB)
+    return false;
+
+  // Walk the layout forward to the first point where data can be placed:
+  // past a block that never falls through to its layout successor.
+  const BinaryBasicBlock *Anchor = nullptr;
+  bool SeenHottest = false;
+  for (const BinaryBasicBlock *BB : BF.layout()) {
+    SeenHottest |= BB == HottestBB;
+    if (!SeenHottest)
+      continue;
+    // Once the cold fragment starts the default position is equivalent.
+    if (BB->isCold())
+      break;
+    const MCInst *LastInst = BB->getLastNonPseudoInstr();
+    if (!LastInst)
+      continue;
+    if (BC.MIB->isUnconditionalBranch(*LastInst) ||
+        BC.MIB->isReturn(*LastInst) || BC.MIB->isIndirectBranch(*LastInst)) {
+      Anchor = BB;
+      break;
+    }
+  }
+  if (!Anchor)
+    return false;
+
+  Islands.AnchorBlock = Anchor;
+  return true;
+}
+
+void ConstantIslandPlacementPass::runOnFunctions(BinaryContext &BC) {
+  if (!opts::PlaceConstantIslands || !BC.isAArch64())
+    return;
+
+  std::atomic<uint64_t> NumAnchored{0};
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_TRIVIAL,
+      [&](BinaryFunction &BF) { NumAnchored += runOnFunction(BF); },
+      [](const BinaryFunction &BF) {
+        return !BF.isSimple() || !BF.hasIslandsInfo() || !BF.hasValidProfile();
+      },
+      "ConstantIslandPlacementPass");
+
+  if (NumAnchored)
+    outs() << "BOLT-INFO: constant islands of " << NumAnchored
+           << " functions were anchored next to their hottest references\n";
+}
+
+} // end namespace bolt
+} // end namespace llvm
@@ -143,6 +143,23 @@ DataflowInfoManager::getInsnToBBMap() {
 
 void DataflowInfoManager::invalidateInsnToBBMap() { InsnToBB.reset(nullptr); }
 
+void DataflowInfoManager::rerunAfterLocalEdits(
+    ArrayRef<BinaryBasicBlock *> EditedBBs) {
+  if (LA)
+    LA->rerun(EditedBBs);
+  if (SPT)
+    SPT->rerun(EditedBBs);
+  invalidateReachingDefs();
+  invalidateReachingUses();
+  invalidateStackReachingUses();
+  invalidateDominatorAnalysis();
+  invalidatePostDominatorAnalysis();
+  invalidateReachingInsns();
+  invalidateReachingInsnsBackwards();
+  invalidateStackAllocationAnalysis();
+  invalidateInsnToBBMap();
+}
+
 void DataflowInfoManager::invalidateAll() {
   invalidateReachingDefs();
   invalidateReachingUses();
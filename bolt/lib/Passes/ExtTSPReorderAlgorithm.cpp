@@ -44,6 +44,7 @@ namespace opts {
 
 extern cl::OptionCategory BoltOptCategory;
 extern cl::opt<bool> NoThreads;
+extern cl::opt<unsigned> MispredictWeight;
 
 cl::opt<unsigned>
 ChainSplitThreshold("chain-split-threshold",
@@ -53,6 +54,16 @@ ChainSplitThreshold("chain-split-threshold",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+cl::opt<unsigned>
+ChainMergeCandidates("chain-merge-candidates",
+  cl::desc("The maximum number of adjacent chains considered for merging with "
+           "a given chain; chains with more neighbors only try the heaviest "
+           "candidates by jump count. Zero removes the limit"),
+  cl::init(128),
+  cl::ReallyHidden,
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 cl::opt<double>
 ForwardWeight("forward-weight",
   cl::desc("The weight of forward jumps for ExtTSP value"),
@@ -317,10 +328,13 @@ public:
 
   explicit Edge(Block *SrcBlock, Block *DstBlock, uint64_t EC)
       : SrcChain(SrcBlock->CurChain), DstChain(DstBlock->CurChain),
-        Jumps(1, std::make_pair(std::make_pair(SrcBlock, DstBlock), EC)) {}
+        Jumps(1, std::make_pair(std::make_pair(SrcBlock, DstBlock), EC)),
+        Weight(EC) {}
 
   const JumpList &jumps() const { return Jumps; }
 
+  uint64_t weight() const { return Weight; }
+
   void changeEndpoint(Chain *From, Chain *To) {
     if (From == SrcChain)
       SrcChain = To;
@@ -330,11 +344,14 @@ public:
 
   void appendJump(Block *SrcBlock, Block *DstBlock, uint64_t EC) {
     Jumps.emplace_back(std::make_pair(SrcBlock, DstBlock), EC);
+    Weight += EC;
   }
 
   void moveJumps(Edge *Other) {
     Jumps.insert(Jumps.end(), Other->Jumps.begin(), Other->Jumps.end());
     Other->Jumps.clear();
+    Weight += Other->Weight;
+    Other->Weight = 0;
   }
 
   bool hasCachedMergeGain(Chain *Src, Chain *Dst) const {
@@ -365,6 +382,8 @@ private:
   Chain *DstChain{nullptr};
   // Original jumps in the binary with correspinding execution counts
   JumpList Jumps;
+  // Total execution count of the jumps
+  uint64_t Weight{0};
   // Cached ext-tsp value for merging the pair of chains
   // Since the gain of merging (Src, Dst) and (Dst, Src) might be different,
   // we store both values here
@@ -499,7 +518,14 @@ private:
                "missing profile for a jump");
         if (SuccBB != Block.BB && BI->Count > 0) {
           class Block &SuccBlock = AllBlocks[SuccBB->getLayoutIndex()];
+          // Optionally bias the jump weight by the measured misprediction
+          // count so frequently mispredicted branches are the most valuable
+          // to convert into fall-throughs. Inferred fall-through edges carry
+          // no misprediction measurement.
           uint64_t Count = BI->Count;
+          if (opts::MispredictWeight &&
+              BI->MispredictedCount != BinaryBasicBlock::COUNT_INFERRED)
+            Count += (uint64_t)opts::MispredictWeight * BI->MispredictedCount;
           SuccBlock.InWeight += Count;
           SuccBlock.InJumps.emplace_back(&Block, Count);
           Block.OutWeight += Count;
@@ -616,14 +642,36 @@ private:
 
   /// Merge pairs of chains while improving the ExtTSP objective
   void mergeChainPairs() {
+    // A reusable buffer for bounding the set of merge candidates
+    std::vector<std::pair<Chain *, Edge *>> TopCandidates;
     while (HotChains.size() > 1) {
       Chain *BestChainPred = nullptr;
       Chain *BestChainSucc = nullptr;
       auto BestGain = MergeGainTy();
       // Iterate over all pairs of chains
       for (Chain *ChainPred : HotChains) {
-        // Get candidates for merging with the current chain
-        for (auto EdgeIter : ChainPred->edges()) {
+        // Get candidates for merging with the current chain. Chains adjacent
+        // to too many others only try the heaviest candidates so that the
+        // cost of an iteration stays bounded for huge functions. The order
+        // by weight with chain ids breaking ties is deterministic
+        const std::vector<std::pair<Chain *, Edge *>> *Candidates =
+            &ChainPred->edges();
+        if (opts::ChainMergeCandidates != 0 &&
+            Candidates->size() > opts::ChainMergeCandidates) {
+          TopCandidates.assign(Candidates->begin(), Candidates->end());
+          std::partial_sort(TopCandidates.begin(),
+                            TopCandidates.begin() + opts::ChainMergeCandidates,
+                            TopCandidates.end(),
+                            [](const std::pair<Chain *, Edge *> &E1,
+                               const std::pair<Chain *, Edge *> &E2) {
+                              if (E1.second->weight() != E2.second->weight())
+                                return E1.second->weight() > E2.second->weight();
+                              return E1.first->id() < E2.first->id();
+                            });
+          TopCandidates.resize(opts::ChainMergeCandidates);
+          Candidates = &TopCandidates;
+        }
+        for (auto EdgeIter : *Candidates) {
           Chain *ChainSucc = EdgeIter.first;
           Edge *ChainEdge = EdgeIter.second;
           // Ignore loop edges
@@ -12,8 +12,11 @@
 
 #include "bolt/Passes/FrameAnalysis.h"
 #include "bolt/Core/ParallelUtilities.h"
+#include "bolt/Passes/BinaryFunctionCallGraph.h"
 #include "bolt/Passes/CallGraphWalker.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/Timer.h"
+#include <atomic>
 #include <fstream>
 #include <stack>
 
@@ -230,7 +233,8 @@ public:
 
 } // end anonymous namespace
 
-void FrameAnalysis::addArgAccessesFor(MCInst &Inst, ArgAccesses &&AA) {
+void FrameAnalysis::addArgAccessesFor(MCInst &Inst, ArgAccesses &&AA,
+                                      MCPlusBuilder::AllocatorIdTy AllocId) {
   if (ErrorOr<ArgAccesses &> OldAA = getArgAccessesFor(Inst)) {
     if (OldAA->AssumeEverything)
       return;
@@ -239,19 +243,23 @@ void FrameAnalysis::addArgAccessesFor(MCInst &Inst, ArgAccesses &&AA) {
   }
   if (AA.AssumeEverything) {
     // Index 0 in ArgAccessesVector represents an "assumeeverything" entry
-    BC.MIB->addAnnotation(Inst, "ArgAccessEntry", 0U);
+    BC.MIB->addAnnotation(Inst, MCPlus::MCAnnotation::kArgAccessEntry, 0U,
+                          AllocId);
     return;
   }
-  BC.MIB->addAnnotation(Inst, "ArgAccessEntry",
-                        (unsigned)ArgAccessesVector.size());
+  std::lock_guard<std::mutex> Lock(ArgAccessesMutex);
+  BC.MIB->addAnnotation(Inst, MCPlus::MCAnnotation::kArgAccessEntry,
+                        (unsigned)ArgAccessesVector.size(), AllocId);
   ArgAccessesVector.emplace_back(std::move(AA));
 }
 
 void FrameAnalysis::addArgInStackAccessFor(MCInst &Inst,
-                                           const ArgInStackAccess &Arg) {
+                                           const ArgInStackAccess &Arg,
+                                           MCPlusBuilder::AllocatorIdTy
+                                               AllocId) {
   ErrorOr<ArgAccesses &> AA = getArgAccessesFor(Inst);
   if (!AA) {
-    addArgAccessesFor(Inst, ArgAccesses(false));
+    addArgAccessesFor(Inst, ArgAccesses(false), AllocId);
     AA = getArgAccessesFor(Inst);
     assert(AA && "Object setup failed");
   }
@@ -261,12 +269,15 @@ void FrameAnalysis::addArgInStackAccessFor(MCInst &Inst,
 }
 
 void FrameAnalysis::addFIEFor(MCInst &Inst, const FrameIndexEntry &FIE) {
-  BC.MIB->addAnnotation(Inst, "FrameAccessEntry", (unsigned)FIEVector.size());
+  BC.MIB->addAnnotation(Inst, MCPlus::MCAnnotation::kFrameAccessEntry,
+                        (unsigned)FIEVector.size());
   FIEVector.emplace_back(FIE);
 }
 
 ErrorOr<ArgAccesses &> FrameAnalysis::getArgAccessesFor(const MCInst &Inst) {
-  if (auto Idx = BC.MIB->tryGetAnnotationAs<unsigned>(Inst, "ArgAccessEntry")) {
+  if (auto Idx = BC.MIB->tryGetAnnotationAs<unsigned>(
+          Inst, MCPlus::MCAnnotation::kArgAccessEntry)) {
+    std::lock_guard<std::mutex> Lock(ArgAccessesMutex);
     assert(ArgAccessesVector.size() > *Idx && "Out of bounds");
     return ArgAccessesVector[*Idx];
   }
@@ -275,7 +286,9 @@ ErrorOr<ArgAccesses &> FrameAnalysis::getArgAccessesFor(const MCInst &Inst) {
 
 ErrorOr<const ArgAccesses &>
 FrameAnalysis::getArgAccessesFor(const MCInst &Inst) const {
-  if (auto Idx = BC.MIB->tryGetAnnotationAs<unsigned>(Inst, "ArgAccessEntry")) {
+  if (auto Idx = BC.MIB->tryGetAnnotationAs<unsigned>(
+          Inst, MCPlus::MCAnnotation::kArgAccessEntry)) {
+    std::lock_guard<std::mutex> Lock(ArgAccessesMutex);
     assert(ArgAccessesVector.size() > *Idx && "Out of bounds");
     return ArgAccessesVector[*Idx];
   }
@@ -284,21 +297,50 @@ FrameAnalysis::getArgAccessesFor(const MCInst &Inst) const {
 
 ErrorOr<const FrameIndexEntry &>
 FrameAnalysis::getFIEFor(const MCInst &Inst) const {
-  if (auto Idx =
-          BC.MIB->tryGetAnnotationAs<unsigned>(Inst, "FrameAccessEntry")) {
+  if (auto Idx = BC.MIB->tryGetAnnotationAs<unsigned>(
+          Inst, MCPlus::MCAnnotation::kFrameAccessEntry)) {
     assert(FIEVector.size() > *Idx && "Out of bounds");
     return FIEVector[*Idx];
   }
   return make_error_code(errc::result_out_of_range);
 }
 
-void FrameAnalysis::traverseCG(BinaryFunctionCallGraph &CG) {
-  CallGraphWalker CGWalker(CG);
+bool FrameAnalysis::markRequiresAlignment(const BinaryFunction &BF) {
+  auto It = FunctionsRequireAlignment.find(&BF);
+  assert(It != FunctionsRequireAlignment.end() && "entry should be created");
+  if (It->second)
+    return false;
+  It->second = true;
+  return true;
+}
 
-  CGWalker.registerVisitor(
-      [&](BinaryFunction *Func) -> bool { return computeArgsAccessed(*Func); });
+void FrameAnalysis::traverseCG(BinaryFunctionCallGraph &CG) {
+  // Create map entries for every function upfront. Parallel visitors then
+  // only ever write the entry of the function they own while reading their
+  // callees' finished entries, and no visitor changes the map structure.
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    ArgsTouchedMap[&BFI.second];
+    FunctionsRequireAlignment[&BFI.second] = false;
+  }
 
-  CGWalker.walk();
+  if (opts::NoThreads) {
+    CallGraphWalker CGWalker(CG);
+
+    CGWalker.registerVisitor([&](BinaryFunction *Func) -> bool {
+      return computeArgsAccessed(*Func);
+    });
+
+    // If a function inside a call graph cycle exhausts its revisit budget,
+    // assume it touches every argument and requires alignment.
+    CGWalker.registerFallback([&](BinaryFunction *Func) {
+      ArgsTouchedMap[Func].emplace(std::make_pair(-1, 0));
+      markRequiresAlignment(*Func);
+    });
+
+    CGWalker.walk();
+  } else {
+    traverseCGInParallel(CG);
+  }
 
   DEBUG_WITH_TYPE("ra", {
     for (auto &MapEntry : ArgsTouchedMap) {
@@ -315,8 +357,135 @@ void FrameAnalysis::traverseCG(BinaryFunctionCallGraph &CG) {
   });
 }
 
+void FrameAnalysis::traverseCGInParallel(BinaryFunctionCallGraph &CG) {
+  // Partition the call graph into strongly connected components with an
+  // iterative Tarjan traversal. Components are emitted callees-first.
+  const size_t NumNodes = CG.numNodes();
+  constexpr uint32_t Unvisited = UINT32_MAX;
+  std::vector<uint32_t> Index(NumNodes, Unvisited);
+  std::vector<uint32_t> LowLink(NumNodes, 0);
+  std::vector<bool> OnStack(NumNodes, false);
+  std::vector<uint32_t> ComponentId(NumNodes, Unvisited);
+  std::vector<std::vector<CallGraph::NodeId>> Components;
+  std::vector<CallGraph::NodeId> Stack;
+  uint32_t NextIndex = 0;
+
+  struct DFSFrame {
+    CallGraph::NodeId Node;
+    size_t NextSucc;
+  };
+  std::vector<DFSFrame> DFS;
+
+  for (CallGraph::NodeId Root = 0; Root < NumNodes; ++Root) {
+    if (Index[Root] != Unvisited)
+      continue;
+    Index[Root] = LowLink[Root] = NextIndex++;
+    Stack.push_back(Root);
+    OnStack[Root] = true;
+    DFS.push_back({Root, 0});
+
+    while (!DFS.empty()) {
+      DFSFrame &Frame = DFS.back();
+      const CallGraph::NodeId Node = Frame.Node;
+      const std::vector<CallGraph::NodeId> &Succs = CG.successors(Node);
+      if (Frame.NextSucc < Succs.size()) {
+        const CallGraph::NodeId Succ = Succs[Frame.NextSucc++];
+        if (Index[Succ] == Unvisited) {
+          Index[Succ] = LowLink[Succ] = NextIndex++;
+          Stack.push_back(Succ);
+          OnStack[Succ] = true;
+          DFS.push_back({Succ, 0});
+        } else if (OnStack[Succ]) {
+          LowLink[Node] = std::min(LowLink[Node], Index[Succ]);
+        }
+        continue;
+      }
+
+      if (LowLink[Node] == Index[Node]) {
+        Components.emplace_back();
+        while (true) {
+          const CallGraph::NodeId Member = Stack.back();
+          Stack.pop_back();
+          OnStack[Member] = false;
+          ComponentId[Member] = Components.size() - 1;
+          Components.back().push_back(Member);
+          if (Member == Node)
+            break;
+        }
+      }
+      DFS.pop_back();
+      if (!DFS.empty())
+        LowLink[DFS.back().Node] =
+            std::min(LowLink[DFS.back().Node], LowLink[Node]);
+    }
+  }
+
+  // Group the components into bottom-up levels: every call out of a level N
+  // component targets a level below N, so by the time a level runs, all the
+  // information its functions read from their callees is final and the
+  // components within the level can be analyzed concurrently.
+  std::vector<uint32_t> ComponentLevel(Components.size(), 0);
+  uint32_t NumLevels = 0;
+  for (uint32_t Id = 0; Id < Components.size(); ++Id) {
+    uint32_t Level = 0;
+    for (CallGraph::NodeId Node : Components[Id])
+      for (CallGraph::NodeId Succ : CG.successors(Node))
+        if (ComponentId[Succ] != Id)
+          Level = std::max(Level, ComponentLevel[ComponentId[Succ]] + 1);
+    ComponentLevel[Id] = Level;
+    NumLevels = std::max(NumLevels, Level + 1);
+  }
+
+  std::vector<std::vector<uint32_t>> Levels(NumLevels);
+  for (uint32_t Id = 0; Id < Components.size(); ++Id)
+    Levels[ComponentLevel[Id]].push_back(Id);
+
+  // Initialize the annotation allocators the workers will use upfront,
+  // mirroring runOnEachFunctionWithUniqueAllocId().
+  const size_t WorkerCount =
+      std::min<size_t>(opts::ThreadCount, Components.size());
+  for (unsigned AllocId = 1; AllocId <= WorkerCount; ++AllocId) {
+    if (!BC.MIB->checkAllocatorExists(AllocId)) {
+      MCPlusBuilder::AllocatorIdTy Id =
+          BC.MIB->initializeNewAnnotationAllocator();
+      (void)Id;
+      assert(AllocId == Id && "unexpected allocator id created");
+    }
+  }
+
+  ThreadPool &Pool = ParallelUtilities::getThreadPool();
+  for (const std::vector<uint32_t> &Level : Levels) {
+    std::atomic<size_t> NextComponent{0};
+    auto runWorker = [&](MCPlusBuilder::AllocatorIdTy AllocId) {
+      while (true) {
+        const size_t I = NextComponent.fetch_add(1, std::memory_order_relaxed);
+        if (I >= Level.size())
+          break;
+        const std::vector<CallGraph::NodeId> &Members = Components[Level[I]];
+        // Mutually recursive functions form one component and are iterated
+        // by a single worker until their observed properties converge, as
+        // in CallGraphWalker. The call graph stores no self arcs, so a
+        // singleton component converges in one pass.
+        bool Changed = true;
+        while (Changed) {
+          Changed = false;
+          for (CallGraph::NodeId Node : Members)
+            if (computeArgsAccessed(*CG.nodeIdToFunc(Node), AllocId))
+              Changed = true;
+          if (Members.size() == 1)
+            break;
+        }
+      }
+    };
+    for (unsigned W = 0; W < WorkerCount; ++W)
+      Pool.async(runWorker, W + 1);
+    Pool.wait();
+  }
+}
+
 bool FrameAnalysis::updateArgsTouchedFor(const BinaryFunction &BF, MCInst &Inst,
-                                         int CurOffset) {
+                                         int CurOffset,
+                                         MCPlusBuilder::AllocatorIdTy AllocId) {
   if (!BC.MIB->isCall(Inst))
     return false;
 
@@ -324,24 +493,16 @@ bool FrameAnalysis::updateArgsTouchedFor(const BinaryFunction &BF, MCInst &Inst,
   const MCSymbol *TargetSymbol = BC.MIB->getTargetSymbol(Inst);
   // If indirect call, we conservatively assume it accesses all stack positions
   if (TargetSymbol == nullptr) {
-    addArgAccessesFor(Inst, ArgAccesses(/*AssumeEverything=*/true));
-    if (!FunctionsRequireAlignment.count(&BF)) {
-      FunctionsRequireAlignment.insert(&BF);
-      return true;
-    }
-    return false;
+    addArgAccessesFor(Inst, ArgAccesses(/*AssumeEverything=*/true), AllocId);
+    return markRequiresAlignment(BF);
   }
 
   const BinaryFunction *Function = BC.getFunctionForSymbol(TargetSymbol);
   // Call to a function without a BinaryFunction object. Conservatively assume
   // it accesses all stack positions
   if (Function == nullptr) {
-    addArgAccessesFor(Inst, ArgAccesses(/*AssumeEverything=*/true));
-    if (!FunctionsRequireAlignment.count(&BF)) {
-      FunctionsRequireAlignment.insert(&BF);
-      return true;
-    }
-    return false;
+    addArgAccessesFor(Inst, ArgAccesses(/*AssumeEverything=*/true), AllocId);
+    return markRequiresAlignment(BF);
   }
 
   auto Iter = ArgsTouchedMap.find(Function);
@@ -358,44 +519,40 @@ bool FrameAnalysis::updateArgsTouchedFor(const BinaryFunction &BF, MCInst &Inst,
       }
     }
   }
-  if (FunctionsRequireAlignment.count(Function) &&
-      !FunctionsRequireAlignment.count(&BF)) {
-    Changed = true;
-    FunctionsRequireAlignment.insert(&BF);
-  }
+  if (FunctionsRequireAlignment.lookup(Function))
+    Changed |= markRequiresAlignment(BF);
   if (Iter == ArgsTouchedMap.end())
     return Changed;
 
   if (CurOffset == StackPointerTracking::EMPTY ||
       CurOffset == StackPointerTracking::SUPERPOSITION) {
-    addArgAccessesFor(Inst, ArgAccesses(/*AssumeEverything=*/true));
+    addArgAccessesFor(Inst, ArgAccesses(/*AssumeEverything=*/true), AllocId);
     return Changed;
   }
 
   for (std::pair<int64_t, uint8_t> Elem : Iter->second) {
     if (Elem.first == -1) {
-      addArgAccessesFor(Inst, ArgAccesses(/*AssumeEverything=*/true));
+      addArgAccessesFor(Inst, ArgAccesses(/*AssumeEverything=*/true), AllocId);
       break;
     }
     LLVM_DEBUG(dbgs() << "Added arg in stack access annotation "
                       << CurOffset + Elem.first << "\n");
     addArgInStackAccessFor(
-        Inst, ArgInStackAccess{/*StackOffset=*/CurOffset + Elem.first,
-                               /*Size=*/Elem.second});
+        Inst,
+        ArgInStackAccess{/*StackOffset=*/CurOffset + Elem.first,
+                         /*Size=*/Elem.second},
+        AllocId);
   }
   return Changed;
 }
 
-bool FrameAnalysis::computeArgsAccessed(BinaryFunction &BF) {
-  if (!BF.isSimple() || !BF.hasCFG()) {
+bool FrameAnalysis::computeArgsAccessed(BinaryFunction &BF,
+                                        MCPlusBuilder::AllocatorIdTy AllocId) {
+  if (!BF.isSimple() || !BF.hasCFG() || !isWithinScope(BF)) {
     LLVM_DEBUG(dbgs() << "Treating " << BF.getPrintName()
                       << " conservatively.\n");
     ArgsTouchedMap[&BF].emplace(std::make_pair(-1, 0));
-    if (!FunctionsRequireAlignment.count(&BF)) {
-      FunctionsRequireAlignment.insert(&BF);
-      return true;
-    }
-    return false;
+    return markRequiresAlignment(BF);
   }
 
   LLVM_DEBUG(dbgs() << "Now computing args accessed for: " << BF.getPrintName()
@@ -416,7 +573,7 @@ bool FrameAnalysis::computeArgsAccessed(BinaryFunction &BF) {
 
       // Check for calls -- attach stack accessing info to them regarding their
       // target
-      if (updateArgsTouchedFor(BF, Inst, FAA.getSPOffset()))
+      if (updateArgsTouchedFor(BF, Inst, FAA.getSPOffset(), AllocId))
         UpdatedArgsTouched = true;
 
       // Check for stack accesses that affect callers
@@ -441,20 +598,16 @@ bool FrameAnalysis::computeArgsAccessed(BinaryFunction &BF) {
     if (NoInfo)
       break;
   }
-  if (FunctionsRequireAlignment.count(&BF))
+  if (FunctionsRequireAlignment.lookup(&BF))
     return UpdatedArgsTouched;
 
-  if (NoInfo) {
-    FunctionsRequireAlignment.insert(&BF);
-    return true;
-  }
+  if (NoInfo)
+    return markRequiresAlignment(BF) || UpdatedArgsTouched;
 
   for (BinaryBasicBlock &BB : BF) {
     for (MCInst &Inst : BB) {
-      if (BC.MIB->requiresAlignedAddress(Inst)) {
-        FunctionsRequireAlignment.insert(&BF);
-        return true;
-      }
+      if (BC.MIB->requiresAlignedAddress(Inst))
+        return markRequiresAlignment(BF) || UpdatedArgsTouched;
     }
   }
   return UpdatedArgsTouched;
@@ -462,6 +615,7 @@ bool FrameAnalysis::computeArgsAccessed(BinaryFunction &BF) {
 
 bool FrameAnalysis::restoreFrameIndex(BinaryFunction &BF) {
   FrameAccessAnalysis FAA(BF, getSPT(BF));
+  FunctionSummary Summary;
 
   LLVM_DEBUG(dbgs() << "Restoring frame indices for \"" << BF.getPrintName()
                     << "\"\n");
@@ -484,12 +638,22 @@ bool FrameAnalysis::restoreFrameIndex(BinaryFunction &BF) {
       const FrameIndexEntry &FIE = FAA.getFIE();
 
       addFIEFor(Inst, FIE);
+      ++Summary.NumFrameAccesses;
+      if (FIE.IsSimple && FIE.StackOffset < 0) {
+        if (FIE.IsLoad)
+          Summary.HasSimpleLoad = true;
+        else
+          Summary.HasSimpleStore = true;
+        if (FIE.IsStore && FIE.IsStoreFromReg)
+          Summary.HasSpillCandidate = true;
+      }
       LLVM_DEBUG({
         dbgs() << "Frame index annotation " << FIE << " added to:\n";
         BC.printInstruction(dbgs(), Inst, 0, &BF, true);
       });
     }
   }
+  SummaryMap[&BF] = Summary;
   return true;
 }
 
@@ -500,8 +664,9 @@ void FrameAnalysis::cleanAnnotations() {
   ParallelUtilities::WorkFuncTy CleanFunction = [&](BinaryFunction &BF) {
     for (BinaryBasicBlock &BB : BF) {
       for (MCInst &Inst : BB) {
-        BC.MIB->removeAnnotation(Inst, "ArgAccessEntry");
-        BC.MIB->removeAnnotation(Inst, "FrameAccessEntry");
+        BC.MIB->removeAnnotation(Inst, MCPlus::MCAnnotation::kArgAccessEntry);
+        BC.MIB->removeAnnotation(Inst,
+                                 MCPlus::MCAnnotation::kFrameAccessEntry);
       }
     }
   };
@@ -511,8 +676,10 @@ void FrameAnalysis::cleanAnnotations() {
       ParallelUtilities::PredicateTy(nullptr), "cleanAnnotations");
 }
 
-FrameAnalysis::FrameAnalysis(BinaryContext &BC, BinaryFunctionCallGraph &CG)
-    : BC(BC) {
+FrameAnalysis::FrameAnalysis(
+    BinaryContext &BC, BinaryFunctionCallGraph &CG,
+    const DenseSet<const BinaryFunction *> *AnalysisScope)
+    : BC(BC), AnalysisScope(AnalysisScope) {
   // Position 0 of the vector should be always associated with "assume access
   // everything".
   ArgAccessesVector.emplace_back(ArgAccesses(/*AssumeEverything*/ true));
@@ -536,7 +703,7 @@ FrameAnalysis::FrameAnalysis(BinaryContext &BC, BinaryFunctionCallGraph &CG)
 
     // "shouldOptimize" for passes that run after finalize
     if (!(I.second.isSimple() && I.second.hasCFG() && !I.second.isIgnored()) ||
-        !opts::shouldFrameOptimize(I.second)) {
+        !isWithinScope(I.second) || !opts::shouldFrameOptimize(I.second)) {
       ++NumFunctionsNotOptimized;
       if (Count != BinaryFunction::COUNT_NO_PROFILE)
         CountFunctionsNotOptimized += Count;
@@ -629,8 +796,11 @@ void FrameAnalysis::preComputeSPT() {
         SPTPtr->run();
       };
 
+  // Out-of-scope functions never run the dataflow analyses that consume the
+  // SPT, so don't pay for theirs. Their map entry stays null, which
+  // clearSPTMap() handles.
   ParallelUtilities::PredicateTy SkipPredicate = [&](const BinaryFunction &BF) {
-    return !BF.isSimple() || !BF.hasCFG();
+    return !BF.isSimple() || !BF.hasCFG() || !isWithinScope(BF);
   };
 
   ParallelUtilities::runOnEachFunctionWithUniqueAllocId(
@@ -56,10 +56,10 @@ RemoveStores("frame-opt-rm-stores",
 namespace llvm {
 namespace bolt {
 
-void FrameOptimizerPass::removeUnnecessaryLoads(const RegAnalysis &RA,
-                                                const FrameAnalysis &FA,
-                                                BinaryFunction &BF) {
-  StackAvailableExpressions SAE(RA, FA, BF);
+void FrameOptimizerPass::removeUnnecessaryLoads(
+    const RegAnalysis &RA, const FrameAnalysis &FA, BinaryFunction &BF,
+    MCPlusBuilder::AllocatorIdTy AllocatorId) {
+  StackAvailableExpressions SAE(RA, FA, BF, AllocatorId);
   SAE.run();
 
   LLVM_DEBUG(dbgs() << "Performing unnecessary loads removal\n");
@@ -124,7 +124,7 @@ void FrameOptimizerPass::removeUnnecessaryLoads(const RegAnalysis &RA,
             break;
           }
           ++NumLoadsChangedToReg;
-          MIB->removeAnnotation(Inst, "FrameAccessEntry");
+          MIB->removeAnnotation(Inst, MCPlus::MCAnnotation::kFrameAccessEntry);
           LLVM_DEBUG(dbgs() << "Changed operand to a reg\n");
           if (MIB->isRedundantMove(Inst)) {
             ++NumLoadsDeleted;
@@ -140,7 +140,8 @@ void FrameOptimizerPass::removeUnnecessaryLoads(const RegAnalysis &RA,
             LLVM_DEBUG(dbgs() << "FAILED\n");
           } else {
             ++NumLoadsChangedToImm;
-            MIB->removeAnnotation(Inst, "FrameAccessEntry");
+            MIB->removeAnnotation(Inst,
+                                  MCPlus::MCAnnotation::kFrameAccessEntry);
             LLVM_DEBUG(dbgs() << "Ok\n");
           }
         }
@@ -160,9 +161,10 @@ void FrameOptimizerPass::removeUnnecessaryLoads(const RegAnalysis &RA,
     I.first->eraseInstruction(I.first->findInstruction(I.second));
 }
 
-void FrameOptimizerPass::removeUnusedStores(const FrameAnalysis &FA,
-                                            BinaryFunction &BF) {
-  StackReachingUses SRU(FA, BF);
+void FrameOptimizerPass::removeUnusedStores(
+    const FrameAnalysis &FA, BinaryFunction &BF,
+    MCPlusBuilder::AllocatorIdTy AllocatorId) {
+  StackReachingUses SRU(FA, BF, AllocatorId);
   SRU.run();
 
   LLVM_DEBUG(dbgs() << "Performing unused stores removal\n");
@@ -235,10 +237,57 @@ void FrameOptimizerPass::runOnFunctions(BinaryContext &BC) {
     CG = std::make_unique<BinaryFunctionCallGraph>(buildCallGraph(BC));
   }
 
+  // A function with a cold entry may still spend most of its cycles on spill
+  // traffic inside hot loops, so judge hotness by the hottest basic block
+  // rather than by the entry count alone.
+  auto isConsideredHot = [&](const BinaryFunction &BF) {
+    if (BF.getKnownExecutionCount() >= BC.getHotThreshold())
+      return true;
+    for (const BinaryBasicBlock &BB : BF)
+      if (BB.getKnownExecutionCount() >= BC.getHotThreshold())
+        return true;
+    return false;
+  };
+
+  // Under -frame-opt=hot, only a small subset of functions is ever rewritten,
+  // yet frame analysis used to pay for the whole binary. Select the hot
+  // candidates from the profile first and close the set over the call graph:
+  // a candidate plus all callees transitively reachable from it. Everything
+  // outside the closure is treated conservatively by FrameAnalysis, which is
+  // sound because no function inside the closure calls one outside it.
+  std::unique_ptr<DenseSet<const BinaryFunction *>> HotClosure;
+  if (opts::FrameOptimization == FOP_HOT) {
+    NamedRegionTimer T1("hotclosure", "compute hot closure", "FOP",
+                        "FOP breakdown", opts::TimeOpts);
+    HotClosure = std::make_unique<DenseSet<const BinaryFunction *>>();
+    std::vector<CallGraph::NodeId> Worklist;
+    for (auto &BFI : BC.getBinaryFunctions()) {
+      const BinaryFunction &BF = BFI.second;
+      if (!BF.isSimple() || !BF.hasCFG() || BF.isIgnored() ||
+          !isConsideredHot(BF))
+        continue;
+      if (HotClosure->insert(&BF).second) {
+        const CallGraph::NodeId Id = CG->maybeGetNodeId(&BF);
+        if (Id != CallGraph::InvalidId)
+          Worklist.push_back(Id);
+      }
+    }
+    while (!Worklist.empty()) {
+      const CallGraph::NodeId Id = Worklist.back();
+      Worklist.pop_back();
+      for (CallGraph::NodeId Succ : CG->successors(Id))
+        if (HotClosure->insert(CG->nodeIdToFunc(Succ)).second)
+          Worklist.push_back(Succ);
+    }
+    outs() << "BOLT-INFO: FOP restricting frame analysis to "
+           << HotClosure->size()
+           << " function(s) (hot candidates and their callees)\n";
+  }
+
   {
     NamedRegionTimer T1("frameanalysis", "frame analysis", "FOP",
                         "FOP breakdown", opts::TimeOpts);
-    FA = std::make_unique<FrameAnalysis>(BC, *CG);
+    FA = std::make_unique<FrameAnalysis>(BC, *CG, HotClosure.get());
   }
 
   {
@@ -247,37 +296,45 @@ void FrameOptimizerPass::runOnFunctions(BinaryContext &BC) {
     RA = std::make_unique<RegAnalysis>(BC, &BC.getBinaryFunctions(), CG.get());
   }
 
-  // Perform caller-saved register optimizations, then callee-saved register
-  // optimizations (shrink wrapping)
-  for (auto &I : BC.getBinaryFunctions()) {
-    if (!FA->hasFrameInfo(I.second))
-      continue;
+  // Preallocate annotation indices used by the dataflow analyses below so
+  // the parallel workers never create them concurrently.
+  BC.MIB->getOrCreateAnnotationIndex("StackAvailableExpressions");
+  BC.MIB->getOrCreateAnnotationIndex("StackReachingUses");
+
+  ParallelUtilities::PredicateTy SkipFunc = [&](const BinaryFunction &BF) {
+    if (!FA->hasFrameInfo(BF))
+      return true;
     // Restrict pass execution if user asked to only run on hot functions
-    if (opts::FrameOptimization == FOP_HOT) {
-      if (I.second.getKnownExecutionCount() < BC.getHotThreshold())
-        continue;
-      LLVM_DEBUG(
-          dbgs() << "Considering " << I.second.getPrintName()
-                 << " for frame optimizations because its execution count ( "
-                 << I.second.getKnownExecutionCount()
-                 << " ) exceeds our hotness threshold ( "
-                 << BC.getHotThreshold() << " )\n");
-    }
+    if (opts::FrameOptimization == FOP_HOT && !isConsideredHot(BF))
+      return true;
+    // FrameAnalysis already categorized the frame accesses while attaching
+    // the annotations; skip functions with no candidate access instead of
+    // re-scanning their instructions here.
+    const FrameAnalysis::FunctionSummary *Summary = FA->getSummaryFor(BF);
+    if (Summary && !Summary->HasSimpleLoad &&
+        !(opts::RemoveStores && Summary->HasSimpleStore))
+      return true;
+    return false;
+  };
 
-    {
-      NamedRegionTimer T1("removeloads", "remove loads", "FOP", "FOP breakdown",
-                          opts::TimeOpts);
-      removeUnnecessaryLoads(*RA, *FA, I.second);
-    }
+  // Perform caller-saved register optimizations, then callee-saved register
+  // optimizations (shrink wrapping). The dataflow analyses and rewrites are
+  // local to a function, so every function is processed independently.
+  ParallelUtilities::WorkFuncWithAllocTy WorkFun =
+      [&](BinaryFunction &BF, MCPlusBuilder::AllocatorIdTy AllocatorId) {
+        const FrameAnalysis::FunctionSummary *Summary = FA->getSummaryFor(BF);
+        if (!Summary || Summary->HasSimpleLoad)
+          removeUnnecessaryLoads(*RA, *FA, BF, AllocatorId);
+        if (opts::RemoveStores && (!Summary || Summary->HasSimpleStore))
+          removeUnusedStores(*FA, BF, AllocatorId);
+      };
 
-    if (opts::RemoveStores) {
-      NamedRegionTimer T1("removestores", "remove stores", "FOP",
-                          "FOP breakdown", opts::TimeOpts);
-      removeUnusedStores(*FA, I.second);
-    }
-    // Don't even start shrink wrapping if no profiling info is available
-    if (I.second.getKnownExecutionCount() == 0)
-      continue;
+  {
+    NamedRegionTimer T1("removeloadstores", "remove loads and stores", "FOP",
+                        "FOP breakdown", opts::TimeOpts);
+    ParallelUtilities::runOnEachFunctionWithUniqueAllocId(
+        BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+        SkipFunc, "frame-load-store-opt");
   }
 
   {
@@ -286,14 +343,14 @@ void FrameOptimizerPass::runOnFunctions(BinaryContext &BC) {
     performShrinkWrapping(*RA, *FA, BC);
   }
 
-  outs() << "BOLT-INFO: FOP optimized " << NumRedundantLoads
-         << " redundant load(s) and " << NumRedundantStores
+  outs() << "BOLT-INFO: FOP optimized " << NumRedundantLoads.load()
+         << " redundant load(s) and " << NumRedundantStores.load()
          << " unused store(s)\n";
-  outs() << "BOLT-INFO: FOP changed " << NumLoadsChangedToReg
+  outs() << "BOLT-INFO: FOP changed " << NumLoadsChangedToReg.load()
          << " load(s) to use a register instead of a stack access, and "
-         << NumLoadsChangedToImm << " to use an immediate.\n"
-         << "BOLT-INFO: FOP deleted " << NumLoadsDeleted << " load(s) and "
-         << NumRedundantStores << " store(s).\n";
+         << NumLoadsChangedToImm.load() << " to use an immediate.\n"
+         << "BOLT-INFO: FOP deleted " << NumLoadsDeleted.load()
+         << " load(s) and " << NumRedundantStores.load() << " store(s).\n";
   FA->printStats();
   ShrinkWrapping::printStats();
 }
@@ -337,6 +394,11 @@ void FrameOptimizerPass::performShrinkWrapping(const RegAnalysis &RA,
     if (BF.getKnownExecutionCount() == 0)
       return true;
 
+    // Skip functions with no candidate spills before paying for any dataflow
+    // analysis on them.
+    if (!ShrinkWrapping::hasSpillCandidates(FA, BF))
+      return true;
+
     return false;
   };
 
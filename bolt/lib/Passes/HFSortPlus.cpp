@@ -22,9 +22,13 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "bolt/Core/ParallelUtilities.h"
 #include "bolt/Passes/HFSort.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
 #include <cmath>
+#include <numeric>
 #include <set>
 #include <vector>
 
@@ -61,6 +65,15 @@ ITLBDensity("itlb-density",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+ITLBPageBoundaries("itlb-page-boundaries",
+  cl::desc("model i-tlb page boundaries instead of the caller-callee "
+           "distance decay when computing expected short calls"),
+  cl::init(false),
+  cl::ReallyHidden,
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<double>
 MergeProbability("merge-probability",
   cl::desc("The minimum probability of a call for merging two clusters"),
@@ -240,9 +253,19 @@ void Chain::mergeEdges(Chain *Other) {
 
 class HFSortPlus {
 public:
-  explicit HFSortPlus(const CallGraph &Cg) : Cg(Cg) { initialize(); }
+  /// Build the algorithm state for the nodes in \p Nodes, a subset of the
+  /// call graph closed under the arcs the algorithm considers (chains never
+  /// merge across such a subset). \p TotalSamples is the number of samples
+  /// in the whole graph so that page-miss probabilities and arc thresholds
+  /// do not depend on the partition.
+  explicit HFSortPlus(const CallGraph &Cg, ArrayRef<NodeId> Nodes,
+                      double TotalSamples)
+      : Cg(Cg), Nodes(Nodes), TotalSamples(TotalSamples) {
+    initialize();
+  }
 
-  /// Run the algorithm and return ordered set of function clusters.
+  /// Run the algorithm and return the resulting set of function clusters,
+  /// unordered. The caller is responsible for sorting clusters by density.
   std::vector<Cluster> run() {
     // Pass 1
     runPassOne();
@@ -250,18 +273,6 @@ public:
     // Pass 2
     runPassTwo();
 
-    outs() << "BOLT-INFO: hfsort+ reduced the number of chains from "
-           << Cg.numNodes() << " to " << HotChains.size() << "\n";
-
-    // Sorting chains by density in decreasing order
-    auto DensityComparator = [](const Chain *L, const Chain *R) {
-      if (L->density() != R->density())
-        return L->density() > R->density();
-      // Making sure the comparison is deterministic
-      return L->Id < R->Id;
-    };
-    std::stable_sort(HotChains.begin(), HotChains.end(), DensityComparator);
-
     // Return the set of clusters that are left, which are the ones that
     // didn't get merged (so their first func is its original func)
     std::vector<Cluster> Clusters;
@@ -273,32 +284,38 @@ public:
 
 private:
   /// Initialize the set of active chains, function id to chain mapping,
-  /// total number of samples and function addresses.
+  /// and function addresses.
   void initialize() {
+    // Node-indexed vectors are sized for the whole graph so that global
+    // node ids can be used without translation; only the entries for
+    // Nodes (and weights of their neighbors) are ever populated.
     OutWeight.resize(Cg.numNodes(), 0);
     InWeight.resize(Cg.numNodes(), 0);
-    AllChains.reserve(Cg.numNodes());
-    HotChains.reserve(Cg.numNodes());
+    AllChains.reserve(Nodes.size());
+    HotChains.reserve(Nodes.size());
     NodeChain.resize(Cg.numNodes(), nullptr);
     Addr.resize(Cg.numNodes(), 0);
 
     // Initialize chains
-    for (NodeId F = 0; F < Cg.numNodes(); ++F) {
+    size_t MaxArcs = 0;
+    for (NodeId F : Nodes) {
       AllChains.emplace_back(F, F, Cg.samples(F), Cg.size(F));
       HotChains.push_back(&AllChains.back());
       NodeChain[F] = &AllChains.back();
-      TotalSamples += Cg.samples(F);
       for (NodeId Succ : Cg.successors(F)) {
         if (F == Succ)
           continue;
         const Arc &Arc = *Cg.findArc(F, Succ);
         OutWeight[F] += Arc.weight();
         InWeight[Succ] += Arc.weight();
+        ++MaxArcs;
       }
     }
 
-    AllEdges.reserve(Cg.numArcs());
-    for (NodeId F = 0; F < Cg.numNodes(); ++F) {
+    // Edges hand out pointers into AllEdges; reserve an upper bound so the
+    // storage is never reallocated.
+    AllEdges.reserve(MaxArcs);
+    for (NodeId F : Nodes) {
       for (NodeId Succ : Cg.successors(F)) {
         if (F == Succ)
           continue;
@@ -355,6 +372,13 @@ private:
       return 0;
 
     double D = double(Dist) / double(opts::ITLBPageSize);
+    // Chain-local addresses carry no page-grid alignment, so averaged over
+    // the possible placements of the chain, the probability that both ends
+    // of a call land on the same page is exactly 1 - D. This makes the
+    // objective the expected number of same-page calls rather than a
+    // distance decay.
+    if (opts::ITLBPageBoundaries)
+      return (1.0 - D) * Weight;
     // Increasing the importance of shorter calls
     return (1.0 - D * D) * Weight;
   }
@@ -590,6 +614,9 @@ private:
   // The call graph
   const CallGraph &Cg;
 
+  // The subset of call graph nodes being ordered
+  ArrayRef<NodeId> Nodes;
+
   // All chains of functions
   std::vector<Chain> AllChains;
 
@@ -610,10 +637,52 @@ private:
 
   // Total weight of incoming arcs for each function
   std::vector<double> InWeight;
-  // The total number of samples in the graph
-  double TotalSamples{0};
+  // The total number of samples in the whole graph
+  double TotalSamples;
 };
 
+/// Partition the call graph into weakly connected components over the arcs
+/// the algorithm considers (positive weight above the arc threshold). Chains
+/// never merge across such arcs, so each component can be ordered
+/// independently. Components are returned with node ids in increasing order,
+/// keeping the processing order deterministic.
+std::vector<std::vector<NodeId>> findComponents(const CallGraph &Cg,
+                                                double TotalSamples) {
+  std::vector<NodeId> Parent(Cg.numNodes());
+  std::iota(Parent.begin(), Parent.end(), 0);
+  auto find = [&Parent](NodeId F) {
+    while (Parent[F] != F) {
+      Parent[F] = Parent[Parent[F]];
+      F = Parent[F];
+    }
+    return F;
+  };
+
+  for (NodeId F = 0; F < Cg.numNodes(); ++F) {
+    for (NodeId Succ : Cg.successors(F)) {
+      if (F == Succ)
+        continue;
+      const Arc &Arc = *Cg.findArc(F, Succ);
+      if (Arc.weight() == 0.0 ||
+          Arc.weight() / TotalSamples < opts::ArcThreshold)
+        continue;
+      Parent[find(F)] = find(Succ);
+    }
+  }
+
+  std::vector<std::vector<NodeId>> Components;
+  std::vector<size_t> ComponentId(Cg.numNodes(), size_t(-1));
+  for (NodeId F = 0; F < Cg.numNodes(); ++F) {
+    const NodeId Root = find(F);
+    if (ComponentId[Root] == size_t(-1)) {
+      ComponentId[Root] = Components.size();
+      Components.emplace_back();
+    }
+    Components[ComponentId[Root]].push_back(F);
+  }
+  return Components;
+}
+
 } // end anonymous namespace
 
 std::vector<Cluster> hfsortPlus(CallGraph &Cg) {
@@ -621,7 +690,57 @@ std::vector<Cluster> hfsortPlus(CallGraph &Cg) {
   // than the number of samples for every function.
   // Ensuring the call graph obeys the property before running the algorithm.
   Cg.adjustArcWeights();
-  return HFSortPlus(Cg).run();
+
+  double TotalSamples = 0;
+  for (NodeId F = 0; F < Cg.numNodes(); ++F)
+    TotalSamples += Cg.samples(F);
+
+  // Order each connected component of the call graph independently.
+  // Components with a single node need no ordering and become trivial
+  // clusters right away.
+  std::vector<std::vector<NodeId>> Components =
+      findComponents(Cg, TotalSamples);
+
+  std::vector<std::vector<Cluster>> Shards(Components.size());
+  auto processComponent = [&](size_t Index) {
+    const std::vector<NodeId> &Component = Components[Index];
+    if (Component.size() == 1) {
+      Shards[Index].emplace_back(Component.front(),
+                                 Cg.getNode(Component.front()));
+      return;
+    }
+    Shards[Index] = HFSortPlus(Cg, Component, TotalSamples).run();
+  };
+
+  if (opts::NoThreads) {
+    for (size_t I = 0; I < Components.size(); ++I)
+      processComponent(I);
+  } else {
+    ThreadPool &Pool = ParallelUtilities::getThreadPool();
+    for (size_t I = 0; I < Components.size(); ++I)
+      Pool.async(processComponent, I);
+    Pool.wait();
+  }
+
+  // Merge the per-component orders into a single one sorted by chain
+  // density. A chain's first node is the node it was created from, so
+  // breaking ties by it reproduces the order a whole-graph run would give.
+  std::vector<Cluster> Clusters;
+  Clusters.reserve(Cg.numNodes());
+  for (std::vector<Cluster> &Shard : Shards)
+    std::move(Shard.begin(), Shard.end(), std::back_inserter(Clusters));
+
+  outs() << "BOLT-INFO: hfsort+ reduced the number of chains from "
+         << Cg.numNodes() << " to " << Clusters.size() << "\n";
+
+  std::stable_sort(Clusters.begin(), Clusters.end(),
+                   [](const Cluster &L, const Cluster &R) {
+                     if (L.density() != R.density())
+                       return L.density() > R.density();
+                     // Making sure the comparison is deterministic
+                     return L.targets().front() < R.targets().front();
+                   });
+  return Clusters;
 }
 
 } // namespace bolt
@@ -11,12 +11,15 @@
 //===----------------------------------------------------------------------===//
 
 #include "bolt/Passes/IdenticalCodeFolding.h"
+#include "bolt/Core/HashUtilities.h"
 #include "bolt/Core/ParallelUtilities.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/Timer.h"
 #include <atomic>
 #include <map>
+#include <mutex>
 #include <set>
 #include <unordered_map>
 
@@ -36,6 +39,16 @@ UseDFS("icf-dfs",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+ICFConstData("icf-const-data",
+  cl::desc("treat references to byte-identical read-only objects as "
+           "equivalent during identical code folding. Folds template "
+           "instantiations that differ only in the constants they reference, "
+           "but merges the address identity of those constants, which is "
+           "observable by code comparing their addresses."),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 TimeICF("time-icf",
   cl::desc("time icf steps"),
@@ -89,6 +102,51 @@ bool equalJumpTables(const JumpTable &JumpTableA, const JumpTable &JumpTableB,
   return true;
 }
 
+/// Compare the contents of two read-only data objects, treating relocations
+/// against the data as parameters: the objects are interchangeable when the
+/// bytes between relocations match and the corresponding relocations agree
+/// on type, symbol, and addend.
+bool equalConstData(const BinaryData &DataA, const BinaryData &DataB) {
+  if (DataA.getSize() != DataB.getSize() || !DataA.getSize())
+    return false;
+
+  // Writable data may change at run time and is never interchangeable.
+  const BinarySection &SectionA = DataA.getSection();
+  const BinarySection &SectionB = DataB.getSection();
+  if (!SectionA.isReadOnly() || !SectionB.isReadOnly())
+    return false;
+
+  const uint64_t OffsetA = DataA.getAddress() - SectionA.getAddress();
+  const uint64_t OffsetB = DataB.getAddress() - SectionB.getAddress();
+  const StringRef ContentsA =
+      SectionA.getContents().substr(OffsetA, DataA.getSize());
+  const StringRef ContentsB =
+      SectionB.getContents().substr(OffsetB, DataB.getSize());
+  if (ContentsA.size() != DataA.getSize() ||
+      ContentsB.size() != DataB.getSize())
+    return false;
+
+  uint64_t Offset = 0;
+  while (Offset < DataA.getSize()) {
+    const Relocation *RelA = SectionA.getRelocationAt(OffsetA + Offset);
+    const Relocation *RelB = SectionB.getRelocationAt(OffsetB + Offset);
+    if (!RelA != !RelB)
+      return false;
+    if (RelA) {
+      if (RelA->Type != RelB->Type || RelA->Symbol != RelB->Symbol ||
+          RelA->Addend != RelB->Addend)
+        return false;
+      Offset += RelA->getSize();
+      continue;
+    }
+    if (ContentsA[Offset] != ContentsB[Offset])
+      return false;
+    ++Offset;
+  }
+
+  return true;
+}
+
 /// Helper function that compares an instruction of this function to the
 /// given instruction of the given function. The functions should have
 /// identical CFG.
@@ -252,12 +310,15 @@ bool isIdenticalWith(const BinaryFunction &A, const BinaryFunction &B,
 
         const JumpTable *JumpTableA =
             A.getJumpTableContainingAddress(SIA->getAddress());
-        if (!JumpTableA)
-          return false;
-
         const JumpTable *JumpTableB =
             B.getJumpTableContainingAddress(SIB->getAddress());
-        if (!JumpTableB)
+
+        // Neither symbol is a jump table. The references may still be
+        // interchangeable if they resolve to identical read-only data.
+        if (!JumpTableA && !JumpTableB)
+          return opts::ICFConstData && equalConstData(*SIA, *SIB);
+
+        if (!JumpTableA || !JumpTableB)
           return false;
 
         if ((SIA->getAddress() - JumpTableA->getAddress()) !=
@@ -331,71 +392,154 @@ typedef std::unordered_map<BinaryFunction *, std::vector<BinaryFunction *>,
                            KeyHash, KeyEqual>
     IdenticalBucketsMap;
 
-std::string hashInteger(uint64_t Value) {
-  std::string HashString;
-  if (Value == 0)
-    HashString.push_back(0);
-
-  while (Value) {
-    uint8_t LSB = Value & 0xff;
-    HashString.push_back(LSB);
-    Value >>= 8;
-  }
-
-  return HashString;
+void hashInteger(uint64_t Value, StreamingHash64 &Hasher) {
+  Hasher.add(Value);
 }
 
-std::string hashSymbol(BinaryContext &BC, const MCSymbol &Symbol) {
-  std::string HashString;
-
+void hashSymbol(BinaryContext &BC, const MCSymbol &Symbol,
+                StreamingHash64 &Hasher) {
   // Ignore function references.
   if (BC.getFunctionForSymbol(&Symbol))
-    return HashString;
+    return;
 
   llvm::ErrorOr<uint64_t> ErrorOrValue = BC.getSymbolValue(Symbol);
   if (!ErrorOrValue)
-    return HashString;
+    return;
 
   // Ignore jump table references.
   if (BC.getJumpTableContainingAddress(*ErrorOrValue))
-    return HashString;
+    return;
+
+  // When different read-only objects may compare equal, hash the referenced
+  // contents instead of the address so that functions differing only in such
+  // references land in the same congruent bucket. The section hash resolves
+  // relocations against the data recursively, hence functions that
+  // equalConstData() can fold are guaranteed to hash identically.
+  if (opts::ICFConstData) {
+    if (const BinaryData *BD = BC.getBinaryDataByName(Symbol.getName())) {
+      if (BD->getSize() && BD->getSection().isReadOnly())
+        return hashInteger(BD->getSection().hash(*BD), Hasher);
+    }
+  }
 
-  return HashString.append(hashInteger(*ErrorOrValue));
+  hashInteger(*ErrorOrValue, Hasher);
 }
 
-std::string hashExpr(BinaryContext &BC, const MCExpr &Expr) {
+void hashExpr(BinaryContext &BC, const MCExpr &Expr, StreamingHash64 &Hasher) {
   switch (Expr.getKind()) {
   case MCExpr::Constant:
-    return hashInteger(cast<MCConstantExpr>(Expr).getValue());
+    return hashInteger(cast<MCConstantExpr>(Expr).getValue(), Hasher);
   case MCExpr::SymbolRef:
-    return hashSymbol(BC, cast<MCSymbolRefExpr>(Expr).getSymbol());
+    return hashSymbol(BC, cast<MCSymbolRefExpr>(Expr).getSymbol(), Hasher);
   case MCExpr::Unary: {
     const auto &UnaryExpr = cast<MCUnaryExpr>(Expr);
-    return hashInteger(UnaryExpr.getOpcode())
-        .append(hashExpr(BC, *UnaryExpr.getSubExpr()));
+    hashInteger(UnaryExpr.getOpcode(), Hasher);
+    return hashExpr(BC, *UnaryExpr.getSubExpr(), Hasher);
   }
   case MCExpr::Binary: {
     const auto &BinaryExpr = cast<MCBinaryExpr>(Expr);
-    return hashExpr(BC, *BinaryExpr.getLHS())
-        .append(hashInteger(BinaryExpr.getOpcode()))
-        .append(hashExpr(BC, *BinaryExpr.getRHS()));
+    hashExpr(BC, *BinaryExpr.getLHS(), Hasher);
+    hashInteger(BinaryExpr.getOpcode(), Hasher);
+    return hashExpr(BC, *BinaryExpr.getRHS(), Hasher);
   }
   case MCExpr::Target:
-    return std::string();
+    return;
   }
 
   llvm_unreachable("invalid expression kind");
 }
 
-std::string hashInstOperand(BinaryContext &BC, const MCOperand &Operand) {
+void hashInstOperand(BinaryContext &BC, const MCOperand &Operand,
+                     StreamingHash64 &Hasher) {
   if (Operand.isImm())
-    return hashInteger(Operand.getImm());
+    return hashInteger(Operand.getImm(), Hasher);
   if (Operand.isReg())
-    return hashInteger(Operand.getReg());
+    return hashInteger(Operand.getReg(), Hasher);
   if (Operand.isExpr())
-    return hashExpr(BC, *Operand.getExpr());
+    return hashExpr(BC, *Operand.getExpr(), Hasher);
+}
+
+/// Folding-state-independent part of a function's folding-identity hash (see
+/// hashFoldingIdentity() below) together with the column of symbol references
+/// that have to be re-resolved through the current folding state on every
+/// rehash. Precomputed once so the per-iteration rehash scans this flat
+/// record instead of re-walking the MCInst stream and its operands.
+struct FoldingIdentity {
+  uint64_t StaticHash{0};
+  std::vector<const MCSymbol *> SymbolRefs;
+};
 
-  return std::string();
+using FoldingIdentityMapTy =
+    std::unordered_map<const BinaryFunction *, FoldingIdentity>;
+
+/// Pre-hash the instruction stream of \p BF for hashFoldingIdentity(): all
+/// literal values are folded into a single word and the non-local symbol
+/// references, whose meaning changes as functions get folded, are collected
+/// in scan order for later resolution.
+FoldingIdentity computeFoldingIdentity(BinaryContext &BC,
+                                       const BinaryFunction &BF) {
+  const BinaryFunction::BasicBlockOrderType &Order =
+      opts::UseDFS ? BF.dfs() : BF.getLayout();
+
+  FoldingIdentity Identity;
+  size_t Hash = BF.getHash();
+  const auto combine = [&Hash](uint64_t Value) {
+    Hash = hash_combine(Hash, Value);
+  };
+
+  for (const BinaryBasicBlock *BB : Order) {
+    for (const MCInst &Inst : *BB) {
+      // Mirror computeHash(): unconditional branches are covered by the CFG
+      // comparison and may legitimately differ between identical functions.
+      if (BC.MIB->isPseudo(Inst) || BC.MIB->isUnconditionalBranch(Inst))
+        continue;
+
+      combine(Inst.getOpcode());
+      for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E;
+           ++I) {
+        const MCOperand &Op = Inst.getOperand(I);
+        if (Op.isImm()) {
+          combine(Op.getImm());
+        } else if (Op.isReg()) {
+          combine(Op.getReg());
+        } else if (Op.isExpr() &&
+                   Op.getExpr()->getKind() == MCExpr::SymbolRef) {
+          const MCSymbol &Symbol =
+              cast<MCSymbolRefExpr>(*Op.getExpr()).getSymbol();
+          // Local symbols are covered by the CFG comparison.
+          if (Symbol.isTemporary())
+            continue;
+          Identity.SymbolRefs.push_back(&Symbol);
+        }
+      }
+    }
+  }
+
+  Identity.StaticHash = Hash;
+  return Identity;
+}
+
+/// Compute a hash of the instruction stream of \p BF that, unlike the
+/// congruent hash, resolves references to other functions through the current
+/// folding state. Functions that compare equal under
+/// isIdenticalWith(..., /*CongruentSymbols=*/false) are guaranteed to produce
+/// equal values, so the expensive comparison only has to run on true hash
+/// collisions. Operands whose equality is structural (jump tables, local
+/// labels) are hashed coarsely: collisions are resolved by isIdenticalWith,
+/// never the other way around.
+uint64_t hashFoldingIdentity(BinaryContext &BC, const BinaryFunction &BF,
+                             const FoldingIdentity &Identity) {
+  size_t Hash = Identity.StaticHash;
+  for (const MCSymbol *Symbol : Identity.SymbolRefs) {
+    uint64_t EntryID = 0;
+    const BinaryFunction *Callee = BC.getFunctionForSymbol(Symbol, &EntryID);
+    // Recursive calls are identical in identical functions even though
+    // they resolve to distinct callees.
+    if (Callee && !EntryID)
+      Hash = hash_combine(
+          Hash, Callee == &BF ? 1 : reinterpret_cast<uint64_t>(Callee));
+  }
+  return Hash;
 }
 
 } // namespace
@@ -412,6 +556,20 @@ void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC) {
   std::atomic<uint64_t> NumFoldedLastIteration{0};
   CongruentBucketsMap CongruentBuckets;
 
+  // Flat per-function records for the folding-identity hash, built once
+  // during the parallel hashing phase and only read afterwards.
+  FoldingIdentityMapTy FoldingIdentities;
+  std::mutex FoldingIdentitiesMutex;
+
+  // Congruent buckets together with the identity-hash signature each had when
+  // it was last processed. A bucket whose signature did not change since the
+  // previous iteration cannot yield new folds and is skipped.
+  struct CongruentBucketState {
+    std::set<BinaryFunction *> *Bucket;
+    uint64_t LastSignature{0};
+  };
+  std::vector<CongruentBucketState> BucketStates;
+
   // Hash all the functions
   auto hashFunctions = [&]() {
     NamedRegionTimer HashFunctionsTimer("hashing", "hashing", "ICF breakdown",
@@ -422,9 +580,16 @@ void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC) {
 
       // Pre-compute hash before pushing into hashtable.
       // Hash instruction operands to minimize hash collisions.
-      BF.computeHash(opts::UseDFS, [&BC](const MCOperand &Op) {
-        return hashInstOperand(BC, Op);
-      });
+      BF.computeHash(opts::UseDFS,
+                     [&BC](const MCOperand &Op, StreamingHash64 &Hasher) {
+                       hashInstOperand(BC, Op, Hasher);
+                     });
+
+      // Flatten the instruction stream for the per-iteration rehash while
+      // the function is already hot in cache.
+      FoldingIdentity Identity = computeFoldingIdentity(BC, BF);
+      std::lock_guard<std::mutex> Lock(FoldingIdentitiesMutex);
+      FoldingIdentities.emplace(&BF, std::move(Identity));
     };
 
     ParallelUtilities::PredicateTy SkipFunc = [&](const BinaryFunction &BF) {
@@ -464,52 +629,78 @@ void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC) {
       ThPool = &ParallelUtilities::getThreadPool();
 
     // Fold identical functions within a single congruent bucket
-    auto processSingleBucket = [&](std::set<BinaryFunction *> &Candidates) {
+    auto processSingleBucket = [&](CongruentBucketState &State) {
+      std::set<BinaryFunction *> &Candidates = *State.Bucket;
       Timer T("folding single congruent list", "folding single congruent list");
       LLVM_DEBUG(T.startTimer());
 
-      // Identical functions go into the same bucket.
-      IdenticalBucketsMap IdenticalBuckets;
+      // Group candidates by a hash that resolves function references through
+      // the current folding state, so the expensive isIdenticalWith
+      // comparison below only runs on true hash collisions. If no hash
+      // changed since the previous iteration, the bucket cannot yield new
+      // folds and the comparisons are skipped altogether.
+      std::unordered_map<uint64_t, std::vector<BinaryFunction *>> HashGroups;
+      uint64_t Signature = Candidates.size();
       for (BinaryFunction *BF : Candidates) {
-        IdenticalBuckets[BF].emplace_back(BF);
+        const uint64_t Hash =
+            hashFoldingIdentity(BC, *BF, FoldingIdentities.at(BF));
+        Signature += Hash;
+        HashGroups[Hash].emplace_back(BF);
+      }
+      if (Signature == State.LastSignature) {
+        LLVM_DEBUG(T.stopTimer());
+        return;
       }
+      State.LastSignature = Signature;
 
-      for (auto &IBI : IdenticalBuckets) {
-        // Functions identified as identical.
-        std::vector<BinaryFunction *> &Twins = IBI.second;
-        if (Twins.size() < 2)
+      for (auto &HGI : HashGroups) {
+        if (HGI.second.size() < 2)
           continue;
 
-        // Fold functions. Keep the order consistent across invocations with
-        // different options.
-        std::stable_sort(Twins.begin(), Twins.end(),
-                         [](const BinaryFunction *A, const BinaryFunction *B) {
-                           return A->getFunctionNumber() <
-                                  B->getFunctionNumber();
-                         });
-
-        BinaryFunction *ParentBF = Twins[0];
-        for (unsigned I = 1; I < Twins.size(); ++I) {
-          BinaryFunction *ChildBF = Twins[I];
-          LLVM_DEBUG(dbgs() << "BOLT-DEBUG: folding " << *ChildBF << " into "
-                            << *ParentBF << '\n');
-
-          // Remove child function from the list of candidates.
-          auto FI = Candidates.find(ChildBF);
-          assert(FI != Candidates.end() &&
-                 "function expected to be in the set");
-          Candidates.erase(FI);
-
-          // Fold the function and remove from the list of processed functions.
-          BytesSavedEstimate += ChildBF->getSize();
-          CallsSavedEstimate += std::min(ChildBF->getKnownExecutionCount(),
-                                         ParentBF->getKnownExecutionCount());
-          BC.foldFunction(*ChildBF, *ParentBF);
-
-          ++NumFoldedLastIteration;
-
-          if (ParentBF->hasJumpTables())
-            ++NumJTFunctionsFolded;
+        // Identical functions go into the same bucket.
+        IdenticalBucketsMap IdenticalBuckets;
+        for (BinaryFunction *BF : HGI.second) {
+          IdenticalBuckets[BF].emplace_back(BF);
+        }
+
+        for (auto &IBI : IdenticalBuckets) {
+          // Functions identified as identical.
+          std::vector<BinaryFunction *> &Twins = IBI.second;
+          if (Twins.size() < 2)
+            continue;
+
+          // Fold functions. Keep the order consistent across invocations with
+          // different options.
+          std::stable_sort(
+              Twins.begin(), Twins.end(),
+              [](const BinaryFunction *A, const BinaryFunction *B) {
+                return A->getFunctionNumber() < B->getFunctionNumber();
+              });
+
+          BinaryFunction *ParentBF = Twins[0];
+          for (unsigned I = 1; I < Twins.size(); ++I) {
+            BinaryFunction *ChildBF = Twins[I];
+            LLVM_DEBUG(dbgs() << "BOLT-DEBUG: folding " << *ChildBF << " into "
+                              << *ParentBF << '\n');
+
+            // Remove child function from the list of candidates.
+            auto FI = Candidates.find(ChildBF);
+            assert(FI != Candidates.end() &&
+                   "function expected to be in the set");
+            Candidates.erase(FI);
+
+            // Fold the function and remove from the list of processed
+            // functions.
+            BytesSavedEstimate += ChildBF->getSize();
+            CallsSavedEstimate += std::min(ChildBF->getKnownExecutionCount(),
+                                           ParentBF->getKnownExecutionCount());
+            BC.foldFunction(*ChildBF, *ParentBF);
+
+            ++NumFoldedLastIteration;
+
+            if (ParentBF->hasJumpTables())
+              ++NumJTFunctionsFolded;
+          }
         }
       }
 
@@ -517,15 +708,14 @@ void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC) {
     };
 
     // Create a task for each congruent bucket
-    for (auto &Entry : CongruentBuckets) {
-      std::set<BinaryFunction *> &Bucket = Entry.second;
-      if (Bucket.size() < 2)
+    for (CongruentBucketState &State : BucketStates) {
+      if (State.Bucket->size() < 2)
         continue;
 
       if (opts::NoThreads)
-        processSingleBucket(Bucket);
+        processSingleBucket(State);
       else
-        ThPool->async(processSingleBucket, std::ref(Bucket));
+        ThPool->async(processSingleBucket, std::ref(State));
     }
 
     if (!opts::NoThreads)
@@ -537,6 +727,10 @@ void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC) {
   hashFunctions();
   createCongruentBuckets();
 
+  BucketStates.reserve(CongruentBuckets.size());
+  for (auto &Entry : CongruentBuckets)
+    BucketStates.push_back({&Entry.second, 0});
+
   unsigned Iteration = 1;
   // We repeat the pass until no new modifications happen.
   do {
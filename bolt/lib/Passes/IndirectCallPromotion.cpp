@@ -11,10 +11,13 @@
 //===----------------------------------------------------------------------===//
 
 #include "bolt/Passes/IndirectCallPromotion.h"
+#include "bolt/Core/ParallelUtilities.h"
 #include "bolt/Passes/BinaryFunctionCallGraph.h"
 #include "bolt/Passes/DataflowInfoManager.h"
 #include "bolt/Utils/CommandLineOpts.h"
 #include "llvm/Support/CommandLine.h"
+#include <cmath>
+#include <mutex>
 
 #define DEBUG_TYPE "ICP"
 #define DEBUG_VERBOSE(Level, X)                                                \
@@ -103,6 +106,12 @@ static cl::opt<unsigned> ICPTopCallsites(
              "indirect calls frequency is covered. 0 = all callsites"),
     cl::init(99), cl::Hidden, cl::ZeroOrMore, cl::cat(BoltOptCategory));
 
+static cl::opt<bool> ICPTopCallsitesByMispredicts(
+    "icp-top-callsites-by-mispredicts",
+    cl::desc("rank indirect callsites by misprediction count instead of call "
+             "count when selecting the hottest callsites"),
+    cl::init(false), cl::ZeroOrMore, cl::Hidden, cl::cat(BoltOptCategory));
+
 static cl::list<std::string>
     ICPFuncsList("icp-funcs", cl::CommaSeparated,
                  cl::desc("list of functions to enable ICP for"),
@@ -121,6 +130,26 @@ static cl::opt<bool> ICPJumpTablesByTarget(
         "for jump tables, optimize indirect jmp targets instead of indices"),
     cl::init(false), cl::ZeroOrMore, cl::Hidden, cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned> ICPJTLadderEntropyThreshold(
+    "icp-jt-ladder-entropy-threshold",
+    cl::desc("normalized entropy of a jump table target histogram, in percent "
+             "of the maximum, above which the callsite is promoted with a "
+             "binary-searched compare ladder instead of a sequential compare "
+             "chain. 0 = never use ladders"),
+    cl::init(85), cl::ZeroOrMore, cl::Hidden, cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned> ICPJTLadderMinTargets(
+    "icp-jt-ladder-min-targets",
+    cl::desc("minimum number of profiled jump table indices required to "
+             "promote a callsite with a compare ladder"),
+    cl::init(8), cl::ZeroOrMore, cl::Hidden, cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned> ICPJTLadderMaxTargets(
+    "icp-jt-ladder-max-targets",
+    cl::desc("maximum number of jump table indices dispatched through a "
+             "compare ladder"),
+    cl::init(64), cl::ZeroOrMore, cl::Hidden, cl::cat(BoltOptCategory));
+
 } // namespace opts
 
 namespace llvm {
@@ -282,7 +311,7 @@ IndirectCallPromotion::getCallTargets(BinaryBasicBlock &BB,
       return Targets;
 
     auto ICSP = BC.MIB->tryGetAnnotationAs<IndirectCallSiteProfile>(
-        Inst, "CallProfile");
+        Inst, MCPlus::MCAnnotation::kCallProfile);
     if (ICSP) {
       for (const IndirectCallProfile &CSP : ICSP.get()) {
         Callsite Site(BF, CSP);
@@ -487,7 +516,8 @@ IndirectCallPromotion::maybeGetHotJumpTableTargets(BinaryBasicBlock &BB,
              << "Count = " << Target.first << "\n";
   });
 
-  BC.MIB->getOrCreateAnnotationAs<uint16_t>(CallInst, "JTIndexReg") = IndexReg;
+  BC.MIB->getOrCreateAnnotationAs<uint16_t>(
+      CallInst, MCPlus::MCAnnotation::kJTIndexReg) = IndexReg;
 
   TargetFetchInst = MemLocInstr;
 
@@ -610,6 +640,72 @@ IndirectCallPromotion::findCallTargetSymbols(std::vector<Callsite> &Targets,
   return SymTargets;
 }
 
+double IndirectCallPromotion::computeTargetEntropy(
+    const std::vector<Callsite> &Targets) {
+  uint64_t TotalCount = 0;
+  size_t NumTakenTargets = 0;
+  for (const Callsite &Target : Targets) {
+    TotalCount += Target.Branches;
+    if (Target.Branches)
+      ++NumTakenTargets;
+  }
+  if (NumTakenTargets < 2 || !TotalCount)
+    return 0.0;
+
+  double Entropy = 0.0;
+  for (const Callsite &Target : Targets) {
+    if (!Target.Branches)
+      continue;
+    const double P = static_cast<double>(Target.Branches) / TotalCount;
+    Entropy -= P * std::log2(P);
+  }
+  return Entropy / std::log2(static_cast<double>(NumTakenTargets));
+}
+
+IndirectCallPromotion::SymTargetsType
+IndirectCallPromotion::findLadderCallTargetSymbols(
+    const std::vector<Callsite> &Targets, const size_t N, BinaryBasicBlock &BB,
+    MCInst &CallInst, MCInst *&TargetFetchInst) const {
+  BinaryFunction &Function = *BB.getFunction();
+  BinaryContext &BC = Function.getBinaryContext();
+
+  // The ladder compares the jump table index register against immediate
+  // indices, so the register must be recoverable even when there is no
+  // memory profile for the table load.
+  MCInst *MemLocInstr;
+  MCInst *PCRelBaseOut;
+  unsigned BaseReg, IndexReg;
+  int64_t DispValue;
+  const MCExpr *DispExpr;
+  MutableArrayRef<MCInst> Insts(&BB.front(), &CallInst);
+  BC.MIB->analyzeIndirectBranch(CallInst, Insts.begin(), Insts.end(),
+                                BC.AsmInfo->getCodePointerSize(), MemLocInstr,
+                                BaseReg, IndexReg, DispValue, DispExpr,
+                                PCRelBaseOut);
+  if (!MemLocInstr || IndexReg == 0) {
+    DEBUG_VERBOSE(1, dbgs() << "BOLT-INFO: ICP no index register for ladder in "
+                            << Function << "\n");
+    return SymTargetsType();
+  }
+
+  BC.MIB->getOrCreateAnnotationAs<uint16_t>(
+      CallInst, MCPlus::MCAnnotation::kJTIndexReg) = IndexReg;
+  TargetFetchInst = MemLocInstr;
+
+  SymTargetsType SymTargets;
+  for (size_t I = 0, TgtIdx = 0; I < N; ++TgtIdx) {
+    const Callsite &Target = Targets[TgtIdx];
+    assert(Target.To.Sym && "All ICP targets must be to known symbols");
+    assert(!Target.JTIndices.empty() && "Jump tables must have indices");
+    for (uint64_t Idx : Target.JTIndices) {
+      SymTargets.emplace_back(Target.To.Sym, Idx);
+      ++I;
+    }
+  }
+
+  return SymTargets;
+}
+
 IndirectCallPromotion::MethodInfoType IndirectCallPromotion::maybeGetVtableSyms(
     BinaryBasicBlock &BB, MCInst &Inst,
     const SymTargetsType &SymTargets) const {
@@ -772,7 +868,7 @@ IndirectCallPromotion::rewriteCall(
         Function.createBasicBlock(OrigOffset, Sym);
     for (MCInst &Inst : Insts) // sanitize new instructions.
       if (MIB->isCall(Inst))
-        MIB->removeAnnotation(Inst, "CallProfile");
+        MIB->removeAnnotation(Inst, MCPlus::MCAnnotation::kCallProfile);
     TBB->addInstructions(Insts.begin(), Insts.end());
     NewBBs.emplace_back(std::move(TBB));
   }
@@ -788,6 +884,7 @@ IndirectCallPromotion::rewriteCall(
 BinaryBasicBlock *
 IndirectCallPromotion::fixCFG(BinaryBasicBlock &IndCallBlock,
                               const bool IsTailCall, const bool IsJumpTable,
+                              const bool IsLadder,
                               IndirectCallPromotion::BasicBlocksVector &&NewBBs,
                               const std::vector<Callsite> &Targets) const {
   BinaryFunction &Function = *IndCallBlock.getFunction();
@@ -819,7 +916,105 @@ IndirectCallPromotion::fixCFG(BinaryBasicBlock &IndCallBlock,
     }
   }
 
-  if (IsJumpTable) {
+  if (IsJumpTable && IsLadder) {
+    BinaryContext &BC = Function.getBinaryContext();
+    BinaryBasicBlock *FallbackBlock = NewBBs.back().get();
+    IndCallBlock.moveAllSuccessorsTo(FallbackBlock);
+
+    // All indices of one target split its counts evenly, so an equality
+    // compare edge is weighted by its target symbol alone.
+    std::map<const MCSymbol *, BinaryBranchInfo> PerIndexBBI;
+    std::map<const MCSymbol *, BinaryBranchInfo> PerIndexScaledBBI;
+    size_t EntryIdx = 0;
+    for (const Callsite &Target : Targets) {
+      const size_t NumEntries =
+          std::max(static_cast<std::size_t>(1UL), Target.JTIndices.size());
+      PerIndexBBI[Target.To.Sym] = BBI[EntryIdx];
+      PerIndexScaledBBI[Target.To.Sym] = ScaledBBI[EntryIdx];
+      EntryIdx += NumEntries;
+    }
+
+    // Ladder blocks in layout order. The root compare replaced the indirect
+    // jump inside IndCallBlock.
+    std::vector<BinaryBasicBlock *> LadderBlocks;
+    LadderBlocks.push_back(&IndCallBlock);
+    for (std::unique_ptr<BinaryBasicBlock> &BB : NewBBs)
+      if (BB.get() != FallbackBlock)
+        LadderBlocks.push_back(BB.get());
+
+    std::map<const MCSymbol *, BinaryBasicBlock *> LadderBlockForLabel;
+    for (BinaryBasicBlock *LadderBB : LadderBlocks)
+      if (LadderBB->getLabel())
+        LadderBlockForLabel[LadderBB->getLabel()] = LadderBB;
+
+    // Decode the single conditional branch of every ladder block: leaves
+    // test an index for equality and jump to a promoted target, internal
+    // blocks jump into the upper half of their index range.
+    std::vector<const MCSymbol *> CondTarget(LadderBlocks.size(), nullptr);
+    size_t NumLeaves = 0;
+    uint64_t PromotedCount = 0;
+    for (size_t I = 0; I < LadderBlocks.size(); ++I) {
+      for (const MCInst &Inst : *LadderBlocks[I]) {
+        if (!BC.MIB->isConditionalBranch(Inst))
+          continue;
+        CondTarget[I] = BC.MIB->getTargetSymbol(Inst);
+        break;
+      }
+      assert(CondTarget[I] && "ladder block must have a conditional branch");
+      if (!LadderBlockForLabel.count(CondTarget[I])) {
+        ++NumLeaves;
+        PromotedCount += PerIndexScaledBBI[CondTarget[I]].Count;
+      }
+    }
+    const uint64_t FallbackCount =
+        TotalCount > PromotedCount ? TotalCount - PromotedCount : 0;
+
+    // Attribute execution counts bottom-up: all branches target later
+    // blocks, so a block's count is the sum of its outgoing edges. The
+    // unprofiled remainder reaching the fallback block is split evenly over
+    // the miss edges of the leaves.
+    uint64_t RemainingFallbackCount = FallbackCount;
+    size_t RemainingLeaves = NumLeaves;
+    std::map<const BinaryBasicBlock *, uint64_t> BlockCount;
+    for (size_t I = LadderBlocks.size(); I-- > 0;) {
+      BinaryBasicBlock *LadderBB = LadderBlocks[I];
+      uint64_t Count = 0;
+      auto LadderTargetItr = LadderBlockForLabel.find(CondTarget[I]);
+      if (LadderTargetItr == LadderBlockForLabel.end()) {
+        // Leaf: equality branch to the promoted target, miss edge to the
+        // fallback block.
+        BinaryBasicBlock *TargetBB =
+            Function.getBasicBlockForLabel(CondTarget[I]);
+        assert(TargetBB && "promoted target must be in the function");
+        const BinaryBranchInfo &TakenBI = PerIndexScaledBBI[CondTarget[I]];
+        const uint64_t MissCount = RemainingFallbackCount / RemainingLeaves;
+        --RemainingLeaves;
+        RemainingFallbackCount -= MissCount;
+        LadderBB->addSuccessor(TargetBB, TakenBI);
+        LadderBB->addSuccessor(FallbackBlock, MissCount);
+        Count = TakenBI.Count + MissCount;
+
+        // Update branch info for the fallback indirect jump.
+        BinaryBranchInfo &BranchInfo = FallbackBlock->getBranchInfo(*TargetBB);
+        const BinaryBranchInfo &UnscaledBI = PerIndexBBI[CondTarget[I]];
+        BranchInfo.Count -= std::min(BranchInfo.Count, UnscaledBI.Count);
+        BranchInfo.MispredictedCount -=
+            std::min(BranchInfo.MispredictedCount, UnscaledBI.MispredictedCount);
+      } else {
+        // Internal compare: branch into the upper half of the index range,
+        // fall through to the lower half in the next block.
+        BinaryBasicBlock *RightBB = LadderTargetItr->second;
+        BinaryBasicBlock *FallthroughBB = LadderBlocks[I + 1];
+        LadderBB->addSuccessor(RightBB, BlockCount[RightBB]);
+        LadderBB->addSuccessor(FallthroughBB, BlockCount[FallthroughBB]);
+        Count = BlockCount[RightBB] + BlockCount[FallthroughBB];
+      }
+      BlockCount[LadderBB] = Count;
+      LadderBB->setExecutionCount(Count);
+    }
+
+    TotalCount = FallbackCount;
+  } else if (IsJumpTable) {
     BinaryBasicBlock *NewIndCallBlock = NewBBs.back().get();
     IndCallBlock.moveAllSuccessorsTo(NewIndCallBlock);
 
@@ -925,6 +1120,13 @@ size_t IndirectCallPromotion::canPromoteCallsite(
   if (BB.getKnownExecutionCount() < opts::ExecutionCountThreshold)
     return 0;
 
+  // The call target profile attached to the instruction is only as
+  // trustworthy as the block count it was collected with. Promoting based on
+  // a guessed count inserts compare-and-branch sequences on paths that may
+  // not be hot at all.
+  if (BB.getProfileConfidence() == BinaryBasicBlock::PROF_CONF_GUESSED)
+    return 0;
+
   const bool IsJumpTable = BB.getFunction()->getJumpTable(Inst);
 
   auto computeStats = [&](size_t N) {
@@ -1124,19 +1326,23 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
     for (auto &KV : BFs)
       Functions.insert(&KV.second);
   } else {
-    using IndirectCallsite = std::tuple<uint64_t, MCInst *, BinaryFunction *>;
+    // A callsite is ranked by its benefit estimate and broken down by the
+    // number of calls it issues. By default the two are the same; with
+    // -icp-top-callsites-by-mispredicts the benefit is the misprediction
+    // count, spending the promotion budget where the cycles are.
+    using IndirectCallsite =
+        std::tuple<uint64_t, uint64_t, MCInst *, BinaryFunction *>;
     std::vector<IndirectCallsite> IndirectCalls;
     size_t TotalIndirectCalls = 0;
 
-    // Find all the indirect callsites.
-    for (auto &BFIt : BFs) {
-      BinaryFunction &Function = BFIt.second;
-
-      if (!Function.isSimple() || Function.isIgnored() ||
-          !Function.hasProfile())
-        continue;
-
+    // Find all the indirect callsites. Candidate analysis only reads the
+    // CFG and profile annotations, so functions are mined in parallel and
+    // the per-function results merged under a lock.
+    std::mutex CandidatesMutex;
+    ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &Function) {
       const bool HasLayout = !Function.layout_empty();
+      std::vector<IndirectCallsite> FunctionCalls;
+      uint64_t FunctionTotalCalls = 0;
 
       for (BinaryBasicBlock &BB : Function) {
         if (HasLayout && Function.isSplit() && BB.isCold())
@@ -1145,7 +1351,7 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
         for (MCInst &Inst : BB) {
           const bool IsJumpTable = Function.getJumpTable(Inst);
           const bool HasIndirectCallProfile =
-              BC.MIB->hasAnnotation(Inst, "CallProfile");
+              BC.MIB->hasAnnotation(Inst, MCPlus::MCAnnotation::kCallProfile);
           const bool IsDirectCall =
               (BC.MIB->isCall(Inst) && BC.MIB->getTargetSymbol(Inst, 0));
 
@@ -1153,17 +1359,35 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
               ((HasIndirectCallProfile && !IsJumpTable && OptimizeCalls) ||
                (IsJumpTable && OptimizeJumpTables))) {
             uint64_t NumCalls = 0;
-            for (const Callsite &BInfo : getCallTargets(BB, Inst))
+            uint64_t NumMispreds = 0;
+            for (const Callsite &BInfo : getCallTargets(BB, Inst)) {
               NumCalls += BInfo.Branches;
-            IndirectCalls.push_back(
-                std::make_tuple(NumCalls, &Inst, &Function));
-            TotalIndirectCalls += NumCalls;
+              NumMispreds += BInfo.Mispreds;
+            }
+            const uint64_t Benefit =
+                opts::ICPTopCallsitesByMispredicts ? NumMispreds : NumCalls;
+            FunctionCalls.push_back(
+                std::make_tuple(Benefit, NumCalls, &Inst, &Function));
+            FunctionTotalCalls += NumCalls;
           }
         }
       }
-    }
 
-    // Sort callsites by execution count.
+      std::lock_guard<std::mutex> Lock(CandidatesMutex);
+      IndirectCalls.insert(IndirectCalls.end(), FunctionCalls.begin(),
+                           FunctionCalls.end());
+      TotalIndirectCalls += FunctionTotalCalls;
+    };
+
+    ParallelUtilities::PredicateTy SkipFunc = [](const BinaryFunction &BF) {
+      return !BF.isSimple() || BF.isIgnored() || !BF.hasProfile();
+    };
+
+    ParallelUtilities::runOnEachFunction(
+        BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+        SkipFunc, "ICPCandidates", /*ForceSequential=*/false);
+
+    // Sort callsites by benefit.
     std::sort(IndirectCalls.rbegin(), IndirectCalls.rend());
 
     // Find callsites that contribute to the top "opts::ICPTopCallsites"%
@@ -1179,10 +1403,10 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
       // (e.g. turning on/off ICP depending on the order of functions)
       if (MaxCalls <= 0 && CurFreq != LastFreq)
         break;
-      MaxCalls -= CurFreq;
+      MaxCalls -= std::get<1>(IC);
       LastFreq = CurFreq;
-      BC.MIB->addAnnotation(*std::get<1>(IC), "DoICP", true);
-      Functions.insert(std::get<2>(IC));
+      BC.MIB->addAnnotation(*std::get<2>(IC), "DoICP", true);
+      Functions.insert(std::get<3>(IC));
       ++Num;
     }
     outs() << "BOLT-INFO: ICP Total indirect calls = " << TotalIndirectCalls
@@ -1222,7 +1446,7 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
         const auto InstIdx = &Inst - &(*BB->begin());
         const bool IsTailCall = BC.MIB->isTailCall(Inst);
         const bool HasIndirectCallProfile =
-            BC.MIB->hasAnnotation(Inst, "CallProfile");
+            BC.MIB->hasAnnotation(Inst, MCPlus::MCAnnotation::kCallProfile);
         const bool IsJumpTable = Function.getJumpTable(Inst);
 
         if (BC.MIB->isCall(Inst))
@@ -1277,6 +1501,34 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
         // to use when promoting this call.  A value of zero means to skip
         // this callsite.
         size_t N = canPromoteCallsite(*BB, Inst, Targets, NumCalls);
+        const size_t ChainN = N;
+
+        // Megamorphic callsites with a flat target histogram defeat both the
+        // sequential compare chain and the per-target frequency thresholds
+        // that size it. If the histogram entropy is high enough, dispatch
+        // through a binary-searched compare ladder instead, sized only by
+        // the number of profiled indices.
+        bool UseLadder = false;
+        if (IsJumpTable && !opts::ICPJumpTablesByTarget &&
+            opts::ICPJTLadderEntropyThreshold &&
+            BB->getKnownExecutionCount() >= opts::ExecutionCountThreshold &&
+            (!opts::ICPTopCallsites || BC.MIB->hasAnnotation(Inst, "DoICP")) &&
+            100.0 * computeTargetEntropy(Targets) >=
+                opts::ICPJTLadderEntropyThreshold) {
+          size_t LadderN = 0;
+          for (const Callsite &Target : Targets) {
+            if (!Target.Branches || !Target.To.Sym || Target.JTIndices.empty())
+              break;
+            if (LadderN + Target.JTIndices.size() >
+                opts::ICPJTLadderMaxTargets)
+              break;
+            LadderN += Target.JTIndices.size();
+          }
+          if (LadderN >= opts::ICPJTLadderMinTargets && LadderN > N) {
+            N = LadderN;
+            UseLadder = true;
+          }
+        }
 
         // If it is a jump table and it failed to meet our initial threshold,
         // proceed to findCallTargetSymbols -- it may reevaluate N if
@@ -1285,12 +1537,26 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
           continue;
 
         if (opts::Verbosity >= 1)
-          printCallsiteInfo(*BB, Inst, Targets, N, NumCalls);
+          printCallsiteInfo(*BB, Inst, Targets, std::min(N, Targets.size()),
+                            NumCalls);
 
         // Find MCSymbols or absolute addresses for each call target.
         MCInst *TargetFetchInst = nullptr;
-        const SymTargetsType SymTargets =
-            findCallTargetSymbols(Targets, N, *BB, Inst, TargetFetchInst);
+        SymTargetsType SymTargets;
+        if (UseLadder) {
+          SymTargets =
+              findLadderCallTargetSymbols(Targets, N, *BB, Inst,
+                                          TargetFetchInst);
+          if (SymTargets.empty()) {
+            // The index register could not be recovered; fall back to the
+            // regular compare chain.
+            UseLadder = false;
+            N = ChainN;
+          }
+        }
+        if (!UseLadder)
+          SymTargets = findCallTargetSymbols(Targets, N, *BB, Inst,
+                                             TargetFetchInst);
 
         // findCallTargetSymbols may have changed N if mem profile is available
         // for jump tables
@@ -1322,15 +1588,19 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
                      << (!MethodInfo.first.empty() ? "found" : "did not find")
                      << " vtables for all methods.\n");
         } else if (TargetFetchInst) {
-          ++TotalIndexBasedJumps;
+          if (!UseLadder)
+            ++TotalIndexBasedJumps;
           MethodInfo.second.push_back(TargetFetchInst);
         }
 
         // Generate new promoted call code for this callsite.
         MCPlusBuilder::BlocksVectorTy ICPcode =
             (IsJumpTable && !opts::ICPJumpTablesByTarget)
-                ? BC.MIB->jumpTablePromotion(Inst, SymTargets,
-                                             MethodInfo.second, BC.Ctx.get())
+                ? (UseLadder
+                       ? BC.MIB->jumpTableLadderPromotion(
+                             Inst, SymTargets, MethodInfo.second, BC.Ctx.get())
+                       : BC.MIB->jumpTablePromotion(
+                             Inst, SymTargets, MethodInfo.second, BC.Ctx.get()))
                 : BC.MIB->indirectCallPromotion(
                       Inst, SymTargets, MethodInfo.first, MethodInfo.second,
                       opts::ICPOldCodeSequence, BC.Ctx.get());
@@ -1363,8 +1633,9 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
             rewriteCall(*BB, Inst, std::move(ICPcode), MethodInfo.second);
 
         // Fix the CFG after inserting the new basic blocks.
-        BinaryBasicBlock *MergeBlock =
-            fixCFG(*BB, IsTailCall, IsJumpTable, std::move(NewBBs), Targets);
+        BinaryBasicBlock *MergeBlock = fixCFG(*BB, IsTailCall, IsJumpTable,
+                                              UseLadder, std::move(NewBBs),
+                                              Targets);
 
         // Since the tail of the original block was split off and it may contain
         // additional indirect calls, we must add the merge block to the set of
@@ -1377,10 +1648,13 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
                  << InstIdx << " in " << BB->getName()
                  << " -> calls = " << NumCalls << "\n";
 
-        if (IsJumpTable)
+        if (IsJumpTable) {
           ++TotalOptimizedJumpTableCallsites;
-        else
+          if (UseLadder)
+            ++TotalLadderCallsites;
+        } else {
           ++TotalOptimizedIndirectCallsites;
+        }
 
         Modified.insert(&Function);
       }
@@ -1424,6 +1698,9 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
          << format("%.1f", (100.0 * TotalOptimizedJumpTableCallsites) /
                                std::max<uint64_t>(TotalJumpTableCallsites, 1))
          << "%\n"
+         << "BOLT-INFO: ICP number of jump table callsites promoted with "
+            "compare ladders = "
+         << TotalLadderCallsites << "\n"
          << "BOLT-INFO: ICP number of jump table callsites that can use hot "
          << "indices = " << TotalIndexBasedCandidates << "\n"
          << "BOLT-INFO: ICP percentage of jump table callsites that use hot "
@@ -26,8 +26,11 @@
 
 #include "bolt/Passes/Inliner.h"
 #include "bolt/Core/MCPlus.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Support/CommandLine.h"
 #include <map>
+#include <queue>
 
 #define DEBUG_TYPE "bolt-inliner"
 
@@ -82,9 +85,18 @@ InlineLimit("inline-limit",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+InlineMaxGrowth("inline-max-growth",
+  cl::desc("maximum total increase in binary size due to inlining, in bytes "
+           "(0 = unlimited)"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<unsigned>
 InlineMaxIters("inline-max-iters",
-  cl::desc("maximum number of inline iterations"),
+  cl::desc("maximum number of inlining passes over a single function"),
   cl::init(3),
   cl::ZeroOrMore,
   cl::Hidden,
@@ -417,6 +429,51 @@ Inliner::inlineCall(BinaryBasicBlock &CallerBB,
   return std::make_pair(FirstInlinedBB, FirstInlinedBB->end());
 }
 
+BinaryFunction *Inliner::getEligibleCallTarget(const BinaryFunction &Function,
+                                               const MCInst &Inst,
+                                               int64_t &SizeAfterInlining) {
+  const BinaryContext &BC = Function.getBinaryContext();
+  if (!BC.MIB->isCall(Inst) || MCPlus::getNumPrimeOperands(Inst) != 1 ||
+      !Inst.getOperand(0).isExpr())
+    return nullptr;
+
+  const MCSymbol *TargetSymbol = BC.MIB->getTargetSymbol(Inst);
+  assert(TargetSymbol && "target symbol expected for direct call");
+
+  // Don't inline calls to a secondary entry point in a target function.
+  uint64_t EntryID = 0;
+  BinaryFunction *TargetFunction =
+      BC.getFunctionForSymbol(TargetSymbol, &EntryID);
+  if (!TargetFunction || EntryID != 0)
+    return nullptr;
+
+  // Don't do recursive inlining.
+  if (TargetFunction == &Function)
+    return nullptr;
+
+  auto IInfo = InliningCandidates.find(TargetFunction);
+  if (IInfo == InliningCandidates.end())
+    return nullptr;
+
+  const bool IsTailCall = BC.MIB->isTailCall(Inst);
+  if (!IsTailCall && IInfo->second.Type == INL_TAILCALL)
+    return nullptr;
+
+  if (IsTailCall)
+    SizeAfterInlining =
+        IInfo->second.SizeAfterTailCallInlining - getSizeOfTailCallInst(BC);
+  else
+    SizeAfterInlining =
+        IInfo->second.SizeAfterInlining - getSizeOfCallInst(BC);
+
+  if (!opts::InlineAll && !opts::mustConsider(*TargetFunction))
+    if (!opts::InlineSmallFunctions ||
+        SizeAfterInlining > opts::InlineSmallFunctionsBytes)
+      return nullptr;
+
+  return TargetFunction;
+}
+
 bool Inliner::inlineCallsInFunction(BinaryFunction &Function) {
   BinaryContext &BC = Function.getBinaryContext();
   std::vector<BinaryBasicBlock *> Blocks(Function.layout().begin(),
@@ -431,58 +488,24 @@ bool Inliner::inlineCallsInFunction(BinaryFunction &Function) {
   for (BinaryBasicBlock *BB : Blocks) {
     for (auto InstIt = BB->begin(); InstIt != BB->end();) {
       MCInst &Inst = *InstIt;
-      if (!BC.MIB->isCall(Inst) || MCPlus::getNumPrimeOperands(Inst) != 1 ||
-          !Inst.getOperand(0).isExpr()) {
-        ++InstIt;
-        continue;
-      }
 
-      const MCSymbol *TargetSymbol = BC.MIB->getTargetSymbol(Inst);
-      assert(TargetSymbol && "target symbol expected for direct call");
-
-      // Don't inline calls to a secondary entry point in a target function.
-      uint64_t EntryID = 0;
+      int64_t SizeAfterInlining;
       BinaryFunction *TargetFunction =
-          BC.getFunctionForSymbol(TargetSymbol, &EntryID);
-      if (!TargetFunction || EntryID != 0) {
-        ++InstIt;
-        continue;
-      }
-
-      // Don't do recursive inlining.
-      if (TargetFunction == &Function) {
-        ++InstIt;
-        continue;
-      }
-
-      auto IInfo = InliningCandidates.find(TargetFunction);
-      if (IInfo == InliningCandidates.end()) {
+          getEligibleCallTarget(Function, Inst, SizeAfterInlining);
+      if (!TargetFunction) {
         ++InstIt;
         continue;
       }
 
-      const bool IsTailCall = BC.MIB->isTailCall(Inst);
-      if (!IsTailCall && IInfo->second.Type == INL_TAILCALL) {
+      // Skip the call site if inlining it would exceed the code growth
+      // budget.
+      if (opts::InlineMaxGrowth &&
+          TotalInlinedBytes + SizeAfterInlining >
+              static_cast<int64_t>(opts::InlineMaxGrowth)) {
         ++InstIt;
         continue;
       }
 
-      int64_t SizeAfterInlining;
-      if (IsTailCall)
-        SizeAfterInlining =
-            IInfo->second.SizeAfterTailCallInlining - getSizeOfTailCallInst(BC);
-      else
-        SizeAfterInlining =
-            IInfo->second.SizeAfterInlining - getSizeOfCallInst(BC);
-
-      if (!opts::InlineAll && !opts::mustConsider(*TargetFunction)) {
-        if (!opts::InlineSmallFunctions ||
-            SizeAfterInlining > opts::InlineSmallFunctionsBytes) {
-          ++InstIt;
-          continue;
-        }
-      }
-
       LLVM_DEBUG(dbgs() << "BOLT-DEBUG: inlining call to " << *TargetFunction
                         << " in " << Function << " : " << BB->getName()
                         << ". Count: " << BB->getKnownExecutionCount()
@@ -502,7 +525,8 @@ bool Inliner::inlineCallsInFunction(BinaryFunction &Function) {
         TargetFunction->adjustExecutionCount(BB->getKnownExecutionCount());
 
       // Check if the caller inlining status has to be adjusted.
-      if (IInfo->second.Type == INL_TAILCALL) {
+      if (InliningCandidates.find(TargetFunction)->second.Type ==
+          INL_TAILCALL) {
         auto CallerIInfo = InliningCandidates.find(&Function);
         if (CallerIInfo != InliningCandidates.end() &&
             CallerIInfo->second.Type == INL_ANY) {
@@ -526,52 +550,119 @@ void Inliner::runOnFunctions(BinaryContext &BC) {
   if (!opts::inliningEnabled())
     return;
 
-  uint64_t TotalSize = 0;
+  // Summary phase: screen all potential callees once. The table is kept up
+  // to date incrementally as inlining modifies functions.
+  findInliningCandidates(BC);
+
+  // Functions containing direct calls to a given function. Used to requeue
+  // callers when the callee's summary changes.
+  DenseMap<const BinaryFunction *, SmallPtrSet<BinaryFunction *, 4>> Callers;
+
+  // Score a caller by the most profitable of its eligible call sites: the
+  // profiled execution count of the call site against the net code growth of
+  // inlining it. Zero-count call sites still get a small non-zero score so
+  // that every eligible site is eventually visited.
+  auto computeScore = [&](BinaryFunction &Function, bool RecordCallers) {
+    double Score = 0;
+    for (const BinaryBasicBlock &BB : Function) {
+      const uint64_t Count = BB.getKnownExecutionCount();
+      for (const MCInst &Inst : BB) {
+        if (RecordCallers && BC.MIB->isCall(Inst))
+          if (const MCSymbol *TargetSymbol = BC.MIB->getTargetSymbol(Inst))
+            if (BinaryFunction *Target =
+                    BC.getFunctionForSymbol(TargetSymbol))
+              Callers[Target].insert(&Function);
+
+        int64_t SizeAfterInlining;
+        if (!getEligibleCallTarget(Function, Inst, SizeAfterInlining))
+          continue;
+        Score = std::max(Score, static_cast<double>(Count + 1) /
+                                    std::max<int64_t>(1, SizeAfterInlining));
+      }
+    }
+    return Score;
+  };
+
+  // Global worklist of callers ordered by score. Entries are invalidated
+  // lazily: whenever a function or one of its callees changes, its version
+  // is bumped and a fresh entry is pushed.
+  struct QueueEntry {
+    double Score;
+    uint64_t Address;
+    BinaryFunction *Function;
+    unsigned Version;
+  };
+  auto Less = [](const QueueEntry &A, const QueueEntry &B) {
+    if (A.Score != B.Score)
+      return A.Score < B.Score;
+    return A.Address > B.Address;
+  };
+  std::priority_queue<QueueEntry, std::vector<QueueEntry>, decltype(Less)>
+      Queue(Less);
+  DenseMap<const BinaryFunction *, unsigned> Version;
+  DenseMap<const BinaryFunction *, unsigned> TimesProcessed;
+
+  auto enqueue = [&](BinaryFunction &Function, bool RecordCallers) {
+    if (!shouldOptimize(Function))
+      return;
+    const double Score = computeScore(Function, RecordCallers);
+    if (Score == 0)
+      return;
+    Queue.push({Score, Function.getAddress(), &Function, Version[&Function]});
+  };
+
   for (auto &BFI : BC.getBinaryFunctions())
-    TotalSize += BFI.second.getSize();
+    enqueue(BFI.second, /*RecordCallers=*/true);
 
-  bool InlinedOnce;
-  unsigned NumIters = 0;
-  do {
+  while (!Queue.empty()) {
     if (opts::InlineLimit && NumInlinedCallSites >= opts::InlineLimit)
       break;
+    if (opts::InlineMaxGrowth &&
+        TotalInlinedBytes >= static_cast<int64_t>(opts::InlineMaxGrowth))
+      break;
 
-    InlinedOnce = false;
+    const QueueEntry Entry = Queue.top();
+    Queue.pop();
+    BinaryFunction &Function = *Entry.Function;
 
-    InliningCandidates.clear();
-    findInliningCandidates(BC);
+    // Drop entries invalidated by a later change to the caller or one of
+    // its callees.
+    if (Entry.Version != Version[&Function])
+      continue;
 
-    std::vector<BinaryFunction *> ConsideredFunctions;
-    for (auto &BFI : BC.getBinaryFunctions()) {
-      BinaryFunction &Function = BFI.second;
-      if (!shouldOptimize(Function))
-        continue;
-      ConsideredFunctions.push_back(&Function);
-    }
-    std::sort(ConsideredFunctions.begin(), ConsideredFunctions.end(),
-              [](const BinaryFunction *A, const BinaryFunction *B) {
-                return B->getKnownExecutionCount() <
-                       A->getKnownExecutionCount();
-              });
-    for (BinaryFunction *Function : ConsideredFunctions) {
-      if (opts::InlineLimit && NumInlinedCallSites >= opts::InlineLimit)
-        break;
+    if (TimesProcessed[&Function] >= opts::InlineMaxIters)
+      continue;
+    ++TimesProcessed[&Function];
 
-      const bool DidInline = inlineCallsInFunction(*Function);
+    if (!inlineCallsInFunction(Function))
+      continue;
 
-      if (DidInline)
-        Modified.insert(Function);
+    Modified.insert(&Function);
 
-      InlinedOnce |= DidInline;
-    }
+    // The function changed: refresh its callee summary and revisit its
+    // remaining call sites, including ones exposed by the inlined bodies.
+    ++Version[&Function];
+    const InliningInfo Info = getInliningInfo(Function);
+    if (Info.Type != INL_NONE)
+      InliningCandidates[&Function] = Info;
+    else
+      InliningCandidates.erase(&Function);
+    enqueue(Function, /*RecordCallers=*/true);
 
-    ++NumIters;
-  } while (InlinedOnce && NumIters < opts::InlineMaxIters);
+    // The summary change may have created or altered opportunities in the
+    // callers of this function.
+    for (BinaryFunction *Caller : Callers[&Function]) {
+      if (Caller == &Function)
+        continue;
+      ++Version[Caller];
+      enqueue(*Caller, /*RecordCallers=*/false);
+    }
+  }
 
   if (NumInlinedCallSites)
     outs() << "BOLT-INFO: inlined " << NumInlinedDynamicCalls << " calls at "
-           << NumInlinedCallSites << " call sites in " << NumIters
-           << " iteration(s). Change in binary size: " << TotalInlinedBytes
+           << NumInlinedCallSites
+           << " call sites. Change in binary size: " << TotalInlinedBytes
            << " bytes.\n";
 }
 
@@ -15,7 +15,8 @@
 #include "bolt/RuntimeLibs/InstrumentationRuntimeLibrary.h"
 #include "bolt/Utils/Utils.h"
 #include "llvm/Support/CommandLine.h"
-#include <stack>
+#include "llvm/Support/MathExtras.h"
+#include <queue>
 
 #define DEBUG_TYPE "bolt-instrumentation"
 
@@ -41,6 +42,39 @@ cl::opt<bool> InstrumentationFileAppendPID(
     cl::desc("append PID to saved profile file name (default: false)"),
     cl::init(false), cl::Optional, cl::cat(BoltInstrCategory));
 
+cl::opt<bool> InstrumentationBinaryProfile(
+    "instrumentation-binary-dump",
+    cl::desc("write the profile in the binary fdata container instead of "
+             "text, producing much smaller dumps for periodic collection; "
+             "understood by merge-fdata and BOLT's profile readers "
+             "(default: false)"),
+    cl::init(false), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<uint32_t> InstrumentationCounterShards(
+    "instrumentation-counter-shards",
+    cl::desc("replicate the counter region this many times and make each "
+             "thread update the replica selected by hashing its thread "
+             "pointer, reducing cache-line contention on hot counters (must "
+             "be a power of two, default: 1)"),
+    cl::init(1), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<uint32_t> InstrumentationSampling(
+    "instrumentation-sampling",
+    cl::desc("record only 1-in-N counter increments, steering the rest to a "
+             "slab-local sink slot (N must be a power of two; 0 = record "
+             "every execution, default). Best combined with "
+             "-instrumentation-counter-shards. The rate can be retuned at "
+             "runtime by writing __bolt_instr_sample_mask in the running "
+             "process."),
+    cl::init(0), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<bool> InstrumentationSharedCounters(
+    "instrumentation-shared-counters",
+    cl::desc("back instrumentation counters with a named shared-memory "
+             "segment under /dev/shm so external tools can snapshot them "
+             "without pausing the process (default: false)"),
+    cl::init(false), cl::Optional, cl::cat(BoltInstrCategory));
+
 cl::opt<bool> ConservativeInstrumentation(
     "conservative-instrumentation",
     cl::desc("disable instrumentation optimizations that sacrifice profile "
@@ -95,7 +129,20 @@ uint32_t Instrumentation::getFunctionNameIndex(const BinaryFunction &Function) {
   return Idx;
 }
 
-bool Instrumentation::createCallDescription(FunctionDescription &FuncDesc,
+uint32_t
+Instrumentation::getFunctionNameIndex(const BinaryFunction &Function,
+                                      FunctionInstrumentationData &Data) {
+  auto Iter = Data.FuncToLocalIdx.find(&Function);
+  if (Iter != Data.FuncToLocalIdx.end())
+    return Iter->second;
+  const uint32_t Idx = Data.StringTableSize;
+  Data.FuncToLocalIdx[&Function] = Idx;
+  Data.ReferencedNames.emplace_back(&Function, Idx);
+  Data.StringTableSize += getEscapedName(Function.getOneName()).size() + 1;
+  return Idx;
+}
+
+bool Instrumentation::createCallDescription(FunctionInstrumentationData &Data,
                                             const BinaryFunction &FromFunction,
                                             uint32_t From, uint32_t FromNodeID,
                                             const BinaryFunction &ToFunction,
@@ -106,78 +153,88 @@ bool Instrumentation::createCallDescription(FunctionDescription &FuncDesc,
   // exceptions, in which case there is no other way to accurately record its
   // frequency.
   bool ForceInstrumentation = opts::ConservativeInstrumentation || IsInvoke;
-  CD.FromLoc.FuncString = getFunctionNameIndex(FromFunction);
+  CD.FromLoc.FuncString = getFunctionNameIndex(FromFunction, Data);
   CD.FromLoc.Offset = From;
   CD.FromNode = FromNodeID;
   CD.Target = &ToFunction;
-  CD.ToLoc.FuncString = getFunctionNameIndex(ToFunction);
+  CD.ToLoc.FuncString = getFunctionNameIndex(ToFunction, Data);
   CD.ToLoc.Offset = To;
-  CD.Counter = ForceInstrumentation ? Summary->Counters.size() : 0xffffffff;
+  CD.Counter = ForceInstrumentation ? Data.Counters.size() : 0xffffffff;
   if (ForceInstrumentation)
-    ++DirectCallCounters;
-  FuncDesc.Calls.emplace_back(CD);
+    ++Data.DirectCallCounters;
+  Data.FuncDesc.Calls.emplace_back(CD);
   return ForceInstrumentation;
 }
 
 void Instrumentation::createIndCallDescription(
-    const BinaryFunction &FromFunction, uint32_t From) {
+    FunctionInstrumentationData &Data, const BinaryFunction &FromFunction,
+    uint32_t From) {
   IndCallDescription ICD;
-  ICD.FromLoc.FuncString = getFunctionNameIndex(FromFunction);
+  ICD.FromLoc.FuncString = getFunctionNameIndex(FromFunction, Data);
   ICD.FromLoc.Offset = From;
-  Summary->IndCallDescriptions.emplace_back(ICD);
+  Data.IndCallDescriptions.emplace_back(ICD);
 }
 
 void Instrumentation::createIndCallTargetDescription(
-    const BinaryFunction &ToFunction, uint32_t To) {
+    FunctionInstrumentationData &Data, const BinaryFunction &ToFunction,
+    uint32_t To) {
   IndCallTargetDescription ICD;
-  ICD.ToLoc.FuncString = getFunctionNameIndex(ToFunction);
+  ICD.ToLoc.FuncString = getFunctionNameIndex(ToFunction, Data);
   ICD.ToLoc.Offset = To;
   ICD.Target = &ToFunction;
-  Summary->IndCallTargetDescriptions.emplace_back(ICD);
+  Data.IndCallTargetDescriptions.emplace_back(ICD);
 }
 
-bool Instrumentation::createEdgeDescription(FunctionDescription &FuncDesc,
+bool Instrumentation::createEdgeDescription(FunctionInstrumentationData &Data,
                                             const BinaryFunction &FromFunction,
                                             uint32_t From, uint32_t FromNodeID,
                                             const BinaryFunction &ToFunction,
                                             uint32_t To, uint32_t ToNodeID,
                                             bool Instrumented) {
   EdgeDescription ED;
-  auto Result = FuncDesc.EdgesSet.insert(std::make_pair(FromNodeID, ToNodeID));
+  auto Result =
+      Data.FuncDesc.EdgesSet.insert(std::make_pair(FromNodeID, ToNodeID));
   // Avoid creating duplicated edge descriptions. This happens in CFGs where a
   // block jumps to its fall-through.
   if (Result.second == false)
     return false;
-  ED.FromLoc.FuncString = getFunctionNameIndex(FromFunction);
+  ED.FromLoc.FuncString = getFunctionNameIndex(FromFunction, Data);
   ED.FromLoc.Offset = From;
   ED.FromNode = FromNodeID;
-  ED.ToLoc.FuncString = getFunctionNameIndex(ToFunction);
+  ED.ToLoc.FuncString = getFunctionNameIndex(ToFunction, Data);
   ED.ToLoc.Offset = To;
   ED.ToNode = ToNodeID;
-  ED.Counter = Instrumented ? Summary->Counters.size() : 0xffffffff;
+  ED.Counter = Instrumented ? Data.Counters.size() : 0xffffffff;
   if (Instrumented)
-    ++BranchCounters;
-  FuncDesc.Edges.emplace_back(ED);
+    ++Data.BranchCounters;
+  Data.FuncDesc.Edges.emplace_back(ED);
   return Instrumented;
 }
 
-void Instrumentation::createLeafNodeDescription(FunctionDescription &FuncDesc,
-                                                uint32_t Node) {
+void Instrumentation::createLeafNodeDescription(
+    FunctionInstrumentationData &Data, uint32_t Node) {
   InstrumentedNode IN;
   IN.Node = Node;
-  IN.Counter = Summary->Counters.size();
-  ++LeafNodeCounters;
-  FuncDesc.LeafNodes.emplace_back(IN);
+  IN.Counter = Data.Counters.size();
+  ++Data.LeafNodeCounters;
+  Data.FuncDesc.LeafNodes.emplace_back(IN);
 }
 
 InstructionListType
-Instrumentation::createInstrumentationSnippet(BinaryContext &BC, bool IsLeaf) {
+Instrumentation::createInstrumentationSnippet(BinaryContext &BC, bool IsLeaf,
+                                              FunctionInstrumentationData &Data) {
+  // Creating the label and building expressions referencing it modifies the
+  // shared MC context.
   auto L = BC.scopeLock();
   MCSymbol *Label;
   Label = BC.Ctx->createNamedTempSymbol("InstrEntry");
-  Summary->Counters.emplace_back(Label);
+  Data.Counters.emplace_back(Label);
   InstructionListType CounterInstrs;
-  BC.MIB->createInstrIncMemory(CounterInstrs, Label, &*BC.Ctx, IsLeaf);
+  BC.MIB->createInstrIncMemory(CounterInstrs, Label, &*BC.Ctx, IsLeaf,
+                               opts::InstrumentationCounterShards,
+                               opts::InstrumentationSampling
+                                   ? opts::InstrumentationSampling - 1
+                                   : 0);
   return CounterInstrs;
 }
 
@@ -193,34 +250,75 @@ BinaryBasicBlock::iterator insertInstructions(InstructionListType &Instrs,
   }
   return Iter;
 }
+
+/// Count the number of indirect call sites instrumentFunction() is going to
+/// instrument in \p Function. Used to pre-assign a contiguous range of global
+/// call site IDs to each function before the parallel phase starts, so the
+/// numbering baked into the rewritten call sequences does not depend on
+/// thread scheduling. Has to stay in sync with the conditions guarding
+/// instrumentIndirectTarget() in the instrumentFunction() loop below.
+uint32_t countIndCallSites(BinaryContext &BC, BinaryFunction &Function) {
+  if (!opts::InstrumentCalls)
+    return 0;
+  if (Function.hasUnknownControlFlow())
+    return 0;
+  if (BC.isMachO() && Function.hasName("___GLOBAL_init_65535/1"))
+    return 0;
+
+  uint32_t Count = 0;
+  for (BinaryBasicBlock &BB : Function) {
+    for (MCInst &Inst : BB) {
+      if (!BC.MIB->getOffset(Inst))
+        continue;
+      if (Function.getJumpTable(Inst))
+        continue;
+      if (!BC.MIB->isUnconditionalBranch(Inst) &&
+          ((!BC.MIB->isCall(Inst) && !BC.MIB->isConditionalBranch(Inst)) ||
+           BC.MIB->isUnsupportedBranch(Inst.getOpcode())))
+        continue;
+      const MCSymbol *Target = BC.MIB->getTargetSymbol(Inst);
+      if (Function.getBasicBlockForLabel(Target) ||
+          BC.getFunctionForSymbol(Target))
+        continue;
+      if (BC.MIB->isIndirectCall(Inst))
+        ++Count;
+    }
+  }
+  return Count;
+}
 } // namespace
 
 void Instrumentation::instrumentLeafNode(BinaryBasicBlock &BB,
                                          BinaryBasicBlock::iterator Iter,
                                          bool IsLeaf,
-                                         FunctionDescription &FuncDesc,
+                                         FunctionInstrumentationData &Data,
                                          uint32_t Node) {
-  createLeafNodeDescription(FuncDesc, Node);
+  createLeafNodeDescription(Data, Node);
   InstructionListType CounterInstrs = createInstrumentationSnippet(
-      BB.getFunction()->getBinaryContext(), IsLeaf);
+      BB.getFunction()->getBinaryContext(), IsLeaf, Data);
   insertInstructions(CounterInstrs, BB, Iter);
 }
 
-void Instrumentation::instrumentIndirectTarget(BinaryBasicBlock &BB,
-                                               BinaryBasicBlock::iterator &Iter,
-                                               BinaryFunction &FromFunction,
-                                               uint32_t From) {
-  auto L = FromFunction.getBinaryContext().scopeLock();
-  const size_t IndCallSiteID = Summary->IndCallDescriptions.size();
-  createIndCallDescription(FromFunction, From);
+void Instrumentation::instrumentIndirectTarget(
+    BinaryBasicBlock &BB, BinaryBasicBlock::iterator &Iter,
+    BinaryFunction &FromFunction, uint32_t From,
+    FunctionInstrumentationData &Data) {
+  const size_t IndCallSiteID =
+      Data.FirstIndCallSiteID + Data.IndCallDescriptions.size();
+  createIndCallDescription(Data, FromFunction, From);
 
   BinaryContext &BC = FromFunction.getBinaryContext();
   bool IsTailCall = BC.MIB->isTailCall(*Iter);
-  InstructionListType CounterInstrs = BC.MIB->createInstrumentedIndirectCall(
-      *Iter, IsTailCall,
-      IsTailCall ? IndTailCallHandlerExitBBFunction->getSymbol()
-                 : IndCallHandlerExitBBFunction->getSymbol(),
-      IndCallSiteID, &*BC.Ctx);
+  InstructionListType CounterInstrs;
+  {
+    // Building the rewritten call sequence modifies the shared MC context.
+    auto L = BC.scopeLock();
+    CounterInstrs = BC.MIB->createInstrumentedIndirectCall(
+        *Iter, IsTailCall,
+        IsTailCall ? IndTailCallHandlerExitBBFunction->getSymbol()
+                   : IndCallHandlerExitBBFunction->getSymbol(),
+        IndCallSiteID, &*BC.Ctx);
+  }
 
   Iter = BB.eraseInstruction(Iter);
   Iter = insertInstructions(CounterInstrs, BB, Iter);
@@ -232,23 +330,20 @@ bool Instrumentation::instrumentOneTarget(
     BinaryBasicBlock::iterator &Iter, BinaryFunction &FromFunction,
     BinaryBasicBlock &FromBB, uint32_t From, BinaryFunction &ToFunc,
     BinaryBasicBlock *TargetBB, uint32_t ToOffset, bool IsLeaf, bool IsInvoke,
-    FunctionDescription *FuncDesc, uint32_t FromNodeID, uint32_t ToNodeID) {
-  {
-    auto L = FromFunction.getBinaryContext().scopeLock();
-    bool Created = true;
-    if (!TargetBB)
-      Created = createCallDescription(*FuncDesc, FromFunction, From, FromNodeID,
-                                      ToFunc, ToOffset, IsInvoke);
-    else
-      Created = createEdgeDescription(*FuncDesc, FromFunction, From, FromNodeID,
-                                      ToFunc, ToOffset, ToNodeID,
-                                      /*Instrumented=*/true);
-    if (!Created)
-      return false;
-  }
+    FunctionInstrumentationData &Data, uint32_t FromNodeID, uint32_t ToNodeID) {
+  bool Created = true;
+  if (!TargetBB)
+    Created = createCallDescription(Data, FromFunction, From, FromNodeID,
+                                    ToFunc, ToOffset, IsInvoke);
+  else
+    Created = createEdgeDescription(Data, FromFunction, From, FromNodeID,
+                                    ToFunc, ToOffset, ToNodeID,
+                                    /*Instrumented=*/true);
+  if (!Created)
+    return false;
 
-  InstructionListType CounterInstrs =
-      createInstrumentationSnippet(FromFunction.getBinaryContext(), IsLeaf);
+  InstructionListType CounterInstrs = createInstrumentationSnippet(
+      FromFunction.getBinaryContext(), IsLeaf, Data);
 
   BinaryContext &BC = FromFunction.getBinaryContext();
   const MCInst &Inst = *Iter;
@@ -260,7 +355,7 @@ bool Instrumentation::instrumentOneTarget(
     return true;
   }
 
-  if (!TargetBB || !FuncDesc)
+  if (!TargetBB)
     return false;
 
   // Indirect branch, conditional branches or fall-throughs
@@ -296,12 +391,10 @@ void Instrumentation::instrumentFunction(BinaryFunction &Function,
   SplitWorklistTy SplitWorklist;
   SplitInstrsTy SplitInstrs;
 
-  FunctionDescription *FuncDesc = nullptr;
-  {
-    std::unique_lock<std::shared_timed_mutex> L(FDMutex);
-    Summary->FunctionDescriptions.emplace_back();
-    FuncDesc = &Summary->FunctionDescriptions.back();
-  }
+  auto DataIter = FuncData.find(&Function);
+  assert(DataIter != FuncData.end() && "no data pre-assigned for function");
+  FunctionInstrumentationData &Data = DataIter->second;
+  FunctionDescription *FuncDesc = &Data.FuncDesc;
 
   FuncDesc->Function = &Function;
   Function.disambiguateJumpTables(AllocId);
@@ -313,45 +406,82 @@ void Instrumentation::instrumentFunction(BinaryFunction &Function,
     BBToID[&*BBI] = Id++;
   }
   std::unordered_set<const BinaryBasicBlock *> VisitedSet;
-  // DFS to establish edges we will use for a spanning tree. Edges in the
-  // spanning tree can be instrumentation-free since their count can be
+  // Traversal to establish edges we will use for a spanning tree. Edges in
+  // the spanning tree can be instrumentation-free since their count can be
   // inferred by solving flow equations on a bottom-up traversal of the tree.
   // Exit basic blocks are always instrumented so we start the traversal with
-  // a minimum number of defined variables to make the equation solvable.
-  std::stack<std::pair<const BinaryBasicBlock *, BinaryBasicBlock *>> Stack;
+  // a minimum number of defined variables to make the equation solvable. The
+  // tree is grown greedily from the heaviest candidate edge so that edges in
+  // deep loops are adopted into the tree before colder edges reaching the
+  // same block, leaving the counter increments on the colder edges. Back
+  // edges can never join the tree regardless of weight: a loop header is
+  // necessarily visited before its latches, and every node takes a single
+  // tree parent, which the runtime count inference relies on.
+  struct CandidateEdge {
+    uint64_t Weight;
+    uint32_t Order;
+    const BinaryBasicBlock *Pred;
+    BinaryBasicBlock *BB;
+  };
+  auto CandidateCompare = [](const CandidateEdge &A, const CandidateEdge &B) {
+    return std::make_pair(A.Weight, A.Order) <
+           std::make_pair(B.Weight, B.Order);
+  };
+  std::priority_queue<CandidateEdge, std::vector<CandidateEdge>,
+                      decltype(CandidateCompare)>
+      Queue(CandidateCompare);
+  uint32_t Order = 0;
+
+  // Weight candidate tree edges by the edge counts when the input binary
+  // carries a profile, and by loop nesting depth otherwise. Ties are broken
+  // towards the most recently discovered edge, so an unweighted traversal
+  // degenerates to the plain DFS used before.
+  Function.calculateLoopInfo();
+  const BinaryLoopInfo &BLI = Function.getLoopInfo();
+  const bool HasProfile = Function.hasValidProfile();
+  auto edgeWeight = [&](BinaryBasicBlock &Pred,
+                        BinaryBasicBlock &Succ) -> uint64_t {
+    if (HasProfile) {
+      const uint64_t Count = Pred.getBranchInfo(Succ).Count;
+      return Count == BinaryBasicBlock::COUNT_NO_PROFILE ? 0 : Count;
+    }
+    return std::min(BLI.getLoopDepth(&Pred), BLI.getLoopDepth(&Succ));
+  };
+
   std::unordered_map<const BinaryBasicBlock *,
                      std::set<const BinaryBasicBlock *>>
       STOutSet;
   for (auto BBI = Function.layout_rbegin(); BBI != Function.layout_rend();
        ++BBI) {
     if ((*BBI)->isEntryPoint() || (*BBI)->isLandingPad()) {
-      Stack.push(std::make_pair(nullptr, *BBI));
+      Queue.push(CandidateEdge{0, Order++, nullptr, *BBI});
       if (opts::InstrumentCalls && (*BBI)->isEntryPoint()) {
         EntryNode E;
         E.Node = BBToID[&**BBI];
         E.Address = (*BBI)->getInputOffset();
         FuncDesc->EntryNodes.emplace_back(E);
-        createIndCallTargetDescription(Function, (*BBI)->getInputOffset());
+        createIndCallTargetDescription(Data, Function, (*BBI)->getInputOffset());
       }
     }
   }
 
-  // Modified version of BinaryFunction::dfs() to build a spanning tree
+  // Modified version of BinaryFunction::dfs() to build a maximum-weight
+  // spanning tree
   if (!opts::ConservativeInstrumentation) {
-    while (!Stack.empty()) {
-      BinaryBasicBlock *BB;
-      const BinaryBasicBlock *Pred;
-      std::tie(Pred, BB) = Stack.top();
-      Stack.pop();
+    while (!Queue.empty()) {
+      const CandidateEdge Candidate = Queue.top();
+      Queue.pop();
+      BinaryBasicBlock *BB = Candidate.BB;
       if (VisitedSet.find(BB) != VisitedSet.end())
         continue;
 
       VisitedSet.insert(BB);
-      if (Pred)
-        STOutSet[Pred].insert(BB);
+      if (Candidate.Pred)
+        STOutSet[Candidate.Pred].insert(BB);
 
       for (BinaryBasicBlock *SuccBB : BB->successors())
-        Stack.push(std::make_pair(BB, SuccBB));
+        Queue.push(CandidateEdge{edgeWeight(*BB, *SuccBB), Order++, BB,
+                                 SuccBB});
     }
   }
 
@@ -377,7 +507,7 @@ void Instrumentation::instrumentFunction(BinaryFunction &Function,
 
     for (auto I = BB.begin(); I != BB.end(); ++I) {
       const MCInst &Inst = *I;
-      if (!BC.MIB->hasAnnotation(Inst, "Offset"))
+      if (!BC.MIB->getOffset(Inst))
         continue;
 
       const bool IsJumpTable = Function.getJumpTable(Inst);
@@ -389,7 +519,7 @@ void Instrumentation::instrumentFunction(BinaryFunction &Function,
                BC.MIB->isUnsupportedBranch(Inst.getOpcode()))
         continue;
 
-      uint32_t FromOffset = BC.MIB->getAnnotationAs<uint32_t>(Inst, "Offset");
+      uint32_t FromOffset = *BC.MIB->getOffset(Inst);
       const MCSymbol *Target = BC.MIB->getTargetSymbol(Inst);
       BinaryBasicBlock *TargetBB = Function.getBasicBlockForLabel(Target);
       uint32_t ToOffset = TargetBB ? TargetBB->getInputOffset() : 0;
@@ -403,24 +533,22 @@ void Instrumentation::instrumentFunction(BinaryFunction &Function,
             ToOffset = ForeignBB->getInputOffset();
           instrumentOneTarget(SplitWorklist, SplitInstrs, I, Function, BB,
                               FromOffset, *TargetFunc, TargetBB, ToOffset,
-                              IsLeafFunction, IsInvokeBlock, FuncDesc,
-                              BBToID[&BB]);
+                              IsLeafFunction, IsInvokeBlock, Data, BBToID[&BB]);
         }
         continue;
       }
       if (TargetFunc) {
         // Do not instrument edges in the spanning tree
         if (STOutSet[&BB].find(TargetBB) != STOutSet[&BB].end()) {
-          auto L = BC.scopeLock();
-          createEdgeDescription(*FuncDesc, Function, FromOffset, BBToID[&BB],
+          createEdgeDescription(Data, Function, FromOffset, BBToID[&BB],
                                 Function, ToOffset, BBToID[TargetBB],
                                 /*Instrumented=*/false);
           continue;
         }
         instrumentOneTarget(SplitWorklist, SplitInstrs, I, Function, BB,
                             FromOffset, *TargetFunc, TargetBB, ToOffset,
-                            IsLeafFunction, IsInvokeBlock, FuncDesc,
-                            BBToID[&BB], BBToID[TargetBB]);
+                            IsLeafFunction, IsInvokeBlock, Data, BBToID[&BB],
+                            BBToID[TargetBB]);
         continue;
       }
 
@@ -428,16 +556,15 @@ void Instrumentation::instrumentFunction(BinaryFunction &Function,
         for (BinaryBasicBlock *&Succ : BB.successors()) {
           // Do not instrument edges in the spanning tree
           if (STOutSet[&BB].find(&*Succ) != STOutSet[&BB].end()) {
-            auto L = BC.scopeLock();
-            createEdgeDescription(*FuncDesc, Function, FromOffset, BBToID[&BB],
+            createEdgeDescription(Data, Function, FromOffset, BBToID[&BB],
                                   Function, Succ->getInputOffset(),
                                   BBToID[&*Succ], /*Instrumented=*/false);
             continue;
           }
-          instrumentOneTarget(
-              SplitWorklist, SplitInstrs, I, Function, BB, FromOffset, Function,
-              &*Succ, Succ->getInputOffset(), IsLeafFunction, IsInvokeBlock,
-              FuncDesc, BBToID[&BB], BBToID[&*Succ]);
+          instrumentOneTarget(SplitWorklist, SplitInstrs, I, Function, BB,
+                              FromOffset, Function, &*Succ,
+                              Succ->getInputOffset(), IsLeafFunction,
+                              IsInvokeBlock, Data, BBToID[&BB], BBToID[&*Succ]);
         }
         continue;
       }
@@ -446,7 +573,7 @@ void Instrumentation::instrumentFunction(BinaryFunction &Function,
       // or secondary entry points of known functions, so check it is indirect
       // to be sure.
       if (opts::InstrumentCalls && BC.MIB->isIndirectCall(*I))
-        instrumentIndirectTarget(BB, I, Function, FromOffset);
+        instrumentIndirectTarget(BB, I, Function, FromOffset, Data);
 
     } // End of instructions loop
 
@@ -465,21 +592,20 @@ void Instrumentation::instrumentFunction(BinaryFunction &Function,
       // if it was branching to the end of the function as a result of
       // __builtin_unreachable(), in which case it was deleted by fixBranches.
       // Ignore this case. FIXME: force fixBranches() to preserve the offset.
-      if (!BC.MIB->hasAnnotation(*LastInstr, "Offset"))
+      if (!BC.MIB->getOffset(*LastInstr))
         continue;
-      FromOffset = BC.MIB->getAnnotationAs<uint32_t>(*LastInstr, "Offset");
+      FromOffset = *BC.MIB->getOffset(*LastInstr);
 
       // Do not instrument edges in the spanning tree
       if (STOutSet[&BB].find(FTBB) != STOutSet[&BB].end()) {
-        auto L = BC.scopeLock();
-        createEdgeDescription(*FuncDesc, Function, FromOffset, BBToID[&BB],
+        createEdgeDescription(Data, Function, FromOffset, BBToID[&BB],
                               Function, FTBB->getInputOffset(), BBToID[FTBB],
                               /*Instrumented=*/false);
         continue;
       }
       instrumentOneTarget(SplitWorklist, SplitInstrs, I, Function, BB,
                           FromOffset, Function, FTBB, FTBB->getInputOffset(),
-                          IsLeafFunction, IsInvokeBlock, FuncDesc, BBToID[&BB],
+                          IsLeafFunction, IsInvokeBlock, Data, BBToID[&BB],
                           BBToID[FTBB]);
     }
   } // End of BBs loop
@@ -489,8 +615,7 @@ void Instrumentation::instrumentFunction(BinaryFunction &Function,
     for (auto BBI = Function.begin(), BBE = Function.end(); BBI != BBE; ++BBI) {
       BinaryBasicBlock &BB = *BBI;
       if (STOutSet[&BB].size() == 0)
-        instrumentLeafNode(BB, BB.begin(), IsLeafFunction, *FuncDesc,
-                           BBToID[&BB]);
+        instrumentLeafNode(BB, BB.begin(), IsLeafFunction, Data, BBToID[&BB]);
     }
   }
 
@@ -512,6 +637,19 @@ void Instrumentation::runOnFunctions(BinaryContext &BC) {
   if (!BC.isX86())
     return;
 
+  if (!isPowerOf2_32(opts::InstrumentationCounterShards)) {
+    llvm::errs() << "BOLT-ERROR: -instrumentation-counter-shards must be a "
+                    "power of two\n";
+    exit(1);
+  }
+
+  if (opts::InstrumentationSampling &&
+      !isPowerOf2_32(opts::InstrumentationSampling)) {
+    llvm::errs() << "BOLT-ERROR: -instrumentation-sampling must be a power of "
+                    "two\n";
+    exit(1);
+  }
+
   const unsigned Flags = BinarySection::getFlags(/*IsReadOnly=*/false,
                                                  /*IsText=*/false,
                                                  /*IsAllocatable=*/true);
@@ -534,6 +672,20 @@ void Instrumentation::runOnFunctions(BinaryContext &BC) {
             (opts::InstrumentHotOnly && !BF.getKnownExecutionCount()));
   };
 
+  // Pre-assign a contiguous range of indirect call site IDs to each function
+  // and create its data slot, so worker threads never have to agree on global
+  // numbering and the result is independent of their scheduling.
+  uint32_t NumIndCallSites = 0;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    BinaryFunction &BF = BFI.second;
+    if (SkipPredicate(BF))
+      continue;
+    FunctionInstrumentationData &Data = FuncData[&BF];
+    Data.FuncDesc.Function = nullptr;
+    Data.FirstIndCallSiteID = NumIndCallSites;
+    NumIndCallSites += countIndCallSites(BC, BF);
+  }
+
   ParallelUtilities::WorkFuncWithAllocTy WorkFun =
       [&](BinaryFunction &BF, MCPlusBuilder::AllocatorIdTy AllocatorId) {
         instrumentFunction(BF, AllocatorId);
@@ -541,7 +693,68 @@ void Instrumentation::runOnFunctions(BinaryContext &BC) {
 
   ParallelUtilities::runOnEachFunctionWithUniqueAllocId(
       BC, ParallelUtilities::SchedulingPolicy::SP_INST_QUADRATIC, WorkFun,
-      SkipPredicate, "instrumentation", /* ForceSequential=*/true);
+      SkipPredicate, "instrumentation");
+
+  // Merge the per-function data into the summary in function address order,
+  // rebasing local counter and string table indices, so the emitted tables
+  // and the counter section layout are byte-reproducible across runs.
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto DataIter = FuncData.find(&BFI.second);
+    if (DataIter == FuncData.end())
+      continue;
+    FunctionInstrumentationData &Data = DataIter->second;
+    // Skipped by instrumentFunction(), e.g. due to unknown control flow.
+    if (!Data.FuncDesc.Function)
+      continue;
+
+    DenseMap<uint32_t, uint32_t> StringOffsetMap;
+    for (const std::pair<const BinaryFunction *, uint32_t> &Entry :
+         Data.ReferencedNames)
+      StringOffsetMap[Entry.second] = getFunctionNameIndex(*Entry.first);
+
+    const uint32_t CounterBase = Summary->Counters.size();
+    auto rebaseCounter = [&](uint32_t &Counter) {
+      if (Counter != 0xffffffff)
+        Counter += CounterBase;
+    };
+    auto rebaseLoc = [&](LocDescription &Loc) {
+      Loc.FuncString = StringOffsetMap[Loc.FuncString];
+    };
+
+    for (CallDescription &CD : Data.FuncDesc.Calls) {
+      rebaseLoc(CD.FromLoc);
+      rebaseLoc(CD.ToLoc);
+      rebaseCounter(CD.Counter);
+    }
+    for (EdgeDescription &ED : Data.FuncDesc.Edges) {
+      rebaseLoc(ED.FromLoc);
+      rebaseLoc(ED.ToLoc);
+      rebaseCounter(ED.Counter);
+    }
+    for (InstrumentedNode &IN : Data.FuncDesc.LeafNodes)
+      rebaseCounter(IN.Counter);
+    for (IndCallDescription &ICD : Data.IndCallDescriptions)
+      rebaseLoc(ICD.FromLoc);
+    for (IndCallTargetDescription &ICD : Data.IndCallTargetDescriptions)
+      rebaseLoc(ICD.ToLoc);
+
+    assert(Summary->IndCallDescriptions.size() == Data.FirstIndCallSiteID &&
+           "indirect call site pre-count out of sync");
+    Summary->Counters.insert(Summary->Counters.end(), Data.Counters.begin(),
+                             Data.Counters.end());
+    Summary->IndCallDescriptions.insert(Summary->IndCallDescriptions.end(),
+                                        Data.IndCallDescriptions.begin(),
+                                        Data.IndCallDescriptions.end());
+    Summary->IndCallTargetDescriptions.insert(
+        Summary->IndCallTargetDescriptions.end(),
+        Data.IndCallTargetDescriptions.begin(),
+        Data.IndCallTargetDescriptions.end());
+    DirectCallCounters += Data.DirectCallCounters;
+    BranchCounters += Data.BranchCounters;
+    LeafNodeCounters += Data.LeafNodeCounters;
+    Summary->FunctionDescriptions.emplace_back(std::move(Data.FuncDesc));
+  }
+  FuncData.clear();
 
   if (BC.isMachO()) {
     if (BC.StartFunctionAddress) {
@@ -34,6 +34,13 @@ static cl::opt<bool> JTFootprintOnlyPIC(
              " off other transformations that increase code size"),
     cl::init(false), cl::ZeroOrMore, cl::cat(BoltOptCategory));
 
+static cl::opt<uint64_t> JTFootprintHotThreshold(
+    "jt-footprint-hot-threshold",
+    cl::desc("with jt-footprint-reduction, only shrink jump tables executed at "
+             "least this many times and align them to a cache line; colder "
+             "tables are left in place (0 = shrink all eligible tables)"),
+    cl::init(0), cl::ZeroOrMore, cl::Hidden, cl::cat(BoltOptCategory));
+
 } // namespace opts
 
 namespace llvm {
@@ -58,6 +65,17 @@ void JTFootprintReduction::checkOpportunities(BinaryFunction &Function,
         continue;
       }
 
+      // With tiered compression, leave cold tables untouched: shrinking them
+      // cannot pay for the longer jump sequence, and the existing emission
+      // already moves never-taken tables out of the hot rodata.
+      if (opts::JTFootprintHotThreshold &&
+          JumpTable->Count < opts::JTFootprintHotThreshold) {
+        BlacklistedJTs.insert(JumpTable);
+        ++IndJmpsDenied;
+        ++NumJTsColdTier;
+        continue;
+      }
+
       uint64_t Scale;
       // Try a standard indirect jump matcher
       std::unique_ptr<MCPlusBuilder::MCInstMatcher> IndJmpMatcher =
@@ -121,6 +139,10 @@ void JTFootprintReduction::checkOpportunities(BinaryFunction &Function,
       OptimizedScore += CurScore;
       if (JT->EntrySize == 8)
         BytesSaved += JT->getSize() >> 1;
+      for (const JumpTable::JumpInfo &JI : JT->Counts)
+        if (JI.Count > 0)
+          ++HotTierEntries;
+      TotalTierEntries += JT->Counts.size();
     }
   }
   TotalJTs += AllJTs.size();
@@ -228,6 +250,10 @@ void JTFootprintReduction::optimizeFunction(BinaryFunction &Function,
 
     if (tryOptimizeNonPIC(BC, BB, IndJmp, JTAddr, JumpTable, Info) ||
         tryOptimizePIC(BC, BB, IndJmp, JTAddr, JumpTable, Info)) {
+      // Align hot-tier tables to a cache line so their leading entries never
+      // straddle one in the dispatcher loop.
+      if (opts::JTFootprintHotThreshold)
+        JumpTable->OutputAlignment = 64;
       Modified.insert(&Function);
       continue;
     }
@@ -288,6 +314,14 @@ void JTFootprintReduction::runOnFunctions(BinaryContext &BC) {
          << " JTs discarded due to unsupported jump pattern.\n";
   outs() << "\t   " << NumJTsNoReg
          << " JTs discarded due to register unavailability.\n";
+  if (opts::JTFootprintHotThreshold) {
+    outs() << "\t   " << NumJTsColdTier
+           << " JTs left in place in the cold tier.\n";
+    if (TotalTierEntries)
+      outs() << format("\t   %.2lf%%",
+                       (HotTierEntries * 100.0 / TotalTierEntries))
+             << " of entries in shrunk tables are dynamically reached.\n";
+  }
   outs() << "\t   " << BytesSaved << " bytes saved.\n";
 }
 
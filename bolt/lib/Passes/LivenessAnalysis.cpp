@@ -8,6 +8,20 @@
 
 #include "bolt/Passes/LivenessAnalysis.h"
 
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+cl::opt<bool> CompactLiveness(
+    "compact-liveness",
+    cl::desc("keep only block-boundary liveness states and recompute states "
+             "inside a block on demand"),
+    cl::init(true), cl::Hidden, cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+} // namespace opts
+
 namespace llvm {
 namespace bolt {
 
@@ -11,7 +11,9 @@
 //===----------------------------------------------------------------------===//
 
 #include "bolt/Passes/LongJmp.h"
+#include "bolt/Core/ParallelUtilities.h"
 #include "llvm/Support/Alignment.h"
+#include "llvm/Support/ThreadPool.h"
 
 #define DEBUG_TYPE "longjmp"
 
@@ -297,19 +299,27 @@ void LongJmpPass::tentativeBBLayout(const BinaryFunction &Func) {
 uint64_t LongJmpPass::tentativeLayoutRelocColdPart(
     const BinaryContext &BC, std::vector<BinaryFunction *> &SortedFunctions,
     uint64_t DotAddress) {
-  for (BinaryFunction *Func : SortedFunctions) {
-    if (!Func->isSplit())
-      continue;
-    DotAddress = alignTo(DotAddress, BinaryFunction::MinAlign);
-    uint64_t Pad =
-        offsetToAlignment(DotAddress, llvm::Align(opts::AlignFunctions));
-    if (Pad <= opts::AlignFunctionsMaxBytes)
-      DotAddress += Pad;
-    ColdAddresses[Func] = DotAddress;
-    LLVM_DEBUG(dbgs() << Func->getPrintName() << " cold tentative: "
-                      << Twine::utohexstr(DotAddress) << "\n");
-    DotAddress += Func->estimateColdSize();
-    DotAddress += Func->estimateConstantIslandSize();
+  // Lay out cold fragments grouped by placement tier to match the output
+  // section order under region splitting: warm fragments land closest to
+  // the hot code. With region splitting disabled every fragment is in the
+  // cold tier and the grouping is a no-op.
+  for (const BinaryFunction::FragmentTier Tier :
+       {BinaryFunction::FT_WARM, BinaryFunction::FT_COLD,
+        BinaryFunction::FT_FROZEN}) {
+    for (BinaryFunction *Func : SortedFunctions) {
+      if (!Func->isSplit() || Func->getColdFragmentTier() != Tier)
+        continue;
+      DotAddress = alignTo(DotAddress, BinaryFunction::MinAlign);
+      uint64_t Pad =
+          offsetToAlignment(DotAddress, llvm::Align(opts::AlignFunctions));
+      if (Pad <= opts::AlignFunctionsMaxBytes)
+        DotAddress += Pad;
+      ColdAddresses[Func] = DotAddress;
+      LLVM_DEBUG(dbgs() << Func->getPrintName() << " cold tentative: "
+                        << Twine::utohexstr(DotAddress) << "\n");
+      DotAddress += Func->estimateColdSize();
+      DotAddress += Func->estimateConstantIslandSize();
+    }
   }
   return DotAddress;
 }
@@ -600,17 +610,95 @@ bool LongJmpPass::relax(BinaryFunction &Func) {
   return Modified;
 }
 
+bool LongJmpPass::stubNeedsRelaxation(const BinaryBasicBlock &StubBB) const {
+  const BinaryFunction &Func = *StubBB.getFunction();
+  const BinaryContext &BC = Func.getBinaryContext();
+  const int Bits = StubBits.lookup(&StubBB);
+  if (Bits == static_cast<int>(BC.AsmInfo->getCodePointerSize() * 8))
+    return false;
+
+  const int RangeShortJmp = BC.MIB->getShortJmpEncodingSize();
+  const int RangeSingleInstr = BC.MIB->getUncondBranchEncodingSize();
+  const uint64_t ShortJmpMask = ~((1ULL << RangeShortJmp) - 1);
+  const uint64_t SingleInstrMask = ~((1ULL << (RangeSingleInstr - 1)) - 1);
+
+  const MCSymbol *RealTargetSym = BC.MIB->getTargetSymbol(*StubBB.begin());
+  const BinaryBasicBlock *TgtBB = Func.getBasicBlockForLabel(RealTargetSym);
+  const uint64_t TgtAddress = getSymbolAddress(BC, RealTargetSym, TgtBB);
+  const uint64_t DotAddress = BBAddresses.lookup(&StubBB);
+  const uint64_t PCRelTgtAddress = DotAddress > TgtAddress
+                                       ? DotAddress - TgtAddress
+                                       : TgtAddress - DotAddress;
+  if (!(PCRelTgtAddress & SingleInstrMask))
+    return false;
+  if (!(PCRelTgtAddress & ShortJmpMask))
+    return Bits < RangeShortJmp;
+  return true;
+}
+
+bool LongJmpPass::needsRelaxation(const BinaryFunction &Func) const {
+  const BinaryContext &BC = Func.getBinaryContext();
+  constexpr int InsnSize = 4; // AArch64
+  const auto StubsIter = Stubs.find(&Func);
+  const std::set<const BinaryBasicBlock *> *FuncStubs =
+      StubsIter == Stubs.end() ? nullptr : &StubsIter->second;
+
+  for (const BinaryBasicBlock &BB : Func) {
+    if (FuncStubs && FuncStubs->count(&BB)) {
+      if (BB.isValid() && stubNeedsRelaxation(BB))
+        return true;
+      continue;
+    }
+
+    uint64_t DotAddress = BBAddresses.lookup(&BB);
+    for (const MCInst &Inst : BB) {
+      if (BC.MIB->isPseudo(Inst))
+        continue;
+      if (shouldInsertStub(BC, Inst) && needsStub(BB, Inst, DotAddress))
+        return true;
+      DotAddress += InsnSize;
+    }
+  }
+  return false;
+}
+
 void LongJmpPass::runOnFunctions(BinaryContext &BC) {
   outs() << "BOLT-INFO: Starting stub-insertion pass\n";
   std::vector<BinaryFunction *> Sorted = BC.getSortedFunctions();
   bool Modified;
   uint32_t Iterations = 0;
+  std::vector<uint8_t> NeedsRelaxation(Sorted.size());
   do {
     ++Iterations;
     Modified = false;
     tentativeLayout(BC, Sorted);
     updateStubGroups();
-    for (BinaryFunction *Func : Sorted) {
+
+    // Deciding whether a function still has out-of-range branches or
+    // undersized stubs only reads the tentative layout, so scan all functions
+    // in parallel and run the mutating relaxation serially on the flagged
+    // ones. Stub insertion changes function sizes, so the loop still iterates
+    // until the layout settles, but the converged round reduces to a single
+    // parallel verification sweep.
+    auto ScanChunk = [&](size_t Begin, size_t End) {
+      for (size_t I = Begin; I < End; ++I)
+        NeedsRelaxation[I] = needsRelaxation(*Sorted[I]);
+    };
+    if (opts::NoThreads) {
+      ScanChunk(0, Sorted.size());
+    } else {
+      ThreadPool &Pool = ParallelUtilities::getThreadPool();
+      const size_t ChunkSize = std::max<size_t>(
+          1, Sorted.size() / (opts::ThreadCount * opts::TaskCount));
+      for (size_t I = 0; I < Sorted.size(); I += ChunkSize)
+        Pool.async(ScanChunk, I, std::min(I + ChunkSize, Sorted.size()));
+      Pool.wait();
+    }
+
+    for (size_t I = 0, E = Sorted.size(); I != E; ++I) {
+      if (!NeedsRelaxation[I])
+        continue;
+      BinaryFunction *Func = Sorted[I];
       if (relax(*Func)) {
         // Don't ruin non-simple functions, they can't afford to have the layout
         // changed.
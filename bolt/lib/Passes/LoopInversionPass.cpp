@@ -24,6 +24,12 @@ static cl::opt<bool> LoopReorder(
     "loop-inversion-opt",
     cl::desc("reorder unconditional jump instructions in loops optimization"),
     cl::init(true), cl::cat(BoltCategory), cl::ReallyHidden);
+
+static cl::opt<bool> LoopRotation(
+    "loop-rotation-opt",
+    cl::desc("rotate innermost loops after block reordering so that the "
+             "hottest back edge becomes a fall-through"),
+    cl::init(true), cl::cat(BoltCategory), cl::ReallyHidden);
 } // namespace opts
 
 namespace llvm {
@@ -78,14 +84,132 @@ bool LoopInversionPass::runOnFunction(BinaryFunction &BF) {
   return IsChanged;
 }
 
+unsigned LoopInversionPass::rotateLoops(BinaryFunction &BF) {
+  if (BF.layout_size() < 3 || !BF.hasValidProfile())
+    return 0;
+
+  BF.calculateLoopInfo();
+  if (BF.getLoopInfo().empty())
+    return 0;
+
+  BF.updateLayoutIndices();
+  const BinaryFunction::BasicBlockOrderType Layout = BF.getLayout();
+
+  // Count of the edge from \p FromBB to \p ToBB, or zero if the edge does not
+  // exist or carries no profile.
+  auto edgeCount = [](BinaryBasicBlock *FromBB,
+                      BinaryBasicBlock *ToBB) -> uint64_t {
+    if (!ToBB || !FromBB->isSuccessor(ToBB))
+      return 0;
+    const uint64_t Count = FromBB->getBranchInfo(*ToBB).Count;
+    return Count == BinaryBasicBlock::COUNT_NO_PROFILE ? 0 : Count;
+  };
+
+  // Only innermost loops are rotated: a cyclic shift of an outer loop could
+  // split the blocks of a nested loop around the wrap point.
+  SmallVector<const BinaryLoop *, 8> Worklist;
+  for (auto I = BF.getLoopInfo().begin(), E = BF.getLoopInfo().end(); I != E;
+       ++I)
+    Worklist.push_back(*I);
+
+  unsigned NumRotated = 0;
+  while (!Worklist.empty()) {
+    const BinaryLoop *L = Worklist.pop_back_val();
+    if (!L->isInnermost()) {
+      for (const BinaryLoop *Inner : *L)
+        Worklist.push_back(Inner);
+      continue;
+    }
+
+    const unsigned NumBlocks = L->getNumBlocks();
+    if (NumBlocks < 2)
+      continue;
+
+    // The loop has to occupy a contiguous segment of the hot layout, and the
+    // function entry block has to stay first.
+    unsigned MinIndex = UINT_MAX;
+    unsigned MaxIndex = 0;
+    bool IsEligible = true;
+    for (BinaryBasicBlock *BB : L->blocks()) {
+      if (BB->isCold() || BB->getLayoutIndex() == 0) {
+        IsEligible = false;
+        break;
+      }
+      MinIndex = std::min(MinIndex, BB->getLayoutIndex());
+      MaxIndex = std::max(MaxIndex, BB->getLayoutIndex());
+    }
+    if (!IsEligible || MaxIndex - MinIndex + 1 != NumBlocks)
+      continue;
+
+    const ArrayRef<BinaryBasicBlock *> Segment(&Layout[MinIndex], NumBlocks);
+    BinaryBasicBlock *const Prev = Layout[MinIndex - 1];
+    BinaryBasicBlock *const Next =
+        MaxIndex + 1 < Layout.size() ? Layout[MaxIndex + 1] : nullptr;
+
+    // Weight of each cyclic fall-through candidate: W[I] is the count of the
+    // edge from Segment[I] to its cyclic successor.
+    SmallVector<uint64_t, 8> W(NumBlocks);
+    uint64_t TotalW = 0;
+    for (unsigned I = 0; I < NumBlocks; ++I) {
+      W[I] = edgeCount(Segment[I], Segment[(I + 1) % NumBlocks]);
+      TotalW += W[I];
+    }
+
+    // Score the rotation that makes Segment[R] the new first block: every
+    // cyclic edge except the one wrapping around the segment end can fall
+    // through, plus the entry and exit edges of the new boundary blocks.
+    auto score = [&](unsigned R) {
+      const unsigned Wrap = (R + NumBlocks - 1) % NumBlocks;
+      return TotalW - W[Wrap] + edgeCount(Prev, Segment[R]) +
+             edgeCount(Segment[Wrap], Next);
+    };
+
+    unsigned BestR = 0;
+    uint64_t BestScore = score(0);
+    for (unsigned R = 1; R < NumBlocks; ++R) {
+      const uint64_t Score = score(R);
+      if (Score > BestScore) {
+        BestScore = Score;
+        BestR = R;
+      }
+    }
+    if (BestR == 0)
+      continue;
+
+    for (unsigned I = 0; I < NumBlocks; ++I)
+      Segment[(BestR + I) % NumBlocks]->setLayoutIndex(MinIndex + I);
+    ++NumRotated;
+  }
+
+  if (NumRotated) {
+    BinaryFunction::BasicBlockOrderType NewOrder = BF.getLayout();
+    std::sort(NewOrder.begin(), NewOrder.end(),
+              [&](BinaryBasicBlock *BB1, BinaryBasicBlock *BB2) {
+                return BB1->getLayoutIndex() < BB2->getLayoutIndex();
+              });
+    BF.updateBasicBlockLayout(NewOrder);
+  }
+
+  return NumRotated;
+}
+
 void LoopInversionPass::runOnFunctions(BinaryContext &BC) {
   std::atomic<uint64_t> ModifiedFuncCount{0};
+  std::atomic<uint64_t> RotatedLoopCount{0};
   if (opts::ReorderBlocks == ReorderBasicBlocks::LT_NONE ||
-      opts::LoopReorder == false)
+      (opts::LoopReorder == false && opts::LoopRotation == false))
     return;
 
   ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
-    if (runOnFunction(BF))
+    bool IsChanged = false;
+    if (opts::LoopReorder)
+      IsChanged |= runOnFunction(BF);
+    if (opts::LoopRotation) {
+      const unsigned NumRotated = rotateLoops(BF);
+      RotatedLoopCount += NumRotated;
+      IsChanged |= NumRotated != 0;
+    }
+    if (IsChanged)
       ++ModifiedFuncCount;
   };
 
@@ -99,6 +223,10 @@ void LoopInversionPass::runOnFunctions(BinaryContext &BC) {
 
   outs() << "BOLT-INFO: " << ModifiedFuncCount
          << " Functions were reordered by LoopInversionPass\n";
+  if (opts::LoopRotation && RotatedLoopCount)
+    outs() << "BOLT-INFO: " << RotatedLoopCount
+           << " innermost loops were rotated to make their back edges fall "
+              "through\n";
 }
 
 } // end namespace bolt
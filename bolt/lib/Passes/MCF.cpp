@@ -12,6 +12,7 @@
 
 #include "bolt/Passes/MCF.h"
 #include "bolt/Core/BinaryFunction.h"
+#include "bolt/Core/ParallelUtilities.h"
 #include "bolt/Passes/DataflowInfoManager.h"
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/Support/CommandLine.h"
@@ -456,9 +457,35 @@ void equalizeBBCounts(BinaryFunction &BF) {
   }
 }
 
+/// Check whether the profile of \p BF already obeys the flow invariant
+/// maintained in LBR mode: for every block, the sum of incoming edge counts
+/// covers the block execution count. Inference exists to establish this
+/// invariant, so such functions have nothing left to infer. In practice
+/// this fires for functions that collected no positive counts at all, since
+/// freshly attached sample profiles carry zero edge counts.
+bool isFlowConsistent(BinaryFunction &BF) {
+  for (BinaryBasicBlock &BB : BF) {
+    if (BB.pred_size() == 0)
+      continue;
+
+    uint64_t TotalPredsEWeight = 0;
+    for (BinaryBasicBlock *Pred : BB.predecessors())
+      TotalPredsEWeight += Pred->getBranchInfo(BB).Count;
+
+    if (TotalPredsEWeight < BB.getExecutionCount())
+      return false;
+  }
+  return true;
+}
+
 } // end anonymous namespace
 
 void estimateEdgeCounts(BinaryFunction &BF) {
+  // The iterative and equalizing modes adjust counts even when the flow
+  // equations hold, so only take the early exit for the default heuristic.
+  if (!opts::IterativeGuess && !opts::EqualizeBBCounts && isFlowConsistent(BF))
+    return;
+
   EdgeWeightMap PredEdgeWeights;
   EdgeWeightMap SuccEdgeWeights;
   if (!opts::IterativeGuess) {
@@ -478,6 +505,21 @@ void estimateEdgeCounts(BinaryFunction &BF) {
   recalculateBBCounts(BF, /*AllEdges=*/false);
 }
 
+void estimateEdgeCounts(
+    BinaryContext &BC,
+    std::function<bool(const BinaryFunction &BF)> SkipFunction) {
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
+    estimateEdgeCounts(BF);
+  };
+
+  // equalizeBBCounts runs dataflow analyses that create instruction
+  // annotations, which is not thread-safe under the shared allocator.
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_BB_QUADRATIC, WorkFun,
+      SkipFunction, "EstimateEdgeCounts",
+      /*ForceSequential=*/opts::EqualizeBBCounts);
+}
+
 void solveMCF(BinaryFunction &BF, MCFCostFunction CostFunction) {
   llvm_unreachable("not implemented");
 }
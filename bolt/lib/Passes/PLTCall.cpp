@@ -12,7 +12,10 @@
 //===----------------------------------------------------------------------===//
 
 #include "bolt/Passes/PLTCall.h"
+#include "bolt/Core/ParallelUtilities.h"
+#include "bolt/Utils/NameResolver.h"
 #include "llvm/Support/CommandLine.h"
+#include <atomic>
 
 #define DEBUG_TYPE "bolt-plt"
 
@@ -38,6 +41,15 @@ PLT("plt",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+PLTDirectCalls("plt-use-direct-calls",
+  cl::desc("convert PLT calls into direct calls when the callee is also "
+           "defined in the binary (breaks symbol interposition)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 }
 
 namespace llvm {
@@ -47,42 +59,114 @@ void PLTCall::runOnFunctions(BinaryContext &BC) {
   if (opts::PLT == OT_NONE)
     return;
 
-  uint64_t NumCallsOptimized = 0;
-  for (auto &It : BC.getBinaryFunctions()) {
-    BinaryFunction &Function = It.second;
-    if (!shouldOptimize(Function))
-      continue;
+  /// Rewrite targets of a single PLT entry.
+  struct PLTTarget {
+    /// GOT slot the call can go through without the PLT hop.
+    const MCSymbol *GOTSymbol{nullptr};
+    /// Definition of the callee inside the binary, if any.
+    const MCSymbol *LocalSymbol{nullptr};
+  };
 
-    if (opts::PLT == OT_HOT &&
-        Function.getExecutionCount() == BinaryFunction::COUNT_NO_PROFILE)
+  // Index the PLT once up front instead of consulting isPLTFunction() for
+  // every callsite.
+  DenseMap<const MCSymbol *, PLTTarget> PLTTargets;
+  for (auto &It : BC.getBinaryFunctions()) {
+    BinaryFunction &BF = It.second;
+    if (!BF.isPLTFunction())
       continue;
 
-    for (BinaryBasicBlock *BB : Function.layout()) {
-      if (opts::PLT == OT_HOT && !BB->getKnownExecutionCount())
-        continue;
+    PLTTarget Target;
+    Target.GOTSymbol = BF.getPLTSymbol();
 
-      for (MCInst &Instr : *BB) {
-        if (!BC.MIB->isCall(Instr))
-          continue;
-        const MCSymbol *CallSymbol = BC.MIB->getTargetSymbol(Instr);
-        if (!CallSymbol)
+    // A call through the PLT can be turned into a direct call when the
+    // callee is defined in the binary itself. Note that the target DSO has
+    // to be known to be the binary at run time: interposing the symbol with
+    // LD_PRELOAD would have no effect on the rewritten calls.
+    if (opts::PLTDirectCalls) {
+      for (StringRef Name : BF.getNames()) {
+        StringRef BaseName = NameResolver::restore(Name);
+        if (!BaseName.consume_back("@PLT"))
           continue;
-        const BinaryFunction *CalleeBF = BC.getFunctionForSymbol(CallSymbol);
-        if (!CalleeBF || !CalleeBF->isPLTFunction())
-          continue;
-        BC.MIB->convertCallToIndirectCall(Instr, CalleeBF->getPLTSymbol(),
-                                          BC.Ctx.get());
-        BC.MIB->addAnnotation(Instr, "PLTCall", true);
-        ++NumCallsOptimized;
+        if (const BinaryData *BD = BC.getBinaryDataByName(BaseName)) {
+          const BinaryFunction *Callee =
+              BC.getFunctionForSymbol(BD->getSymbol());
+          if (Callee && !Callee->isPLTFunction() && !Callee->isIgnored())
+            Target.LocalSymbol = Callee->getSymbol();
+        }
+        break;
       }
     }
+
+    for (MCSymbol *Symbol : BF.getSymbols())
+      PLTTargets[Symbol] = Target;
   }
 
+  if (PLTTargets.empty())
+    return;
+
+  std::atomic<uint64_t> NumCallsOptimized{0};
+  std::atomic<uint64_t> NumDirectCalls{0};
+
+  ParallelUtilities::WorkFuncWithAllocTy WorkFun =
+      [&](BinaryFunction &Function, MCPlusBuilder::AllocatorIdTy AllocId) {
+        uint64_t FuncOptimized = 0;
+        uint64_t FuncDirect = 0;
+        for (BinaryBasicBlock *BB : Function.layout()) {
+          if (opts::PLT == OT_HOT && !BB->getKnownExecutionCount())
+            continue;
+
+          for (MCInst &Instr : *BB) {
+            if (!BC.MIB->isCall(Instr))
+              continue;
+            const MCSymbol *CallSymbol = BC.MIB->getTargetSymbol(Instr);
+            if (!CallSymbol)
+              continue;
+            auto TargetItr = PLTTargets.find(CallSymbol);
+            if (TargetItr == PLTTargets.end())
+              continue;
+            const PLTTarget &Target = TargetItr->second;
+            // Building the new target expression modifies the shared MC
+            // context.
+            auto L = BC.scopeLock();
+            if (Target.LocalSymbol) {
+              BC.MIB->replaceBranchTarget(Instr, Target.LocalSymbol,
+                                          BC.Ctx.get());
+              ++FuncDirect;
+            } else {
+              BC.MIB->convertCallToIndirectCall(Instr, Target.GOTSymbol,
+                                                BC.Ctx.get());
+              L.unlock();
+              BC.MIB->addAnnotation(Instr, "PLTCall", true, AllocId);
+              ++FuncOptimized;
+            }
+          }
+        }
+        NumCallsOptimized += FuncOptimized;
+        NumDirectCalls += FuncDirect;
+      };
+
+  ParallelUtilities::PredicateTy SkipFunc =
+      [&](const BinaryFunction &Function) {
+        if (!shouldOptimize(Function))
+          return true;
+        return opts::PLT == OT_HOT &&
+               Function.getExecutionCount() == BinaryFunction::COUNT_NO_PROFILE;
+      };
+
+  ParallelUtilities::runOnEachFunctionWithUniqueAllocId(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+      SkipFunc, "PLTCall");
+
   if (NumCallsOptimized) {
+    // Calls no longer go through the PLT, so the lazy binding fallback is
+    // gone and all GOT slots have to be resolved at load time.
     BC.RequiresZNow = true;
     outs() << "BOLT-INFO: " << NumCallsOptimized
            << " PLT calls in the binary were optimized.\n";
   }
+  if (NumDirectCalls)
+    outs() << "BOLT-INFO: " << NumDirectCalls
+           << " PLT calls were converted to direct calls.\n";
 }
 
 } // namespace bolt
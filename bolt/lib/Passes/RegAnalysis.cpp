@@ -62,6 +62,13 @@ RegAnalysis::RegAnalysis(BinaryContext &BC,
     return Updated;
   });
 
+  // If a function inside a call graph cycle exhausts its revisit budget,
+  // assume it clobbers and uses every register.
+  CGWalker.registerFallback([&](BinaryFunction *Func) {
+    RegsKilledMap[Func] = BitVector(BC.MRI->getNumRegs(), true);
+    RegsGenMap[Func] = BitVector(BC.MRI->getNumRegs(), true);
+  });
+
   CGWalker.walk();
 
   if (opts::Verbosity == 0) {
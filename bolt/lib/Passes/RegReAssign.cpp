@@ -12,6 +12,7 @@
 
 #include "bolt/Passes/RegReAssign.h"
 #include "bolt/Core/MCPlus.h"
+#include "bolt/Core/ParallelUtilities.h"
 #include "bolt/Passes/BinaryFunctionCallGraph.h"
 #include "bolt/Passes/DataflowAnalysis.h"
 #include "bolt/Passes/DataflowInfoManager.h"
@@ -139,10 +140,12 @@ void RegReAssign::swap(BinaryFunction &Function, MCPhysReg A, MCPhysReg B) {
   }
 }
 
-void RegReAssign::rankRegisters(BinaryFunction &Function) {
+void RegReAssign::rankRegisters(BinaryFunction &Function,
+                                std::vector<int64_t> &RegScore,
+                                std::vector<size_t> &RankedRegs) {
   BinaryContext &BC = Function.getBinaryContext();
-  std::fill(RegScore.begin(), RegScore.end(), 0);
-  std::fill(RankedRegs.begin(), RankedRegs.end(), 0);
+  RegScore.assign(BC.MRI->getNumRegs(), 0);
+  RankedRegs.assign(BC.MRI->getNumRegs(), 0);
 
   for (BinaryBasicBlock &BB : Function) {
     for (MCInst &Inst : BB) {
@@ -217,9 +220,12 @@ void RegReAssign::rankRegisters(BinaryFunction &Function) {
   });
 }
 
-void RegReAssign::aggressivePassOverFunction(BinaryFunction &Function) {
+void RegReAssign::aggressivePassOverFunction(
+    BinaryFunction &Function, MCPlusBuilder::AllocatorIdTy AllocId) {
   BinaryContext &BC = Function.getBinaryContext();
-  rankRegisters(Function);
+  std::vector<int64_t> RegScore;
+  std::vector<size_t> RankedRegs;
+  rankRegisters(Function, RegScore, RankedRegs);
 
   // Bail early if our registers are all black listed, before running expensive
   // analysis passes
@@ -253,7 +259,7 @@ void RegReAssign::aggressivePassOverFunction(BinaryFunction &Function) {
     return;
 
   // -- expensive pass -- determine all regs alive during func start
-  DataflowInfoManager Info(Function, RA.get(), nullptr);
+  DataflowInfoManager Info(Function, RA.get(), nullptr, AllocId);
   BitVector AliveAtStart = *Info.getLivenessAnalysis().getStateAt(
       ProgramPoint::getFirstPointAt(*Function.begin()));
   for (BinaryBasicBlock &BB : Function)
@@ -312,7 +318,10 @@ void RegReAssign::aggressivePassOverFunction(BinaryFunction &Function) {
     LLVM_DEBUG(dbgs() << "\n ** Swapping " << BC.MRI->getName(ClassicReg)
                       << " with " << BC.MRI->getName(ExtReg) << "\n\n");
     swap(Function, ClassicReg, ExtReg);
-    FuncsChanged.insert(&Function);
+    {
+      std::lock_guard<std::mutex> Lock(FuncsChangedMutex);
+      FuncsChanged.insert(&Function);
+    }
     ++Begin;
     if (Begin == End)
       break;
@@ -322,7 +331,9 @@ void RegReAssign::aggressivePassOverFunction(BinaryFunction &Function) {
 
 bool RegReAssign::conservativePassOverFunction(BinaryFunction &Function) {
   BinaryContext &BC = Function.getBinaryContext();
-  rankRegisters(Function);
+  std::vector<int64_t> RegScore;
+  std::vector<size_t> RankedRegs;
+  rankRegisters(Function, RegScore, RankedRegs);
 
   // Try swapping R12, R13, R14 or R15 with RBX (we work with all callee-saved
   // regs except RBP)
@@ -353,7 +364,10 @@ bool RegReAssign::conservativePassOverFunction(BinaryFunction &Function) {
   LLVM_DEBUG(dbgs() << "\n ** Swapping " << BC.MRI->getName(RBX) << " with "
                     << BC.MRI->getName(Candidate) << "\n\n");
   swap(Function, RBX, Candidate);
-  FuncsChanged.insert(&Function);
+  {
+    std::lock_guard<std::mutex> Lock(FuncsChangedMutex);
+    FuncsChanged.insert(&Function);
+  }
   return true;
 }
 
@@ -402,31 +416,40 @@ void RegReAssign::setupConservativePass(
 }
 
 void RegReAssign::runOnFunctions(BinaryContext &BC) {
-  RegScore = std::vector<int64_t>(BC.MRI->getNumRegs(), 0);
-  RankedRegs = std::vector<size_t>(BC.MRI->getNumRegs(), 0);
-
   if (opts::AggressiveReAssign)
     setupAggressivePass(BC, BC.getBinaryFunctions());
   else
     setupConservativePass(BC, BC.getBinaryFunctions());
 
-  for (auto &I : BC.getBinaryFunctions()) {
-    BinaryFunction &Function = I.second;
-
-    if (!Function.isSimple() || Function.isIgnored())
-      continue;
-
-    LLVM_DEBUG(dbgs() << "====================================\n");
-    LLVM_DEBUG(dbgs() << " - " << Function.getPrintName() << "\n");
-    if (!conservativePassOverFunction(Function) && opts::AggressiveReAssign) {
-      aggressivePassOverFunction(Function);
-      LLVM_DEBUG({
-        if (FuncsChanged.count(&Function))
-          dbgs() << "Aggressive pass successful on " << Function.getPrintName()
-                 << "\n";
-      });
-    }
-  }
+  // Register scores are weighted by block execution counts and each function
+  // is rewritten independently, so candidate swaps are evaluated in parallel
+  // with per-function scratch state. RegAnalysis and the call graph are
+  // built once up front and only read by the workers.
+  ParallelUtilities::PredicateTy SkipPredicate = [](const BinaryFunction &BF) {
+    return !BF.isSimple() || BF.isIgnored();
+  };
+
+  ParallelUtilities::WorkFuncWithAllocTy WorkFun =
+      [&](BinaryFunction &Function, MCPlusBuilder::AllocatorIdTy AllocId) {
+        LLVM_DEBUG(dbgs() << "====================================\n");
+        LLVM_DEBUG(dbgs() << " - " << Function.getPrintName() << "\n");
+        if (!conservativePassOverFunction(Function) &&
+            opts::AggressiveReAssign) {
+          aggressivePassOverFunction(Function, AllocId);
+          LLVM_DEBUG({
+            if (FuncsChanged.count(&Function))
+              dbgs() << "Aggressive pass successful on "
+                     << Function.getPrintName() << "\n";
+          });
+        }
+      };
+
+  ParallelUtilities::runOnEachFunctionWithUniqueAllocId(
+      BC,
+      opts::AggressiveReAssign
+          ? ParallelUtilities::SchedulingPolicy::SP_INST_QUADRATIC
+          : ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR,
+      WorkFun, SkipPredicate, "regreassign");
 
   if (FuncsChanged.empty()) {
     outs() << "BOLT-INFO: Reg Reassignment Pass: no changes were made.\n";
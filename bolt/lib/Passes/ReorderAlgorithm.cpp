@@ -53,6 +53,17 @@ RandomSeed("bolt-seed",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+cl::opt<unsigned>
+MispredictWeight("mispredict-weight",
+  cl::desc("extra weight given to each recorded misprediction of a branch "
+           "when reordering basic blocks, on top of its execution count. "
+           "Branches the predictor handles poorly then become fall-throughs "
+           "first. 0 (default) ranks branches by execution count alone"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 } // namespace opts
 
 namespace {
@@ -71,6 +82,17 @@ template <typename A, typename B> struct HashPair {
   }
 };
 
+/// Return the layout weight of a branch: its execution count, optionally
+/// biased by the measured misprediction count so the clustering converts the
+/// costliest branches into fall-throughs, not just the most frequent ones.
+uint64_t branchLayoutWeight(const BinaryBasicBlock::BinaryBranchInfo &BI) {
+  // Inferred fall-through edges carry no misprediction measurement.
+  if (!opts::MispredictWeight ||
+      BI.MispredictedCount == BinaryBasicBlock::COUNT_INFERRED)
+    return BI.Count;
+  return BI.Count + (uint64_t)opts::MispredictWeight * BI.MispredictedCount;
+}
+
 } // namespace
 
 void ClusterAlgorithm::computeClusterAverageFrequency(const BinaryContext &BC) {
@@ -159,7 +181,7 @@ void GreedyClusterAlgorithm::clusterBasicBlocks(const BinaryFunction &BF,
     for (BinaryBasicBlock *&I : BB->successors()) {
       assert(BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE &&
              "attempted reordering blocks of function with no profile data");
-      Queue.emplace_back(EdgeTy(BB, I, BI->Count));
+      Queue.emplace_back(EdgeTy(BB, I, branchLayoutWeight(*BI)));
       ++BI;
     }
   }
@@ -285,7 +307,7 @@ int64_t MinBranchGreedyClusterAlgorithm::calculateWeight(
     // Ignore edges with same source and destination, edges that target the
     // entry block as well as the edge E itself.
     if (SuccBB != SrcBB && SuccBB != *BF.layout_begin() && SuccBB != DstBB)
-      W -= (int64_t)BI->Count;
+      W -= (int64_t)branchLayoutWeight(*BI);
     ++BI;
   }
 
@@ -307,7 +329,7 @@ int64_t MinBranchGreedyClusterAlgorithm::calculateWeight(
            "attempted reordering blocks of function with no profile data");
     assert(BI->Count <= std::numeric_limits<int64_t>::max() &&
            "overflow detected");
-    W -= (int64_t)BI->Count;
+    W -= (int64_t)branchLayoutWeight(*BI);
   }
 
   return W;
@@ -16,7 +16,9 @@
 // - estimate temporal locality by looking at CFG?
 
 #include "bolt/Passes/ReorderData.h"
+#include "bolt/Core/ParallelUtilities.h"
 #include <algorithm>
+#include <mutex>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "reorder-data"
@@ -27,6 +29,7 @@ using namespace bolt;
 namespace opts {
 extern cl::OptionCategory BoltCategory;
 extern cl::OptionCategory BoltOptCategory;
+extern cl::opt<bool> HugifyData;
 extern cl::opt<JumpTableSupportLevel> JumpTables;
 
 static cl::opt<bool>
@@ -45,7 +48,8 @@ ReorderData("reorder-data",
 
 enum ReorderAlgo : char {
   REORDER_COUNT         = 0,
-  REORDER_FUNCS         = 1
+  REORDER_FUNCS         = 1,
+  REORDER_LINES         = 2
 };
 
 static cl::opt<ReorderAlgo>
@@ -58,7 +62,10 @@ ReorderAlgorithm("reorder-data-algo",
       "sort hot data by read counts"),
     clEnumValN(REORDER_FUNCS,
       "funcs",
-      "sort hot data by hot function usage and count")),
+      "sort hot data by hot function usage and count"),
+    clEnumValN(REORDER_LINES,
+      "lines",
+      "pack data used by the same hot functions into shared cache lines")),
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
@@ -107,9 +114,37 @@ namespace bolt {
 namespace {
 
 static constexpr uint16_t MinAlignment = 16;
+static constexpr uint16_t CacheLineSize = 64;
 
 bool isSupported(const BinarySection &BS) { return BS.isData() && !BS.isTLS(); }
 
+/// Collect all data objects accessed by \p BF according to the memory
+/// profile. When \p OnlyHot is set, accesses from cold blocks are ignored.
+std::set<BinaryData *> dataUses(BinaryContext &BC, const BinaryFunction &BF,
+                                bool OnlyHot) {
+  std::set<BinaryData *> Uses;
+  for (const BinaryBasicBlock &BB : BF) {
+    if (OnlyHot && BB.isCold())
+      continue;
+
+    for (const MCInst &Inst : BB) {
+      auto ErrorOrMemAccesssProfile =
+          BC.MIB->tryGetAnnotationAs<MemoryAccessProfile>(
+              Inst, "MemoryAccessProfile");
+      if (!ErrorOrMemAccesssProfile)
+        continue;
+
+      const MemoryAccessProfile &MemAccessProfile =
+          ErrorOrMemAccesssProfile.get();
+      for (const AddressAccess &AccessInfo :
+           MemAccessProfile.AddressAccessInfo)
+        if (AccessInfo.MemoryObject)
+          Uses.insert(AccessInfo.MemoryObject);
+    }
+  }
+  return Uses;
+}
+
 bool filterSymbol(const BinaryData *BD) {
   if (!BD->isAtomic() || BD->isJumpTable() || !BD->isMoveable())
     return false;
@@ -188,36 +223,57 @@ void ReorderData::assignMemData(BinaryContext &BC) {
   StringMap<uint64_t> Counts;
   StringMap<uint64_t> JumpTableCounts;
   uint64_t TotalCount = 0;
-  for (auto &BFI : BC.getBinaryFunctions()) {
-    const BinaryFunction &BF = BFI.second;
-    if (!BF.hasMemoryProfile())
-      continue;
-
-    for (const BinaryBasicBlock &BB : BF) {
-      for (const MCInst &Inst : BB) {
-        auto ErrorOrMemAccesssProfile =
-            BC.MIB->tryGetAnnotationAs<MemoryAccessProfile>(
-                Inst, "MemoryAccessProfile");
-        if (!ErrorOrMemAccesssProfile)
-          continue;
-
-        const MemoryAccessProfile &MemAccessProfile =
-            ErrorOrMemAccesssProfile.get();
-        for (const AddressAccess &AccessInfo :
-             MemAccessProfile.AddressAccessInfo) {
-          if (BinaryData *BD = AccessInfo.MemoryObject) {
-            BinaryDataCounts[BD->getAtomicRoot()] += AccessInfo.Count;
-            Counts[BD->getSectionName()] += AccessInfo.Count;
-            if (BD->getAtomicRoot()->isJumpTable())
-              JumpTableCounts[BD->getSectionName()] += AccessInfo.Count;
-          } else {
-            Counts["Heap/stack"] += AccessInfo.Count;
+  std::mutex AssignMutex;
+
+  // Scanning the annotations dominates the run time, so tally each function
+  // locally in parallel and only merge the small per-function maps under the
+  // lock.
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR,
+      [&](BinaryFunction &BF) {
+        std::unordered_map<BinaryData *, uint64_t> LocalDataCounts;
+        StringMap<uint64_t> LocalCounts;
+        StringMap<uint64_t> LocalJumpTableCounts;
+        uint64_t LocalTotalCount = 0;
+
+        for (const BinaryBasicBlock &BB : BF) {
+          for (const MCInst &Inst : BB) {
+            auto ErrorOrMemAccesssProfile =
+                BC.MIB->tryGetAnnotationAs<MemoryAccessProfile>(
+                    Inst, "MemoryAccessProfile");
+            if (!ErrorOrMemAccesssProfile)
+              continue;
+
+            const MemoryAccessProfile &MemAccessProfile =
+                ErrorOrMemAccesssProfile.get();
+            for (const AddressAccess &AccessInfo :
+                 MemAccessProfile.AddressAccessInfo) {
+              if (BinaryData *BD = AccessInfo.MemoryObject) {
+                LocalDataCounts[BD->getAtomicRoot()] += AccessInfo.Count;
+                LocalCounts[BD->getSectionName()] += AccessInfo.Count;
+                if (BD->getAtomicRoot()->isJumpTable())
+                  LocalJumpTableCounts[BD->getSectionName()] +=
+                      AccessInfo.Count;
+              } else {
+                LocalCounts["Heap/stack"] += AccessInfo.Count;
+              }
+              LocalTotalCount += AccessInfo.Count;
+            }
           }
-          TotalCount += AccessInfo.Count;
         }
-      }
-    }
-  }
+
+        std::lock_guard<std::mutex> Lock(AssignMutex);
+        for (const std::pair<BinaryData *const, uint64_t> &Entry :
+             LocalDataCounts)
+          BinaryDataCounts[Entry.first] += Entry.second;
+        for (const StringMapEntry<uint64_t> &Entry : LocalCounts)
+          Counts[Entry.first()] += Entry.second;
+        for (const StringMapEntry<uint64_t> &Entry : LocalJumpTableCounts)
+          JumpTableCounts[Entry.first()] += Entry.second;
+        TotalCount += LocalTotalCount;
+      },
+      [](const BinaryFunction &BF) { return !BF.hasMemoryProfile(); },
+      "assignMemData");
 
   if (!Counts.empty()) {
     outs() << "BOLT-INFO: Memory stats breakdown:\n";
@@ -244,35 +300,10 @@ ReorderData::sortedByFunc(BinaryContext &BC, const BinarySection &Section,
   std::map<BinaryData *, std::set<BinaryFunction *>> BDtoFunc;
   std::map<BinaryData *, uint64_t> BDtoFuncCount;
 
-  auto dataUses = [&BC](const BinaryFunction &BF, bool OnlyHot) {
-    std::set<BinaryData *> Uses;
-    for (const BinaryBasicBlock &BB : BF) {
-      if (OnlyHot && BB.isCold())
-        continue;
-
-      for (const MCInst &Inst : BB) {
-        auto ErrorOrMemAccesssProfile =
-            BC.MIB->tryGetAnnotationAs<MemoryAccessProfile>(
-                Inst, "MemoryAccessProfile");
-        if (!ErrorOrMemAccesssProfile)
-          continue;
-
-        const MemoryAccessProfile &MemAccessProfile =
-            ErrorOrMemAccesssProfile.get();
-        for (const AddressAccess &AccessInfo :
-             MemAccessProfile.AddressAccessInfo) {
-          if (AccessInfo.MemoryObject)
-            Uses.insert(AccessInfo.MemoryObject);
-        }
-      }
-    }
-    return Uses;
-  };
-
   for (auto &Entry : BFs) {
     BinaryFunction &BF = Entry.second;
     if (BF.hasValidProfile()) {
-      for (BinaryData *BD : dataUses(BF, true)) {
+      for (BinaryData *BD : dataUses(BC, BF, /*OnlyHot=*/true)) {
         if (!BC.getFunctionForSymbol(BD->getSymbol())) {
           BDtoFunc[BD->getAtomicRoot()].insert(&BF);
           BDtoFuncCount[BD->getAtomicRoot()] += BF.getKnownExecutionCount();
@@ -310,6 +341,86 @@ ReorderData::sortedByFunc(BinaryContext &BC, const BinarySection &Section,
   return std::make_pair(Order, SplitPoint);
 }
 
+/// Pack data accessed by the same hot function next to each other. Grouping
+/// by the hottest referencing function approximates temporal locality: the
+/// globals one hot function touches end up in one run of cache lines instead
+/// of being interleaved with data the function never reads, which cuts both
+/// false sharing in writeable sections and d-TLB pressure.
+std::pair<DataOrder, unsigned>
+ReorderData::sortedByCacheLines(BinaryContext &BC, const BinarySection &Section,
+                                std::map<uint64_t, BinaryFunction> &BFs) {
+  // The hottest function accessing each symbol defines the symbol's group.
+  std::map<BinaryData *, BinaryFunction *> BDtoPrimaryFunc;
+  std::map<BinaryFunction *, uint64_t> GroupCount;
+
+  for (auto &Entry : BFs) {
+    BinaryFunction &BF = Entry.second;
+    if (!BF.hasValidProfile())
+      continue;
+
+    for (BinaryData *BD : dataUses(BC, BF, /*OnlyHot=*/true)) {
+      if (BC.getFunctionForSymbol(BD->getSymbol()))
+        continue;
+      BinaryFunction *&Primary = BDtoPrimaryFunc[BD->getAtomicRoot()];
+      if (!Primary ||
+          Primary->getKnownExecutionCount() < BF.getKnownExecutionCount())
+        Primary = &BF;
+    }
+  }
+
+  DataOrder Order = baseOrder(BC, Section);
+  unsigned SplitPoint = Order.size();
+
+  auto groupOf = [&](BinaryData *BD) -> BinaryFunction * {
+    auto Itr = BDtoPrimaryFunc.find(BD);
+    return Itr == BDtoPrimaryFunc.end() ? nullptr : Itr->second;
+  };
+
+  for (const DataOrder::value_type &Entry : Order)
+    if (BinaryFunction *Func = groupOf(Entry.first))
+      GroupCount[Func] += Entry.second;
+
+  std::sort(
+      Order.begin(), Order.end(),
+      [&](const DataOrder::value_type &A, const DataOrder::value_type &B) {
+        BinaryFunction *FuncA = groupOf(A.first);
+        BinaryFunction *FuncB = groupOf(B.first);
+        // Hotter groups come first, symbols without a group go last.
+        const uint64_t ACount = FuncA ? GroupCount[FuncA] : 0;
+        const uint64_t BCount = FuncB ? GroupCount[FuncB] : 0;
+        if (ACount != BCount)
+          return ACount > BCount;
+        // Keep each group contiguous.
+        if (FuncA != FuncB)
+          return (FuncA ? FuncA->getAddress() : UINT64_MAX) <
+                 (FuncB ? FuncB->getAddress() : UINT64_MAX);
+        // Within a group order by load density as usual.
+        const double AWeight = double(A.second) / A.first->getSize();
+        const double BWeight = double(B.second) / B.first->getSize();
+        return AWeight > BWeight ||
+               (AWeight == BWeight &&
+                A.first->getAddress() < B.first->getAddress());
+      });
+
+  LineGroupLeaders.clear();
+  const BinaryFunction *LastFunc = nullptr;
+  for (unsigned Idx = 0; Idx < Order.size(); ++Idx) {
+    const BinaryFunction *Func = groupOf(Order[Idx].first);
+    if (Idx == 0 || Func != LastFunc)
+      LineGroupLeaders.insert(Order[Idx].first);
+    LastFunc = Func;
+  }
+
+  for (unsigned Idx = 0; Idx < Order.size(); ++Idx) {
+    if (!groupOf(Order[Idx].first) && !Order[Idx].second) {
+      SplitPoint = Idx;
+      break;
+    }
+  }
+
+  return std::make_pair(Order, SplitPoint);
+}
+
 std::pair<DataOrder, unsigned>
 ReorderData::sortedByCount(BinaryContext &BC,
                            const BinarySection &Section) const {
@@ -373,7 +484,23 @@ void ReorderData::setSectionOrder(BinaryContext &BC,
       break;
     }
 
-    uint16_t Alignment = std::max(BD->getAlignment(), MinAlignment);
+    uint16_t Alignment;
+    if (opts::ReorderAlgorithm == opts::ReorderAlgo::REORDER_LINES) {
+      Alignment = std::max<uint16_t>(BD->getAlignment(), 1);
+      if (LineGroupLeaders.count(BD)) {
+        // Each group of co-accessed symbols starts on a fresh cache line.
+        Alignment = std::max(Alignment, CacheLineSize);
+      } else if (BD->getSize() && BD->getSize() <= CacheLineSize) {
+        // Pack symbols within the group, but do not let a symbol that fits
+        // in a single cache line straddle a line boundary.
+        const uint64_t AlignedOffset = alignTo(Offset, Alignment);
+        if (AlignedOffset / CacheLineSize !=
+            (AlignedOffset + BD->getSize() - 1) / CacheLineSize)
+          Alignment = std::max(Alignment, CacheLineSize);
+      }
+    } else {
+      Alignment = std::max(BD->getAlignment(), MinAlignment);
+    }
     Offset = alignTo(Offset, Alignment);
 
     if ((Offset + BD->getSize()) > opts::ReorderDataMaxBytes) {
@@ -448,7 +575,14 @@ bool ReorderData::markUnmoveableSymbols(BinaryContext &BC,
 }
 
 void ReorderData::runOnFunctions(BinaryContext &BC) {
-  static const char *DefaultSections[] = {".rodata", ".data", ".bss", nullptr};
+  // Mergeable constant sections are safe to shuffle once the linker is done
+  // with them, so they are part of the default set. Mergeable string sections
+  // are not: a string may overlap the tail of its neighbor after suffix
+  // merging and cannot be moved independently.
+  static const char *DefaultSections[] = {".rodata",      ".data",
+                                          ".bss",         ".rodata.cst8",
+                                          ".rodata.cst16", ".rodata.cst32",
+                                          nullptr};
 
   if (!BC.HasRelocations || opts::ReorderData.empty())
     return;
@@ -497,6 +631,11 @@ void ReorderData::runOnFunctions(BinaryContext &BC) {
     if (opts::ReorderAlgorithm == opts::ReorderAlgo::REORDER_COUNT) {
       outs() << "BOLT-INFO: reorder-sections: ordering data by count\n";
       std::tie(Order, SplitPointIdx) = sortedByCount(BC, *Section);
+    } else if (opts::ReorderAlgorithm == opts::ReorderAlgo::REORDER_LINES) {
+      outs() << "BOLT-INFO: reorder-sections: packing data into cache lines "
+             << "by function usage\n";
+      std::tie(Order, SplitPointIdx) =
+          sortedByCacheLines(BC, *Section, BC.getBinaryFunctions());
     } else {
       outs() << "BOLT-INFO: reorder-sections: ordering data by funcs\n";
       std::tie(Order, SplitPointIdx) =
@@ -520,6 +659,12 @@ void ReorderData::runOnFunctions(BinaryContext &BC) {
       // Reorder contents of original section.
       setSectionOrder(BC, *Section, Order.begin(), SplitPoint);
 
+      // When the hugify runtime is going to back the hot data with huge
+      // pages, start the section on a huge page boundary so that the whole
+      // hot range can be covered without touching neighboring sections.
+      if (opts::HugifyData)
+        Section->setAlignment(BinaryContext::HugePageSize);
+
       // This keeps the original data from thinking it has been moved.
       for (std::pair<const uint64_t, BinaryData *> &Entry :
            BC.getBinaryDataForSection(*Section)) {
@@ -13,6 +13,8 @@
 #include "bolt/Passes/ReorderFunctions.h"
 #include "bolt/Passes/HFSort.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Timer.h"
 #include <fstream>
 
 #define DEBUG_TYPE "hfsort"
@@ -24,6 +26,7 @@ namespace opts {
 extern cl::OptionCategory BoltOptCategory;
 extern cl::opt<unsigned> Verbosity;
 extern cl::opt<uint32_t> RandomSeed;
+extern cl::opt<bool> TimeOpts;
 
 extern size_t padFunction(const bolt::BinaryFunction &Function);
 
@@ -62,6 +65,16 @@ ReorderFunctionsUseHotSize("reorder-functions-use-hot-size",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+ReorderFunctionsStartupSet("reorder-functions-startup-set",
+  cl::desc("place functions with first-touch timestamps from the profile in "
+           "a contiguous region at the start of the layout, ordered by their "
+           "first execution during startup, so that cold-start page-in is "
+           "sequential"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<std::string>
 FunctionOrderFile("function-order",
   cl::desc("file containing an ordered list of functions to use for function "
@@ -80,6 +93,15 @@ LinkSectionsFile("generate-link-sections",
            "inclusion in a linker script"),
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+HugePageBins("reorder-functions-huge-page-bins",
+  cl::desc("pack hot clusters into a minimal number of 2MB pages; the "
+           "resulting page count caps the range remapped by the hugify "
+           "runtime (use with -hugify)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 UseEdgeCounts("use-edge-counts",
   cl::desc("use edge count data when doing clustering"),
@@ -119,16 +141,69 @@ using NodeId = CallGraph::NodeId;
 using Arc = CallGraph::Arc;
 using Node = CallGraph::Node;
 
+namespace {
+
+/// Return the number of pages of size \p PageSize the hot code occupies in
+/// the order given by \p FuncAddr, and the number of the hottest such pages
+/// covering 99% of the samples. Function samples are spread evenly over the
+/// function body.
+std::pair<uint64_t, uint64_t>
+computePageWorkingSet(const CallGraph &Cg,
+                      const std::vector<uint64_t> &FuncAddr,
+                      uint64_t PageSize) {
+  std::map<uint64_t, double> PageSamples;
+  double TotalSamples = 0;
+  for (NodeId FuncId = 0; FuncId < Cg.numNodes(); ++FuncId) {
+    if (!Cg.samples(FuncId) || !Cg.size(FuncId))
+      continue;
+    const uint64_t Begin = FuncAddr[FuncId];
+    const uint64_t End = Begin + Cg.size(FuncId);
+    const double Density = double(Cg.samples(FuncId)) / Cg.size(FuncId);
+    for (uint64_t Page = Begin / PageSize; Page <= (End - 1) / PageSize;
+         ++Page) {
+      const uint64_t PageBegin = Page * PageSize;
+      const uint64_t Bytes =
+          std::min(End, PageBegin + PageSize) - std::max(Begin, PageBegin);
+      PageSamples[Page] += Density * Bytes;
+    }
+    TotalSamples += Cg.samples(FuncId);
+  }
+
+  std::vector<double> Samples;
+  Samples.reserve(PageSamples.size());
+  for (const std::pair<const uint64_t, double> &Page : PageSamples)
+    Samples.push_back(Page.second);
+  std::sort(Samples.begin(), Samples.end(),
+            [](double L, double R) { return L > R; });
+
+  double Covered = 0;
+  uint64_t HotPages = 0;
+  while (HotPages < Samples.size() && Covered < 0.99 * TotalSamples)
+    Covered += Samples[HotPages++];
+
+  return std::make_pair(PageSamples.size(), HotPages);
+}
+
+} // namespace
+
 void ReorderFunctions::reorder(std::vector<Cluster> &&Clusters,
                                std::map<uint64_t, BinaryFunction> &BFs) {
   std::vector<uint64_t> FuncAddr(Cg.numNodes()); // Just for computing stats
   uint64_t TotalSize = 0;
+
+  // The startup set may have indices assigned already; continue numbering
+  // after it.
   uint32_t Index = 0;
+  for (const std::pair<const uint64_t, BinaryFunction> &BFI : BFs)
+    if (BFI.second.hasValidIndex())
+      ++Index;
 
   // Set order of hot functions based on clusters.
   for (const Cluster &Cluster : Clusters) {
     for (const NodeId FuncId : Cluster.targets()) {
-      Cg.nodeIdToFunc(FuncId)->setIndex(Index++);
+      BinaryFunction *BF = Cg.nodeIdToFunc(FuncId);
+      if (!BF->hasValidIndex())
+        BF->setIndex(Index++);
       FuncAddr[FuncId] = TotalSize;
       TotalSize += Cg.size(FuncId);
     }
@@ -137,6 +212,18 @@ void ReorderFunctions::reorder(std::vector<Cluster> &&Clusters,
   if (opts::ReorderFunctions == RT_NONE)
     return;
 
+  // Report the predicted page footprint of the hot code under the new order.
+  if (Cg.numNodes() > 0) {
+    const std::pair<uint64_t, uint64_t> WS4K =
+        computePageWorkingSet(Cg, FuncAddr, 4096);
+    const std::pair<uint64_t, uint64_t> WS2M =
+        computePageWorkingSet(Cg, FuncAddr, HugePageSize);
+    outs() << "BOLT-INFO: predicted hot code working set: " << WS4K.first
+           << " 4KB pages (" << WS4K.second << " cover 99% of samples), "
+           << WS2M.first << " 2MB pages (" << WS2M.second
+           << " cover 99% of samples)\n";
+  }
+
   if (opts::Verbosity == 0) {
 #ifndef NDEBUG
     if (!DebugFlag || !isCurrentDebugType("hfsort"))
@@ -244,6 +331,42 @@ void ReorderFunctions::reorder(std::vector<Cluster> &&Clusters,
 
 namespace {
 
+/// Repack \p Clusters so that hot clusters fill whole 2MB pages with minimal
+/// slack. Clusters arrive sorted by density; that order is kept for page
+/// openers and smaller hot clusters are only pulled forward to fill the tail
+/// of a page that the next cluster in line would not fit into. Returns the
+/// number of huge pages the hot clusters occupy.
+uint64_t packClustersIntoHugePages(std::vector<Cluster> &Clusters) {
+  std::vector<Cluster> Packed;
+  Packed.reserve(Clusters.size());
+  std::vector<bool> Placed(Clusters.size(), false);
+  uint64_t NumPages = 0;
+  for (size_t I = 0; I < Clusters.size(); ++I) {
+    if (Placed[I] || !Clusters[I].samples())
+      continue;
+    // Open a new page (or a run of pages) with the densest unplaced cluster.
+    const uint64_t Size = Clusters[I].size();
+    NumPages += alignTo(Size, HugePageSize) / HugePageSize;
+    uint64_t Remaining = alignTo(Size, HugePageSize) - Size;
+    Placed[I] = true;
+    Packed.emplace_back(std::move(Clusters[I]));
+    // Fill the tail of the page with the densest clusters that still fit.
+    for (size_t J = I + 1; J < Clusters.size() && Remaining > 0; ++J) {
+      if (Placed[J] || !Clusters[J].samples() || Clusters[J].size() > Remaining)
+        continue;
+      Remaining -= Clusters[J].size();
+      Placed[J] = true;
+      Packed.emplace_back(std::move(Clusters[J]));
+    }
+  }
+  // Preserve the original order for clusters without samples.
+  for (size_t I = 0; I < Clusters.size(); ++I)
+    if (!Placed[I])
+      Packed.emplace_back(std::move(Clusters[I]));
+  Clusters = std::move(Packed);
+  return NumPages;
+}
+
 std::vector<std::string> readFunctionOrderFile() {
   std::vector<std::string> FunctionNames;
   std::ifstream FuncsFile(opts::FunctionOrderFile, std::ios::in);
@@ -262,6 +385,33 @@ std::vector<std::string> readFunctionOrderFile() {
 
 void ReorderFunctions::runOnFunctions(BinaryContext &BC) {
   auto &BFs = BC.getBinaryFunctions();
+
+  // Place functions executed during startup at the front of the layout in
+  // first-touch order, so that paging them in during cold start becomes one
+  // sequential readahead stream. The remaining functions are ordered by the
+  // selected algorithm after the startup set.
+  uint32_t StartupIndex = 0;
+  if (opts::ReorderFunctionsStartupSet && opts::ReorderFunctions != RT_NONE) {
+    std::vector<BinaryFunction *> StartupFunctions;
+    for (std::pair<const uint64_t, BinaryFunction> &BFI : BFs) {
+      BinaryFunction &BF = BFI.second;
+      if (BF.hasFirstTouchTime() && !BF.isIgnored())
+        StartupFunctions.push_back(&BF);
+    }
+    std::stable_sort(StartupFunctions.begin(), StartupFunctions.end(),
+                     [](const BinaryFunction *A, const BinaryFunction *B) {
+                       return A->getFirstTouchTime() < B->getFirstTouchTime();
+                     });
+    for (BinaryFunction *BF : StartupFunctions)
+      BF->setIndex(StartupIndex++);
+    if (!StartupFunctions.empty())
+      outs() << "BOLT-INFO: clustered " << StartupFunctions.size()
+             << " startup functions in first-touch order\n";
+    else
+      errs() << "BOLT-WARNING: -reorder-functions-startup-set is set, but the "
+                "profile has no first_touch records\n";
+  }
+
   if (opts::ReorderFunctions != RT_NONE &&
       opts::ReorderFunctions != RT_EXEC_COUNT &&
       opts::ReorderFunctions != RT_USER) {
@@ -284,102 +434,112 @@ void ReorderFunctions::runOnFunctions(BinaryContext &BC) {
 
   std::vector<Cluster> Clusters;
 
-  switch (opts::ReorderFunctions) {
-  case RT_NONE:
-    break;
-  case RT_EXEC_COUNT:
-    {
-      std::vector<BinaryFunction *> SortedFunctions(BFs.size());
-      uint32_t Index = 0;
-      std::transform(BFs.begin(),
-                     BFs.end(),
-                     SortedFunctions.begin(),
-                     [](std::pair<const uint64_t, BinaryFunction> &BFI) {
-                       return &BFI.second;
-                     });
-      std::stable_sort(SortedFunctions.begin(), SortedFunctions.end(),
-                       [&](const BinaryFunction *A, const BinaryFunction *B) {
-                         if (A->isIgnored())
-                           return false;
-                         const size_t PadA = opts::padFunction(*A);
-                         const size_t PadB = opts::padFunction(*B);
-                         if (!PadA || !PadB) {
-                           if (PadA)
-                             return true;
-                           if (PadB)
-                             return false;
-                         }
-                         return !A->hasProfile() &&
-                           (B->hasProfile() ||
-                            (A->getExecutionCount() > B->getExecutionCount()));
+  {
+    NamedRegionTimer T("cluster", "cluster functions", "RF", "RF breakdown",
+                       opts::TimeOpts);
+    switch (opts::ReorderFunctions) {
+    case RT_NONE:
+      break;
+    case RT_EXEC_COUNT:
+      {
+        std::vector<BinaryFunction *> SortedFunctions(BFs.size());
+        uint32_t Index = StartupIndex;
+        std::transform(BFs.begin(),
+                       BFs.end(),
+                       SortedFunctions.begin(),
+                       [](std::pair<const uint64_t, BinaryFunction> &BFI) {
+                         return &BFI.second;
                        });
-      for (BinaryFunction *BF : SortedFunctions)
-        if (BF->hasProfile())
-          BF->setIndex(Index++);
-    }
-    break;
-  case RT_HFSORT:
-    Clusters = clusterize(Cg);
-    break;
-  case RT_HFSORT_PLUS:
-    Clusters = hfsortPlus(Cg);
-    break;
-  case RT_PETTIS_HANSEN:
-    Clusters = pettisAndHansen(Cg);
-    break;
-  case RT_RANDOM:
-    std::srand(opts::RandomSeed);
-    Clusters = randomClusters(Cg);
-    break;
-  case RT_USER:
-    {
-      uint32_t Index = 0;
-      for (const std::string &Function : readFunctionOrderFile()) {
-        std::vector<uint64_t> FuncAddrs;
-
-        BinaryData *BD = BC.getBinaryDataByName(Function);
-        if (!BD) {
-          uint32_t LocalID = 1;
-          while(1) {
-            // If we can't find the main symbol name, look for alternates.
-            const std::string FuncName =
-                Function + "/" + std::to_string(LocalID);
-            BD = BC.getBinaryDataByName(FuncName);
-            if (BD)
-              FuncAddrs.push_back(BD->getAddress());
-            else
-              break;
-            LocalID++;
+        std::stable_sort(SortedFunctions.begin(), SortedFunctions.end(),
+                         [&](const BinaryFunction *A, const BinaryFunction *B) {
+                           if (A->isIgnored())
+                             return false;
+                           const size_t PadA = opts::padFunction(*A);
+                           const size_t PadB = opts::padFunction(*B);
+                           if (!PadA || !PadB) {
+                             if (PadA)
+                               return true;
+                             if (PadB)
+                               return false;
+                           }
+                           return !A->hasProfile() &&
+                             (B->hasProfile() ||
+                              (A->getExecutionCount() > B->getExecutionCount()));
+                         });
+        for (BinaryFunction *BF : SortedFunctions)
+          if (BF->hasProfile() && !BF->hasValidIndex())
+            BF->setIndex(Index++);
+      }
+      break;
+    case RT_HFSORT:
+      Clusters = clusterize(Cg);
+      break;
+    case RT_HFSORT_PLUS:
+      Clusters = hfsortPlus(Cg);
+      break;
+    case RT_PETTIS_HANSEN:
+      Clusters = pettisAndHansen(Cg);
+      break;
+    case RT_RANDOM:
+      std::srand(opts::RandomSeed);
+      Clusters = randomClusters(Cg);
+      break;
+    case RT_USER:
+      {
+        uint32_t Index = StartupIndex;
+        for (const std::string &Function : readFunctionOrderFile()) {
+          std::vector<uint64_t> FuncAddrs;
+
+          BinaryData *BD = BC.getBinaryDataByName(Function);
+          if (!BD) {
+            uint32_t LocalID = 1;
+            while(1) {
+              // If we can't find the main symbol name, look for alternates.
+              const std::string FuncName =
+                  Function + "/" + std::to_string(LocalID);
+              BD = BC.getBinaryDataByName(FuncName);
+              if (BD)
+                FuncAddrs.push_back(BD->getAddress());
+              else
+                break;
+              LocalID++;
+            }
+          } else {
+            FuncAddrs.push_back(BD->getAddress());
           }
-        } else {
-          FuncAddrs.push_back(BD->getAddress());
-        }
-
-        if (FuncAddrs.empty()) {
-          errs() << "BOLT-WARNING: Reorder functions: can't find function for "
-                 << Function << ".\n";
-          continue;
-        }
 
-        for (const uint64_t FuncAddr : FuncAddrs) {
-          const BinaryData *FuncBD = BC.getBinaryDataAtAddress(FuncAddr);
-          assert(FuncBD);
-
-          BinaryFunction *BF = BC.getFunctionForSymbol(FuncBD->getSymbol());
-          if (!BF) {
+          if (FuncAddrs.empty()) {
             errs() << "BOLT-WARNING: Reorder functions: can't find function for "
                    << Function << ".\n";
-            break;
+            continue;
+          }
+
+          for (const uint64_t FuncAddr : FuncAddrs) {
+            const BinaryData *FuncBD = BC.getBinaryDataAtAddress(FuncAddr);
+            assert(FuncBD);
+
+            BinaryFunction *BF = BC.getFunctionForSymbol(FuncBD->getSymbol());
+            if (!BF) {
+              errs() << "BOLT-WARNING: Reorder functions: can't find function for "
+                     << Function << ".\n";
+              break;
+            }
+            if (!BF->hasValidIndex())
+              BF->setIndex(Index++);
+            else if (opts::Verbosity > 0)
+              errs() << "BOLT-WARNING: Duplicate reorder entry for " << Function
+                     << ".\n";
           }
-          if (!BF->hasValidIndex())
-            BF->setIndex(Index++);
-          else if (opts::Verbosity > 0)
-            errs() << "BOLT-WARNING: Duplicate reorder entry for " << Function
-                   << ".\n";
         }
       }
+      break;
     }
-    break;
+  }
+
+  if (opts::HugePageBins && !Clusters.empty()) {
+    BC.HugePageCount = packClustersIntoHugePages(Clusters);
+    outs() << "BOLT-INFO: hot clusters packed into " << BC.HugePageCount
+           << " huge page(s)\n";
   }
 
   reorder(std::move(Clusters), BFs);
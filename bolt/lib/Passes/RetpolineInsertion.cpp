@@ -18,6 +18,9 @@
 // option, by default %r11 is assumed not available.
 // Adding lfence instruction to the body of the speculate code is enabled by
 // default and can be controlled by the user using retpoline-lfence option.
+// Retpolines are deduplicated across the whole binary and accumulate the
+// execution counts of the callsites they serve; thunks used from profiled
+// callsites are placed with the hot text by AssignSections.
 //
 //===----------------------------------------------------------------------===//
 
@@ -319,6 +322,12 @@ void RetpolineInsertion::runOnFunctions(BinaryContext &BC) {
 
         TargetRetpoline = getOrCreateRetpoline(BC, BrInfo, R11Available);
 
+        // Attribute the callsite frequency to the thunk so that thunks
+        // serving hot callsites can be placed with the hot text.
+        if (const uint64_t Count = BB.getKnownExecutionCount())
+          TargetRetpoline->setExecutionCount(
+              TargetRetpoline->getKnownExecutionCount() + Count);
+
         createBranchReplacement(BC, BrInfo, R11Available, Replacement,
                                 TargetRetpoline->getSymbol());
 
@@ -327,8 +336,22 @@ void RetpolineInsertion::runOnFunctions(BinaryContext &BC) {
       }
     }
   }
+  // Emit the hottest thunks first so they cluster together at the front of
+  // their output section.
+  llvm::stable_sort(BC.getInjectedBinaryFunctions(),
+                    [](const BinaryFunction *A, const BinaryFunction *B) {
+                      return A->getKnownExecutionCount() >
+                             B->getKnownExecutionCount();
+                    });
+
+  uint64_t NumHotRetpolines = 0;
+  for (const auto &KV : CreatedRetpolines)
+    if (KV.second->getKnownExecutionCount())
+      ++NumHotRetpolines;
+
   outs() << "BOLT-INFO: The number of created retpoline functions is : "
-         << CreatedRetpolines.size()
+         << CreatedRetpolines.size() << " (" << NumHotRetpolines
+         << " used from profiled callsites)"
          << "\nBOLT-INFO: The number of retpolined branches is : "
          << RetpolinedBranches << "\n";
 }
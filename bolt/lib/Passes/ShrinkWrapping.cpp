@@ -1020,7 +1020,7 @@ ShrinkWrapping::doRestorePlacement(MCInst *BestPosSave, unsigned CSR,
   // analysis that depends on insertions happening before real instructions
   // (PredictiveStackPointerTracking). Detect now for empty BBs and add a
   // dummy nop that is scheduled to be removed later.
-  bool InvalidateRequired = false;
+  SmallVector<BinaryBasicBlock *, 4> NopBBs;
   for (BinaryBasicBlock *&BB : BF.layout()) {
     if (BB->size() != 0)
       continue;
@@ -1028,7 +1028,7 @@ ShrinkWrapping::doRestorePlacement(MCInst *BestPosSave, unsigned CSR,
     BC.MIB->createNoop(NewInst);
     auto II = BB->addInstruction(std::move(NewInst));
     scheduleChange(&*II, WorklistItem(WorklistItem::Erase, 0));
-    InvalidateRequired = true;
+    NopBBs.push_back(BB);
   }
   if (std::accumulate(IsCritEdge.begin(), IsCritEdge.end(), 0)) {
     LLVM_DEBUG({
@@ -1044,14 +1044,17 @@ ShrinkWrapping::doRestorePlacement(MCInst *BestPosSave, unsigned CSR,
     });
     splitFrontierCritEdges(&BF, Frontier, IsCritEdge, CritEdgesFrom,
                            CritEdgesTo);
-    InvalidateRequired = true;
-  }
-  if (InvalidateRequired) {
     // BitVectors that represent all insns of the function are invalid now
     // since we changed BBs/Insts. Re-run steps that depend on pointers being
     // valid
     Info.invalidateAll();
     classifyCSRUses();
+  } else if (!NopBBs.empty()) {
+    // Only instructions were inserted and the CFG is intact: analyses over
+    // instruction-independent domains are refreshed incrementally, the rest
+    // are invalidated as above.
+    Info.rerunAfterLocalEdits(NopBBs);
+    classifyCSRUses();
   }
   if (CannotPlace) {
     LLVM_DEBUG({
@@ -1950,6 +1953,27 @@ void ShrinkWrapping::rebuildCFI() {
   }
 }
 
+bool ShrinkWrapping::hasSpillCandidates(const FrameAnalysis &FA,
+                                        const BinaryFunction &BF) {
+  if (const FrameAnalysis::FunctionSummary *Summary = FA.getSummaryFor(BF))
+    return Summary->HasSpillCandidate;
+
+  for (const BinaryBasicBlock &BB : BF) {
+    for (const MCInst &Inst : BB) {
+      ErrorOr<const FrameIndexEntry &> FIE = FA.getFIEFor(Inst);
+      if (!FIE)
+        continue;
+      // Mirror the shape analyzeSaves() accepts as a callee-saved register
+      // save: a simple store from a register below the entry stack pointer.
+      // Anything else is either ignored or blacklists the register.
+      if (FIE->IsStore && FIE->IsStoreFromReg && FIE->IsSimple &&
+          FIE->StackOffset < 0)
+        return true;
+    }
+  }
+  return false;
+}
+
 bool ShrinkWrapping::perform() {
   HasDeletedOffsetCFIs = std::vector<bool>(BC.MRI->getNumRegs(), false);
   PushOffsetByReg = std::vector<int64_t>(BC.MRI->getNumRegs(), 0LL);
@@ -27,6 +27,7 @@ namespace opts {
 extern cl::OptionCategory BoltOptCategory;
 
 extern cl::opt<bool> SplitEH;
+extern cl::opt<bool> SplitRegions;
 extern cl::opt<unsigned> ExecutionCountThreshold;
 
 static cl::opt<bool>
@@ -61,6 +62,16 @@ SplitFunctions("split-functions",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+WarmThreshold("warm-threshold",
+  cl::desc("with -split-regions, blocks executed fewer times than the "
+           "threshold are split together with never-executed code and "
+           "placed in the warm section. Default value: 1, i.e. only "
+           "never-executed blocks are split."),
+  cl::init(1),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<unsigned>
 SplitThreshold("split-threshold",
   cl::desc("split function only if its main size is reduced by more than "
@@ -113,6 +124,11 @@ void SplitFunctions::runOnFunctions(BinaryContext &BC) {
            << " hot bytes from " << SplitBytesCold << " cold bytes "
            << format("(%.2lf%% of split functions is hot).\n",
                      100.0 * SplitBytesHot / (SplitBytesHot + SplitBytesCold));
+
+  if (opts::SplitRegions && NumWarmFragments + NumColdFragments > 0)
+    outs() << "BOLT-INFO: region splitting assigned " << NumWarmFragments
+           << " fragments to the warm section and " << NumColdFragments
+           << " fragments to the cold section\n";
 }
 
 void SplitFunctions::splitFunction(BinaryFunction &BF) {
@@ -154,12 +170,24 @@ void SplitFunctions::splitFunction(BinaryFunction &BF) {
       return;
   }
 
+  // With region splitting, blocks executed fewer times than the warm
+  // threshold leave the hot fragment as well.
+  const uint64_t ColdThreshold =
+      opts::SplitRegions ? std::max(opts::WarmThreshold.getValue(), 1u) : 1;
+
   // Never outline the first basic block.
   BF.layout_front()->setCanOutline(false);
   for (BinaryBasicBlock *BB : BF.layout()) {
     if (!BB->canOutline())
       continue;
-    if (BB->getExecutionCount() != 0) {
+    if (BB->getExecutionCount() >= ColdThreshold) {
+      BB->setCanOutline(false);
+      continue;
+    }
+    // A cold-looking block whose count is a guess, e.g. from a partially
+    // matched profile, may well be hot. Keep it in the main fragment rather
+    // than risk a call into the cold section on every execution.
+    if (BB->getProfileConfidence() == BinaryBasicBlock::PROF_CONF_GUESSED) {
       BB->setCanOutline(false);
       continue;
     }
@@ -241,6 +269,23 @@ void SplitFunctions::splitFunction(BinaryFunction &BF) {
       SplitBytesCold += ColdSize;
     }
   }
+
+  // Classify the cold fragment for section assignment. A fragment that was
+  // executed, however rarely, belongs to the warm tier. The frozen tier is
+  // reserved for functions with no execution evidence at all: a zero count
+  // on an individual fragment may be profile undersampling.
+  if (opts::SplitRegions && BF.isSplit()) {
+    uint64_t ColdCount = 0;
+    for (BinaryBasicBlock *BB : BF.layout())
+      if (BB->isCold())
+        ColdCount = std::max(ColdCount, BB->getKnownExecutionCount());
+    if (ColdCount > 0) {
+      BF.setColdFragmentTier(BinaryFunction::FT_WARM);
+      ++NumWarmFragments;
+    } else {
+      ++NumColdFragments;
+    }
+  }
 }
 
 } // namespace bolt
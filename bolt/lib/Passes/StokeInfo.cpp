@@ -11,9 +11,13 @@
 //===----------------------------------------------------------------------===//
 
 #include "bolt/Passes/StokeInfo.h"
+#include "bolt/Core/ParallelUtilities.h"
 #include "bolt/Passes/BinaryFunctionCallGraph.h"
 #include "bolt/Passes/DataflowInfoManager.h"
 #include "llvm/Support/CommandLine.h"
+#include <map>
+#include <mutex>
+#include <sstream>
 
 #define DEBUG_TYPE "stoke"
 
@@ -28,6 +32,22 @@ StokeOutputDataFilename("stoke-out",
   cl::desc("output data (.csv) for Stoke's use"),
   cl::Optional,
   cl::cat(StokeOptCategory));
+
+static cl::opt<unsigned>
+StokeMaxInstrs("stoke-max-instrs",
+  cl::desc("maximum number of instructions in a function to be considered "
+           "a Stoke candidate (default: 500)"),
+  cl::init(500),
+  cl::Optional,
+  cl::cat(StokeOptCategory));
+
+static cl::opt<uint64_t>
+StokeMinScore("stoke-min-score",
+  cl::desc("minimum profile score of a function to be considered a Stoke "
+           "candidate (default: 0)"),
+  cl::init(0),
+  cl::Optional,
+  cl::cat(StokeOptCategory));
 }
 
 namespace llvm {
@@ -93,7 +113,7 @@ bool StokeInfo::checkFunction(BinaryFunction &BF, DataflowInfoManager &DInfo,
 
   if (!BF.isSimple() || BF.isMultiEntry() || BF.empty())
     return false;
-  outs() << " STOKE-INFO: analyzing function " << Name << "\n";
+  LLVM_DEBUG(dbgs() << " STOKE-INFO: analyzing function " << Name << "\n");
 
   FuncInfo.FuncName = Name;
   FuncInfo.Offset = BF.getFileOffset();
@@ -101,7 +121,7 @@ bool StokeInfo::checkFunction(BinaryFunction &BF, DataflowInfoManager &DInfo,
   FuncInfo.NumInstrs = BF.getNumNonPseudos();
   FuncInfo.NumBlocks = BF.size();
   // early stop for large functions
-  if (FuncInfo.NumInstrs > 500)
+  if (FuncInfo.NumInstrs > opts::StokeMaxInstrs)
     return false;
 
   FuncInfo.IsLoopFree = BF.isLoopFree();
@@ -136,7 +156,7 @@ bool StokeInfo::checkFunction(BinaryFunction &BF, DataflowInfoManager &DInfo,
   LiveOutBV &= DefaultLiveOutMask;
   getRegNameFromBitVec(BF.getBinaryContext(), LiveOutBV, &FuncInfo.LiveOut);
 
-  outs() << " STOKE-INFO: end function \n";
+  LLVM_DEBUG(dbgs() << " STOKE-INFO: end function \n");
   return true;
 }
 
@@ -171,16 +191,42 @@ void StokeInfo::runOnFunctions(BinaryContext &BC) {
   getRegNameFromBitVec(BC, DefaultDefInMask);
   getRegNameFromBitVec(BC, DefaultLiveOutMask);
 
+  // Analyze functions in parallel. Each worker formats the candidate's row
+  // into a small buffer; the rows are flushed to the output file in address
+  // order once all workers are done, so only one compact line per candidate
+  // is ever held in memory. Filtering on size and profile heat happens in the
+  // skip predicate, before any dataflow state is built for the function.
+  std::map<uint64_t, std::string> Rows;
+  std::mutex RowsMutex;
+
+  ParallelUtilities::WorkFuncWithAllocTy WorkFun =
+      [&](BinaryFunction &BF, MCPlusBuilder::AllocatorIdTy AllocId) {
+        DataflowInfoManager DInfo(BF, &RA, nullptr, AllocId);
+        StokeFuncInfo FuncInfo;
+        if (!checkFunction(BF, DInfo, RA, FuncInfo))
+          return;
+        std::ostringstream Row;
+        FuncInfo.printData(Row);
+        std::lock_guard<std::mutex> Lock(RowsMutex);
+        Rows[BF.getAddress()] = Row.str();
+      };
+
+  ParallelUtilities::PredicateTy SkipFunc = [](const BinaryFunction &BF) {
+    return !BF.isSimple() || BF.isMultiEntry() || BF.empty() ||
+           BF.getNumNonPseudos() > opts::StokeMaxInstrs ||
+           BF.getFunctionScore() < opts::StokeMinScore;
+  };
+
+  ParallelUtilities::runOnEachFunctionWithUniqueAllocId(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+      SkipFunc, "StokeInfo");
+
   StokeFuncInfo FuncInfo;
-  // analyze all functions
   FuncInfo.printCsvHeader(Outfile);
-  for (auto &BF : BC.getBinaryFunctions()) {
-    DataflowInfoManager DInfo(BF.second, &RA, nullptr);
-    FuncInfo.reset();
-    if (checkFunction(BF.second, DInfo, RA, FuncInfo))
-      FuncInfo.printData(Outfile);
-  }
+  for (std::pair<const uint64_t, std::string> &Row : Rows)
+    Outfile << Row.second;
 
+  outs() << "STOKE-INFO: found " << Rows.size() << " candidate functions\n";
   outs() << "STOKE-INFO: end of stoke pass\n";
 }
 
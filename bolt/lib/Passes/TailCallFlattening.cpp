@@ -0,0 +1,128 @@
+//===- bolt/Passes/TailCallFlattening.cpp ---------------------------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This pass detects tail-call-only forwarding functions and redirects their
+// direct callers at the final destination of the forwarding chain.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bolt/Passes/TailCallFlattening.h"
+#include "bolt/Core/ParallelUtilities.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include <atomic>
+#include <unordered_map>
+
+#define DEBUG_TYPE "tail-call-flattening"
+
+using namespace llvm;
+
+namespace llvm {
+namespace bolt {
+
+namespace {
+
+/// If \p BF does nothing but forward control to another function with a
+/// single unconditional direct tail call, return the target symbol of that
+/// call. Return nullptr otherwise.
+const MCSymbol *getForwardingTarget(const BinaryContext &BC,
+                                    const BinaryFunction &BF) {
+  if (!BF.hasCFG() || !BF.isSimple() || BF.isMultiEntry() ||
+      BF.hasEHRanges() || BF.size() != 1)
+    return nullptr;
+
+  const BinaryBasicBlock &BB = BF.front();
+  if (BB.getNumNonPseudos() != 1)
+    return nullptr;
+
+  const MCInst *Instr = BB.getLastNonPseudoInstr();
+  if (!BC.MIB->isTailCall(*Instr) || BC.MIB->isConditionalBranch(*Instr) ||
+      BC.MIB->isIndirectCall(*Instr) || BC.MIB->isIndirectBranch(*Instr))
+    return nullptr;
+
+  const MCSymbol *TargetSymbol = BC.MIB->getTargetSymbol(*Instr);
+  if (!TargetSymbol)
+    return nullptr;
+
+  // Only forward to the primary entry of another function. A jump into the
+  // middle of a function or to a secondary entry is not a plain forwarder.
+  const BinaryFunction *Callee = BC.getFunctionForSymbol(TargetSymbol);
+  if (!Callee || Callee == &BF || Callee->getSymbol() != TargetSymbol)
+    return nullptr;
+
+  return TargetSymbol;
+}
+
+} // namespace
+
+void TailCallFlattening::runOnFunctions(BinaryContext &BC) {
+  // Map a forwarding function's entry symbol to the entry of the function it
+  // forwards to. Only forwarders observed executed in the profile are
+  // flattened: the binary may contain thousands of cold shims, and
+  // retargeting their call sites only grows the relocation work without a
+  // measurable win.
+  std::unordered_map<const MCSymbol *, const MCSymbol *> ForwardingTargets;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    const BinaryFunction &Function = BFI.second;
+    if (!shouldOptimize(Function) || Function.getKnownExecutionCount() == 0)
+      continue;
+    if (const MCSymbol *Target = getForwardingTarget(BC, Function))
+      ForwardingTargets[Function.getSymbol()] = Target;
+  }
+
+  if (ForwardingTargets.empty())
+    return;
+
+  // Flatten forwarder chains so that a single rewrite takes a caller past
+  // every hop. Mutually tail-calling forwarders form a cycle; leave such
+  // chains at the first repeated symbol, and let the rewrite sweep below
+  // skip the resulting self-mappings.
+  for (auto &Entry : ForwardingTargets) {
+    SmallPtrSet<const MCSymbol *, 4> Visited = {Entry.first};
+    const MCSymbol *Dest = Entry.second;
+    while (ForwardingTargets.count(Dest) && Visited.insert(Dest).second)
+      Dest = ForwardingTargets[Dest];
+    Entry.second = Dest;
+  }
+
+  // Rewrite direct calls and tail calls targeting a forwarder in a parallel
+  // sweep. The map is read-only by now; only the branch target replacement
+  // allocates in the shared MCContext and takes the context lock.
+  std::atomic<uint64_t> NumRedirected{0};
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &Function) {
+    for (BinaryBasicBlock &BB : Function) {
+      for (MCInst &Instr : BB) {
+        if ((!BC.MIB->isCall(Instr) && !BC.MIB->isTailCall(Instr)) ||
+            BC.MIB->isConditionalBranch(Instr) ||
+            BC.MIB->isIndirectCall(Instr) || BC.MIB->isIndirectBranch(Instr))
+          continue;
+
+        const MCSymbol *TargetSymbol = BC.MIB->getTargetSymbol(Instr);
+        auto FTI = ForwardingTargets.find(TargetSymbol);
+        if (FTI == ForwardingTargets.end() || FTI->second == TargetSymbol)
+          continue;
+
+        NumRedirected++;
+        auto L = BC.scopeLock();
+        if (!BC.MIB->replaceBranchTarget(Instr, FTI->second, BC.Ctx.get()))
+          assert(false && "updating forwarded call destination failed");
+      }
+    }
+  };
+
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+      nullptr, "TailCallFlattening");
+
+  if (NumRedirected)
+    outs() << "BOLT-INFO: redirected " << NumRedirected
+           << " call sites past " << ForwardingTargets.size()
+           << " tail-call forwarders\n";
+}
+
+} // namespace bolt
+} // namespace llvm
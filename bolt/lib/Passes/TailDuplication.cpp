@@ -40,6 +40,26 @@ static cl::opt<unsigned> TailDuplicationMaximumDuplication(
     cl::desc("maximum size of duplicated blocks (in bytes)"), cl::ZeroOrMore,
     cl::ReallyHidden, cl::init(64), cl::cat(BoltOptCategory));
 
+static cl::opt<bool> TailDuplicationCostModel(
+    "tail-duplication-cost-model",
+    cl::desc("gate every duplication on profile-measured benefit: removed "
+             "unconditional branches plus mispredicted conditional branches "
+             "whose history the copy separates, against the bytes duplicated"),
+    cl::ZeroOrMore, cl::ReallyHidden, cl::init(true),
+    cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned> TailDuplicationMinBenefitPerByte(
+    "tail-duplication-min-benefit-per-byte",
+    cl::desc("minimum dynamic benefit (execution count units) required per "
+             "duplicated byte for the cost model to accept a candidate"),
+    cl::ZeroOrMore, cl::ReallyHidden, cl::init(10), cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned> TailDuplicationMaxGrowthPercent(
+    "tail-duplication-max-growth",
+    cl::desc("budget for code added by tail duplication, in percent of "
+             "function size; candidates past the budget are rejected"),
+    cl::ZeroOrMore, cl::ReallyHidden, cl::init(5), cl::cat(BoltOptCategory));
+
 static cl::opt<bool> TailDuplicationConstCopyPropagation(
     "tail-duplication-const-copy-propagation",
     cl::desc("enable const and copy propagation after tail duplication"),
@@ -318,6 +338,42 @@ TailDuplication::aggressiveCodeToDuplicate(BinaryBasicBlock &BB) const {
   return BlocksToDuplicate;
 }
 
+bool TailDuplication::isProfitable(
+    const BinaryBasicBlock &BB,
+    const std::vector<BinaryBasicBlock *> &BlocksToDuplicate,
+    uint64_t DuplicationByteCount) const {
+  // Unconditional branches removed: every execution of BB used to jump to
+  // the duplicated tail and now falls through.
+  const BinaryBasicBlock::BinaryBranchInfo &BI =
+      const_cast<BinaryBasicBlock &>(BB).getBranchInfo(*BB.getSuccessor());
+  const uint64_t PathCount = BI.Count == BinaryBasicBlock::COUNT_NO_PROFILE
+                                 ? BB.getKnownExecutionCount()
+                                 : BI.Count;
+  uint64_t Benefit = PathCount;
+
+  // Mispredicted conditional branches in the tail whose history the copy
+  // separates from the other predecessors. The LBR profile records
+  // mispredictions per edge; attribute to this candidate the share of them
+  // proportional to the path count entering through BB. Blocks with a single
+  // predecessor gain nothing from a separate branch history.
+  for (const BinaryBasicBlock *Block : BlocksToDuplicate) {
+    if (Block->succ_size() != 2 || Block->pred_size() < 2)
+      continue;
+    uint64_t Mispredictions = 0;
+    for (auto I = Block->branch_info_begin(), E = Block->branch_info_end();
+         I != E; ++I)
+      if (I->MispredictedCount != BinaryBasicBlock::COUNT_INFERRED)
+        Mispredictions += I->MispredictedCount;
+    const uint64_t BlockCount = Block->getKnownExecutionCount();
+    if (BlockCount > 0)
+      Benefit += Mispredictions * std::min<uint64_t>(PathCount, BlockCount) /
+                 BlockCount;
+  }
+
+  return Benefit >=
+         DuplicationByteCount * opts::TailDuplicationMinBenefitPerByte;
+}
+
 std::vector<BinaryBasicBlock *> TailDuplication::tailDuplicate(
     BinaryBasicBlock &BB,
     const std::vector<BinaryBasicBlock *> &BlocksToDuplicate) const {
@@ -389,6 +445,9 @@ void TailDuplication::runOnFunction(BinaryFunction &Function) {
   // New blocks will be added and layout will change,
   // so make a copy here to iterate over the original layout
   BinaryFunction::BasicBlockOrderType BlockLayout = Function.getLayout();
+  uint64_t BytesDuplicated = 0;
+  const uint64_t BytesBudget =
+      Function.getSize() * opts::TailDuplicationMaxGrowthPercent / 100;
   for (BinaryBasicBlock *BB : BlockLayout) {
     if (BB->succ_size() == 1 &&
         BB->getSuccessor()->getLayoutIndex() != BB->getLayoutIndex() + 1)
@@ -418,6 +477,14 @@ void TailDuplication::runOnFunction(BinaryFunction &Function) {
     BinaryBasicBlock *Succ = BB->getSuccessor();
     if (isInCacheLine(*BB, *Succ))
       continue;
+
+    // Only act on counts backed by actual LBR records. Duplicating a path
+    // whose counts were inferred or guessed risks pessimizing the layout the
+    // duplication was supposed to improve.
+    if (BB->getProfileConfidence() < BinaryBasicBlock::PROF_CONF_EXACT ||
+        Succ->getProfileConfidence() < BinaryBasicBlock::PROF_CONF_EXACT)
+      continue;
+
     std::vector<BinaryBasicBlock *> BlocksToDuplicate;
     if (opts::TailDuplicationAggressive)
       BlocksToDuplicate = aggressiveCodeToDuplicate(*Succ);
@@ -426,6 +493,22 @@ void TailDuplication::runOnFunction(BinaryFunction &Function) {
 
     if (BlocksToDuplicate.size() == 0)
       continue;
+
+    if (opts::TailDuplicationCostModel) {
+      const uint64_t DuplicationByteCount = std::accumulate(
+          BlocksToDuplicate.begin(), BlocksToDuplicate.end(), uint64_t(0),
+          [](uint64_t Bytes, const BinaryBasicBlock *Block) {
+            return Bytes + Block->getOriginalSize();
+          });
+      if (BytesDuplicated + DuplicationByteCount > BytesBudget ||
+          !isProfitable(*BB, BlocksToDuplicate, DuplicationByteCount)) {
+        DuplicationsRejectedByCostModel++;
+        continue;
+      }
+      BytesDuplicated += DuplicationByteCount;
+      BytesDuplicatedTotal += DuplicationByteCount;
+    }
+
     PossibleDuplications++;
     PossibleDuplicationsDynamicCount += BB->getExecutionCount();
     std::vector<BinaryBasicBlock *> DuplicatedBlocks =
@@ -465,6 +548,12 @@ void TailDuplication::runOnFunctions(BinaryContext &BC) {
          << format("%.1f", ((float)PossibleDuplicationsDynamicCount * 100.0f) /
                                AllBlocksDynamicCount)
          << "%\n";
+  if (opts::TailDuplicationCostModel) {
+    outs() << "BOLT-INFO: tail duplication rejected by cost model: "
+           << DuplicationsRejectedByCostModel << "\n";
+    outs() << "BOLT-INFO: tail duplication bytes duplicated: "
+           << BytesDuplicatedTotal << "\n";
+  }
   outs() << "BOLT-INFO: tail duplication static propagation deletions: "
          << StaticInstructionDeletionCount << "\n";
   outs() << "BOLT-INFO: tail duplication dynamic propagation deletions: "
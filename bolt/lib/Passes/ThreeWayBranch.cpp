@@ -11,8 +11,10 @@
 //===----------------------------------------------------------------------===//
 
 #include "bolt/Passes/ThreeWayBranch.h"
+#include "llvm/MC/MCRegisterInfo.h"
 
 #include <numeric>
+#include <set>
 
 using namespace llvm;
 
@@ -29,6 +31,202 @@ bool ThreeWayBranch::shouldRunOnFunction(BinaryFunction &Function) {
   return true;
 }
 
+bool ThreeWayBranch::rebalanceLadder(BinaryFunction &Function,
+                                     BinaryBasicBlock *Entry) {
+  BinaryContext &BC = Function.getBinaryContext();
+  MCContext *Ctx = BC.Ctx.get();
+
+  // The ladder entry must be hot
+  if (Entry->getExecutionCount() == 0 ||
+      Entry->getExecutionCount() == BinaryBasicBlock::COUNT_NO_PROFILE)
+    return false;
+  // with two successors
+  if (Entry->succ_size() != 2)
+    return false;
+  // no jump table
+  if (Entry->hasJumpTable())
+    return false;
+
+  MCInst *EntryJump = Entry->getLastNonPseudoInstr();
+  if (!EntryJump || !BC.MIB->isConditionalBranch(*EntryJump))
+    return false;
+
+  // Return the comparison of \p BB if it is a ladder rung: a block with a
+  // single predecessor that only compares a value against a constant and
+  // branches on equality, continuing the ladder on the fallthrough side.
+  auto getRungCompare = [&](BinaryBasicBlock *BB) -> MCInst * {
+    if (BB->pred_size() != 1 || BB->succ_size() != 2 || BB->hasJumpTable())
+      return nullptr;
+    MCInst *Compare = nullptr;
+    MCInst *Jump = nullptr;
+    for (MCInst &Inst : *BB) {
+      if (BC.MIB->isPseudo(Inst))
+        continue;
+      if (!Compare)
+        Compare = &Inst;
+      else if (!Jump)
+        Jump = &Inst;
+      else
+        return nullptr;
+    }
+    if (!Compare || !Jump)
+      return nullptr;
+    const MCInstrDesc &CompareDesc = BC.MII->get(Compare->getOpcode());
+    if (!CompareDesc.isCompare() || CompareDesc.getNumDefs() != 0 ||
+        CompareDesc.mayLoad() || CompareDesc.mayStore() ||
+        CompareDesc.hasUnmodeledSideEffects())
+      return nullptr;
+    if (!BC.MIB->isConditionalBranch(*Jump))
+      return nullptr;
+    unsigned CC = BC.MIB->getCondCode(*Jump);
+    if (!BC.MIB->isValidCondCode(CC) || !BC.MIB->isEqualityCondCode(CC))
+      return nullptr;
+    // The jump must only read flags set by the rung's own comparison
+    const MCInstrDesc &JumpDesc = BC.MII->get(Jump->getOpcode());
+    for (unsigned I = 0, E = JumpDesc.getNumImplicitUses(); I != E; ++I) {
+      MCPhysReg Reg = JumpDesc.getImplicitUses()[I];
+      bool SetByCompare = false;
+      for (unsigned J = 0, DE = CompareDesc.getNumImplicitDefs(); J != DE; ++J)
+        if (CompareDesc.getImplicitDefs()[J] == Reg)
+          SetByCompare = true;
+      if (!SetByCompare)
+        return nullptr;
+    }
+    return Compare;
+  };
+
+  struct Rung {
+    BinaryBasicBlock *Block;
+    MCInst *Compare;
+    uint64_t TakenCount;
+  };
+
+  // The ladder may hang off either side of the entry branch
+  BinaryBasicBlock *Start = Entry->getConditionalSuccessor(false);
+  if (!getRungCompare(Start))
+    Start = Entry->getConditionalSuccessor(true);
+
+  // Collect the rungs of the ladder
+  std::vector<Rung> Rungs;
+  BinaryBasicBlock *Next = Start;
+  while (MCInst *Compare = getRungCompare(Next)) {
+    uint64_t TakenCount = Next->getTakenBranchInfo().Count;
+    if (TakenCount == BinaryBasicBlock::COUNT_NO_PROFILE)
+      TakenCount = 0;
+    Rungs.push_back(Rung{Next, Compare, TakenCount});
+    Next = Next->getConditionalSuccessor(false);
+  }
+  // Reordering a pair of rungs is the smallest profitable ladder
+  if (Rungs.size() < 2)
+    return false;
+  BinaryBasicBlock *Default = Next;
+
+  // The rungs are mutually exclusive only if they all compare the same value
+  // against pairwise distinct constants; require the comparisons to be
+  // identical except for a single immediate operand. Reject comparisons whose
+  // register inputs overlap their own implicit definitions, since every rung
+  // must read the same unclobbered value.
+  const MCInst &RefCompare = *Rungs.front().Compare;
+  const MCInstrDesc &RefDesc = BC.MII->get(RefCompare.getOpcode());
+  int ImmIndex = -1;
+  for (unsigned I = 0, E = RefCompare.getNumOperands(); I != E; ++I) {
+    const MCOperand &Operand = RefCompare.getOperand(I);
+    if (Operand.isImm()) {
+      if (ImmIndex != -1)
+        return false;
+      ImmIndex = I;
+    } else if (Operand.isReg()) {
+      for (unsigned J = 0, DE = RefDesc.getNumImplicitDefs(); J != DE; ++J)
+        for (MCRegAliasIterator AI(RefDesc.getImplicitDefs()[J], BC.MRI.get(),
+                                   true);
+             AI.isValid(); ++AI)
+          if (*AI == Operand.getReg())
+            return false;
+    } else {
+      return false;
+    }
+  }
+  if (ImmIndex == -1)
+    return false;
+
+  std::set<int64_t> Immediates;
+  for (const Rung &R : Rungs) {
+    const MCInst &Compare = *R.Compare;
+    if (Compare.getOpcode() != RefCompare.getOpcode() ||
+        Compare.getNumOperands() != RefCompare.getNumOperands())
+      return false;
+    for (unsigned I = 0, E = Compare.getNumOperands(); I != E; ++I) {
+      const MCOperand &Operand = Compare.getOperand(I);
+      if ((int)I == ImmIndex) {
+        if (!Operand.isImm() || !Immediates.insert(Operand.getImm()).second)
+          return false;
+      } else if (!Operand.isReg() ||
+                 Operand.getReg() != RefCompare.getOperand(I).getReg()) {
+        return false;
+      }
+    }
+  }
+
+  // A match target inside the ladder would change meaning once the rungs are
+  // reordered
+  for (const Rung &R : Rungs) {
+    BinaryBasicBlock *Target = R.Block->getConditionalSuccessor(true);
+    if (Target == Default)
+      return false;
+    for (const Rung &Other : Rungs)
+      if (Target == Other.Block)
+        return false;
+  }
+
+  // Order the rungs so the most likely match is tested first
+  std::vector<Rung> Sorted = Rungs;
+  std::stable_sort(Sorted.begin(), Sorted.end(),
+                   [](const Rung &A, const Rung &B) {
+                     return A.TakenCount > B.TakenCount;
+                   });
+  bool Changed = false;
+  for (size_t I = 0; I < Rungs.size(); ++I)
+    if (Sorted[I].Block != Rungs[I].Block)
+      Changed = true;
+  if (!Changed)
+    return false;
+
+  uint64_t DefaultCount = Rungs.back().Block->getFallthroughBranchInfo().Count;
+  if (DefaultCount == BinaryBasicBlock::COUNT_NO_PROFILE)
+    DefaultCount = 0;
+  uint64_t Total = DefaultCount;
+  for (const Rung &R : Rungs)
+    Total += R.TakenCount;
+
+  // Point the entry at the hottest rung
+  if (Sorted.front().Block != Start) {
+    const BinaryBasicBlock::BinaryBranchInfo EntryBI =
+        Entry->getBranchInfo(*Start);
+    bool StartIsTaken = Start == Entry->getConditionalSuccessor(true);
+    Entry->replaceSuccessor(Start, Sorted.front().Block, EntryBI.Count,
+                            EntryBI.MispredictedCount);
+    if (StartIsTaken)
+      BC.MIB->replaceBranchTarget(*EntryJump, Sorted.front().Block->getLabel(),
+                                  Ctx);
+  }
+
+  // Chain the rungs in the new order; each rung keeps its own comparison and
+  // match target, so only the fallthrough successors change. The fallthrough
+  // jumps themselves are materialized later when branches are fixed up.
+  uint64_t Remaining = Total;
+  for (size_t I = 0; I < Sorted.size(); ++I) {
+    BinaryBasicBlock *Block = Sorted[I].Block;
+    BinaryBasicBlock *NewNext =
+        I + 1 < Sorted.size() ? Sorted[I + 1].Block : Default;
+    Block->setExecutionCount(Remaining);
+    Remaining -= std::min(Sorted[I].TakenCount, Remaining);
+    Block->replaceSuccessor(Block->getConditionalSuccessor(false), NewNext,
+                            Remaining);
+  }
+
+  return true;
+}
+
 void ThreeWayBranch::runOnFunction(BinaryFunction &Function) {
   BinaryContext &BC = Function.getBinaryContext();
   MCContext *Ctx = BC.Ctx.get();
@@ -149,6 +347,12 @@ void ThreeWayBranch::runOnFunction(BinaryFunction &Function) {
 
     ++BranchesAltered;
   }
+
+  // Look for longer equality-comparison ladders and reorder their rungs by
+  // decreasing execution count
+  for (BinaryBasicBlock *BB : BlockLayout)
+    if (rebalanceLadder(Function, BB))
+      ++LaddersAltered;
 }
 
 void ThreeWayBranch::runOnFunctions(BinaryContext &BC) {
@@ -161,6 +365,8 @@ void ThreeWayBranch::runOnFunctions(BinaryContext &BC) {
 
   outs() << "BOLT-INFO: number of three way branches order changed: "
          << BranchesAltered << "\n";
+  outs() << "BOLT-INFO: number of comparison ladders rebalanced: "
+         << LaddersAltered << "\n";
 }
 
 } // end namespace bolt
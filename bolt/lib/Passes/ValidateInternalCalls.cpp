@@ -11,9 +11,12 @@
 //===----------------------------------------------------------------------===//
 
 #include "bolt/Passes/ValidateInternalCalls.h"
+#include "bolt/Core/ParallelUtilities.h"
 #include "bolt/Passes/DataflowInfoManager.h"
 #include "bolt/Passes/FrameAnalysis.h"
+#include "bolt/Utils/CommandLineOpts.h"
 #include "llvm/MC/MCInstPrinter.h"
+#include <mutex>
 
 #define DEBUG_TYPE "bolt-internalcalls"
 
@@ -298,19 +301,25 @@ void ValidateInternalCalls::runOnFunctions(BinaryContext &BC) {
     return;
 
   // Look for functions that need validation. This should be pretty rare.
+  // The scan itself is cheap and only reads the instructions, so it runs
+  // over all functions in parallel.
   std::set<BinaryFunction *> NeedsValidation;
-  for (auto &BFI : BC.getBinaryFunctions()) {
-    BinaryFunction &Function = BFI.second;
-    for (BinaryBasicBlock &BB : Function) {
-      for (MCInst &Inst : BB) {
-        if (getInternalCallTarget(Function, Inst)) {
-          NeedsValidation.insert(&Function);
-          Function.setSimple(false);
-          break;
+  std::mutex NeedsValidationMutex;
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR,
+      [&](BinaryFunction &Function) {
+        for (BinaryBasicBlock &BB : Function) {
+          for (MCInst &Inst : BB) {
+            if (getInternalCallTarget(Function, Inst)) {
+              Function.setSimple(false);
+              std::lock_guard<std::mutex> Lock(NeedsValidationMutex);
+              NeedsValidation.insert(&Function);
+              return;
+            }
+          }
         }
-      }
-    }
-  }
+      },
+      ParallelUtilities::PredicateTy(), "ValidateInternalCalls");
 
   // Skip validation for non-relocation mode
   if (!BC.HasRelocations)
@@ -322,11 +331,18 @@ void ValidateInternalCalls::runOnFunctions(BinaryContext &BC) {
   // value, so it is not really a call, but a jump. If we find that it's not the
   // case, we mark this function as non-simple and stop processing it.
   std::set<BinaryFunction *> Invalid;
-  for (BinaryFunction *Function : NeedsValidation) {
-    LLVM_DEBUG(dbgs() << "Validating " << *Function << "\n");
-    if (!analyzeFunction(*Function))
-      Invalid.insert(Function);
-    clearAnnotations(*Function);
+  if (opts::Validate == opts::VL_FULL) {
+    for (BinaryFunction *Function : NeedsValidation) {
+      LLVM_DEBUG(dbgs() << "Validating " << *Function << "\n");
+      if (!analyzeFunction(*Function))
+        Invalid.insert(Function);
+      clearAnnotations(*Function);
+    }
+  } else {
+    // Without the dataflow analysis proving that an internal call is just a
+    // PC-computation trick, conservatively treat all flagged functions as
+    // unsupported.
+    Invalid = std::move(NeedsValidation);
   }
 
   if (!Invalid.empty()) {
@@ -336,6 +352,9 @@ void ValidateInternalCalls::runOnFunctions(BinaryContext &BC) {
       errs() << "              " << *Function << "\n";
       Function->setIgnored();
     }
+    if (opts::Validate != opts::VL_FULL)
+      errs() << "BOLT-WARNING: some of the functions may be recoverable with "
+                "-validate=full\n";
   }
 }
 
@@ -12,6 +12,8 @@
 //===----------------------------------------------------------------------===//
 
 #include "bolt/Passes/VeneerElimination.h"
+#include "bolt/Core/ParallelUtilities.h"
+#include <atomic>
 #define DEBUG_TYPE "veneer-elim"
 
 using namespace llvm;
@@ -55,7 +57,7 @@ void VeneerElimination::runOnFunctions(BinaryContext &BC) {
       for (StringRef Name : VeneerFunction.getNames()) {
         MCSymbol *Symbol = BC.Ctx->lookupSymbol(Name);
         VeneerDestinations[Symbol] = VeneerTargetSymbol;
-        BC.SymbolToFunctionMap.erase(Symbol);
+        BC.removeSymbolFromFunctionMap(Symbol);
       }
 
       BC.BinaryDataMap.erase(VeneerFunction.getAddress());
@@ -76,25 +78,32 @@ void VeneerElimination::runOnFunctions(BinaryContext &BC) {
     VeneerDestinations[src] = dest;
   }
 
-  uint64_t VeneerCallers = 0;
-  for (auto &It : BFs) {
-    BinaryFunction &Function = It.second;
+  // Rewrite direct calls to veneers in a parallel sweep. The destination
+  // table is read-only by now; only the branch target replacement allocates
+  // in the shared MCContext and takes the context lock.
+  std::atomic<uint64_t> VeneerCallers{0};
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &Function) {
     for (BinaryBasicBlock &BB : Function) {
       for (MCInst &Instr : BB) {
         if (!BC.MIB->isCall(Instr) || BC.MIB->isIndirectCall(Instr))
           continue;
 
         const MCSymbol *TargetSymbol = BC.MIB->getTargetSymbol(Instr, 0);
-        if (VeneerDestinations.find(TargetSymbol) == VeneerDestinations.end())
+        auto VDI = VeneerDestinations.find(TargetSymbol);
+        if (VDI == VeneerDestinations.end())
           continue;
 
         VeneerCallers++;
-        if (!BC.MIB->replaceBranchTarget(
-                Instr, VeneerDestinations[TargetSymbol], BC.Ctx.get()))
+        auto L = BC.scopeLock();
+        if (!BC.MIB->replaceBranchTarget(Instr, VDI->second, BC.Ctx.get()))
           assert(false && "updating veneer call destination failed");
       }
     }
-  }
+  };
+
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun, nullptr,
+      "VeneerElimination");
 
   LLVM_DEBUG(
       dbgs() << "BOLT-INFO: number of linker-inserted veneers call sites :"
@@ -8,8 +8,13 @@
 
 #include "bolt/Profile/BoltAddressTranslation.h"
 #include "bolt/Core/BinaryFunction.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/Endian.h"
 #include "llvm/Support/Errc.h"
+#include "llvm/Support/LEB128.h"
+#include <algorithm>
 
 #define DEBUG_TYPE "bolt-bat"
 
@@ -18,6 +23,98 @@ namespace bolt {
 
 const char *BoltAddressTranslation::SECTION_NAME = ".note.bolt_bat";
 
+namespace {
+
+/// Size in bytes of one record in the serialized function directory: 64-bit
+/// function output address, 32-bit offset into the entry pool and 32-bit
+/// number of entries.
+constexpr uint64_t FuncRecordSize = 16;
+
+/// Number of translation entries covered by one skip-index record. Larger
+/// blocks shrink the index, smaller blocks cut the decode work per point
+/// lookup.
+constexpr size_t SkipInterval = 32;
+
+/// Size in bytes of one skip-index record: 32-bit output offset of the
+/// block's first entry and 32-bit byte position of that entry in the delta
+/// stream.
+constexpr uint64_t SkipRecordSize = 8;
+
+uint64_t zigzagEncode(int64_t Value) {
+  return (uint64_t(Value) << 1) ^ uint64_t(Value >> 63);
+}
+
+int64_t zigzagDecode(uint64_t Value) {
+  return int64_t(Value >> 1) ^ -int64_t(Value & 1);
+}
+
+/// Decoder over one function's serialized skip index and delta stream.
+class EntryStream {
+public:
+  EntryStream(StringRef Data, uint32_t NumEntries)
+      : Data(Data), NumEntries(NumEntries),
+        NumBlocks((NumEntries + SkipInterval - 1) / SkipInterval) {}
+
+  size_t getNumBlocks() const { return NumBlocks; }
+
+  /// Output offset of the first entry of \p Block.
+  uint32_t getBlockKey(size_t Block) const {
+    return support::endian::read32le(Data.data() + Block * SkipRecordSize);
+  }
+
+  /// Return the index of the first block whose first key is greater than
+  /// \p Offset, or the number of blocks if there is none.
+  size_t upperBoundBlock(uint64_t Offset) const {
+    size_t Lo = 0;
+    size_t Hi = NumBlocks;
+    while (Lo < Hi) {
+      const size_t Mid = Lo + (Hi - Lo) / 2;
+      if (getBlockKey(Mid) <= Offset)
+        Lo = Mid + 1;
+      else
+        Hi = Mid;
+    }
+    return Lo;
+  }
+
+  /// Decode the entries of \p Block in order, calling \p Callback with the
+  /// output offset, the input offset and the branch flag of every entry.
+  /// Stops early when the callback returns true.
+  void forEachEntryInBlock(
+      size_t Block,
+      function_ref<bool(uint32_t Key, uint32_t InputOffset, bool IsBranch)>
+          Callback) const {
+    const uint32_t StreamPos =
+        support::endian::read32le(Data.data() + Block * SkipRecordSize + 4);
+    const uint8_t *Pos = reinterpret_cast<const uint8_t *>(Data.data()) +
+                         NumBlocks * SkipRecordSize + StreamPos;
+    const uint8_t *End = reinterpret_cast<const uint8_t *>(Data.end());
+    const size_t BlockEntries =
+        std::min(SkipInterval, NumEntries - Block * SkipInterval);
+    uint32_t Key = getBlockKey(Block);
+    for (size_t I = 0; I < BlockEntries && Pos < End; ++I) {
+      unsigned N;
+      const uint64_t KeyDelta = decodeULEB128(Pos, &N, End);
+      Pos += N;
+      // The key of the block's first entry comes from the skip record.
+      if (I != 0)
+        Key += KeyDelta;
+      const uint64_t Enc = decodeULEB128(Pos, &N, End);
+      Pos += N;
+      const uint32_t InputOffset = uint32_t(Key + zigzagDecode(Enc >> 1));
+      if (Callback(Key, InputOffset, Enc & 1))
+        return;
+    }
+  }
+
+private:
+  StringRef Data;
+  uint32_t NumEntries;
+  size_t NumBlocks;
+};
+
+} // anonymous namespace
+
 void BoltAddressTranslation::writeEntriesForBB(MapTy &Map,
                                                const BinaryBasicBlock &BB,
                                                uint64_t FuncAddress) {
@@ -58,11 +155,12 @@ void BoltAddressTranslation::writeEntriesForBB(MapTy &Map,
 
 void BoltAddressTranslation::write(raw_ostream &OS) {
   LLVM_DEBUG(dbgs() << "BOLT-DEBUG: Writing BOLT Address Translation Tables\n");
-  for (auto &BFI : BC.getBinaryFunctions()) {
+  assert(BC && "writing the table requires a binary context");
+  for (auto &BFI : BC->getBinaryFunctions()) {
     BinaryFunction &Function = BFI.second;
     // We don't need a translation table if the body of the function hasn't
     // changed
-    if (!BC.HasRelocations && !Function.isSimple())
+    if (!BC->HasRelocations && !Function.isSimple())
       continue;
 
     LLVM_DEBUG(dbgs() << "Function name: " << Function.getPrintName() << "\n");
@@ -93,22 +191,61 @@ void BoltAddressTranslation::write(raw_ostream &OS) {
         Function.cold().getAddress(), Function.getOutputAddress()));
   }
 
+  // Serialize each function's map into its slice of the entry pool: the
+  // skip index first, then the stream of delta-encoded entries. Entries are
+  // sorted by key as a side effect of the map iteration order.
+  SmallString<0> Pool;
+  std::vector<uint32_t> DataOffsets;
+  DataOffsets.reserve(Maps.size());
+  for (auto &MapEntry : Maps) {
+    DataOffsets.push_back(Pool.size());
+    SmallVector<std::pair<uint32_t, uint32_t>, 8> SkipRecords;
+    SmallString<128> Stream;
+    raw_svector_ostream StreamOS(Stream);
+    size_t Index = 0;
+    uint32_t PrevKey = 0;
+    for (std::pair<const uint32_t, uint32_t> &KeyVal : MapEntry.second) {
+      const uint32_t Key = KeyVal.first;
+      const uint32_t Val = KeyVal.second;
+      if (Index % SkipInterval == 0)
+        SkipRecords.emplace_back(Key, uint32_t(Stream.size()));
+      encodeULEB128(Key - PrevKey, StreamOS);
+      const uint32_t InputOffset = Val & ~BRANCHENTRY;
+      encodeULEB128(
+          (zigzagEncode(int64_t(InputOffset) - int64_t(Key)) << 1) |
+              (Val >> 31),
+          StreamOS);
+      PrevKey = Key;
+      ++Index;
+    }
+    char Record[SkipRecordSize];
+    for (const std::pair<uint32_t, uint32_t> &Skip : SkipRecords) {
+      support::endian::write32le(Record, Skip.first);
+      support::endian::write32le(Record + 4, Skip.second);
+      Pool.append(Record, Record + SkipRecordSize);
+    }
+    Pool.append(Stream.begin(), Stream.end());
+  }
+
   const uint32_t NumFuncs = Maps.size();
   OS.write(reinterpret_cast<const char *>(&NumFuncs), 4);
   LLVM_DEBUG(dbgs() << "Writing " << NumFuncs << " functions for BAT.\n");
+  // Directory of fixed-size records, sorted by function address, so the
+  // reader can binary-search it directly in the mmapped section.
+  size_t FuncIndex = 0;
   for (auto &MapEntry : Maps) {
     const uint64_t Address = MapEntry.first;
-    MapTy &Map = MapEntry.second;
-    const uint32_t NumEntries = Map.size();
+    const uint32_t NumEntries = MapEntry.second.size();
+    const uint32_t EntryOffset = DataOffsets[FuncIndex++];
     LLVM_DEBUG(dbgs() << "Writing " << NumEntries << " entries for 0x"
                       << Twine::utohexstr(Address) << ".\n");
     OS.write(reinterpret_cast<const char *>(&Address), 8);
+    OS.write(reinterpret_cast<const char *>(&EntryOffset), 4);
     OS.write(reinterpret_cast<const char *>(&NumEntries), 4);
-    for (std::pair<const uint32_t, uint32_t> &KeyVal : Map) {
-      OS.write(reinterpret_cast<const char *>(&KeyVal.first), 4);
-      OS.write(reinterpret_cast<const char *>(&KeyVal.second), 4);
-    }
   }
+  const uint32_t PoolSize = Pool.size();
+  OS.write(reinterpret_cast<const char *>(&PoolSize), 4);
+  OS.write(Pool.data(), Pool.size());
   const uint32_t NumColdEntries = ColdPartSource.size();
   LLVM_DEBUG(dbgs() << "Writing " << NumColdEntries
                     << " cold part mappings.\n");
@@ -123,6 +260,10 @@ void BoltAddressTranslation::write(raw_ostream &OS) {
   outs() << "BOLT-INFO: Wrote " << Maps.size() << " BAT maps\n";
   outs() << "BOLT-INFO: Wrote " << NumColdEntries
          << " BAT cold-to-hot entries\n";
+  outs() << "BOLT-INFO: BAT section size (bytes): "
+         << (4 + NumFuncs * FuncRecordSize + 4 + PoolSize + 4 +
+             NumColdEntries * 16)
+         << '\n';
 }
 
 std::error_code BoltAddressTranslation::parse(StringRef Buf) {
@@ -149,27 +290,41 @@ std::error_code BoltAddressTranslation::parse(StringRef Buf) {
 
   const uint32_t NumFunctions = DE.getU32(&Offset);
   LLVM_DEBUG(dbgs() << "Parsing " << NumFunctions << " functions\n");
-  for (uint32_t I = 0; I < NumFunctions; ++I) {
-    if (Buf.size() - Offset < 12)
-      return make_error_code(llvm::errc::io_error);
+  if (Buf.size() - Offset < NumFunctions * FuncRecordSize)
+    return make_error_code(llvm::errc::io_error);
 
-    const uint64_t Address = DE.getU64(&Offset);
-    const uint32_t NumEntries = DE.getU32(&Offset);
-    MapTy Map;
+  // Reference the function directory and the entry pool in place instead of
+  // materializing maps. Lookups binary-search the mmapped section directly.
+  FuncTable = Buf.substr(Offset, NumFunctions * FuncRecordSize);
+  Offset += FuncTable.size();
 
-    LLVM_DEBUG(dbgs() << "Parsing " << NumEntries << " entries for 0x"
-                      << Twine::utohexstr(Address) << "\n");
-    if (Buf.size() - Offset < 8 * NumEntries)
+  if (Buf.size() - Offset < 4)
+    return make_error_code(llvm::errc::io_error);
+  const uint32_t PoolSize = DE.getU32(&Offset);
+
+  // Validate the directory: addresses must be sorted for the binary search
+  // to work, pool offsets must not go backwards and every slice must be
+  // large enough to hold at least its skip index.
+  uint64_t PrevAddress = 0;
+  uint64_t PrevOffset = 0;
+  for (uint32_t I = 0; I < NumFunctions; ++I) {
+    const char *Record = FuncTable.data() + I * FuncRecordSize;
+    const uint64_t Address = support::endian::read64le(Record);
+    const uint32_t EntryOffset = support::endian::read32le(Record + 8);
+    const uint32_t NumEntries = support::endian::read32le(Record + 12);
+    const uint64_t NumBlocks = (NumEntries + SkipInterval - 1) / SkipInterval;
+    if ((I != 0 && Address <= PrevAddress) || EntryOffset < PrevOffset ||
+        EntryOffset + NumBlocks * SkipRecordSize > PoolSize)
       return make_error_code(llvm::errc::io_error);
-    for (uint32_t J = 0; J < NumEntries; ++J) {
-      const uint32_t OutputAddr = DE.getU32(&Offset);
-      const uint32_t InputAddr = DE.getU32(&Offset);
-      Map.insert(std::pair<uint32_t, uint32_t>(OutputAddr, InputAddr));
-      LLVM_DEBUG(dbgs() << Twine::utohexstr(OutputAddr) << " -> "
-                        << Twine::utohexstr(InputAddr) << "\n");
-    }
-    Maps.insert(std::pair<uint64_t, MapTy>(Address, Map));
+    PrevAddress = Address;
+    PrevOffset = EntryOffset;
+    LLVM_DEBUG(dbgs() << "Function at 0x" << Twine::utohexstr(Address)
+                      << " has " << NumEntries << " entries\n");
   }
+  if (Buf.size() - Offset < PoolSize)
+    return make_error_code(llvm::errc::io_error);
+  EntryPool = Buf.substr(Offset, PoolSize);
+  Offset += PoolSize;
 
   if (Buf.size() - Offset < 4)
     return make_error_code(llvm::errc::io_error);
@@ -186,34 +341,112 @@ std::error_code BoltAddressTranslation::parse(StringRef Buf) {
     LLVM_DEBUG(dbgs() << Twine::utohexstr(ColdAddress) << " -> "
                       << Twine::utohexstr(HotAddress) << "\n");
   }
-  outs() << "BOLT-INFO: Parsed " << Maps.size() << " BAT entries\n";
+  outs() << "BOLT-INFO: Parsed " << NumFunctions << " BAT entries\n";
   outs() << "BOLT-INFO: Parsed " << NumColdEntries
          << " BAT cold-to-hot entries\n";
 
   return std::error_code();
 }
 
+Optional<BoltAddressTranslation::EntryRegion>
+BoltAddressTranslation::getEntriesForAddress(uint64_t Address) const {
+  const size_t NumFunctions = FuncTable.size() / FuncRecordSize;
+  size_t Lo = 0;
+  size_t Hi = NumFunctions;
+  while (Lo < Hi) {
+    const size_t Mid = Lo + (Hi - Lo) / 2;
+    const uint64_t MidAddress =
+        support::endian::read64le(FuncTable.data() + Mid * FuncRecordSize);
+    if (MidAddress < Address)
+      Lo = Mid + 1;
+    else
+      Hi = Mid;
+  }
+  if (Lo == NumFunctions)
+    return NoneType();
+
+  const char *Record = FuncTable.data() + Lo * FuncRecordSize;
+  if (support::endian::read64le(Record) != Address)
+    return NoneType();
+
+  const uint32_t EntryOffset = support::endian::read32le(Record + 8);
+  const uint32_t NumEntries = support::endian::read32le(Record + 12);
+  // The slice ends where the next function's data starts, or at the end of
+  // the pool for the last function.
+  const uint32_t EntryEnd =
+      Lo + 1 < NumFunctions ? support::endian::read32le(
+                                  FuncTable.data() +
+                                  (Lo + 1) * FuncRecordSize + 8)
+                            : EntryPool.size();
+  EntryRegion Region;
+  Region.Data = StringRef(EntryPool.data() + EntryOffset,
+                          EntryEnd - EntryOffset);
+  Region.NumEntries = NumEntries;
+  return Region;
+}
+
+const std::vector<std::pair<uint32_t, uint32_t>> *
+BoltAddressTranslation::getDecodedMap(uint64_t Address) const {
+  auto Iter = DecodedMaps.find(Address);
+  if (Iter != DecodedMaps.end())
+    return &Iter->second;
+
+  Optional<EntryRegion> Region = getEntriesForAddress(Address);
+  if (!Region)
+    return nullptr;
+
+  std::vector<std::pair<uint32_t, uint32_t>> &Entries = DecodedMaps[Address];
+  Entries.reserve(Region->NumEntries);
+  const EntryStream Stream(Region->Data, Region->NumEntries);
+  for (size_t Block = 0; Block < Stream.getNumBlocks(); ++Block)
+    Stream.forEachEntryInBlock(
+        Block, [&](uint32_t Key, uint32_t InputOffset, bool IsBranch) {
+          Entries.emplace_back(Key,
+                               InputOffset | (IsBranch ? BRANCHENTRY : 0));
+          return false;
+        });
+  return &Entries;
+}
+
 uint64_t BoltAddressTranslation::translate(const BinaryFunction &Func,
                                            uint64_t Offset,
                                            bool IsBranchSrc) const {
-  auto Iter = Maps.find(Func.getAddress());
-  if (Iter == Maps.end())
-    return Offset;
-
-  const MapTy &Map = Iter->second;
-  auto KeyVal = Map.upper_bound(Offset);
-  if (KeyVal == Map.begin())
-    return Offset;
-
-  --KeyVal;
-
-  const uint32_t Val = KeyVal->second & ~BRANCHENTRY;
-  // Branch source addresses are translated to the first instruction of the
-  // source BB to avoid accounting for modifications BOLT may have made in the
-  // BB regarding deletion/addition of instructions.
-  if (IsBranchSrc)
-    return Val;
-  return Offset - KeyVal->first + Val;
+  const std::pair<uint64_t, uint64_t> CacheKey(Func.getAddress() + Offset,
+                                               IsBranchSrc);
+  auto CacheIter = TranslationCache.find(CacheKey);
+  if (CacheIter != TranslationCache.end())
+    return CacheIter->second;
+
+  uint64_t Result = Offset;
+  if (Optional<EntryRegion> Region =
+          getEntriesForAddress(Func.getAddress())) {
+    const EntryStream Stream(Region->Data, Region->NumEntries);
+    // The last entry with a key less than or equal to Offset lives in the
+    // last block whose first key is less than or equal to Offset.
+    const size_t Block = Stream.upperBoundBlock(Offset);
+    if (Block != 0) {
+      uint32_t MatchKey = 0;
+      uint32_t MatchVal = 0;
+      bool Found = false;
+      Stream.forEachEntryInBlock(
+          Block - 1, [&](uint32_t Key, uint32_t InputOffset, bool) {
+            if (Key > Offset)
+              return true;
+            MatchKey = Key;
+            MatchVal = InputOffset;
+            Found = true;
+            return false;
+          });
+      // Branch source addresses are translated to the first instruction of
+      // the source BB to avoid accounting for modifications BOLT may have
+      // made in the BB regarding deletion/addition of instructions.
+      if (Found)
+        Result = IsBranchSrc ? MatchVal : Offset - MatchKey + MatchVal;
+    }
+  }
+
+  TranslationCache[CacheKey] = Result;
+  return Result;
 }
 
 Optional<BoltAddressTranslation::FallthroughListTy>
@@ -229,47 +462,110 @@ BoltAddressTranslation::getFallthroughsInTrace(const BinaryFunction &Func,
   From -= Func.getAddress();
   To -= Func.getAddress();
 
-  auto Iter = Maps.find(Func.getAddress());
-  if (Iter == Maps.end())
+  // Traces need random access over block boundaries in both directions, so
+  // work on the lazily materialized map instead of the delta stream.
+  const std::vector<std::pair<uint32_t, uint32_t>> *Map =
+      getDecodedMap(Func.getAddress());
+  if (!Map)
     return NoneType();
 
-  const MapTy &Map = Iter->second;
-  auto FromIter = Map.upper_bound(From);
-  if (FromIter == Map.begin())
+  const std::vector<std::pair<uint32_t, uint32_t>> &Entries = *Map;
+  auto upperBoundEntry = [&Entries](uint64_t Offset) {
+    return size_t(std::upper_bound(
+                      Entries.begin(), Entries.end(), Offset,
+                      [](uint64_t Offset,
+                         const std::pair<uint32_t, uint32_t> &Entry) {
+                        return Offset < Entry.first;
+                      }) -
+                  Entries.begin());
+  };
+  size_t FromIndex = upperBoundEntry(From);
+  if (FromIndex == 0)
     return Res;
   // Skip instruction entries, to create fallthroughs we are only interested in
   // BB boundaries
   do {
-    if (FromIter == Map.begin())
+    if (FromIndex == 0)
       return Res;
-    --FromIter;
-  } while (FromIter->second & BRANCHENTRY);
+    --FromIndex;
+  } while (Entries[FromIndex].second & BRANCHENTRY);
 
-  auto ToIter = Map.upper_bound(To);
-  if (ToIter == Map.begin())
+  size_t ToIndex = upperBoundEntry(To);
+  if (ToIndex == 0)
     return Res;
-  --ToIter;
-  if (FromIter->first >= ToIter->first)
+  --ToIndex;
+  if (Entries[FromIndex].first >= Entries[ToIndex].first)
     return Res;
 
-  for (auto Iter = FromIter; Iter != ToIter;) {
-    const uint32_t Src = Iter->first;
-    if (Iter->second & BRANCHENTRY) {
-      ++Iter;
+  for (size_t Index = FromIndex; Index != ToIndex;) {
+    const uint32_t Src = Entries[Index].first;
+    if (Entries[Index].second & BRANCHENTRY) {
+      ++Index;
       continue;
     }
 
-    ++Iter;
-    while (Iter->second & BRANCHENTRY && Iter != ToIter)
-      ++Iter;
-    if (Iter->second & BRANCHENTRY)
+    ++Index;
+    while (Entries[Index].second & BRANCHENTRY && Index != ToIndex)
+      ++Index;
+    if (Entries[Index].second & BRANCHENTRY)
       break;
-    Res.emplace_back(Src, Iter->first);
+    Res.emplace_back(Src, Entries[Index].first);
   }
 
   return Res;
 }
 
+Optional<BoltAddressTranslation::AddressMapping>
+BoltAddressTranslation::translateAddress(uint64_t Address) const {
+  // Floor search: the last directory record with an address less than or
+  // equal to the queried address.
+  const size_t NumFunctions = FuncTable.size() / FuncRecordSize;
+  size_t Lo = 0;
+  size_t Hi = NumFunctions;
+  while (Lo < Hi) {
+    const size_t Mid = Lo + (Hi - Lo) / 2;
+    const uint64_t MidAddress =
+        support::endian::read64le(FuncTable.data() + Mid * FuncRecordSize);
+    if (MidAddress <= Address)
+      Lo = Mid + 1;
+    else
+      Hi = Mid;
+  }
+  if (Lo == 0)
+    return NoneType();
+
+  const char *Record = FuncTable.data() + (Lo - 1) * FuncRecordSize;
+  const uint64_t FuncAddress = support::endian::read64le(Record);
+  const uint32_t EntryOffset = support::endian::read32le(Record + 8);
+  const uint32_t NumEntries = support::endian::read32le(Record + 12);
+  const uint32_t EntryEnd =
+      Lo < NumFunctions ? support::endian::read32le(FuncTable.data() +
+                                                    Lo * FuncRecordSize + 8)
+                        : EntryPool.size();
+
+  const uint64_t Offset = Address - FuncAddress;
+  uint64_t InputOffset = Offset;
+  const EntryStream Stream(
+      StringRef(EntryPool.data() + EntryOffset, EntryEnd - EntryOffset),
+      NumEntries);
+  const size_t Block = Stream.upperBoundBlock(Offset);
+  if (Block != 0) {
+    Stream.forEachEntryInBlock(
+        Block - 1, [&](uint32_t Key, uint32_t EntryInput, bool) {
+          if (Key > Offset)
+            return true;
+          InputOffset = Offset - Key + EntryInput;
+          return false;
+        });
+  }
+
+  // Attribute addresses in outlined cold fragments to the hot part of
+  // their original function.
+  const uint64_t ParentAddress = fetchParentAddress(FuncAddress);
+  return AddressMapping{ParentAddress ? ParentAddress : FuncAddress,
+                        InputOffset};
+}
+
 uint64_t BoltAddressTranslation::fetchParentAddress(uint64_t Address) const {
   auto Iter = ColdPartSource.find(Address);
   if (Iter == ColdPartSource.end())
@@ -14,21 +14,36 @@
 #include "bolt/Profile/DataAggregator.h"
 #include "bolt/Core/BinaryContext.h"
 #include "bolt/Core/BinaryFunction.h"
+#include "bolt/Core/ParallelUtilities.h"
 #include "bolt/Profile/BoltAddressTranslation.h"
 #include "bolt/Profile/Heatmap.h"
+#include "bolt/Profile/PerfDataReader.h"
 #include "bolt/Utils/CommandLineOpts.h"
 #include "bolt/Utils/Utils.h"
 #include "llvm/ADT/ScopeExit.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/Process.h"
 #include "llvm/Support/Program.h"
 #include "llvm/Support/Regex.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <iterator>
 #include <map>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <vector>
+
+#if defined(__unix__)
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define DEBUG_TYPE "aggregator"
 
@@ -37,6 +52,14 @@ using namespace bolt;
 
 namespace opts {
 
+static cl::opt<bool>
+ArmSPE("spe",
+  cl::desc("aggregate branch samples synthesized from Arm SPE (Statistical "
+           "Profiling Extension) records on hardware without LBR"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
 static cl::opt<bool>
 BasicAggregation("nl",
   cl::desc("aggregate basic samples (without LBR info)"),
@@ -79,6 +102,13 @@ MaxSamples("max-samples",
   cl::Hidden,
   cl::cat(AggregatorCategory));
 
+static cl::opt<bool>
+NativePerfReader("native-perf-reader",
+  cl::desc("read perf.data directly instead of spawning perf script"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
 static cl::opt<bool>
 ReadPreAggregated("pa",
   cl::desc("skip perf and read data from a pre-aggregated file format"),
@@ -86,6 +116,24 @@ ReadPreAggregated("pa",
   cl::ZeroOrMore,
   cl::cat(AggregatorCategory));
 
+static cl::opt<bool>
+StreamPerfOutput("stream-perf-output",
+  cl::desc("parse perf script output as it is produced instead of buffering "
+           "it in a file"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned>
+TimeSlices("time-slices",
+  cl::desc("split the aggregated LBR profile into N consecutive time windows "
+           "and write each one as an additional <output>-slice<I>.fdata file "
+           "for phase-aware layout experiments (blend the slices with "
+           "merge-fdata -weights)"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
 static cl::opt<bool>
 TimeAggregator("time-aggr",
   cl::desc("time BOLT aggregator"),
@@ -114,9 +162,23 @@ namespace {
 const char TimerGroupName[] = "aggregator";
 const char TimerGroupDesc[] = "Aggregator";
 
+/// Convert a perf script timestamp of the form <sec>.<usec> into
+/// microseconds.
+Optional<uint64_t> parsePerfTime(const StringRef TimeStr) {
+  const StringRef SecTimeStr = TimeStr.split('.').first;
+  const StringRef USecTimeStr = TimeStr.split('.').second;
+  uint64_t SecTime;
+  uint64_t USecTime;
+  if (SecTimeStr.getAsInteger(10, SecTime) ||
+      USecTimeStr.getAsInteger(10, USecTime))
+    return NoneType();
+  return SecTime * 1000000ULL + USecTime;
+}
+
 }
 
 constexpr uint64_t DataAggregator::KernelBaseAddr;
+constexpr uint64_t DataAggregator::MinBufferSizeForParallelParsing;
 
 DataAggregator::~DataAggregator() { deleteTempFiles(); }
 
@@ -126,6 +188,34 @@ void deleteTempFile(const std::string &FileName) {
     errs() << "PERF2BOLT: failed to delete temporary file " << FileName
            << " with error " << Errc.message() << "\n";
 }
+
+/// Create a FIFO for streaming the output of a perf subprocess. Return false
+/// if FIFOs are not supported on this platform.
+bool createPerfOutputFIFO(SmallVectorImpl<char> &Path) {
+#if defined(__unix__)
+  SmallString<128> Model;
+  sys::path::system_temp_directory(/*erasedOnReboot=*/true, Model);
+  sys::path::append(Model, "perf.script-%%%%%%.fifo");
+  sys::fs::createUniquePath(Model, Path, /*MakeAbsolute=*/false);
+  // Guarantee that the path is null-terminated for system calls.
+  Path.push_back('\0');
+  Path.pop_back();
+  if (::mkfifo(Path.data(), 0600) != 0) {
+    errs() << "PERF2BOLT-WARNING: failed to create FIFO " << Path.data()
+           << " with error "
+           << std::error_code(errno, std::generic_category()).message()
+           << "\n";
+    Path.clear();
+    return false;
+  }
+  return true;
+#else
+  (void)Path;
+  errs() << "PERF2BOLT-WARNING: streaming perf output is not supported on "
+            "this platform\n";
+  return false;
+#endif
+}
 }
 
 void DataAggregator::deleteTempFiles() {
@@ -151,18 +241,76 @@ void DataAggregator::start() {
   if (opts::ReadPreAggregated)
     return;
 
+  // In heat map mode, the input may name a comma-separated sequence of
+  // perf.data files. The first one drives the process discovery below, and
+  // branch events from the rest are merged into the same heat map.
+  if (opts::HeatmapMode && StringRef(Filename).contains(',')) {
+    SmallVector<StringRef> Segments;
+    StringRef(Filename).split(Segments, ',', /*MaxSplit=*/-1,
+                              /*KeepEmpty=*/false);
+    const std::string FirstSegment = Segments.front().str();
+    for (StringRef Segment : drop_begin(Segments))
+      HeatmapSegments.push_back(Segment.str());
+    Filename = FirstSegment;
+  }
+
+  if (opts::ArmSPE && opts::BasicAggregation) {
+    errs() << "PERF2BOLT-ERROR: -spe produces branch samples and cannot be "
+              "combined with -nl\n";
+    exit(1);
+  }
+
+  // Decode perf.data in-process when possible. The basic aggregation, heat
+  // map, and kernel modes still rely on perf script output, and SPE records
+  // live in the aux trace area that only perf itself can decode.
+  if (opts::NativePerfReader && !opts::BasicAggregation && !opts::HeatmapMode &&
+      !opts::LinuxKernelMode && !opts::ArmSPE) {
+    Expected<std::unique_ptr<PerfDataReader>> ReaderOrErr =
+        PerfDataReader::create(Filename);
+    if (ReaderOrErr) {
+      if (opts::TimeSlices)
+        errs() << "PERF2BOLT-WARNING: the native perf.data reader does not "
+                  "support -time-slices; ignoring\n";
+      NativeReader = std::move(*ReaderOrErr);
+      return;
+    }
+    errs() << "PERF2BOLT-WARNING: cannot use native perf.data reader: "
+           << toString(ReaderOrErr.takeError())
+           << ". Falling back to perf script.\n";
+  }
+
   findPerfExecutable();
 
   if (opts::BasicAggregation)
     launchPerfProcess("events without LBR",
                       MainEventsPPI,
                       "script -F pid,event,ip",
-                      /*Wait = */false);
-  else
+                      /*Wait = */false,
+                      /*PipeStdout = */opts::StreamPerfOutput);
+  else if (opts::TimeSlices > 1 && opts::AggregateOnly &&
+           !opts::HeatmapMode && !BAT) {
+    // Time slicing needs a timestamp per sample to place it in a window.
+    NumTimeSlices = opts::TimeSlices;
+    BranchSampleHasTime = true;
+    launchPerfProcess("branch events",
+                      MainEventsPPI,
+                      opts::ArmSPE
+                          ? "script --itrace=bl -F pid,ip,time,brstack"
+                          : "script -F pid,ip,time,brstack",
+                      /*Wait = */false,
+                      /*PipeStdout = */opts::StreamPerfOutput);
+  } else {
+    if (opts::TimeSlices)
+      errs() << "PERF2BOLT-WARNING: -time-slices needs at least two windows "
+                "and LBR aggregation mode (perf2bolt) on a non-bolted "
+                "binary; ignoring\n";
     launchPerfProcess("branch events",
                       MainEventsPPI,
-                      "script -F pid,ip,brstack",
-                      /*Wait = */false);
+                      opts::ArmSPE ? "script --itrace=bl -F pid,ip,brstack"
+                                   : "script -F pid,ip,brstack",
+                      /*Wait = */false,
+                      /*PipeStdout = */opts::StreamPerfOutput);
+  }
 
   // Note: we launch script for mem events regardless of the option, as the
   //       command fails fairly fast if mem events were not collected.
@@ -200,7 +348,8 @@ void DataAggregator::abort() {
 }
 
 void DataAggregator::launchPerfProcess(StringRef Name, PerfProcessInfo &PPI,
-                                       const char *ArgsString, bool Wait) {
+                                       const char *ArgsString, bool Wait,
+                                       bool PipeStdout) {
   SmallVector<StringRef, 4> Argv;
 
   outs() << "PERF2BOLT: spawning perf job to read " << Name << '\n';
@@ -221,11 +370,16 @@ void DataAggregator::launchPerfProcess(StringRef Name, PerfProcessInfo &PPI,
   Argv.push_back("-i");
   Argv.push_back(Filename.c_str());
 
-  if (std::error_code Errc =
-          sys::fs::createTemporaryFile("perf.script", "out", PPI.StdoutPath)) {
-    errs() << "PERF2BOLT: failed to create temporary file " << PPI.StdoutPath
-           << " with error " << Errc.message() << "\n";
-    exit(1);
+  if (PipeStdout)
+    PPI.IsPipe = createPerfOutputFIFO(PPI.StdoutPath);
+  if (!PPI.IsPipe) {
+    if (std::error_code Errc =
+            sys::fs::createTemporaryFile("perf.script", "out",
+                                         PPI.StdoutPath)) {
+      errs() << "PERF2BOLT: failed to create temporary file " << PPI.StdoutPath
+             << " with error " << Errc.message() << "\n";
+      exit(1);
+    }
   }
   TempFiles.push_back(PPI.StdoutPath.data());
 
@@ -453,6 +607,122 @@ void DataAggregator::filterBinaryMMapInfo() {
   }
 }
 
+void DataAggregator::prepareToParse(StringRef Name, PerfProcessInfo &Process) {
+  std::string Error;
+  outs() << "PERF2BOLT: waiting for perf " << Name
+         << " collection to finish...\n";
+  sys::ProcessInfo PI = sys::Wait(Process.PI, 0, true, &Error);
+
+  if (!Error.empty()) {
+    errs() << "PERF-ERROR: " << PerfPath << ": " << Error << "\n";
+    deleteTempFiles();
+    exit(1);
+  }
+
+  if (PI.ReturnCode != 0) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> ErrorMB =
+        MemoryBuffer::getFileOrSTDIN(Process.StderrPath.data());
+    StringRef ErrBuf = (*ErrorMB)->getBuffer();
+
+    errs() << "PERF-ERROR: return code " << PI.ReturnCode << "\n";
+    errs() << ErrBuf;
+    deleteTempFiles();
+    exit(1);
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+      MemoryBuffer::getFileOrSTDIN(Process.StdoutPath.data());
+  if (std::error_code EC = MB.getError()) {
+    errs() << "Cannot open " << Process.StdoutPath.data() << ": "
+           << EC.message() << "\n";
+    deleteTempFiles();
+    exit(1);
+  }
+
+  FileBuf.reset(MB->release());
+  ParsingBuf = FileBuf->getBuffer();
+  Col = 0;
+  Line = 1;
+}
+
+std::error_code
+DataAggregator::streamPerfOutput(PerfProcessInfo &Process,
+                                 function_ref<std::error_code()> ParseFn) {
+#if defined(__unix__)
+  // Opening the FIFO for reading unblocks the subprocess that opened it for
+  // writing at spawn time.
+  int FD;
+  if (std::error_code EC =
+          sys::fs::openFileForRead(Process.StdoutPath.data(), FD)) {
+    errs() << "Cannot open " << Process.StdoutPath.data() << ": "
+           << EC.message() << "\n";
+    deleteTempFiles();
+    exit(1);
+  }
+
+  // Accumulate output in a window holding only the lines that were not
+  // parsed yet, keeping the memory usage constant regardless of the total
+  // output size.
+  std::string Window;
+  char Chunk[65536];
+  Col = 0;
+  Line = 1;
+  while (true) {
+    const ssize_t BytesRead = ::read(FD, Chunk, sizeof(Chunk));
+    if (BytesRead < 0) {
+      if (errno == EINTR)
+        continue;
+      ::close(FD);
+      return std::error_code(errno, std::generic_category());
+    }
+    if (BytesRead == 0)
+      break;
+
+    Window.append(Chunk, Chunk + BytesRead);
+    const size_t LastLF = Window.rfind('\n');
+    if (LastLF == std::string::npos)
+      continue;
+
+    ParsingBuf = StringRef(Window.data(), LastLF + 1);
+    if (std::error_code EC = ParseFn()) {
+      ::close(FD);
+      return EC;
+    }
+    Window.erase(0, LastLF + 1);
+  }
+  ::close(FD);
+
+  // Parse any leftover output without a terminating new line.
+  if (!Window.empty()) {
+    ParsingBuf = StringRef(Window);
+    if (std::error_code EC = ParseFn())
+      return EC;
+  }
+
+  // The pipe is drained. Wait for the subprocess and check for errors.
+  std::string Error;
+  sys::ProcessInfo PI = sys::Wait(Process.PI, 0, true, &Error);
+  if (!Error.empty()) {
+    errs() << "PERF-ERROR: " << PerfPath << ": " << Error << "\n";
+    deleteTempFiles();
+    exit(1);
+  }
+  if (PI.ReturnCode != 0) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> ErrorMB =
+        MemoryBuffer::getFileOrSTDIN(Process.StderrPath.data());
+    StringRef ErrBuf = (*ErrorMB)->getBuffer();
+
+    errs() << "PERF-ERROR: return code " << PI.ReturnCode << "\n";
+    errs() << ErrBuf;
+    deleteTempFiles();
+    exit(1);
+  }
+  return std::error_code();
+#else
+  llvm_unreachable("perf output streaming requires FIFO support");
+#endif
+}
+
 Error DataAggregator::preprocessProfile(BinaryContext &BC) {
   this->BC = &BC;
 
@@ -461,6 +731,25 @@ Error DataAggregator::preprocessProfile(BinaryContext &BC) {
     return Error::success();
   }
 
+  if (NativeReader) {
+    // The native reader does not decode the build-id feature section or
+    // memory events.
+    errs() << "PERF2BOLT-WARNING: build-id will not be checked when reading "
+              "perf.data natively\n";
+    if (parsePerfData())
+      errs() << "PERF2BOLT: failed to parse samples\n";
+
+    // We can finish early if the goal is just to generate data for autofdo
+    if (opts::WriteAutoFDOData) {
+      if (std::error_code EC = writeAutoFDOData(opts::OutputFilename))
+        errs() << "Error writing autofdo data to file: " << EC.message()
+               << "\n";
+      exit(0);
+    }
+
+    return Error::success();
+  }
+
   if (Optional<StringRef> FileBuildID = BC.getFileBuildID()) {
     outs() << "BOLT-INFO: binary build-id is:     " << *FileBuildID << "\n";
     processFileBuildID(*FileBuildID);
@@ -469,44 +758,6 @@ Error DataAggregator::preprocessProfile(BinaryContext &BC) {
               "not read one from input binary\n";
   }
 
-  auto prepareToParse = [&](StringRef Name, PerfProcessInfo &Process) {
-    std::string Error;
-    outs() << "PERF2BOLT: waiting for perf " << Name
-           << " collection to finish...\n";
-    sys::ProcessInfo PI = sys::Wait(Process.PI, 0, true, &Error);
-
-    if (!Error.empty()) {
-      errs() << "PERF-ERROR: " << PerfPath << ": " << Error << "\n";
-      deleteTempFiles();
-      exit(1);
-    }
-
-    if (PI.ReturnCode != 0) {
-      ErrorOr<std::unique_ptr<MemoryBuffer>> ErrorMB =
-          MemoryBuffer::getFileOrSTDIN(Process.StderrPath.data());
-      StringRef ErrBuf = (*ErrorMB)->getBuffer();
-
-      errs() << "PERF-ERROR: return code " << PI.ReturnCode << "\n";
-      errs() << ErrBuf;
-      deleteTempFiles();
-      exit(1);
-    }
-
-    ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
-        MemoryBuffer::getFileOrSTDIN(Process.StdoutPath.data());
-    if (std::error_code EC = MB.getError()) {
-      errs() << "Cannot open " << Process.StdoutPath.data() << ": "
-             << EC.message() << "\n";
-      deleteTempFiles();
-      exit(1);
-    }
-
-    FileBuf.reset(MB->release());
-    ParsingBuf = FileBuf->getBuffer();
-    Col = 0;
-    Line = 1;
-  };
-
   if (opts::LinuxKernelMode) {
     // Current MMap parsing logic does not work with linux kernel.
     // MMap entries for linux kernel uses PERF_RECORD_MMAP
@@ -533,7 +784,8 @@ Error DataAggregator::preprocessProfile(BinaryContext &BC) {
     errs() << "PERF2BOLT: failed to parse task events\n";
 
   filterBinaryMMapInfo();
-  prepareToParse("events", MainEventsPPI);
+  if (!MainEventsPPI.IsPipe)
+    prepareToParse("events", MainEventsPPI);
 
   if (opts::HeatmapMode) {
     if (std::error_code EC = printLBRHeatMap()) {
@@ -543,10 +795,62 @@ Error DataAggregator::preprocessProfile(BinaryContext &BC) {
     exit(0);
   }
 
+  // Memory events are independent of the main events, so wait for their perf
+  // process and parse its output on a separate thread while the main events
+  // are being parsed. A private shard aggregator keeps the parser state
+  // thread-local; memory samples are plain addresses and can be moved out
+  // once both sides are done. Any failure is recorded and acted upon on the
+  // main thread to preserve the original diagnostics and exit behavior.
+  struct {
+    std::unique_ptr<DataAggregator> Shard;
+    std::error_code ParseEC;
+    std::error_code OpenEC;
+    std::string ErrBuf;
+    int ReturnCode{0};
+  } Mem;
+  Mem.Shard =
+      std::unique_ptr<DataAggregator>(new DataAggregator(Filename, ShardTag()));
+  Mem.Shard->BC = BC;
+  Mem.Shard->BAT = BAT;
+  Mem.Shard->BinaryMMapInfo = BinaryMMapInfo;
+  auto collectMemEvents = [&]() {
+    std::string Error;
+    sys::ProcessInfo PI = sys::Wait(MemEventsPPI.PI, 0, true, &Error);
+    Mem.ReturnCode = PI.ReturnCode;
+    if (PI.ReturnCode != 0) {
+      ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+          MemoryBuffer::getFileOrSTDIN(MemEventsPPI.StderrPath.data());
+      Mem.ErrBuf = std::string((*MB)->getBuffer());
+      return;
+    }
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+        MemoryBuffer::getFileOrSTDIN(MemEventsPPI.StdoutPath.data());
+    if (std::error_code EC = MB.getError()) {
+      Mem.OpenEC = EC;
+      return;
+    }
+
+    Mem.Shard->FileBuf.reset(MB->release());
+    Mem.Shard->ParsingBuf = Mem.Shard->FileBuf->getBuffer();
+    Mem.Shard->Col = 0;
+    Mem.Shard->Line = 1;
+    Mem.ParseEC = Mem.Shard->parseMemEvents();
+  };
+
+  std::thread MemEventsThread;
+  if (opts::NoThreads)
+    collectMemEvents();
+  else
+    MemEventsThread = std::thread(collectMemEvents);
+
   if ((!opts::BasicAggregation && parseBranchEvents()) ||
       (opts::BasicAggregation && parseBasicEvents()))
     errs() << "PERF2BOLT: failed to parse samples\n";
 
+  if (MemEventsThread.joinable())
+    MemEventsThread.join();
+
   // We can finish early if the goal is just to generate data for autofdo
   if (opts::WriteAutoFDOData) {
     if (std::error_code EC = writeAutoFDOData(opts::OutputFilename))
@@ -557,41 +861,30 @@ Error DataAggregator::preprocessProfile(BinaryContext &BC) {
   }
 
   // Special handling for memory events
-  std::string Error;
-  sys::ProcessInfo PI = sys::Wait(MemEventsPPI.PI, 0, true, &Error);
-  if (PI.ReturnCode != 0) {
-    ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
-        MemoryBuffer::getFileOrSTDIN(MemEventsPPI.StderrPath.data());
-    StringRef ErrBuf = (*MB)->getBuffer();
-
+  if (Mem.ReturnCode != 0) {
     deleteTempFiles();
 
     Regex NoData("Samples for '.*' event do not have ADDR attribute set. "
                  "Cannot print 'addr' field.");
-    if (!NoData.match(ErrBuf)) {
-      errs() << "PERF-ERROR: return code " << PI.ReturnCode << "\n";
-      errs() << ErrBuf;
+    if (!NoData.match(Mem.ErrBuf)) {
+      errs() << "PERF-ERROR: return code " << Mem.ReturnCode << "\n";
+      errs() << Mem.ErrBuf;
       exit(1);
     }
     return Error::success();
   }
 
-  ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
-      MemoryBuffer::getFileOrSTDIN(MemEventsPPI.StdoutPath.data());
-  if (std::error_code EC = MB.getError()) {
+  if (Mem.OpenEC) {
     errs() << "Cannot open " << MemEventsPPI.StdoutPath.data() << ": "
-           << EC.message() << "\n";
+           << Mem.OpenEC.message() << "\n";
     deleteTempFiles();
     exit(1);
   }
 
-  FileBuf.reset(MB->release());
-  ParsingBuf = FileBuf->getBuffer();
-  Col = 0;
-  Line = 1;
-  if (const std::error_code EC = parseMemEvents())
-    errs() << "PERF2BOLT: failed to parse memory events: " << EC.message()
-           << '\n';
+  if (Mem.ParseEC)
+    errs() << "PERF2BOLT: failed to parse memory events: "
+           << Mem.ParseEC.message() << '\n';
+  MemSamples = std::move(Mem.Shard->MemSamples);
 
   deleteTempFiles();
 
@@ -609,6 +902,9 @@ Error DataAggregator::readProfile(BinaryContext &BC) {
   if (opts::AggregateOnly) {
     if (std::error_code EC = writeAggregatedFile(opts::OutputFilename))
       report_error("cannot create output data file", EC);
+    if (NumTimeSlices)
+      if (std::error_code EC = writeTimeSlicedFiles(opts::OutputFilename))
+        report_error("cannot create time-slice data file", EC);
   }
 
   return Error::success();
@@ -648,11 +944,23 @@ void DataAggregator::processProfile(BinaryContext &BC) {
 
 BinaryFunction *
 DataAggregator::getBinaryFunctionContainingAddress(uint64_t Address) const {
-  if (!BC->containsAddress(Address))
+  if (!Address || !BC->containsAddress(Address))
     return nullptr;
 
-  return BC->getBinaryFunctionContainingAddress(Address, /*CheckPastEnd=*/false,
-                                                /*UseMaxSize=*/true);
+  // Multiplying by an odd constant spreads nearby branch addresses across the
+  // table; the top bits select the slot.
+  if (FunctionLookupCache.empty())
+    FunctionLookupCache.resize(FunctionLookupCacheSize);
+  FunctionLookupEntry &Entry =
+      FunctionLookupCache[(Address * 0x9E3779B97F4A7C15ULL) >> 48];
+  if (Entry.Address == Address)
+    return Entry.Function;
+
+  BinaryFunction *BF = BC->getBinaryFunctionContainingAddress(
+      Address, /*CheckPastEnd=*/false, /*UseMaxSize=*/true);
+  Entry.Address = Address;
+  Entry.Function = BF;
+  return BF;
 }
 
 StringRef DataAggregator::getLocationName(BinaryFunction &Func,
@@ -834,9 +1142,19 @@ bool DataAggregator::doTrace(const LBREntry &First, const LBREntry &Second,
                     << FromFunc->getPrintName() << ":"
                     << Twine::utohexstr(First.To) << " to "
                     << Twine::utohexstr(Second.From) << ".\n");
-  for (const std::pair<uint64_t, uint64_t> &Pair : *FTs)
+  for (const std::pair<uint64_t, uint64_t> &Pair : *FTs) {
+    if (BAT) {
+      // Different traces repeat the same basic block pairs heavily. Coalesce
+      // them here and let processBranchEventsBAT() record each unique pair
+      // once with the combined count.
+      BATFallthroughCounts[Trace(Pair.first + FromFunc->getAddress(),
+                                 Pair.second + FromFunc->getAddress())] +=
+          Count;
+      continue;
+    }
     doIntraBranch(*FromFunc, Pair.first + FromFunc->getAddress(),
                   Pair.second + FromFunc->getAddress(), Count, false);
+  }
 
   return true;
 }
@@ -913,7 +1231,7 @@ bool DataAggregator::recordTrace(
       const MCInst *Instr = BB->getLastNonPseudoInstr();
       uint64_t Offset = 0;
       if (Instr)
-        Offset = BC.MIB->getAnnotationWithDefault<uint32_t>(*Instr, "Offset");
+        Offset = BC.MIB->getOffsetWithDefault(*Instr, 0);
       else
         Offset = BB->getOffset();
 
@@ -1062,6 +1380,24 @@ ErrorOr<DataAggregator::PerfBranchSample> DataAggregator::parseBranchSample() {
     return make_error_code(errc::no_such_process);
   }
 
+  if (BranchSampleHasTime) {
+    while (checkAndConsumeFS()) {
+    }
+
+    // The timestamp is printed as <sec>.<usec> followed by a colon.
+    ErrorOr<StringRef> TimeRes = parseString(FieldSeparator, true);
+    if (std::error_code EC = TimeRes.getError())
+      return EC;
+    if (NumTimeSlices) {
+      CurrentSlice = 0;
+      if (Optional<uint64_t> Time = parsePerfTime(TimeRes.get().rtrim(':')))
+        if (*Time >= SliceTimeBase && SliceTimeWidth)
+          CurrentSlice =
+              std::min<uint64_t>((*Time - SliceTimeBase) / SliceTimeWidth,
+                                 NumTimeSlices - 1);
+    }
+  }
+
   while (checkAndConsumeFS()) {
   }
 
@@ -1292,34 +1628,71 @@ std::error_code DataAggregator::printLBRHeatMap() {
   Heatmap HM(opts::HeatmapBlock, opts::HeatmapMinAddress,
              opts::HeatmapMaxAddress);
   uint64_t NumTotalSamples = 0;
+  uint64_t NumTraces = 0;
 
-  while (hasData()) {
-    ErrorOr<PerfBranchSample> SampleRes = parseBranchSample();
-    if (std::error_code EC = SampleRes.getError()) {
-      if (EC == errc::no_such_process)
-        continue;
-      return EC;
-    }
+  // Register samples and fall-through traces in the heat map as they are
+  // parsed. Feeding traces incrementally instead of aggregating them
+  // beforehand produces identical bucket counts while keeping the memory
+  // usage constant in the number of samples.
+  auto parseAvailableSamples = [&]() -> std::error_code {
+    while (hasData()) {
+      ErrorOr<PerfBranchSample> SampleRes = parseBranchSample();
+      if (std::error_code EC = SampleRes.getError()) {
+        if (EC == errc::no_such_process)
+          continue;
+        return EC;
+      }
 
-    PerfBranchSample &Sample = SampleRes.get();
+      PerfBranchSample &Sample = SampleRes.get();
 
-    // LBRs are stored in reverse execution order. NextLBR refers to the next
-    // executed branch record.
-    const LBREntry *NextLBR = nullptr;
-    for (const LBREntry &LBR : Sample.LBR) {
-      if (NextLBR) {
-        // Record fall-through trace.
-        const uint64_t TraceFrom = LBR.To;
-        const uint64_t TraceTo = NextLBR->From;
-        ++FallthroughLBRs[Trace(TraceFrom, TraceTo)].InternCount;
+      // LBRs are stored in reverse execution order. NextLBR refers to the
+      // next executed branch record.
+      const LBREntry *NextLBR = nullptr;
+      for (const LBREntry &LBR : Sample.LBR) {
+        if (NextLBR) {
+          // Record fall-through trace.
+          HM.registerAddressRange(LBR.To, NextLBR->From, 1);
+          ++NumTraces;
+        }
+        NextLBR = &LBR;
+      }
+      if (!Sample.LBR.empty()) {
+        HM.registerAddress(Sample.LBR.front().To);
+        HM.registerAddress(Sample.LBR.back().From);
       }
-      NextLBR = &LBR;
+      NumTotalSamples += Sample.LBR.size();
     }
-    if (!Sample.LBR.empty()) {
-      HM.registerAddress(Sample.LBR.front().To);
-      HM.registerAddress(Sample.LBR.back().From);
+    return std::error_code();
+  };
+
+  if (MainEventsPPI.IsPipe) {
+    if (std::error_code EC =
+            streamPerfOutput(MainEventsPPI, parseAvailableSamples))
+      return EC;
+  } else if (std::error_code EC = parseAvailableSamples()) {
+    return EC;
+  }
+
+  // Merge branch events from the remaining perf.data inputs into the same
+  // heat map.
+  for (const std::string &Segment : HeatmapSegments) {
+    outs() << "HEATMAP: reading samples from " << Segment << '\n';
+    Filename = Segment;
+    PerfProcessInfo SegmentPPI;
+    launchPerfProcess("branch events", SegmentPPI,
+                      opts::ArmSPE ? "script --itrace=bl -F pid,ip,brstack"
+                                   : "script -F pid,ip,brstack",
+                      /*Wait = */ false,
+                      /*PipeStdout = */ opts::StreamPerfOutput);
+    if (SegmentPPI.IsPipe) {
+      if (std::error_code EC =
+              streamPerfOutput(SegmentPPI, parseAvailableSamples))
+        return EC;
+    } else {
+      prepareToParse("branch events", SegmentPPI);
+      if (std::error_code EC = parseAvailableSamples())
+        return EC;
     }
-    NumTotalSamples += Sample.LBR.size();
   }
 
   if (!NumTotalSamples) {
@@ -1329,15 +1702,7 @@ std::error_code DataAggregator::printLBRHeatMap() {
   }
 
   outs() << "HEATMAP: read " << NumTotalSamples << " LBR samples\n";
-  outs() << "HEATMAP: " << FallthroughLBRs.size() << " unique traces\n";
-
-  outs() << "HEATMAP: building heat map...\n";
-
-  for (const auto &LBR : FallthroughLBRs) {
-    const Trace &Trace = LBR.first;
-    const FTInfo &Info = LBR.second;
-    HM.registerAddressRange(Trace.From, Trace.To, Info.InternCount);
-  }
+  outs() << "HEATMAP: " << NumTraces << " traces\n";
 
   if (HM.getNumInvalidRanges())
     outs() << "HEATMAP: invalid traces: " << HM.getNumInvalidRanges() << '\n';
@@ -1347,6 +1712,11 @@ std::error_code DataAggregator::printLBRHeatMap() {
     exit(1);
   }
 
+  if (opts::HeatmapBinary) {
+    HM.writeBinary(opts::HeatmapFile);
+    return std::error_code();
+  }
+
   HM.print(opts::HeatmapFile);
   if (opts::HeatmapFile == "-")
     HM.printCDF(opts::HeatmapFile);
@@ -1361,11 +1731,94 @@ std::error_code DataAggregator::parseBranchEvents() {
   NamedRegionTimer T("parseBranch", "Parsing branch events", TimerGroupName,
                      TimerGroupDesc, opts::TimeAggregator);
 
-  uint64_t NumTotalSamples = 0;
-  uint64_t NumEntries = 0;
-  uint64_t NumSamples = 0;
-  uint64_t NumSamplesNoLBR = 0;
-  uint64_t NumTraces = 0;
+  BranchEventStats Stats;
+
+  if (NumTimeSlices) {
+    if (MainEventsPPI.IsPipe) {
+      errs() << "PERF2BOLT-WARNING: cannot time-slice streamed perf output; "
+                "ignoring -time-slices\n";
+      NumTimeSlices = 0;
+    } else if (!initTimeSlices()) {
+      errs() << "PERF2BOLT-WARNING: no timestamps found in branch samples; "
+                "ignoring -time-slices\n";
+      NumTimeSlices = 0;
+    }
+  }
+
+  // Samples are line-delimited and independent, so large inputs can be
+  // parsed in shards. Respecting -max-samples requires observing samples in
+  // file order, hence it forces sequential parsing.
+  std::error_code EC;
+  if (MainEventsPPI.IsPipe)
+    // Consume the stream in windows of whole samples while perf is still
+    // producing output; the aggregated state persists across windows.
+    EC = streamPerfOutput(MainEventsPPI,
+                          [&]() { return parseBranchEventsImpl(Stats); });
+  else if (opts::NoThreads || opts::MaxSamples != -1ULL ||
+           ParsingBuf.size() < MinBufferSizeForParallelParsing)
+    EC = parseBranchEventsImpl(Stats);
+  else
+    EC = parseBranchEventsParallel(Stats);
+  if (EC)
+    return EC;
+
+  printBranchSamplesDiagnostics(Stats.NumTotalSamples, Stats.NumSamples,
+                                Stats.NumSamplesNoLBR, Stats.NumEntries,
+                                Stats.NumTraces);
+
+  return std::error_code();
+}
+
+bool DataAggregator::initTimeSlices() {
+  // perf script emits samples in time order, so the collection window runs
+  // from the timestamp of the first sample to the timestamp of the last one.
+  // Extract both directly from the buffered output instead of making a
+  // separate parsing pass.
+  auto sampleTime = [](StringRef Line) -> Optional<uint64_t> {
+    // Line: <pid> <sec>.<usec>: <ip> <brstack>
+    SmallVector<StringRef, 3> Fields;
+    Line.trim().split(Fields, FieldSeparator, /*MaxSplit=*/2,
+                      /*KeepEmpty=*/false);
+    if (Fields.size() < 2)
+      return NoneType();
+    return parsePerfTime(Fields[1].rtrim(':'));
+  };
+
+  Optional<uint64_t> First;
+  StringRef Buf = ParsingBuf;
+  while (!Buf.empty() && !First) {
+    const std::pair<StringRef, StringRef> Split = Buf.split('\n');
+    First = sampleTime(Split.first);
+    Buf = Split.second;
+  }
+
+  Optional<uint64_t> Last;
+  Buf = ParsingBuf.rtrim('\n');
+  while (!Buf.empty() && !Last) {
+    const size_t Pos = Buf.rfind('\n');
+    Last = sampleTime(Pos == StringRef::npos ? Buf : Buf.substr(Pos + 1));
+    Buf = Pos == StringRef::npos ? StringRef() : Buf.substr(0, Pos);
+  }
+
+  if (!First || !Last || *Last < *First)
+    return false;
+
+  SliceTimeBase = *First;
+  SliceTimeWidth = (*Last - *First) / NumTimeSlices + 1;
+  SlicedBranchLBRs.resize(NumTimeSlices);
+  SlicedFallthroughLBRs.resize(NumTimeSlices);
+
+  outs() << "PERF2BOLT: aggregating into " << NumTimeSlices
+         << " time slice(s) of " << SliceTimeWidth << " us each\n";
+  return true;
+}
+
+std::error_code DataAggregator::parseBranchEventsImpl(BranchEventStats &Stats) {
+  uint64_t &NumTotalSamples = Stats.NumTotalSamples;
+  uint64_t &NumEntries = Stats.NumEntries;
+  uint64_t &NumSamples = Stats.NumSamples;
+  uint64_t &NumSamplesNoLBR = Stats.NumSamplesNoLBR;
+  uint64_t &NumTraces = Stats.NumTraces;
   bool NeedsSkylakeFix = false;
 
   while (hasData() && NumTotalSamples < opts::MaxSamples) {
@@ -1394,81 +1847,207 @@ std::error_code DataAggregator::parseBranchEvents() {
       NeedsSkylakeFix = true;
     }
 
-    // LBRs are stored in reverse execution order. NextPC refers to the next
-    // recorded executed PC.
-    uint64_t NextPC = opts::UseEventPC ? Sample.PC : 0;
-    uint32_t NumEntry = 0;
-    for (const LBREntry &LBR : Sample.LBR) {
-      ++NumEntry;
-      // Hardware bug workaround: Intel Skylake (which has 32 LBR entries)
-      // sometimes record entry 32 as an exact copy of entry 31. This will cause
-      // us to likely record an invalid trace and generate a stale function for
-      // BAT mode (non BAT disassembles the function and is able to ignore this
-      // trace at aggregation time). Drop first 2 entries (last two, in
-      // chronological order)
-      if (NeedsSkylakeFix && NumEntry <= 2)
-        continue;
-      if (NextPC) {
-        // Record fall-through trace.
-        const uint64_t TraceFrom = LBR.To;
-        const uint64_t TraceTo = NextPC;
-        const BinaryFunction *TraceBF =
-            getBinaryFunctionContainingAddress(TraceFrom);
-        if (TraceBF && TraceBF->containsAddress(TraceTo)) {
-          FTInfo &Info = FallthroughLBRs[Trace(TraceFrom, TraceTo)];
-          if (TraceBF->containsAddress(LBR.From))
-            ++Info.InternCount;
+    aggregateBranchSample(Sample, NeedsSkylakeFix, NumTraces);
+  }
+
+  return std::error_code();
+}
+
+std::error_code
+DataAggregator::parseBranchEventsParallel(BranchEventStats &Stats) {
+  // Split the input at sample boundaries into roughly equal-sized shards,
+  // one per task.
+  const StringRef Buf = ParsingBuf;
+  const size_t NumTasks = opts::ThreadCount * opts::TaskCount;
+  const size_t ChunkSize = Buf.size() / NumTasks + 1;
+  std::vector<StringRef> ShardBufs;
+  size_t Pos = 0;
+  while (Pos < Buf.size()) {
+    size_t End = Pos + ChunkSize;
+    if (End >= Buf.size()) {
+      End = Buf.size();
+    } else {
+      const size_t NewLine = Buf.find('\n', End);
+      End = NewLine == StringRef::npos ? Buf.size() : NewLine + 1;
+    }
+    ShardBufs.push_back(Buf.slice(Pos, End));
+    Pos = End;
+  }
+
+  outs() << "PERF2BOLT: parsing branch events in " << ShardBufs.size()
+         << " shards\n";
+
+  // Parse each shard with a private aggregator to keep parser and map state
+  // thread-local.
+  std::vector<std::unique_ptr<DataAggregator>> Shards(ShardBufs.size());
+  std::vector<BranchEventStats> ShardStats(ShardBufs.size());
+  std::vector<std::error_code> ShardErrs(ShardBufs.size());
+  ThreadPool &Pool = ParallelUtilities::getThreadPool();
+  for (size_t I = 0; I < ShardBufs.size(); ++I) {
+    Shards[I] =
+        std::unique_ptr<DataAggregator>(new DataAggregator(Filename, ShardTag()));
+    DataAggregator &Shard = *Shards[I];
+    Shard.BC = BC;
+    Shard.BAT = BAT;
+    Shard.BinaryMMapInfo = BinaryMMapInfo;
+    Shard.NumTimeSlices = NumTimeSlices;
+    Shard.BranchSampleHasTime = BranchSampleHasTime;
+    Shard.SliceTimeBase = SliceTimeBase;
+    Shard.SliceTimeWidth = SliceTimeWidth;
+    Shard.SlicedBranchLBRs.resize(SlicedBranchLBRs.size());
+    Shard.SlicedFallthroughLBRs.resize(SlicedFallthroughLBRs.size());
+    Shard.ParsingBuf = ShardBufs[I];
+    Shard.Col = 0;
+    Shard.Line = 1;
+    Pool.async(
+        [](DataAggregator *Shard, BranchEventStats *ShardStat,
+           std::error_code *ShardErr) {
+          *ShardErr = Shard->parseBranchEventsImpl(*ShardStat);
+        },
+        &Shard, &ShardStats[I], &ShardErrs[I]);
+  }
+  Pool.wait();
+
+  // Merge per-shard maps and counters.
+  for (size_t I = 0; I < Shards.size(); ++I) {
+    if (ShardErrs[I])
+      return ShardErrs[I];
+    DataAggregator &Shard = *Shards[I];
+
+    Stats.NumTotalSamples += ShardStats[I].NumTotalSamples;
+    Stats.NumSamples += ShardStats[I].NumSamples;
+    Stats.NumSamplesNoLBR += ShardStats[I].NumSamplesNoLBR;
+    Stats.NumEntries += ShardStats[I].NumEntries;
+    Stats.NumTraces += ShardStats[I].NumTraces;
+    NumInvalidTraces += Shard.NumInvalidTraces;
+    NumLongRangeTraces += Shard.NumLongRangeTraces;
+    NumColdSamples += Shard.NumColdSamples;
+
+    for (const auto &AggrLBR : Shard.BranchLBRs) {
+      BranchInfo &Info = BranchLBRs[AggrLBR.first];
+      Info.TakenCount += AggrLBR.second.TakenCount;
+      Info.MispredCount += AggrLBR.second.MispredCount;
+    }
+    for (const auto &AggrLBR : Shard.FallthroughLBRs) {
+      FTInfo &Info = FallthroughLBRs[AggrLBR.first];
+      Info.InternCount += AggrLBR.second.InternCount;
+      Info.ExternCount += AggrLBR.second.ExternCount;
+    }
+    for (const auto &Sample : Shard.BasicSamples)
+      BasicSamples[Sample.first] += Sample.second;
+
+    for (size_t S = 0; S < SlicedBranchLBRs.size(); ++S) {
+      for (const auto &AggrLBR : Shard.SlicedBranchLBRs[S]) {
+        BranchInfo &Info = SlicedBranchLBRs[S][AggrLBR.first];
+        Info.TakenCount += AggrLBR.second.TakenCount;
+        Info.MispredCount += AggrLBR.second.MispredCount;
+      }
+      for (const auto &AggrLBR : Shard.SlicedFallthroughLBRs[S]) {
+        FTInfo &Info = SlicedFallthroughLBRs[S][AggrLBR.first];
+        Info.InternCount += AggrLBR.second.InternCount;
+        Info.ExternCount += AggrLBR.second.ExternCount;
+      }
+    }
+  }
+
+  return std::error_code();
+}
+
+void DataAggregator::aggregateBranchSample(const PerfBranchSample &Sample,
+                                           bool NeedsSkylakeFix,
+                                           uint64_t &NumTraces) {
+  // LBRs are stored in reverse execution order. NextPC refers to the next
+  // recorded executed PC.
+  uint64_t NextPC = opts::UseEventPC ? Sample.PC : 0;
+  // Hardware bug workaround: Intel Skylake (which has 32 LBR entries)
+  // sometimes record entry 32 as an exact copy of entry 31. This will cause
+  // us to likely record an invalid trace and generate a stale function for
+  // BAT mode (non BAT disassembles the function and is able to ignore this
+  // trace at aggregation time). Drop first 2 entries (last two, in
+  // chronological order). Trimming the range up front keeps the check out of
+  // the per-entry loop.
+  ArrayRef<LBREntry> Entries = makeArrayRef(Sample.LBR);
+  if (NeedsSkylakeFix)
+    Entries = Entries.drop_front(std::min<size_t>(2, Entries.size()));
+  for (const LBREntry &LBR : Entries) {
+    if (NextPC) {
+      // Record fall-through trace.
+      const uint64_t TraceFrom = LBR.To;
+      const uint64_t TraceTo = NextPC;
+      const BinaryFunction *TraceBF =
+          getBinaryFunctionContainingAddress(TraceFrom);
+      if (TraceBF && TraceBF->containsAddress(TraceTo)) {
+        const Trace FTTrace(TraceFrom, TraceTo);
+        const bool IsIntern = TraceBF->containsAddress(LBR.From);
+        FTInfo &Info = FallthroughLBRs[FTTrace];
+        if (IsIntern)
+          ++Info.InternCount;
+        else
+          ++Info.ExternCount;
+        if (NumTimeSlices) {
+          FTInfo &SliceInfo = SlicedFallthroughLBRs[CurrentSlice][FTTrace];
+          if (IsIntern)
+            ++SliceInfo.InternCount;
           else
-            ++Info.ExternCount;
+            ++SliceInfo.ExternCount;
+        }
+      } else {
+        if (TraceBF && getBinaryFunctionContainingAddress(TraceTo)) {
+          LLVM_DEBUG(dbgs()
+                     << "Invalid trace starting in "
+                     << TraceBF->getPrintName() << " @ "
+                     << Twine::utohexstr(TraceFrom - TraceBF->getAddress())
+                     << " and ending @ " << Twine::utohexstr(TraceTo)
+                     << '\n');
+          ++NumInvalidTraces;
         } else {
-          if (TraceBF && getBinaryFunctionContainingAddress(TraceTo)) {
-            LLVM_DEBUG(dbgs()
-                       << "Invalid trace starting in "
-                       << TraceBF->getPrintName() << " @ "
-                       << Twine::utohexstr(TraceFrom - TraceBF->getAddress())
-                       << " and ending @ " << Twine::utohexstr(TraceTo)
-                       << '\n');
-            ++NumInvalidTraces;
-          } else {
-            LLVM_DEBUG(dbgs()
-                       << "Out of range trace starting in "
-                       << (TraceBF ? TraceBF->getPrintName() : "None") << " @ "
-                       << Twine::utohexstr(
-                              TraceFrom - (TraceBF ? TraceBF->getAddress() : 0))
-                       << " and ending in "
-                       << (getBinaryFunctionContainingAddress(TraceTo)
-                               ? getBinaryFunctionContainingAddress(TraceTo)
-                                     ->getPrintName()
-                               : "None")
-                       << " @ "
-                       << Twine::utohexstr(
-                              TraceTo -
-                              (getBinaryFunctionContainingAddress(TraceTo)
-                                   ? getBinaryFunctionContainingAddress(TraceTo)
-                                         ->getAddress()
-                                   : 0))
-                       << '\n');
-            ++NumLongRangeTraces;
-          }
+          LLVM_DEBUG(dbgs()
+                     << "Out of range trace starting in "
+                     << (TraceBF ? TraceBF->getPrintName() : "None") << " @ "
+                     << Twine::utohexstr(
+                            TraceFrom - (TraceBF ? TraceBF->getAddress() : 0))
+                     << " and ending in "
+                     << (getBinaryFunctionContainingAddress(TraceTo)
+                             ? getBinaryFunctionContainingAddress(TraceTo)
+                                   ->getPrintName()
+                             : "None")
+                     << " @ "
+                     << Twine::utohexstr(
+                            TraceTo -
+                            (getBinaryFunctionContainingAddress(TraceTo)
+                                 ? getBinaryFunctionContainingAddress(TraceTo)
+                                       ->getAddress()
+                                 : 0))
+                     << '\n');
+          ++NumLongRangeTraces;
         }
-        ++NumTraces;
       }
-      NextPC = LBR.From;
-
-      uint64_t From = LBR.From;
-      if (!getBinaryFunctionContainingAddress(From))
-        From = 0;
-      uint64_t To = LBR.To;
-      if (!getBinaryFunctionContainingAddress(To))
-        To = 0;
-      if (!From && !To)
-        continue;
-      BranchInfo &Info = BranchLBRs[Trace(From, To)];
-      ++Info.TakenCount;
-      Info.MispredCount += LBR.Mispred;
+      ++NumTraces;
+    }
+    NextPC = LBR.From;
+
+    uint64_t From = LBR.From;
+    if (!getBinaryFunctionContainingAddress(From))
+      From = 0;
+    uint64_t To = LBR.To;
+    if (!getBinaryFunctionContainingAddress(To))
+      To = 0;
+    if (!From && !To)
+      continue;
+    BranchInfo &Info = BranchLBRs[Trace(From, To)];
+    ++Info.TakenCount;
+    Info.MispredCount += LBR.Mispred;
+    if (NumTimeSlices) {
+      BranchInfo &SliceInfo = SlicedBranchLBRs[CurrentSlice][Trace(From, To)];
+      ++SliceInfo.TakenCount;
+      SliceInfo.MispredCount += LBR.Mispred;
     }
   }
+}
 
+void DataAggregator::printBranchSamplesDiagnostics(
+    uint64_t NumTotalSamples, uint64_t NumSamples, uint64_t NumSamplesNoLBR,
+    uint64_t NumEntries, uint64_t NumTraces) {
   for (const auto &LBR : BranchLBRs) {
     const Trace &Trace = LBR.first;
     if (BinaryFunction *BF = getBinaryFunctionContainingAddress(Trace.From))
@@ -1545,6 +2124,118 @@ std::error_code DataAggregator::parseBranchEvents() {
              "likely used bad data or your service observed a large shift in "
              "profile. You may want to audit this.\n";
   }
+}
+
+std::error_code DataAggregator::parsePerfData() {
+  outs() << "PERF2BOLT: parsing perf.data directly...\n";
+  NamedRegionTimer T("parsePerfData", "Parsing perf.data", TimerGroupName,
+                     TimerGroupDesc, opts::TimeAggregator);
+
+  const StringRef NameToUse = sys::path::filename(BC->getFilename());
+
+  uint64_t NumTotalSamples = 0;
+  uint64_t NumEntries = 0;
+  uint64_t NumSamples = 0;
+  uint64_t NumSamplesNoLBR = 0;
+  uint64_t NumTraces = 0;
+  bool NeedsSkylakeFix = false;
+
+  // Records are decoded in file order: mappings of a process always precede
+  // its samples, so a single pass is sufficient.
+  auto MMapCB = [&](const PerfDataReader::MMapRecord &Record) {
+    if (sys::path::filename(Record.Filename) != NameToUse)
+      return;
+    if (opts::FilterPID && Record.PID != static_cast<int32_t>(opts::FilterPID))
+      return;
+    // Consider only the first mapping of the binary for any given PID.
+    if (BinaryMMapInfo.count(Record.PID))
+      return;
+    MMapInfo MMap;
+    MMap.PID = Record.PID;
+    MMap.BaseAddress = Record.Address;
+    MMap.Size = Record.Size;
+    MMap.Offset = Record.PageOffset;
+    MMap.Time = Record.Time;
+    BinaryMMapInfo.insert(std::make_pair(MMap.PID, MMap));
+  };
+
+  auto ForkCB = [&](const PerfDataReader::ForkRecord &Record) {
+    if (Record.ParentPID == Record.ChildPID)
+      return;
+    // Process was forked and mmaped before perf ran. In this case the child
+    // has its own mmap entry unless it was execve'd.
+    if (Record.Time == 0)
+      return;
+    auto MMapInfoIter = BinaryMMapInfo.find(Record.ParentPID);
+    if (MMapInfoIter == BinaryMMapInfo.end())
+      return;
+    MMapInfo MMap = MMapInfoIter->second;
+    MMap.PID = Record.ChildPID;
+    MMap.Forked = true;
+    BinaryMMapInfo.insert(std::make_pair(MMap.PID, MMap));
+  };
+
+  auto CommExecCB = [&](const PerfDataReader::CommExecRecord &Record) {
+    // Remove forked child that ran execve.
+    auto MMapInfoIter = BinaryMMapInfo.find(Record.PID);
+    if (MMapInfoIter != BinaryMMapInfo.end() && MMapInfoIter->second.Forked)
+      BinaryMMapInfo.erase(MMapInfoIter);
+  };
+
+  auto SampleCB = [&](const PerfDataReader::SampleRecord &Record) {
+    if (++NumTotalSamples > opts::MaxSamples)
+      return;
+
+    auto MMapInfoIter = BinaryMMapInfo.find(Record.PID);
+    if (MMapInfoIter == BinaryMMapInfo.end())
+      return;
+    ++NumSamples;
+
+    PerfBranchSample Sample;
+    Sample.PC = Record.IP;
+    if (!BC->HasFixedLoadAddress)
+      adjustAddress(Sample.PC, MMapInfoIter->second);
+    if (opts::WriteAutoFDOData)
+      ++BasicSamples[Sample.PC];
+
+    for (const PerfDataReader::BranchStackEntry &Entry : Record.BranchStack) {
+      LBREntry LBR{Entry.From, Entry.To, Entry.Mispred};
+      if (ignoreKernelInterrupt(LBR))
+        continue;
+      if (!BC->HasFixedLoadAddress)
+        adjustLBR(LBR, MMapInfoIter->second);
+      Sample.LBR.push_back(LBR);
+    }
+
+    if (Sample.LBR.empty()) {
+      ++NumSamplesNoLBR;
+      return;
+    }
+    NumEntries += Sample.LBR.size();
+    if (BAT && Sample.LBR.size() == 32 && !NeedsSkylakeFix) {
+      errs() << "PERF2BOLT-WARNING: using Intel Skylake bug workaround\n";
+      NeedsSkylakeFix = true;
+    }
+
+    aggregateBranchSample(Sample, NeedsSkylakeFix, NumTraces);
+  };
+
+  if (Error E = NativeReader->parse(SampleCB, MMapCB, ForkCB, CommExecCB)) {
+    errs() << "PERF2BOLT-ERROR: " << toString(std::move(E)) << '\n';
+    return make_error_code(llvm::errc::io_error);
+  }
+
+  if (BinaryMMapInfo.empty()) {
+    errs() << "PERF2BOLT-ERROR: could not find a profile matching binary \""
+           << BC->getFilename() << "\". Please rename the input binary.\n";
+    exit(1);
+  }
+
+  outs() << "PERF2BOLT: input binary is associated with "
+         << BinaryMMapInfo.size() << " PID(s)\n";
+
+  printBranchSamplesDiagnostics(NumTotalSamples, NumSamples, NumSamplesNoLBR,
+                                NumEntries, NumTraces);
 
   return std::error_code();
 }
@@ -1554,6 +2245,11 @@ void DataAggregator::processBranchEvents() {
   NamedRegionTimer T("processBranch", "Processing branch events",
                      TimerGroupName, TimerGroupDesc, opts::TimeAggregator);
 
+  if (BAT) {
+    processBranchEventsBAT();
+    return;
+  }
+
   for (const auto &AggrLBR : FallthroughLBRs) {
     const Trace &Loc = AggrLBR.first;
     const FTInfo &Info = AggrLBR.second;
@@ -1574,26 +2270,95 @@ void DataAggregator::processBranchEvents() {
   }
 }
 
+void DataAggregator::processBranchEventsBAT() {
+  // Group entries by (from-page, to-page) so that consecutive BAT lookups
+  // are served by the same directory records and translation cache lines
+  // instead of bouncing across the section. Full addresses break ties to
+  // keep the visit order deterministic.
+  auto PageOrder = [](const Trace &A, const Trace &B) {
+    constexpr uint64_t PageShift = 12;
+    return std::make_tuple(A.From >> PageShift, A.To >> PageShift, A.From,
+                           A.To) < std::make_tuple(B.From >> PageShift,
+                                                   B.To >> PageShift, B.From,
+                                                   B.To);
+  };
+
+  std::vector<std::pair<Trace, FTInfo>> FTs(FallthroughLBRs.begin(),
+                                            FallthroughLBRs.end());
+  std::sort(FTs.begin(), FTs.end(),
+            [&](const std::pair<Trace, FTInfo> &A,
+                const std::pair<Trace, FTInfo> &B) {
+              return PageOrder(A.first, B.first);
+            });
+  for (const std::pair<Trace, FTInfo> &AggrLBR : FTs) {
+    const Trace &Loc = AggrLBR.first;
+    const FTInfo &Info = AggrLBR.second;
+    LBREntry First{Loc.From, Loc.From, false};
+    LBREntry Second{Loc.To, Loc.To, false};
+    if (Info.InternCount)
+      doTrace(First, Second, Info.InternCount);
+    if (Info.ExternCount) {
+      First.From = 0;
+      doTrace(First, Second, Info.ExternCount);
+    }
+  }
+
+  // Apply the fallthroughs coalesced by doTrace() in bulk: each unique
+  // basic block pair is translated and recorded once, with the combined
+  // count of all traces crossing it.
+  std::vector<std::pair<Trace, uint64_t>> FTCounts(BATFallthroughCounts.begin(),
+                                                   BATFallthroughCounts.end());
+  std::sort(FTCounts.begin(), FTCounts.end(),
+            [&](const std::pair<Trace, uint64_t> &A,
+                const std::pair<Trace, uint64_t> &B) {
+              return PageOrder(A.first, B.first);
+            });
+  for (const std::pair<Trace, uint64_t> &FT : FTCounts)
+    if (BinaryFunction *Func =
+            getBinaryFunctionContainingAddress(FT.first.From))
+      doIntraBranch(*Func, FT.first.From, FT.first.To, FT.second,
+                    /*Mispreds=*/0);
+  clear(BATFallthroughCounts);
+
+  std::vector<std::pair<Trace, BranchInfo>> Branches(BranchLBRs.begin(),
+                                                     BranchLBRs.end());
+  std::sort(Branches.begin(), Branches.end(),
+            [&](const std::pair<Trace, BranchInfo> &A,
+                const std::pair<Trace, BranchInfo> &B) {
+              return PageOrder(A.first, B.first);
+            });
+  for (const std::pair<Trace, BranchInfo> &AggrLBR : Branches) {
+    const Trace &Loc = AggrLBR.first;
+    const BranchInfo &Info = AggrLBR.second;
+    doBranch(Loc.From, Loc.To, Info.TakenCount, Info.MispredCount);
+  }
+}
+
 std::error_code DataAggregator::parseBasicEvents() {
   outs() << "PERF2BOLT: parsing basic events (without LBR)...\n";
   NamedRegionTimer T("parseBasic", "Parsing basic events", TimerGroupName,
                      TimerGroupDesc, opts::TimeAggregator);
-  while (hasData()) {
-    ErrorOr<PerfBasicSample> Sample = parseBasicSample();
-    if (std::error_code EC = Sample.getError())
-      return EC;
+  auto parseAvailableSamples = [&]() -> std::error_code {
+    while (hasData()) {
+      ErrorOr<PerfBasicSample> Sample = parseBasicSample();
+      if (std::error_code EC = Sample.getError())
+        return EC;
 
-    if (!Sample->PC)
-      continue;
+      if (!Sample->PC)
+        continue;
 
-    if (BinaryFunction *BF = getBinaryFunctionContainingAddress(Sample->PC))
-      BF->setHasProfileAvailable();
+      if (BinaryFunction *BF = getBinaryFunctionContainingAddress(Sample->PC))
+        BF->setHasProfileAvailable();
 
-    ++BasicSamples[Sample->PC];
-    EventNames.insert(Sample->EventName);
-  }
+      ++BasicSamples[Sample->PC];
+      EventNames.insert(Sample->EventName);
+    }
+    return std::error_code();
+  };
 
-  return std::error_code();
+  if (MainEventsPPI.IsPipe)
+    return streamPerfOutput(MainEventsPPI, parseAvailableSamples);
+  return parseAvailableSamples();
 }
 
 void DataAggregator::processBasicEvents() {
@@ -1706,6 +2471,15 @@ std::error_code DataAggregator::parsePreAggregatedLBRSamples() {
   outs() << "PERF2BOLT: parsing pre-aggregated profile...\n";
   NamedRegionTimer T("parseAggregated", "Parsing aggregated branch events",
                      TimerGroupName, TimerGroupDesc, opts::TimeAggregator);
+
+  // Records are line-delimited and independent, so large inputs can be
+  // parsed in shards.
+  if (opts::NoThreads || ParsingBuf.size() < MinBufferSizeForParallelParsing)
+    return parsePreAggregatedLBRSamplesImpl();
+  return parsePreAggregatedLBRSamplesParallel();
+}
+
+std::error_code DataAggregator::parsePreAggregatedLBRSamplesImpl() {
   while (hasData()) {
     ErrorOr<AggregatedLBREntry> AggrEntry = parseAggregatedLBREntry();
     if (std::error_code EC = AggrEntry.getError())
@@ -1724,6 +2498,70 @@ std::error_code DataAggregator::parsePreAggregatedLBRSamples() {
   return std::error_code();
 }
 
+std::error_code DataAggregator::parsePreAggregatedLBRSamplesParallel() {
+  // Split the input at record boundaries into roughly equal-sized shards,
+  // one per task.
+  const StringRef Buf = ParsingBuf;
+  const size_t NumTasks = opts::ThreadCount * opts::TaskCount;
+  const size_t ChunkSize = Buf.size() / NumTasks + 1;
+  std::vector<StringRef> ShardBufs;
+  size_t Pos = 0;
+  while (Pos < Buf.size()) {
+    size_t End = Pos + ChunkSize;
+    if (End >= Buf.size()) {
+      End = Buf.size();
+    } else {
+      const size_t NewLine = Buf.find('\n', End);
+      End = NewLine == StringRef::npos ? Buf.size() : NewLine + 1;
+    }
+    ShardBufs.push_back(Buf.slice(Pos, End));
+    Pos = End;
+  }
+
+  outs() << "PERF2BOLT: parsing pre-aggregated profile in " << ShardBufs.size()
+         << " shards\n";
+
+  // Parse each shard with a private aggregator to keep parser state
+  // thread-local. Shard buffers alias the memory-mapped input, so locations
+  // in the parsed records stay valid after the merge.
+  std::vector<std::unique_ptr<DataAggregator>> Shards(ShardBufs.size());
+  std::vector<std::error_code> ShardErrs(ShardBufs.size());
+  ThreadPool &Pool = ParallelUtilities::getThreadPool();
+  for (size_t I = 0; I < ShardBufs.size(); ++I) {
+    Shards[I] = std::unique_ptr<DataAggregator>(
+        new DataAggregator(Filename, ShardTag()));
+    DataAggregator &Shard = *Shards[I];
+    Shard.BC = BC;
+    Shard.BAT = BAT;
+    Shard.BinaryMMapInfo = BinaryMMapInfo;
+    Shard.ParsingBuf = ShardBufs[I];
+    Shard.Col = 0;
+    Shard.Line = 1;
+    Pool.async(
+        [](DataAggregator *Shard, std::error_code *ShardErr) {
+          *ShardErr = Shard->parsePreAggregatedLBRSamplesImpl();
+        },
+        &Shard, &ShardErrs[I]);
+  }
+  Pool.wait();
+
+  // Concatenate per-shard records preserving the input order.
+  size_t NumRecords = AggregatedLBRs.size();
+  for (const std::unique_ptr<DataAggregator> &Shard : Shards)
+    NumRecords += Shard->AggregatedLBRs.size();
+  AggregatedLBRs.reserve(NumRecords);
+  for (size_t I = 0; I < Shards.size(); ++I) {
+    if (ShardErrs[I])
+      return ShardErrs[I];
+    std::vector<AggregatedLBREntry> &ShardLBRs = Shards[I]->AggregatedLBRs;
+    AggregatedLBRs.insert(AggregatedLBRs.end(),
+                          std::make_move_iterator(ShardLBRs.begin()),
+                          std::make_move_iterator(ShardLBRs.end()));
+  }
+
+  return std::error_code();
+}
+
 void DataAggregator::processPreAggregated() {
   outs() << "PERF2BOLT: processing pre-aggregated profile...\n";
   NamedRegionTimer T("processAggregated", "Processing aggregated branch events",
@@ -1812,19 +2650,6 @@ Optional<int32_t> DataAggregator::parseCommExecEvent() {
   return PID;
 }
 
-namespace {
-Optional<uint64_t> parsePerfTime(const StringRef TimeStr) {
-  const StringRef SecTimeStr = TimeStr.split('.').first;
-  const StringRef USecTimeStr = TimeStr.split('.').second;
-  uint64_t SecTime;
-  uint64_t USecTime;
-  if (SecTimeStr.getAsInteger(10, SecTime) ||
-      USecTimeStr.getAsInteger(10, USecTime))
-    return NoneType();
-  return SecTime * 1000000ULL + USecTime;
-}
-}
-
 Optional<DataAggregator::ForkInfo> DataAggregator::parseForkEvent() {
   while (checkAndConsumeFS()) {
   }
@@ -2200,6 +3025,57 @@ DataAggregator::writeAggregatedFile(StringRef OutputFilename) const {
   return std::error_code();
 }
 
+std::error_code
+DataAggregator::writeTimeSlicedFiles(StringRef OutputFilename) {
+  // Run each slice through the same attribution pipeline that produced the
+  // combined profile and reuse the regular writer, so every slice file is a
+  // plain fdata profile: use one directly with -data, or blend several with
+  // merge-fdata -weights. Memory data is not timestamped and goes only to
+  // the combined file.
+  for (unsigned Slice = 0; Slice < NumTimeSlices; ++Slice) {
+    // Drop the attribution state of the previously written profile.
+    for (auto &BFI : BC->getBinaryFunctions())
+      setBranchData(BFI.second, nullptr);
+    NamesToBranches.clear();
+    NamesToMemEvents.clear();
+
+    for (const auto &AggrLBR : SlicedFallthroughLBRs[Slice]) {
+      const Trace &Loc = AggrLBR.first;
+      const FTInfo &Info = AggrLBR.second;
+      LBREntry First{Loc.From, Loc.From, false};
+      LBREntry Second{Loc.To, Loc.To, false};
+      if (Info.InternCount)
+        doTrace(First, Second, Info.InternCount);
+      if (Info.ExternCount) {
+        First.From = 0;
+        doTrace(First, Second, Info.ExternCount);
+      }
+    }
+
+    for (const auto &AggrLBR : SlicedBranchLBRs[Slice]) {
+      const Trace &Loc = AggrLBR.first;
+      const BranchInfo &Info = AggrLBR.second;
+      doBranch(Loc.From, Loc.To, Info.TakenCount, Info.MispredCount);
+    }
+
+    outs() << "PERF2BOLT: time slice " << Slice << " covers ["
+           << SliceTimeBase + Slice * SliceTimeWidth << ", "
+           << SliceTimeBase + (Slice + 1) * SliceTimeWidth << ") us\n";
+    const std::string SliceFilename =
+        (OutputFilename + "-slice" + Twine(Slice) + ".fdata").str();
+    if (std::error_code EC = writeAggregatedFile(SliceFilename))
+      return EC;
+
+    clear(SlicedFallthroughLBRs[Slice]);
+    clear(SlicedBranchLBRs[Slice]);
+  }
+
+  clear(SlicedBranchLBRs);
+  clear(SlicedFallthroughLBRs);
+
+  return std::error_code();
+}
+
 void DataAggregator::dump() const { DataReader::dump(); }
 
 void DataAggregator::dump(const LBREntry &LBR) const {
@@ -13,11 +13,26 @@
 
 #include "bolt/Profile/DataReader.h"
 #include "bolt/Core/BinaryFunction.h"
+#include "bolt/Core/ParallelUtilities.h"
 #include "bolt/Passes/MCF.h"
+#include "bolt/Profile/ProfileBinaryFormat.h"
 #include "bolt/Utils/Utils.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/xxhash.h"
+#include <algorithm>
 #include <map>
+#include <mutex>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt-prof"
@@ -35,6 +50,15 @@ DumpData("dump-data",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+cl::opt<std::string>
+ProfileMatchCacheFile("profile-match-cache",
+  cl::desc("file with a cross-binary profile match cache. Exact profile "
+           "matches are recorded against the function content hash and "
+           "reused by later runs on binaries sharing the code, e.g. common "
+           "static libraries. The file is created if it does not exist"),
+  cl::Optional,
+  cl::cat(BoltCategory));
+
 } // namespace opts
 
 namespace llvm {
@@ -67,6 +91,96 @@ std::string normalizeName(StringRef NameRef) {
   return getEscapedName(NameRef);
 }
 
+/// Find the first occurrence of one of three delimiter characters in \p Buf
+/// starting at \p From, processing a vector register worth of bytes per
+/// iteration where SSE2 or NEON is available. Pass the same character more
+/// than once to search for fewer delimiters. Return StringRef::npos if no
+/// delimiter is present.
+size_t findDelimiter(StringRef Buf, size_t From, char A, char B, char C) {
+  const char *Data = Buf.data();
+  const size_t Size = Buf.size();
+  size_t I = From;
+#if defined(__SSE2__)
+  const __m128i VA = _mm_set1_epi8(A);
+  const __m128i VB = _mm_set1_epi8(B);
+  const __m128i VC = _mm_set1_epi8(C);
+  for (; I + 16 <= Size; I += 16) {
+    const __m128i Bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(Data + I));
+    const __m128i Hits = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(Bytes, VA), _mm_cmpeq_epi8(Bytes, VB)),
+        _mm_cmpeq_epi8(Bytes, VC));
+    if (const unsigned Mask = _mm_movemask_epi8(Hits))
+      return I + countTrailingZeros(Mask);
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t VA = vdupq_n_u8(A);
+  const uint8x16_t VB = vdupq_n_u8(B);
+  const uint8x16_t VC = vdupq_n_u8(C);
+  for (; I + 16 <= Size; I += 16) {
+    const uint8x16_t Bytes =
+        vld1q_u8(reinterpret_cast<const uint8_t *>(Data + I));
+    const uint8x16_t Hits = vorrq_u8(
+        vorrq_u8(vceqq_u8(Bytes, VA), vceqq_u8(Bytes, VB)),
+        vceqq_u8(Bytes, VC));
+    // Narrow each matching byte to four mask bits to locate the first hit.
+    const uint8x8_t Narrowed = vshrn_n_u16(vreinterpretq_u16_u8(Hits), 4);
+    if (const uint64_t Mask = vget_lane_u64(vreinterpret_u64_u8(Narrowed), 0))
+      return I + (countTrailingZeros(Mask) >> 2);
+  }
+#endif
+  for (; I < Size; ++I) {
+    const char Ch = Data[I];
+    if (Ch == A || Ch == B || Ch == C)
+      return I;
+  }
+  return StringRef::npos;
+}
+
+/// Convert the decimal string \p Str to \p Num. Mirrors the error semantics
+/// of StringRef::getAsInteger while keeping the conversion loop free of
+/// radix dispatch. Return true on error.
+bool parseDecimalValue(StringRef Str, int64_t &Num) {
+  const bool Negative = Str.startswith("-");
+  if (Negative)
+    Str = Str.drop_front();
+  if (Str.empty())
+    return true;
+  uint64_t Value = 0;
+  for (const char Ch : Str) {
+    if (Ch < '0' || Ch > '9')
+      return true;
+    const uint64_t Digit = Ch - '0';
+    if (Value > (UINT64_MAX - Digit) / 10)
+      return true;
+    Value = Value * 10 + Digit;
+  }
+  if (Value > static_cast<uint64_t>(INT64_MAX) + (Negative ? 1 : 0))
+    return true;
+  Num = Negative ? -static_cast<int64_t>(Value) : static_cast<int64_t>(Value);
+  return false;
+}
+
+/// Convert the hexadecimal string \p Str, with or without a "0x" prefix, to
+/// \p Num. Return true on error.
+bool parseHexValue(StringRef Str, uint64_t &Num) {
+  if (Str.startswith("0x") || Str.startswith("0X"))
+    Str = Str.drop_front(2);
+  if (Str.empty())
+    return true;
+  uint64_t Value = 0;
+  for (const char Ch : Str) {
+    const unsigned Digit = hexDigitValue(Ch);
+    if (Digit == -1U)
+      return true;
+    if (Value >> 60)
+      return true;
+    Value = (Value << 4) | Digit;
+  }
+  Num = Value;
+  return false;
+}
+
 } // anonymous namespace
 
 raw_ostream &operator<<(raw_ostream &OS, const Location &Loc) {
@@ -81,19 +195,38 @@ raw_ostream &operator<<(raw_ostream &OS, const Location &Loc) {
 }
 
 void FuncBranchData::appendFrom(const FuncBranchData &FBD, uint64_t Offset) {
+  const size_t OldSize = Data.size();
+  Data.reserve(OldSize + FBD.Data.size());
   Data.insert(Data.end(), FBD.Data.begin(), FBD.Data.end());
-  for (auto I = Data.begin(), E = Data.end(); I != E; ++I) {
-    if (I->From.Name == FBD.Name) {
-      I->From.Name = this->Name;
-      I->From.Offset += Offset;
+  // Rebase every reference to the donor's name. Only the To location of a
+  // pre-existing record can refer to the donor (a call into the secondary
+  // entry point); if one is found the whole vector is re-sorted since the
+  // order of records sharing a From location may change.
+  bool RebasedExisting = false;
+  for (size_t I = 0, E = Data.size(); I != E; ++I) {
+    BranchInfo &BI = Data[I];
+    if (BI.From.Name == FBD.Name) {
+      BI.From.Name = this->Name;
+      BI.From.Offset += Offset;
     }
-    if (I->To.Name == FBD.Name) {
-      I->To.Name = this->Name;
-      I->To.Offset += Offset;
+    if (BI.To.Name == FBD.Name) {
+      BI.To.Name = this->Name;
+      BI.To.Offset += Offset;
+      if (I < OldSize)
+        RebasedExisting = true;
     }
   }
-  std::stable_sort(Data.begin(), Data.end());
+  if (RebasedExisting) {
+    std::stable_sort(Data.begin(), Data.end());
+  } else {
+    // Rebasing shifts the appended records monotonically, so sorting them
+    // and merging with the already sorted original records is equivalent to
+    // re-sorting the whole vector.
+    std::stable_sort(Data.begin() + OldSize, Data.end());
+    std::inplace_merge(Data.begin(), Data.begin() + OldSize, Data.end());
+  }
   ExecutionCount += FBD.ExecutionCount;
+  EntryData.reserve(EntryData.size() + FBD.EntryData.size());
   for (auto I = FBD.EntryData.begin(), E = FBD.EntryData.end(); I != E; ++I) {
     assert(I->To.Name == FBD.Name);
     auto NewElmt = EntryData.insert(EntryData.end(), *I);
@@ -262,16 +395,43 @@ Error DataReader::preprocessProfile(BinaryContext &BC) {
     outs() << "BOLT-INFO: profile collection done on a binary already "
               "processed by BOLT\n";
 
-  for (auto &BFI : BC.getBinaryFunctions()) {
-    BinaryFunction &Function = BFI.second;
-    if (FuncMemData *MemData = getMemDataForNames(Function.getNames())) {
-      setMemData(Function, MemData);
-      MemData->Used = true;
+  // Phase one: match profile objects to functions by name. Every function
+  // probes the name maps with each of its (typically long, mangled) names,
+  // and the lookups are read-only once parsing is done, so run them in
+  // parallel and record the matches.
+  struct MatchTy {
+    BinaryFunction *Function;
+    FuncBranchData *FuncData;
+    FuncMemData *MemData;
+  };
+  std::vector<MatchTy> Matches;
+  std::mutex MatchesMutex;
+
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &Function) {
+    FuncMemData *MemData = getMemDataForNames(Function.getNames());
+    FuncBranchData *FuncData = getBranchDataForNames(Function.getNames());
+    if (!MemData && !FuncData)
+      return;
+    std::lock_guard<std::mutex> Lock(MatchesMutex);
+    Matches.push_back({&Function, FuncData, MemData});
+  };
+
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_CONSTANT, WorkFun, nullptr,
+      "preprocessProfile");
+
+  // Phase two: attribute the matched profile. Each match only writes state
+  // of its own function, and marking a profile object used is idempotent, so
+  // the order of Matches does not affect the result.
+  for (const MatchTy &Match : Matches) {
+    if (Match.MemData) {
+      setMemData(*Match.Function, Match.MemData);
+      Match.MemData->Used = true;
     }
-    if (FuncBranchData *FuncData = getBranchDataForNames(Function.getNames())) {
-      setBranchData(Function, FuncData);
-      Function.ExecutionCount = FuncData->ExecutionCount;
-      FuncData->Used = true;
+    if (Match.FuncData) {
+      setBranchData(*Match.Function, Match.FuncData);
+      Match.Function->ExecutionCount = Match.FuncData->ExecutionCount;
+      Match.FuncData->Used = true;
     }
   }
 
@@ -319,11 +479,26 @@ Error DataReader::readProfilePreCFG(BinaryContext &BC) {
 }
 
 Error DataReader::readProfile(BinaryContext &BC) {
+  loadProfileMatchCache();
+
   for (auto &BFI : BC.getBinaryFunctions()) {
     BinaryFunction &Function = BFI.second;
     readProfile(Function);
   }
 
+  if (ProfileMatchCacheActive) {
+    outs() << "BOLT-INFO: profile match cache: " << ProfileMatchCacheHits
+           << " functions matched by content hash\n";
+    saveProfileMatchCache(BC);
+  }
+
+  // Basic samples only set block counts. Infer the edge counts for all
+  // functions at once, so independent per-function work can run in parallel.
+  if (!hasLBR())
+    estimateEdgeCounts(BC, [this](const BinaryFunction &BF) {
+      return BF.empty() || !getFuncSampleData(BF.getNames());
+    });
+
   uint64_t NumUnused = 0;
   for (const StringMapEntry<FuncBranchData> &FuncData : NamesToBranches)
     if (!FuncData.getValue().Used)
@@ -342,6 +517,8 @@ std::error_code DataReader::parseInput() {
   }
   FileBuf = std::move(MB.get());
   ParsingBuf = FileBuf->getBuffer();
+  if (ParsingBuf.startswith(getProfileBinaryMagic()))
+    return parseBinaryFdata();
   if (std::error_code EC = parse())
     return EC;
   if (!ParsingBuf.empty())
@@ -357,6 +534,17 @@ void DataReader::readProfile(BinaryFunction &BF) {
   if (BF.empty())
     return;
 
+  // Attach the first-touch timestamp if the profile recorded one for any of
+  // the function's names.
+  if (!NamesToFirstTouch.empty()) {
+    for (StringRef Name : BF.getNames()) {
+      auto It = NamesToFirstTouch.find(Name);
+      if (It != NamesToFirstTouch.end() &&
+          It->getValue() < BF.getFirstTouchTime())
+        BF.setFirstTouchTime(It->getValue());
+    }
+  }
+
   if (!hasLBR()) {
     BF.ProfileFlags = BinaryFunction::PF_SAMPLE;
     readSampleData(BF);
@@ -427,6 +615,30 @@ void DataReader::matchProfileData(BinaryFunction &BF) {
     }
   }
 
+  // Look up the function body in the cross-binary match cache before falling
+  // back to the fuzzy name search. The recorded record still has to pass the
+  // full evaluation since the content hash ignores instruction operands.
+  if (ProfileMatchCacheActive) {
+    auto CacheIt = ProfileMatchCache.find(BF.computeHash(/*UseDFS=*/true));
+    if (CacheIt != ProfileMatchCache.end()) {
+      auto NameIt = NamesToBranches.find(CacheIt->second);
+      if (NameIt != NamesToBranches.end() && !NameIt->getValue().Used &&
+          evaluateProfileData(BF, NameIt->getValue()) == 1.0f) {
+        FuncBranchData *NewBranchData = &NameIt->getValue();
+        if (FBD)
+          FBD->Used = false;
+
+        setBranchData(BF, NewBranchData);
+        NewBranchData->Used = true;
+        BF.ExecutionCount = NewBranchData->ExecutionCount;
+        BF.RawBranchCount = NewBranchData->getNumExecutedBranches();
+        BF.ProfileMatchRatio = 1.0f;
+        ++ProfileMatchCacheHits;
+        return;
+      }
+    }
+  }
+
   // Check if the function name can fluctuate between several compilations
   // possibly triggered by minor unrelated code changes in the source code
   // of the input binary.
@@ -456,6 +668,94 @@ void DataReader::matchProfileData(BinaryFunction &BF) {
   }
 }
 
+void DataReader::loadProfileMatchCache() {
+  if (opts::ProfileMatchCacheFile.empty() || !hasLBR())
+    return;
+
+  ProfileMatchCacheActive = true;
+  ProfileContentsHash = xxHash64(FileBuf->getBuffer());
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+      MemoryBuffer::getFile(opts::ProfileMatchCacheFile);
+  if (!MB) {
+    // Start with an empty cache. It is written out after attribution.
+    return;
+  }
+
+  StringRef Buf = (*MB)->getBuffer();
+  StringRef Line;
+  std::tie(Line, Buf) = Buf.split('\n');
+  uint64_t RecordedHash;
+  if (!Line.consume_front("profile ") ||
+      Line.getAsInteger(16, RecordedHash) ||
+      RecordedHash != ProfileContentsHash) {
+    errs() << "BOLT-WARNING: ignoring profile match cache "
+           << opts::ProfileMatchCacheFile
+           << ": recorded against a different profile\n";
+    return;
+  }
+
+  while (!Buf.empty()) {
+    std::tie(Line, Buf) = Buf.split('\n');
+    if (Line.empty())
+      continue;
+    StringRef HashStr, Name;
+    std::tie(HashStr, Name) = Line.split(FieldSeparator);
+    uint64_t FunctionHash;
+    if (HashStr.getAsInteger(16, FunctionHash) || Name.empty())
+      continue;
+    ProfileMatchCache[FunctionHash] = Name.str();
+  }
+}
+
+void DataReader::saveProfileMatchCache(BinaryContext &BC) {
+  if (!ProfileMatchCacheActive)
+    return;
+
+  // Merge this run's exact matches into the cache so that entries recorded
+  // by runs on other binaries are preserved.
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    BinaryFunction &BF = BFI.second;
+    if (BF.empty() || BF.ProfileMatchRatio != 1.0f)
+      continue;
+    FuncBranchData *FBD = getBranchData(BF);
+    if (!FBD)
+      continue;
+    ProfileMatchCache[BF.computeHash(/*UseDFS=*/true)] = FBD->Name.str();
+  }
+
+  // Write to a unique temporary and move it in place at the end, so parallel
+  // runs sharing the cache file never observe a torn cache.
+  int FD;
+  SmallString<128> TmpPath;
+  if (std::error_code EC = sys::fs::createUniqueFile(
+          opts::ProfileMatchCacheFile + ".tmp%%%%%%", FD, TmpPath)) {
+    errs() << "BOLT-WARNING: cannot write profile match cache to "
+           << opts::ProfileMatchCacheFile << ": " << EC.message() << '\n';
+    return;
+  }
+  raw_fd_ostream OS(FD, /*shouldClose=*/true);
+
+  std::vector<std::pair<uint64_t, StringRef>> Entries;
+  Entries.reserve(ProfileMatchCache.size());
+  for (const auto &Entry : ProfileMatchCache)
+    Entries.emplace_back(Entry.first, StringRef(Entry.second));
+  std::sort(Entries.begin(), Entries.end());
+
+  OS << "profile " << Twine::utohexstr(ProfileContentsHash) << '\n';
+  for (const std::pair<uint64_t, StringRef> &Entry : Entries)
+    OS << Twine::utohexstr(Entry.first) << FieldSeparator << Entry.second
+       << '\n';
+
+  OS.close();
+  if (std::error_code EC =
+          sys::fs::rename(TmpPath, opts::ProfileMatchCacheFile)) {
+    errs() << "BOLT-WARNING: cannot write profile match cache to "
+           << opts::ProfileMatchCacheFile << ": " << EC.message() << '\n';
+    sys::fs::remove(TmpPath);
+  }
+}
+
 void DataReader::matchProfileMemData(BinaryFunction &BF) {
   const std::vector<FuncMemData *> AllMemData =
       getMemDataForNamesRegex(BF.getNames());
@@ -496,6 +796,9 @@ bool DataReader::fetchProfileForOtherEntryPoints(BinaryFunction &BF) {
         if (FuncBranchData *Data = getBranchDataForSymbols(BD->getSymbols())) {
           FBD->appendFrom(*Data, BB->getOffset());
           Data->Used = true;
+          // The records now live rebased in FBD and this profile can no
+          // longer be matched by another function: drop the duplicate copy.
+          Data->clearRecords();
           Updated = true;
         }
       }
@@ -607,8 +910,6 @@ void DataReader::readSampleData(BinaryFunction &BF) {
   }
 
   BF.ExecutionCount = TotalEntryCount;
-
-  estimateEdgeCounts(BF);
 }
 
 void DataReader::convertBranchData(BinaryFunction &BF) const {
@@ -640,19 +941,21 @@ void DataReader::convertBranchData(BinaryFunction &BF) const {
         (!BC.MIB->isCall(*Instr) && !BC.MIB->isIndirectBranch(*Instr)))
       continue;
 
-    auto setOrUpdateAnnotation = [&](StringRef Name, uint64_t Count) {
-      if (opts::Verbosity >= 1 && BC.MIB->hasAnnotation(*Instr, Name))
-        errs() << "BOLT-WARNING: duplicate " << Name << " info for offset 0x"
-               << Twine::utohexstr(BI.From.Offset) << " in function " << BF
-               << '\n';
-      auto &Value = BC.MIB->getOrCreateAnnotationAs<uint64_t>(*Instr, Name);
+    auto setOrUpdateAnnotation = [&](unsigned Annotation, uint64_t Count) {
+      if (opts::Verbosity >= 1 && BC.MIB->hasAnnotation(*Instr, Annotation))
+        errs() << "BOLT-WARNING: duplicate "
+               << BC.MIB->getAnnotationName(Annotation)
+               << " info for offset 0x" << Twine::utohexstr(BI.From.Offset)
+               << " in function " << BF << '\n';
+      auto &Value =
+          BC.MIB->getOrCreateAnnotationAs<uint64_t>(*Instr, Annotation);
       Value += Count;
     };
 
     if (BC.MIB->isIndirectCall(*Instr) || BC.MIB->isIndirectBranch(*Instr)) {
       IndirectCallSiteProfile &CSP =
           BC.MIB->getOrCreateAnnotationAs<IndirectCallSiteProfile>(
-              *Instr, "CallProfile");
+              *Instr, MCPlus::MCAnnotation::kCallProfile);
       MCSymbol *CalleeSymbol = nullptr;
       if (BI.To.IsSymbol) {
         if (BinaryData *BD = BC.getBinaryDataByName(BI.To.Name))
@@ -660,10 +963,11 @@ void DataReader::convertBranchData(BinaryFunction &BF) const {
       }
       CSP.emplace_back(CalleeSymbol, BI.Branches, BI.Mispreds);
     } else if (BC.MIB->getConditionalTailCall(*Instr)) {
-      setOrUpdateAnnotation("CTCTakenCount", BI.Branches);
-      setOrUpdateAnnotation("CTCMispredCount", BI.Mispreds);
+      setOrUpdateAnnotation(MCPlus::MCAnnotation::kCTCTakenCount, BI.Branches);
+      setOrUpdateAnnotation(MCPlus::MCAnnotation::kCTCMispredCount,
+                            BI.Mispreds);
     } else {
-      setOrUpdateAnnotation("Count", BI.Branches);
+      setOrUpdateAnnotation(MCPlus::MCAnnotation::kCount, BI.Branches);
     }
   }
 }
@@ -706,7 +1010,8 @@ bool DataReader::recordBranch(BinaryFunction &BF, uint64_t From, uint64_t To,
       if (!BC.MIB->isNoop(Instr))
         break;
 
-      Offset += BC.MIB->getAnnotationWithDefault<uint32_t>(Instr, "Size");
+      Offset += BC.MIB->getAnnotationWithDefault<uint32_t>(
+          Instr, MCPlus::MCAnnotation::kSize);
     }
 
     if (To == Offset)
@@ -721,7 +1026,7 @@ bool DataReader::recordBranch(BinaryFunction &BF, uint64_t From, uint64_t To,
     const MCInst *LastInstr = ToBB->getLastNonPseudoInstr();
     if (LastInstr) {
       const uint32_t LastInstrOffset =
-          BC.MIB->getAnnotationWithDefault<uint32_t>(*LastInstr, "Offset");
+          BC.MIB->getOffsetWithDefault(*LastInstr, 0);
 
       // With old .fdata we are getting FT branches for "jcc,jmp" sequences.
       if (To == LastInstrOffset && BC.MIB->isUnconditionalBranch(*LastInstr))
@@ -847,14 +1152,11 @@ ErrorOr<StringRef> DataReader::parseString(char EndChar, bool EndNl) {
     return make_error_code(llvm::errc::io_error);
   }
 
-  std::string EndChars(1, EndChar);
-  EndChars.push_back('\\');
-  if (EndNl)
-    EndChars.push_back('\n');
+  const char NlChar = EndNl ? '\n' : EndChar;
 
   size_t StringEnd = 0;
   do {
-    StringEnd = ParsingBuf.find_first_of(EndChars, StringEnd);
+    StringEnd = findDelimiter(ParsingBuf, StringEnd, EndChar, '\\', NlChar);
     if (StringEnd == StringRef::npos ||
         (StringEnd == 0 && ParsingBuf[StringEnd] != '\\')) {
       reportError("malformed field");
@@ -890,7 +1192,7 @@ ErrorOr<int64_t> DataReader::parseNumberField(char EndChar, bool EndNl) {
     return EC;
   StringRef NumStr = NumStrRes.get();
   int64_t Num;
-  if (NumStr.getAsInteger(10, Num)) {
+  if (parseDecimalValue(NumStr, Num)) {
     reportError("expected decimal number");
     Diag << "Found: " << NumStr << "\n";
     return make_error_code(llvm::errc::io_error);
@@ -904,7 +1206,7 @@ ErrorOr<uint64_t> DataReader::parseHexField(char EndChar, bool EndNl) {
     return EC;
   StringRef NumStr = NumStrRes.get();
   uint64_t Num;
-  if (NumStr.getAsInteger(16, Num)) {
+  if (parseHexValue(NumStr, Num)) {
     reportError("expected hexidecimal number");
     Diag << "Found: " << NumStr << "\n";
     return make_error_code(llvm::errc::io_error);
@@ -1090,8 +1392,39 @@ bool DataReader::hasMemData() {
   return false;
 }
 
+bool DataReader::hasFirstTouchData() {
+  return ParsingBuf.startswith("first_touch ");
+}
+
+std::error_code DataReader::parseFirstTouchEntry() {
+  const size_t MarkerSize = sizeof("first_touch ") - 1;
+  ParsingBuf = ParsingBuf.drop_front(MarkerSize);
+  Col += MarkerSize;
+
+  ErrorOr<StringRef> Name = parseString(FieldSeparator);
+  if (std::error_code EC = Name.getError())
+    return EC;
+
+  ErrorOr<int64_t> Timestamp = parseNumberField('\n');
+  if (std::error_code EC = Timestamp.getError())
+    return EC;
+
+  // Keep the earliest record if the function appears more than once.
+  auto I = NamesToFirstTouch.insert(
+      std::make_pair(*Name, static_cast<uint64_t>(*Timestamp)));
+  if (!I.second)
+    I.first->getValue() = std::min(I.first->getValue(),
+                                   static_cast<uint64_t>(*Timestamp));
+  return std::error_code();
+}
+
 std::error_code DataReader::parseInNoLBRMode() {
-  auto GetOrCreateFuncEntry = [&](StringRef Name) {
+  // Samples for one function are consecutive; cache the last entry to avoid
+  // re-hashing its name. Entry pointers stay valid across rehashing.
+  StringMapEntry<FuncSampleData> *CachedSampleEntry = nullptr;
+  auto GetOrCreateFuncEntry = [&](StringRef Name) -> FuncSampleData & {
+    if (CachedSampleEntry && CachedSampleEntry->getKey() == Name)
+      return CachedSampleEntry->getValue();
     auto I = NamesToSamples.find(Name);
     if (I == NamesToSamples.end()) {
       bool Success;
@@ -1100,10 +1433,14 @@ std::error_code DataReader::parseInNoLBRMode() {
 
       assert(Success && "unexpected result of insert");
     }
-    return I;
+    CachedSampleEntry = &*I;
+    return I->getValue();
   };
 
-  auto GetOrCreateFuncMemEntry = [&](StringRef Name) {
+  StringMapEntry<FuncMemData> *CachedMemEntry = nullptr;
+  auto GetOrCreateFuncMemEntry = [&](StringRef Name) -> FuncMemData & {
+    if (CachedMemEntry && CachedMemEntry->getKey() == Name)
+      return CachedMemEntry->getValue();
     auto I = NamesToMemEvents.find(Name);
     if (I == NamesToMemEvents.end()) {
       bool Success;
@@ -1111,10 +1448,16 @@ std::error_code DataReader::parseInNoLBRMode() {
           std::make_pair(Name, FuncMemData(Name, FuncMemData::ContainerTy())));
       assert(Success && "unexpected result of insert");
     }
-    return I;
+    CachedMemEntry = &*I;
+    return I->getValue();
   };
 
-  while (hasBranchData()) {
+  while (hasBranchData() || hasFirstTouchData()) {
+    if (hasFirstTouchData()) {
+      if (std::error_code EC = parseFirstTouchEntry())
+        return EC;
+      continue;
+    }
     ErrorOr<SampleInfo> Res = parseSampleInfo();
     if (std::error_code EC = Res.getError())
       return EC;
@@ -1125,11 +1468,15 @@ std::error_code DataReader::parseInNoLBRMode() {
     if (!SI.Loc.IsSymbol)
       continue;
 
-    StringMapIterator<FuncSampleData> I = GetOrCreateFuncEntry(SI.Loc.Name);
-    I->getValue().Data.emplace_back(std::move(SI));
+    GetOrCreateFuncEntry(SI.Loc.Name).Data.emplace_back(std::move(SI));
   }
 
-  while (hasMemData()) {
+  while (hasMemData() || hasFirstTouchData()) {
+    if (hasFirstTouchData()) {
+      if (std::error_code EC = parseFirstTouchEntry())
+        return EC;
+      continue;
+    }
     ErrorOr<MemInfo> Res = parseMemInfo();
     if (std::error_code EC = Res.getError())
       return EC;
@@ -1140,8 +1487,7 @@ std::error_code DataReader::parseInNoLBRMode() {
     if (!MI.Offset.IsSymbol)
       continue;
 
-    StringMapIterator<FuncMemData> I = GetOrCreateFuncMemEntry(MI.Offset.Name);
-    I->getValue().Data.emplace_back(std::move(MI));
+    GetOrCreateFuncMemEntry(MI.Offset.Name).Data.emplace_back(std::move(MI));
   }
 
   for (StringMapEntry<FuncSampleData> &FuncSamples : NamesToSamples)
@@ -1156,7 +1502,15 @@ std::error_code DataReader::parseInNoLBRMode() {
 }
 
 std::error_code DataReader::parse() {
-  auto GetOrCreateFuncEntry = [&](StringRef Name) {
+  // Consecutive records overwhelmingly refer to the same functions and the
+  // mangled names are long, so cache the last entry resolved for each slot
+  // to avoid re-hashing the name. Entry pointers, unlike iterators, stay
+  // valid when the map rehashes.
+  auto GetOrCreateFuncEntry =
+      [&](StringRef Name,
+          StringMapEntry<FuncBranchData> *&Cached) -> FuncBranchData & {
+    if (Cached && Cached->getKey() == Name)
+      return Cached->getValue();
     auto I = NamesToBranches.find(Name);
     if (I == NamesToBranches.end()) {
       bool Success;
@@ -1165,10 +1519,14 @@ std::error_code DataReader::parse() {
                                FuncBranchData::ContainerTy())));
       assert(Success && "unexpected result of insert");
     }
-    return I;
+    Cached = &*I;
+    return I->getValue();
   };
 
-  auto GetOrCreateFuncMemEntry = [&](StringRef Name) {
+  StringMapEntry<FuncMemData> *CachedMemEntry = nullptr;
+  auto GetOrCreateFuncMemEntry = [&](StringRef Name) -> FuncMemData & {
+    if (CachedMemEntry && CachedMemEntry->getKey() == Name)
+      return CachedMemEntry->getValue();
     auto I = NamesToMemEvents.find(Name);
     if (I == NamesToMemEvents.end()) {
       bool Success;
@@ -1176,7 +1534,8 @@ std::error_code DataReader::parse() {
           std::make_pair(Name, FuncMemData(Name, FuncMemData::ContainerTy())));
       assert(Success && "unexpected result of insert");
     }
-    return I;
+    CachedMemEntry = &*I;
+    return I->getValue();
   };
 
   Col = 0;
@@ -1199,7 +1558,14 @@ std::error_code DataReader::parse() {
   if (NoLBRMode)
     return parseInNoLBRMode();
 
-  while (hasBranchData()) {
+  StringMapEntry<FuncBranchData> *CachedFromEntry = nullptr;
+  StringMapEntry<FuncBranchData> *CachedToEntry = nullptr;
+  while (hasBranchData() || hasFirstTouchData()) {
+    if (hasFirstTouchData()) {
+      if (std::error_code EC = parseFirstTouchEntry())
+        return EC;
+      continue;
+    }
     ErrorOr<BranchInfo> Res = parseBranchInfo();
     if (std::error_code EC = Res.getError())
       return EC;
@@ -1210,27 +1576,34 @@ std::error_code DataReader::parse() {
     if (!BI.From.IsSymbol && !BI.To.IsSymbol)
       continue;
 
-    StringMapIterator<FuncBranchData> I = GetOrCreateFuncEntry(BI.From.Name);
-    I->getValue().Data.emplace_back(std::move(BI));
-
-    // Add entry data for branches to another function or branches
-    // to entry points (including recursive calls)
-    if (BI.To.IsSymbol &&
-        (!BI.From.Name.equals(BI.To.Name) || BI.To.Offset == 0)) {
-      I = GetOrCreateFuncEntry(BI.To.Name);
-      I->getValue().EntryData.emplace_back(std::move(BI));
-    }
-
-    // If destination is the function start - update execution count.
-    // NB: the data is skewed since we cannot tell tail recursion from
-    //     branches to the function start.
-    if (BI.To.IsSymbol && BI.To.Offset == 0) {
-      I = GetOrCreateFuncEntry(BI.To.Name);
-      I->getValue().ExecutionCount += BI.Branches;
+    FuncBranchData &FromData = GetOrCreateFuncEntry(BI.From.Name,
+                                                    CachedFromEntry);
+    FromData.Data.emplace_back(std::move(BI));
+
+    if (BI.To.IsSymbol) {
+      // One lookup serves both updates below. Entry identity substitutes for
+      // comparing the names.
+      FuncBranchData &ToData = GetOrCreateFuncEntry(BI.To.Name, CachedToEntry);
+
+      // Add entry data for branches to another function or branches
+      // to entry points (including recursive calls)
+      if (&ToData != &FromData || BI.To.Offset == 0)
+        ToData.EntryData.emplace_back(std::move(BI));
+
+      // If destination is the function start - update execution count.
+      // NB: the data is skewed since we cannot tell tail recursion from
+      //     branches to the function start.
+      if (BI.To.Offset == 0)
+        ToData.ExecutionCount += BI.Branches;
     }
   }
 
-  while (hasMemData()) {
+  while (hasMemData() || hasFirstTouchData()) {
+    if (hasFirstTouchData()) {
+      if (std::error_code EC = parseFirstTouchEntry())
+        return EC;
+      continue;
+    }
     ErrorOr<MemInfo> Res = parseMemInfo();
     if (std::error_code EC = Res.getError())
       return EC;
@@ -1241,8 +1614,8 @@ std::error_code DataReader::parse() {
     if (!MI.Offset.IsSymbol)
       continue;
 
-    StringMapIterator<FuncMemData> I = GetOrCreateFuncMemEntry(MI.Offset.Name);
-    I->getValue().Data.emplace_back(std::move(MI));
+    FuncMemData &MemData = GetOrCreateFuncMemEntry(MI.Offset.Name);
+    MemData.Data.emplace_back(std::move(MI));
   }
 
   for (StringMapEntry<FuncBranchData> &FuncBranches : NamesToBranches)
@@ -1256,6 +1629,121 @@ std::error_code DataReader::parse() {
   return std::error_code();
 }
 
+std::error_code DataReader::parseBinaryFdata() {
+  using namespace llvm::support;
+
+  const StringRef Buf = ParsingBuf;
+  // The buffer has been consumed; prevent the corrupted-profile warning.
+  ParsingBuf = StringRef();
+
+  if (Buf.size() < sizeof(ProfileBinaryHeader)) {
+    Diag << "ERROR: truncated binary fdata header\n";
+    return make_error_code(llvm::errc::io_error);
+  }
+
+  const char *Data = Buf.data();
+  const uint32_t Version = endian::read32le(Data + ProfileBinaryMagicSize);
+  const uint32_t Flags = endian::read32le(Data + ProfileBinaryMagicSize + 4);
+  const uint64_t NumBranchEntries = endian::read64le(Data + 16);
+  const uint64_t StringTableOffset = endian::read64le(Data + 24);
+  const uint64_t StringTableSize = endian::read64le(Data + 32);
+
+  if (Version != ProfileBinaryVersion) {
+    Diag << "ERROR: unsupported binary fdata version " << Version << "\n";
+    return make_error_code(llvm::errc::io_error);
+  }
+
+  const uint64_t RecordsEnd = sizeof(ProfileBinaryHeader) +
+                              NumBranchEntries *
+                                  sizeof(ProfileBinaryBranchRecord);
+  if (RecordsEnd > StringTableOffset ||
+      StringTableOffset + StringTableSize > Buf.size()) {
+    Diag << "ERROR: corrupted binary fdata file\n";
+    return make_error_code(llvm::errc::io_error);
+  }
+
+  BATMode = Flags & PBF_BOLTED_COLLECTION;
+
+  const StringRef StrTab = Buf.substr(StringTableOffset, StringTableSize);
+  auto getLocation = [&](uint32_t NameOffset,
+                         uint64_t Offset) -> ErrorOr<Location> {
+    if (NameOffset == ProfileBinaryBranchRecord::UnknownNameOffset)
+      return Location(Offset);
+    const size_t NameEnd = StrTab.find('\0', NameOffset);
+    if (NameOffset >= StringTableSize || NameEnd == StringRef::npos) {
+      Diag << "ERROR: invalid string table reference in binary fdata\n";
+      return make_error_code(llvm::errc::io_error);
+    }
+    return Location(true, StrTab.slice(NameOffset, NameEnd), Offset);
+  };
+
+  // Same entry caching as in parse(): records for one function are
+  // consecutive, and entry pointers stay valid across rehashing.
+  auto GetOrCreateFuncEntry =
+      [&](StringRef Name,
+          StringMapEntry<FuncBranchData> *&Cached) -> FuncBranchData & {
+    if (Cached && Cached->getKey() == Name)
+      return Cached->getValue();
+    auto I = NamesToBranches.find(Name);
+    if (I == NamesToBranches.end()) {
+      bool Success;
+      std::tie(I, Success) = NamesToBranches.insert(std::make_pair(
+          Name, FuncBranchData(Name, FuncBranchData::ContainerTy(),
+                               FuncBranchData::ContainerTy())));
+      assert(Success && "unexpected result of insert");
+    }
+    Cached = &*I;
+    return I->getValue();
+  };
+
+  StringMapEntry<FuncBranchData> *CachedFromEntry = nullptr;
+  StringMapEntry<FuncBranchData> *CachedToEntry = nullptr;
+  for (uint64_t I = 0; I < NumBranchEntries; ++I) {
+    const char *Record = Data + sizeof(ProfileBinaryHeader) +
+                         I * sizeof(ProfileBinaryBranchRecord);
+    ErrorOr<Location> From = getLocation(endian::read32le(Record),
+                                         endian::read64le(Record + 8));
+    if (std::error_code EC = From.getError())
+      return EC;
+    ErrorOr<Location> To = getLocation(endian::read32le(Record + 4),
+                                       endian::read64le(Record + 16));
+    if (std::error_code EC = To.getError())
+      return EC;
+
+    BranchInfo BI(From.get(), To.get(), endian::read64le(Record + 24),
+                  endian::read64le(Record + 32));
+
+    // Ignore branches not involving known location.
+    if (!BI.From.IsSymbol && !BI.To.IsSymbol)
+      continue;
+
+    FuncBranchData &FromData = GetOrCreateFuncEntry(BI.From.Name,
+                                                    CachedFromEntry);
+    FromData.Data.emplace_back(BI);
+
+    if (BI.To.IsSymbol) {
+      FuncBranchData &ToData = GetOrCreateFuncEntry(BI.To.Name, CachedToEntry);
+
+      // Add entry data for branches to another function or branches
+      // to entry points (including recursive calls)
+      if (&ToData != &FromData || BI.To.Offset == 0)
+        ToData.EntryData.emplace_back(BI);
+
+      // If destination is the function start - update execution count.
+      // NB: the data is skewed since we cannot tell tail recursion from
+      //     branches to the function start.
+      if (BI.To.Offset == 0)
+        ToData.ExecutionCount += BI.Branches;
+    }
+  }
+
+  for (StringMapEntry<FuncBranchData> &FuncBranches : NamesToBranches)
+    std::stable_sort(FuncBranches.second.Data.begin(),
+                     FuncBranches.second.Data.end());
+
+  return std::error_code();
+}
+
 void DataReader::buildLTONameMaps() {
   for (StringMapEntry<FuncBranchData> &FuncData : NamesToBranches) {
     const StringRef FuncName = FuncData.getKey();
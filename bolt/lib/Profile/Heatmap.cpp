@@ -8,12 +8,16 @@
 
 #include "bolt/Profile/Heatmap.h"
 #include "bolt/Utils/CommandLineOpts.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Twine.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Format.h"
+#include "llvm/Support/LEB128.h"
 #include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 #include <algorithm>
 #include <cmath>
@@ -251,5 +255,400 @@ void Heatmap::printCDF(raw_ostream &OS) const {
   Counts.clear();
 }
 
+// The binary heat map format stores the bucket map at multiple resolutions:
+//
+//   "BOLTHMAP"                 magic
+//   version                    ULEB128
+//   number of levels           ULEB128
+//   per level:
+//     bucket size in bytes     ULEB128
+//     number of entries        ULEB128
+//     total count              ULEB128
+//     per entry: bucket index delta from the previous entry (absolute for
+//                the first entry) and count, both ULEB128
+//
+// Levels are ordered from finest to coarsest; entries within a level are
+// ordered by address. Readers and writers operate as a single forward
+// stream, so heat maps can be diffed and merged in memory independent of
+// their size.
+static const char BinaryHeatmapMagic[] = "BOLTHMAP";
+static const size_t BinaryHeatmapMagicSize = 8;
+static const uint64_t BinaryHeatmapVersion = 1;
+
+/// Coarse bucket resolutions stored on top of the native one: 4KB pages and
+/// 2MB huge pages.
+static const uint64_t CoarseBucketSizes[] = {0x1000, 0x200000};
+
+namespace {
+
+/// Streaming reader over one binary heat map file. Entries of the current
+/// level are consumed one at a time and never materialized.
+class BinaryHeatmapReader {
+public:
+  /// Open \p FileName and read the file header.
+  std::error_code open(StringRef FileName) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+        MemoryBuffer::getFileOrSTDIN(FileName);
+    if (std::error_code EC = MB.getError())
+      return EC;
+    Buffer = std::move(MB.get());
+    Ptr = reinterpret_cast<const uint8_t *>(Buffer->getBufferStart());
+    End = reinterpret_cast<const uint8_t *>(Buffer->getBufferEnd());
+
+    if (Buffer->getBufferSize() < BinaryHeatmapMagicSize ||
+        !Buffer->getBuffer().startswith(
+            StringRef(BinaryHeatmapMagic, BinaryHeatmapMagicSize)))
+      return std::make_error_code(std::errc::illegal_byte_sequence);
+    Ptr += BinaryHeatmapMagicSize;
+
+    const uint64_t Version = readValue();
+    NumLevels = readValue();
+    if (DecodeError || Version != BinaryHeatmapVersion)
+      return std::make_error_code(std::errc::illegal_byte_sequence);
+    return std::error_code();
+  }
+
+  uint64_t getNumLevels() const { return NumLevels; }
+
+  /// Position the reader at the first entry of the next level.
+  std::error_code startLevel() {
+    LevelBucketSize = readValue();
+    LevelNumEntries = readValue();
+    LevelTotalCount = readValue();
+    if (DecodeError)
+      return std::make_error_code(std::errc::illegal_byte_sequence);
+    LevelEntriesStart = Ptr;
+    EntriesLeft = LevelNumEntries;
+    PrevBucket = 0;
+    return std::error_code();
+  }
+
+  uint64_t getLevelBucketSize() const { return LevelBucketSize; }
+  uint64_t getLevelTotalCount() const { return LevelTotalCount; }
+
+  /// Return true while the current level has unread entries.
+  bool hasEntry() const { return EntriesLeft > 0; }
+
+  /// Read the next (bucket, count) entry of the current level.
+  std::error_code readEntry(uint64_t &Bucket, uint64_t &Count) {
+    assert(hasEntry() && "reading past the end of a level");
+    PrevBucket += readValue();
+    Count = readValue();
+    if (DecodeError)
+      return std::make_error_code(std::errc::illegal_byte_sequence);
+    Bucket = PrevBucket;
+    --EntriesLeft;
+    return std::error_code();
+  }
+
+  /// Re-position the reader at the first entry of the current level.
+  void rewindLevel() {
+    Ptr = LevelEntriesStart;
+    EntriesLeft = LevelNumEntries;
+    PrevBucket = 0;
+  }
+
+private:
+  uint64_t readValue() {
+    unsigned Size;
+    const uint64_t Value = decodeULEB128(Ptr, &Size, End, &DecodeError);
+    Ptr += Size;
+    return Value;
+  }
+
+  std::unique_ptr<MemoryBuffer> Buffer;
+  const uint8_t *Ptr{nullptr};
+  const uint8_t *End{nullptr};
+  const uint8_t *LevelEntriesStart{nullptr};
+  const char *DecodeError{nullptr};
+  uint64_t NumLevels{0};
+  uint64_t LevelBucketSize{0};
+  uint64_t LevelNumEntries{0};
+  uint64_t LevelTotalCount{0};
+  uint64_t EntriesLeft{0};
+  uint64_t PrevBucket{0};
+};
+
+} // anonymous namespace
+
+void Heatmap::writeBinary(StringRef FileName) const {
+  std::error_code EC;
+  raw_fd_ostream OS(FileName, EC, sys::fs::OpenFlags::OF_None);
+  if (EC) {
+    errs() << "error opening output file: " << EC.message() << '\n';
+    exit(1);
+  }
+  writeBinary(OS);
+}
+
+void Heatmap::writeBinary(raw_ostream &OS) const {
+  SmallVector<uint64_t, 3> Levels(1, BucketSize);
+  for (uint64_t CoarseSize : CoarseBucketSizes)
+    if (CoarseSize > Levels.back())
+      Levels.push_back(CoarseSize);
+
+  OS.write(BinaryHeatmapMagic, BinaryHeatmapMagicSize);
+  encodeULEB128(BinaryHeatmapVersion, OS);
+  encodeULEB128(Levels.size(), OS);
+
+  for (const uint64_t LevelBucketSize : Levels) {
+    // Native buckets are attributed to the coarse bucket containing their
+    // start address. Map is sorted, so coarse buckets come out sorted too.
+    auto rebucket = [&](uint64_t Bucket) {
+      return Bucket * BucketSize / LevelBucketSize;
+    };
+
+    // First pass: the level header needs the number of distinct buckets.
+    uint64_t NumEntries = 0;
+    uint64_t TotalCount = 0;
+    uint64_t PrevBucket = UINT64_MAX;
+    for (const std::pair<const uint64_t, uint64_t> &KV : Map) {
+      if (rebucket(KV.first) != PrevBucket) {
+        PrevBucket = rebucket(KV.first);
+        ++NumEntries;
+      }
+      TotalCount += KV.second;
+    }
+
+    encodeULEB128(LevelBucketSize, OS);
+    encodeULEB128(NumEntries, OS);
+    encodeULEB128(TotalCount, OS);
+
+    // Second pass: accumulate runs of native buckets that fall into the
+    // same coarse bucket and emit delta-encoded (bucket, count) entries.
+    uint64_t LastEmittedBucket = 0;
+    uint64_t CurBucket = 0;
+    uint64_t CurCount = 0;
+    auto flush = [&]() {
+      if (!CurCount)
+        return;
+      encodeULEB128(CurBucket - LastEmittedBucket, OS);
+      encodeULEB128(CurCount, OS);
+      LastEmittedBucket = CurBucket;
+      CurCount = 0;
+    };
+    for (const std::pair<const uint64_t, uint64_t> &KV : Map) {
+      const uint64_t Bucket = rebucket(KV.first);
+      if (CurCount && Bucket != CurBucket)
+        flush();
+      CurBucket = Bucket;
+      CurCount += KV.second;
+    }
+    flush();
+  }
+}
+
+std::error_code Heatmap::diffBinaryFiles(StringRef FileNameA,
+                                         StringRef FileNameB,
+                                         raw_ostream &OS) {
+  BinaryHeatmapReader A;
+  BinaryHeatmapReader B;
+  if (std::error_code EC = A.open(FileNameA)) {
+    errs() << "HEATMAP-ERROR: cannot read heatmap from " << FileNameA << ": "
+           << EC.message() << '\n';
+    return EC;
+  }
+  if (std::error_code EC = B.open(FileNameB)) {
+    errs() << "HEATMAP-ERROR: cannot read heatmap from " << FileNameB << ": "
+           << EC.message() << '\n';
+    return EC;
+  }
+  if (A.getNumLevels() != B.getNumLevels()) {
+    errs() << "HEATMAP-ERROR: heatmaps store different sets of bucket "
+              "resolutions\n";
+    return std::make_error_code(std::errc::invalid_argument);
+  }
+
+  OS << "Heatmap diff: A = " << FileNameA << ", B = " << FileNameB << '\n';
+
+  for (uint64_t Level = 0; Level < A.getNumLevels(); ++Level) {
+    if (std::error_code EC = A.startLevel())
+      return EC;
+    if (std::error_code EC = B.startLevel())
+      return EC;
+    if (A.getLevelBucketSize() != B.getLevelBucketSize()) {
+      errs() << "HEATMAP-ERROR: heatmaps store different sets of bucket "
+                "resolutions\n";
+      return std::make_error_code(std::errc::invalid_argument);
+    }
+
+    const uint64_t TotalA = A.getLevelTotalCount();
+    const uint64_t TotalB = B.getLevelTotalCount();
+    auto fractionOf = [](uint64_t Count, uint64_t Total) {
+      return Total ? (double)Count / Total : 0.0;
+    };
+
+    std::error_code ReadError;
+    auto advance = [&ReadError](BinaryHeatmapReader &R, uint64_t &Bucket,
+                                uint64_t &Count, bool &Have) {
+      Have = R.hasEntry();
+      if (Have)
+        if (std::error_code EC = R.readEntry(Bucket, Count))
+          ReadError = EC;
+    };
+
+    // Merge-join the sorted entry streams. The divergence is the total
+    // variation distance between the two normalized bucket distributions:
+    // 0 for identical heat, 1 for fully disjoint heat.
+    uint64_t OnlyA = 0;
+    uint64_t OnlyB = 0;
+    uint64_t Common = 0;
+    double Divergence = 0.0;
+    uint64_t BucketA = 0, CountA = 0, BucketB = 0, CountB = 0;
+    bool HaveA, HaveB;
+    advance(A, BucketA, CountA, HaveA);
+    advance(B, BucketB, CountB, HaveB);
+    while (!ReadError && (HaveA || HaveB)) {
+      if (HaveA && (!HaveB || BucketA < BucketB)) {
+        ++OnlyA;
+        Divergence += fractionOf(CountA, TotalA);
+        advance(A, BucketA, CountA, HaveA);
+      } else if (HaveB && (!HaveA || BucketB < BucketA)) {
+        ++OnlyB;
+        Divergence += fractionOf(CountB, TotalB);
+        advance(B, BucketB, CountB, HaveB);
+      } else {
+        ++Common;
+        Divergence +=
+            std::fabs(fractionOf(CountA, TotalA) - fractionOf(CountB, TotalB));
+        advance(A, BucketA, CountA, HaveA);
+        advance(B, BucketB, CountB, HaveB);
+      }
+    }
+    if (ReadError) {
+      errs() << "HEATMAP-ERROR: malformed heatmap entry stream\n";
+      return ReadError;
+    }
+    Divergence /= 2;
+
+    OS << format("  %7" PRIu64 "-byte buckets: ", A.getLevelBucketSize())
+       << Common << " common, " << OnlyA << " only in A, " << OnlyB
+       << " only in B, divergence " << format("%.2f%%", 100.0 * Divergence)
+       << '\n';
+  }
+
+  return std::error_code();
+}
+
+std::error_code Heatmap::mergeBinaryFiles(ArrayRef<StringRef> InputFileNames,
+                                          StringRef OutputFileName) {
+  assert(!InputFileNames.empty() && "expected at least one input heatmap");
+
+  std::vector<BinaryHeatmapReader> Readers(InputFileNames.size());
+  for (size_t I = 0; I < Readers.size(); ++I) {
+    if (std::error_code EC = Readers[I].open(InputFileNames[I])) {
+      errs() << "HEATMAP-ERROR: cannot read heatmap from " << InputFileNames[I]
+             << ": " << EC.message() << '\n';
+      return EC;
+    }
+    if (Readers[I].getNumLevels() != Readers[0].getNumLevels()) {
+      errs() << "HEATMAP-ERROR: heatmaps store different sets of bucket "
+                "resolutions\n";
+      return std::make_error_code(std::errc::invalid_argument);
+    }
+  }
+
+  std::error_code EC;
+  raw_fd_ostream OS(OutputFileName, EC, sys::fs::OpenFlags::OF_None);
+  if (EC) {
+    errs() << "HEATMAP-ERROR: cannot open output file " << OutputFileName
+           << ": " << EC.message() << '\n';
+    return EC;
+  }
+
+  OS.write(BinaryHeatmapMagic, BinaryHeatmapMagicSize);
+  encodeULEB128(BinaryHeatmapVersion, OS);
+  encodeULEB128(Readers[0].getNumLevels(), OS);
+
+  for (uint64_t Level = 0; Level < Readers[0].getNumLevels(); ++Level) {
+    for (BinaryHeatmapReader &Reader : Readers) {
+      if (std::error_code EC = Reader.startLevel())
+        return EC;
+      if (Reader.getLevelBucketSize() != Readers[0].getLevelBucketSize()) {
+        errs() << "HEATMAP-ERROR: heatmaps store different sets of bucket "
+                  "resolutions\n";
+        return std::make_error_code(std::errc::invalid_argument);
+      }
+    }
+
+    // K-way merge-join over the sorted entry streams, summing the counts of
+    // buckets present in several inputs. Memory is proportional to the
+    // number of inputs, not to the number of entries.
+    std::error_code ReadError;
+    auto forEachMergedEntry =
+        [&](function_ref<void(uint64_t, uint64_t)> Emit) {
+          struct Head {
+            uint64_t Bucket;
+            uint64_t Count;
+            bool Valid;
+          };
+          std::vector<Head> Heads(Readers.size());
+          auto advance = [&](size_t I) {
+            Heads[I].Valid = Readers[I].hasEntry();
+            if (Heads[I].Valid)
+              if (std::error_code EC =
+                      Readers[I].readEntry(Heads[I].Bucket, Heads[I].Count))
+                ReadError = EC;
+          };
+          for (size_t I = 0; I < Heads.size(); ++I)
+            advance(I);
+
+          while (!ReadError) {
+            uint64_t MinBucket = UINT64_MAX;
+            bool Found = false;
+            for (const Head &H : Heads) {
+              if (H.Valid && (!Found || H.Bucket < MinBucket)) {
+                MinBucket = H.Bucket;
+                Found = true;
+              }
+            }
+            if (!Found)
+              break;
+
+            uint64_t Count = 0;
+            for (size_t I = 0; I < Heads.size(); ++I) {
+              if (Heads[I].Valid && Heads[I].Bucket == MinBucket) {
+                Count += Heads[I].Count;
+                advance(I);
+              }
+            }
+            Emit(MinBucket, Count);
+          }
+        };
+
+    // First pass: the level header needs the number of merged buckets.
+    uint64_t NumEntries = 0;
+    uint64_t TotalCount = 0;
+    forEachMergedEntry([&](uint64_t, uint64_t Count) {
+      ++NumEntries;
+      TotalCount += Count;
+    });
+    if (ReadError) {
+      errs() << "HEATMAP-ERROR: malformed heatmap entry stream\n";
+      return ReadError;
+    }
+
+    encodeULEB128(Readers[0].getLevelBucketSize(), OS);
+    encodeULEB128(NumEntries, OS);
+    encodeULEB128(TotalCount, OS);
+
+    // Second pass: emit the merged delta-encoded entries.
+    for (BinaryHeatmapReader &Reader : Readers)
+      Reader.rewindLevel();
+    uint64_t PrevBucket = 0;
+    forEachMergedEntry([&](uint64_t Bucket, uint64_t Count) {
+      encodeULEB128(Bucket - PrevBucket, OS);
+      encodeULEB128(Count, OS);
+      PrevBucket = Bucket;
+    });
+    if (ReadError) {
+      errs() << "HEATMAP-ERROR: malformed heatmap entry stream\n";
+      return ReadError;
+    }
+  }
+
+  return std::error_code();
+}
+
 } // namespace bolt
 } // namespace llvm
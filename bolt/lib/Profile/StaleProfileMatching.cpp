@@ -0,0 +1,226 @@
+//===- bolt/Profile/StaleProfileMatching.cpp - Fuzzy profile matching -----===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Matching of a stale profile to a binary whose code changed since the
+// profile was collected. When the function hash check fails, the DFS block
+// indices stored in the profile no longer identify the same blocks, so
+// instead every profiled block is matched to the most similar block of the
+// optimized binary by its blended hash (see StaleProfileMatching.h). The
+// matched counts rarely satisfy the CFG flow equations, so the final counts
+// are repaired with the edge-count estimator from MCF.cpp.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bolt/Profile/StaleProfileMatching.h"
+#include "bolt/Core/BinaryBasicBlock.h"
+#include "bolt/Core/BinaryFunction.h"
+#include "bolt/Core/HashUtilities.h"
+#include "bolt/Core/MCPlus.h"
+#include "bolt/Passes/MCF.h"
+#include "bolt/Profile/YAMLProfileReader.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/CommandLine.h"
+
+#undef  DEBUG_TYPE
+#define DEBUG_TYPE "bolt-prof"
+
+using namespace llvm;
+
+namespace opts {
+
+extern cl::opt<unsigned> Verbosity;
+
+}
+
+namespace llvm {
+namespace bolt {
+
+namespace {
+
+/// Fold a 64-bit hash into 16 bits.
+uint16_t hash16(uint64_t Hash) {
+  return Hash ^ (Hash >> 16) ^ (Hash >> 32) ^ (Hash >> 48);
+}
+
+/// The distance between two blended hashes with equal opcode hashes. Lower
+/// is a better match: agreement on a stricter feature dominates any
+/// disagreement on looser ones, and the input offset breaks the remaining
+/// ties in favor of the candidate closest to the profiled position.
+uint64_t hashDistance(const BlendedBlockHash &A, const BlendedBlockHash &B) {
+  assert(A.OpcodeHash == B.OpcodeHash &&
+         "only candidates with equal opcode hashes are comparable");
+  uint64_t Distance =
+      A.Offset > B.Offset ? A.Offset - B.Offset : B.Offset - A.Offset;
+  if (A.NeighborHash != B.NeighborHash)
+    Distance += 1ULL << 16;
+  if (A.InstrHash != B.InstrHash)
+    Distance += 1ULL << 17;
+  return Distance;
+}
+
+} // end anonymous namespace
+
+DenseMap<const BinaryBasicBlock *, BlendedBlockHash>
+computeBlockHashes(const BinaryFunction &BF) {
+  const BinaryContext &BC = BF.getBinaryContext();
+  DenseMap<const BinaryBasicBlock *, BlendedBlockHash> Hashes;
+
+  for (const BinaryBasicBlock &BB : BF) {
+    BlendedBlockHash &Hash = Hashes[&BB];
+    Hash.Offset = std::min<uint32_t>(BB.getInputOffset(), UINT16_MAX);
+
+    StreamingHash64 OpcodeHasher;
+    StreamingHash64 InstrHasher;
+    uint64_t PreviousOpcode = 0;
+    for (const MCInst &Inst : BB) {
+      if (BC.MIB->isPseudo(Inst))
+        continue;
+      // Unconditional branches are a layout artifact; skip them the same way
+      // BinaryFunction::computeHash() does.
+      if (BC.MIB->isUnconditionalBranch(Inst))
+        continue;
+
+      OpcodeHasher.add(PreviousOpcode << 32 | Inst.getOpcode());
+      PreviousOpcode = Inst.getOpcode();
+
+      InstrHasher.add(static_cast<uint64_t>(Inst.getOpcode()));
+      for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E;
+           ++I) {
+        const MCOperand &Op = Inst.getOperand(I);
+        if (Op.isReg())
+          InstrHasher.add(static_cast<uint64_t>(Op.getReg()));
+        else if (Op.isImm())
+          InstrHasher.add(static_cast<uint64_t>(Op.getImm()));
+      }
+    }
+    Hash.OpcodeHash = hash16(OpcodeHasher.finalize());
+    Hash.InstrHash = hash16(InstrHasher.finalize());
+  }
+
+  // The neighbor hash depends on the opcode hashes of adjacent blocks and is
+  // filled in by a second pass.
+  for (const BinaryBasicBlock &BB : BF) {
+    StreamingHash64 NeighborHasher;
+    for (const BinaryBasicBlock *SuccBB : BB.successors())
+      NeighborHasher.add(static_cast<uint64_t>(Hashes[SuccBB].OpcodeHash));
+    for (const BinaryBasicBlock *PredBB : BB.predecessors())
+      NeighborHasher.add(static_cast<uint64_t>(Hashes[PredBB].OpcodeHash));
+    Hashes[&BB].NeighborHash = hash16(NeighborHasher.finalize());
+  }
+
+  return Hashes;
+}
+
+bool YAMLProfileReader::inferStaleProfile(
+    BinaryFunction &BF, const yaml::bolt::BinaryFunctionProfile &YamlBF) {
+  if (BF.size() == 0)
+    return false;
+
+  // Basic samples profiles identify blocks by input offset rather than by
+  // contents and are repaired wholesale by readProfile().
+  if (YamlBP.Header.Flags & BinaryFunction::PF_SAMPLE)
+    return false;
+
+  // The profile has to carry block hashes: older profiles do not, and
+  // without them there is nothing to match on.
+  if (llvm::none_of(YamlBF.Blocks,
+                    [](const yaml::bolt::BinaryBasicBlockProfile &YamlBB) {
+                      return YamlBB.Hash != 0;
+                    }))
+    return false;
+
+  const DenseMap<const BinaryBasicBlock *, BlendedBlockHash> Hashes =
+      computeBlockHashes(BF);
+
+  // Bucket the binary's blocks by their opcode hash.
+  using CandidateTy = std::pair<BlendedBlockHash, BinaryBasicBlock *>;
+  DenseMap<unsigned, SmallVector<CandidateTy, 4>> OpcodeHashToBlocks;
+  for (BinaryBasicBlock &BB : BF) {
+    const BlendedBlockHash Hash = Hashes.lookup(&BB);
+    OpcodeHashToBlocks[Hash.OpcodeHash].emplace_back(Hash, &BB);
+  }
+
+  // Match every profiled block to the most similar block of the function.
+  // Several profiled blocks may map to one block, e.g. when a loop was
+  // unrolled back; their counts add up.
+  std::vector<BinaryBasicBlock *> Matched(YamlBF.Blocks.size(), nullptr);
+  DenseMap<uint64_t, BinaryBasicBlock *> ProfileIndexToBlock;
+  size_t MatchedBlocks = 0;
+  for (size_t I = 0, E = YamlBF.Blocks.size(); I != E; ++I) {
+    const yaml::bolt::BinaryBasicBlockProfile &YamlBB = YamlBF.Blocks[I];
+    if (!YamlBB.Hash)
+      continue;
+    const BlendedBlockHash YamlHash = BlendedBlockHash::parse(YamlBB.Hash);
+    auto It = OpcodeHashToBlocks.find(YamlHash.OpcodeHash);
+    if (It == OpcodeHashToBlocks.end())
+      continue;
+
+    BinaryBasicBlock *Best = nullptr;
+    uint64_t BestDistance = 0;
+    for (const CandidateTy &Candidate : It->second) {
+      const uint64_t Distance = hashDistance(Candidate.first, YamlHash);
+      if (!Best || Distance < BestDistance) {
+        Best = Candidate.second;
+        BestDistance = Distance;
+      }
+    }
+
+    Matched[I] = Best;
+    ProfileIndexToBlock[YamlBB.Index] = Best;
+    ++MatchedBlocks;
+  }
+
+  if (!MatchedBlocks)
+    return false;
+
+  // Zero out the counts so blocks with no match come out cold instead of
+  // keeping counts of blocks they no longer correspond to.
+  for (BinaryBasicBlock &BB : BF) {
+    BB.setExecutionCount(0);
+    for (BinaryBasicBlock::BinaryBranchInfo &BI : BB.branch_info()) {
+      BI.Count = 0;
+      BI.MispredictedCount = 0;
+    }
+  }
+
+  // Transfer counts over matched pairs: block counts always, edge counts
+  // only when both endpoints matched and the edge still exists.
+  for (size_t I = 0, E = YamlBF.Blocks.size(); I != E; ++I) {
+    BinaryBasicBlock *BB = Matched[I];
+    if (!BB)
+      continue;
+    const yaml::bolt::BinaryBasicBlockProfile &YamlBB = YamlBF.Blocks[I];
+    BB->setExecutionCount(BB->getExecutionCount() + YamlBB.ExecCount);
+
+    for (const yaml::bolt::SuccessorInfo &YamlSI : YamlBB.Successors) {
+      BinaryBasicBlock *SuccBB = ProfileIndexToBlock.lookup(YamlSI.Index);
+      if (!SuccBB || !BB->getSuccessor(SuccBB->getLabel()))
+        continue;
+      BinaryBasicBlock::BinaryBranchInfo &BI = BB->getBranchInfo(*SuccBB);
+      BI.Count += YamlSI.Count;
+      BI.MispredictedCount += YamlSI.Mispreds;
+    }
+  }
+
+  // The transferred counts generally violate the flow equations: some edges
+  // lost an endpoint, and matched blocks moved relative to each other. Run
+  // the edge-count estimator to propagate the matched counts over the CFG.
+  estimateEdgeCounts(BF);
+
+  if (opts::Verbosity >= 1)
+    outs() << "BOLT-INFO: matched " << MatchedBlocks << " out of "
+           << YamlBF.Blocks.size() << " blocks of the stale profile to "
+           << BF << '\n';
+
+  BF.markProfiled(YamlBP.Header.Flags);
+
+  return true;
+}
+
+} // end namespace bolt
+} // end namespace llvm
@@ -10,9 +10,13 @@
 #include "bolt/Core/BinaryBasicBlock.h"
 #include "bolt/Core/BinaryFunction.h"
 #include "bolt/Passes/MCF.h"
+#include "bolt/Profile/CompactProfileFormat.h"
 #include "bolt/Profile/ProfileYAMLMapping.h"
 #include "bolt/Utils/Utils.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Compression.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/LEB128.h"
 
 using namespace llvm;
 
@@ -29,6 +33,14 @@ IgnoreHash("profile-ignore-hash",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static llvm::cl::opt<bool>
+InferStaleProfile("infer-stale-profile",
+  cl::desc("match a stale profile to functions that changed since profile "
+           "collection using fuzzy basic block hashes"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 }
 
 namespace llvm {
@@ -45,6 +57,14 @@ bool YAMLProfileReader::isYAML(const StringRef Filename) {
   return false;
 }
 
+bool YAMLProfileReader::isCompact(const StringRef Filename) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+      MemoryBuffer::getFileOrSTDIN(Filename);
+  if (std::error_code EC = MB.getError())
+    report_error(Filename, EC);
+  return MB.get()->getBuffer().startswith(getCompactProfileMagic());
+}
+
 void YAMLProfileReader::buildNameMaps(
     std::map<uint64_t, BinaryFunction> &Functions) {
   for (yaml::bolt::BinaryFunctionProfile &YamlBF : YamlBP.Functions) {
@@ -88,6 +108,11 @@ bool YAMLProfileReader::parseFunctionProfile(
   BF.setExecutionCount(YamlBF.ExecCount);
 
   if (!opts::IgnoreHash && YamlBF.Hash != BF.computeHash(/*UseDFS=*/true)) {
+    // The DFS block indices in the profile identify different blocks now.
+    // Instead of applying the counts by index, try to match the profiled
+    // blocks to the blocks of the changed function by their hashes.
+    if (opts::InferStaleProfile && inferStaleProfile(BF, YamlBF))
+      return true;
     if (opts::Verbosity >= 1)
       errs() << "BOLT-WARNING: function hash mismatch\n";
     ProfileMatched = false;
@@ -170,26 +195,28 @@ bool YAMLProfileReader::parseFunctionProfile(
         continue;
       }
 
-      auto setAnnotation = [&](StringRef Name, uint64_t Count) {
-        if (BC.MIB->hasAnnotation(*Instr, Name)) {
+      auto setAnnotation = [&](unsigned Annotation, uint64_t Count) {
+        if (BC.MIB->hasAnnotation(*Instr, Annotation)) {
           if (opts::Verbosity >= 1)
-            errs() << "BOLT-WARNING: ignoring duplicate " << Name
+            errs() << "BOLT-WARNING: ignoring duplicate "
+                   << BC.MIB->getAnnotationName(Annotation)
                    << " info for offset 0x" << Twine::utohexstr(YamlCSI.Offset)
                    << " in function " << BF << '\n';
           return;
         }
-        BC.MIB->addAnnotation(*Instr, Name, Count);
+        BC.MIB->addAnnotation(*Instr, Annotation, Count);
       };
 
       if (BC.MIB->isIndirectCall(*Instr) || BC.MIB->isIndirectBranch(*Instr)) {
         auto &CSP = BC.MIB->getOrCreateAnnotationAs<IndirectCallSiteProfile>(
-            *Instr, "CallProfile");
+            *Instr, MCPlus::MCAnnotation::kCallProfile);
         CSP.emplace_back(CalleeSymbol, YamlCSI.Count, YamlCSI.Mispreds);
       } else if (BC.MIB->getConditionalTailCall(*Instr)) {
-        setAnnotation("CTCTakenCount", YamlCSI.Count);
-        setAnnotation("CTCMispredCount", YamlCSI.Mispreds);
+        setAnnotation(MCPlus::MCAnnotation::kCTCTakenCount, YamlCSI.Count);
+        setAnnotation(MCPlus::MCAnnotation::kCTCMispredCount,
+                      YamlCSI.Mispreds);
       } else {
-        setAnnotation("Count", YamlCSI.Count);
+        setAnnotation(MCPlus::MCAnnotation::kCount, YamlCSI.Count);
       }
     }
 
@@ -222,10 +249,10 @@ bool YAMLProfileReader::parseFunctionProfile(
     if (BB.getExecutionCount() == BinaryBasicBlock::COUNT_NO_PROFILE)
       BB.setExecutionCount(0);
 
-  if (YamlBP.Header.Flags & BinaryFunction::PF_SAMPLE) {
+  // Edge counts for sample profiles are inferred over all functions at once
+  // by readProfile() after every profile has been parsed.
+  if (YamlBP.Header.Flags & BinaryFunction::PF_SAMPLE)
     BF.setExecutionCount(FunctionExecutionCount);
-    estimateEdgeCounts(BF);
-  }
 
   ProfileMatched &= !MismatchedBlocks && !MismatchedCalls && !MismatchedEdges;
 
@@ -247,21 +274,30 @@ Error YAMLProfileReader::preprocessProfile(BinaryContext &BC) {
     errs() << "ERROR: cannot open " << Filename << ": " << EC.message() << "\n";
     return errorCodeToError(EC);
   }
-  yaml::Input YamlInput(MB.get()->getBuffer());
-
-  // Consume YAML file.
-  YamlInput >> YamlBP;
-  if (YamlInput.error()) {
-    errs() << "BOLT-ERROR: syntax error parsing profile in " << Filename
-           << " : " << YamlInput.error().message() << '\n';
-    return errorCodeToError(YamlInput.error());
-  }
 
-  // Sanity check.
-  if (YamlBP.Header.Version != 1)
-    return make_error<StringError>(
-        Twine("cannot read profile : unsupported version"),
-        inconvertibleErrorCode());
+  if (MB.get()->getBuffer().startswith(getCompactProfileMagic())) {
+    // The compact container holds block payloads encoded. Keep the buffer
+    // around to decode the payloads of matched functions in readProfile().
+    CompactBuffer = std::move(MB.get());
+    if (Error E = parseCompactProfile())
+      return E;
+  } else {
+    yaml::Input YamlInput(MB.get()->getBuffer());
+
+    // Consume YAML file.
+    YamlInput >> YamlBP;
+    if (YamlInput.error()) {
+      errs() << "BOLT-ERROR: syntax error parsing profile in " << Filename
+             << " : " << YamlInput.error().message() << '\n';
+      return errorCodeToError(YamlInput.error());
+    }
+
+    // Sanity check.
+    if (YamlBP.Header.Version != 1)
+      return make_error<StringError>(
+          Twine("cannot read profile : unsupported version"),
+          inconvertibleErrorCode());
+  }
 
   if (YamlBP.Header.EventNames.find(',') != StringRef::npos)
     return make_error<StringError>(
@@ -287,6 +323,168 @@ Error YAMLProfileReader::preprocessProfile(BinaryContext &BC) {
   return Error::success();
 }
 
+Error YAMLProfileReader::parseCompactProfile() {
+  using namespace llvm::support;
+
+  const StringRef Buf = CompactBuffer->getBuffer();
+  auto parseError = [&](const Twine &Message) {
+    return make_error<StringError>(Twine("cannot read profile from ") +
+                                       Filename + " : " + Message,
+                                   inconvertibleErrorCode());
+  };
+
+  if (Buf.size() < sizeof(CompactProfileHeader))
+    return parseError("truncated header");
+
+  const char *Data = Buf.data();
+  const uint32_t Version = endian::read32le(Data + CompactProfileMagicSize);
+  if (Version != CompactProfileVersion)
+    return parseError("unsupported version");
+  const uint32_t Flags = endian::read32le(Data + 12);
+  const uint64_t NumFunctions = endian::read64le(Data + 16);
+  const uint64_t StringTableOffset = endian::read64le(Data + 24);
+  const uint64_t StringTableSize = endian::read64le(Data + 32);
+
+  const uint64_t RecordsEnd =
+      sizeof(CompactProfileHeader) +
+      NumFunctions * sizeof(CompactProfileFunctionRecord);
+  if (RecordsEnd > StringTableOffset ||
+      StringTableOffset + StringTableSize > Buf.size())
+    return parseError("corrupted function index");
+
+  const StringRef StrTab = Buf.substr(StringTableOffset, StringTableSize);
+  auto getString = [&](uint32_t Offset) -> Optional<StringRef> {
+    const size_t End = StrTab.find('\0', Offset);
+    if (Offset >= StringTableSize || End == StringRef::npos)
+      return None;
+    return StrTab.slice(Offset, End);
+  };
+
+  YamlBP.Header.Version = 1;
+  YamlBP.Header.Flags = static_cast<uint16_t>(Flags);
+  const Optional<StringRef> FileName = getString(endian::read32le(Data + 40));
+  const Optional<StringRef> Id = getString(endian::read32le(Data + 44));
+  const Optional<StringRef> Origin = getString(endian::read32le(Data + 48));
+  const Optional<StringRef> EventNames =
+      getString(endian::read32le(Data + 52));
+  if (!FileName || !Id || !Origin || !EventNames)
+    return parseError("invalid string table reference");
+  YamlBP.Header.FileName = FileName->str();
+  YamlBP.Header.Id = Id->str();
+  YamlBP.Header.Origin = Origin->str();
+  YamlBP.Header.EventNames = EventNames->str();
+
+  YamlBP.Functions.resize(NumFunctions);
+  CompactPayloads.resize(NumFunctions);
+  for (uint64_t I = 0; I < NumFunctions; ++I) {
+    const char *Record = Data + sizeof(CompactProfileHeader) +
+                         I * sizeof(CompactProfileFunctionRecord);
+    yaml::bolt::BinaryFunctionProfile &YamlBF = YamlBP.Functions[I];
+    const Optional<StringRef> Name = getString(endian::read32le(Record));
+    if (!Name)
+      return parseError("invalid string table reference");
+    YamlBF.Name = Name->str();
+    YamlBF.Id = endian::read32le(Record + 4);
+    YamlBF.Hash = endian::read64le(Record + 8);
+    YamlBF.ExecCount = endian::read64le(Record + 16);
+    YamlBF.NumBasicBlocks = endian::read32le(Record + 24);
+
+    CompactPayload &Payload = CompactPayloads[I];
+    Payload.NumProfiledBlocks = endian::read32le(Record + 28);
+    const uint64_t DataOffset = endian::read64le(Record + 32);
+    const uint32_t CompressedSize = endian::read32le(Record + 40);
+    Payload.UncompressedSize = endian::read32le(Record + 44);
+    if (DataOffset < RecordsEnd ||
+        DataOffset + CompressedSize > StringTableOffset)
+      return parseError("corrupted block payload");
+    Payload.Data = Buf.substr(DataOffset, CompressedSize);
+  }
+
+  return Error::success();
+}
+
+Error YAMLProfileReader::decodeFunctionProfile(size_t Index) {
+  if (Index >= CompactPayloads.size())
+    return Error::success();
+
+  const CompactPayload &Payload = CompactPayloads[Index];
+  yaml::bolt::BinaryFunctionProfile &YamlBF = YamlBP.Functions[Index];
+  if (!YamlBF.Blocks.empty() || !Payload.NumProfiledBlocks)
+    return Error::success();
+
+  auto parseError = [&](const Twine &Message) {
+    return make_error<StringError>(Twine("cannot read profile for ") +
+                                       YamlBF.Name + " : " + Message,
+                                   inconvertibleErrorCode());
+  };
+
+  StringRef Data = Payload.Data;
+  SmallVector<char, 0> InflateBuffer;
+  if (Data.size() != Payload.UncompressedSize) {
+    if (!zlib::isAvailable())
+      return parseError("profile is compressed but zlib is not available");
+    if (Error E =
+            zlib::uncompress(Data, InflateBuffer, Payload.UncompressedSize))
+      return joinErrors(parseError("inflation failed"), std::move(E));
+    Data = StringRef(InflateBuffer.data(), InflateBuffer.size());
+  }
+
+  const uint8_t *Ptr = reinterpret_cast<const uint8_t *>(Data.begin());
+  const uint8_t *const End = reinterpret_cast<const uint8_t *>(Data.end());
+  const char *DecodeError = nullptr;
+  auto readValue = [&]() {
+    unsigned Size;
+    const uint64_t Value = decodeULEB128(Ptr, &Size, End, &DecodeError);
+    Ptr += Size;
+    return Value;
+  };
+
+  YamlBF.Blocks.reserve(Payload.NumProfiledBlocks);
+  for (uint32_t I = 0; I < Payload.NumProfiledBlocks; ++I) {
+    yaml::bolt::BinaryBasicBlockProfile YamlBB;
+    YamlBB.Index = readValue();
+    YamlBB.NumInstructions = readValue();
+    YamlBB.Hash = readValue();
+    YamlBB.ExecCount = readValue();
+    YamlBB.EventCount = readValue();
+    const uint64_t NumCallSites = readValue();
+    const uint64_t NumSuccessors = readValue();
+    if (DecodeError)
+      return parseError(DecodeError);
+
+    uint64_t Offset = 0;
+    for (uint64_t J = 0; J < NumCallSites; ++J) {
+      yaml::bolt::CallSiteInfo CSI;
+      Offset += readValue();
+      CSI.Offset = Offset;
+      CSI.DestId = readValue();
+      CSI.EntryDiscriminator = readValue();
+      CSI.Count = readValue();
+      CSI.Mispreds = readValue();
+      if (DecodeError)
+        return parseError(DecodeError);
+      YamlBB.CallSites.push_back(CSI);
+    }
+
+    for (uint64_t J = 0; J < NumSuccessors; ++J) {
+      yaml::bolt::SuccessorInfo YamlSI;
+      YamlSI.Index = readValue();
+      YamlSI.Count = readValue();
+      YamlSI.Mispreds = readValue();
+      if (DecodeError)
+        return parseError(DecodeError);
+      YamlBB.Successors.push_back(YamlSI);
+    }
+
+    YamlBF.Blocks.push_back(std::move(YamlBB));
+  }
+
+  if (Ptr != End)
+    return parseError("malformed block payload");
+
+  return Error::success();
+}
+
 bool YAMLProfileReader::mayHaveProfileData(const BinaryFunction &BF) {
   for (StringRef Name : BF.getNames()) {
     if (ProfileNameToProfile.find(Name) != ProfileNameToProfile.end())
@@ -403,12 +601,23 @@ Error YAMLProfileReader::readProfile(BinaryContext &BC) {
       ++NumUnused;
       continue;
     }
-    if (BinaryFunction *BF = YamlProfileToFunction[YamlBF.Id])
+    if (BinaryFunction *BF = YamlProfileToFunction[YamlBF.Id]) {
+      if (Error E = decodeFunctionProfile(&YamlBF - YamlBP.Functions.data()))
+        return E;
       parseFunctionProfile(*BF, YamlBF);
-    else
+    } else {
       ++NumUnused;
+    }
   }
 
+  // Sample profiles only carry block counts. Infer the edge counts for all
+  // matched functions at once, so independent per-function work can run in
+  // parallel.
+  if (YamlBP.Header.Flags & BinaryFunction::PF_SAMPLE)
+    estimateEdgeCounts(BC, [this](const BinaryFunction &BF) {
+      return !ProfiledFunctions.count(&BF);
+    });
+
   BC.setNumUnusedProfiledObjects(NumUnused);
 
   return Error::success();
@@ -9,15 +9,36 @@
 #include "bolt/Profile/YAMLProfileWriter.h"
 #include "bolt/Core/BinaryBasicBlock.h"
 #include "bolt/Core/BinaryFunction.h"
+#include "bolt/Profile/CompactProfileFormat.h"
 #include "bolt/Profile/ProfileReaderBase.h"
 #include "bolt/Profile/ProfileYAMLMapping.h"
+#include "bolt/Profile/StaleProfileMatching.h"
 #include "bolt/Rewrite/RewriteInstance.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Compression.h"
+#include "llvm/Support/EndianStream.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LEB128.h"
 #include "llvm/Support/raw_ostream.h"
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt-prof"
 
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<bool>
+CompactProfile("compact-profile",
+  cl::desc("save profile in the compact indexed format instead of YAML"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+}
+
 namespace llvm {
 namespace bolt {
 
@@ -34,10 +55,16 @@ void convert(const BinaryFunction &BF,
   YamlBF.NumBasicBlocks = BF.size();
   YamlBF.ExecCount = BF.getKnownExecutionCount();
 
+  // Per-block hashes allow the reader to match the profile back to the
+  // function after its code has changed.
+  const DenseMap<const BinaryBasicBlock *, BlendedBlockHash> BlockHashes =
+      computeBlockHashes(BF);
+
   for (const BinaryBasicBlock *BB : BF.dfs()) {
     yaml::bolt::BinaryBasicBlockProfile YamlBB;
     YamlBB.Index = BB->getLayoutIndex();
     YamlBB.NumInstructions = BB->getNumNonPseudos();
+    YamlBB.Hash = BlockHashes.lookup(BB).combine();
 
     if (!LBRProfile) {
       YamlBB.EventCount = BB->getKnownExecutionCount();
@@ -53,14 +80,14 @@ void convert(const BinaryFunction &BF,
         continue;
 
       yaml::bolt::CallSiteInfo CSI;
-      auto Offset = BC.MIB->tryGetAnnotationAs<uint32_t>(Instr, "Offset");
-      if (!Offset || Offset.get() < BB->getInputOffset())
+      Optional<uint32_t> Offset = BC.MIB->getOffset(Instr);
+      if (!Offset || *Offset < BB->getInputOffset())
         continue;
-      CSI.Offset = Offset.get() - BB->getInputOffset();
+      CSI.Offset = *Offset - BB->getInputOffset();
 
       if (BC.MIB->isIndirectCall(Instr) || BC.MIB->isIndirectBranch(Instr)) {
         auto ICSP = BC.MIB->tryGetAnnotationAs<IndirectCallSiteProfile>(
-            Instr, "CallProfile");
+            Instr, MCPlus::MCAnnotation::kCallProfile);
         if (!ICSP)
           continue;
         for (const IndirectCallProfile &CSP : ICSP.get()) {
@@ -86,17 +113,18 @@ void convert(const BinaryFunction &BF,
         }
 
         if (BC.MIB->getConditionalTailCall(Instr)) {
-          auto CTCCount =
-              BC.MIB->tryGetAnnotationAs<uint64_t>(Instr, "CTCTakenCount");
+          auto CTCCount = BC.MIB->tryGetAnnotationAs<uint64_t>(
+              Instr, MCPlus::MCAnnotation::kCTCTakenCount);
           if (CTCCount) {
             CSI.Count = *CTCCount;
-            auto CTCMispreds =
-                BC.MIB->tryGetAnnotationAs<uint64_t>(Instr, "CTCMispredCount");
+            auto CTCMispreds = BC.MIB->tryGetAnnotationAs<uint64_t>(
+                Instr, MCPlus::MCAnnotation::kCTCMispredCount);
             if (CTCMispreds)
               CSI.Mispreds = *CTCMispreds;
           }
         } else {
-          auto Count = BC.MIB->tryGetAnnotationAs<uint64_t>(Instr, "Count");
+          auto Count = BC.MIB->tryGetAnnotationAs<uint64_t>(
+              Instr, MCPlus::MCAnnotation::kCount);
           if (Count)
             CSI.Count = *Count;
         }
@@ -135,6 +163,120 @@ void convert(const BinaryFunction &BF,
     YamlBF.Blocks.emplace_back(YamlBB);
   }
 }
+
+/// Serialize block profiles of \p YamlBF as the ULEB128 stream described in
+/// CompactProfileFormat.h.
+void encodeFunctionBlocks(const yaml::bolt::BinaryFunctionProfile &YamlBF,
+                          raw_ostream &OS) {
+  for (const yaml::bolt::BinaryBasicBlockProfile &YamlBB : YamlBF.Blocks) {
+    encodeULEB128(YamlBB.Index, OS);
+    encodeULEB128(YamlBB.NumInstructions, OS);
+    encodeULEB128(YamlBB.Hash, OS);
+    encodeULEB128(YamlBB.ExecCount, OS);
+    encodeULEB128(YamlBB.EventCount, OS);
+    encodeULEB128(YamlBB.CallSites.size(), OS);
+    encodeULEB128(YamlBB.Successors.size(), OS);
+
+    // Call sites are sorted by offset, so the deltas are non-negative and
+    // mostly small.
+    uint64_t PreviousOffset = 0;
+    for (const yaml::bolt::CallSiteInfo &CSI : YamlBB.CallSites) {
+      encodeULEB128(CSI.Offset - PreviousOffset, OS);
+      PreviousOffset = CSI.Offset;
+      encodeULEB128(CSI.DestId, OS);
+      encodeULEB128(CSI.EntryDiscriminator, OS);
+      encodeULEB128(CSI.Count, OS);
+      encodeULEB128(CSI.Mispreds, OS);
+    }
+
+    for (const yaml::bolt::SuccessorInfo &YamlSI : YamlBB.Successors) {
+      encodeULEB128(YamlSI.Index, OS);
+      encodeULEB128(YamlSI.Count, OS);
+      encodeULEB128(YamlSI.Mispreds, OS);
+    }
+  }
+}
+
+/// Write \p BP to \p OS in the compact indexed container format.
+std::error_code writeCompactProfile(raw_ostream &OS,
+                                    const yaml::bolt::BinaryProfile &BP) {
+  SmallString<0> StringTable;
+  auto addString = [&StringTable](StringRef Str) {
+    const uint32_t Offset = StringTable.size();
+    StringTable.append(Str);
+    StringTable.push_back('\0');
+    return Offset;
+  };
+
+  const uint32_t FileNameOffset = addString(BP.Header.FileName);
+  const uint32_t IdOffset = addString(BP.Header.Id);
+  const uint32_t OriginOffset = addString(BP.Header.Origin);
+  const uint32_t EventNamesOffset = addString(BP.Header.EventNames);
+
+  const uint64_t PayloadsOffset =
+      sizeof(CompactProfileHeader) +
+      BP.Functions.size() * sizeof(CompactProfileFunctionRecord);
+
+  std::vector<CompactProfileFunctionRecord> Records(BP.Functions.size());
+  SmallString<0> Payloads;
+  for (size_t I = 0, E = BP.Functions.size(); I != E; ++I) {
+    const yaml::bolt::BinaryFunctionProfile &YamlBF = BP.Functions[I];
+    CompactProfileFunctionRecord &Record = Records[I];
+    Record.NameOffset = addString(YamlBF.Name);
+    Record.Id = YamlBF.Id;
+    Record.Hash = YamlBF.Hash;
+    Record.ExecCount = YamlBF.ExecCount;
+    Record.NumBasicBlocks = YamlBF.NumBasicBlocks;
+    Record.NumProfiledBlocks = YamlBF.Blocks.size();
+
+    SmallString<256> Payload;
+    raw_svector_ostream PayloadOS(Payload);
+    encodeFunctionBlocks(YamlBF, PayloadOS);
+    Record.UncompressedSize = Payload.size();
+
+    // Store the payload deflated when that is a win. A failure to compress
+    // is not an error: the payload is kept raw.
+    StringRef Stored = Payload.str();
+    SmallVector<char, 256> Compressed;
+    if (zlib::isAvailable() && !Payload.empty()) {
+      if (Error E = zlib::compress(Payload.str(), Compressed))
+        consumeError(std::move(E));
+      else if (Compressed.size() < Payload.size())
+        Stored = StringRef(Compressed.data(), Compressed.size());
+    }
+    Record.DataOffset = PayloadsOffset + Payloads.size();
+    Record.CompressedSize = Stored.size();
+    Payloads.append(Stored);
+  }
+
+  support::endian::Writer W(OS, support::little);
+  OS.write(CompactProfileMagic, CompactProfileMagicSize);
+  W.write<uint32_t>(CompactProfileVersion);
+  W.write<uint32_t>(BP.Header.Flags);
+  W.write<uint64_t>(Records.size());
+  W.write<uint64_t>(PayloadsOffset + Payloads.size());
+  W.write<uint64_t>(StringTable.size());
+  W.write<uint32_t>(FileNameOffset);
+  W.write<uint32_t>(IdOffset);
+  W.write<uint32_t>(OriginOffset);
+  W.write<uint32_t>(EventNamesOffset);
+
+  for (const CompactProfileFunctionRecord &Record : Records) {
+    W.write<uint32_t>(Record.NameOffset);
+    W.write<uint32_t>(Record.Id);
+    W.write<uint64_t>(Record.Hash);
+    W.write<uint64_t>(Record.ExecCount);
+    W.write<uint32_t>(Record.NumBasicBlocks);
+    W.write<uint32_t>(Record.NumProfiledBlocks);
+    W.write<uint64_t>(Record.DataOffset);
+    W.write<uint32_t>(Record.CompressedSize);
+    W.write<uint32_t>(Record.UncompressedSize);
+  }
+
+  OS << Payloads << StringTable;
+
+  return std::error_code();
+}
 } // end anonymous namespace
 
 std::error_code YAMLProfileWriter::writeProfile(const RewriteInstance &RI) {
@@ -196,6 +338,9 @@ std::error_code YAMLProfileWriter::writeProfile(const RewriteInstance &RI) {
   }
 
   // Write the profile.
+  if (opts::CompactProfile)
+    return writeCompactProfile(*OS, BP);
+
   yaml::Output Out(*OS, nullptr, 0);
   Out << BP;
 
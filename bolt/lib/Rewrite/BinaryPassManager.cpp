@@ -7,10 +7,15 @@
 //===----------------------------------------------------------------------===//
 
 #include "bolt/Rewrite/BinaryPassManager.h"
+#include "bolt/Core/ParallelUtilities.h"
 #include "bolt/Passes/ADRRelaxationPass.h"
 #include "bolt/Passes/Aligner.h"
+#include "bolt/Passes/BranchRelaxation.h"
+#include "bolt/Passes/ConstantIslandDedupPass.h"
+#include "bolt/Passes/ConstantIslandPlacementPass.h"
 #include "bolt/Passes/AllocCombiner.h"
 #include "bolt/Passes/AsmDump.h"
+#include "bolt/Passes/ColdPrefetch.h"
 #include "bolt/Passes/FrameOptimizer.h"
 #include "bolt/Passes/IdenticalCodeFolding.h"
 #include "bolt/Passes/IndirectCallPromotion.h"
@@ -27,16 +32,21 @@
 #include "bolt/Passes/RetpolineInsertion.h"
 #include "bolt/Passes/SplitFunctions.h"
 #include "bolt/Passes/StokeInfo.h"
+#include "bolt/Passes/TailCallFlattening.h"
 #include "bolt/Passes/TailDuplication.h"
 #include "bolt/Passes/ThreeWayBranch.h"
 #include "bolt/Passes/ValidateInternalCalls.h"
 #include "bolt/Passes/VeneerElimination.h"
 #include "bolt/Utils/CommandLineOpts.h"
 #include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
+#include <atomic>
 #include <memory>
 #include <numeric>
+#include <thread>
 
 using namespace llvm;
 
@@ -46,9 +56,11 @@ extern cl::opt<bool> PrintAll;
 extern cl::opt<bool> PrintDynoStats;
 extern cl::opt<bool> DumpDotAll;
 extern cl::opt<std::string> AsmDump;
+extern cl::opt<std::string> ReplayFunction;
 extern cl::opt<bolt::PLTCall::OptType> PLT;
+extern cl::opt<bool> ColdPrefetch;
 
-static cl::opt<bool>
+cl::opt<bool>
 DynoStatsAll("dyno-stats-all",
   cl::desc("print dyno stats after each stage"),
   cl::ZeroOrMore, cl::Hidden, cl::cat(BoltCategory));
@@ -189,6 +201,11 @@ PrintVeneerElimination("print-veneer-elimination",
   cl::desc("print functions after veneer elimination pass"),
   cl::init(false), cl::ZeroOrMore, cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+PrintTailCallFlattening("print-tail-call-flattening",
+  cl::desc("print functions after tail-call flattening pass"),
+  cl::init(false), cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 PrintUCE("print-uce",
   cl::desc("print functions after unreachable code elimination"),
@@ -199,6 +216,12 @@ RegReAssign("reg-reassign",
   cl::desc("reassign registers so as to avoid using REX prefixes in hot code"),
   cl::init(false), cl::ZeroOrMore, cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+ReportPassStats("report-pass-stats",
+  cl::desc("report per-pass wall time, aggregate CPU time, heap usage delta, "
+           "and the number of processable functions in JSON format"),
+  cl::init(false), cl::ZeroOrMore, cl::Hidden, cl::cat(BoltCategory));
+
 static cl::opt<bool>
 SimplifyConditionalTailCalls("simplify-conditional-tail-calls",
   cl::desc("simplify conditional tail calls by removing unnecessary jumps"),
@@ -227,6 +250,12 @@ StringOps("inline-memcpy",
   cl::desc("inline memcpy using 'rep movsb' instruction (X86-only)"),
   cl::init(false), cl::ZeroOrMore, cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+FlattenTailCalls("flatten-tail-calls",
+  cl::desc("redirect direct callers past hot tail-call-only forwarding "
+           "functions"),
+  cl::init(false), cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 StripRepRet("strip-rep-ret",
   cl::desc("strip 'repz' prefix from 'repz retq' sequence (on by default)"),
@@ -247,6 +276,12 @@ ThreeWayBranchFlag("three-way-branch",
   cl::desc("reorder three way branches"),
   cl::ZeroOrMore, cl::ReallyHidden, cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+SchedMacroFusionFlag("sched-macro-fusion",
+  cl::desc("reorder instructions in hot blocks to make compare-and-branch "
+           "pairs adjacent for macro-op fusion (x86)"),
+  cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
 } // namespace opts
 
 namespace llvm {
@@ -258,8 +293,20 @@ const char BinaryFunctionPassManager::TimerGroupName[] = "passman";
 const char BinaryFunctionPassManager::TimerGroupDesc[] =
     "Binary Function Pass Manager";
 
+/// Two passes may execute at the same time only if neither one mutates a
+/// state component the other one reads or mutates.
+static bool arePassesCompatible(const BinaryFunctionPass &A,
+                                const BinaryFunctionPass &B) {
+  if (A.getStateWritten() & (B.getStateRead() | B.getStateWritten()))
+    return false;
+  if (B.getStateWritten() & A.getStateRead())
+    return false;
+  return true;
+}
+
 void BinaryFunctionPassManager::runPasses() {
   auto &BFs = BC.getBinaryFunctions();
+  json::Array PassStats;
   for (size_t PassIdx = 0; PassIdx < Passes.size(); PassIdx++) {
     const std::pair<const bool, std::unique_ptr<BinaryFunctionPass>>
         &OptPassPair = Passes[PassIdx];
@@ -273,22 +320,126 @@ void BinaryFunctionPassManager::runPasses() {
     if (opts::Verbosity > 0)
       outs() << "BOLT-INFO: Starting pass: " << Pass->getName() << "\n";
 
+    // In replay mode, print the function right before and after the replayed
+    // pass and stop the pipeline there.
+    const std::pair<StringRef, StringRef> ReplayParts =
+        StringRef(opts::ReplayFunction).rsplit('@');
+    const bool IsReplayTarget =
+        !opts::ReplayFunction.empty() && ReplayParts.second == Pass->getName();
+    auto printReplayFunctions = [&](const std::string &Message) {
+      const Regex MatchName = BinaryFunction::buildNameRegex(ReplayParts.first);
+      for (auto &It : BFs) {
+        BinaryFunction &Function = It.second;
+        if (Function.hasNameRegex(MatchName))
+          Function.print(outs(), Message, true);
+      }
+    };
+    if (IsReplayTarget)
+      printReplayFunctions(std::string("replay: before ") + Pass->getName());
+
+    TimeRecord StartTime;
+    size_t StartMemUsage = 0;
+    if (opts::ReportPassStats) {
+      StartTime = TimeRecord::getCurrentTime(/*Start=*/true);
+      StartMemUsage = sys::Process::GetMallocUsage();
+    }
+
     NamedRegionTimer T(Pass->getName(), Pass->getName(), TimerGroupName,
                        TimerGroupDesc, TimeOpts);
 
-    callWithDynoStats([this, &Pass] { Pass->runOnFunctions(BC); }, BFs,
-                      Pass->getName(), opts::DynoStatsAll);
-
-    if (opts::VerifyCFG &&
-        !std::accumulate(
-            BFs.begin(), BFs.end(), true,
-            [](const bool Valid,
-               const std::pair<const uint64_t, BinaryFunction> &It) {
-              return Valid && It.second.validateCFG();
-            })) {
-      errs() << "BOLT-ERROR: Invalid CFG detected after pass "
-             << Pass->getName() << "\n";
-      exit(1);
+    // Serve the pass's temporary annotations from a scoped region that is
+    // bulk-freed below instead of accumulating until context teardown.
+    MCPlusBuilder::AllocatorIdTy AnnotationRegion = 0;
+    if (Pass->useAnnotationRegion())
+      AnnotationRegion = BC.MIB->startAnnotationRegion();
+
+    // Look ahead for the next enabled pass: if its declared state footprint
+    // is disjoint from this one's, overlap the two. Pairing requires all
+    // per-pass bookkeeping to be off, since stats, timing, verification, and
+    // printing are collected for one pass at a time.
+    BinaryFunctionPass *Companion = nullptr;
+    if (opts::ReplayFunction.empty() && !opts::NoThreads &&
+        !opts::DynoStatsAll && !opts::TimeOpts &&
+        !opts::PrintAll && !opts::DumpDotAll && !opts::VerifyCFG &&
+        !opts::ReportPassStats && !Pass->printPass() &&
+        !Pass->useAnnotationRegion()) {
+      for (size_t NextIdx = PassIdx + 1; NextIdx < Passes.size(); ++NextIdx) {
+        if (!Passes[NextIdx].first)
+          continue;
+        BinaryFunctionPass &Next = *Passes[NextIdx].second;
+        if (!Next.printPass() && !Next.useAnnotationRegion() &&
+            arePassesCompatible(*Pass, Next)) {
+          Companion = &Next;
+          // The companion runs now, so skip its own iteration.
+          PassIdx = NextIdx;
+        }
+        break;
+      }
+    }
+
+    if (Companion) {
+      if (opts::Verbosity > 0)
+        outs() << "BOLT-INFO: Starting pass: " << Companion->getName()
+               << " (overlapped with " << Pass->getName() << ")\n";
+      // Use a dedicated thread rather than the shared pool: both passes may
+      // dispatch work to the pool and wait on it.
+      std::thread CompanionThread(
+          [this, Companion] { Companion->runOnFunctions(BC); });
+      Pass->runOnFunctions(BC);
+      CompanionThread.join();
+      if (opts::Verbosity > 0)
+        outs() << "BOLT-INFO: Finished pass: " << Companion->getName() << "\n";
+    } else {
+      callWithDynoStats([this, &Pass] { Pass->runOnFunctions(BC); }, BFs,
+                        Pass->getName(), opts::DynoStatsAll);
+    }
+
+    if (AnnotationRegion)
+      BC.MIB->endAnnotationRegion(AnnotationRegion);
+
+    if (IsReplayTarget) {
+      printReplayFunctions(std::string("replay: after ") + Pass->getName());
+      outs() << "BOLT-INFO: replay finished after pass '" << Pass->getName()
+             << "', exiting without writing output\n";
+      exit(0);
+    }
+
+    if (opts::ReportPassStats) {
+      TimeRecord Time = TimeRecord::getCurrentTime(/*Start=*/false);
+      Time -= StartTime;
+      const size_t MemUsage = sys::Process::GetMallocUsage();
+      const int64_t NumFunctions = llvm::count_if(
+          BFs, [&Pass](const std::pair<const uint64_t, BinaryFunction> &BFI) {
+            return Pass->shouldOptimize(BFI.second);
+          });
+      PassStats.push_back(json::Object{
+          {"name", Pass->getName()},
+          {"wall_time", Time.getWallTime()},
+          {"cpu_time", Time.getProcessTime()},
+          {"mem_delta",
+           static_cast<int64_t>(MemUsage) - static_cast<int64_t>(StartMemUsage)},
+          {"num_functions", NumFunctions}});
+    }
+
+    if (opts::VerifyCFG && opts::Validate != opts::VL_OFF) {
+      std::atomic<bool> Valid{true};
+      ParallelUtilities::runOnEachFunction(
+          BC, ParallelUtilities::SchedulingPolicy::SP_BB_LINEAR,
+          [&Valid](BinaryFunction &BF) {
+            if (!BF.validateCFG())
+              Valid = false;
+          },
+          [](const BinaryFunction &BF) {
+            // In fast mode only re-check functions whose layout was touched
+            // by one of the passes.
+            return opts::Validate == opts::VL_FAST && !BF.hasLayoutChanged();
+          },
+          "verify-cfg");
+      if (!Valid) {
+        errs() << "BOLT-ERROR: Invalid CFG detected after pass "
+               << Pass->getName() << "\n";
+        exit(1);
+      }
     }
 
     if (opts::Verbosity > 0)
@@ -311,6 +462,15 @@ void BinaryFunctionPassManager::runPasses() {
         Function.dumpGraphForPass(PassIdName);
     }
   }
+
+  if (!opts::ReplayFunction.empty())
+    errs() << "BOLT-WARNING: -replay-function pass '"
+           << StringRef(opts::ReplayFunction).rsplit('@').second
+           << "' did not match any pass that ran; continuing normally\n";
+
+  if (opts::ReportPassStats)
+    outs() << "BOLT-INFO: pass stats: " << json::Value(std::move(PassStats))
+           << '\n';
 }
 
 void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
@@ -351,6 +511,10 @@ void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
     Manager.registerPass(
         std::make_unique<VeneerElimination>(PrintVeneerElimination));
 
+  Manager.registerPass(
+      std::make_unique<TailCallFlattening>(PrintTailCallFlattening),
+      opts::FlattenTailCalls);
+
   Manager.registerPass(
       std::make_unique<SpecializeMemcpy1>(NeverPrint, opts::SpecializeMemcpy1),
       !opts::SpecializeMemcpy1.empty());
@@ -388,11 +552,18 @@ void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
 
   Manager.registerPass(std::make_unique<SplitFunctions>(PrintSplit));
 
+  Manager.registerPass(std::make_unique<ColdPrefetch>(), opts::ColdPrefetch);
+
   Manager.registerPass(std::make_unique<LoopInversionPass>());
 
   Manager.registerPass(std::make_unique<TailDuplication>(),
                        opts::TailDuplicationFlag);
 
+  // Runs after the layout is final so pairs broken by block reordering or
+  // splitting are put back together before emission.
+  Manager.registerPass(std::make_unique<ScheduleMacroFusion>(NeverPrint),
+                       opts::SchedMacroFusionFlag);
+
   // This pass syncs local branches with CFG. If any of the following
   // passes breaks the sync - they either need to re-run the pass or
   // fix branches consistency internally.
@@ -410,6 +581,11 @@ void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
           InitialDynoStats, "after all optimizations before SCTC and FOP"),
       opts::PrintDynoStats | opts::DynoStatsAll);
 
+  // Gate the run on the predicted dyno stats delta while the CFG and the
+  // profile attribution are still intact.
+  Manager.registerPass(std::make_unique<DynoStatsVerdictPass>(InitialDynoStats),
+                       DynoStatsVerdictPass::isEnabled());
+
   // Add the StokeInfo pass, which extract functions for stoke optimization and
   // get the liveness information for them
   Manager.registerPass(std::make_unique<StokeInfo>(PrintStoke), opts::Stoke);
@@ -435,7 +611,17 @@ void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
   // memory profiling data.
   Manager.registerPass(std::make_unique<ReorderData>());
 
+  if (BC.isX86()) {
+    // Settle branch encodings after all layout and alignment decisions so
+    // that assembler relaxation has nothing left to iterate on.
+    Manager.registerPass(std::make_unique<BranchRelaxationPass>());
+  }
+
   if (BC.isAArch64()) {
+    // Select island anchors before address relaxation so ADR relaxation sees
+    // the final relative placement of island references.
+    Manager.registerPass(std::make_unique<ConstantIslandPlacementPass>());
+
     Manager.registerPass(std::make_unique<ADRRelaxationPass>());
 
     // Tighten branches according to offset differences between branch and
@@ -458,9 +644,21 @@ void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
   Manager.registerPass(
       std::make_unique<RetpolineInsertion>(PrintRetpolineInsertion));
 
+  // Prove functions unreachable from exported or address-taken code so that
+  // AssignSections can place them with the never-executed code.
+  Manager.registerPass(std::make_unique<GCFunctions>());
+
   // Assign each function an output section.
   Manager.registerPass(std::make_unique<AssignSections>());
 
+  // Fold identical constant islands of functions placed in the same output
+  // section. Runs after section assignment so the merge candidates and
+  // their relative placement are known, and only bridges distances well
+  // within the reach of literal loads, so the in-range assumptions settled
+  // by ADR relaxation and LongJmp still hold after folding.
+  if (BC.isAArch64())
+    Manager.registerPass(std::make_unique<ConstantIslandDedupPass>());
+
   // Patch original function entries
   if (BC.HasRelocations)
     Manager.registerPass(std::make_unique<PatchEntries>());
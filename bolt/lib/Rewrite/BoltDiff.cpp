@@ -11,10 +11,12 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "bolt/Core/ParallelUtilities.h"
 #include "bolt/Passes/IdenticalCodeFolding.h"
 #include "bolt/Profile/ProfileReaderBase.h"
 #include "bolt/Rewrite/RewriteInstance.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "boltdiff"
@@ -210,6 +212,24 @@ class RewriteInstanceDiff {
     return Score / RI1.getTotalScore();
   }
 
+  /// Compute the hash of every function with a CFG in both binaries once, in
+  /// parallel. Matching and reporting below work with the cached value, so no
+  /// function is ever re-hashed at query time.
+  void precomputeHashes() {
+    ParallelUtilities::WorkFuncTy WorkFun = [](BinaryFunction &BF) {
+      BF.computeHash(/*UseDFS=*/true);
+    };
+    ParallelUtilities::PredicateTy SkipFunc = [](const BinaryFunction &BF) {
+      return !BF.hasCFG();
+    };
+    ParallelUtilities::runOnEachFunction(
+        *RI1.BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+        SkipFunc, "diffHashBinary1");
+    ParallelUtilities::runOnEachFunction(
+        *RI2.BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+        SkipFunc, "diffHashBinary2");
+  }
+
   /// Initialize data structures used for function lookup in binary 1, used
   /// later when matching functions in binary 2 to corresponding functions
   /// in binary 1
@@ -225,7 +245,7 @@ class RewriteInstanceDiff {
         NameLookup[Name] = &Function;
       }
       if (opts::MatchByHash && Function.hasCFG())
-        HashLookup[Function.computeHash(/*UseDFS=*/true)] = &Function;
+        HashLookup[Function.getHash()] = &Function;
       if (opts::IgnoreLTOSuffix && !LTOName.empty()) {
         if (!LTONameLookup1.count(LTOName))
           LTONameLookup1[LTOName] = &Function;
@@ -279,7 +299,7 @@ class RewriteInstanceDiff {
       }
       if (Match || !Function2.hasCFG())
         continue;
-      auto Iter = HashLookup.find(Function2.computeHash(/*UseDFS*/ true));
+      auto Iter = HashLookup.find(Function2.getHash());
       if (Iter != HashLookup.end()) {
         FuncMap.insert(std::make_pair<>(&Function2, Iter->second));
         Bin1MappedFuncs.insert(Iter->second);
@@ -357,27 +377,44 @@ class RewriteInstanceDiff {
   /// For a function in binary 2 that matched one in binary 1, now match each
   /// individual basic block in it to its corresponding blocks in binary 1.
   /// Also match each edge in binary 2 to the corresponding ones in binary 1.
+  /// Pairs are scored in parallel and the results merged in FuncMap order, so
+  /// the report does not depend on thread scheduling.
   void matchBasicBlocks() {
-    for (const auto &MapEntry : FuncMap) {
-      const BinaryFunction *const &Func1 = MapEntry.second;
-      const BinaryFunction *const &Func2 = MapEntry.first;
+    struct PairResult {
+      bool Matched{false};
+      std::map<const BinaryBasicBlock *, const BinaryBasicBlock *> Map;
+      std::map<double, std::pair<EdgeTy, EdgeTy>> EMap;
+      std::vector<std::pair<const BinaryBasicBlock *, const BinaryFunction *>>
+          BBToFunc;
+    };
+    std::vector<std::pair<const BinaryFunction *, const BinaryFunction *>>
+        Pairs(FuncMap.begin(), FuncMap.end());
+    std::vector<PairResult> Results(Pairs.size());
+
+    auto processPair = [&](size_t Index) {
+      const BinaryFunction *Func1 = Pairs[Index].second;
+      const BinaryFunction *Func2 = Pairs[Index].first;
+      PairResult &Res = Results[Index];
+
+      // Functions with equal hashes have identical instruction streams: skip
+      // the opcode-by-opcode comparison and only collect scores for them.
+      const bool IdenticalContents = Func1->hasCFG() && Func2->hasCFG() &&
+                                     Func1->getHash() == Func2->getHash();
 
       auto Iter1 = Func1->layout_begin();
       auto Iter2 = Func2->layout_begin();
 
       bool Match = true;
-      std::map<const BinaryBasicBlock *, const BinaryBasicBlock *> Map;
-      std::map<double, std::pair<EdgeTy, EdgeTy>> EMap;
       while (Iter1 != Func1->layout_end()) {
         if (Iter2 == Func2->layout_end()) {
           Match = false;
           break;
         }
-        if (!compareBBs(**Iter1, **Iter2)) {
+        if (!IdenticalContents && !compareBBs(**Iter1, **Iter2)) {
           Match = false;
           break;
         }
-        Map.insert(std::make_pair<>(*Iter2, *Iter1));
+        Res.Map.insert(std::make_pair<>(*Iter2, *Iter1));
 
         auto SuccIter1 = (*Iter1)->succ_begin();
         auto SuccIter2 = (*Iter2)->succ_begin();
@@ -390,7 +427,7 @@ class RewriteInstanceDiff {
           }
           const double ScoreEdge1 = getNormalizedScore(BIIter1, RI1);
           const double ScoreEdge2 = getNormalizedScore(BIIter2, RI2);
-          EMap.insert(std::make_pair<>(
+          Res.EMap.insert(std::make_pair<>(
               std::abs(ScoreEdge2 - ScoreEdge1),
               std::make_pair<>(
                   std::make_tuple<>(*Iter2, *SuccIter2, ScoreEdge2),
@@ -406,16 +443,32 @@ class RewriteInstanceDiff {
         if (!Match)
           break;
 
-        BBToFuncMap[*Iter1] = Func1;
-        BBToFuncMap[*Iter2] = Func2;
+        Res.BBToFunc.emplace_back(*Iter1, Func1);
+        Res.BBToFunc.emplace_back(*Iter2, Func2);
         ++Iter1;
         ++Iter2;
       }
-      if (!Match || Iter2 != Func2->layout_end())
-        continue;
+      Res.Matched = Match && Iter2 == Func2->layout_end();
+    };
+
+    if (opts::NoThreads) {
+      for (size_t Index = 0; Index < Pairs.size(); ++Index)
+        processPair(Index);
+    } else {
+      ThreadPool &Pool = ParallelUtilities::getThreadPool();
+      for (size_t Index = 0; Index < Pairs.size(); ++Index)
+        Pool.async(processPair, Index);
+      Pool.wait();
+    }
 
-      BBMap.insert(Map.begin(), Map.end());
-      EdgeMap.insert(EMap.begin(), EMap.end());
+    for (PairResult &Res : Results) {
+      for (const std::pair<const BinaryBasicBlock *, const BinaryFunction *>
+               &Entry : Res.BBToFunc)
+        BBToFuncMap[Entry.first] = Entry.second;
+      if (!Res.Matched)
+        continue;
+      BBMap.insert(Res.Map.begin(), Res.Map.end());
+      EdgeMap.insert(Res.EMap.begin(), Res.EMap.end());
     }
   }
 
@@ -569,8 +622,7 @@ class RewriteInstanceDiff {
       const std::pair<const BinaryFunction *const, const BinaryFunction *>
           &MapEntry = I->second;
       if (opts::IgnoreUnchanged &&
-          MapEntry.second->computeHash(/*UseDFS=*/true) ==
-              MapEntry.first->computeHash(/*UseDFS=*/true))
+          MapEntry.second->getHash() == MapEntry.first->getHash())
         continue;
       const std::pair<double, double> &Scores = ScoreMap[MapEntry.first];
       outs() << "Function " << MapEntry.first->getDemangledName();
@@ -582,8 +634,7 @@ class RewriteInstanceDiff {
              << "%\t(Difference: ";
       printColoredPercentage((Scores.second - Scores.first) * 100.0);
       outs() << ")";
-      if (MapEntry.second->computeHash(/*UseDFS=*/true) !=
-          MapEntry.first->computeHash(/*UseDFS=*/true)) {
+      if (MapEntry.second->getHash() != MapEntry.first->getHash()) {
         outs() << "\t[Functions have different contents]";
         if (opts::PrintDiffCFG) {
           outs() << "\n *** CFG for function in binary 1:\n";
@@ -657,6 +708,7 @@ class RewriteInstanceDiff {
 public:
   /// Main entry point: coordinate all tasks necessary to compare two binaries
   void compareAndReport() {
+    precomputeHashes();
     buildLookupMaps();
     matchFunctions();
     if (opts::IgnoreLTOSuffix)
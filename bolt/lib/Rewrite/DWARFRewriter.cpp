@@ -11,7 +11,9 @@
 #include "bolt/Core/BinaryFunction.h"
 #include "bolt/Core/DebugData.h"
 #include "bolt/Core/ParallelUtilities.h"
+#include "bolt/Utils/CommandLineOpts.h"
 #include "bolt/Utils/Utils.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/BinaryFormat/Dwarf.h"
 #include "llvm/DWP/DWP.h"
@@ -143,6 +145,18 @@ static cl::opt<std::string> DwarfOutputPath(
     cl::desc("Path to where .dwo files or dwp file will be written out to."),
     cl::init(""), cl::cat(BoltCategory));
 
+static cl::opt<bool>
+SkipUnchangedCUs("skip-unchanged-cus",
+  cl::desc("do not update debug info for compile units with no functions "
+           "modified by BOLT, and carry input .debug_ranges and .debug_loc "
+           "contents over to the output to keep references from such units "
+           "valid (increases the size of these sections; on by default when "
+           "not processing all functions)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
 static cl::opt<bool>
     WriteDWP("write-dwp",
              cl::desc("output a single dwarf package file (dwp) instead of "
@@ -191,6 +205,52 @@ static bool isHighPcFormEightBytes(dwarf::Form DwarfForm) {
   return DwarfForm == dwarf::DW_FORM_addr || DwarfForm == dwarf::DW_FORM_data8;
 }
 
+/// Return true if debug info of \p Unit describes the output binary as-is,
+/// i.e. no function covered by the unit changed its address or layout, and
+/// no reference from the unit can be invalidated by updates to other units.
+static bool isUnitUnchanged(const BinaryContext &BC, DWARFUnit &Unit) {
+  // Units with split (DWO) debug info have their DWO-related attributes
+  // updated even when the code is unchanged.
+  if (Unit.getDWOId())
+    return false;
+
+  // DW_FORM_ref_addr references could be invalidated when another unit
+  // changes its size. Checking abbreviations is sufficient to rule them out
+  // without visiting every DIE.
+  if (const DWARFAbbreviationDeclarationSet *Abbrevs = Unit.getAbbreviations())
+    for (const DWARFAbbreviationDeclaration &Decl : *Abbrevs)
+      for (const DWARFAbbreviationDeclaration::AttributeSpec &AttrSpec :
+           Decl.attributes())
+        if (AttrSpec.Form == dwarf::DW_FORM_ref_addr)
+          return false;
+
+  Expected<DWARFAddressRangesVector> RangesOrError =
+      Unit.getUnitDIE().getAddressRanges();
+  if (!RangesOrError) {
+    consumeError(RangesOrError.takeError());
+    return false;
+  }
+
+  const std::map<uint64_t, BinaryFunction> &BFs = BC.getBinaryFunctions();
+  for (const DWARFAddressRange &Range : *RangesOrError) {
+    auto BFI = BFs.lower_bound(Range.LowPC);
+    // The range could start in the middle of a function.
+    if (BFI != BFs.begin())
+      --BFI;
+    for (; BFI != BFs.end() && BFI->first < Range.HighPC; ++BFI) {
+      const BinaryFunction &Function = BFI->second;
+      if (Function.getAddress() + Function.getMaxSize() <= Range.LowPC)
+        continue;
+      // Functions that were not emitted keep their input address and
+      // contents in the output binary.
+      if (Function.isEmitted())
+        return false;
+    }
+  }
+
+  return true;
+}
+
 void DWARFRewriter::updateDebugInfo() {
   ErrorOr<BinarySection &> DebugInfo = BC.getUniqueSectionByName(".debug_info");
   if (!DebugInfo)
@@ -200,7 +260,6 @@ void DWARFRewriter::updateDebugInfo() {
       static_cast<DebugInfoBinaryPatcher *>(DebugInfo->getPatcher());
 
   ARangesSectionWriter = std::make_unique<DebugARangesSectionWriter>();
-  RangesSectionWriter = std::make_unique<DebugRangesSectionWriter>();
   StrWriter = std::make_unique<DebugStrWriter>(&BC);
   AbbrevWriter = std::make_unique<DebugAbbrevWriter>(*BC.DwCtx);
 
@@ -219,6 +278,49 @@ void DWARFRewriter::updateDebugInfo() {
   for (size_t CUIndex = 0; CUIndex < NumCUs; ++CUIndex)
     LocListWritersByCU[CUIndex] = std::make_unique<DebugLocWriter>(&BC);
 
+  // When running single-threaded all units share one ranges writer, which
+  // matches the old behavior of a single section-wide writer. In parallel
+  // mode every unit gets its own writer so that the section contents do not
+  // depend on the order in which units are processed.
+  const size_t NumRangesWriters =
+      (opts::NoThreads || opts::DeterministicDebugInfo)
+          ? 1
+          : BC.DwCtx->getNumCompileUnits();
+  RangesWritersByCU.reserve(NumRangesWriters);
+  for (size_t CUIndex = 0; CUIndex < NumRangesWriters; ++CUIndex)
+    RangesWritersByCU[CUIndex] = std::make_unique<UnitRangesWriter>();
+
+  // Identify units whose debug info describes the output binary as-is. Such
+  // units are carried over to the output without rewriting their DIEs. The
+  // input contents of .debug_ranges and .debug_loc are preserved in the
+  // output so that section references from these units remain valid.
+  //
+  // In lite mode most units cover only functions that BOLT does not emit, so
+  // the skip is on by default there: it avoids parsing the DIEs of units
+  // that describe unchanged code.
+  bool SkipUnchanged = opts::SkipUnchangedCUs;
+  if (!opts::SkipUnchangedCUs.getNumOccurrences() &&
+      !opts::processAllFunctions())
+    SkipUnchanged = true;
+
+  DenseSet<const DWARFUnit *> UnchangedUnits;
+  if (SkipUnchanged) {
+    for (const std::unique_ptr<DWARFUnit> &CU : BC.DwCtx->compile_units()) {
+      // Units covering processed functions always need the rewrite; the set
+      // was built during debug info preprocessing without parsing any DIEs.
+      if (BC.ProcessedCUs.count(CU.get()))
+        continue;
+      if (isUnitUnchanged(BC, *CU))
+        UnchangedUnits.insert(CU.get());
+    }
+    if (!UnchangedUnits.empty()) {
+      KeepInputDebugSections = true;
+      outs() << "BOLT-INFO: skipping debug info update for "
+             << UnchangedUnits.size() << " out of "
+             << BC.DwCtx->getNumCompileUnits() << " compile units\n";
+    }
+  }
+
   // Unordered maps to handle name collision if output DWO directory is
   // specified.
   std::unordered_map<std::string, uint32_t> NameToIndexMap;
@@ -255,6 +357,22 @@ void DWARFRewriter::updateDebugInfo() {
   };
 
   auto processUnitDIE = [&](size_t CUIndex, DWARFUnit *Unit) {
+    if (UnchangedUnits.count(Unit)) {
+      // The unit's DIEs are carried over verbatim. It still contributes to
+      // .debug_aranges and .gdb_index, and needs its offset registered for
+      // the CU offset remapping.
+      Expected<DWARFAddressRangesVector> RangesOrError =
+          Unit->getUnitDIE().getAddressRanges();
+      if (RangesOrError)
+        ARangesSectionWriter->addCURanges(
+            Unit->getOffset(),
+            BC.translateModuleAddressRanges(*RangesOrError));
+      else
+        consumeError(RangesOrError.takeError());
+      DebugInfoPatcher->addUnitBaseOffsetLabel(Unit->getOffset());
+      return;
+    }
+
     // Check if the unit is a skeleton and we need special updates for it and
     // its matching split/DWO CU.
     Optional<DWARFUnit *> SplitCU;
@@ -263,6 +381,7 @@ void DWARFRewriter::updateDebugInfo() {
     if (DWOId)
       SplitCU = BC.getDWOCU(*DWOId);
 
+    UnitRangesWriter &RangesWriter = *RangesWritersByCU.find(CUIndex)->second;
     DebugLocWriter *DebugLocWriter = nullptr;
     // Skipping CUs that failed to load.
     if (SplitCU) {
@@ -283,7 +402,7 @@ void DWARFRewriter::updateDebugInfo() {
       DebugInfoBinaryPatcher *DwoDebugInfoPatcher =
           llvm::cast<DebugInfoBinaryPatcher>(
               getBinaryDWODebugInfoPatcher(*DWOId));
-      RangesBase = RangesSectionWriter->getSectionOffset();
+      RangesBase = RangesWriter.Writer.getSectionOffset();
       DWARFContext *DWOCtx = BC.getDWOContext();
       // Setting this CU offset with DWP to normalize DIE offsets to uint32_t
       if (DWOCtx && !DWOCtx->getCUIndex().getRows().empty())
@@ -293,7 +412,7 @@ void DWARFRewriter::updateDebugInfo() {
       DebugAbbrevWriter *DWOAbbrevWriter =
           createBinaryDWOAbbrevWriter((*SplitCU)->getContext(), *DWOId);
       updateUnitDebugInfo(*(*SplitCU), *DwoDebugInfoPatcher, *DWOAbbrevWriter,
-                          *DebugLocWriter);
+                          *DebugLocWriter, RangesWriter);
       DwoDebugInfoPatcher->clearDestinationLabels();
       if (!DwoDebugInfoPatcher->getWasRangBasedUsed())
         RangesBase = None;
@@ -305,7 +424,7 @@ void DWARFRewriter::updateDebugInfo() {
     }
     DebugInfoPatcher->addUnitBaseOffsetLabel(Unit->getOffset());
     updateUnitDebugInfo(*Unit, *DebugInfoPatcher, *AbbrevWriter,
-                        *DebugLocWriter, RangesBase);
+                        *DebugLocWriter, RangesWriter, RangesBase);
   };
 
   if (opts::NoThreads || opts::DeterministicDebugInfo) {
@@ -338,7 +457,7 @@ void DWARFRewriter::updateDebugInfo() {
 void DWARFRewriter::updateUnitDebugInfo(
     DWARFUnit &Unit, DebugInfoBinaryPatcher &DebugInfoPatcher,
     DebugAbbrevWriter &AbbrevWriter, DebugLocWriter &DebugLocWriter,
-    Optional<uint64_t> RangesBase) {
+    UnitRangesWriter &RangesWriter, Optional<uint64_t> RangesBase) {
   // Cache debug ranges so that the offset for identical ranges could be reused.
   std::map<DebugAddressRangesVector, uint64_t> CachedRanges;
 
@@ -376,12 +495,12 @@ void DWARFRewriter::updateUnitDebugInfo(
       DebugAddressRangesVector OutputRanges =
           BC.translateModuleAddressRanges(ModuleRanges);
       const uint64_t RangesSectionOffset =
-          RangesSectionWriter->addRanges(OutputRanges);
+          RangesWriter.Writer.addRanges(OutputRanges);
       if (!Unit.isDWOUnit())
         ARangesSectionWriter->addCURanges(Unit.getOffset(),
                                           std::move(OutputRanges));
       updateDWARFObjectAddressRanges(DIE, RangesSectionOffset, DebugInfoPatcher,
-                                     AbbrevWriter, RangesBase);
+                                     AbbrevWriter, RangesWriter, RangesBase);
       break;
     }
     case dwarf::DW_TAG_subprogram: {
@@ -415,8 +534,8 @@ void DWARFRewriter::updateUnitDebugInfo(
       // Update ranges.
       if (UsesRanges) {
         updateDWARFObjectAddressRanges(
-            DIE, RangesSectionWriter->addRanges(FunctionRanges),
-            DebugInfoPatcher, AbbrevWriter);
+            DIE, RangesWriter.Writer.addRanges(FunctionRanges),
+            DebugInfoPatcher, AbbrevWriter, RangesWriter);
       } else {
         // Delay conversion of [LowPC, HighPC) into DW_AT_ranges if possible.
         const DWARFAbbreviationDeclaration *Abbrev =
@@ -428,15 +547,16 @@ void DWARFRewriter::updateUnitDebugInfo(
         std::unique_lock<std::shared_timed_mutex> Lock(CriticalSectionMutex);
 
         if (FunctionRanges.size() > 1) {
-          convertPending(Unit, Abbrev, DebugInfoPatcher, AbbrevWriter);
+          convertPending(Unit, Abbrev, DebugInfoPatcher, AbbrevWriter,
+                         RangesWriter);
           // Exit critical section early.
           Lock.unlock();
-          convertToRanges(DIE, FunctionRanges, DebugInfoPatcher);
+          convertToRanges(DIE, FunctionRanges, DebugInfoPatcher, RangesWriter);
         } else if (ConvertedRangesAbbrevs.find(Abbrev) !=
                    ConvertedRangesAbbrevs.end()) {
           // Exit critical section early.
           Lock.unlock();
-          convertToRanges(DIE, FunctionRanges, DebugInfoPatcher);
+          convertToRanges(DIE, FunctionRanges, DebugInfoPatcher, RangesWriter);
         } else {
           if (FunctionRanges.empty())
             FunctionRanges.emplace_back(DebugAddressRange());
@@ -450,7 +570,7 @@ void DWARFRewriter::updateUnitDebugInfo(
     case dwarf::DW_TAG_try_block:
     case dwarf::DW_TAG_catch_block: {
       uint64_t RangesSectionOffset =
-          RangesSectionWriter->getEmptyRangesOffset();
+          RangesWriter.Writer.getEmptyRangesOffset();
       Expected<DWARFAddressRangesVector> RangesOrError = DIE.getAddressRanges();
       const BinaryFunction *Function =
           RangesOrError && !RangesOrError->empty()
@@ -465,13 +585,13 @@ void DWARFRewriter::updateUnitDebugInfo(
                  << Twine::utohexstr(DIE.getOffset()) << " in CU at 0x"
                  << Twine::utohexstr(Unit.getOffset()) << '\n';
         });
-        RangesSectionOffset = RangesSectionWriter->addRanges(
+        RangesSectionOffset = RangesWriter.Writer.addRanges(
             std::move(OutputRanges), CachedRanges);
       } else if (!RangesOrError) {
         consumeError(RangesOrError.takeError());
       }
       updateDWARFObjectAddressRanges(DIE, RangesSectionOffset, DebugInfoPatcher,
-                                     AbbrevWriter);
+                                     AbbrevWriter, RangesWriter);
       break;
     }
     default: {
@@ -659,7 +779,7 @@ void DWARFRewriter::updateUnitDebugInfo(
 void DWARFRewriter::updateDWARFObjectAddressRanges(
     const DWARFDie DIE, uint64_t DebugRangesOffset,
     SimpleBinaryPatcher &DebugInfoPatcher, DebugAbbrevWriter &AbbrevWriter,
-    Optional<uint64_t> RangesBase) {
+    UnitRangesWriter &RangesWriter, Optional<uint64_t> RangesBase) {
 
   // Some objects don't have an associated DIE and cannot be updated (such as
   // compiler-generated functions).
@@ -678,13 +798,15 @@ void DWARFRewriter::updateDWARFObjectAddressRanges(
 
   if (RangesBase) {
     // If DW_AT_GNU_ranges_base is present, update it. No further modifications
-    // are needed for ranges base.
+    // are needed for ranges base. The value is an offset into the unit's
+    // ranges buffer, so it is finalized once per-unit buffers are merged.
     Optional<AttrInfo> RangesBaseAttrInfo =
         findAttributeInfo(DIE, dwarf::DW_AT_GNU_ranges_base);
     if (RangesBaseAttrInfo) {
-      DebugInfoPatcher.addLE32Patch(RangesBaseAttrInfo->Offset,
-                                    static_cast<uint32_t>(*RangesBase),
-                                    RangesBaseAttrInfo->Size);
+      RangesWriter.InfoPatches.push_back({RangesBaseAttrInfo->Offset,
+                                          *RangesBase,
+                                          RangesBaseAttrInfo->Size,
+                                          /*IsULEB128=*/false});
       RangesBase = None;
     }
   }
@@ -695,10 +817,18 @@ void DWARFRewriter::updateDWARFObjectAddressRanges(
     // and introduce DW_AT_GNU_ranges_base if required.
     Optional<AttrInfo> AttrVal = findAttributeInfo(DIE, dwarf::DW_AT_ranges);
 
-    std::lock_guard<std::mutex> Lock(DebugInfoPatcherMutex);
-    DebugInfoPatcher.addLE32Patch(
-        AttrVal->Offset, DebugRangesOffset - DebugInfoPatcher.getRangeBase(),
-        AttrVal->Size);
+    if (DIE.getDwarfUnit()->isDWOUnit()) {
+      // Ranges in a split unit are relative to DW_AT_GNU_ranges_base that was
+      // captured from the same per-unit writer, so the value is final.
+      std::lock_guard<std::mutex> Lock(DebugInfoPatcherMutex);
+      DebugInfoPatcher.addLE32Patch(
+          AttrVal->Offset, DebugRangesOffset - DebugInfoPatcher.getRangeBase(),
+          AttrVal->Size);
+      return;
+    }
+
+    RangesWriter.InfoPatches.push_back({AttrVal->Offset, DebugRangesOffset,
+                                        AttrVal->Size, /*IsULEB128=*/false});
     if (!RangesBase)
       return;
 
@@ -718,7 +848,8 @@ void DWARFRewriter::updateDWARFObjectAddressRanges(
         dwarf::DW_AT_GNU_ranges_base, dwarf::DW_FORM_indirect);
     DebugInfoPatcher.addUDataPatch(LowPCAttrInfo->Offset, dwarf::DW_FORM_udata,
                                    1);
-    DebugInfoPatcher.addUDataPatch(LowPCAttrInfo->Offset + 1, *RangesBase, 7);
+    RangesWriter.InfoPatches.push_back(
+        {LowPCAttrInfo->Offset + 1, *RangesBase, 7, /*IsULEB128=*/true});
 
     return;
   }
@@ -730,7 +861,7 @@ void DWARFRewriter::updateDWARFObjectAddressRanges(
     convertToRangesPatchAbbrev(*DIE.getDwarfUnit(), AbbreviationDecl,
                                AbbrevWriter, RangesBase);
     convertToRangesPatchDebugInfo(DIE, DebugRangesOffset, DebugInfoPatcher,
-                                  RangesBase);
+                                  RangesWriter, RangesBase);
   } else {
     if (opts::Verbosity >= 1)
       errs() << "BOLT-ERROR: cannot update ranges for DIE at offset 0x"
@@ -827,8 +958,38 @@ void DWARFRewriter::finalizeDebugSections(
                                    DebugStrSectionContents->size());
   }
 
-  std::unique_ptr<DebugBufferVector> RangesSectionContents =
-      RangesSectionWriter->finalize();
+  // Concatenate per-unit ranges buffers in the input unit order, and
+  // finalize .debug_info patches whose values are offsets into the unit's
+  // buffer now that the buffer's position in the section is known.
+  auto RangesSectionContents = std::make_unique<DebugBufferVector>();
+  if (KeepInputDebugSections) {
+    // Carry the input section over so that ranges references from units
+    // that were not updated remain valid.
+    ErrorOr<BinarySection &> InputRanges =
+        BC.getUniqueSectionByName(".debug_ranges");
+    if (InputRanges) {
+      StringRef Contents = InputRanges->getContents();
+      RangesSectionContents->append(Contents.begin(), Contents.end());
+    }
+  }
+  for (size_t CUIndex = 0; CUIndex < RangesWritersByCU.size(); ++CUIndex) {
+    UnitRangesWriter &UnitWriter = *RangesWritersByCU[CUIndex];
+    const uint64_t SectionBase = RangesSectionContents->size();
+    for (const DebugRangesOffsetPatch &Patch : UnitWriter.InfoPatches) {
+      if (Patch.IsULEB128)
+        DebugInfoPatcher.addUDataPatch(Patch.InfoOffset,
+                                       SectionBase + Patch.RangesOffset,
+                                       Patch.OldValueSize);
+      else
+        DebugInfoPatcher.addLE32Patch(
+            Patch.InfoOffset,
+            static_cast<uint32_t>(SectionBase + Patch.RangesOffset),
+            Patch.OldValueSize);
+    }
+    std::unique_ptr<DebugBufferVector> UnitContents =
+        UnitWriter.Writer.finalize();
+    RangesSectionContents->append(UnitContents->begin(), UnitContents->end());
+  }
   BC.registerOrUpdateNoteSection(".debug_ranges",
                                  copyByteArray(*RangesSectionContents),
                                  RangesSectionContents->size());
@@ -1343,20 +1504,23 @@ void DWARFRewriter::updateGdbIndexSection() {
 
 void DWARFRewriter::convertToRanges(DWARFDie DIE,
                                     const DebugAddressRangesVector &Ranges,
-                                    SimpleBinaryPatcher &DebugInfoPatcher) {
+                                    SimpleBinaryPatcher &DebugInfoPatcher,
+                                    UnitRangesWriter &RangesWriter) {
   uint64_t RangesSectionOffset;
   if (Ranges.empty())
-    RangesSectionOffset = RangesSectionWriter->getEmptyRangesOffset();
+    RangesSectionOffset = RangesWriter.Writer.getEmptyRangesOffset();
   else
-    RangesSectionOffset = RangesSectionWriter->addRanges(Ranges);
+    RangesSectionOffset = RangesWriter.Writer.addRanges(Ranges);
 
-  convertToRangesPatchDebugInfo(DIE, RangesSectionOffset, DebugInfoPatcher);
+  convertToRangesPatchDebugInfo(DIE, RangesSectionOffset, DebugInfoPatcher,
+                                RangesWriter);
 }
 
 void DWARFRewriter::convertPending(const DWARFUnit &Unit,
                                    const DWARFAbbreviationDeclaration *Abbrev,
                                    SimpleBinaryPatcher &DebugInfoPatcher,
-                                   DebugAbbrevWriter &AbbrevWriter) {
+                                   DebugAbbrevWriter &AbbrevWriter,
+                                   UnitRangesWriter &RangesWriter) {
   if (ConvertedRangesAbbrevs.count(Abbrev))
     return;
 
@@ -1365,7 +1529,8 @@ void DWARFRewriter::convertPending(const DWARFUnit &Unit,
   auto I = PendingRanges.find(Abbrev);
   if (I != PendingRanges.end()) {
     for (std::pair<DWARFDieWrapper, DebugAddressRange> &Pair : I->second)
-      convertToRanges(Pair.first, {Pair.second}, DebugInfoPatcher);
+      convertToRanges(Pair.first, {Pair.second}, DebugInfoPatcher,
+                      RangesWriter);
     PendingRanges.erase(I);
   }
 
@@ -1411,7 +1576,19 @@ DWARFRewriter::makeFinalLocListsSection(SimpleBinaryPatcher &DebugInfoPatcher) {
 
   uint64_t SectionOffset = 0;
 
-  // Add an empty list as the first entry;
+  if (KeepInputDebugSections) {
+    // Carry the input section over so that location list references from
+    // units that were not updated remain valid.
+    ErrorOr<BinarySection &> InputLoc = BC.getUniqueSectionByName(".debug_loc");
+    if (InputLoc) {
+      StringRef Contents = InputLoc->getContents();
+      *LocStream << Contents;
+      SectionOffset += Contents.size();
+    }
+  }
+
+  // Add an empty list as the first entry after the preserved contents;
+  const uint64_t EmptyListOffset = SectionOffset;
   const char Zeroes[16] = {0};
   *LocStream << StringRef(Zeroes, 16);
   SectionOffset += 2 * 8;
@@ -1425,6 +1602,7 @@ DWARFRewriter::makeFinalLocListsSection(SimpleBinaryPatcher &DebugInfoPatcher) {
       LocListWriter->finalize(0, *Patcher);
       continue;
     }
+    LocWriter->setEmptyListOffset(EmptyListOffset);
     LocWriter->finalize(SectionOffset, DebugInfoPatcher);
     std::unique_ptr<DebugBufferVector> CurrCULocationLists =
         LocWriter->getBuffer();
@@ -1535,7 +1713,8 @@ void DWARFRewriter::convertToRangesPatchAbbrev(
 
 void DWARFRewriter::convertToRangesPatchDebugInfo(
     DWARFDie DIE, uint64_t RangesSectionOffset,
-    SimpleBinaryPatcher &DebugInfoPatcher, Optional<uint64_t> RangesBase) {
+    SimpleBinaryPatcher &DebugInfoPatcher, UnitRangesWriter &RangesWriter,
+    Optional<uint64_t> RangesBase) {
   Optional<AttrInfo> LowPCVal = None;
   Optional<AttrInfo> HighPCVal = None;
   getRangeAttrData(DIE, LowPCVal, HighPCVal);
@@ -1543,20 +1722,34 @@ void DWARFRewriter::convertToRangesPatchDebugInfo(
   uint64_t HighPCOffset = HighPCVal->Offset;
 
   std::lock_guard<std::mutex> Lock(DebugInfoPatcherMutex);
-  uint32_t BaseOffset = 0;
   if (LowPCVal->V.getForm() == dwarf::DW_FORM_GNU_addr_index) {
     // Use ULEB128 for the value.
     DebugInfoPatcher.addUDataPatch(LowPCOffset, 0,
                                    std::abs(int(HighPCOffset - LowPCOffset)));
-    // Ranges are relative to DW_AT_GNU_ranges_base.
-    BaseOffset = DebugInfoPatcher.getRangeBase();
-  } else {
-    // If case DW_AT_low_pc was converted into DW_AT_GNU_ranges_base
-    if (RangesBase)
-      DebugInfoPatcher.addLE32Patch(LowPCOffset, *RangesBase, 8);
-    else
-      DebugInfoPatcher.addLE64Patch(LowPCOffset, 0);
+    // Ranges are relative to DW_AT_GNU_ranges_base that was captured from the
+    // same per-unit writer, so the value is final.
+    DebugInfoPatcher.addLE32Patch(
+        HighPCOffset, RangesSectionOffset - DebugInfoPatcher.getRangeBase(),
+        HighPCVal->Size);
+    return;
   }
-  DebugInfoPatcher.addLE32Patch(HighPCOffset, RangesSectionOffset - BaseOffset,
-                                HighPCVal->Size);
+
+  if (DIE.getDwarfUnit()->isDWOUnit()) {
+    // Keep direct patching for split units: their ranges offsets are not
+    // in the main binary patcher.
+    DebugInfoPatcher.addLE64Patch(LowPCOffset, 0);
+    DebugInfoPatcher.addLE32Patch(HighPCOffset, RangesSectionOffset,
+                                  HighPCVal->Size);
+    return;
+  }
+
+  // If case DW_AT_low_pc was converted into DW_AT_GNU_ranges_base
+  if (RangesBase)
+    RangesWriter.InfoPatches.push_back(
+        {LowPCOffset, *RangesBase, 8, /*IsULEB128=*/false});
+  else
+    DebugInfoPatcher.addLE64Patch(LowPCOffset, 0);
+  RangesWriter.InfoPatches.push_back(
+      {HighPCOffset, RangesSectionOffset, HighPCVal->Size,
+       /*IsULEB128=*/false});
 }
@@ -25,11 +25,16 @@
 #include "bolt/Rewrite/BinaryPassManager.h"
 #include "bolt/Rewrite/DWARFRewriter.h"
 #include "bolt/Rewrite/ExecutableFileMemoryManager.h"
+#include "bolt/RuntimeLibs/ColdCompressRuntimeLibrary.h"
 #include "bolt/RuntimeLibs/HugifyRuntimeLibrary.h"
 #include "bolt/RuntimeLibs/InstrumentationRuntimeLibrary.h"
+#include "bolt/RuntimeLibs/RuntimeImageCache.h"
 #include "bolt/Utils/CommandLineOpts.h"
+#include "bolt/Utils/ThreadTimer.h"
 #include "bolt/Utils/Utils.h"
 #include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/DebugInfo/DWARF/DWARFContext.h"
 #include "llvm/ExecutionEngine/RuntimeDyld.h"
 #include "llvm/MC/MCAsmBackend.h"
@@ -46,17 +51,34 @@
 #include "llvm/Support/Alignment.h"
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Compression.h"
 #include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/LEB128.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/raw_ostream.h"
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <limits>
 #include <system_error>
+#include <thread>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt"
@@ -71,10 +93,12 @@ extern cl::opt<bool> X86AlignBranchWithin32BBoundaries;
 namespace opts {
 
 extern cl::opt<MacroFusionType> AlignMacroOpFusion;
+extern cl::opt<bool> DynoStatsAll;
 extern cl::list<std::string> HotTextMoveSections;
 extern cl::opt<bool> Hugify;
 extern cl::opt<bool> Instrument;
 extern cl::opt<JumpTableSupportLevel> JumpTables;
+extern cl::opt<std::string> ProfileMatchCacheFile;
 extern cl::list<std::string> ReorderData;
 extern cl::opt<bolt::ReorderFunctions::ReorderType> ReorderFunctions;
 extern cl::opt<bool> TimeBuild;
@@ -100,6 +124,25 @@ AllowStripped("allow-stripped",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<bool>
+DeferredCFG("deferred-cfg",
+  cl::desc("build CFG only for functions with profile and for functions "
+           "requested by optimization passes, and keep the rest of the code "
+           "unchanged in the output"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
+static cl::opt<bool>
+DryRun("dry-run",
+  cl::desc("run discovery, profile attribution, and optimization passes, then "
+           "report the estimated layout (hot text size, cache metrics) "
+           "instead of emitting and rewriting the binary"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 cl::opt<bool>
 DumpDotAll("dump-dot-all",
   cl::desc("dump function CFGs to graphviz format after each stage"),
@@ -131,6 +174,15 @@ static cl::opt<std::string> FunctionNamesFileNR(
     cl::desc("file with list of functions to optimize (non-regex)"), cl::Hidden,
     cl::cat(BoltCategory));
 
+cl::opt<std::string>
+ReplayFunction("replay-function",
+  cl::desc("restrict optimization to one function and stop right after the "
+           "named pass finishes, printing the function before and after it; "
+           "no output binary is written"),
+  cl::value_desc("func@pass"),
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
 cl::opt<bool>
 KeepTmp("keep-tmp",
   cl::desc("preserve intermediate .o file"),
@@ -165,6 +217,16 @@ LiteThresholdCount("lite-threshold-count",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static cl::opt<double>
+LiteCoveragePct("lite-coverage-pct",
+  cl::desc("process only the hottest functions that together cover the given "
+           "percentage of all profile samples (e.g. 99.9), keeping the rest "
+           "as raw bytes. Implies -lite."),
+  cl::init(0.0),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<unsigned>
 MaxFunctions("max-funcs",
   cl::desc("maximum number of functions to process"),
@@ -179,6 +241,17 @@ MaxDataRelocations("max-data-relocations",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<unsigned>
+MaxMemoryMB("max-memory",
+  cl::desc("approximate memory budget in megabytes. When the budget is "
+           "exceeded, degrade processing instead of risking an OOM kill: "
+           "drop CFGs of functions without profile, fall back to "
+           "single-threaded processing, and switch to lite mode. "
+           "0 = unlimited"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 cl::opt<bool>
 PrintAll("print-all",
   cl::desc("print functions after each stage"),
@@ -242,12 +315,57 @@ cl::opt<PrintPseudoProbesOptions> PrintPseudoProbes(
                clEnumValN(PPP_All, "all", "enable all debugging printout")),
     cl::ZeroOrMore, cl::Hidden, cl::cat(BoltCategory));
 
+static cl::opt<bool>
+ReportMemory("report-memory",
+  cl::desc("report per-subsystem memory usage at each processing phase"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
+static cl::opt<bool>
+ReportInstFootprint("report-inst-footprint",
+  cl::desc("report MCInst operand usage to size compact instruction storage"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
+static cl::opt<std::string>
+CheckpointDir("checkpoint-dir",
+  cl::desc("directory with restartable state kept across runs on the same "
+           "input binary: the symbol discovery snapshot and the profile "
+           "match cache. A restarted run reuses whatever state the previous "
+           "run persisted. Runs producing different output variants of the "
+           "same input, e.g. per-microarchitecture layouts, may share one "
+           "directory and execute concurrently: state files are replaced "
+           "atomically and whichever run finishes a phase first populates "
+           "them for the others. The directory is created if it does not "
+           "exist"),
+  cl::value_desc("dir"),
+  cl::cat(BoltCategory));
+
+static cl::opt<std::string>
+ReadDiscoverySnapshot("read-discovery-snapshot",
+  cl::desc("replay the symbol table analysis from a snapshot <file> written "
+           "by -write-discovery-snapshot for the same input binary"),
+  cl::value_desc("file"),
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
 static cl::opt<cl::boolOrDefault>
 RelocationMode("relocs",
   cl::desc("use relocations in the binary (default=autodetect)"),
   cl::ZeroOrMore,
   cl::cat(BoltCategory));
 
+static cl::opt<std::string>
+RuntimeLibCache("runtime-lib-cache",
+  cl::desc("directory with resolved runtime library images, reused across "
+           "invocations when the library links to identical addresses"),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 static cl::opt<std::string>
 SaveProfile("w",
   cl::desc("save recorded profile to a file"),
@@ -273,6 +391,14 @@ TrapOldCode("trap-old-code",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<std::string>
+WriteDiscoverySnapshot("write-discovery-snapshot",
+  cl::desc("save the result of the symbol table analysis to <file> so that "
+           "other tools processing the same input binary can reuse it"),
+  cl::value_desc("file"),
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
 static cl::opt<std::string> DWPPathName("dwp",
                                         cl::desc("Path and name to DWP file."),
                                         cl::Hidden, cl::ZeroOrMore,
@@ -298,6 +424,31 @@ SequentialDisassembly("sequential-disassembly",
   cl::init(false),
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+ZeroCopyOutput("zero-copy-output",
+  cl::desc("copy unchanged parts of the input binary to the output file in "
+           "the kernel, bypassing user-space buffers (Linux only)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOutputCategory));
+
+static cl::opt<bool>
+SparseOutput("sparse-output",
+  cl::desc("punch holes in the output file for long all-zero regions, "
+           "creating a sparse file (Linux only)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOutputCategory));
+
+static cl::opt<bool>
+CompressDebugSections("compress-debug-sections",
+  cl::desc("write debug sections compressed with zlib (SHF_COMPRESSED)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOutputCategory));
+
 static cl::opt<bool>
 WriteBoltInfoSection("bolt-info",
   cl::desc("write bolt info section in the output binary"),
@@ -398,6 +549,8 @@ RewriteInstance::RewriteInstance(ELFObjectFileBase *File, const int Argc,
     BC->setRuntimeLibrary(std::make_unique<InstrumentationRuntimeLibrary>());
   else if (opts::Hugify)
     BC->setRuntimeLibrary(std::make_unique<HugifyRuntimeLibrary>());
+  else if (opts::ColdCompress)
+    BC->setRuntimeLibrary(std::make_unique<ColdCompressRuntimeLibrary>());
 }
 
 RewriteInstance::~RewriteInstance() {}
@@ -417,7 +570,8 @@ Error RewriteInstance::setProfile(StringRef Filename) {
   // Spawn a profile reader based on file contents.
   if (DataAggregator::checkPerfDataMagic(Filename))
     ProfileReader = std::make_unique<DataAggregator>(Filename);
-  else if (YAMLProfileReader::isYAML(Filename))
+  else if (YAMLProfileReader::isYAML(Filename) ||
+           YAMLProfileReader::isCompact(Filename))
     ProfileReader = std::make_unique<YAMLProfileReader>(Filename);
   else
     ProfileReader = std::make_unique<DataReader>(Filename);
@@ -477,8 +631,30 @@ void RewriteInstance::discoverStorage() {
     }
   }
 
+  // This is the only pass over the input section table: with
+  // -ffunction-sections inputs the table holds a header per function, and
+  // repeated scans with per-section name lookups are measurable at startup.
+  // Sections are registered and classified here, and readSpecialSections()
+  // reuses the results.
   for (const SectionRef &Section : InputFile->sections()) {
-    StringRef SectionName = cantFail(Section.getName());
+    Expected<StringRef> SectionNameOrErr = Section.getName();
+    check_error(SectionNameOrErr.takeError(), "cannot get section name");
+    StringRef SectionName = *SectionNameOrErr;
+
+    // Only register sections with names.
+    if (!SectionName.empty()) {
+      BC->registerSection(Section);
+      LLVM_DEBUG(
+          dbgs() << "BOLT-DEBUG: registering section " << SectionName << " @ 0x"
+                 << Twine::utohexstr(Section.getAddress()) << ":0x"
+                 << Twine::utohexstr(Section.getAddress() + Section.getSize())
+                 << "\n");
+      if (isDebugSection(SectionName))
+        InputHasDebugInfo = true;
+      if (isKSymtabSection(SectionName))
+        opts::LinuxKernelMode = true;
+    }
+
     if (SectionName == ".text") {
       BC->OldTextSectionAddress = Section.getAddress();
       BC->OldTextSectionSize = Section.getSize();
@@ -747,28 +923,64 @@ void RewriteInstance::run() {
   discoverStorage();
   readSpecialSections();
   adjustCommandLineOptions();
+  auto reportMemory = [this](StringRef Phase) {
+    if (opts::ReportMemory)
+      BC->printMemoryStats(outs(), Phase);
+  };
+
   discoverFileObjects();
+  reportMemory("discovery");
+
+  // Profile pre-processing is dominated by I/O while disassembly is dominated
+  // by CPU, and the pre-processing stage only reads binary state that is
+  // fixed after file discovery. Overlap it with the phases below by running
+  // it on a separate thread and joining before the first consumer of the
+  // profile: function selection in lite mode, or CFG construction otherwise.
+  std::thread ProfilePreprocessingThread;
+  if (ProfileReader && !opts::NoThreads)
+    ProfilePreprocessingThread = std::thread([this] {
+      preprocessProfileData();
+    });
+  else
+    preprocessProfileData();
 
-  preprocessProfileData();
+  auto joinProfilePreprocessing = [&ProfilePreprocessingThread] {
+    if (ProfilePreprocessingThread.joinable())
+      ProfilePreprocessingThread.join();
+  };
 
   // Skip disassembling if we have a translation table and we are running an
   // aggregation job.
   if (opts::AggregateOnly && BAT->enabledFor(InputFile)) {
+    joinProfilePreprocessing();
     processProfileData();
     return;
   }
 
+  enforceMemoryLimit("discovery", /*BeforeFunctionSelection=*/true);
+
+  // Lite-mode function selection is driven by the profile.
+  if (ProfileReader &&
+      (opts::Lite || opts::LiteThresholdPct || opts::LiteCoveragePct))
+    joinProfilePreprocessing();
+
   selectFunctionsToProcess();
 
   readDebugInfo();
 
   disassembleFunctions();
+  reportMemory("disassembly");
+  enforceMemoryLimit("disassembly");
+
+  joinProfilePreprocessing();
 
   processProfileDataPreCFG();
 
   buildFunctionsCFG();
 
   processProfileData();
+  reportMemory("profile processing");
+  enforceMemoryLimit("profile processing");
 
   postProcessFunctions();
 
@@ -776,8 +988,16 @@ void RewriteInstance::run() {
     return;
 
   runOptimizationPasses();
+  reportMemory("optimization passes");
+  enforceMemoryLimit("optimization passes");
+
+  if (opts::DryRun) {
+    printDryRunReport();
+    return;
+  }
 
   emitAndLink();
+  reportMemory("emission");
 
   updateMetadata();
 
@@ -791,6 +1011,113 @@ void RewriteInstance::run() {
 
   // Rewrite allocatable contents and copy non-allocatable parts with mods.
   rewriteFile();
+  reportMemory("rewriting");
+}
+
+void RewriteInstance::predictHotFunctions(raw_ostream &OS) {
+  if (!BC) {
+    errs() << "BOLT-ERROR: failed to create a binary context\n";
+    return;
+  }
+  if (!ProfileReader) {
+    errs() << "BOLT-ERROR: hot set prediction requires a profile\n";
+    return;
+  }
+
+  discoverStorage();
+  readSpecialSections();
+  adjustCommandLineOptions();
+  discoverFileObjects();
+  preprocessProfileData();
+  selectFunctionsToProcess();
+
+  // The predicted hot set is the profiled part of the processing selection.
+  // Rank it by sample mass the same way the sample-coverage selection does
+  // so that consumers can truncate the list at any coverage point.
+  auto sampleMass = [](const BinaryFunction &Function) {
+    return Function.getRawBranchCount() ? Function.getRawBranchCount()
+                                        : Function.getKnownExecutionCount();
+  };
+  std::vector<const BinaryFunction *> HotFunctions;
+  for (auto &BFI : BC->getBinaryFunctions()) {
+    const BinaryFunction &Function = BFI.second;
+    if (Function.isIgnored() || !ProfileReader->mayHaveProfileData(Function))
+      continue;
+    HotFunctions.push_back(&Function);
+  }
+  std::sort(HotFunctions.begin(), HotFunctions.end(),
+            [&](const BinaryFunction *A, const BinaryFunction *B) {
+              if (sampleMass(*A) != sampleMass(*B))
+                return sampleMass(*A) > sampleMass(*B);
+              return A->getAddress() < B->getAddress();
+            });
+
+  OS << "BOLT-INFO: predicted hot set contains " << HotFunctions.size()
+     << " functions: <samples> <invocations> <name>\n";
+  for (const BinaryFunction *Function : HotFunctions)
+    OS << sampleMass(*Function) << ' ' << Function->getKnownExecutionCount()
+       << ' ' << Function->getOneName() << '\n';
+}
+
+void RewriteInstance::enforceMemoryLimit(StringRef Phase,
+                                         bool BeforeFunctionSelection) {
+  if (!opts::MaxMemoryMB)
+    return;
+
+  auto usedMB = [] { return sys::Process::GetMallocUsage() >> 20; };
+
+  size_t UsedMB = usedMB();
+  if (UsedMB <= opts::MaxMemoryMB)
+    return;
+
+  errs() << "BOLT-WARNING: memory usage of " << UsedMB << "MB after " << Phase
+         << " exceeds the budget of " << opts::MaxMemoryMB << "MB\n";
+
+  // First release the CFGs of functions without profile. These functions are
+  // emitted unmodified and only need their raw bytes. Functions that have not
+  // reached CFG construction yet keep this rung available for a later phase.
+  // Under -use-old-text or -strict every function must be processed, so
+  // dropping state is not an option there.
+  if (!DroppedColdCFGs && !opts::processAllFunctions()) {
+    bool SawCFG = false;
+    uint64_t NumDropped = 0;
+    for (auto &BFI : BC->getBinaryFunctions()) {
+      BinaryFunction &Function = BFI.second;
+      if (!Function.hasCFG())
+        continue;
+      SawCFG = true;
+      if (!Function.hasValidProfile()) {
+        Function.setIgnored();
+        ++NumDropped;
+      }
+    }
+    if (SawCFG) {
+      DroppedColdCFGs = true;
+      errs() << "BOLT-WARNING: released CFGs of " << NumDropped
+             << " functions without profile\n";
+      UsedMB = usedMB();
+      if (UsedMB <= opts::MaxMemoryMB)
+        return;
+    }
+  }
+
+  // Still over budget: give up parallelism so that per-thread working sets
+  // and allocator caches stop multiplying the footprint.
+  if (!opts::NoThreads) {
+    errs() << "BOLT-WARNING: falling back to single-threaded processing\n";
+    opts::NoThreads = true;
+    if (!BeforeFunctionSelection)
+      return;
+  }
+
+  // Exceeding the budget before functions were even selected means the CFG
+  // phases are certain to exceed it too. Lite mode is the last resort and is
+  // only possible while the selection has not happened yet.
+  if (BeforeFunctionSelection && !opts::Lite) {
+    errs() << "BOLT-WARNING: switching to lite mode to stay within the "
+              "memory budget\n";
+    opts::Lite = true;
+  }
 }
 
 void RewriteInstance::discoverFileObjects() {
@@ -800,16 +1127,125 @@ void RewriteInstance::discoverFileObjects() {
   BC->getBinaryFunctions().clear();
   BC->clearBinaryData();
 
+  bool SeenFileName = false;
+  std::vector<std::pair<uint64_t, SymbolRef>> MarkerSymbols;
+  std::vector<std::pair<uint64_t, uint64_t>> SecondaryEntryPoints;
+
+  // Replay a previously saved symbol table analysis if requested: tools
+  // processing the same input binary in one pipeline stage (optimization,
+  // diff, heatmap) can then amortize the discovery work across each other.
+  bool SnapshotLoaded = false;
+  if (!opts::ReadDiscoverySnapshot.empty())
+    SnapshotLoaded =
+        loadDiscoverySnapshot(opts::ReadDiscoverySnapshot, SeenFileName);
+
+  if (!SnapshotLoaded) {
+    discoverSymbolTableObjects(MarkerSymbols, SecondaryEntryPoints,
+                               SeenFileName);
+    if (!opts::WriteDiscoverySnapshot.empty())
+      writeDiscoverySnapshot(opts::WriteDiscoverySnapshot, SecondaryEntryPoints,
+                             SeenFileName);
+  }
+
+  // Read dynamic relocation first as their presence affects the way we process
+  // static relocations. E.g. we will ignore a static relocation at an address
+  // that is a subject to dynamic relocation processing.
+  processDynamicRelocations();
+
+  // Process PLT section.
+  if (BC->TheTriple->getArch() == Triple::x86_64)
+    disassemblePLT();
+
+  // See if we missed any functions marked by FDE.
+  for (const auto &FDEI : CFIRdWrt->getFDEs()) {
+    const uint64_t Address = FDEI.first;
+    const dwarf::FDE *FDE = FDEI.second;
+    const BinaryFunction *BF = BC->getBinaryFunctionAtAddress(Address);
+    if (BF)
+      continue;
+
+    BF = BC->getBinaryFunctionContainingAddress(Address);
+    if (BF) {
+      errs() << "BOLT-WARNING: FDE [0x" << Twine::utohexstr(Address) << ", 0x"
+             << Twine::utohexstr(Address + FDE->getAddressRange())
+             << ") conflicts with function " << *BF << '\n';
+      continue;
+    }
+
+    if (opts::Verbosity >= 1)
+      errs() << "BOLT-WARNING: FDE [0x" << Twine::utohexstr(Address) << ", 0x"
+             << Twine::utohexstr(Address + FDE->getAddressRange())
+             << ") has no corresponding symbol table entry\n";
+
+    ErrorOr<BinarySection &> Section = BC->getSectionForAddress(Address);
+    assert(Section && "cannot get section for address from FDE");
+    std::string FunctionName =
+        "__BOLT_FDE_FUNCat" + Twine::utohexstr(Address).str();
+    BC->createBinaryFunction(FunctionName, *Section, Address,
+                             FDE->getAddressRange());
+  }
+
+  BC->setHasSymbolsWithFileName(SeenFileName);
+
+  // Now that all the functions were created - adjust their boundaries.
+  adjustFunctionBoundaries();
+
+  // Annotate functions with code/data markers in AArch64
+  for (const std::pair<uint64_t, SymbolRef> &Marker : MarkerSymbols) {
+    const SymbolRef &Symbol = Marker.second;
+    const uint64_t Address = Marker.first;
+    uint64_t SymbolSize = ELFSymbolRef(Symbol).getSize();
+    BinaryFunction *BF =
+        BC->getBinaryFunctionContainingAddress(Address, true, true);
+    if (!BF) {
+      // Stray marker
+      continue;
+    }
+    const uint64_t EntryOffset = Address - BF->getAddress();
+    if (BF->isCodeMarker(Symbol, SymbolSize)) {
+      BF->markCodeAtOffset(EntryOffset);
+      continue;
+    }
+    if (BF->isDataMarker(Symbol, SymbolSize)) {
+      BF->markDataAtOffset(EntryOffset);
+      BC->AddressToConstantIslandMap[Address] = BF;
+      continue;
+    }
+    llvm_unreachable("Unknown marker");
+  }
+
+  if (opts::LinuxKernelMode) {
+    // Read all special linux kernel sections and their relocations
+    processLKSections();
+  } else {
+    // Read all relocations now that we have binary functions mapped.
+    processRelocations();
+  }
+}
+
+void RewriteInstance::discoverSymbolTableObjects(
+    std::vector<std::pair<uint64_t, SymbolRef>> &MarkerSymbols,
+    std::vector<std::pair<uint64_t, uint64_t>> &SecondaryEntryPoints,
+    bool &SeenFileName) {
   // For local symbols we want to keep track of associated FILE symbol name for
   // disambiguation by combined name.
   StringRef FileSymbolName;
-  bool SeenFileName = false;
-  struct SymbolRefHash {
-    size_t operator()(SymbolRef const &S) const {
-      return std::hash<decltype(DataRefImpl::p)>{}(S.getRawDataRefImpl().p);
-    }
+
+  // Compact per-symbol record built in a single streaming pass over the
+  // symbol table. Only the fields needed for sorting and filtering are
+  // materialized; names stay in the memory-mapped string table until the
+  // second pass turns a symbol into a function or data object.
+  const uint32_t NoFileName = std::numeric_limits<uint32_t>::max();
+  struct SymbolInfo {
+    uint64_t Address;
+    DataRefImpl Impl;       // Handle into the input symbol table.
+    uint32_t FileNameIndex; // FILE symbol used for local name disambiguation.
+    uint8_t Type;           // Cached SymbolRef::Type.
+    bool IsMarker;          // AArch64 mapping symbol ($x/$d).
   };
-  std::unordered_map<SymbolRef, StringRef, SymbolRefHash> SymbolToFileName;
+  std::vector<SymbolInfo> FileSymbols;
+  std::vector<StringRef> FileSymbolNames;
+
   for (const ELFSymbolRef &Symbol : InputFile->symbols()) {
     Expected<StringRef> NameOrError = Symbol.getName();
     if (NameOrError && NameOrError->startswith("__asan_init")) {
@@ -823,94 +1259,90 @@ void RewriteInstance::discoverFileObjects() {
       exit(1);
     }
 
-    if (cantFail(Symbol.getFlags()) & SymbolRef::SF_Undefined)
-      continue;
+    const uint32_t SymbolFlags = cantFail(Symbol.getFlags());
+    const SymbolRef::Type SymbolType = cantFail(Symbol.getType());
 
-    if (cantFail(Symbol.getType()) == SymbolRef::ST_File) {
-      StringRef Name =
-          cantFail(std::move(NameOrError), "cannot get symbol name for file");
-      // Ignore Clang LTO artificial FILE symbol as it is not always generated,
-      // and this uncertainty is causing havoc in function name matching.
-      if (Name == "ld-temp.o")
+    uint32_t FileNameIndex = NoFileName;
+    if (!(SymbolFlags & SymbolRef::SF_Undefined)) {
+      if (SymbolType == SymbolRef::ST_File) {
+        StringRef Name =
+            cantFail(std::move(NameOrError), "cannot get symbol name for file");
+        // Ignore Clang LTO artificial FILE symbol as it is not always
+        // generated, and this uncertainty is causing havoc in function name
+        // matching.
+        if (Name == "ld-temp.o")
+          continue;
+        FileSymbolName = Name;
+        SeenFileName = true;
         continue;
-      FileSymbolName = Name;
-      SeenFileName = true;
+      }
+      if (!FileSymbolName.empty() && !(SymbolFlags & SymbolRef::SF_Global)) {
+        if (FileSymbolNames.empty() || FileSymbolNames.back() != FileSymbolName)
+          FileSymbolNames.push_back(FileSymbolName);
+        FileNameIndex = FileSymbolNames.size() - 1;
+      }
+    }
+
+    // Ignore symbols that are not in memory, i.e. keep symbols from
+    // allocatable sections and absolute symbols.
+    bool InMemory;
+    if (SymbolFlags & SymbolRef::SF_Absolute)
+      InMemory = true;
+    else if (SymbolFlags & SymbolRef::SF_Undefined)
+      InMemory = false;
+    else
+      InMemory = BinarySection(*BC, *cantFail(Symbol.getSection())).isAllocatable();
+    if (!InMemory)
       continue;
+
+    // For aarch64, the ABI defines mapping symbols so we identify data in the
+    // code section (see IHI0056B). $d identifies data contents.
+    bool IsMarker = false;
+    if (BC->isAArch64() && SymbolType == SymbolRef::ST_Unknown && NameOrError) {
+      StringRef Name = *NameOrError;
+      IsMarker = Name == "$d" || Name.startswith("$d.") || Name == "$x" ||
+                 Name.startswith("$x.");
     }
-    if (!FileSymbolName.empty() &&
-        !(cantFail(Symbol.getFlags()) & SymbolRef::SF_Global))
-      SymbolToFileName[Symbol] = FileSymbolName;
+
+    FileSymbols.push_back({cantFail(Symbol.getAddress()),
+                           Symbol.getRawDataRefImpl(), FileNameIndex,
+                           static_cast<uint8_t>(SymbolType), IsMarker});
   }
 
-  // Sort symbols in the file by value. Ignore symbols from non-allocatable
-  // sections.
-  auto isSymbolInMemory = [this](const SymbolRef &Sym) {
-    if (cantFail(Sym.getType()) == SymbolRef::ST_File)
-      return false;
-    if (cantFail(Sym.getFlags()) & SymbolRef::SF_Absolute)
-      return true;
-    if (cantFail(Sym.getFlags()) & SymbolRef::SF_Undefined)
-      return false;
-    BinarySection Section(*BC, *cantFail(Sym.getSection()));
-    return Section.isAllocatable();
+  // Sort the compact records by address. At the same address FUNC symbols
+  // have the highest precedence, while SECTIONs have the lowest.
+  auto typePrecedence = [](uint8_t Type) {
+    if (Type == SymbolRef::ST_Function)
+      return 0;
+    if (Type == SymbolRef::ST_Debug)
+      return 2;
+    return 1;
   };
-  std::vector<SymbolRef> SortedFileSymbols;
-  std::copy_if(InputFile->symbol_begin(), InputFile->symbol_end(),
-               std::back_inserter(SortedFileSymbols), isSymbolInMemory);
-
-  std::stable_sort(
-      SortedFileSymbols.begin(), SortedFileSymbols.end(),
-      [](const SymbolRef &A, const SymbolRef &B) {
-        // FUNC symbols have the highest precedence, while SECTIONs
-        // have the lowest.
-        uint64_t AddressA = cantFail(A.getAddress());
-        uint64_t AddressB = cantFail(B.getAddress());
-        if (AddressA != AddressB)
-          return AddressA < AddressB;
-
-        SymbolRef::Type AType = cantFail(A.getType());
-        SymbolRef::Type BType = cantFail(B.getType());
-        if (AType == SymbolRef::ST_Function && BType != SymbolRef::ST_Function)
-          return true;
-        if (BType == SymbolRef::ST_Debug && AType != SymbolRef::ST_Debug)
-          return true;
-
-        return false;
-      });
+  std::stable_sort(FileSymbols.begin(), FileSymbols.end(),
+                   [&](const SymbolInfo &A, const SymbolInfo &B) {
+                     if (A.Address != B.Address)
+                       return A.Address < B.Address;
+                     return typePrecedence(A.Type) < typePrecedence(B.Type);
+                   });
 
-  // For aarch64, the ABI defines mapping symbols so we identify data in the
-  // code section (see IHI0056B). $d identifies data contents.
-  auto LastSymbol = SortedFileSymbols.end() - 1;
-  if (BC->isAArch64()) {
-    LastSymbol = std::stable_partition(
-        SortedFileSymbols.begin(), SortedFileSymbols.end(),
-        [](const SymbolRef &Symbol) {
-          StringRef Name = cantFail(Symbol.getName());
-          return !(cantFail(Symbol.getType()) == SymbolRef::ST_Unknown &&
-                   (Name == "$d" || Name.startswith("$d.") || Name == "$x" ||
-                    Name.startswith("$x.")));
-        });
-    --LastSymbol;
-  }
+  // Move the AArch64 mapping symbols after all other symbols.
+  auto MarkersBegin = FileSymbols.end();
+  if (BC->isAArch64())
+    MarkersBegin =
+        std::stable_partition(FileSymbols.begin(), FileSymbols.end(),
+                              [](const SymbolInfo &SI) { return !SI.IsMarker; });
 
   BinaryFunction *PreviousFunction = nullptr;
   unsigned AnonymousId = 0;
 
-  const auto MarkersBegin = std::next(LastSymbol);
-  for (auto ISym = SortedFileSymbols.begin(); ISym != MarkersBegin; ++ISym) {
-    const SymbolRef &Symbol = *ISym;
-    // Keep undefined symbols for pretty printing?
-    if (cantFail(Symbol.getFlags()) & SymbolRef::SF_Undefined)
-      continue;
-
-    const SymbolRef::Type SymbolType = cantFail(Symbol.getType());
-
-    if (SymbolType == SymbolRef::ST_File)
-      continue;
+  for (auto ISym = FileSymbols.begin(); ISym != MarkersBegin; ++ISym) {
+    const SymbolInfo &SymInfo = *ISym;
+    const SymbolRef Symbol(SymInfo.Impl, InputFile);
+    const uint64_t Address = SymInfo.Address;
+    const SymbolRef::Type SymbolType =
+        static_cast<SymbolRef::Type>(SymInfo.Type);
 
     StringRef SymName = cantFail(Symbol.getName(), "cannot get symbol name");
-    uint64_t Address =
-        cantFail(Symbol.getAddress(), "cannot get symbol address");
     if (Address == 0) {
       if (opts::Verbosity >= 1 && SymbolType == SymbolRef::ST_Function)
         errs() << "BOLT-WARNING: function with 0 address seen\n";
@@ -924,7 +1356,7 @@ void RewriteInstance::discoverFileObjects() {
     FileSymRefs[Address] = Symbol;
 
     // Skip section symbols that will be registered by disassemblePLT().
-    if ((cantFail(Symbol.getType()) == SymbolRef::ST_Debug)) {
+    if (SymbolType == SymbolRef::ST_Debug) {
       ErrorOr<BinarySection &> BSection = BC->getSectionForAddress(Address);
       if (BSection && getPLTSectionInfo(BSection->getName()))
         continue;
@@ -963,9 +1395,10 @@ void RewriteInstance::discoverFileObjects() {
       // could be identical function names coming from identical file names
       // (e.g. from different directories).
       std::string AltPrefix;
-      auto SFI = SymbolToFileName.find(Symbol);
-      if (SymbolType == SymbolRef::ST_Function && SFI != SymbolToFileName.end())
-        AltPrefix = Name + "/" + std::string(SFI->second);
+      if (SymbolType == SymbolRef::ST_Function &&
+          SymInfo.FileNameIndex != NoFileName)
+        AltPrefix =
+            Name + "/" + std::string(FileSymbolNames[SymInfo.FileNameIndex]);
 
       UniqueName = NR.uniquify(Name);
       if (!AltPrefix.empty())
@@ -1050,6 +1483,8 @@ void RewriteInstance::discoverFileObjects() {
 
         PreviousFunction->addEntryPointAtOffset(Address -
                                                 PreviousFunction->getAddress());
+        SecondaryEntryPoints.emplace_back(PreviousFunction->getAddress(),
+                                          Address);
 
         // Remove the symbol from FileSymRefs so that we can skip it from
         // in the future.
@@ -1147,81 +1582,236 @@ void RewriteInstance::discoverFileObjects() {
     PreviousFunction = BF;
   }
 
-  // Read dynamic relocation first as their presence affects the way we process
-  // static relocations. E.g. we will ignore a static relocation at an address
-  // that is a subject to dynamic relocation processing.
-  processDynamicRelocations();
+  // Keep the mapping symbols for the caller to process once function
+  // boundaries are known.
+  for (auto ISym = MarkersBegin; ISym != FileSymbols.end(); ++ISym)
+    MarkerSymbols.emplace_back(ISym->Address, SymbolRef(ISym->Impl, InputFile));
+}
 
-  // Process PLT section.
-  if (BC->TheTriple->getArch() == Triple::x86_64)
-    disassemblePLT();
+namespace {
+/// Magic bytes and version of the discovery snapshot file format.
+constexpr StringLiteral DiscoverySnapshotMagic("BOLTSNAP");
+constexpr uint64_t DiscoverySnapshotVersion = 1;
+} // anonymous namespace
 
-  // See if we missed any functions marked by FDE.
-  for (const auto &FDEI : CFIRdWrt->getFDEs()) {
-    const uint64_t Address = FDEI.first;
-    const dwarf::FDE *FDE = FDEI.second;
-    const BinaryFunction *BF = BC->getBinaryFunctionAtAddress(Address);
-    if (BF)
-      continue;
+void RewriteInstance::writeDiscoverySnapshot(
+    StringRef FileName,
+    ArrayRef<std::pair<uint64_t, uint64_t>> SecondaryEntryPoints,
+    bool SeenFileName) {
+  // Mapping symbol annotations are not captured by the snapshot, and Linux
+  // kernel mode has its own special section processing.
+  if (BC->isAArch64() || opts::LinuxKernelMode) {
+    errs() << "BOLT-WARNING: discovery snapshots are not supported for this "
+              "input. Skipping snapshot write.\n";
+    return;
+  }
 
-    BF = BC->getBinaryFunctionContainingAddress(Address);
-    if (BF) {
-      errs() << "BOLT-WARNING: FDE [0x" << Twine::utohexstr(Address) << ", 0x"
-             << Twine::utohexstr(Address + FDE->getAddressRange())
-             << ") conflicts with function " << *BF << '\n';
-      continue;
-    }
+  // Write to a unique temporary and move it in place at the end, so parallel
+  // runs sharing a checkpoint directory never observe a torn snapshot.
+  int FD;
+  SmallString<128> TmpPath;
+  if (std::error_code EC = sys::fs::createUniqueFile(
+          FileName + ".tmp%%%%%%", FD, TmpPath)) {
+    errs() << "BOLT-WARNING: cannot write discovery snapshot to " << FileName
+           << ": " << EC.message() << '\n';
+    return;
+  }
+  raw_fd_ostream OS(FD, /*shouldClose=*/true);
 
-    if (opts::Verbosity >= 1)
-      errs() << "BOLT-WARNING: FDE [0x" << Twine::utohexstr(Address) << ", 0x"
-             << Twine::utohexstr(Address + FDE->getAddressRange())
-             << ") has no corresponding symbol table entry\n";
+  auto emitString = [&OS](StringRef Str) {
+    encodeULEB128(Str.size(), OS);
+    OS << Str;
+  };
 
-    ErrorOr<BinarySection &> Section = BC->getSectionForAddress(Address);
-    assert(Section && "cannot get section for address from FDE");
-    std::string FunctionName =
-        "__BOLT_FDE_FUNCat" + Twine::utohexstr(Address).str();
-    BC->createBinaryFunction(FunctionName, *Section, Address,
-                             FDE->getAddressRange());
+  OS << DiscoverySnapshotMagic;
+  encodeULEB128(DiscoverySnapshotVersion, OS);
+  emitString(BC->getFileBuildID() ? *BC->getFileBuildID() : StringRef());
+  encodeULEB128(InputFile->getData().size(), OS);
+  encodeULEB128(SeenFileName, OS);
+
+  // All named objects with the complete list of their names: replaying the
+  // registrations reconstructs BinaryData objects, their nesting, and the
+  // global symbol table.
+  uint64_t NumObjects = 0;
+  for (const auto &AddressEntry : BC->getBinaryData()) {
+    (void)AddressEntry;
+    ++NumObjects;
+  }
+  encodeULEB128(NumObjects, OS);
+  for (const auto &AddressEntry : BC->getBinaryData()) {
+    const BinaryData *BD = AddressEntry.second;
+    encodeULEB128(BD->getAddress(), OS);
+    encodeULEB128(BD->getSize(), OS);
+    encodeULEB128(BD->getAlignment(), OS);
+    encodeULEB128(BD->getFlags(), OS);
+    encodeULEB128(BD->getSymbols().size(), OS);
+    for (const MCSymbol *Symbol : BD->getSymbols())
+      emitString(Symbol->getName());
+  }
+
+  // Functions with their alternative names.
+  encodeULEB128(BC->getBinaryFunctions().size(), OS);
+  for (const auto &BFI : BC->getBinaryFunctions()) {
+    const BinaryFunction &Function = BFI.second;
+    encodeULEB128(Function.getAddress(), OS);
+    encodeULEB128(Function.getSize(), OS);
+    encodeULEB128(Function.isSimple(), OS);
+    const std::vector<StringRef> Names = Function.getNames();
+    encodeULEB128(Names.size(), OS);
+    for (StringRef Name : Names)
+      emitString(Name);
+  }
+
+  encodeULEB128(SecondaryEntryPoints.size(), OS);
+  for (const std::pair<uint64_t, uint64_t> &EntryPoint : SecondaryEntryPoints) {
+    encodeULEB128(EntryPoint.first, OS);
+    encodeULEB128(EntryPoint.second, OS);
+  }
+
+  // References into the input symbol table used for function boundary
+  // adjustment. The raw libObject handles are deterministic for a fixed
+  // input file.
+  encodeULEB128(FileSymRefs.size(), OS);
+  for (const std::pair<const uint64_t, SymbolRef> &SymRef : FileSymRefs) {
+    encodeULEB128(SymRef.first, OS);
+    const DataRefImpl Impl = SymRef.second.getRawDataRefImpl();
+    encodeULEB128(Impl.d.a, OS);
+    encodeULEB128(Impl.d.b, OS);
+  }
+
+  OS.close();
+  if (std::error_code EC = sys::fs::rename(TmpPath, FileName)) {
+    errs() << "BOLT-WARNING: cannot write discovery snapshot to " << FileName
+           << ": " << EC.message() << '\n';
+    sys::fs::remove(TmpPath);
+    return;
   }
 
-  BC->setHasSymbolsWithFileName(SeenFileName);
+  outs() << "BOLT-INFO: wrote discovery snapshot to " << FileName << '\n';
+}
 
-  // Now that all the functions were created - adjust their boundaries.
-  adjustFunctionBoundaries();
+bool RewriteInstance::loadDiscoverySnapshot(StringRef FileName,
+                                            bool &SeenFileName) {
+  Error Err = Error::success();
+  auto failWith = [&](const Twine &Message) {
+    errs() << "BOLT-WARNING: cannot use discovery snapshot " << FileName
+           << ": " << Message << ". Running full discovery.\n";
+    consumeError(std::move(Err));
+    FileSymRefs.clear();
+    BC->getBinaryFunctions().clear();
+    BC->clearBinaryData();
+    return false;
+  };
 
-  // Annotate functions with code/data markers in AArch64
-  for (auto ISym = MarkersBegin; ISym != SortedFileSymbols.end(); ++ISym) {
-    const SymbolRef &Symbol = *ISym;
-    uint64_t Address =
-        cantFail(Symbol.getAddress(), "cannot get symbol address");
-    uint64_t SymbolSize = ELFSymbolRef(Symbol).getSize();
-    BinaryFunction *BF =
-        BC->getBinaryFunctionContainingAddress(Address, true, true);
-    if (!BF) {
-      // Stray marker
-      continue;
-    }
-    const uint64_t EntryOffset = Address - BF->getAddress();
-    if (BF->isCodeMarker(Symbol, SymbolSize)) {
-      BF->markCodeAtOffset(EntryOffset);
-      continue;
-    }
-    if (BF->isDataMarker(Symbol, SymbolSize)) {
-      BF->markDataAtOffset(EntryOffset);
-      BC->AddressToConstantIslandMap[Address] = BF;
-      continue;
+  if (BC->isAArch64() || opts::LinuxKernelMode)
+    return failWith("unsupported input");
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufferOrErr =
+      MemoryBuffer::getFile(FileName);
+  if (!BufferOrErr)
+    return failWith(BufferOrErr.getError().message());
+  const StringRef Buffer = (*BufferOrErr)->getBuffer();
+
+  if (!Buffer.startswith(DiscoverySnapshotMagic))
+    return failWith("bad magic");
+
+  DataExtractor DE(Buffer, /*IsLittleEndian=*/true, /*AddressSize=*/8);
+  uint64_t Offset = DiscoverySnapshotMagic.size();
+  auto readULEB = [&]() { return DE.getULEB128(&Offset, &Err); };
+  auto readString = [&]() {
+    const uint64_t Size = readULEB();
+    const StringRef Str = Buffer.substr(Offset, Size);
+    Offset = std::min<uint64_t>(Offset + Size, Buffer.size());
+    return Str;
+  };
+
+  if (readULEB() != DiscoverySnapshotVersion)
+    return failWith("version mismatch");
+  const StringRef BuildID =
+      BC->getFileBuildID() ? *BC->getFileBuildID() : StringRef();
+  if (readString() != BuildID)
+    return failWith("build-id mismatch");
+  if (readULEB() != InputFile->getData().size())
+    return failWith("input size mismatch");
+  SeenFileName = static_cast<bool>(readULEB());
+
+  // Replay name registrations.
+  const uint64_t NumObjects = readULEB();
+  if (NumObjects > Buffer.size())
+    return failWith("corrupt object table");
+  for (uint64_t I = 0; I < NumObjects && !Err; ++I) {
+    const uint64_t Address = readULEB();
+    const uint64_t Size = readULEB();
+    const uint16_t Alignment = readULEB();
+    const unsigned Flags = readULEB();
+    const uint64_t NumNames = readULEB();
+    if (NumNames > Buffer.size())
+      return failWith("corrupt object record");
+    for (uint64_t J = 0; J < NumNames && !Err; ++J) {
+      const StringRef Name = readString();
+      // Seed the deduplicator so that names created after the replay do not
+      // clash with the loaded ones.
+      NR.reserve(Name);
+      BC->registerNameAtAddress(Name, Address, Size, Alignment, Flags);
     }
-    llvm_unreachable("Unknown marker");
   }
 
-  if (opts::LinuxKernelMode) {
-    // Read all special linux kernel sections and their relocations
-    processLKSections();
-  } else {
-    // Read all relocations now that we have binary functions mapped.
-    processRelocations();
-  }
+  // Replay function creation.
+  const uint64_t NumFunctions = readULEB();
+  if (NumFunctions > Buffer.size())
+    return failWith("corrupt function table");
+  for (uint64_t I = 0; I < NumFunctions && !Err; ++I) {
+    const uint64_t Address = readULEB();
+    const uint64_t Size = readULEB();
+    const bool IsSimple = readULEB();
+    const uint64_t NumNames = readULEB();
+    if (!NumNames || NumNames > Buffer.size())
+      return failWith("corrupt function record");
+    const StringRef PrimaryName = readString();
+    ErrorOr<BinarySection &> Section = BC->getSectionForAddress(Address);
+    if (!Section)
+      return failWith("no section for function address");
+    BinaryFunction *BF = BC->createBinaryFunction(std::string(PrimaryName),
+                                                  *Section, Address, Size);
+    if (!IsSimple)
+      BF->setSimple(false);
+    for (uint64_t J = 1; J < NumNames && !Err; ++J)
+      BF->addAlternativeName(std::string(readString()));
+  }
+
+  const uint64_t NumEntryPoints = readULEB();
+  if (NumEntryPoints > Buffer.size())
+    return failWith("corrupt entry point table");
+  for (uint64_t I = 0; I < NumEntryPoints && !Err; ++I) {
+    const uint64_t FunctionAddress = readULEB();
+    const uint64_t EntryAddress = readULEB();
+    auto BFI = BC->getBinaryFunctions().find(FunctionAddress);
+    if (BFI == BC->getBinaryFunctions().end())
+      return failWith("entry point for unknown function");
+    BFI->second.addEntryPointAtOffset(EntryAddress - FunctionAddress);
+  }
+
+  const uint64_t NumSymRefs = readULEB();
+  if (NumSymRefs > Buffer.size())
+    return failWith("corrupt symbol reference table");
+  for (uint64_t I = 0; I < NumSymRefs && !Err; ++I) {
+    const uint64_t Address = readULEB();
+    DataRefImpl Impl;
+    Impl.d.a = readULEB();
+    Impl.d.b = readULEB();
+    FileSymRefs.emplace(Address, SymbolRef(Impl, InputFile));
+  }
+
+  if (Err) {
+    const std::string Message = toString(std::move(Err));
+    return failWith(Message);
+  }
+  if (Offset != Buffer.size())
+    return failWith("trailing data");
+
+  outs() << "BOLT-INFO: replayed discovery snapshot for "
+         << BC->getBinaryFunctions().size() << " functions\n";
+  return true;
 }
 
 void RewriteInstance::disassemblePLT() {
@@ -1429,7 +2019,8 @@ void RewriteInstance::relocateEHFrameSection() {
     EHFrameSection->addRelocation(Offset, nullptr, RelType, Value);
   };
 
-  Error E = EHFrameParser::parse(DE, EHFrameSection->getAddress(), createReloc);
+  Error E = EHFrameParser::parseParallel(DE, EHFrameSection->getAddress(),
+                                         createReloc);
   check_error(std::move(E), "failed to patch EH frame");
 }
 
@@ -1444,36 +2035,15 @@ void RewriteInstance::readSpecialSections() {
   NamedRegionTimer T("readSpecialSections", "read special sections",
                      TimerGroupName, TimerGroupDesc, opts::TimeRewrite);
 
-  bool HasTextRelocations = false;
-  bool HasDebugInfo = false;
-
-  // Process special sections.
-  for (const SectionRef &Section : InputFile->sections()) {
-    Expected<StringRef> SectionNameOrErr = Section.getName();
-    check_error(SectionNameOrErr.takeError(), "cannot get section name");
-    StringRef SectionName = *SectionNameOrErr;
-
-    // Only register sections with names.
-    if (!SectionName.empty()) {
-      BC->registerSection(Section);
-      LLVM_DEBUG(
-          dbgs() << "BOLT-DEBUG: registering section " << SectionName << " @ 0x"
-                 << Twine::utohexstr(Section.getAddress()) << ":0x"
-                 << Twine::utohexstr(Section.getAddress() + Section.getSize())
-                 << "\n");
-      if (isDebugSection(SectionName))
-        HasDebugInfo = true;
-      if (isKSymtabSection(SectionName))
-        opts::LinuxKernelMode = true;
-    }
-  }
-
-  if (HasDebugInfo && !opts::UpdateDebugSections && !opts::AggregateOnly) {
+  // The input sections were registered and classified during the single
+  // section table scan in discoverStorage().
+  if (InputHasDebugInfo && !opts::UpdateDebugSections && !opts::AggregateOnly) {
     errs() << "BOLT-WARNING: debug info will be stripped from the binary. "
               "Use -update-debug-sections to keep it.\n";
   }
 
-  HasTextRelocations = (bool)BC->getUniqueSectionByName(".rela.text");
+  const bool HasTextRelocations =
+      (bool)BC->getUniqueSectionByName(".rela.text");
   LSDASection = BC->getUniqueSectionByName(".gcc_except_table");
   EHFrameSection = BC->getUniqueSectionByName(".eh_frame");
   GOTPLTSection = BC->getUniqueSectionByName(".got.plt");
@@ -1581,6 +2151,11 @@ void RewriteInstance::adjustCommandLineOptions() {
     opts::StrictMode = false;
   }
 
+  if (opts::DryRun && !opts::DynoStatsAll.getNumOccurrences()) {
+    outs() << "BOLT-INFO: enabling -dyno-stats-all for the dry-run report\n";
+    opts::DynoStatsAll = true;
+  }
+
   if (BC->HasRelocations && opts::AggregateOnly &&
       !opts::StrictMode.getNumOccurrences()) {
     outs() << "BOLT-INFO: enabling strict relocation mode for aggregation "
@@ -1629,10 +2204,23 @@ void RewriteInstance::adjustCommandLineOptions() {
   if (!opts::AlignText.getNumOccurrences())
     opts::AlignText = BC->PageAlign;
 
+  if (opts::DeferredCFG && opts::processAllFunctions()) {
+    errs() << "BOLT-WARNING: disabling -deferred-cfg as all functions have to "
+              "be processed in the current mode\n";
+    opts::DeferredCFG = false;
+  }
+
   if (BC->isX86() && opts::Lite.getNumOccurrences() == 0 && !opts::StrictMode &&
-      !opts::UseOldText)
+      !opts::UseOldText && !opts::DeferredCFG)
     opts::Lite = true;
 
+  if (opts::LiteCoveragePct > 0 && opts::Lite.getNumOccurrences() == 0)
+    opts::Lite = true;
+
+  if (opts::DeferredCFG && opts::Lite)
+    errs() << "BOLT-WARNING: -deferred-cfg has no effect on functions that are "
+              "skipped in lite mode\n";
+
   if (opts::Lite && opts::UseOldText) {
     errs() << "BOLT-WARNING: cannot combine -lite with -use-old-text. "
               "Disabling -use-old-text.\n";
@@ -1653,6 +2241,32 @@ void RewriteInstance::adjustCommandLineOptions() {
               "profile.\n";
     exit(1);
   }
+
+  // Wire the restartable state caches to the checkpoint directory unless the
+  // corresponding options point elsewhere explicitly. The discovery snapshot
+  // is only read when a previous run persisted one.
+  if (!opts::CheckpointDir.empty()) {
+    if (std::error_code EC = sys::fs::create_directories(opts::CheckpointDir)) {
+      errs() << "BOLT-WARNING: cannot create checkpoint directory "
+             << opts::CheckpointDir << ": " << EC.message()
+             << ". Continuing without checkpointing.\n";
+    } else {
+      if (!BC->isAArch64() && !opts::LinuxKernelMode) {
+        SmallString<256> SnapshotPath(opts::CheckpointDir);
+        sys::path::append(SnapshotPath, "discovery.snapshot");
+        if (opts::WriteDiscoverySnapshot.empty())
+          opts::WriteDiscoverySnapshot = std::string(SnapshotPath);
+        if (opts::ReadDiscoverySnapshot.empty() &&
+            sys::fs::exists(SnapshotPath))
+          opts::ReadDiscoverySnapshot = std::string(SnapshotPath);
+      }
+      if (opts::ProfileMatchCacheFile.empty()) {
+        SmallString<256> CachePath(opts::CheckpointDir);
+        sys::path::append(CachePath, "profile-match.cache");
+        opts::ProfileMatchCacheFile = std::string(CachePath);
+      }
+    }
+  }
 }
 
 namespace {
@@ -1719,10 +2333,11 @@ bool RewriteInstance::analyzeRelocation(
   bool SkipVerification = false;
   auto SymbolIter = Rel.getSymbol();
   if (SymbolIter == InputFile->symbol_end()) {
+    // The relocation does not reference a symbol. Leave the name empty and
+    // let the caller register a symbol at the target address: creating it
+    // here is not an option since the analysis can run on multiple threads.
     SymbolAddress = ExtractedValue - Addend + PCRelOffset;
-    MCSymbol *RelSymbol =
-        BC->getOrCreateGlobalSymbol(SymbolAddress, "RELSYMat");
-    SymbolName = std::string(RelSymbol->getName());
+    SymbolName.clear();
     IsSectionRelocation = false;
   } else {
     const SymbolRef &Symbol = *SymbolIter;
@@ -2161,61 +2776,111 @@ void RewriteInstance::readRelocations(const SectionRef &Section) {
       dbgs() << BC->getSectionForAddress(Rel.getOffset())->getName() << "\n";
   };
 
-  for (const RelocationRef &Rel : Section.relocations()) {
-    SmallString<16> TypeName;
-    Rel.getTypeName(TypeName);
-    uint64_t RType = Rel.getType();
-    if (Relocation::isNone(RType))
-      continue;
+  // Relocation contents produced by the analysis phase. The analysis only
+  // reads previously constructed address maps and hence can run on multiple
+  // threads, while the processing phase registers symbols and references and
+  // has to run sequentially.
+  struct RelocationAnalysis {
+    uint64_t RType{0};
+    std::string SymbolName;
+    uint64_t SymbolAddress{0};
+    int64_t Addend{0};
+    uint64_t ExtractedValue{0};
+    bool IsSectionRelocation{false};
+    bool ConvertedRelocBit{false};
+    bool Ignored{false};
+    bool Failed{false};
+    bool Skip{false};
+  };
 
-    // Adjust the relocation type as the linker might have skewed it.
-    if (BC->isX86() && (RType & ELF::R_X86_64_converted_reloc_bit)) {
-      if (opts::Verbosity >= 1)
-        dbgs() << "BOLT-WARNING: ignoring R_X86_64_converted_reloc_bit\n";
-      RType &= ~ELF::R_X86_64_converted_reloc_bit;
-    }
+  std::vector<RelocationRef> SectionRelocations(Section.relocations().begin(),
+                                                Section.relocations().end());
+  std::vector<RelocationAnalysis> Records;
+  size_t BatchBegin = 0;
 
-    if (Relocation::isTLS(RType)) {
-      // No special handling required for TLS relocations on X86.
-      if (BC->isX86())
+  auto analyzeChunk = [&](size_t Begin, size_t End) {
+    for (size_t I = Begin; I != End; ++I) {
+      const RelocationRef &Rel = SectionRelocations[I];
+      RelocationAnalysis &RA = Records[I - BatchBegin];
+
+      RA.RType = Rel.getType();
+      if (Relocation::isNone(RA.RType)) {
+        RA.Ignored = true;
         continue;
+      }
 
-      // The non-got related TLS relocations on AArch64 also could be skipped.
-      if (!Relocation::isGOT(RType))
+      // Adjust the relocation type as the linker might have skewed it.
+      if (BC->isX86() && (RA.RType & ELF::R_X86_64_converted_reloc_bit)) {
+        RA.ConvertedRelocBit = true;
+        RA.RType &= ~ELF::R_X86_64_converted_reloc_bit;
+      }
+
+      if (Relocation::isTLS(RA.RType)) {
+        // No special handling required for TLS relocations on X86. The
+        // non-got related TLS relocations on AArch64 also could be skipped.
+        if (BC->isX86() || !Relocation::isGOT(RA.RType)) {
+          RA.Ignored = true;
+          continue;
+        }
+      }
+
+      if (BC->getDynamicRelocationAt(Rel.getOffset())) {
+        LLVM_DEBUG(
+            dbgs() << "BOLT-DEBUG: address 0x"
+                   << Twine::utohexstr(Rel.getOffset())
+                   << " has a dynamic relocation against it. Ignoring static "
+                      "relocation.\n");
+        RA.Ignored = true;
         continue;
-    }
+      }
 
-    if (BC->getDynamicRelocationAt(Rel.getOffset())) {
-      LLVM_DEBUG(
-          dbgs() << "BOLT-DEBUG: address 0x"
-                 << Twine::utohexstr(Rel.getOffset())
-                 << " has a dynamic relocation against it. Ignoring static "
-                    "relocation.\n");
-      continue;
+      RA.Failed = !analyzeRelocation(Rel, RA.RType, RA.SymbolName,
+                                     RA.IsSectionRelocation, RA.SymbolAddress,
+                                     RA.Addend, RA.ExtractedValue, RA.Skip);
     }
+  };
 
-    std::string SymbolName;
-    uint64_t SymbolAddress;
-    int64_t Addend;
-    uint64_t ExtractedValue;
-    bool IsSectionRelocation;
-    bool Skip;
-    if (!analyzeRelocation(Rel, RType, SymbolName, IsSectionRelocation,
-                           SymbolAddress, Addend, ExtractedValue, Skip)) {
-      LLVM_DEBUG(dbgs() << "BOLT-WARNING: failed to analyze relocation @ "
-                        << "offset = 0x" << Twine::utohexstr(Rel.getOffset())
-                        << "; type name = " << TypeName << '\n');
+  auto processRelocation = [&](const RelocationRef &Rel,
+                               RelocationAnalysis &RA) {
+    if (RA.ConvertedRelocBit && opts::Verbosity >= 1)
+      dbgs() << "BOLT-WARNING: ignoring R_X86_64_converted_reloc_bit\n";
+
+    uint64_t RType = RA.RType;
+    std::string SymbolName = std::move(RA.SymbolName);
+    uint64_t SymbolAddress = RA.SymbolAddress;
+    int64_t Addend = RA.Addend;
+    uint64_t ExtractedValue = RA.ExtractedValue;
+    const bool IsSectionRelocation = RA.IsSectionRelocation;
+
+    if (RA.Failed) {
+      LLVM_DEBUG({
+        SmallString<16> TypeName;
+        Rel.getTypeName(TypeName);
+        dbgs() << "BOLT-WARNING: failed to analyze relocation @ "
+               << "offset = 0x" << Twine::utohexstr(Rel.getOffset())
+               << "; type name = " << TypeName << '\n';
+      });
       ++NumFailedRelocations;
-      continue;
+      return;
     }
 
-    if (Skip) {
-      LLVM_DEBUG(dbgs() << "BOLT-DEBUG: skipping relocation @ offset = 0x"
-                        << Twine::utohexstr(Rel.getOffset())
-                        << "; type name = " << TypeName << '\n');
-      continue;
+    if (RA.Skip) {
+      LLVM_DEBUG({
+        SmallString<16> TypeName;
+        Rel.getTypeName(TypeName);
+        dbgs() << "BOLT-DEBUG: skipping relocation @ offset = 0x"
+               << Twine::utohexstr(Rel.getOffset())
+               << "; type name = " << TypeName << '\n';
+      });
+      return;
     }
 
+    // The relocation did not reference a symbol. Register one at the target
+    // address.
+    if (SymbolName.empty() && !IsSectionRelocation)
+      SymbolName = std::string(
+          BC->getOrCreateGlobalSymbol(SymbolAddress, "RELSYMat")->getName());
+
     const uint64_t Address = SymbolAddress + Addend;
 
     LLVM_DEBUG(dbgs() << "BOLT-DEBUG: "; printRelocationInfo(
@@ -2234,7 +2899,7 @@ void RewriteInstance::readRelocations(const SectionRef &Section) {
                  << " has relocations in padding area\n";
         ContainingBF->setSize(ContainingBF->getMaxSize());
         ContainingBF->setSimple(false);
-        continue;
+        return;
       }
     }
 
@@ -2256,7 +2921,7 @@ void RewriteInstance::readRelocations(const SectionRef &Section) {
           dbgs() << "BOLT-DEBUG: not creating PC-relative relocation at 0x"
                  << Twine::utohexstr(Rel.getOffset()) << " for " << SymbolName
                  << "\n");
-      continue;
+      return;
     }
 
     bool ForceRelocation = BC->forceSymbolRelocations(SymbolName);
@@ -2269,7 +2934,7 @@ void RewriteInstance::readRelocations(const SectionRef &Section) {
       if (!RefSection && !ForceRelocation) {
         LLVM_DEBUG(
             dbgs() << "BOLT-DEBUG: cannot determine referenced section.\n");
-        continue;
+        return;
       }
     }
 
@@ -2330,7 +2995,7 @@ void RewriteInstance::readRelocations(const SectionRef &Section) {
                     "de-virtualization bug: -1 addend used with "
                     "non-pc-relative relocation against function "
                  << *RogueBF << " in function " << *ContainingBF << '\n';
-          continue;
+          return;
         }
       }
     }
@@ -2484,6 +3149,33 @@ void RewriteInstance::readRelocations(const SectionRef &Section) {
       LLVM_DEBUG(
           dbgs() << "BOLT-DEBUG: ignoring relocation from data to data\n");
     }
+  };
+
+  // Analyze relocations in batches to bound the memory used by analysis
+  // records: relocation sections of large relocatable-mode binaries contain
+  // hundreds of millions of entries.
+  constexpr size_t BatchSize = 1UL << 20;
+  const size_t NumRelocations = SectionRelocations.size();
+  for (; BatchBegin < NumRelocations; BatchBegin += BatchSize) {
+    const size_t BatchEnd = std::min(BatchBegin + BatchSize, NumRelocations);
+    Records.assign(BatchEnd - BatchBegin, RelocationAnalysis());
+
+    if (opts::NoThreads) {
+      analyzeChunk(BatchBegin, BatchEnd);
+    } else {
+      ThreadPool &Pool = ParallelUtilities::getThreadPool();
+      const size_t ChunkSize = std::max<size_t>(
+          1, (BatchEnd - BatchBegin) / (opts::ThreadCount * opts::TaskCount));
+      for (size_t I = BatchBegin; I < BatchEnd; I += ChunkSize)
+        Pool.async(analyzeChunk, I, std::min(I + ChunkSize, BatchEnd));
+      Pool.wait();
+    }
+
+    for (size_t I = BatchBegin; I < BatchEnd; ++I) {
+      RelocationAnalysis &RA = Records[I - BatchBegin];
+      if (!RA.Ignored)
+        processRelocation(SectionRelocations[I], RA);
+    }
   }
 }
 
@@ -2502,6 +3194,21 @@ void RewriteInstance::selectFunctionsToProcess() {
   populateFunctionNames(opts::SkipFunctionNamesFile, opts::SkipFunctionNames);
   populateFunctionNames(opts::FunctionNamesFileNR, opts::ForceFunctionNamesNR);
 
+  // Replay mode processes a single function, so every pass preceding the
+  // replayed one reconstructs that function's state in negligible time.
+  if (!opts::ReplayFunction.empty()) {
+    const std::pair<StringRef, StringRef> Parts =
+        StringRef(opts::ReplayFunction).rsplit('@');
+    if (Parts.first.empty() || Parts.second.empty()) {
+      errs() << "BOLT-ERROR: expected <function>@<pass-name> in "
+                "-replay-function\n";
+      exit(1);
+    }
+    opts::ForceFunctionNames.push_back(Parts.first.str());
+    outs() << "BOLT-INFO: replaying function " << Parts.first
+           << " through pass '" << Parts.second << "'\n";
+  }
+
   // Make a set of functions to process to speed up lookups.
   std::unordered_set<std::string> ForceFunctionsNR(
       opts::ForceFunctionNamesNR.begin(), opts::ForceFunctionNamesNR.end());
@@ -2541,6 +3248,53 @@ void RewriteInstance::selectFunctionsToProcess() {
   LiteThresholdExecCount = std::max(
       LiteThresholdExecCount, static_cast<uint64_t>(opts::LiteThresholdCount));
 
+  // Functions covering the requested share of all profile samples. Empty
+  // when sample-coverage selection is disabled.
+  std::unordered_set<const BinaryFunction *> CoveredFunctions;
+  const bool UseSampleCoverage = opts::LiteCoveragePct > 0 && ProfileReader;
+  if (UseSampleCoverage) {
+    if (opts::LiteCoveragePct > 100)
+      opts::LiteCoveragePct = 100;
+
+    // Rank functions by sample mass. Raw branch samples are a better proxy
+    // for the optimization opportunity in a function than the invocation
+    // count alone, so use them when the profile provides them.
+    auto sampleMass = [](const BinaryFunction &Function) {
+      return Function.getRawBranchCount() ? Function.getRawBranchCount()
+                                          : Function.getKnownExecutionCount();
+    };
+    std::vector<const BinaryFunction *> RankedFunctions;
+    uint64_t TotalMass = 0;
+    for (auto &BFI : BC->getBinaryFunctions()) {
+      const BinaryFunction &Function = BFI.second;
+      if (!ProfileReader->mayHaveProfileData(Function))
+        continue;
+      RankedFunctions.push_back(&Function);
+      TotalMass += sampleMass(Function);
+    }
+    std::sort(RankedFunctions.begin(), RankedFunctions.end(),
+              [&](const BinaryFunction *A, const BinaryFunction *B) {
+                if (sampleMass(*A) != sampleMass(*B))
+                  return sampleMass(*A) > sampleMass(*B);
+                return A->getAddress() < B->getAddress();
+              });
+
+    const double TargetMass = TotalMass * opts::LiteCoveragePct / 100.0;
+    uint64_t CoveredMass = 0;
+    for (const BinaryFunction *Function : RankedFunctions) {
+      if (CoveredMass >= TargetMass)
+        break;
+      CoveredMass += sampleMass(*Function);
+      CoveredFunctions.insert(Function);
+    }
+    outs() << "BOLT-INFO: limiting processing to " << CoveredFunctions.size()
+           << " out of " << RankedFunctions.size()
+           << " functions with profile covering "
+           << format("%.2f",
+                     TotalMass ? 100.0 * CoveredMass / TotalMass : 100.0)
+           << "% of samples\n";
+  }
+
   uint64_t NumFunctionsToProcess = 0;
   auto shouldProcess = [&](const BinaryFunction &Function) {
     if (opts::MaxFunctions && NumFunctionsToProcess > opts::MaxFunctions)
@@ -2571,6 +3325,9 @@ void RewriteInstance::selectFunctionsToProcess() {
 
       if (Function.getKnownExecutionCount() < LiteThresholdExecCount)
         return false;
+
+      if (UseSampleCoverage && !CoveredFunctions.count(&Function))
+        return false;
     }
 
     return true;
@@ -2695,25 +3452,58 @@ void RewriteInstance::disassembleFunctions() {
     Function.setFileOffset(FunctionData->begin() - FileBegin);
 
     if (!shouldDisassemble(Function)) {
-      NamedRegionTimer T("scan", "scan functions", "buildfuncs",
-                         "Scan Binary Functions", opts::TimeBuild);
+      static ThreadTimer ScanTimer("scan", "scan functions",
+                                   "Scan Binary Functions");
+      ThreadTimer::Scope T(ScanTimer, opts::TimeBuild);
       Function.scanExternalRefs();
       Function.setSimple(false);
-      continue;
     }
+  }
+
+  // Index jump-table candidates in data sections up front so that the
+  // indirect branch analysis below can reject most non-table memory
+  // references with a bit lookup instead of probing section contents.
+  BC->buildJumpTableCandidateIndex();
+
+  ParallelUtilities::WorkFuncWithAllocTy WorkFun =
+      [&](BinaryFunction &Function, MCPlusBuilder::AllocatorIdTy AllocId) {
+        if (!Function.disassemble(AllocId)) {
+          if (opts::processAllFunctions())
+            BC->exitWithBugReport("function cannot be properly disassembled. "
+                                  "Unable to continue in relocation mode.",
+                                  Function);
+          if (opts::Verbosity >= 1)
+            outs() << "BOLT-INFO: could not disassemble function " << Function
+                   << ". Will ignore.\n";
+          // Forcefully ignore the function.
+          Function.setIgnored();
+        }
+      };
+
+  ParallelUtilities::PredicateTy SkipPredicate =
+      [&](const BinaryFunction &Function) {
+        return !shouldDisassemble(Function) || Function.getSize() == 0;
+      };
+
+  // Constant island handling on AArch64 registers accesses in functions other
+  // than the one being disassembled, and lazily-parsed DWARF line tables are
+  // not safe to access concurrently. Stay sequential in these modes.
+  const bool ForceSequential = opts::SequentialDisassembly || opts::PrintAll ||
+                               opts::PrintDisasm ||
+                               opts::UpdateDebugSections || BC->isAArch64();
+
+  ParallelUtilities::runOnEachFunctionWithUniqueAllocId(
+      *BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+      SkipPredicate, "disassembleFunctions", ForceSequential);
+
+  // Register cross-function references accumulated during the disassembly
+  // in the order functions appear in the binary for reproducible output.
+  for (auto &BFI : BC->getBinaryFunctions()) {
+    BinaryFunction &Function = BFI.second;
 
-    if (!Function.disassemble()) {
-      if (opts::processAllFunctions())
-        BC->exitWithBugReport("function cannot be properly disassembled. "
-                              "Unable to continue in relocation mode.",
-                              Function);
-      if (opts::Verbosity >= 1)
-        outs() << "BOLT-INFO: could not disassemble function " << Function
-               << ". Will ignore.\n";
-      // Forcefully ignore the function.
-      Function.setIgnored();
+    if (!shouldDisassemble(Function) || Function.getSize() == 0 ||
+        Function.isIgnored())
       continue;
-    }
 
     if (opts::PrintAll || opts::PrintDisasm)
       Function.print(outs(), "after disassembly", true);
@@ -2770,12 +3560,6 @@ void RewriteInstance::buildFunctionsCFG() {
   NamedRegionTimer T("buildCFG", "buildCFG", "buildfuncs",
                      "Build Binary Functions", opts::TimeBuild);
 
-  // Create annotation indices to allow lock-free execution
-  BC->MIB->getOrCreateAnnotationIndex("Offset");
-  BC->MIB->getOrCreateAnnotationIndex("JTIndexReg");
-  BC->MIB->getOrCreateAnnotationIndex("NOP");
-  BC->MIB->getOrCreateAnnotationIndex("Size");
-
   ParallelUtilities::WorkFuncWithAllocTy WorkFun =
       [&](BinaryFunction &BF, MCPlusBuilder::AllocatorIdTy AllocId) {
         if (!BF.buildCFG(AllocId))
@@ -2786,7 +3570,17 @@ void RewriteInstance::buildFunctionsCFG() {
       };
 
   ParallelUtilities::PredicateTy SkipPredicate = [&](const BinaryFunction &BF) {
-    return !shouldDisassemble(BF) || !BF.isSimple();
+    if (!shouldDisassemble(BF) || !BF.isSimple())
+      return true;
+
+    // Defer CFG construction for functions that are unlikely to be optimized.
+    // A pass interested in such a function can still build its CFG on demand
+    // as the function keeps its disassembled state.
+    if (opts::DeferredCFG && ProfileReader &&
+        !ProfileReader->mayHaveProfileData(BF))
+      return true;
+
+    return false;
   };
 
   ParallelUtilities::runOnEachFunctionWithUniqueAllocId(
@@ -2798,14 +3592,15 @@ void RewriteInstance::buildFunctionsCFG() {
 }
 
 void RewriteInstance::postProcessFunctions() {
-  BC->TotalScore = 0;
-  BC->SumExecutionCount = 0;
-  for (auto &BFI : BC->getBinaryFunctions()) {
-    BinaryFunction &Function = BFI.second;
-
-    if (Function.empty())
-      continue;
-
+  // Post-processing of one function is independent of all others, so fuse
+  // CFG post-processing, profile post-processing, and the score computation
+  // into a single parallel walk instead of several serial sweeps. The
+  // binary-wide totals are accumulated atomically with one update per
+  // function.
+  std::atomic<uint64_t> TotalScore{0};
+  std::atomic<uint64_t> SumExecutionCount{0};
+
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &Function) {
     Function.postProcessCFG();
 
     if (opts::PrintAll || opts::PrintCFG)
@@ -2819,14 +3614,31 @@ void RewriteInstance::postProcessFunctions() {
       Function.printLoopInfo(outs());
     }
 
-    BC->TotalScore += Function.getFunctionScore();
-    BC->SumExecutionCount += Function.getKnownExecutionCount();
-  }
+    TotalScore += Function.getFunctionScore();
+    SumExecutionCount += Function.getKnownExecutionCount();
+  };
+
+  ParallelUtilities::PredicateTy SkipPredicate =
+      [](const BinaryFunction &Function) { return Function.empty(); };
+
+  // Keep per-function printing in input order.
+  const bool ForceSequential = opts::PrintAll || opts::PrintCFG ||
+                               opts::DumpDotAll || opts::PrintLoopInfo;
+
+  ParallelUtilities::runOnEachFunction(
+      *BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+      SkipPredicate, "postProcessFunctions", ForceSequential);
+
+  BC->TotalScore = TotalScore;
+  BC->SumExecutionCount = SumExecutionCount;
 
   if (opts::PrintGlobals) {
     outs() << "BOLT-INFO: Global symbols:\n";
     BC->printGlobalSymbols(outs());
   }
+
+  if (opts::ReportInstFootprint)
+    BC->printInstructionFootprint(outs());
 }
 
 void RewriteInstance::runOptimizationPasses() {
@@ -2835,14 +3647,77 @@ void RewriteInstance::runOptimizationPasses() {
   BinaryFunctionPassManager::runAllPasses(*BC);
 }
 
+void RewriteInstance::printDryRunReport() {
+  NamedRegionTimer T("dryRunReport", "dry-run report", TimerGroupName,
+                     TimerGroupDesc, opts::TimeRewrite);
+
+  // Assign estimated output addresses reflecting the final layout without
+  // emitting any code: functions are placed in emission order with hot
+  // fragments first and all cold fragments after the hot code, mirroring
+  // function splitting. Block sizes come from computeCodeSize() and are
+  // pre-relaxation estimates.
+  std::vector<BinaryFunction *> SortedFunctions = BC->getSortedFunctions();
+  uint64_t Address = NextAvailableAddress;
+  uint64_t HotTextSize = 0;
+  uint64_t ColdTextSize = 0;
+  auto placeFragment = [&](BinaryFunction &Function, bool Cold) -> uint64_t {
+    Address = alignTo(Address, std::max<uint64_t>(Function.getAlignment(), 1));
+    uint64_t FragmentSize = 0;
+    for (BinaryBasicBlock *BB : Function.layout()) {
+      if (BB->isCold() != Cold)
+        continue;
+      const uint64_t Size = BC->computeCodeSize(BB->begin(), BB->end());
+      BB->setOutputStartAddress(Address);
+      BB->setOutputEndAddress(Address + Size);
+      Address += Size;
+      FragmentSize += Size;
+    }
+    return FragmentSize;
+  };
+
+  for (BinaryFunction *Function : SortedFunctions) {
+    if (!BC->shouldEmit(*Function)) {
+      // Functions we do not emit keep their input addresses.
+      for (BinaryBasicBlock *BB : Function->layout()) {
+        BB->setOutputStartAddress(Function->getAddress() +
+                                  BB->getInputAddressRange().first);
+        BB->setOutputEndAddress(Function->getAddress() +
+                                BB->getInputAddressRange().second);
+      }
+      continue;
+    }
+    HotTextSize += placeFragment(*Function, /*Cold=*/false);
+  }
+  for (BinaryFunction *Function : SortedFunctions)
+    if (BC->shouldEmit(*Function) && Function->isSplit())
+      ColdTextSize += placeFragment(*Function, /*Cold=*/true);
+
+  outs() << "BOLT-INFO: dry run: predicted hot text size: " << HotTextSize
+         << " bytes\n";
+  outs() << "BOLT-INFO: dry run: predicted cold text size: " << ColdTextSize
+         << " bytes\n";
+  outs() << "BOLT-INFO: dry run: cache metrics for the predicted layout:\n";
+  CacheMetrics::printAll(SortedFunctions);
+  outs() << "BOLT-INFO: dry run: skipping emission and rewriting\n";
+}
+
 namespace {
 
 class BOLTSymbolResolver : public JITSymbolResolver {
   BinaryContext &BC;
 
+  /// When non-null, every symbol resolved for a runtime library is appended
+  /// here together with its address. The recorded pairs validate a cached
+  /// runtime image in a later invocation.
+  std::vector<std::pair<std::string, uint64_t>> *RecordLookups{nullptr};
+
 public:
   BOLTSymbolResolver(BinaryContext &BC) : BC(BC) {}
 
+  void recordLookupsTo(std::vector<std::pair<std::string, uint64_t>> *Record) {
+    RecordLookups = Record;
+  }
+
   // We are responsible for all symbols
   Expected<LookupSet> getResponsibilitySet(const LookupSet &Symbols) override {
     return Symbols;
@@ -2864,6 +3739,8 @@ public:
         if (BinaryData *I = BC.getBinaryDataByName(SymName + "@PLT")) {
           AllResults[Symbol] =
               JITEvaluatedSymbol(I->getAddress(), JITSymbolFlags());
+          if (RecordLookups)
+            RecordLookups->emplace_back(SymName, I->getAddress());
           continue;
         }
         OnResolved(make_error<StringError>(
@@ -2875,23 +3752,43 @@ public:
       return;
     }
 
-    for (const StringRef &Symbol : Symbols) {
-      std::string SymName = Symbol.str();
-      LLVM_DEBUG(dbgs() << "BOLT: looking for " << SymName << "\n");
-
-      if (BinaryData *I = BC.getBinaryDataByName(SymName)) {
-        uint64_t Address = I->isMoved() && !I->isJumpTable()
-                               ? I->getOutputAddress()
-                               : I->getAddress();
+    // The object emitted for a large binary references hundreds of thousands
+    // of symbols, and RuntimeDyld hands all of them to us in a single batch.
+    // Resolve the batch with a parallel sweep: the symbol tables of the
+    // context are not modified at this stage, so concurrent lookups are safe.
+    std::vector<StringRef> SymbolNames(Symbols.begin(), Symbols.end());
+    std::vector<uint64_t> Addresses(SymbolNames.size(), 0);
+
+    auto resolveRange = [&](size_t Begin, size_t End) {
+      for (size_t I = Begin; I < End; ++I) {
+        LLVM_DEBUG(dbgs() << "BOLT: looking for " << SymbolNames[I] << "\n");
+        if (const BinaryData *BD = BC.getBinaryDataByName(SymbolNames[I]))
+          Addresses[I] = BD->isMoved() && !BD->isJumpTable()
+                             ? BD->getOutputAddress()
+                             : BD->getAddress();
         LLVM_DEBUG(dbgs() << "Resolved to address 0x"
-                          << Twine::utohexstr(Address) << "\n");
-        AllResults[Symbol] = JITEvaluatedSymbol(Address, JITSymbolFlags());
-        continue;
+                          << Twine::utohexstr(Addresses[I]) << "\n");
       }
-      LLVM_DEBUG(dbgs() << "Resolved to address 0x0\n");
-      AllResults[Symbol] = JITEvaluatedSymbol(0, JITSymbolFlags());
+    };
+
+    // Small batches are not worth the thread wake-up cost.
+    constexpr size_t MinSymbolsPerTask = 1024;
+    if (opts::NoThreads || SymbolNames.size() < 2 * MinSymbolsPerTask) {
+      resolveRange(0, SymbolNames.size());
+    } else {
+      ThreadPool &Pool = ParallelUtilities::getThreadPool();
+      const size_t TaskSize = std::max(
+          MinSymbolsPerTask, SymbolNames.size() / (opts::ThreadCount * 8));
+      for (size_t Begin = 0; Begin < SymbolNames.size(); Begin += TaskSize)
+        Pool.async(resolveRange, Begin,
+                   std::min(Begin + TaskSize, SymbolNames.size()));
+      Pool.wait();
     }
 
+    for (size_t I = 0; I < SymbolNames.size(); ++I)
+      AllResults[SymbolNames[I]] =
+          JITEvaluatedSymbol(Addresses[I], JITSymbolFlags());
+
     OnResolved(std::move(AllResults));
   }
 };
@@ -2903,6 +3800,22 @@ void RewriteInstance::emitAndLink() {
                      TimerGroupDesc, opts::TimeRewrite);
   std::error_code EC;
 
+  // Functions that still have no CFG at this point were not requested by any
+  // optimization pass. Mark them as ignored so that their input code is
+  // reused.
+  if (opts::DeferredCFG) {
+    uint64_t NumDeferredFunctions = 0;
+    for (auto &BFI : BC->getBinaryFunctions()) {
+      BinaryFunction &Function = BFI.second;
+      if (Function.getState() != BinaryFunction::State::Disassembled)
+        continue;
+      Function.setIgnored();
+      ++NumDeferredFunctions;
+    }
+    outs() << "BOLT-INFO: " << NumDeferredFunctions
+           << " functions with deferred CFG will keep their original code\n";
+  }
+
   // This is an object file, which we keep for debugging purposes.
   // Once we decide it's useless, we should create it in memory.
   SmallString<128> OutObjectPath;
@@ -2911,9 +3824,16 @@ void RewriteInstance::emitAndLink() {
       std::make_unique<ToolOutputFile>(OutObjectPath, EC, sys::fs::OF_None);
   check_error(EC, "cannot create output object file");
 
-  std::unique_ptr<buffer_ostream> BOS =
-      std::make_unique<buffer_ostream>(TempOut->os());
-  raw_pwrite_stream *OS = BOS.get();
+  // Emit directly into the temporary file when the stream is seekable.
+  // Buffering the object in memory first would keep a transient copy of all
+  // emitted sections resident next to the input binary and the output
+  // sections, which dominates peak RSS on large binaries.
+  std::unique_ptr<buffer_ostream> BOS;
+  raw_pwrite_stream *OS = &TempOut->os();
+  if (!TempOut->os().supportsSeeking()) {
+    BOS = std::make_unique<buffer_ostream>(TempOut->os());
+    OS = BOS.get();
+  }
 
   // Implicitly MCObjectStreamer takes ownership of MCAsmBackend (MAB)
   // and MCCodeEmitter (MCE). ~MCObjectStreamer() will delete these
@@ -2931,17 +3851,39 @@ void RewriteInstance::emitAndLink() {
     }
   }
 
-  emitBinaryContext(*Streamer, *BC, getOrgSecPrefix());
+  {
+    NamedRegionTimer T("emitCode", "emit code", TimerGroupName, TimerGroupDesc,
+                       opts::TimeRewrite);
+    emitBinaryContext(*Streamer, *BC, getOrgSecPrefix());
+  }
 
-  Streamer->Finish();
+  {
+    NamedRegionTimer T("finalizeObject", "finalize object", TimerGroupName,
+                       TimerGroupDesc, opts::TimeRewrite);
+    Streamer->Finish();
+  }
 
   //////////////////////////////////////////////////////////////////////////////
   // Assign addresses to new sections.
   //////////////////////////////////////////////////////////////////////////////
 
-  // Get output object as ObjectFile.
-  std::unique_ptr<MemoryBuffer> ObjectMemBuffer =
-      MemoryBuffer::getMemBuffer(BOS->str(), "in-memory object file", false);
+  // Get output object as ObjectFile. When the object was emitted straight
+  // into the temporary file, map it from there: RuntimeDyld copies the
+  // sections it loads to their final locations, and the file-backed pages
+  // can be reclaimed by the OS instead of counting against our RSS.
+  std::unique_ptr<MemoryBuffer> ObjectMemBuffer;
+  if (BOS) {
+    ObjectMemBuffer =
+        MemoryBuffer::getMemBuffer(BOS->str(), "in-memory object file", false);
+  } else {
+    TempOut->os().flush();
+    ErrorOr<std::unique_ptr<MemoryBuffer>> ObjectBufferOrErr =
+        MemoryBuffer::getFile(OutObjectPath, /*IsText=*/false,
+                              /*RequiresNullTerminator=*/false);
+    check_error(ObjectBufferOrErr.getError(),
+                "cannot read intermediary output object file");
+    ObjectMemBuffer = std::move(*ObjectBufferOrErr);
+  }
   std::unique_ptr<object::ObjectFile> Obj = cantFail(
       object::ObjectFile::createObjectFile(ObjectMemBuffer->getMemBufferRef()),
       "error creating in-memory object");
@@ -2974,10 +3916,108 @@ void RewriteInstance::emitAndLink() {
   if (opts::UpdateDebugSections)
     DebugInfoRewriter->updateLineTableOffsets(FinalLayout);
 
-  if (RuntimeLibrary *RtLibrary = BC->getRuntimeLibrary())
-    RtLibrary->link(*BC, ToolPath, *RTDyld, [this](RuntimeDyld &R) {
-      this->mapExtraSections(*RTDyld);
-    });
+  if (RuntimeLibrary *RtLibrary = BC->getRuntimeLibrary()) {
+    // The resolved runtime image depends only on the library bytes and the
+    // addresses it links to. With -runtime-lib-cache, reuse the image
+    // resolved by a previous invocation when all of them are unchanged,
+    // skipping the RuntimeDyld work.
+    std::unique_ptr<RuntimeImageCache> Cache;
+    std::string CacheKey;
+    if (!opts::RuntimeLibCache.empty() && BC->isELF()) {
+      ErrorOr<std::unique_ptr<MemoryBuffer>> LibBuf =
+          MemoryBuffer::getFile(RtLibrary->getLibraryPath(ToolPath));
+      if (LibBuf) {
+        Cache = std::make_unique<RuntimeImageCache>(opts::RuntimeLibCache);
+        CacheKey = RuntimeImageCache::computeKey(
+            LibBuf.get()->getBuffer(), BC->TripleName, NextAvailableAddress,
+            RTDyld->getSymbolTable());
+      }
+    }
+
+    // Returns true when the cached image still links to the same addresses
+    // and was installed in place of running a RuntimeDyld link.
+    auto linkFromCache = [&](const RuntimeImageCache::Image &Image) -> bool {
+      for (const std::pair<std::string, uint64_t> &KV : Image.ExternalSymbols) {
+        BinaryData *BD = BC->getBinaryDataByName(KV.first + "@PLT");
+        if (!BD || BD->getAddress() != KV.second)
+          return false;
+      }
+
+      // Replay the address assignment of mapExtraSections() to verify every
+      // section lands exactly where its bytes were resolved for.
+      uint64_t Address = NextAvailableAddress;
+      for (const RuntimeImageCache::Section &Section : Image.Sections) {
+        Address = alignTo(Address, Section.Alignment);
+        if (Address != Section.Address)
+          return false;
+        Address += Section.Size;
+      }
+
+      for (const RuntimeImageCache::Section &Cached : Image.Sections) {
+        BinarySection &Section = BC->registerOrUpdateSection(
+            Cached.Name, ELF::SHT_PROGBITS,
+            BinarySection::getFlags(Cached.IsReadOnly, Cached.IsCode,
+                                    /*IsAllocatable=*/true),
+            copyByteArray(Cached.Contents), Cached.Size, Cached.Alignment);
+        Section.setOutputAddress(Cached.Address);
+        Section.setOutputFileOffset(getFileOffsetForAddress(Cached.Address));
+      }
+      NextAvailableAddress = Address;
+
+      RtLibrary->linkFromCachedImage(
+          *BC, ToolPath, [&Image](StringRef Name) -> uint64_t {
+            for (const std::pair<std::string, uint64_t> &KV : Image.Symbols)
+              if (KV.first == Name)
+                return KV.second;
+            return 0;
+          });
+      outs() << "BOLT-INFO: reusing cached runtime library image\n";
+      return true;
+    };
+
+    bool Linked = false;
+    if (Cache)
+      if (Optional<RuntimeImageCache::Image> Image = Cache->lookup(CacheKey))
+        Linked = linkFromCache(*Image);
+
+    if (!Linked) {
+      std::vector<std::pair<std::string, uint64_t>> ExternalSymbols;
+      if (Cache)
+        Resolver.recordLookupsTo(&ExternalSymbols);
+      RtLibrary->link(*BC, ToolPath, *RTDyld, [this](RuntimeDyld &R) {
+        this->mapExtraSections(*RTDyld);
+      });
+      Resolver.recordLookupsTo(nullptr);
+
+      if (Cache) {
+        RuntimeImageCache::Image Image;
+        Image.ExternalSymbols = std::move(ExternalSymbols);
+        for (const auto &KV : RTDyld->getSymbolTable())
+          Image.Symbols.emplace_back(KV.first.str(), KV.second.getAddress());
+        for (BinarySection &Section : BC->allocatableSections()) {
+          if (!Section.getName().contains(".bolt.extra."))
+            continue;
+          RuntimeImageCache::Section Cached;
+          Cached.Name = std::string(Section.getName());
+          Cached.Address = Section.getOutputAddress();
+          Cached.Size = Section.getOutputSize();
+          Cached.Alignment = Section.getAlignment();
+          Cached.IsCode = Section.isText();
+          Cached.IsReadOnly = Section.isReadOnly();
+          Cached.Contents = Section.getOutputContents().str();
+          Image.Sections.push_back(std::move(Cached));
+        }
+        // mapExtraSections() assigned the addresses in increasing order;
+        // store the sections the same way for the replay check above.
+        std::sort(Image.Sections.begin(), Image.Sections.end(),
+                  [](const RuntimeImageCache::Section &A,
+                     const RuntimeImageCache::Section &B) {
+                    return A.Address < B.Address;
+                  });
+        Cache->store(CacheKey, Image);
+      }
+    }
+  }
 
   // Once the code is emitted, we can rename function sections to actual
   // output sections and de-register sections used for emission.
@@ -3370,6 +4410,22 @@ std::vector<BinarySection *> RewriteInstance::getCodeSections() {
     if (Section.hasValidSectionID())
       CodeSections.emplace_back(&Section);
 
+  // Rank code sections from the hottest to the coldest: the main text is
+  // followed by the warm section, then everything else, with the frozen
+  // section at the very end. The order is inverted when hot functions are
+  // placed at the end of the binary.
+  auto sectionRank = [&](const BinarySection *Section) -> unsigned {
+    const StringRef Name = Section->getName();
+    unsigned Rank = 2;
+    if (Name == BC->getMainCodeSectionName())
+      Rank = 0;
+    else if (Name == BC->getWarmCodeSectionName())
+      Rank = 1;
+    else if (Name == BC->getFrozenCodeSectionName())
+      Rank = 3;
+    return opts::HotFunctionsAtEnd ? 3 - Rank : Rank;
+  };
+
   auto compareSections = [&](const BinarySection *A, const BinarySection *B) {
     // Place movers before anything else.
     if (A->getName() == BC->getHotTextMoverSectionName())
@@ -3377,11 +4433,7 @@ std::vector<BinarySection *> RewriteInstance::getCodeSections() {
     if (B->getName() == BC->getHotTextMoverSectionName())
       return false;
 
-    // Depending on the option, put main text at the beginning or at the end.
-    if (opts::HotFunctionsAtEnd)
-      return B->getName() == BC->getMainCodeSectionName();
-    else
-      return A->getName() == BC->getMainCodeSectionName();
+    return sectionRank(A) < sectionRank(B);
   };
 
   // Determine the order of sections.
@@ -3656,23 +4708,40 @@ void RewriteInstance::mapDataSections(RuntimeDyld &RTDyld) {
 }
 
 void RewriteInstance::mapExtraSections(RuntimeDyld &RTDyld) {
+  // The relative order of these sections carries no meaning, so lay them out
+  // in the order of decreasing alignment: a section can then only be padded
+  // by a stricter predecessor, which keeps the total padding bounded by the
+  // few distinct alignments present instead of up to an alignment unit per
+  // section. Ties are broken by name to keep the layout reproducible.
+  std::vector<BinarySection *> ExtraSections;
   for (BinarySection &Section : BC->allocatableSections()) {
     if (Section.getOutputAddress() || !Section.hasValidSectionID())
       continue;
+    ExtraSections.push_back(&Section);
+  }
+  std::stable_sort(ExtraSections.begin(), ExtraSections.end(),
+                   [](const BinarySection *A, const BinarySection *B) {
+                     if (A->getAlignment() != B->getAlignment())
+                       return A->getAlignment() > B->getAlignment();
+                     return A->getName() < B->getName();
+                   });
+
+  for (BinarySection *Section : ExtraSections) {
     NextAvailableAddress =
-        alignTo(NextAvailableAddress, Section.getAlignment());
-    Section.setOutputAddress(NextAvailableAddress);
-    NextAvailableAddress += Section.getOutputSize();
+        alignTo(NextAvailableAddress, Section->getAlignment());
+    Section->setOutputAddress(NextAvailableAddress);
+    NextAvailableAddress += Section->getOutputSize();
 
-    LLVM_DEBUG(dbgs() << "BOLT: (extra) mapping " << Section.getName()
-                      << " at 0x" << Twine::utohexstr(Section.getAllocAddress())
+    LLVM_DEBUG(dbgs() << "BOLT: (extra) mapping " << Section->getName()
+                      << " at 0x"
+                      << Twine::utohexstr(Section->getAllocAddress())
                       << " to 0x"
-                      << Twine::utohexstr(Section.getOutputAddress()) << '\n');
+                      << Twine::utohexstr(Section->getOutputAddress()) << '\n');
 
-    RTDyld.reassignSectionAddress(Section.getSectionID(),
-                                  Section.getOutputAddress());
-    Section.setOutputFileOffset(
-        getFileOffsetForAddress(Section.getOutputAddress()));
+    RTDyld.reassignSectionAddress(Section->getSectionID(),
+                                  Section->getOutputAddress());
+    Section->setOutputFileOffset(
+        getFileOffsetForAddress(Section->getOutputAddress()));
   }
 }
 
@@ -3788,13 +4857,176 @@ uint64_t appendPadding(raw_pwrite_stream &OS, uint64_t Offset,
 
   const uint64_t PaddingSize =
       offsetToAlignment(Offset, llvm::Align(Alignment));
-  for (unsigned I = 0; I < PaddingSize; ++I)
-    OS.write((unsigned char)0);
+  OS.write_zeros(PaddingSize);
   return Offset + PaddingSize;
 }
 
 }
 
+void RewriteInstance::compressDebugSections(const ELFFile<ELF64LE> &Obj) {
+  if (!zlib::isAvailable()) {
+    errs() << "BOLT-WARNING: zlib is not available; debug sections will be "
+              "written uncompressed\n";
+    return;
+  }
+
+  constexpr uint64_t ChdrSize = sizeof(ELF64LE::Chdr);
+
+  // Jobs hold the final uncompressed contents of each section. Patches are
+  // applied up front since compressed contents cannot be patched after they
+  // are written out.
+  struct CompressJob {
+    std::string SectionName;
+    std::string PatchedContents; // Backing storage when patching was needed.
+    StringRef Contents;
+    uint64_t Alignment;
+    unsigned ELFType;
+    SmallVector<char, 0> Compressed;
+  };
+  std::deque<CompressJob> Jobs;
+
+  auto isCompressible = [](StringRef SectionName) {
+    return SectionName.startswith(".debug_");
+  };
+
+  StringSet<> InputSectionNames;
+  for (const ELF64LE::Shdr &Section : cantFail(Obj.sections())) {
+    if (Section.sh_type == ELF::SHT_NULL)
+      continue;
+    if (Section.sh_flags & ELF::SHF_ALLOC)
+      continue;
+
+    StringRef SectionName =
+        cantFail(Obj.getSectionName(Section), "cannot get section name");
+    InputSectionNames.insert(SectionName);
+
+    if (!isCompressible(SectionName) || shouldStrip(Section, SectionName))
+      continue;
+    // Sections compressed in the input are carried over as they are.
+    if (Section.sh_flags & ELF::SHF_COMPRESSED)
+      continue;
+
+    ErrorOr<BinarySection &> BSec = BC->getUniqueSectionByName(SectionName);
+    // Pending relocations are patched in after the contents are written.
+    if (BSec && BSec->hasPendingRelocations())
+      continue;
+
+    Jobs.emplace_back();
+    CompressJob &Job = Jobs.back();
+    Job.SectionName = std::string(SectionName);
+    Job.Alignment = std::max<uint64_t>(Section.sh_addralign, 1);
+    Job.ELFType = Section.sh_type;
+
+    if (willOverwriteSection(SectionName)) {
+      if (!BSec || !BSec->getAllocAddress()) {
+        Jobs.pop_back();
+        continue;
+      }
+      Job.Contents = BSec->getOutputContents();
+    } else {
+      StringRef Dataref =
+          InputFile->getData().substr(Section.sh_offset, Section.sh_size);
+      if (BSec && BSec->getPatcher()) {
+        BinaryPatcher *Patcher = BSec->getPatcher();
+        if (Patcher->resizesContents()) {
+          Job.PatchedContents = Patcher->patchBinary(Dataref);
+        } else {
+          Job.PatchedContents = std::string(Dataref);
+          auto *SBP = static_cast<SimpleBinaryPatcher *>(Patcher);
+          for (const SimpleBinaryPatcher::PatchTy &Patch : SBP->getPatches())
+            Job.PatchedContents.replace(Patch.first, Patch.second.size(),
+                                        Patch.second);
+        }
+        Job.Contents = StringRef(Job.PatchedContents);
+      } else {
+        Job.Contents = Dataref;
+      }
+    }
+
+    if (Job.Contents.size() <= ChdrSize)
+      Jobs.pop_back();
+  }
+
+  // Pick up debug sections created by BOLT that have no counterpart in the
+  // input file.
+  for (BinarySection &Section : BC->nonAllocatableSections()) {
+    if (!isCompressible(Section.getName()) || !Section.getAllocAddress())
+      continue;
+    if (InputSectionNames.count(Section.getName()))
+      continue;
+    if (Section.hasPendingRelocations())
+      continue;
+
+    Jobs.emplace_back();
+    CompressJob &Job = Jobs.back();
+    Job.SectionName = std::string(Section.getName());
+    Job.Alignment = std::max<uint64_t>(Section.getAlignment(), 1);
+    Job.ELFType = Section.getELFType();
+    Job.Contents = Section.getOutputContents();
+    if (Job.Contents.size() <= ChdrSize)
+      Jobs.pop_back();
+  }
+
+  if (Jobs.empty())
+    return;
+
+  auto CompressOne = [](CompressJob &Job) {
+    if (Error E = zlib::compress(Job.Contents, Job.Compressed)) {
+      consumeError(std::move(E));
+      Job.Compressed.clear();
+    }
+  };
+  if (opts::NoThreads) {
+    for (CompressJob &Job : Jobs)
+      CompressOne(Job);
+  } else {
+    ThreadPool &Pool = ParallelUtilities::getThreadPool();
+    for (CompressJob &Job : Jobs)
+      Pool.async([&CompressOne, &Job] { CompressOne(Job); });
+    Pool.wait();
+  }
+
+  uint64_t NumCompressed = 0;
+  uint64_t UncompressedBytes = 0;
+  uint64_t CompressedBytes = 0;
+  for (CompressJob &Job : Jobs) {
+    // Keep the section uncompressed unless compression pays for the header.
+    if (Job.Compressed.empty() ||
+        Job.Compressed.size() + ChdrSize >= Job.Contents.size())
+      continue;
+
+    // ELF64 compression header followed by the deflated payload.
+    std::string Blob;
+    Blob.reserve(ChdrSize + Job.Compressed.size());
+    raw_string_ostream BlobOS(Blob);
+    support::endian::Writer Writer(BlobOS, support::little);
+    Writer.write<uint32_t>(ELF::ELFCOMPRESS_ZLIB);
+    Writer.write<uint32_t>(0); // ch_reserved
+    Writer.write<uint64_t>(Job.Contents.size());
+    Writer.write<uint64_t>(Job.Alignment);
+    BlobOS.write(Job.Compressed.data(), Job.Compressed.size());
+
+    const std::string &Contents = BlobOS.str();
+    ++NumCompressed;
+    UncompressedBytes += Job.Contents.size();
+    CompressedBytes += Contents.size();
+
+    BinarySection &NewSection = BC->registerOrUpdateNoteSection(
+        Job.SectionName, copyByteArray(Contents), Contents.size(),
+        /*Alignment=*/8, /*IsReadOnly=*/true, Job.ELFType);
+    NewSection.setIsCompressed();
+    // Make sure the input contents of a pass-through section are not
+    // copied over the compressed ones.
+    if (!willOverwriteSection(Job.SectionName))
+      addToDebugSectionsToOverwrite(Job.SectionName.c_str());
+  }
+
+  if (NumCompressed)
+    outs() << "BOLT-INFO: compressed " << NumCompressed
+           << " debug sections, size " << UncompressedBytes << " -> "
+           << CompressedBytes << " bytes\n";
+}
+
 void RewriteInstance::rewriteNoteSections() {
   auto ELF64LEFile = dyn_cast<ELF64LEObjectFile>(InputFile);
   if (!ELF64LEFile) {
@@ -3809,6 +5041,34 @@ void RewriteInstance::rewriteNoteSections() {
          "next available offset calculation failure");
   OS.seek(NextAvailableOffset);
 
+  // Compress debug sections up front, concurrently, so their final sizes
+  // are known when the file offsets are assigned below.
+  if (opts::CompressDebugSections)
+    compressDebugSections(Obj);
+
+  // With multi-threading enabled, defer the section contents: every extent
+  // is laid out first, then the stream is extended to cover them and the
+  // writes are issued on the thread pool, so the copying time is bounded by
+  // the largest section instead of the sum. Padding between the deferred
+  // extents is left as file holes, which read as zeros. Kernel-side copying
+  // keeps the streaming path as it moves the stream position.
+  const bool DeferWrites = !opts::NoThreads && !opts::ZeroCopyOutput;
+  struct WriteJob {
+    const char *Data;
+    uint64_t Size;
+    uint64_t Offset;
+  };
+  std::vector<WriteJob> WriteJobs;
+  // Backing storage for deferred patched contents.
+  std::deque<std::string> PatchedContents;
+  std::vector<BinarySection *> PendingRelocSections;
+
+  auto advancePadding = [&](uint64_t Offset, uint64_t Alignment) {
+    if (!DeferWrites)
+      return appendPadding(OS, Offset, Alignment);
+    return Alignment ? alignTo(Offset, Alignment) : Offset;
+  };
+
   // Copy over non-allocatable section contents and update file offsets.
   for (const ELF64LE::Shdr &Section : cantFail(Obj.sections())) {
     if (Section.sh_type == ELF::SHT_NULL)
@@ -3823,9 +5083,13 @@ void RewriteInstance::rewriteNoteSections() {
     if (shouldStrip(Section, SectionName))
       continue;
 
-    // Insert padding as needed.
-    NextAvailableOffset =
-        appendPadding(OS, NextAvailableOffset, Section.sh_addralign);
+    // Insert padding as needed. A compressed section needs its compression
+    // header aligned regardless of the input section alignment.
+    NextAvailableOffset = advancePadding(
+        NextAvailableOffset,
+        BSec && BSec->isCompressed()
+            ? std::max<uint64_t>(Section.sh_addralign, BSec->getAlignment())
+            : Section.sh_addralign);
 
     // New section size.
     uint64_t Size = 0;
@@ -3836,9 +5100,23 @@ void RewriteInstance::rewriteNoteSections() {
       Size = Section.sh_size;
       StringRef Dataref = InputFile->getData().substr(Section.sh_offset, Size);
       std::string Data;
+      bool HasInPlacePatches = false;
       if (BSec && BSec->getPatcher()) {
-        Data = BSec->getPatcher()->patchBinary(Dataref);
-        Dataref = StringRef(Data);
+        BinaryPatcher *Patcher = BSec->getPatcher();
+        if (Patcher->resizesContents()) {
+          Data = Patcher->patchBinary(Dataref);
+          Dataref = StringRef(Data);
+        } else {
+          // Same-size patches are flushed over the pass-through contents
+          // after they are written out, so the section is never copied and
+          // memory is only spent on the modified bytes.
+          auto *SBP = static_cast<SimpleBinaryPatcher *>(Patcher);
+          for (const SimpleBinaryPatcher::PatchTy &Patch : SBP->getPatches())
+            BSec->addPatch(Patch.first, SmallVector<char, 8>(
+                                            Patch.second.begin(),
+                                            Patch.second.end()));
+          HasInPlacePatches = true;
+        }
       }
 
       // Section was expanded, so need to treat it as overwrite.
@@ -3846,8 +5124,24 @@ void RewriteInstance::rewriteNoteSections() {
         BSec = BC->registerOrUpdateNoteSection(
             SectionName, copyByteArray(Dataref), Dataref.size());
         Size = 0;
+      } else if (DeferWrites) {
+        if (!Data.empty()) {
+          PatchedContents.emplace_back(std::move(Data));
+          Dataref = StringRef(PatchedContents.back());
+        }
+        WriteJobs.push_back(
+            {Dataref.data(), Dataref.size(), NextAvailableOffset});
+        DataWritten = true;
+
+        // Add padding as the section extension might rely on the alignment.
+        Size = advancePadding(Size, Section.sh_addralign);
       } else {
-        OS << Dataref;
+        // Copy unchanged section contents directly in the kernel when
+        // possible.
+        const bool IsUnchanged =
+            !BSec || !BSec->getPatcher() || HasInPlacePatches;
+        if (!IsUnchanged || !copyInputRangeToOutput(Section.sh_offset, Size))
+          OS << Dataref;
         DataWritten = true;
 
         // Add padding as the section extension might rely on the alignment.
@@ -3857,7 +5151,8 @@ void RewriteInstance::rewriteNoteSections() {
 
     // Perform section post-processing.
     if (BSec && !BSec->isAllocatable()) {
-      assert(BSec->getAlignment() <= Section.sh_addralign &&
+      assert((BSec->isCompressed() ||
+              BSec->getAlignment() <= Section.sh_addralign) &&
              "alignment exceeds value in file");
 
       if (BSec->getAllocAddress()) {
@@ -3866,15 +5161,26 @@ void RewriteInstance::rewriteNoteSections() {
 
         LLVM_DEBUG(dbgs() << "BOLT-DEBUG: " << (Size ? "appending" : "writing")
                           << " contents to section " << SectionName << '\n');
-        OS.write(reinterpret_cast<char *>(SectionData), BSec->getOutputSize());
+        if (DeferWrites)
+          WriteJobs.push_back({reinterpret_cast<const char *>(SectionData),
+                               BSec->getOutputSize(),
+                               NextAvailableOffset + Size});
+        else
+          OS.write(reinterpret_cast<char *>(SectionData),
+                   BSec->getOutputSize());
         Size += BSec->getOutputSize();
       }
 
       BSec->setOutputFileOffset(NextAvailableOffset);
-      BSec->flushPendingRelocations(OS,
-        [this] (const MCSymbol *S) {
-          return getNewValueForSymbol(S->getName());
-        });
+      if (DeferWrites)
+        // Relocations patch the deferred contents; flush them only after the
+        // contents have been written out.
+        PendingRelocSections.push_back(&*BSec);
+      else
+        BSec->flushPendingRelocations(OS,
+          [this] (const MCSymbol *S) {
+            return getNewValueForSymbol(S->getName());
+          });
     }
 
     // Set/modify section info.
@@ -3900,7 +5206,7 @@ void RewriteInstance::rewriteNoteSections() {
     assert(!Section.hasPendingRelocations() && "cannot have pending relocs");
 
     NextAvailableOffset =
-        appendPadding(OS, NextAvailableOffset, Section.getAlignment());
+        advancePadding(NextAvailableOffset, Section.getAlignment());
     Section.setOutputFileOffset(NextAvailableOffset);
 
     LLVM_DEBUG(
@@ -3908,9 +5214,34 @@ void RewriteInstance::rewriteNoteSections() {
                << " of size " << Section.getOutputSize() << " at offset 0x"
                << Twine::utohexstr(Section.getOutputFileOffset()) << '\n');
 
-    OS.write(Section.getOutputContents().data(), Section.getOutputSize());
+    if (DeferWrites)
+      WriteJobs.push_back({Section.getOutputContents().data(),
+                           Section.getOutputSize(), NextAvailableOffset});
+    else
+      OS.write(Section.getOutputContents().data(), Section.getOutputSize());
     NextAvailableOffset += Section.getOutputSize();
   }
+
+  if (DeferWrites) {
+    // Extend the stream over the laid out extents so that pwrite() can
+    // service each of them. With the buffer flushed every deferred write is
+    // an independent pwrite(2) call, so they can run concurrently.
+    OS.seek(NextAvailableOffset);
+    OS.flush();
+
+    ThreadPool &Pool = ParallelUtilities::getThreadPool();
+    for (const WriteJob &Job : WriteJobs) {
+      if (!Job.Size)
+        continue;
+      Pool.async([&OS, Job] { OS.pwrite(Job.Data, Job.Size, Job.Offset); });
+    }
+    Pool.wait();
+
+    for (BinarySection *BSec : PendingRelocSections)
+      BSec->flushPendingRelocations(OS, [this](const MCSymbol *S) {
+        return getNewValueForSymbol(S->getName());
+      });
+  }
 }
 
 template <typename ELFT>
@@ -3971,13 +5302,7 @@ void RewriteInstance::addBATSection() {
                                   /*IsReadOnly=*/true, ELF::SHT_NOTE);
 }
 
-void RewriteInstance::encodeBATSection() {
-  std::string DescStr;
-  raw_string_ostream DescOS(DescStr);
-
-  BAT->write(DescOS);
-  DescOS.flush();
-
+void RewriteInstance::encodeBATSection(StringRef DescStr) {
   const std::string BoltInfo =
       BinarySection::encodeELFNote("BOLT", DescStr, BinarySection::NT_BOLT_BAT);
   BC->registerOrUpdateNoteSection(BoltAddressTranslation::SECTION_NAME,
@@ -4131,6 +5456,11 @@ RewriteInstance::getOutputSections(ELFObjectFile<ELFT> *File,
     NewSection.sh_offset = BSec->getOutputFileOffset();
     NewSection.sh_size = BSec->getOutputSize();
 
+    if (BSec->isCompressed()) {
+      NewSection.sh_flags |= ELF::SHF_COMPRESSED;
+      NewSection.sh_addralign = sizeof(typename ELFT::uint);
+    }
+
     if (NewSection.sh_type == ELF::SHT_SYMTAB)
       NewSection.sh_info = NumLocalSymbols;
 
@@ -4155,6 +5485,8 @@ RewriteInstance::getOutputSections(ELFObjectFile<ELFT> *File,
     NewSection.sh_size = Section.getOutputSize();
     NewSection.sh_entsize = 0;
     NewSection.sh_flags = Section.getELFFlags();
+    if (Section.isCompressed())
+      NewSection.sh_flags |= ELF::SHF_COMPRESSED;
     NewSection.sh_link = 0;
     NewSection.sh_info = 0;
     NewSection.sh_addralign = Section.getAlignment();
@@ -4272,6 +5604,7 @@ void RewriteInstance::updateELFSymbolTable(
 
   unsigned NumHotTextSymsUpdated = 0;
   unsigned NumHotDataSymsUpdated = 0;
+  unsigned NumDynSymsPatched = 0;
 
   std::map<const BinaryFunction *, uint64_t> IslandSizes;
   auto getConstantIslandSize = [&IslandSizes](const BinaryFunction &BF) {
@@ -4284,6 +5617,50 @@ void RewriteInstance::updateELFSymbolTable(
   // Symbols for the new symbol table.
   std::vector<ELFSymTy> Symbols;
 
+  // Snapshot the function address map into a flat sorted array. Per-symbol
+  // lookups against the std::map behind getBinaryFunctionAtAddress() and
+  // getBinaryFunctionContainingAddress() are minutes of pointer chasing on
+  // binaries with millions of symbols; binary search over a contiguous
+  // array is cache-friendly and safe to run from multiple threads.
+  struct FunctionTableEntry {
+    uint64_t Address;
+    uint64_t MaxSize;
+    const BinaryFunction *BF;
+  };
+  std::vector<FunctionTableEntry> FunctionTable;
+  FunctionTable.reserve(BC->getBinaryFunctions().size());
+  for (auto &BFI : BC->getBinaryFunctions())
+    FunctionTable.push_back(
+        FunctionTableEntry{BFI.first, BFI.second.getMaxSize(), &BFI.second});
+
+  auto lookupFunctionAt = [&](uint64_t Address) -> const BinaryFunction * {
+    auto It = llvm::lower_bound(FunctionTable, Address,
+                                [](const FunctionTableEntry &E, uint64_t A) {
+                                  return E.Address < A;
+                                });
+    if (It != FunctionTable.end() && It->Address == Address)
+      return It->BF;
+    // The function at this address could have been folded. Fall back to the
+    // full lookup that resolves the symbol through its BinaryData.
+    return BC->getBinaryFunctionAtAddress(Address);
+  };
+
+  // Equivalent of getBinaryFunctionContainingAddress() with
+  // CheckPastEnd=false and UseMaxSize=true.
+  auto lookupFunctionContaining =
+      [&](uint64_t Address) -> const BinaryFunction * {
+    auto It = llvm::upper_bound(FunctionTable, Address,
+                                [](uint64_t A, const FunctionTableEntry &E) {
+                                  return A < E.Address;
+                                });
+    if (It == FunctionTable.begin())
+      return nullptr;
+    --It;
+    if (Address >= It->Address + It->MaxSize)
+      return nullptr;
+    return It->BF;
+  };
+
   auto getNewSectionIndex = [&](uint32_t OldIndex) {
     assert(OldIndex < NewSectionIndex.size() && "section index out of bounds");
     const uint32_t NewIndex = NewSectionIndex[OldIndex];
@@ -4393,13 +5770,28 @@ void RewriteInstance::updateELFSymbolTable(
     return false;
   };
 
-  for (const ELFSymTy &Symbol : cantFail(Obj.symbols(&SymTabSection))) {
+  // Transformed input symbols. The per-symbol transformation is pure and is
+  // performed in parallel chunks; stripping, extra-symbol creation, string
+  // table updates, and the final write-out are serialized in input order in
+  // a cheap merge pass below.
+  struct SymbolTransform {
+    ELFSymTy NewSymbol;
+    const BinaryFunction *ExtraSymbolsFor{nullptr};
+    StringRef SpecialName;
+    bool Strip{false};
+  };
+
+  const auto InputSymbols = cantFail(Obj.symbols(&SymTabSection));
+  std::vector<SymbolTransform> Records(InputSymbols.size());
+
+  auto transformSymbol = [&](const ELFSymTy &Symbol, SymbolTransform &Record) {
     // For regular (non-dynamic) symbol table strip unneeded symbols.
-    if (!IsDynSym && shouldStrip(Symbol))
-      continue;
+    if (!IsDynSym && shouldStrip(Symbol)) {
+      Record.Strip = true;
+      return;
+    }
 
-    const BinaryFunction *Function =
-        BC->getBinaryFunctionAtAddress(Symbol.st_value);
+    const BinaryFunction *Function = lookupFunctionAt(Symbol.st_value);
     // Ignore false function references, e.g. when the section address matches
     // the address of the function.
     if (Function && Symbol.getType() == ELF::STT_SECTION)
@@ -4417,7 +5809,8 @@ void RewriteInstance::updateELFSymbolTable(
       Function = nullptr;
 
     // Create a new symbol based on the existing symbol.
-    ELFSymTy NewSymbol = Symbol;
+    ELFSymTy &NewSymbol = Record.NewSymbol;
+    NewSymbol = Symbol;
 
     if (Function) {
       // If the symbol matched a function that was not emitted, update the
@@ -4430,18 +5823,16 @@ void RewriteInstance::updateELFSymbolTable(
         NewSymbol.st_shndx = getNewSectionIndex(Symbol.st_shndx);
       }
 
-      // Add new symbols to the symbol table if necessary.
+      // New symbols are added to the symbol table in the merge pass if
+      // necessary.
       if (!IsDynSym)
-        addExtraSymbols(*Function, NewSymbol);
+        Record.ExtraSymbolsFor = Function;
     } else {
       // Check if the function symbol matches address inside a function, i.e.
       // it marks a secondary entry point.
-      Function =
-          (Symbol.getType() == ELF::STT_FUNC)
-              ? BC->getBinaryFunctionContainingAddress(Symbol.st_value,
-                                                       /*CheckPastEnd=*/false,
-                                                       /*UseMaxSize=*/true)
-              : nullptr;
+      Function = (Symbol.getType() == ELF::STT_FUNC)
+                     ? lookupFunctionContaining(Symbol.st_value)
+                     : nullptr;
 
       if (Function && Function->isEmitted()) {
         const uint64_t OutputAddress =
@@ -4485,53 +5876,100 @@ void RewriteInstance::updateELFSymbolTable(
         // .text. Remove them from the symtab.
         if (Symbol.getType() == ELF::STT_NOTYPE &&
             Symbol.getBinding() == ELF::STB_LOCAL && Symbol.st_size == 0) {
-          if (BC->getBinaryFunctionContainingAddress(Symbol.st_value,
-                                                     /*CheckPastEnd=*/false,
-                                                     /*UseMaxSize=*/true)) {
+          if (lookupFunctionContaining(Symbol.st_value)) {
             // Can only delete the symbol if not patching. Such symbols should
             // not exist in the dynamic symbol table.
             assert(!IsDynSym && "cannot delete symbol");
-            continue;
+            Record.Strip = true;
+            return;
           }
         }
       }
     }
 
-    // Handle special symbols based on their name.
+    // Detect special symbols. Their values depend on emission results and
+    // are assigned, with a diagnostic printed, in the merge pass.
     Expected<StringRef> SymbolName = Symbol.getName(StringSection);
     assert(SymbolName && "cannot get symbol name");
 
-    auto updateSymbolValue = [&](const StringRef Name, unsigned &IsUpdated) {
-      NewSymbol.st_value = getNewValueForSymbol(Name);
-      NewSymbol.st_shndx = ELF::SHN_ABS;
-      outs() << "BOLT-INFO: setting " << Name << " to 0x"
-             << Twine::utohexstr(NewSymbol.st_value) << '\n';
-      ++IsUpdated;
-    };
+    if ((opts::HotText &&
+         (*SymbolName == "__hot_start" || *SymbolName == "__hot_end")) ||
+        (opts::HotData && (*SymbolName == "__hot_data_start" ||
+                           *SymbolName == "__hot_data_end")) ||
+        *SymbolName == "_end")
+      Record.SpecialName = *SymbolName;
+  };
 
-    if (opts::HotText &&
-        (*SymbolName == "__hot_start" || *SymbolName == "__hot_end"))
-      updateSymbolValue(*SymbolName, NumHotTextSymsUpdated);
+  // Transform the symbols in parallel chunks.
+  auto transformChunk = [&](size_t Begin, size_t End) {
+    for (size_t I = Begin; I < End; ++I)
+      transformSymbol(InputSymbols[I], Records[I]);
+  };
+  if (opts::NoThreads) {
+    transformChunk(0, Records.size());
+  } else {
+    ThreadPool &Pool = ParallelUtilities::getThreadPool();
+    const size_t ChunkSize = std::max<size_t>(
+        1, Records.size() / (opts::ThreadCount * opts::TaskCount));
+    for (size_t I = 0; I < Records.size(); I += ChunkSize)
+      Pool.async(transformChunk, I, std::min(I + ChunkSize, Records.size()));
+    Pool.wait();
+  }
+
+  auto updateSymbolValue = [&](ELFSymTy &NewSymbol, const StringRef Name,
+                               unsigned &IsUpdated) {
+    NewSymbol.st_value = getNewValueForSymbol(Name);
+    NewSymbol.st_shndx = ELF::SHN_ABS;
+    outs() << "BOLT-INFO: setting " << Name << " to 0x"
+           << Twine::utohexstr(NewSymbol.st_value) << '\n';
+    ++IsUpdated;
+  };
 
-    if (opts::HotData &&
-        (*SymbolName == "__hot_data_start" || *SymbolName == "__hot_data_end"))
-      updateSymbolValue(*SymbolName, NumHotDataSymsUpdated);
+  // Merge the transformed symbols in input order.
+  Symbols.reserve(Records.size());
+  for (size_t Index = 0; Index < Records.size(); ++Index) {
+    SymbolTransform &Record = Records[Index];
+    if (Record.Strip)
+      continue;
+
+    // Handle special symbols based on their name.
+    if (!Record.SpecialName.empty()) {
+      if (Record.SpecialName == "_end") {
+        unsigned Ignored;
+        updateSymbolValue(Record.NewSymbol, Record.SpecialName, Ignored);
+      } else if (Record.SpecialName.startswith("__hot_data")) {
+        updateSymbolValue(Record.NewSymbol, Record.SpecialName,
+                          NumHotDataSymsUpdated);
+      } else {
+        updateSymbolValue(Record.NewSymbol, Record.SpecialName,
+                          NumHotTextSymsUpdated);
+      }
+    }
 
-    if (*SymbolName == "_end") {
-      unsigned Ignored;
-      updateSymbolValue(*SymbolName, Ignored);
+    if (IsDynSym) {
+      // The dynamic symbol table is patched in place. Skip entries that came
+      // out of the transform unchanged, so that a run where only the text
+      // moved costs O(changed symbols) writes instead of rewriting the whole
+      // table.
+      if (memcmp(&Record.NewSymbol, &InputSymbols[Index], sizeof(ELFSymTy))) {
+        Write(Index * sizeof(ELFSymTy), Record.NewSymbol);
+        ++NumDynSymsPatched;
+      }
+      continue;
     }
 
-    if (IsDynSym)
-      Write((&Symbol - cantFail(Obj.symbols(&SymTabSection)).begin()) *
-                sizeof(ELFSymTy),
-            NewSymbol);
-    else
-      Symbols.emplace_back(NewSymbol);
+    // Add new symbols to the symbol table if necessary.
+    if (Record.ExtraSymbolsFor)
+      addExtraSymbols(*Record.ExtraSymbolsFor, Record.NewSymbol);
+
+    Symbols.emplace_back(Record.NewSymbol);
   }
 
   if (IsDynSym) {
     assert(Symbols.empty());
+    LLVM_DEBUG(dbgs() << "BOLT-DEBUG: patched " << NumDynSymsPatched
+                      << " out of " << Records.size()
+                      << " dynamic symbol entries\n");
     return;
   }
 
@@ -4593,14 +6031,16 @@ void RewriteInstance::updateELFSymbolTable(
     addSymbol("__hot_data_end");
   }
 
-  // Put local symbols at the beginning.
-  std::stable_sort(Symbols.begin(), Symbols.end(),
-                   [](const ELFSymTy &A, const ELFSymTy &B) {
-                     if (A.getBinding() == ELF::STB_LOCAL &&
-                         B.getBinding() != ELF::STB_LOCAL)
-                       return true;
-                     return false;
-                   });
+  // Put local symbols at the beginning. The input table is already ordered
+  // this way, so sorting is only needed when the merge pass appended new
+  // local symbols after the global entries.
+  auto LocalsFirst = [](const ELFSymTy &A, const ELFSymTy &B) {
+    if (A.getBinding() == ELF::STB_LOCAL && B.getBinding() != ELF::STB_LOCAL)
+      return true;
+    return false;
+  };
+  if (!std::is_sorted(Symbols.begin(), Symbols.end(), LocalsFirst))
+    std::stable_sort(Symbols.begin(), Symbols.end(), LocalsFirst);
 
   for (const ELFSymTy &Symbol : Symbols)
     Write(0, Symbol);
@@ -4669,9 +6109,20 @@ void RewriteInstance::patchELFSymTabs(ELFObjectFile<ELFT> *File) {
   std::string NewContents;
   std::string NewStrTab = std::string(
       File->getData().substr(StrTabSection->sh_offset, StrTabSection->sh_size));
+  // Presize the output buffers: the new tables are roughly the input tables
+  // plus a small number of extra symbols, so reserving the input sizes
+  // avoids repeated reallocation and copying of multi-hundred-MB tables.
+  NewContents.reserve(SymTabSection->sh_size);
+  NewStrTab.reserve(StrTabSection->sh_size + StrTabSection->sh_size / 8);
   StringRef SecName = cantFail(Obj.getSectionName(*SymTabSection));
   StringRef StrSecName = cantFail(Obj.getSectionName(*StrTabSection));
 
+  // Names of input symbols keep their st_name offsets into the copied input
+  // table; only newly minted names pass through here. Deduplicate them - the
+  // "$d"/"$x" island markers alone repeat once per function - so each
+  // distinct name is stored a single time.
+  StringMap<size_t> NewStrTabIndex;
+
   NumLocalSymbols = 0;
   updateELFSymbolTable(
       File,
@@ -4685,10 +6136,14 @@ void RewriteInstance::patchELFSymTabs(ELFObjectFile<ELFT> *File) {
                            sizeof(ELFSymTy));
       },
       [&](StringRef Str) {
-        size_t Idx = NewStrTab.size();
-        NewStrTab.append(NameResolver::restore(Str).str());
-        NewStrTab.append(1, '\0');
-        return Idx;
+        const std::string Restored = NameResolver::restore(Str).str();
+        auto II = NewStrTabIndex.insert(
+            std::make_pair(StringRef(Restored), NewStrTab.size()));
+        if (II.second) {
+          NewStrTab.append(Restored);
+          NewStrTab.append(1, '\0');
+        }
+        return II.first->second;
       });
 
   BC->registerOrUpdateNoteSection(SecName,
@@ -4929,6 +6384,107 @@ uint64_t RewriteInstance::getNewFunctionAddress(uint64_t OldAddress) {
   return Function->getOutputAddress();
 }
 
+#if defined(__linux__) && defined(SYS_copy_file_range)
+/// Instruct the kernel to copy a range of bytes between two open files.
+/// On file systems supporting shared extents, such as XFS and Btrfs, the
+/// range is reflinked and no data is duplicated at all. Return the number of
+/// bytes copied, or a negative value if the copy could not be performed.
+static int64_t copyFileRange(int InFD, uint64_t InputOffset, int OutFD,
+                             uint64_t OutputOffset, uint64_t Size) {
+  off64_t OffIn = InputOffset;
+  off64_t OffOut = OutputOffset;
+  return syscall(SYS_copy_file_range, InFD, &OffIn, OutFD, &OffOut, Size, 0);
+}
+#endif
+
+bool RewriteInstance::copyInputRangeToOutput(uint64_t InputOffset,
+                                             uint64_t Size) {
+#if defined(__linux__) && defined(SYS_copy_file_range)
+  if (!opts::ZeroCopyOutput || InputFD == -1 || OutputFD == -1)
+    return false;
+
+  // Write out buffered contents first so that the copied range lands past
+  // them in the file.
+  raw_fd_ostream &OS = Out->os();
+  OS.flush();
+  uint64_t OutputOffset = OS.tell();
+  while (Size) {
+    const int64_t BytesCopied =
+        copyFileRange(InputFD, InputOffset, OutputFD, OutputOffset, Size);
+    if (BytesCopied <= 0) {
+      // The file system does not support the operation. Disable further
+      // attempts and let the caller write the range through the stream.
+      // Partially copied data, if any, will be overwritten.
+      errs() << "BOLT-WARNING: kernel-side copy to the output file failed; "
+                "falling back to buffered writes\n";
+      InputFD = OutputFD = -1;
+      return false;
+    }
+    InputOffset += BytesCopied;
+    OutputOffset += BytesCopied;
+    Size -= BytesCopied;
+  }
+  OS.seek(OutputOffset);
+  return true;
+#else
+  (void)InputOffset;
+  (void)Size;
+  return false;
+#endif
+}
+
+void RewriteInstance::writeOutputData(const char *Data, uint64_t Size,
+                                      uint64_t FileOffset) {
+  raw_fd_ostream &OS = Out->os();
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+  if (opts::SparseOutput && OutputFD != -1) {
+    // fallocate(2) zeroes the partial file system blocks at the edges of the
+    // punched range, so no alignment handling is needed. Zero runs shorter
+    // than one block are cheaper to write than to deallocate.
+    constexpr uint64_t BlockSize = 0x1000;
+    auto IsZeroRange = [Data](uint64_t Begin, uint64_t End) {
+      for (uint64_t I = Begin; I < End; ++I)
+        if (Data[I])
+          return false;
+      return true;
+    };
+
+    // Write out buffered contents first so they are not flushed on top of a
+    // punched range later.
+    OS.flush();
+
+    uint64_t Offset = 0;
+    while (Offset < Size) {
+      // Coalesce blocks of the same kind into one write or one hole. The
+      // trailing partial block is always written.
+      uint64_t End = std::min(Offset + BlockSize, Size);
+      const bool IsZero = End - Offset == BlockSize && IsZeroRange(Offset, End);
+      while (End < Size) {
+        const uint64_t NextEnd = std::min(End + BlockSize, Size);
+        if ((NextEnd - End == BlockSize && IsZeroRange(End, NextEnd)) != IsZero)
+          break;
+        End = NextEnd;
+      }
+      if (IsZero) {
+        if (fallocate(OutputFD, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      FileOffset + Offset, End - Offset) != 0) {
+          errs() << "BOLT-WARNING: -sparse-output is disabled: cannot punch "
+                    "holes in the output file\n";
+          opts::SparseOutput = false;
+          OS.pwrite(Data + Offset, Size - Offset, FileOffset + Offset);
+          return;
+        }
+      } else {
+        OS.pwrite(Data + Offset, End - Offset, FileOffset + Offset);
+      }
+      Offset = End;
+    }
+    return;
+  }
+#endif
+  OS.pwrite(Data, Size, FileOffset);
+}
+
 void RewriteInstance::rewriteFile() {
   std::error_code EC;
   Out = std::make_unique<ToolOutputFile>(opts::OutputFilename, EC,
@@ -4937,8 +6493,27 @@ void RewriteInstance::rewriteFile() {
 
   raw_fd_ostream &OS = Out->os();
 
+  // Open file descriptors used to copy unchanged input data to the output in
+  // the kernel and to punch holes for all-zero regions.
+  if (opts::ZeroCopyOutput || opts::SparseOutput) {
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    if ((EC = sys::fs::openFileForRead(InputFile->getFileName(), InputFD)) ||
+        (EC = sys::fs::openFileForWrite(opts::OutputFilename, OutputFD,
+                                        sys::fs::CD_OpenExisting,
+                                        sys::fs::OF_None))) {
+      errs() << "BOLT-WARNING: direct output file access is disabled: "
+             << EC.message() << '\n';
+      InputFD = OutputFD = -1;
+    }
+#else
+    errs() << "BOLT-WARNING: -zero-copy-output and -sparse-output are not "
+              "supported on this platform\n";
+#endif
+  }
+
   // Copy allocatable part of the input.
-  OS << InputFile->getData().substr(0, FirstNonAllocatableOffset);
+  if (!copyInputRangeToOutput(0, FirstNonAllocatableOffset))
+    OS << InputFile->getData().substr(0, FirstNonAllocatableOffset);
 
   // We obtain an asm-specific writer so that we can emit nops in an
   // architecture-specific way at the end of the function.
@@ -5056,7 +6631,13 @@ void RewriteInstance::rewriteFile() {
     OS.seek(SavedPos);
   }
 
-  // Write all allocatable sections - reloc-mode text is written here as well
+  // Write all allocatable sections - reloc-mode text is written here as well.
+  // The file offsets of the sections were assigned during mapping and the
+  // stream has been extended over them above, so with plain buffered output
+  // the writes are independent pwrite() calls and can run concurrently.
+  // Sparse output mutates shared state on failure and stays sequential.
+  const bool ParallelSectionWrites = !opts::NoThreads && !opts::SparseOutput;
+  OS.flush();
   for (BinarySection &Section : BC->allocatableSections()) {
     if (!Section.isFinalized() || !Section.getOutputData())
       continue;
@@ -5066,9 +6647,26 @@ void RewriteInstance::rewriteFile() {
              << "\n data at 0x" << Twine::utohexstr(Section.getAllocAddress())
              << "\n of size " << Section.getOutputSize() << "\n at offset "
              << Section.getOutputFileOffset() << '\n';
-    OS.pwrite(reinterpret_cast<const char *>(Section.getOutputData()),
-              Section.getOutputSize(), Section.getOutputFileOffset());
+    if (opts::ColdCompress &&
+        Section.getName() == (opts::SplitRegions
+                                  ? BC->getFrozenCodeSectionName()
+                                  : BC->getColdCodeSectionName())) {
+      writeCompressedColdSection(Section);
+      continue;
+    }
+    if (ParallelSectionWrites) {
+      ParallelUtilities::getThreadPool().async([this, &Section] {
+        writeOutputData(
+            reinterpret_cast<const char *>(Section.getOutputData()),
+            Section.getOutputSize(), Section.getOutputFileOffset());
+      });
+      continue;
+    }
+    writeOutputData(reinterpret_cast<const char *>(Section.getOutputData()),
+                    Section.getOutputSize(), Section.getOutputFileOffset());
   }
+  if (ParallelSectionWrites)
+    ParallelUtilities::getThreadPool().wait();
 
   for (BinarySection &Section : BC->allocatableSections())
     Section.flushPendingRelocations(OS, [this](const MCSymbol *S) {
@@ -5084,6 +6682,17 @@ void RewriteInstance::rewriteFile() {
   if (opts::EnableBAT)
     addBATSection();
 
+  // BAT encoding only reads the translation maps, so its bytes can be
+  // produced in the background while the symbol tables are patched.
+  std::string BATDesc;
+  std::shared_future<void> BATFuture;
+  if (opts::EnableBAT && !opts::NoThreads)
+    BATFuture = ParallelUtilities::getThreadPool().async([this, &BATDesc] {
+      raw_string_ostream DescOS(BATDesc);
+      BAT->write(DescOS);
+      DescOS.flush();
+    });
+
   // Patch program header table.
   patchELFPHDRTable();
 
@@ -5095,8 +6704,16 @@ void RewriteInstance::rewriteFile() {
 
   patchBuildID();
 
-  if (opts::EnableBAT)
-    encodeBATSection();
+  if (opts::EnableBAT) {
+    if (BATFuture.valid()) {
+      BATFuture.wait();
+    } else {
+      raw_string_ostream DescOS(BATDesc);
+      BAT->write(DescOS);
+      DescOS.flush();
+    }
+    encodeBATSection(BATDesc);
+  }
 
   // Copy non-allocatable sections once allocatable part is finished.
   rewriteNoteSections();
@@ -5117,6 +6734,12 @@ void RewriteInstance::rewriteFile() {
     BC->printSections(outs());
   }
 
+  if (InputFD != -1)
+    sys::Process::SafelyCloseFileDescriptor(InputFD);
+  if (OutputFD != -1)
+    sys::Process::SafelyCloseFileDescriptor(OutputFD);
+  InputFD = OutputFD = -1;
+
   Out->keep();
   EC = sys::fs::setPermissions(opts::OutputFilename, sys::fs::perms::all_all);
   check_error(EC, "cannot set permissions of output file");
@@ -5189,6 +6812,43 @@ void RewriteInstance::writeEHFrameHeader() {
                     << EHFrameSection->getOutputSize() << '\n');
 }
 
+void RewriteInstance::writeCompressedColdSection(BinarySection &Section) {
+  raw_fd_ostream &OS = Out->os();
+  const StringRef Contents(
+      reinterpret_cast<const char *>(Section.getOutputData()),
+      Section.getOutputSize());
+  const uint64_t FileOffset = Section.getOutputFileOffset();
+
+  SmallVector<char, 0> Compressed;
+  ColdCompressRuntimeLibrary::compress(Contents, Compressed);
+
+  constexpr uint64_t HeaderSize = ColdCompressRuntimeLibrary::HeaderSize;
+  if (HeaderSize + Compressed.size() >= Contents.size()) {
+    outs() << "BOLT-INFO: cold code did not compress, writing it as is\n";
+    OS.pwrite(Contents.data(), Contents.size(), FileOffset);
+    return;
+  }
+
+  // The header and the compressed image go at the start of the section; the
+  // runtime library restores the original contents before the binary starts
+  // executing. The rest of the section is zero-filled so it stays free of
+  // stale bytes and compresses away in packaged images.
+  char Header[HeaderSize];
+  support::endian::write64le(Header, ColdCompressRuntimeLibrary::Magic);
+  support::endian::write64le(Header + 8, Compressed.size());
+  support::endian::write64le(Header + 16, Contents.size());
+  OS.pwrite(Header, HeaderSize, FileOffset);
+  OS.pwrite(Compressed.data(), Compressed.size(), FileOffset + HeaderSize);
+
+  const std::vector<char> Zeros(
+      Contents.size() - HeaderSize - Compressed.size(), 0);
+  OS.pwrite(Zeros.data(), Zeros.size(), FileOffset + HeaderSize +
+                                            Compressed.size());
+
+  outs() << "BOLT-INFO: cold code compressed from " << Contents.size()
+         << " to " << Compressed.size() << " bytes\n";
+}
+
 uint64_t RewriteInstance::getNewValueForSymbol(const StringRef Name) {
   uint64_t Value = RTDyld->getSymbol(Name).getAddress();
   if (Value != 0)
@@ -0,0 +1,172 @@
+//===- bolt/RuntimeLibs/ColdCompressRuntimeLibrary.cpp - Cold Code --------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the ColdCompressRuntimeLibrary class.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bolt/RuntimeLibs/ColdCompressRuntimeLibrary.h"
+#include "bolt/Core/BinaryFunction.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/MC/MCStreamer.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<std::string> RuntimeColdCompressLib(
+    "runtime-cold-compress-lib",
+    cl::desc("specify file name of the runtime cold code decompression "
+             "library"),
+    cl::ZeroOrMore, cl::init("libbolt_rt_coldcompress.a"),
+    cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+void ColdCompressRuntimeLibrary::adjustCommandLineOptions(
+    const BinaryContext &BC) const {
+  if (!BC.StartFunctionAddress) {
+    errs() << "BOLT-ERROR: cold code compression requires a known entry "
+              "point of the input binary\n";
+    exit(1);
+  }
+}
+
+void ColdCompressRuntimeLibrary::emitBinary(BinaryContext &BC,
+                                            MCStreamer &Streamer) {
+  const BinaryFunction *StartFunction =
+      BC.getBinaryFunctionAtAddress(*(BC.StartFunctionAddress));
+  assert(!StartFunction->isFragment() && "expected main function fragment");
+  if (!StartFunction) {
+    errs() << "BOLT-ERROR: failed to locate function at binary start address\n";
+    exit(1);
+  }
+
+  const auto Flags = BinarySection::getFlags(/*IsReadOnly=*/false,
+                                             /*IsText=*/false,
+                                             /*IsAllocatable=*/true);
+  MCSectionELF *Section =
+      BC.Ctx->getELFSection(".bolt.coldcompress", ELF::SHT_PROGBITS, Flags);
+
+  // __bolt_coldcompress_init_ptr stores the pointer the runtime library
+  // jumps to after restoring the cold code.
+  MCSymbol *InitPtr = BC.Ctx->getOrCreateSymbol("__bolt_coldcompress_init_ptr");
+
+  Section->setAlignment(llvm::Align(8));
+  Streamer.SwitchSection(Section);
+
+  Streamer.emitLabel(InitPtr);
+  Streamer.emitSymbolAttribute(InitPtr, MCSymbolAttr::MCSA_Global);
+  Streamer.emitValue(
+      MCSymbolRefExpr::create(StartFunction->getSymbol(), *(BC.Ctx)),
+      /*Size=*/8);
+}
+
+std::string
+ColdCompressRuntimeLibrary::getLibraryPath(StringRef ToolPath) const {
+  return getLibPath(ToolPath, opts::RuntimeColdCompressLib);
+}
+
+void ColdCompressRuntimeLibrary::link(
+    BinaryContext &BC, StringRef ToolPath, RuntimeDyld &RTDyld,
+    std::function<void(RuntimeDyld &)> OnLoad) {
+  loadLibrary(getLibraryPath(ToolPath), RTDyld);
+  OnLoad(RTDyld);
+  RTDyld.finalizeWithMemoryManagerLocking();
+  if (RTDyld.hasError()) {
+    outs() << "BOLT-ERROR: RTDyld failed: " << RTDyld.getErrorString() << "\n";
+    exit(1);
+  }
+
+  linkFromCachedImage(BC, ToolPath, [&RTDyld](StringRef Name) {
+    return RTDyld.getSymbol(Name).getAddress();
+  });
+}
+
+void ColdCompressRuntimeLibrary::linkFromCachedImage(
+    BinaryContext &BC, StringRef ToolPath,
+    function_ref<uint64_t(StringRef)> GetAddress) {
+  assert(!RuntimeStartAddress &&
+         "We don't currently support linking multiple runtime libraries");
+  RuntimeStartAddress = GetAddress("__bolt_coldcompress_self");
+  if (!RuntimeStartAddress) {
+    errs() << "BOLT-ERROR: cold code decompression library does not define "
+              "__bolt_coldcompress_self: "
+           << getLibraryPath(ToolPath) << "\n";
+    exit(1);
+  }
+}
+
+void ColdCompressRuntimeLibrary::compress(StringRef Data,
+                                          SmallVectorImpl<char> &Out) {
+  // Byte-oriented LZ with greedy matching: a control byte less than 0x80
+  // introduces a run of (control + 1) literal bytes; a control byte with the
+  // top bit set introduces a match of ((control & 0x7f) + 4) bytes at a
+  // 16-bit little-endian distance that follows the control byte. The format
+  // favors a trivial decoder: the runtime library runs before libc is
+  // initialized and cannot link against a real decompressor.
+  constexpr size_t MinMatch = 4;
+  constexpr size_t MaxMatch = 0x7f + MinMatch;
+  constexpr size_t MaxDistance = 0xffff;
+  constexpr size_t MaxLiteralRun = 0x80;
+
+  const uint8_t *In = Data.bytes_begin();
+  const size_t Size = Data.size();
+
+  size_t LiteralStart = 0;
+  auto flushLiterals = [&](size_t Pos) {
+    while (LiteralStart < Pos) {
+      const size_t Run = std::min(Pos - LiteralStart, MaxLiteralRun);
+      Out.push_back(static_cast<char>(Run - 1));
+      Out.append(In + LiteralStart, In + LiteralStart + Run);
+      LiteralStart += Run;
+    }
+  };
+
+  // Map a hash of the next four input bytes to the last position they were
+  // seen at.
+  std::vector<uint32_t> Table(1 << 16, UINT32_MAX);
+  auto hash = [&](size_t Pos) {
+    return (support::endian::read32le(In + Pos) * 2654435761U) >> 16;
+  };
+
+  size_t Pos = 0;
+  while (Pos + MinMatch <= Size) {
+    const uint32_t H = hash(Pos);
+    const size_t Candidate = Table[H];
+    Table[H] = static_cast<uint32_t>(Pos);
+    if (Candidate == UINT32_MAX || Pos - Candidate > MaxDistance ||
+        support::endian::read32le(In + Candidate) !=
+            support::endian::read32le(In + Pos)) {
+      ++Pos;
+      continue;
+    }
+
+    size_t Len = MinMatch;
+    while (Len < MaxMatch && Pos + Len < Size &&
+           In[Candidate + Len] == In[Pos + Len])
+      ++Len;
+
+    flushLiterals(Pos);
+    Out.push_back(static_cast<char>(0x80 | (Len - MinMatch)));
+    const size_t Distance = Pos - Candidate;
+    Out.push_back(static_cast<char>(Distance & 0xff));
+    Out.push_back(static_cast<char>(Distance >> 8));
+    Pos += Len;
+    LiteralStart = Pos;
+  }
+  flushLiterals(Size);
+}
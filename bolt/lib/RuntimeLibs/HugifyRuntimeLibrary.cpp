@@ -24,7 +24,10 @@ namespace opts {
 
 extern cl::OptionCategory BoltOptCategory;
 
+extern cl::opt<bool> HotData;
 extern cl::opt<bool> HotText;
+extern cl::opt<bool> HugifyData;
+extern cl::list<std::string> ReorderData;
 
 cl::opt<bool>
     Hugify("hugify",
@@ -52,6 +55,15 @@ void HugifyRuntimeLibrary::adjustCommandLineOptions(
   // After the check, we set HotText to be true because automated hugify support
   // relies on it.
   opts::HotText = true;
+  if (opts::HugifyData) {
+    if (opts::ReorderData.empty()) {
+      errs() << "BOLT-ERROR: -hugify-data relies on the hot/cold data split "
+                "performed by -reorder-data\n";
+      exit(1);
+    }
+    // The runtime locates the hot data through the __hot_data markers.
+    opts::HotData = true;
+  }
   if (!BC.StartFunctionAddress) {
     errs() << "BOLT-ERROR: hugify runtime libraries require a known entry "
               "point of "
@@ -87,13 +99,47 @@ void HugifyRuntimeLibrary::emitBinary(BinaryContext &BC, MCStreamer &Streamer) {
   Streamer.emitValue(
       MCSymbolRefExpr::create(StartFunction->getSymbol(), *(BC.Ctx)),
       /*Size=*/8);
+
+  // __bolt_hugify_page_count caps the number of huge pages the runtime
+  // backs. Zero when the layout was not packed by pages and the whole
+  // hot text range should be used.
+  MCSymbol *PageCount = BC.Ctx->getOrCreateSymbol("__bolt_hugify_page_count");
+  Streamer.emitLabel(PageCount);
+  Streamer.emitSymbolAttribute(PageCount, MCSymbolAttr::MCSA_Global);
+  Streamer.emitIntValue(BC.HugePageCount, /*Size=*/8);
+
+  // __bolt_hugify_hot_data_start/end pass the hot data range produced by
+  // -reorder-data to the runtime. The values stay zero when -hugify-data is
+  // off, so the runtime library does not reference the __hot_data markers
+  // unless the hot/cold data split actually happened.
+  auto emitValueSymbol = [&](StringRef Name, MCSymbol *Value) {
+    MCSymbol *Symbol = BC.Ctx->getOrCreateSymbol(Name);
+    Streamer.emitLabel(Symbol);
+    Streamer.emitSymbolAttribute(Symbol, MCSymbolAttr::MCSA_Global);
+    if (Value)
+      Streamer.emitValue(MCSymbolRefExpr::create(Value, *(BC.Ctx)),
+                         /*Size=*/8);
+    else
+      Streamer.emitIntValue(0, /*Size=*/8);
+  };
+  emitValueSymbol("__bolt_hugify_hot_data_start",
+                  opts::HugifyData
+                      ? BC.Ctx->getOrCreateSymbol("__hot_data_start")
+                      : nullptr);
+  emitValueSymbol("__bolt_hugify_hot_data_end",
+                  opts::HugifyData
+                      ? BC.Ctx->getOrCreateSymbol("__hot_data_end")
+                      : nullptr);
+}
+
+std::string HugifyRuntimeLibrary::getLibraryPath(StringRef ToolPath) const {
+  return getLibPath(ToolPath, opts::RuntimeHugifyLib);
 }
 
 void HugifyRuntimeLibrary::link(BinaryContext &BC, StringRef ToolPath,
                                 RuntimeDyld &RTDyld,
                                 std::function<void(RuntimeDyld &)> OnLoad) {
-  std::string LibPath = getLibPath(ToolPath, opts::RuntimeHugifyLib);
-  loadLibrary(LibPath, RTDyld);
+  loadLibrary(getLibraryPath(ToolPath), RTDyld);
   OnLoad(RTDyld);
   RTDyld.finalizeWithMemoryManagerLocking();
   if (RTDyld.hasError()) {
@@ -101,13 +147,21 @@ void HugifyRuntimeLibrary::link(BinaryContext &BC, StringRef ToolPath,
     exit(1);
   }
 
+  linkFromCachedImage(BC, ToolPath, [&RTDyld](StringRef Name) {
+    return RTDyld.getSymbol(Name).getAddress();
+  });
+}
+
+void HugifyRuntimeLibrary::linkFromCachedImage(
+    BinaryContext &BC, StringRef ToolPath,
+    function_ref<uint64_t(StringRef)> GetAddress) {
   assert(!RuntimeStartAddress &&
          "We don't currently support linking multiple runtime libraries");
-  RuntimeStartAddress = RTDyld.getSymbol("__bolt_hugify_self").getAddress();
+  RuntimeStartAddress = GetAddress("__bolt_hugify_self");
   if (!RuntimeStartAddress) {
     errs() << "BOLT-ERROR: instrumentation library does not define "
               "__bolt_hugify_self: "
-           << LibPath << "\n";
+           << getLibraryPath(ToolPath) << "\n";
     exit(1);
   }
 }
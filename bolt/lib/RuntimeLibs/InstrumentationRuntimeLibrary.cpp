@@ -29,7 +29,11 @@ cl::opt<std::string> RuntimeInstrumentationLib(
     cl::desc("specify file name of the runtime instrumentation library"),
     cl::ZeroOrMore, cl::init("libbolt_rt_instr.a"), cl::cat(BoltOptCategory));
 
+extern cl::opt<bool> InstrumentationBinaryProfile;
 extern cl::opt<bool> InstrumentationFileAppendPID;
+extern cl::opt<bool> InstrumentationSharedCounters;
+extern cl::opt<uint32_t> InstrumentationCounterShards;
+extern cl::opt<uint32_t> InstrumentationSampling;
 extern cl::opt<bool> ConservativeInstrumentation;
 extern cl::opt<std::string> InstrumentationFilename;
 extern cl::opt<std::string> InstrumentationBinpath;
@@ -158,9 +162,21 @@ void InstrumentationRuntimeLibrary::emitBinary(BinaryContext &BC,
   // instrumentation runtime library to dump the instrumentation data to disk.
   // Label marking start of the memory region containing instrumentation
   // counters, total vector size is Counters.size() 8-byte counters
+  // Counter slabs for -instrumentation-counter-shards: slab N starts
+  // N * __bolt_instr_slab_stride bytes past a counter's slab-zero slot.
+  // Each slab carries one extra sink slot absorbing the increments that
+  // -instrumentation-sampling steers away from the real counters.
   emitLabelByName("__bolt_instr_locations");
-  for (MCSymbol *const &Label : Summary->Counters)
-    emitFill(sizeof(uint64_t), Label);
+  for (unsigned I = 0; I < opts::InstrumentationCounterShards; ++I) {
+    if (I == 0)
+      for (MCSymbol *const &Label : Summary->Counters)
+        emitFill(sizeof(uint64_t), Label);
+    else
+      emitFill(sizeof(uint64_t) * Summary->Counters.size());
+    emitFill(sizeof(uint64_t),
+             I == 0 ? BC.Ctx->getOrCreateSymbol("__bolt_instr_sink")
+                    : nullptr);
+  }
 
   emitPadding(BC.RegularPageSize);
   emitIntValue("__bolt_instr_sleep_time", opts::InstrumentationSleepTime);
@@ -180,6 +196,16 @@ void InstrumentationRuntimeLibrary::emitBinary(BinaryContext &BC,
   emitString("__bolt_instr_filename", opts::InstrumentationFilename);
   emitString("__bolt_instr_binpath", opts::InstrumentationBinpath);
   emitIntValue("__bolt_instr_use_pid", !!opts::InstrumentationFileAppendPID, 1);
+  emitIntValue("__bolt_instr_binary_dump", !!opts::InstrumentationBinaryProfile,
+               1);
+  emitIntValue("__bolt_instr_use_shmem", !!opts::InstrumentationSharedCounters,
+               1);
+  emitIntValue("__bolt_instr_num_shards", opts::InstrumentationCounterShards);
+  emitIntValue("__bolt_instr_slab_stride",
+               (Summary->Counters.size() + 1) * sizeof(uint64_t), 8);
+  emitIntValue("__bolt_instr_sample_mask",
+               opts::InstrumentationSampling ? opts::InstrumentationSampling - 1
+                                            : 0);
 
   if (BC.isMachO()) {
     MCSection *TablesSection = BC.Ctx->getMachOSection(
@@ -190,10 +216,15 @@ void InstrumentationRuntimeLibrary::emitBinary(BinaryContext &BC,
   }
 }
 
+std::string
+InstrumentationRuntimeLibrary::getLibraryPath(StringRef ToolPath) const {
+  return getLibPath(ToolPath, opts::RuntimeInstrumentationLib);
+}
+
 void InstrumentationRuntimeLibrary::link(
     BinaryContext &BC, StringRef ToolPath, RuntimeDyld &RTDyld,
     std::function<void(RuntimeDyld &)> OnLoad) {
-  std::string LibPath = getLibPath(ToolPath, opts::RuntimeInstrumentationLib);
+  std::string LibPath = getLibraryPath(ToolPath);
   loadLibrary(LibPath, RTDyld);
   OnLoad(RTDyld);
   RTDyld.finalizeWithMemoryManagerLocking();
@@ -202,17 +233,31 @@ void InstrumentationRuntimeLibrary::link(
     exit(1);
   }
 
+  completeLink(BC, LibPath, [&RTDyld](StringRef Name) {
+    return RTDyld.getSymbol(Name).getAddress();
+  });
+}
+
+void InstrumentationRuntimeLibrary::linkFromCachedImage(
+    BinaryContext &BC, StringRef ToolPath,
+    function_ref<uint64_t(StringRef)> GetAddress) {
+  completeLink(BC, getLibraryPath(ToolPath), GetAddress);
+}
+
+void InstrumentationRuntimeLibrary::completeLink(
+    BinaryContext &BC, StringRef LibPath,
+    function_ref<uint64_t(StringRef)> GetAddress) {
   if (BC.isMachO())
     return;
 
-  RuntimeFiniAddress = RTDyld.getSymbol("__bolt_instr_fini").getAddress();
+  RuntimeFiniAddress = GetAddress("__bolt_instr_fini");
   if (!RuntimeFiniAddress) {
     errs() << "BOLT-ERROR: instrumentation library does not define "
               "__bolt_instr_fini: "
            << LibPath << "\n";
     exit(1);
   }
-  RuntimeStartAddress = RTDyld.getSymbol("__bolt_instr_start").getAddress();
+  RuntimeStartAddress = GetAddress("__bolt_instr_start");
   if (!RuntimeStartAddress) {
     errs() << "BOLT-ERROR: instrumentation library does not define "
               "__bolt_instr_start: "
@@ -223,9 +268,7 @@ void InstrumentationRuntimeLibrary::link(
             "library, lib entry point is 0x"
          << Twine::utohexstr(RuntimeFiniAddress) << "\n";
   outs() << "BOLT-INFO: clear procedure is 0x"
-         << Twine::utohexstr(
-                RTDyld.getSymbol("__bolt_instr_clear_counters").getAddress())
-         << "\n";
+         << Twine::utohexstr(GetAddress("__bolt_instr_clear_counters")) << "\n";
 
   emitTablesAsELFNote(BC);
 }
@@ -0,0 +1,209 @@
+//===- bolt/RuntimeLibs/RuntimeImageCache.cpp - Runtime image cache -------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the RuntimeImageCache class.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bolt/RuntimeLibs/RuntimeImageCache.h"
+#include "bolt/Core/HashUtilities.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "bolt-rtlib"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace {
+
+/// Magic bytes at the start of a cache entry.
+const char ImageMagic[] = "BOLTRTIC";
+const size_t ImageMagicSize = 8;
+
+/// Version of the cache entry format.
+const uint32_t ImageVersion = 1;
+
+/// Incremental reader over a cache entry buffer. Any out-of-bounds read
+/// raises the error flag and makes subsequent reads return zeros, so the
+/// caller can validate once at the end.
+class EntryReader {
+  StringRef Buf;
+  size_t Pos = 0;
+  bool Error = false;
+
+public:
+  explicit EntryReader(StringRef Buf) : Buf(Buf) {}
+
+  bool hasError() const { return Error; }
+
+  bool atEnd() const { return Pos == Buf.size(); }
+
+  StringRef readBytes(size_t Size) {
+    if (Error || Buf.size() - Pos < Size) {
+      Error = true;
+      return StringRef();
+    }
+    StringRef Result = Buf.substr(Pos, Size);
+    Pos += Size;
+    return Result;
+  }
+
+  uint32_t read32() {
+    StringRef Bytes = readBytes(4);
+    return Error ? 0 : support::endian::read32le(Bytes.data());
+  }
+
+  uint64_t read64() {
+    StringRef Bytes = readBytes(8);
+    return Error ? 0 : support::endian::read64le(Bytes.data());
+  }
+
+  std::string readString() {
+    const uint32_t Size = read32();
+    return readBytes(Size).str();
+  }
+};
+
+void writeString(support::endian::Writer &W, StringRef Str) {
+  W.write<uint32_t>(Str.size());
+  W.OS << Str;
+}
+
+std::string entryPath(StringRef Directory, StringRef Key) {
+  SmallString<128> Path(Directory);
+  sys::path::append(Path, Key + ".rtimage");
+  return std::string(Path.str());
+}
+
+} // end anonymous namespace
+
+std::string RuntimeImageCache::computeKey(
+    StringRef LibraryContents, StringRef Triple, uint64_t LoadAddress,
+    const std::map<StringRef, JITEvaluatedSymbol> &SymbolTable) {
+  StreamingHash64 Hasher;
+  Hasher.add(LibraryContents);
+  Hasher.add(Triple);
+  Hasher.add(LoadAddress);
+  // std::map keeps the symbols ordered by name, so the hash is stable.
+  for (const auto &KV : SymbolTable) {
+    Hasher.add(KV.first);
+    Hasher.add(KV.second.getAddress());
+  }
+  return Twine::utohexstr(Hasher.finalize()).str();
+}
+
+Optional<RuntimeImageCache::Image>
+RuntimeImageCache::lookup(StringRef Key) const {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(
+      entryPath(Directory, Key), /*IsText=*/false,
+      /*RequiresNullTerminator=*/false);
+  if (!MB)
+    return None;
+
+  EntryReader Reader(MB.get()->getBuffer());
+  if (Reader.readBytes(ImageMagicSize) != StringRef(ImageMagic, ImageMagicSize))
+    return None;
+  if (Reader.read32() != ImageVersion)
+    return None;
+
+  Image Result;
+  const uint32_t NumExternal = Reader.read32();
+  for (uint32_t I = 0; I < NumExternal && !Reader.hasError(); ++I) {
+    std::string Name = Reader.readString();
+    const uint64_t Address = Reader.read64();
+    Result.ExternalSymbols.emplace_back(std::move(Name), Address);
+  }
+
+  const uint32_t NumSymbols = Reader.read32();
+  for (uint32_t I = 0; I < NumSymbols && !Reader.hasError(); ++I) {
+    std::string Name = Reader.readString();
+    const uint64_t Address = Reader.read64();
+    Result.Symbols.emplace_back(std::move(Name), Address);
+  }
+
+  const uint32_t NumSections = Reader.read32();
+  for (uint32_t I = 0; I < NumSections && !Reader.hasError(); ++I) {
+    Section Sec;
+    Sec.Name = Reader.readString();
+    Sec.Address = Reader.read64();
+    Sec.Size = Reader.read64();
+    Sec.Alignment = Reader.read32();
+    Sec.IsCode = Reader.read32() & 1;
+    Sec.IsReadOnly = Reader.read32() & 1;
+    Sec.Contents = Reader.readBytes(Sec.Size).str();
+    Result.Sections.push_back(std::move(Sec));
+  }
+
+  if (Reader.hasError() || !Reader.atEnd())
+    return None;
+
+  return Result;
+}
+
+void RuntimeImageCache::store(StringRef Key, const Image &Image) const {
+  if (std::error_code EC = sys::fs::create_directories(Directory)) {
+    errs() << "BOLT-WARNING: cannot create runtime library cache directory "
+           << Directory << ": " << EC.message() << '\n';
+    return;
+  }
+
+  // Write the entry to a temporary file in the cache directory and move it
+  // into place, so that concurrent jobs sharing the cache never read a
+  // partial entry and the rename never crosses a filesystem boundary.
+  SmallString<128> TmpModel(Directory);
+  sys::path::append(TmpModel, "bolt-rtimage-%%%%%%.tmp");
+  SmallString<128> TmpPath;
+  int TmpFD;
+  if (std::error_code EC =
+          sys::fs::createUniqueFile(TmpModel, TmpFD, TmpPath)) {
+    errs() << "BOLT-WARNING: cannot write runtime library cache entry: "
+           << EC.message() << '\n';
+    return;
+  }
+
+  {
+    raw_fd_ostream OS(TmpFD, /*shouldClose=*/true);
+    support::endian::Writer W(OS, support::little);
+    OS.write(ImageMagic, ImageMagicSize);
+    W.write<uint32_t>(ImageVersion);
+
+    W.write<uint32_t>(Image.ExternalSymbols.size());
+    for (const std::pair<std::string, uint64_t> &KV : Image.ExternalSymbols) {
+      writeString(W, KV.first);
+      W.write<uint64_t>(KV.second);
+    }
+
+    W.write<uint32_t>(Image.Symbols.size());
+    for (const std::pair<std::string, uint64_t> &KV : Image.Symbols) {
+      writeString(W, KV.first);
+      W.write<uint64_t>(KV.second);
+    }
+
+    W.write<uint32_t>(Image.Sections.size());
+    for (const Section &Sec : Image.Sections) {
+      writeString(W, Sec.Name);
+      W.write<uint64_t>(Sec.Address);
+      W.write<uint64_t>(Sec.Size);
+      W.write<uint32_t>(Sec.Alignment);
+      W.write<uint32_t>(Sec.IsCode);
+      W.write<uint32_t>(Sec.IsReadOnly);
+      OS << Sec.Contents;
+    }
+  }
+
+  if (std::error_code EC =
+          sys::fs::rename(TmpPath, entryPath(Directory, Key))) {
+    errs() << "BOLT-WARNING: cannot store runtime library cache entry: "
+           << EC.message() << '\n';
+    sys::fs::remove(TmpPath);
+  }
+}
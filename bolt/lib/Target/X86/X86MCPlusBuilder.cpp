@@ -23,6 +23,7 @@
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/ErrorOr.h"
+#include <functional>
 #include <set>
 
 #define DEBUG_TYPE "mcplus"
@@ -444,6 +445,10 @@ public:
     return (CC != X86::COND_INVALID);
   }
 
+  bool isEqualityCondCode(unsigned CC) const override {
+    return (CC == X86::COND_E);
+  }
+
   bool isBreakpoint(const MCInst &Inst) const override {
     return Inst.getOpcode() == X86::INT3;
   }
@@ -2020,7 +2025,7 @@ public:
 
     Inst.setOpcode(NewOpcode);
     removeAnnotation(Inst, MCPlus::MCAnnotation::kTailCall);
-    removeAnnotation(Inst, "Offset");
+    clearOffset(Inst);
     return true;
   }
 
@@ -3129,6 +3134,19 @@ public:
     return true;
   }
 
+  bool createPrefetch(MCInst &Inst, const MCSymbol *Target,
+                      MCContext *Ctx) const override {
+    Inst.clear();
+    Inst.setOpcode(X86::PREFETCHT0);
+    Inst.addOperand(MCOperand::createReg(X86::RIP));        // BaseReg
+    Inst.addOperand(MCOperand::createImm(1));               // ScaleAmt
+    Inst.addOperand(MCOperand::createReg(X86::NoRegister)); // IndexReg
+    Inst.addOperand(MCOperand::createExpr(MCSymbolRefExpr::create(
+        Target, MCSymbolRefExpr::VK_None, *Ctx)));          // Displacement
+    Inst.addOperand(MCOperand::createReg(X86::NoRegister)); // AddrSegmentReg
+    return true;
+  }
+
   bool createCall(MCInst &Inst, const MCSymbol *Target,
                   MCContext *Ctx) override {
     Inst.setOpcode(X86::CALL64pcrel32);
@@ -3400,10 +3418,16 @@ public:
   }
 
   void createInstrIncMemory(InstructionListType &Instrs, const MCSymbol *Target,
-                            MCContext *Ctx, bool IsLeaf) const override {
+                            MCContext *Ctx, bool IsLeaf, unsigned CounterShards,
+                            unsigned SampleMask) const override {
     unsigned int I = 0;
 
-    Instrs.resize(IsLeaf ? 13 : 11);
+    // Sharded and sampled increments need two scratch registers to compute
+    // the address of the counter slot inside the slab selected for this
+    // thread; sampling adds the timestamp-based counter selection on top.
+    const bool Indexed = CounterShards > 1 || SampleMask != 0;
+    Instrs.resize((IsLeaf ? 13 : 11) + (Indexed ? 9 : 0) +
+                  (SampleMask ? 8 : 0));
     // Don't clobber application red zone (ABI dependent)
     if (IsLeaf)
       createStackPointerIncrement(Instrs[I++], 128,
@@ -3419,8 +3443,123 @@ public:
     createPushRegister(Instrs[I++], X86::RAX, 8);
     createClearRegWithNoEFlagsUpdate(Instrs[I++], X86::RAX, 8);
     createX86SaveOVFlagToRegister(Instrs[I++], X86::AL);
-    // LOCK INC
-    createIncMemory(Instrs[I++], Target, Ctx);
+    if (Indexed) {
+      // Pick a counter slab by hashing the thread pointer, so threads mostly
+      // update private cache lines: slab N starts N * __bolt_instr_slab_stride
+      // bytes past the slab-zero slot the counter label points to. Flags were
+      // already saved above, so clobbering them here is fine. The LOCK prefix
+      // is kept because two threads can still hash into the same slab.
+      createPushRegister(Instrs[I++], X86::RBX, 8);
+      createPushRegister(Instrs[I++], X86::RCX, 8);
+      // MOV %fs:0, %rbx - load the thread pointer
+      MCInst &LoadTP = Instrs[I++];
+      LoadTP.setOpcode(X86::MOV64rm);
+      LoadTP.clear();
+      LoadTP.addOperand(MCOperand::createReg(X86::RBX));
+      LoadTP.addOperand(MCOperand::createReg(X86::NoRegister)); // BaseReg
+      LoadTP.addOperand(MCOperand::createImm(1));               // ScaleAmt
+      LoadTP.addOperand(MCOperand::createReg(X86::NoRegister)); // IndexReg
+      LoadTP.addOperand(MCOperand::createImm(0));               // Displacement
+      LoadTP.addOperand(MCOperand::createReg(X86::FS)); // AddrSegmentReg
+      // SHR $12, %rbx; AND $(CounterShards - 1), %rbx - hash to a slab index
+      MCInst &Shift = Instrs[I++];
+      Shift.setOpcode(X86::SHR64ri);
+      Shift.clear();
+      Shift.addOperand(MCOperand::createReg(X86::RBX));
+      Shift.addOperand(MCOperand::createReg(X86::RBX));
+      Shift.addOperand(MCOperand::createImm(12));
+      MCInst &Mask = Instrs[I++];
+      Mask.setOpcode(X86::AND64ri32);
+      Mask.clear();
+      Mask.addOperand(MCOperand::createReg(X86::RBX));
+      Mask.addOperand(MCOperand::createReg(X86::RBX));
+      Mask.addOperand(MCOperand::createImm(CounterShards - 1));
+      // IMUL __bolt_instr_slab_stride(%rip), %rbx - slab byte offset
+      MCInst &Mul = Instrs[I++];
+      Mul.setOpcode(X86::IMUL64rm);
+      Mul.clear();
+      Mul.addOperand(MCOperand::createReg(X86::RBX));
+      Mul.addOperand(MCOperand::createReg(X86::RBX));
+      Mul.addOperand(MCOperand::createReg(X86::RIP));           // BaseReg
+      Mul.addOperand(MCOperand::createImm(1));                  // ScaleAmt
+      Mul.addOperand(MCOperand::createReg(X86::NoRegister));    // IndexReg
+      Mul.addOperand(MCOperand::createExpr(MCSymbolRefExpr::create(
+          Ctx->getOrCreateSymbol("__bolt_instr_slab_stride"),
+          MCSymbolRefExpr::VK_None, *Ctx)));                    // Displacement
+      Mul.addOperand(MCOperand::createReg(X86::NoRegister)); // AddrSegmentReg
+      // LEA Target(%rip), %rcx; LOCK INC (%rcx,%rbx,1)
+      MCInst &Lea = Instrs[I++];
+      Lea.setOpcode(X86::LEA64r);
+      Lea.clear();
+      Lea.addOperand(MCOperand::createReg(X86::RCX));
+      Lea.addOperand(MCOperand::createReg(X86::RIP));           // BaseReg
+      Lea.addOperand(MCOperand::createImm(1));                  // ScaleAmt
+      Lea.addOperand(MCOperand::createReg(X86::NoRegister));    // IndexReg
+      Lea.addOperand(MCOperand::createExpr(
+          MCSymbolRefExpr::create(Target, MCSymbolRefExpr::VK_None,
+                                  *Ctx)));                      // Displacement
+      Lea.addOperand(MCOperand::createReg(X86::NoRegister)); // AddrSegmentReg
+      if (SampleMask) {
+        // Record only executions whose timestamp counter has all SampleMask
+        // bits clear and steer the rest to the slab-local sink slot, so cold
+        // paths never touch the real counter's cache line. The mask lives in
+        // writable data (__bolt_instr_sample_mask) and can be retuned at
+        // runtime. RAX currently holds the overflow flag byte and RDX is
+        // live in the application, so preserve both around RDTSC.
+        createPushRegister(Instrs[I++], X86::RAX, 8);
+        createPushRegister(Instrs[I++], X86::RDX, 8);
+        MCInst &Tsc = Instrs[I++];
+        Tsc.setOpcode(X86::RDTSC);
+        Tsc.clear();
+        // AND __bolt_instr_sample_mask(%rip), %eax - ZF set when sampled
+        MCInst &Test = Instrs[I++];
+        Test.setOpcode(X86::AND32rm);
+        Test.clear();
+        Test.addOperand(MCOperand::createReg(X86::EAX));
+        Test.addOperand(MCOperand::createReg(X86::EAX));
+        Test.addOperand(MCOperand::createReg(X86::RIP));        // BaseReg
+        Test.addOperand(MCOperand::createImm(1));               // ScaleAmt
+        Test.addOperand(MCOperand::createReg(X86::NoRegister)); // IndexReg
+        Test.addOperand(MCOperand::createExpr(MCSymbolRefExpr::create(
+            Ctx->getOrCreateSymbol("__bolt_instr_sample_mask"),
+            MCSymbolRefExpr::VK_None, *Ctx)));                  // Displacement
+        Test.addOperand(MCOperand::createReg(X86::NoRegister)); // SegmentReg
+        // LEA __bolt_instr_sink(%rip), %rdx; CMOVNE %rdx, %rcx
+        MCInst &Sink = Instrs[I++];
+        Sink.setOpcode(X86::LEA64r);
+        Sink.clear();
+        Sink.addOperand(MCOperand::createReg(X86::RDX));
+        Sink.addOperand(MCOperand::createReg(X86::RIP));        // BaseReg
+        Sink.addOperand(MCOperand::createImm(1));               // ScaleAmt
+        Sink.addOperand(MCOperand::createReg(X86::NoRegister)); // IndexReg
+        Sink.addOperand(MCOperand::createExpr(MCSymbolRefExpr::create(
+            Ctx->getOrCreateSymbol("__bolt_instr_sink"),
+            MCSymbolRefExpr::VK_None, *Ctx)));                  // Displacement
+        Sink.addOperand(MCOperand::createReg(X86::NoRegister)); // SegmentReg
+        MCInst &Select = Instrs[I++];
+        Select.setOpcode(X86::CMOV64rr);
+        Select.clear();
+        Select.addOperand(MCOperand::createReg(X86::RCX));
+        Select.addOperand(MCOperand::createReg(X86::RCX));
+        Select.addOperand(MCOperand::createReg(X86::RDX));
+        Select.addOperand(MCOperand::createImm(X86::COND_NE));
+        createPopRegister(Instrs[I++], X86::RDX, 8);
+        createPopRegister(Instrs[I++], X86::RAX, 8);
+      }
+      MCInst &Inc = Instrs[I++];
+      Inc.setOpcode(X86::LOCK_INC64m);
+      Inc.clear();
+      Inc.addOperand(MCOperand::createReg(X86::RCX));           // BaseReg
+      Inc.addOperand(MCOperand::createImm(1));                  // ScaleAmt
+      Inc.addOperand(MCOperand::createReg(X86::RBX));           // IndexReg
+      Inc.addOperand(MCOperand::createImm(0));                  // Displacement
+      Inc.addOperand(MCOperand::createReg(X86::NoRegister)); // AddrSegmentReg
+      createPopRegister(Instrs[I++], X86::RCX, 8);
+      createPopRegister(Instrs[I++], X86::RBX, 8);
+    } else {
+      // LOCK INC
+      createIncMemory(Instrs[I++], Target, Ctx);
+    }
     // POPF
     createAddRegImm(Instrs[I++], X86::AL, 127, 1);
     createPopRegister(Instrs[I++], X86::RAX, 8);
@@ -3808,10 +3947,9 @@ public:
 
         if (CallOrJmp.getOpcode() == X86::CALL64r ||
             CallOrJmp.getOpcode() == X86::CALL64pcrel32) {
-          if (hasAnnotation(CallInst, "Offset"))
+          if (Optional<uint32_t> Offset = getOffset(CallInst))
             // Annotated as duplicated call
-            addAnnotation(CallOrJmp, "Offset",
-                          getAnnotationAs<uint32_t>(CallInst, "Offset"));
+            setOffset(CallOrJmp, *Offset);
         }
 
         if (isInvoke(CallInst) && !isInvoke(CallOrJmp)) {
@@ -3864,7 +4002,8 @@ public:
       const std::vector<MCInst *> &TargetFetchInsns,
       MCContext *Ctx) const override {
     assert(getJumpTable(IJmpInst) != 0);
-    uint16_t IndexReg = getAnnotationAs<uint16_t>(IJmpInst, "JTIndexReg");
+    uint16_t IndexReg = getAnnotationAs<uint16_t>(
+        IJmpInst, MCPlus::MCAnnotation::kJTIndexReg);
     if (IndexReg == 0)
       return BlocksVectorTy();
 
@@ -3919,6 +4058,95 @@ public:
     return Results;
   }
 
+  BlocksVectorTy jumpTableLadderPromotion(
+      const MCInst &IJmpInst,
+      const std::vector<std::pair<MCSymbol *, uint64_t>> &Targets,
+      const std::vector<MCInst *> &TargetFetchInsns,
+      MCContext *Ctx) const override {
+    assert(getJumpTable(IJmpInst) != 0);
+    uint16_t IndexReg = getAnnotationAs<uint16_t>(
+        IJmpInst, MCPlus::MCAnnotation::kJTIndexReg);
+    if (IndexReg == 0)
+      return BlocksVectorTy();
+
+    std::vector<std::pair<MCSymbol *, uint64_t>> SortedTargets(Targets);
+    std::sort(SortedTargets.begin(), SortedTargets.end(),
+              [](const std::pair<MCSymbol *, uint64_t> &A,
+                 const std::pair<MCSymbol *, uint64_t> &B) {
+                return A.second < B.second;
+              });
+
+    for (const std::pair<MCSymbol *, uint64_t> &Target : SortedTargets) {
+      // Immediate index is out of sign extended 32 bit range.
+      if (int64_t(Target.second) != int64_t(int32_t(Target.second)))
+        return BlocksVectorTy();
+    }
+
+    BlocksVectorTy Results;
+    MCSymbol *FallbackTarget = Ctx->createNamedTempSymbol();
+
+    const auto createCompare = [&](InstructionListType &Insts, uint64_t Imm) {
+      Insts.emplace_back(MCInst());
+      MCInst &CompareInst = Insts.back();
+      CompareInst.setLoc(IJmpInst.getLoc());
+      CompareInst.setOpcode(X86::CMP64ri32);
+      CompareInst.addOperand(MCOperand::createReg(IndexReg));
+      CompareInst.addOperand(MCOperand::createImm(Imm));
+      shortenInstruction(CompareInst);
+    };
+
+    const auto createCondBranch = [&](InstructionListType &Insts,
+                                      const MCSymbol *Target, unsigned CC) {
+      Insts.emplace_back(MCInst());
+      MCInst &JccInst = Insts.back();
+      JccInst.setLoc(IJmpInst.getLoc());
+      JccInst.setOpcode(X86::JCC_1);
+      JccInst.addOperand(MCOperand::createExpr(
+          MCSymbolRefExpr::create(Target, MCSymbolRefExpr::VK_None, *Ctx)));
+      JccInst.addOperand(MCOperand::createImm(CC));
+    };
+
+    // Emit the ladder for [Lo, Hi) in pre-order: an internal block branches
+    // over the blocks of its left half to reach its right half, so every
+    // branch targets a block emitted later.
+    std::function<void(size_t, size_t, MCSymbol *)> emitRange =
+        [&](size_t Lo, size_t Hi, MCSymbol *Label) {
+          Results.emplace_back(Label, InstructionListType());
+          InstructionListType &CurBB = Results.back().second;
+
+          if (Hi - Lo == 1) {
+            // Leaf: dispatch one index or fall back to the indirect jump.
+            createCompare(CurBB, SortedTargets[Lo].second);
+            createCondBranch(CurBB, SortedTargets[Lo].first, X86::COND_E);
+            CurBB.emplace_back(MCInst());
+            MCInst &JmpInst = CurBB.back();
+            JmpInst.setLoc(IJmpInst.getLoc());
+            createUncondBranch(JmpInst, FallbackTarget, Ctx);
+            return;
+          }
+
+          const size_t Mid = Lo + (Hi - Lo) / 2;
+          MCSymbol *RightLabel = Ctx->createNamedTempSymbol();
+          createCompare(CurBB, SortedTargets[Mid].second);
+          createCondBranch(CurBB, RightLabel, X86::COND_AE);
+          emitRange(Lo, Mid, Ctx->createNamedTempSymbol());
+          emitRange(Mid, Hi, RightLabel);
+        };
+
+    emitRange(0, SortedTargets.size(), nullptr);
+
+    // Fallback block with the original indirect jump.
+    Results.emplace_back(FallbackTarget, InstructionListType());
+    InstructionListType &CurBB = Results.back().second;
+    for (const MCInst *Inst : TargetFetchInsns)
+      if (Inst != &IJmpInst)
+        CurBB.push_back(*Inst);
+
+    CurBB.push_back(IJmpInst);
+
+    return Results;
+  }
+
 private:
   bool createMove(MCInst &Inst, const MCSymbol *Src, unsigned Reg,
                   MCContext *Ctx) const {
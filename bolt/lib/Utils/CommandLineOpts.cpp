@@ -56,6 +56,14 @@ BucketsPerLine("line-size",
   cl::Optional,
   cl::sub(HeatmapCommand));
 
+cl::opt<bool>
+ColdCompress("compress-cold-code",
+  cl::desc("store cold code compressed in the output binary and inject "
+           "runtime support to decompress it on startup"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 cl::opt<bool>
 DiffOnly("diff-only",
   cl::desc("stop processing once we have enough to compare two binaries"),
@@ -82,12 +90,28 @@ ExecutionCountThreshold("execution-count-threshold",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+cl::opt<bool>
+HeatmapBinary("binary",
+  cl::desc("write the heat map in the compact binary format instead of "
+           "ASCII; the file stores 4KB and 2MB resolutions in addition to "
+           "block-size"),
+  cl::init(false),
+  cl::Optional,
+  cl::sub(HeatmapCommand));
+
 cl::opt<unsigned>
 HeatmapBlock("block-size",
   cl::desc("size of a heat map block in bytes (default 64)"),
   cl::init(64),
   cl::sub(HeatmapCommand));
 
+cl::opt<std::string>
+HeatmapDiff("diff",
+  cl::desc("<file1>,<file2> print the divergence between two binary heat "
+           "maps instead of generating one"),
+  cl::Optional,
+  cl::sub(HeatmapCommand));
+
 cl::opt<std::string>
 HeatmapFile("o",
   cl::init("-"),
@@ -102,6 +126,13 @@ HeatmapMaxAddress("max-address",
   cl::Optional,
   cl::sub(HeatmapCommand));
 
+cl::opt<std::string>
+HeatmapMerge("merge",
+  cl::desc("comma-separated binary heat maps to merge into the file given "
+           "by -o instead of generating one"),
+  cl::Optional,
+  cl::sub(HeatmapCommand));
+
 cl::opt<unsigned long long>
 HeatmapMinAddress("min-address",
   cl::init(0x0),
@@ -131,6 +162,13 @@ cl::opt<bool> HotText(
         "will put hot code into 2M pages. This requires relocation."),
     cl::ZeroOrMore, cl::cat(BoltCategory));
 
+cl::opt<bool> HugifyData(
+    "hugify-data",
+    cl::desc("with -hugify, also put the profile-hot data placed first by "
+             "-reorder-data on 2MB page(s) at runtime. The cold remainder "
+             "stays on regular pages."),
+    cl::ZeroOrMore, cl::cat(BoltCategory));
+
 cl::opt<std::string>
 InputFilename(
   cl::Positional,
@@ -184,6 +222,14 @@ SplitEH("split-eh",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+cl::opt<bool>
+SplitRegions("split-regions",
+  cl::desc("assign split fragments and never-executed functions to warm, "
+           "cold, and frozen code sections based on execution counts"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 cl::opt<bool>
 StrictMode("strict",
   cl::desc("trust the input to be from a well-formed source"),
@@ -210,6 +256,24 @@ UpdateDebugSections("update-debug-sections",
   cl::ZeroOrMore,
   cl::cat(BoltCategory));
 
+cl::opt<ValidationLevel>
+Validate("validate",
+  cl::desc("degree of internal consistency checking"),
+  cl::init(VL_FULL),
+  cl::values(
+    clEnumValN(VL_OFF,
+      "off",
+      "skip optional validation"),
+    clEnumValN(VL_FAST,
+      "fast",
+      "run cheap checks everywhere, expensive checks only on functions "
+      "modified by the current run"),
+    clEnumValN(VL_FULL,
+      "full",
+      "run all checks on all functions")),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 cl::opt<unsigned>
 Verbosity("v",
   cl::desc("set verbosity level for diagnostic output"),
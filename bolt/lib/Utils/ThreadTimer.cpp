@@ -0,0 +1,111 @@
+//===- bolt/Utils/ThreadTimer.cpp - Lock-free region timing ---------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Implementation of lock-free per-thread region timing.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bolt/Utils/ThreadTimer.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace llvm;
+using namespace bolt;
+
+std::atomic<ThreadTimer *> ThreadTimer::List{nullptr};
+
+namespace {
+
+uint64_t monotonicNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/// Timestamp-counter and monotonic-clock readings taken when the first timer
+/// is constructed. A second pair taken at report time spans (nearly) the
+/// whole run, giving an accurate cycles-to-seconds conversion without
+/// needing to know the counter frequency up front.
+uint64_t BaseNanos;
+uint64_t BaseCycles;
+std::atomic<bool> Calibrated{false};
+
+/// Prints the report when static destructors run, mirroring how LLVM's
+/// timer groups report at exit. ThreadTimer instances have trivial
+/// destructors and static storage, so reading them here is safe regardless
+/// of destruction order across translation units.
+struct ReportPrinter {
+  ~ReportPrinter() { ThreadTimer::printAll(errs()); }
+} Printer;
+
+} // anonymous namespace
+
+uint64_t ThreadTimer::readCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return monotonicNanos();
+#endif
+}
+
+ThreadTimer::ThreadTimer(const char *Name, const char *Description,
+                         const char *GroupDescription)
+    : Name(Name), Description(Description),
+      GroupDescription(GroupDescription) {
+  Next = List.load(std::memory_order_relaxed);
+  while (!List.compare_exchange_weak(Next, this, std::memory_order_release,
+                                     std::memory_order_relaxed))
+    ;
+  bool Expected = false;
+  if (Calibrated.compare_exchange_strong(Expected, true)) {
+    BaseNanos = monotonicNanos();
+    BaseCycles = readCycleCounter();
+  }
+}
+
+void ThreadTimer::add(uint64_t Cycles) {
+  static std::atomic<unsigned> NextSlotId{0};
+  thread_local unsigned SlotId =
+      NextSlotId.fetch_add(1, std::memory_order_relaxed) % NumSlots;
+  Slots[SlotId].Cycles.fetch_add(Cycles, std::memory_order_relaxed);
+}
+
+void ThreadTimer::printAll(raw_ostream &OS) {
+  if (!Calibrated.load(std::memory_order_acquire))
+    return;
+
+  const uint64_t NowNanos = monotonicNanos();
+  const uint64_t NowCycles = readCycleCounter();
+  const double CyclesPerNano =
+      NowNanos > BaseNanos
+          ? static_cast<double>(NowCycles - BaseCycles) / (NowNanos - BaseNanos)
+          : 1.0;
+
+  bool PrintedHeader = false;
+  for (ThreadTimer *T = List.load(std::memory_order_acquire); T;
+       T = T->Next) {
+    uint64_t Total = 0;
+    for (Slot &S : T->Slots)
+      Total += S.Cycles.exchange(0, std::memory_order_relaxed);
+    if (Total == 0)
+      continue;
+    if (!PrintedHeader) {
+      OS << "BOLT-INFO: lock-free region timers, CPU time summed across "
+            "threads:\n";
+      PrintedHeader = true;
+    }
+    const double Seconds = Total / CyclesPerNano / 1e9;
+    OS << format("BOLT-INFO: %12.4fs  %s - %s (%s)\n", Seconds, T->Description,
+                 T->GroupDescription, T->Name);
+  }
+}
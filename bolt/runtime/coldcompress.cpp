@@ -0,0 +1,141 @@
+//===- bolt/runtime/coldcompress.cpp --------------------------------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#if defined (__x86_64__)
+#if !defined(__APPLE__)
+
+#include "common.h"
+#include <sys/mman.h>
+
+// Function pointer to the binary entry point, so we can resume regular
+// execution once the cold code has been restored.
+extern void (*__bolt_coldcompress_init_ptr)();
+
+// Boundaries of the cold code section set by BOLT. The section starts with a
+// header followed by a compressed image of its original contents; the rest of
+// the section is zero-filled in the file.
+extern uint64_t __bolt_cold_start;
+extern uint64_t __bolt_cold_end;
+
+// Must be kept in sync with ColdCompressRuntimeLibrary. Reads "BOLTCC01".
+static constexpr uint64_t ColdCompressMagic = 0x31304343544c4f42ULL;
+
+struct ColdCompressHeader {
+  uint64_t Magic;
+  uint64_t CompressedSize;
+  uint64_t UncompressedSize;
+};
+
+/// Decode the LZ stream produced by ColdCompressRuntimeLibrary::compress():
+/// a control byte less than 0x80 introduces a run of (control + 1) literal
+/// bytes; a control byte with the top bit set introduces a match of
+/// ((control & 0x7f) + 4) bytes at the 16-bit little-endian distance that
+/// follows the control byte. Returns the number of bytes written.
+static uint64_t decompress(uint8_t *Out, const uint8_t *In, uint64_t InSize) {
+  const uint8_t *const OutStart = Out;
+  const uint8_t *const InEnd = In + InSize;
+  while (In < InEnd) {
+    const uint8_t Control = *In++;
+    if (Control < 0x80) {
+      uint64_t Len = Control + 1;
+      while (Len--)
+        *Out++ = *In++;
+      continue;
+    }
+    uint64_t Len = (Control & 0x7f) + 4;
+    const uint64_t Distance = In[0] | (In[1] << 8);
+    In += 2;
+    // Copy byte by byte: a match may overlap its own output.
+    const uint8_t *Src = Out - Distance;
+    while (Len--)
+      *Out++ = *Src++;
+  }
+  return Out - OutStart;
+}
+
+extern "C" void __bolt_coldcompress_self_impl() {
+  uint8_t *ColdStart = (uint8_t *)&__bolt_cold_start;
+  uint8_t *ColdEnd = (uint8_t *)&__bolt_cold_end;
+  if (ColdStart >= ColdEnd)
+    return;
+
+  const ColdCompressHeader *Header = (const ColdCompressHeader *)ColdStart;
+  // BOLT leaves the section uncompressed when compression does not pay off.
+  if (Header->Magic != ColdCompressMagic)
+    return;
+
+  const uint64_t PageMask = 4096 - 1;
+  uint8_t *From = ColdStart - ((uint64_t)ColdStart & PageMask);
+  uint8_t *To = ColdEnd + PageMask;
+  To -= (uint64_t)To & PageMask;
+
+  // Only the pages holding the header and the compressed image, plus the
+  // partial pages shared with neighboring sections, carry meaningful bytes.
+  // Copy those out, replace the whole range with an anonymous mapping so the
+  // zero-filled remainder of the section never pages in from the file, and
+  // reconstruct the section contents.
+  uint8_t *BlobEnd = ColdStart + sizeof(ColdCompressHeader) +
+                     Header->CompressedSize;
+  uint8_t *HeadEnd = BlobEnd + PageMask;
+  HeadEnd -= (uint64_t)HeadEnd & PageMask;
+  if (HeadEnd > To)
+    HeadEnd = To;
+  uint8_t *TailStart = ColdEnd - ((uint64_t)ColdEnd & PageMask);
+  if (TailStart < HeadEnd)
+    TailStart = HeadEnd;
+
+  const uint64_t HeadSize = HeadEnd - From;
+  const uint64_t TailSize = To - TailStart;
+
+  uint8_t *Temp = reinterpret_cast<uint8_t *>(
+      __mmap(0, HeadSize + TailSize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (Temp == (void *)MAP_FAILED) {
+    char Msg[] = "could not allocate memory for cold code decompression\n";
+    reportError(Msg, sizeof(Msg));
+  }
+
+  memCpy(Temp, From, HeadSize);
+  memCpy(Temp + HeadSize, TailStart, TailSize);
+
+  if (__mmap(reinterpret_cast<uint64_t>(From), To - From,
+             PROT_READ | PROT_WRITE | PROT_EXEC,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
+             0) == (void *)MAP_FAILED) {
+    char Msg[] = "failed to remap cold code section\n";
+    reportError(Msg, sizeof(Msg));
+  }
+
+  // Put back the bytes that belong to neighboring sections.
+  memCpy(From, Temp, ColdStart - From);
+  memCpy(ColdEnd, Temp + HeadSize + (ColdEnd - TailStart), To - ColdEnd);
+
+  const uint64_t Written =
+      decompress(ColdStart,
+                 Temp + (ColdStart + sizeof(ColdCompressHeader) - From),
+                 Header->CompressedSize);
+  if (Written != Header->UncompressedSize) {
+    char Msg[] = "cold code image failed to decompress\n";
+    reportError(Msg, sizeof(Msg));
+  }
+
+  __mprotect(From, To - From, PROT_READ | PROT_EXEC);
+  __munmap(Temp, HeadSize + TailSize);
+}
+
+/// This is hooking ELF's entry, it needs to save all machine state.
+extern "C" __attribute((naked)) void __bolt_coldcompress_self() {
+  __asm__ __volatile__(SAVE_ALL
+                       "call __bolt_coldcompress_self_impl\n"
+                       RESTORE_ALL
+                       "jmp *__bolt_coldcompress_init_ptr(%%rip)\n"
+                       :::);
+}
+
+#endif
+#endif
@@ -440,6 +440,16 @@ int __kill(uint64_t pid, int sig) {
   return ret;
 }
 
+int __setpriority(int which, uint64_t who, int prio) {
+  int ret;
+  __asm__ __volatile__("movq $141, %%rax\n"
+                       "syscall\n"
+                       : "=a"(ret)
+                       : "D"(which), "S"(who), "d"(prio)
+                       : "cc", "rcx", "r11", "memory");
+  return ret;
+}
+
 int __fsync(int fd) {
   int ret;
   __asm__ __volatile__("movq $74, %%rax\n"
@@ -450,6 +460,26 @@ int __fsync(int fd) {
   return ret;
 }
 
+int __ftruncate(uint64_t fd, uint64_t length) {
+  int ret;
+  __asm__ __volatile__("movq $77, %%rax\n"
+                       "syscall\n"
+                       : "=a"(ret)
+                       : "D"(fd), "S"(length)
+                       : "cc", "rcx", "r11", "memory");
+  return ret;
+}
+
+int __unlink(const char *pathname) {
+  int ret;
+  __asm__ __volatile__("movq $87, %%rax\n"
+                       "syscall\n"
+                       : "=a"(ret)
+                       : "D"(pathname)
+                       : "cc", "rcx", "r11", "memory");
+  return ret;
+}
+
 #endif
 
 void reportError(const char *Msg, uint64_t Size) {
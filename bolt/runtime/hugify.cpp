@@ -24,6 +24,17 @@ extern void (*__bolt_hugify_init_ptr)();
 extern uint64_t __hot_start;
 extern uint64_t __hot_end;
 
+// Number of huge pages to back, computed by BOLT's huge-page-aware function
+// packing. Zero when the layout was not packed by pages, in which case the
+// whole hot text range is used.
+extern uint64_t __bolt_hugify_page_count;
+
+// The hot data range produced by BOLT's data reordering. The values hold the
+// addresses of the __hot_data_start/__hot_data_end markers and are zero when
+// -hugify-data was not requested.
+extern uint64_t __bolt_hugify_hot_data_start;
+extern uint64_t __bolt_hugify_hot_data_end;
+
 #ifdef MADV_HUGEPAGE
 /// Check whether the kernel supports THP via corresponding sysfs entry.
 static bool has_pagecache_thp_support() {
@@ -84,6 +95,31 @@ static void hugify_for_old_kernel(uint8_t *from, uint8_t *to) {
 
   __munmap(mem, size);
 }
+
+/// Back the profile-hot data range with huge pages. Unlike the text path,
+/// the range is shrunk to whole huge pages instead of extended: the copy
+/// based fallback used for old kernels would disturb the protection of
+/// neighboring sections, so only madvise-capable kernels are handled and
+/// only pages fully owned by the hot data are touched.
+static void hugify_hot_data(uint8_t *start, uint8_t *end) {
+  const size_t hugePageBytes = 2L * 1024 * 1024;
+  uint8_t *from = start + (hugePageBytes - 1);
+  from -= (intptr_t)from & (hugePageBytes - 1);
+  uint8_t *to = end - ((intptr_t)end & (hugePageBytes - 1));
+
+#ifdef ENABLE_DEBUG
+  reportNumber("[hugify] hot data start: ", (uint64_t)start, 16);
+  reportNumber("[hugify] hot data end: ", (uint64_t)end, 16);
+#endif
+
+  if (from >= to || !has_pagecache_thp_support())
+    return;
+
+  if (__madvise(from, (to - from), MADV_HUGEPAGE) == -1) {
+    char msg[] = "failed to allocate large page for hot data\n";
+    reportError(msg, sizeof(msg));
+  }
+}
 #endif
 
 extern "C" void __bolt_hugify_self_impl() {
@@ -96,6 +132,12 @@ extern "C" void __bolt_hugify_self_impl() {
   uint8_t *to = hotEnd + (hugePageBytes - 1);
   to -= (intptr_t)to & (hugePageBytes - 1);
 
+  // When the layout was packed by huge-page bins, only back the pages that
+  // hold the packed hot clusters instead of the whole hot text range.
+  if (__bolt_hugify_page_count &&
+      (uint64_t)(to - from) > __bolt_hugify_page_count * hugePageBytes)
+    to = from + __bolt_hugify_page_count * hugePageBytes;
+
 #ifdef ENABLE_DEBUG
   reportNumber("[hugify] hot start: ", (uint64_t)hotStart, 16);
   reportNumber("[hugify] hot end: ", (uint64_t)hotEnd, 16);
@@ -105,14 +147,15 @@ extern "C" void __bolt_hugify_self_impl() {
 
   if (!has_pagecache_thp_support()) {
     hugify_for_old_kernel(from, to);
-    return;
-  }
-
-  if (__madvise(from, (to - from), MADV_HUGEPAGE) == -1) {
+  } else if (__madvise(from, (to - from), MADV_HUGEPAGE) == -1) {
     char msg[] = "failed to allocate large page\n";
     // TODO: allow user to control the failure behavior.
     reportError(msg, sizeof(msg));
   }
+
+  if (__bolt_hugify_hot_data_start != __bolt_hugify_hot_data_end)
+    hugify_hot_data((uint8_t *)__bolt_hugify_hot_data_start,
+                    (uint8_t *)__bolt_hugify_hot_data_end);
 #endif
 }
 
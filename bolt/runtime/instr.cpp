@@ -97,6 +97,25 @@ extern char __bolt_instr_binpath[];
 // If true, append current PID to the fdata filename when creating it so
 // different invocations of the same program can be differentiated.
 extern bool __bolt_instr_use_pid;
+// If true, write the profile in the binary fdata container instead of the
+// text format. Understood by merge-fdata and by BOLT's profile readers, and
+// much cheaper to produce for periodic dumps of large binaries.
+extern bool __bolt_instr_binary_dump;
+// If true, back the counters in __bolt_instr_locations with a named
+// shared-memory segment under /dev/shm so an external tool can map and
+// snapshot them while this process runs, without us doing any I/O.
+extern bool __bolt_instr_use_shmem;
+// Number of replicas (slabs) of the counter region. Each thread hashes into
+// one slab to avoid cache-line contention on hot counters, and the dump code
+// below folds the slabs into a single snapshot before writing the profile.
+// Every slab carries one trailing sink slot absorbing increments skipped by
+// sampling.
+extern uint32_t __bolt_instr_num_shards;
+// Sampling mask applied to the timestamp counter by instrumented code: an
+// increment reaches the real counter only when all mask bits are clear, so a
+// mask of N-1 records roughly 1-in-N executions. Writable at runtime (e.g.
+// from an attached debugger) to retune the rate; zero records everything.
+extern uint32_t __bolt_instr_sample_mask;
 // Functions that will be used to instrument indirect calls. BOLT static pass
 // will identify indirect calls and modify them to load the address in these
 // trampolines and call this address instead. BOLT can't use direct calls to
@@ -395,6 +414,12 @@ IndirectCallHashTable *GlobalIndCallCounters{
 /// it
 Mutex *GlobalWriteProfileMutex{reinterpret_cast<Mutex *>(1)};
 
+/// Path of the named shared-memory segment backing our counters when
+/// __bolt_instr_use_shmem is set. Built by __bolt_instr_setup and removed
+/// from the filesystem by __bolt_instr_fini. Initialize the first byte so we
+/// don't go into .bss.
+char SharedCountersPath[64] = {'\1'};
+
 /// Store number of calls in additional to target address (Key) and frequency
 /// as perceived by the basic block counter (Val).
 struct CallFlowEntryBase : public SimpleHashTableEntryBase {
@@ -515,6 +540,16 @@ struct ProfileWriterContext {
   /// calls and correctly report them as [unknown] in output fdata.
   CallFlowHashTable *CallFlowTable;
 
+  /// True when the profile is written in the binary fdata container rather
+  /// than as text. Mirrors __bolt_instr_binary_dump; kept here so writer code
+  /// shared with the getter-based configuration needs no extern symbol.
+  bool BinaryProfile;
+  /// Number of branch records written so far in binary mode.
+  uint64_t NumBinaryRecords;
+  /// Highest string table offset referenced by a written record, used to size
+  /// the string table emitted at the end of a binary dump.
+  uint32_t MaxNameOffset;
+
   /// Lookup the sorted indirect call target vector to fetch function name and
   /// offset for an arbitrary function pointer.
   const IndCallTargetDescription *lookupIndCallTarget(uint64_t Target) const;
@@ -552,6 +587,56 @@ char *serializeLoc(const ProfileWriterContext &Ctx, char *OutBuf,
   return OutBuf;
 }
 
+///
+/// On-disk layout of the binary fdata container, produced instead of text
+/// when __bolt_instr_binary_dump is set. This mirrors
+/// bolt/include/bolt/Profile/ProfileBinaryFormat.h, which this freestanding
+/// code cannot include; the two definitions must be kept in sync.
+///
+struct ProfileBinaryHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t Flags;
+  uint64_t NumBranchEntries;
+  uint64_t StringTableOffset;
+  uint64_t StringTableSize;
+};
+
+struct ProfileBinaryBranchRecord {
+  uint32_t FromName;
+  uint32_t ToName;
+  uint64_t FromOffset;
+  uint64_t ToOffset;
+  uint64_t Mispreds;
+  uint64_t Count;
+};
+
+/// Name offset denoting a location outside any known symbol; [unknown] in
+/// the text format.
+const uint32_t UnknownNameOffset = ~0u;
+
+/// Append one branch record to the binary profile. A null \p From or \p To
+/// stands for [unknown]. Name fields reuse the offsets into the string table
+/// BOLT wrote next to the descriptions, so no name bytes are copied per
+/// record; the dump code remembers the highest referenced offset to size the
+/// copy of the table written at the end of the file.
+void writeBinaryRecord(ProfileWriterContext &Ctx, int FD, const Location *From,
+                       const Location *To, uint64_t Count) {
+  ProfileBinaryBranchRecord Rec;
+  Rec.FromName = From ? From->FunctionName : UnknownNameOffset;
+  Rec.ToName = To ? To->FunctionName : UnknownNameOffset;
+  Rec.FromOffset = From ? From->Offset : 0;
+  Rec.ToOffset = To ? To->Offset : 0;
+  Rec.Mispreds = 0;
+  Rec.Count = Count;
+  if (From && From->FunctionName > Ctx.MaxNameOffset)
+    Ctx.MaxNameOffset = From->FunctionName;
+  if (To && To->FunctionName > Ctx.MaxNameOffset)
+    Ctx.MaxNameOffset = To->FunctionName;
+  ++Ctx.NumBinaryRecords;
+  __write(FD, &Rec, sizeof(Rec));
+}
+
 /// Read and deserialize a function description written by BOLT. \p FuncDesc
 /// points at the beginning of the function metadata structure in the file.
 /// See Instrumentation::emitTablesAsELFNote()
@@ -656,6 +741,9 @@ static char *getBinaryPath() {
 
 ProfileWriterContext readDescriptions() {
   ProfileWriterContext Result;
+  Result.BinaryProfile = __bolt_instr_binary_dump;
+  Result.NumBinaryRecords = 0;
+  Result.MaxNameOffset = 0;
   char *BinPath = getBinaryPath();
   assert(BinPath && BinPath[0] != '\0', "failed to find binary path");
 
@@ -721,6 +809,10 @@ ProfileWriterContext readDescriptions() {
 
 ProfileWriterContext readDescriptions() {
   ProfileWriterContext Result;
+  // The binary container is only wired up for the ELF configuration.
+  Result.BinaryProfile = false;
+  Result.NumBinaryRecords = 0;
+  Result.MaxNameOffset = 0;
   uint8_t *Tables = _bolt_instr_tables_getter();
   uint32_t IndCallDescSize = *reinterpret_cast<uint32_t *>(Tables);
   uint32_t IndCallTargetDescSize =
@@ -1214,20 +1306,18 @@ void Graph::computeEdgeFrequencies(const uint64_t *Counters,
   DEBUG(dumpEdgeFreqs());
 }
 
-/// Write to \p FD all of the edge profiles for function \p FuncDesc. Uses
-/// \p Alloc to allocate helper dynamic structures used to compute profile for
-/// edges that we do not explictly instrument.
+/// Write to \p FD all of the edge profiles for function \p FuncDesc, reading
+/// counter values from \p Counters. Uses \p Alloc to allocate helper dynamic
+/// structures used to compute profile for edges that we do not explictly
+/// instrument.
 const uint8_t *writeFunctionProfile(int FD, ProfileWriterContext &Ctx,
                                     const uint8_t *FuncDesc,
+                                    const uint64_t *Counters,
                                     BumpPtrAllocator &Alloc) {
   const FunctionDescription F(FuncDesc);
   const uint8_t *next = FuncDesc + F.getSize();
 
-#if !defined(__APPLE__)
-  uint64_t *bolt_instr_locations = __bolt_instr_locations;
-#else
-  uint64_t *bolt_instr_locations = _bolt_instr_locations_getter();
-#endif
+  const uint64_t *bolt_instr_locations = Counters;
 
   // Skip funcs we know are cold
 #ifndef ENABLE_DEBUG
@@ -1269,6 +1359,10 @@ const uint8_t *writeFunctionProfile(int FD, ProfileWriterContext &Ctx,
     if (Freq == 0)
       continue;
     const EdgeDescription *Desc = &F.Edges[I];
+    if (Ctx.BinaryProfile) {
+      writeBinaryRecord(Ctx, FD, &Desc->From, &Desc->To, Freq);
+      continue;
+    }
     char LineBuf[BufSize];
     char *Ptr = LineBuf;
     Ptr = serializeLoc(Ctx, Ptr, Desc->From, BufSize);
@@ -1283,9 +1377,13 @@ const uint8_t *writeFunctionProfile(int FD, ProfileWriterContext &Ctx,
     const uint64_t Freq = G->CallFreqs[I];
     if (Freq == 0)
       continue;
+    const CallDescription *Desc = &F.Calls[I];
+    if (Ctx.BinaryProfile) {
+      writeBinaryRecord(Ctx, FD, &Desc->From, &Desc->To, Freq);
+      continue;
+    }
     char LineBuf[BufSize];
     char *Ptr = LineBuf;
-    const CallDescription *Desc = &F.Calls[I];
     Ptr = serializeLoc(Ctx, Ptr, Desc->From, BufSize);
     Ptr = serializeLoc(Ctx, Ptr, Desc->To, BufSize - (Ptr - LineBuf));
     Ptr = strCopy(Ptr, "0 ", BufSize - (Ptr - LineBuf) - 25);
@@ -1332,6 +1430,10 @@ void visitIndCallCounter(IndirectCallHashTable::MapEntry &Entry,
       Ctx->lookupIndCallTarget(Entry.Key);
   if (!TargetDesc) {
     DEBUG(report("Failed to lookup indirect call target\n"));
+    if (Ctx->BinaryProfile) {
+      writeBinaryRecord(*Ctx, FD, CallsiteDesc, nullptr, Entry.Val);
+      return;
+    }
     char LineBuf[BufSize];
     char *Ptr = LineBuf;
     Ptr = serializeLoc(*Ctx, Ptr, *CallsiteDesc, BufSize);
@@ -1342,6 +1444,10 @@ void visitIndCallCounter(IndirectCallHashTable::MapEntry &Entry,
     return;
   }
   Ctx->CallFlowTable->get(TargetDesc->Address).Calls += Entry.Val;
+  if (Ctx->BinaryProfile) {
+    writeBinaryRecord(*Ctx, FD, CallsiteDesc, &TargetDesc->Loc, Entry.Val);
+    return;
+  }
   char LineBuf[BufSize];
   char *Ptr = LineBuf;
   Ptr = serializeLoc(*Ctx, Ptr, *CallsiteDesc, BufSize);
@@ -1384,6 +1490,11 @@ void visitCallFlowEntry(CallFlowHashTable::MapEntry &Entry, int FD,
     DEBUG(report("WARNING: failed to look up call target!\n"));
     return;
   }
+  if (Ctx->BinaryProfile) {
+    writeBinaryRecord(*Ctx, FD, nullptr, &TargetDesc->Loc,
+                      Entry.Val - Entry.Calls);
+    return;
+  }
   char LineBuf[BufSize];
   char *Ptr = LineBuf;
   Ptr = strCopy(Ptr, "0 [unknown] 0 ", BufSize);
@@ -1439,7 +1550,7 @@ int openProfile() {
 /// name.
 extern "C" void __bolt_instr_clear_counters() {
   memSet(reinterpret_cast<char *>(__bolt_instr_locations), 0,
-         __bolt_num_counters * 8);
+         (__bolt_num_counters + 1) * __bolt_instr_num_shards * 8);
   for (int I = 0; I < __bolt_instr_num_ind_calls; ++I)
     GlobalIndCallCounters[I].resetCounters();
 }
@@ -1470,10 +1581,35 @@ __bolt_instr_data_dump() {
 
   int FD = openProfile();
 
+  // In binary mode, reserve space for the container header. The number of
+  // records and the string table location are only known once every record
+  // has been written, so the real header is patched in at the end.
+  if (Ctx.BinaryProfile) {
+    ProfileBinaryHeader Hdr = {};
+    __write(FD, &Hdr, sizeof(Hdr));
+  }
+
+  // Serialize a quiesced snapshot instead of the live counters: copying
+  // bounds the window in which concurrently running threads can change the
+  // values to one linear pass, while the serialization below takes orders
+  // of magnitude longer. With sharded counters, fold all per-thread slabs
+  // into a single logical value per counter. With sampling, scale the
+  // counts by the current rate to approximate the true execution
+  // frequencies.
+  const uint64_t Scale = __bolt_instr_sample_mask + 1ull;
+  uint64_t *Snapshot = new (HashAlloc, 0) uint64_t[__bolt_num_counters];
+  for (uint32_t S = 0; S < __bolt_instr_num_shards; ++S) {
+    const uint64_t *Slab =
+        __bolt_instr_locations + S * (__bolt_num_counters + 1);
+    for (uint32_t I = 0; I < __bolt_num_counters; ++I)
+      Snapshot[I] += Slab[I] * Scale;
+  }
+  const uint64_t *Counters = Snapshot;
+
   BumpPtrAllocator Alloc;
   const uint8_t *FuncDesc = Ctx.FuncDescriptions;
   for (int I = 0, E = __bolt_instr_num_funcs; I < E; ++I) {
-    FuncDesc = writeFunctionProfile(FD, Ctx, FuncDesc, Alloc);
+    FuncDesc = writeFunctionProfile(FD, Ctx, FuncDesc, Counters, Alloc);
     Alloc.clear();
     DEBUG(reportNumber("FuncDesc now: ", (uint64_t)FuncDesc, 16));
   }
@@ -1483,6 +1619,29 @@ __bolt_instr_data_dump() {
   writeIndirectCallProfile(FD, Ctx);
   Ctx.CallFlowTable->forEachElement(visitCallFlowEntry, FD, &Ctx);
 
+  if (Ctx.BinaryProfile) {
+    // Reuse BOLT's description string table as the container string table,
+    // truncated past the last name any record references, then seek back and
+    // fill in the header.
+    uint64_t StringTableSize = 0;
+    if (Ctx.NumBinaryRecords)
+      StringTableSize =
+          Ctx.MaxNameOffset + strLen(Ctx.Strings + Ctx.MaxNameOffset) + 1;
+    __write(FD, Ctx.Strings, StringTableSize);
+    ProfileBinaryHeader Hdr;
+    const char Magic[8] = {'B', 'O', 'L', 'T', 'F', 'D', 'A', 'T'};
+    for (unsigned I = 0; I < sizeof(Hdr.Magic); ++I)
+      Hdr.Magic[I] = Magic[I];
+    Hdr.Version = 1;
+    Hdr.Flags = 0;
+    Hdr.NumBranchEntries = Ctx.NumBinaryRecords;
+    Hdr.StringTableOffset = sizeof(Hdr) + Ctx.NumBinaryRecords *
+                                              sizeof(ProfileBinaryBranchRecord);
+    Hdr.StringTableSize = StringTableSize;
+    __lseek(FD, 0, 0 /*SEEK_SET*/);
+    __write(FD, &Hdr, sizeof(Hdr));
+  }
+
   __fsync(FD);
   __close(FD);
   __munmap(Ctx.MMapPtr, Ctx.MMapSize);
@@ -1498,6 +1657,11 @@ void watchProcess() {
   timespec ts, rem;
   uint64_t Ellapsed = 0ull;
   uint64_t ppid;
+
+  // Run at the lowest scheduling priority so periodic dumps do not steal
+  // CPU from the instrumented process. The profile is written by this
+  // separate process, so its syscalls never block the watched threads.
+  __setpriority(0 /* PRIO_PROCESS */, 0, 19);
   if (__bolt_instr_wait_forks) {
     // Store parent pgid
     ppid = -__getpgid(0);
@@ -1546,17 +1710,39 @@ extern "C" void __bolt_instr_indirect_tailcall();
 extern "C" void __attribute((force_align_arg_pointer)) __bolt_instr_setup() {
   const uint64_t CountersStart =
       reinterpret_cast<uint64_t>(&__bolt_instr_locations[0]);
-  const uint64_t CountersEnd = alignTo(
-      reinterpret_cast<uint64_t>(&__bolt_instr_locations[__bolt_num_counters]),
-      0x1000);
+  const uint64_t CountersEnd =
+      alignTo(reinterpret_cast<uint64_t>(
+                  &__bolt_instr_locations[(__bolt_num_counters + 1) *
+                                          __bolt_instr_num_shards]),
+              0x1000);
   DEBUG(reportNumber("replace mmap start: ", CountersStart, 16));
   DEBUG(reportNumber("replace mmap stop: ", CountersEnd, 16));
   assert (CountersEnd > CountersStart, "no counters");
-  // Maps our counters to be shared instead of private, so we keep counting for
-  // forked processes
-  __mmap(CountersStart, CountersEnd - CountersStart,
-         0x3 /*PROT_READ|PROT_WRITE*/,
-         0x31 /*MAP_ANONYMOUS | MAP_SHARED | MAP_FIXED*/, -1, 0);
+  if (__bolt_instr_use_shmem) {
+    // Back the counters with a named shared-memory segment so an external
+    // tool can map and snapshot them while we run. The segment name carries
+    // our PID so concurrent invocations of the same binary don't collide.
+    char *Ptr = strCopy(SharedCountersPath, "/dev/shm/bolt.instr.counters.",
+                        sizeof(SharedCountersPath));
+    Ptr = intToStr(Ptr, __getpid(), 10);
+    *Ptr++ = '\0';
+    uint64_t FD = __open(SharedCountersPath,
+                         /*flags=*/0x42 /*O_RDWR|O_CREAT*/,
+                         /*mode=*/0600);
+    assert(static_cast<int64_t>(FD) >= 0,
+           "failed to create shared-memory counters segment");
+    __ftruncate(FD, CountersEnd - CountersStart);
+    __mmap(CountersStart, CountersEnd - CountersStart,
+           0x3 /*PROT_READ|PROT_WRITE*/, 0x11 /*MAP_SHARED | MAP_FIXED*/, FD,
+           0);
+    __close(FD);
+  } else {
+    // Maps our counters to be shared instead of private, so we keep counting
+    // for forked processes
+    __mmap(CountersStart, CountersEnd - CountersStart,
+           0x3 /*PROT_READ|PROT_WRITE*/,
+           0x31 /*MAP_ANONYMOUS | MAP_SHARED | MAP_FIXED*/, -1, 0);
+  }
 
   __bolt_ind_call_counter_func_pointer = __bolt_instr_indirect_call;
   __bolt_ind_tailcall_counter_func_pointer = __bolt_instr_indirect_tailcall;
@@ -1564,9 +1750,14 @@ extern "C" void __attribute((force_align_arg_pointer)) __bolt_instr_setup() {
   GlobalAlloc.setMaxSize(0x6400000);
   GlobalAlloc.setShared(true);
   GlobalWriteProfileMutex = new (GlobalAlloc, 0) Mutex();
+  // Carve the per-call-site hash table array straight out of the allocator's
+  // demand-zero pages instead of constructing every element. All-zero bytes
+  // are a valid initial table state (no root table, mutex released), so
+  // startup cost stays independent of the number of instrumented call sites.
   if (__bolt_instr_num_ind_calls > 0)
-    GlobalIndCallCounters =
-        new (GlobalAlloc, 0) IndirectCallHashTable[__bolt_instr_num_ind_calls];
+    GlobalIndCallCounters = reinterpret_cast<IndirectCallHashTable *>(
+        GlobalAlloc.allocate(__bolt_instr_num_ind_calls *
+                             sizeof(IndirectCallHashTable)));
 
   if (__bolt_instr_sleep_time != 0) {
     // Separate instrumented process to the own process group
@@ -1623,6 +1814,8 @@ extern "C" void __bolt_instr_fini() {
   __bolt_fini_trampoline();
   if (__bolt_instr_sleep_time == 0)
     __bolt_instr_data_dump();
+  if (__bolt_instr_use_shmem)
+    __unlink(SharedCountersPath);
   DEBUG(report("Finished.\n"));
 }
 
@@ -1639,7 +1832,8 @@ extern "C" void __bolt_instr_data_dump() {
   uint32_t bolt_instr_num_funcs = _bolt_instr_num_funcs_getter();
 
   for (int I = 0, E = bolt_instr_num_funcs; I < E; ++I) {
-    FuncDesc = writeFunctionProfile(FD, Ctx, FuncDesc, Alloc);
+    FuncDesc = writeFunctionProfile(FD, Ctx, FuncDesc,
+                                    _bolt_instr_locations_getter(), Alloc);
     Alloc.clear();
     DEBUG(reportNumber("FuncDesc now: ", (uint64_t)FuncDesc, 16));
   }
@@ -0,0 +1,227 @@
+//===- bolt/tools/bolt-addr/bolt-addr.cpp ---------------------------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Tool for bulk address translation against the BOLT address translation
+// table of a bolted binary. It maps sample addresses collected on the
+// bolted binary back to locations in the original input binary, so that
+// archived perf data can be re-attributed when a new bolted build rolls
+// out:
+//
+//   $ bolt-addr bolted-binary -addrs samples.txt -o translated.txt
+//
+// The input holds one address per line (hex or decimal). Every address
+// produces one output line of the form
+//
+//   <address> <function> <input-offset>
+//
+// where <function> is the output address of the hot part of the containing
+// function and <input-offset> is the offset in the original function. An
+// address outside any translated function was emitted unmodified and is
+// reported with a zero function address and itself as the offset. The
+// input is mmapped and the address stream is translated on all available
+// threads.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bolt/Profile/BoltAddressTranslation.h"
+#include "llvm/Object/Binary.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <atomic>
+
+using namespace llvm;
+using namespace object;
+using namespace bolt;
+
+namespace opts {
+
+static cl::OptionCategory BoltAddrCategory("bolt-addr options");
+
+static cl::opt<std::string>
+InputFilename(
+  cl::Positional,
+  cl::desc("<bolted binary>"),
+  cl::Required,
+  cl::cat(BoltAddrCategory));
+
+static cl::opt<std::string>
+AddressFile("addrs",
+  cl::desc("<file with one address per line, '-' for stdin>"),
+  cl::init("-"),
+  cl::cat(BoltAddrCategory));
+
+static cl::opt<std::string>
+OutputFilename("o",
+  cl::desc("<output file, '-' for stdout>"),
+  cl::init("-"),
+  cl::cat(BoltAddrCategory));
+
+} // namespace opts
+
+static StringRef ToolName;
+
+static void report_error(StringRef Message, std::error_code EC) {
+  assert(EC);
+  errs() << ToolName << ": '" << Message << "': " << EC.message() << ".\n";
+  exit(1);
+}
+
+static void report_error(StringRef Message, Error E) {
+  assert(E);
+  errs() << ToolName << ": '" << Message << "': " << toString(std::move(E))
+         << ".\n";
+  exit(1);
+}
+
+/// Translate the addresses in [\p Begin, \p End) - a range of full lines -
+/// and append one output line per address to \p OS.
+static uint64_t translateChunk(const BoltAddressTranslation &BAT,
+                               const char *Begin, const char *End,
+                               raw_ostream &OS) {
+  uint64_t NumTranslated = 0;
+  StringRef Chunk(Begin, End - Begin);
+  while (!Chunk.empty()) {
+    StringRef Line;
+    std::tie(Line, Chunk) = Chunk.split('\n');
+    Line = Line.trim();
+    if (Line.empty() || Line.startswith("#"))
+      continue;
+
+    uint64_t Address;
+    if (Line.getAsInteger(0, Address)) {
+      errs() << ToolName << ": skipping malformed address '" << Line << "'\n";
+      continue;
+    }
+
+    if (Optional<BoltAddressTranslation::AddressMapping> Mapping =
+            BAT.translateAddress(Address)) {
+      OS << "0x" << Twine::utohexstr(Address) << " 0x"
+         << Twine::utohexstr(Mapping->FuncAddress) << " 0x"
+         << Twine::utohexstr(Mapping->InputOffset) << '\n';
+      ++NumTranslated;
+    } else {
+      OS << "0x" << Twine::utohexstr(Address) << " 0x0 0x"
+         << Twine::utohexstr(Address) << '\n';
+    }
+  }
+  return NumTranslated;
+}
+
+int main(int argc, char **argv) {
+  // Print a stack trace if we signal out.
+  sys::PrintStackTraceOnErrorSignal(argv[0]);
+  PrettyStackTraceProgram X(argc, argv);
+
+  llvm_shutdown_obj Y; // Call llvm_shutdown() on exit.
+
+  cl::HideUnrelatedOptions(opts::BoltAddrCategory);
+
+  cl::ParseCommandLineOptions(
+      argc, argv, "translate addresses in a bolted binary back to the input "
+                  "binary using its BOLT address translation table");
+
+  ToolName = argv[0];
+
+  if (!sys::fs::exists(opts::InputFilename))
+    report_error(opts::InputFilename, errc::no_such_file_or_directory);
+
+  // Locate and parse the translation table of the bolted binary.
+  Expected<OwningBinary<Binary>> BinaryOrErr =
+      createBinary(opts::InputFilename);
+  if (Error E = BinaryOrErr.takeError())
+    report_error(opts::InputFilename, std::move(E));
+  auto *ELFObj = dyn_cast<ELFObjectFileBase>(BinaryOrErr.get().getBinary());
+  if (!ELFObj)
+    report_error(opts::InputFilename, object_error::invalid_file_type);
+
+  BoltAddressTranslation BAT;
+  bool FoundTable = false;
+  for (const SectionRef &Section : ELFObj->sections()) {
+    Expected<StringRef> NameOrErr = Section.getName();
+    if (Error E = NameOrErr.takeError())
+      report_error(opts::InputFilename, std::move(E));
+    if (*NameOrErr != BoltAddressTranslation::SECTION_NAME)
+      continue;
+
+    Expected<StringRef> ContentsOrErr = Section.getContents();
+    if (Error E = ContentsOrErr.takeError())
+      report_error(opts::InputFilename, std::move(E));
+    if (std::error_code EC = BAT.parse(*ContentsOrErr))
+      report_error(opts::InputFilename, EC);
+    FoundTable = true;
+    break;
+  }
+  if (!FoundTable) {
+    errs() << ToolName << ": '" << opts::InputFilename
+           << "': no BOLT address translation table. Was the binary "
+              "processed with -enable-bat?\n";
+    exit(1);
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+      MemoryBuffer::getFileOrSTDIN(opts::AddressFile);
+  if (std::error_code EC = MB.getError())
+    report_error(opts::AddressFile, EC);
+
+  std::error_code EC;
+  raw_fd_ostream Output(opts::OutputFilename, EC, sys::fs::OF_None);
+  if (EC)
+    report_error(opts::OutputFilename, EC);
+
+  // Split the mmapped input into one chunk of whole lines per thread. Each
+  // chunk is translated independently into its own buffer, and the buffers
+  // are written out in input order.
+  const char *Begin = (*MB)->getBufferStart();
+  const char *End = (*MB)->getBufferEnd();
+  const size_t NumThreads =
+      std::max<size_t>(1, std::min<size_t>(
+                              hardware_concurrency().compute_thread_count(),
+                              (End - Begin) / 4096 + 1));
+  std::vector<const char *> Bounds;
+  Bounds.push_back(Begin);
+  for (size_t I = 1; I < NumThreads; ++I) {
+    const char *Pos = Begin + (End - Begin) * I / NumThreads;
+    while (Pos < End && *Pos != '\n')
+      ++Pos;
+    if (Pos < End)
+      ++Pos;
+    Bounds.push_back(std::max(Pos, Bounds.back()));
+  }
+  Bounds.push_back(End);
+
+  std::vector<std::string> Results(NumThreads);
+  std::atomic<uint64_t> NumTranslated{0};
+  ThreadPool Pool(hardware_concurrency(NumThreads));
+  for (size_t I = 0; I < NumThreads; ++I)
+    Pool.async([&, I] {
+      raw_string_ostream OS(Results[I]);
+      NumTranslated += translateChunk(BAT, Bounds[I], Bounds[I + 1], OS);
+    });
+  Pool.wait();
+
+  uint64_t NumAddresses = 0;
+  for (const std::string &Result : Results) {
+    Output << Result;
+    NumAddresses += std::count(Result.begin(), Result.end(), '\n');
+  }
+
+  errs() << "BOLT-INFO: translated " << NumTranslated << " out of "
+         << NumAddresses << " addresses\n";
+
+  return 0;
+}
@@ -13,18 +13,24 @@
 //===----------------------------------------------------------------------===//
 
 #include "bolt/Profile/DataAggregator.h"
+#include "bolt/Profile/Heatmap.h"
 #include "bolt/Rewrite/MachORewriteInstance.h"
 #include "bolt/Rewrite/RewriteInstance.h"
 #include "bolt/Utils/CommandLineOpts.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/MC/TargetRegistry.h"
 #include "llvm/Object/Binary.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/LineIterator.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/TargetSelect.h"
+#include <iostream>
 
 #define DEBUG_TYPE "bolt"
 
@@ -57,6 +63,22 @@ BoltProfile("b",
   cl::aliasopt(InputDataFilename),
   cl::cat(BoltCategory));
 
+static cl::opt<std::string>
+BatchFile("batch",
+  cl::desc("<manifest file> process multiple binaries in one process; each "
+           "manifest line contains <binary> <profile> <output> with '-' for "
+           "no profile"),
+  cl::Optional,
+  cl::cat(BoltCategory));
+
+static cl::opt<bool>
+ServerMode("server",
+  cl::desc("read hot-set prediction requests from stdin and answer them "
+           "without restarting the tool; each request line contains "
+           "'hotset <binary> <profile>'"),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 static cl::opt<std::string>
 InputDataFilename2("data2",
   cl::desc("<data file>"),
@@ -136,6 +158,31 @@ void heatmapMode(int argc, char **argv) {
 
   cl::ParseCommandLineOptions(argc, argv, "");
 
+  // Diffing and merging operate on saved binary heat maps and need neither
+  // a binary nor a profile.
+  if (!opts::HeatmapDiff.empty()) {
+    SmallVector<StringRef, 2> Files;
+    StringRef(opts::HeatmapDiff).split(Files, ',');
+    if (Files.size() != 2) {
+      errs() << ToolName << ": expected -diff=<file1>,<file2>.\n";
+      exit(1);
+    }
+    if (Heatmap::diffBinaryFiles(Files[0], Files[1], outs()))
+      exit(1);
+    exit(EXIT_SUCCESS);
+  }
+  if (!opts::HeatmapMerge.empty()) {
+    if (opts::HeatmapFile == "-") {
+      errs() << ToolName << ": -merge requires the -o=<output file> option.\n";
+      exit(1);
+    }
+    SmallVector<StringRef, 8> Files;
+    StringRef(opts::HeatmapMerge).split(Files, ',');
+    if (Heatmap::mergeBinaryFiles(Files, opts::HeatmapFile))
+      exit(1);
+    exit(EXIT_SUCCESS);
+  }
+
   if (!sys::fs::exists(opts::InputFilename))
     report_error(opts::InputFilename, errc::no_such_file_or_directory);
 
@@ -183,12 +230,164 @@ void boltMode(int argc, char **argv) {
   cl::ParseCommandLineOptions(argc, argv,
                               "BOLT - Binary Optimization and Layout Tool\n");
 
+  if (!opts::BatchFile.empty() && opts::ServerMode) {
+    errs() << ToolName << ": cannot combine -batch and -server.\n";
+    exit(1);
+  }
+
+  if (!opts::BatchFile.empty()) {
+    if (!opts::InputFilename.empty() || !opts::OutputFilename.empty() ||
+        !opts::InputDataFilename.empty()) {
+      errs() << ToolName << ": input, output, and profile names are taken "
+                            "from the manifest in -batch mode.\n";
+      exit(1);
+    }
+    return;
+  }
+
+  if (opts::ServerMode) {
+    if (!opts::InputFilename.empty() || !opts::OutputFilename.empty() ||
+        !opts::InputDataFilename.empty()) {
+      errs() << ToolName << ": binary and profile names are taken from "
+                            "requests in -server mode.\n";
+      exit(1);
+    }
+    return;
+  }
+
   if (opts::OutputFilename.empty()) {
     errs() << ToolName << ": expected -o=<output file> option.\n";
     exit(1);
   }
 }
 
+/// Process all (binary, profile, output) triples from the batch manifest in
+/// a single process. LLVM initialization, target registration, the shared
+/// thread pool, and warmed-up allocator state are paid for once instead of
+/// per binary. Binaries are processed sequentially: rewriting relies on
+/// process-global option state, so only the phases within each binary run
+/// in parallel on the shared pool.
+static void runBatchMode(int argc, char **argv, const std::string &ToolPath) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+      MemoryBuffer::getFileOrSTDIN(opts::BatchFile);
+  if (std::error_code EC = MB.getError())
+    report_error(opts::BatchFile, EC);
+
+  struct BatchJob {
+    std::string Binary;
+    std::string Profile;
+    std::string Output;
+  };
+  std::vector<BatchJob> Jobs;
+  for (line_iterator LI(**MB, /*SkipBlanks=*/true, /*CommentMarker=*/'#');
+       !LI.is_at_eof(); ++LI) {
+    SmallVector<StringRef, 4> Fields;
+    SplitString(*LI, Fields);
+    if (Fields.size() != 3) {
+      errs() << ToolName << ": malformed line " << LI.line_number() << " in '"
+             << opts::BatchFile << "': expected <binary> <profile> <output>.\n";
+      exit(1);
+    }
+    Jobs.push_back(BatchJob{std::string(Fields[0]), std::string(Fields[1]),
+                            std::string(Fields[2])});
+  }
+
+  for (const BatchJob &Job : Jobs) {
+    outs() << "BOLT-INFO: batch: processing " << Job.Binary << " into "
+           << Job.Output << '\n';
+    if (!sys::fs::exists(Job.Binary))
+      report_error(Job.Binary, errc::no_such_file_or_directory);
+
+    Expected<OwningBinary<Binary>> BinaryOrErr = createBinary(Job.Binary);
+    if (Error E = BinaryOrErr.takeError())
+      report_error(Job.Binary, std::move(E));
+    Binary &Binary = *BinaryOrErr.get().getBinary();
+
+    auto *ELFObj = dyn_cast<ELFObjectFileBase>(&Binary);
+    if (!ELFObj)
+      report_error(Job.Binary, object_error::invalid_file_type);
+
+    // The rewriting pipeline reads the input and output names from the
+    // global options.
+    opts::InputFilename = Job.Binary;
+    opts::OutputFilename = Job.Output;
+
+    RewriteInstance RI(ELFObj, argc, argv, ToolPath);
+    if (Job.Profile != "-")
+      if (Error E = RI.setProfile(Job.Profile))
+        report_error(Job.Profile, std::move(E));
+    RI.run();
+  }
+
+  outs() << "BOLT-INFO: batch: processed " << Jobs.size() << " binaries\n";
+}
+
+/// Answer hot-set prediction requests read from stdin until EOF or an
+/// explicit 'quit'. The process stays resident across requests, so LLVM
+/// initialization, target registration, the shared thread pool, and the
+/// loaded binary images are paid for once instead of per query. A request
+/// 'hotset <binary> <profile>' is answered on stdout with the list printed
+/// by RewriteInstance::predictHotFunctions(). A malformed or failing
+/// request is reported on stderr without terminating the server.
+static void runServerMode(int argc, char **argv, const std::string &ToolPath) {
+  // Keep the loaded binary images warm across requests: repeated queries
+  // against the same binary with fresh profiles are the common case.
+  StringMap<OwningBinary<Binary>> CachedBinaries;
+  uint64_t NumQueries = 0;
+  std::string Line;
+  while (std::getline(std::cin, Line)) {
+    const StringRef Request = StringRef(Line).trim();
+    if (Request.empty() || Request.startswith("#"))
+      continue;
+    if (Request == "quit" || Request == "exit")
+      break;
+
+    SmallVector<StringRef, 4> Fields;
+    SplitString(Request, Fields);
+    if (Fields.size() != 3 || Fields[0] != "hotset") {
+      errs() << ToolName << ": server: malformed request '" << Request
+             << "': expected 'hotset <binary> <profile>'.\n";
+      continue;
+    }
+    const std::string BinaryName = std::string(Fields[1]);
+    const std::string Profile = std::string(Fields[2]);
+
+    auto CBI = CachedBinaries.find(BinaryName);
+    if (CBI == CachedBinaries.end()) {
+      Expected<OwningBinary<Binary>> BinaryOrErr = createBinary(BinaryName);
+      if (Error E = BinaryOrErr.takeError()) {
+        errs() << ToolName << ": server: '" << BinaryName
+               << "': " << toString(std::move(E)) << ".\n";
+        continue;
+      }
+      CBI = CachedBinaries.try_emplace(BinaryName, std::move(*BinaryOrErr))
+                .first;
+    }
+
+    auto *ELFObj = dyn_cast<ELFObjectFileBase>(CBI->second.getBinary());
+    if (!ELFObj) {
+      errs() << ToolName << ": server: '" << BinaryName
+             << "': unsupported file type.\n";
+      continue;
+    }
+
+    // The rewriting pipeline reads the input name from the global options.
+    opts::InputFilename = BinaryName;
+
+    RewriteInstance RI(ELFObj, argc, argv, ToolPath);
+    if (Error E = RI.setProfile(Profile)) {
+      errs() << ToolName << ": server: '" << Profile
+             << "': " << toString(std::move(E)) << ".\n";
+      continue;
+    }
+    RI.predictHotFunctions(outs());
+    ++NumQueries;
+    outs().flush();
+  }
+
+  outs() << "BOLT-INFO: server: answered " << NumQueries << " requests\n";
+}
+
 std::string GetExecutablePath(const char *Argv0) {
   SmallString<128> ExecutablePath(Argv0);
   // Do a PATH lookup if Argv0 isn't a valid path.
@@ -235,6 +434,16 @@ int main(int argc, char **argv) {
   else
     boltMode(argc, argv);
 
+  if (!opts::BatchFile.empty()) {
+    runBatchMode(argc, argv, ToolPath);
+    return EXIT_SUCCESS;
+  }
+
+  if (opts::ServerMode) {
+    runServerMode(argc, argv, ToolPath);
+    return EXIT_SUCCESS;
+  }
+
   if (!sys::fs::exists(opts::InputFilename))
     report_error(opts::InputFilename, errc::no_such_file_or_directory);
 
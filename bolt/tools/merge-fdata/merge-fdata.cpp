@@ -10,14 +10,27 @@
 //
 //   $ merge-fdata 1.fdata 2.fdata 3.fdata > merged.fdata
 //
+// Can also score how much a profile has diverged from a newer one:
+//
+//   $ merge-fdata -diff old.fdata new.fdata
+//
 //===----------------------------------------------------------------------===//
 
+#include "bolt/Profile/ProfileBinaryFormat.h"
 #include "bolt/Profile/ProfileYAMLMapping.h"
 #include "llvm/ADT/StringMap.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include <cmath>
+#include <map>
 #include <unordered_map>
 
 using namespace llvm;
@@ -56,6 +69,13 @@ PrintFunctionList("print",
       "print functions sorted by total branch count")),
   cl::cat(MergeFdataCategory));
 
+static cl::opt<bool>
+OutputBinaryFdata("binary",
+  cl::desc("write merged legacy profile in the binary fdata format"),
+  cl::init(false),
+  cl::Optional,
+  cl::cat(MergeFdataCategory));
+
 static cl::opt<bool>
 SuppressMergedDataOutput("q",
   cl::desc("do not print merged data to stdout"),
@@ -63,6 +83,42 @@ SuppressMergedDataOutput("q",
   cl::Optional,
   cl::cat(MergeFdataCategory));
 
+static cl::opt<bool>
+ProfileDiff("diff",
+  cl::desc("compare exactly two legacy profiles and report a weighted "
+           "divergence score per function instead of merging them (run "
+           "perf2bolt on a BOLTed binary to obtain a comparable profile "
+           "from fresh samples)"),
+  cl::init(false),
+  cl::Optional,
+  cl::cat(MergeFdataCategory));
+
+static cl::list<unsigned>
+ProfileWeights("weights",
+  cl::CommaSeparated,
+  cl::desc("scale the counts of each input profile by the corresponding "
+           "weight before merging, e.g. -weights=70,20,10 blends three "
+           "workload profiles 70/20/10. Requires one weight per input."),
+  cl::value_desc("w1[,w2,...]"),
+  cl::cat(MergeFdataCategory));
+
+static cl::opt<bool>
+ReportHotPathConflicts("report-hot-path-conflicts",
+  cl::desc("report functions whose hottest branch disagrees across the "
+           "input profiles, to quantify the compromise of blending "
+           "profiles from different workloads (legacy format only)"),
+  cl::init(false),
+  cl::Optional,
+  cl::cat(MergeFdataCategory));
+
+static cl::opt<double>
+DiffThreshold("diff-threshold",
+  cl::desc("with -diff, exit with a non-zero status if the overall "
+           "divergence score exceeds this percentage"),
+  cl::init(0.),
+  cl::Optional,
+  cl::cat(MergeFdataCategory));
+
 } // namespace opts
 
 namespace {
@@ -224,6 +280,23 @@ void mergeFunctionProfile(BinaryFunctionProfile &MergedBF,
       MergedBF.Blocks.emplace_back(std::move(*BB));
 }
 
+/// Scale all counts of \p BF by \p Weight, saturating on overflow.
+void scaleFunctionProfile(BinaryFunctionProfile &BF, uint64_t Weight) {
+  BF.ExecCount = SaturatingMultiply(BF.ExecCount, Weight);
+  for (BinaryBasicBlockProfile &BB : BF.Blocks) {
+    BB.ExecCount = SaturatingMultiply(BB.ExecCount, Weight);
+    BB.EventCount = SaturatingMultiply(BB.EventCount, Weight);
+    for (CallSiteInfo &CS : BB.CallSites) {
+      CS.Count = SaturatingMultiply(CS.Count, Weight);
+      CS.Mispreds = SaturatingMultiply(CS.Mispreds, Weight);
+    }
+    for (SuccessorInfo &SI : BB.Successors) {
+      SI.Count = SaturatingMultiply(SI.Count, Weight);
+      SI.Mispreds = SaturatingMultiply(SI.Mispreds, Weight);
+    }
+  }
+}
+
 bool isYAML(const StringRef Filename) {
   ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
       MemoryBuffer::getFileOrSTDIN(Filename);
@@ -235,40 +308,519 @@ bool isYAML(const StringRef Filename) {
   return false;
 }
 
+/// Branches aggregated across legacy input profiles for binary fdata output.
+/// The key is <from name, from offset, to name, to offset>; an empty name
+/// denotes a location outside any known symbol.
+using LegacyProfileKeyTy = std::tuple<std::string, uint64_t, std::string,
+                                      uint64_t>;
+struct LegacyProfileCounts {
+  uint64_t Mispreds{0};
+  uint64_t Count{0};
+};
+using LegacyProfileMapTy = std::map<LegacyProfileKeyTy, LegacyProfileCounts>;
+
+/// Add \p Delta scaled by \p Weight into \p Counts, saturating on overflow.
+void addWeighted(LegacyProfileCounts &Counts, const LegacyProfileCounts &Delta,
+                 uint64_t Weight) {
+  Counts.Mispreds =
+      SaturatingAdd(Counts.Mispreds, SaturatingMultiply(Delta.Mispreds,
+                                                        Weight));
+  Counts.Count =
+      SaturatingAdd(Counts.Count, SaturatingMultiply(Delta.Count, Weight));
+}
+
+/// Take the next space-separated token from \p Line honoring backslash
+/// escapes produced by getEscapedName().
+StringRef takeToken(StringRef &Line) {
+  size_t Pos = 0;
+  while (Pos < Line.size() && Line[Pos] != ' ') {
+    if (Line[Pos] == '\\' && Pos + 1 < Line.size())
+      ++Pos;
+    ++Pos;
+  }
+  StringRef Token = Line.substr(0, Pos);
+  Line = Line.drop_front(std::min(Pos + 1, Line.size()));
+  return Token;
+}
+
+std::string unescapeName(StringRef Name) {
+  std::string Output = Name.str();
+  for (size_t I = 0; I < Output.size(); ++I)
+    if (Output[I] == '\\')
+      Output.erase(I++, 1);
+  return Output;
+}
+
+/// Aggregate branch entries from a legacy text profile \p Buf into \p Map.
+void mergeTextFdataInto(StringRef Filename, StringRef Buf,
+                        LegacyProfileMapTy &Map) {
+  auto parseLocation = [&](StringRef &Line, std::string &Name,
+                           uint64_t &Offset) {
+    const StringRef Flag = takeToken(Line);
+    if (Flag == "3" || Flag == "4")
+      report_error(Filename,
+                   "memory events are not supported by the binary format");
+    const StringRef NameStr = takeToken(Line);
+    Name = Flag == "1" ? unescapeName(NameStr) : std::string();
+    if (takeToken(Line).getAsInteger(16, Offset))
+      report_error(Filename, "malformed location offset");
+  };
+
+  while (!Buf.empty()) {
+    StringRef Line;
+    std::tie(Line, Buf) = Buf.split('\n');
+    if (Line.empty() || Line == "boltedcollection")
+      continue;
+    if (Line.startswith("no_lbr"))
+      report_error(Filename,
+                   "no_lbr profiles are not supported by the binary format");
+
+    LegacyProfileKeyTy Key;
+    parseLocation(Line, std::get<0>(Key), std::get<1>(Key));
+    parseLocation(Line, std::get<2>(Key), std::get<3>(Key));
+
+    LegacyProfileCounts Delta;
+    if (takeToken(Line).getAsInteger(10, Delta.Mispreds) ||
+        takeToken(Line).getAsInteger(10, Delta.Count))
+      report_error(Filename, "malformed branch counters");
+
+    LegacyProfileCounts &Counts = Map[Key];
+    Counts.Mispreds += Delta.Mispreds;
+    Counts.Count += Delta.Count;
+  }
+}
+
+/// Aggregate branch records from a binary fdata container \p Buf into \p Map.
+/// Sets \p BoltedCollection according to the container flags.
+void mergeBinaryFdataInto(StringRef Filename, StringRef Buf,
+                          LegacyProfileMapTy &Map, bool &BoltedCollection) {
+  using namespace llvm::support;
+
+  if (Buf.size() < sizeof(llvm::bolt::ProfileBinaryHeader))
+    report_error(Filename, "truncated binary fdata header");
+
+  const char *Data = Buf.data();
+  const uint32_t Version =
+      endian::read32le(Data + llvm::bolt::ProfileBinaryMagicSize);
+  const uint32_t Flags =
+      endian::read32le(Data + llvm::bolt::ProfileBinaryMagicSize + 4);
+  const uint64_t NumBranchEntries = endian::read64le(Data + 16);
+  const uint64_t StringTableOffset = endian::read64le(Data + 24);
+  const uint64_t StringTableSize = endian::read64le(Data + 32);
+
+  if (Version != llvm::bolt::ProfileBinaryVersion)
+    report_error(Filename, "unsupported binary fdata version");
+  const uint64_t RecordsEnd =
+      sizeof(llvm::bolt::ProfileBinaryHeader) +
+      NumBranchEntries * sizeof(llvm::bolt::ProfileBinaryBranchRecord);
+  if (RecordsEnd > StringTableOffset ||
+      StringTableOffset + StringTableSize > Buf.size())
+    report_error(Filename, "corrupted binary fdata file");
+
+  BoltedCollection = Flags & llvm::bolt::PBF_BOLTED_COLLECTION;
+
+  const StringRef StrTab = Buf.substr(StringTableOffset, StringTableSize);
+  auto getName = [&](uint32_t NameOffset) -> std::string {
+    if (NameOffset == llvm::bolt::ProfileBinaryBranchRecord::UnknownNameOffset)
+      return std::string();
+    const size_t NameEnd = StrTab.find('\0', NameOffset);
+    if (NameOffset >= StringTableSize || NameEnd == StringRef::npos)
+      report_error(Filename, "invalid string table reference");
+    return StrTab.slice(NameOffset, NameEnd).str();
+  };
+
+  for (uint64_t I = 0; I < NumBranchEntries; ++I) {
+    const char *Record = Data + sizeof(llvm::bolt::ProfileBinaryHeader) +
+                         I * sizeof(llvm::bolt::ProfileBinaryBranchRecord);
+    LegacyProfileKeyTy Key{getName(endian::read32le(Record)),
+                           endian::read64le(Record + 8),
+                           getName(endian::read32le(Record + 4)),
+                           endian::read64le(Record + 16)};
+    LegacyProfileCounts &Counts = Map[Key];
+    Counts.Mispreds += endian::read64le(Record + 24);
+    Counts.Count += endian::read64le(Record + 32);
+  }
+}
+
+/// Write the merged profile \p Map as a binary fdata container to \p OS.
+void writeBinaryFdataProfile(const LegacyProfileMapTy &Map,
+                             bool BoltedCollection, raw_ostream &OS) {
+  using namespace llvm::support;
+
+  std::string StringTable;
+  StringMap<uint32_t> NameOffsets;
+  auto getNameOffset = [&](const std::string &Name) -> uint32_t {
+    if (Name.empty())
+      return llvm::bolt::ProfileBinaryBranchRecord::UnknownNameOffset;
+    auto I = NameOffsets.find(Name);
+    if (I != NameOffsets.end())
+      return I->second;
+    const uint32_t Offset = StringTable.size();
+    StringTable += Name;
+    StringTable += '\0';
+    NameOffsets[Name] = Offset;
+    return Offset;
+  };
+
+  std::vector<llvm::bolt::ProfileBinaryBranchRecord> Records;
+  Records.reserve(Map.size());
+  for (const std::pair<const LegacyProfileKeyTy, LegacyProfileCounts> &Entry :
+       Map) {
+    llvm::bolt::ProfileBinaryBranchRecord Record;
+    Record.FromName = getNameOffset(std::get<0>(Entry.first));
+    Record.ToName = getNameOffset(std::get<2>(Entry.first));
+    Record.FromOffset = std::get<1>(Entry.first);
+    Record.ToOffset = std::get<3>(Entry.first);
+    Record.Mispreds = Entry.second.Mispreds;
+    Record.Count = Entry.second.Count;
+    Records.push_back(Record);
+  }
+
+  endian::Writer W(OS, little);
+  OS.write(llvm::bolt::ProfileBinaryMagic, llvm::bolt::ProfileBinaryMagicSize);
+  W.write<uint32_t>(llvm::bolt::ProfileBinaryVersion);
+  W.write<uint32_t>(BoltedCollection ? llvm::bolt::PBF_BOLTED_COLLECTION : 0);
+  W.write<uint64_t>(Records.size());
+  W.write<uint64_t>(
+      sizeof(llvm::bolt::ProfileBinaryHeader) +
+      Records.size() * sizeof(llvm::bolt::ProfileBinaryBranchRecord));
+  W.write<uint64_t>(StringTable.size());
+  for (const llvm::bolt::ProfileBinaryBranchRecord &Record : Records) {
+    W.write<uint32_t>(Record.FromName);
+    W.write<uint32_t>(Record.ToName);
+    W.write<uint64_t>(Record.FromOffset);
+    W.write<uint64_t>(Record.ToOffset);
+    W.write<uint64_t>(Record.Mispreds);
+    W.write<uint64_t>(Record.Count);
+  }
+  OS << StringTable;
+}
+
+/// Result of parsing one legacy input profile. Text entries are keyed by the
+/// raw location prefix of a line; structured entries are used for -binary
+/// output.
+struct LegacyProfileShard {
+  bool BoltedCollection{false};
+  bool NoLBR{false};
+  std::string EventNames;
+  StringMap<LegacyProfileCounts> TextCounts;
+  LegacyProfileMapTy BinaryCounts;
+};
+
+/// Aggregate one legacy profile line into \p Counts. The line key is its
+/// location prefix; trailing counters are summed. Branch lines carry
+/// mispredictions and a count, while memory events and no-LBR samples carry
+/// a single counter.
+void aggregateTextLine(StringRef Filename, StringRef Line, bool NoLBR,
+                       StringMap<LegacyProfileCounts> &Counts) {
+  SmallVector<StringRef, 8> Tokens;
+  StringRef Rest = Line;
+  while (!Rest.empty())
+    Tokens.push_back(takeToken(Rest));
+  if (Tokens.empty())
+    report_error(Filename, "malformed profile line");
+
+  const bool SingleCounter = NoLBR || Tokens[0] == "3" || Tokens[0] == "4";
+  const unsigned NumCounters = SingleCounter ? 1 : 2;
+  if (Tokens.size() < NumCounters + 1)
+    report_error(Filename, "malformed profile line");
+
+  LegacyProfileCounts Delta;
+  if (Tokens[Tokens.size() - 1].getAsInteger(10, Delta.Count) ||
+      (!SingleCounter &&
+       Tokens[Tokens.size() - 2].getAsInteger(10, Delta.Mispreds)))
+    report_error(Filename, "malformed branch counters");
+
+  // The key is the line up to (and excluding) the separator preceding the
+  // first counter token.
+  const char *CountersBegin = Tokens[Tokens.size() - NumCounters].data();
+  const StringRef Key = Line.substr(0, CountersBegin - Line.data() - 1);
+  LegacyProfileCounts &LineCounts = Counts[Key];
+  LineCounts.Mispreds += Delta.Mispreds;
+  LineCounts.Count += Delta.Count;
+}
+
+/// Parse a single legacy profile file into \p Shard. Thread-safe: shards are
+/// private to each parsing task and merged afterwards.
+void parseLegacyProfile(const std::string &Filename,
+                        LegacyProfileShard &Shard) {
+  if (isYAML(Filename))
+    report_error(Filename, "cannot mix YAML and legacy formats");
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+      MemoryBuffer::getFileOrSTDIN(Filename);
+  if (std::error_code EC = MB.getError())
+    report_error(Filename, EC);
+
+  StringRef Buf = MB.get()->getBuffer();
+
+  if (Buf.startswith(llvm::bolt::getProfileBinaryMagic())) {
+    if (!opts::OutputBinaryFdata)
+      report_error(Filename, "binary fdata inputs require -binary output");
+    mergeBinaryFdataInto(Filename, Buf, Shard.BinaryCounts,
+                         Shard.BoltedCollection);
+    return;
+  }
+
+  if (opts::OutputBinaryFdata) {
+    Shard.BoltedCollection = Buf.startswith("boltedcollection\n");
+    mergeTextFdataInto(Filename, Buf, Shard.BinaryCounts);
+    return;
+  }
+
+  while (!Buf.empty()) {
+    StringRef Line;
+    std::tie(Line, Buf) = Buf.split('\n');
+    if (Line.empty())
+      continue;
+    if (Line == "boltedcollection") {
+      Shard.BoltedCollection = true;
+      continue;
+    }
+    if (Line.startswith("no_lbr")) {
+      Shard.NoLBR = true;
+      Shard.EventNames = Line.drop_front(6).str();
+      continue;
+    }
+    aggregateTextLine(Filename, Line, Shard.NoLBR, Shard.TextCounts);
+  }
+}
+
 void mergeLegacyProfiles(const cl::list<std::string> &Filenames) {
   errs() << "Using legacy profile format.\n";
+
+  // Parse the input files in parallel. Each file is mapped, aggregated into
+  // a private shard, and released, so memory is bounded by the number of
+  // unique profile entries rather than the total input size.
+  std::vector<LegacyProfileShard> Shards(Filenames.size());
+  ThreadPool Pool(hardware_concurrency());
+  for (size_t I = 0; I < Filenames.size(); ++I)
+    Pool.async(parseLegacyProfile, std::cref(Filenames[I]),
+               std::ref(Shards[I]));
+  Pool.wait();
+
+  // The hottest branch of a function in each input profile, used by
+  // -report-hot-path-conflicts. One slot per input.
+  struct HotPathInfo {
+    std::string Key;
+    uint64_t Count{0};
+    uint64_t Total{0};
+  };
+  StringMap<std::vector<HotPathInfo>> HotPaths;
+
+  // Merge the shards in input order.
   bool BoltedCollection = false;
-  bool First = true;
-  for (const std::string &Filename : Filenames) {
+  bool NoLBR = false;
+  std::string EventNames;
+  StringMap<LegacyProfileCounts> MergedTextProfile;
+  LegacyProfileMapTy MergedBinaryProfile;
+  for (size_t I = 0; I < Shards.size(); ++I) {
+    LegacyProfileShard &Shard = Shards[I];
+    const uint64_t Weight =
+        opts::ProfileWeights.empty() ? 1 : opts::ProfileWeights[I];
+    errs() << "Merging data from " << Filenames[I] << "...\n";
+
+    if (I != 0 && Shard.BoltedCollection != BoltedCollection)
+      report_error(
+          Filenames[I],
+          "cannot mix profile collected in BOLT and non-BOLT deployments");
+    BoltedCollection = Shard.BoltedCollection;
+    if (I != 0 && Shard.NoLBR != NoLBR)
+      report_error(Filenames[I], "cannot mix no_lbr and LBR profiles");
+    NoLBR = Shard.NoLBR;
+    if (EventNames.empty())
+      EventNames = Shard.EventNames;
+
+    for (const StringMapEntry<LegacyProfileCounts> &Entry : Shard.TextCounts) {
+      addWeighted(MergedTextProfile[Entry.getKey()], Entry.getValue(), Weight);
+
+      // Track the hottest branch of every function per input. The comparison
+      // uses unscaled counts: a conflict is about the direction of the hot
+      // path, not about its weighted magnitude.
+      if (opts::ReportHotPathConflicts) {
+        StringRef Line = Entry.getKey();
+        const StringRef Flag = takeToken(Line);
+        if (Flag != "1")
+          continue;
+        const std::string Name = unescapeName(takeToken(Line));
+        std::vector<HotPathInfo> &Slots = HotPaths[Name];
+        Slots.resize(Filenames.size());
+        HotPathInfo &Slot = Slots[I];
+        Slot.Total += Entry.getValue().Count;
+        if (Entry.getValue().Count > Slot.Count) {
+          Slot.Count = Entry.getValue().Count;
+          Slot.Key = Entry.getKey().str();
+        }
+      }
+    }
+    for (const std::pair<const LegacyProfileKeyTy, LegacyProfileCounts>
+             &Entry : Shard.BinaryCounts)
+      addWeighted(MergedBinaryProfile[Entry.first], Entry.second, Weight);
+    // Release shard memory early.
+    Shard = LegacyProfileShard();
+  }
+
+  // Report functions whose hottest branch differs between inputs that both
+  // exercise the function.
+  if (opts::ReportHotPathConflicts) {
+    std::vector<StringRef> Names;
+    Names.reserve(HotPaths.size());
+    for (const StringMapEntry<std::vector<HotPathInfo>> &Entry : HotPaths)
+      Names.push_back(Entry.getKey());
+    std::sort(Names.begin(), Names.end());
+
+    uint64_t NumConflicts = 0;
+    for (const StringRef Name : Names) {
+      const std::vector<HotPathInfo> &Slots = HotPaths[Name];
+      StringRef HotKey;
+      bool Conflict = false;
+      for (const HotPathInfo &Slot : Slots) {
+        if (!Slot.Total)
+          continue;
+        if (HotKey.empty())
+          HotKey = Slot.Key;
+        else if (Slot.Key != HotKey)
+          Conflict = true;
+      }
+      if (!Conflict)
+        continue;
+
+      ++NumConflicts;
+      errs() << "Conflicting hot paths in " << Name << ":\n";
+      for (size_t I = 0; I < Slots.size(); ++I) {
+        if (!Slots[I].Total)
+          continue;
+        errs() << "  " << Filenames[I] << ": " << Slots[I].Key
+               << format(" (%.1f%% of function counts)",
+                         (100.0 * Slots[I].Count) / Slots[I].Total)
+               << '\n';
+      }
+    }
+    errs() << NumConflicts
+           << " functions have conflicting hot paths across inputs.\n";
+  }
+
+  if (opts::OutputBinaryFdata) {
+    writeBinaryFdataProfile(MergedBinaryProfile, BoltedCollection, outs());
+    errs() << "Profile from " << Filenames.size() << " files merged.\n";
+    return;
+  }
+
+  // Emit merged entries in a stable order.
+  std::vector<StringRef> Keys;
+  Keys.reserve(MergedTextProfile.size());
+  for (const StringMapEntry<LegacyProfileCounts> &Entry : MergedTextProfile)
+    Keys.push_back(Entry.getKey());
+  std::sort(Keys.begin(), Keys.end());
+
+  if (BoltedCollection)
+    outs() << "boltedcollection\n";
+  if (NoLBR)
+    outs() << "no_lbr" << EventNames << "\n";
+  for (const StringRef Key : Keys) {
+    const LegacyProfileCounts &Counts = MergedTextProfile[Key];
+    const bool SingleCounter =
+        NoLBR || Key.startswith("3 ") || Key.startswith("4 ");
+    outs() << Key << " ";
+    if (!SingleCounter)
+      outs() << Counts.Mispreds << " ";
+    outs() << Counts.Count << "\n";
+  }
+
+  errs() << "Profile from " << Filenames.size() << " files merged.\n";
+}
+
+/// Compute a weighted divergence score between exactly two legacy profiles.
+/// Each function's branch-count distribution is compared using the total
+/// variation distance (half the L1 distance between the normalized
+/// distributions), weighted by the function's share of the combined dynamic
+/// counts, so a shift in a hot dispatcher weighs more than the same shift in
+/// a cold helper. The overall score falls in [0%, 100%].
+int diffLegacyProfiles(const cl::list<std::string> &Filenames) {
+  if (Filenames.size() != 2)
+    report_error("-diff", "expected exactly two input profiles");
+  if (opts::OutputBinaryFdata)
+    report_error("-diff", "incompatible with -binary output");
+  for (const std::string &Filename : Filenames)
     if (isYAML(Filename))
-      report_error(Filename, "cannot mix YAML and legacy formats");
-    ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
-        MemoryBuffer::getFileOrSTDIN(Filename);
-    if (std::error_code EC = MB.getError())
-      report_error(Filename, EC);
-    errs() << "Merging data from " << Filename << "...\n";
-
-    StringRef Buf = MB.get()->getBuffer();
-    // Check if the string "boltedcollection" is in the first line
-    if (Buf.startswith("boltedcollection\n")) {
-      if (!First && !BoltedCollection)
-        report_error(
-            Filename,
-            "cannot mix profile collected in BOLT and non-BOLT deployments");
-      BoltedCollection = true;
-      if (!First)
-        Buf = Buf.drop_front(17);
+      report_error(Filename, "diff mode supports legacy fdata profiles only");
+
+  LegacyProfileShard Shards[2];
+  for (size_t I = 0; I < 2; ++I)
+    parseLegacyProfile(Filenames[I], Shards[I]);
+  if (Shards[0].BoltedCollection != Shards[1].BoltedCollection)
+    report_error(
+        Filenames[1],
+        "cannot compare profile collected in BOLT and non-BOLT deployments");
+  if (Shards[0].NoLBR != Shards[1].NoLBR)
+    report_error(Filenames[1], "cannot compare no_lbr and LBR profiles");
+
+  // Group entry counts by the originating function. Entries outside any
+  // known symbol are grouped together.
+  struct EntryCounts {
+    uint64_t Count[2] = {0, 0};
+  };
+  struct FunctionCounts {
+    uint64_t Total[2] = {0, 0};
+    StringMap<EntryCounts> Entries;
+  };
+  StringMap<FunctionCounts> Functions;
+  uint64_t TotalCounts[2] = {0, 0};
+  for (size_t I = 0; I < 2; ++I) {
+    for (const StringMapEntry<LegacyProfileCounts> &Entry :
+         Shards[I].TextCounts) {
+      StringRef Line = Entry.getKey();
+      const StringRef Flag = takeToken(Line);
+      const StringRef Name = takeToken(Line);
+      const std::string FuncName =
+          Flag == "1" ? unescapeName(Name) : std::string("[unknown]");
+      FunctionCounts &FC = Functions[FuncName];
+      FC.Total[I] += Entry.getValue().Count;
+      FC.Entries[Entry.getKey()].Count[I] += Entry.getValue().Count;
+      TotalCounts[I] += Entry.getValue().Count;
+    }
+  }
+
+  double WeightedDivergence = 0;
+  std::vector<std::pair<double, StringRef>> FunctionScores;
+  const double CombinedTotal =
+      double(TotalCounts[0]) + double(TotalCounts[1]);
+  for (const StringMapEntry<FunctionCounts> &FI : Functions) {
+    const FunctionCounts &FC = FI.getValue();
+    double Distance;
+    if (!FC.Total[0] || !FC.Total[1]) {
+      // The function is only exercised in one of the profiles.
+      Distance = 1.0;
     } else {
-      if (BoltedCollection)
-        report_error(
-            Filename,
-            "cannot mix profile collected in BOLT and non-BOLT deployments");
+      double L1 = 0;
+      for (const StringMapEntry<EntryCounts> &Entry : FC.Entries)
+        L1 += std::fabs(double(Entry.getValue().Count[0]) / FC.Total[0] -
+                        double(Entry.getValue().Count[1]) / FC.Total[1]);
+      Distance = L1 / 2.0;
     }
+    const double Weight =
+        CombinedTotal ? (FC.Total[0] + FC.Total[1]) / CombinedTotal : 0;
+    const double Score = Distance * Weight;
+    WeightedDivergence += Score;
+    if (Score > 0)
+      FunctionScores.emplace_back(Score, FI.getKey());
+  }
+  std::stable_sort(FunctionScores.rbegin(), FunctionScores.rend());
+
+  errs() << "Functions sorted by weighted divergence:\n";
+  for (const std::pair<double, StringRef> &FI : FunctionScores)
+    errs() << FI.second << " : " << format("%.4lf%%", FI.first * 100.0)
+           << '\n';
+
+  outs() << format("Profile divergence score: %.4lf%%\n",
+                   WeightedDivergence * 100.0);
 
-    outs() << Buf;
-    First = false;
+  if (opts::DiffThreshold.getNumOccurrences() &&
+      WeightedDivergence * 100.0 > opts::DiffThreshold) {
+    errs() << "Profile divergence exceeds threshold of "
+           << format("%.4lf%%", opts::DiffThreshold.getValue()) << '\n';
+    return 2;
   }
-  errs() << "Profile from " << Filenames.size() << " files merged.\n";
+  return 0;
 }
 
 } // anonymous namespace
@@ -287,11 +839,22 @@ int main(int argc, char **argv) {
 
   ToolName = argv[0];
 
+  if (opts::ProfileDiff)
+    return diffLegacyProfiles(opts::InputDataFilenames);
+
+  if (!opts::ProfileWeights.empty() &&
+      opts::ProfileWeights.size() != opts::InputDataFilenames.size())
+    report_error("-weights", "expected one weight per input profile");
+
   if (!isYAML(opts::InputDataFilenames.front())) {
     mergeLegacyProfiles(opts::InputDataFilenames);
     return 0;
   }
 
+  if (opts::ReportHotPathConflicts)
+    report_error("-report-hot-path-conflicts",
+                 "only supported for the legacy profile format");
+
   // Merged header.
   BinaryProfileHeader MergedHeader;
   MergedHeader.Version = 1;
@@ -299,7 +862,8 @@ int main(int argc, char **argv) {
   // Merged information for all functions.
   StringMap<BinaryFunctionProfile> MergedBFs;
 
-  for (std::string &InputDataFilename : opts::InputDataFilenames) {
+  for (size_t Index = 0; Index < opts::InputDataFilenames.size(); ++Index) {
+    const std::string &InputDataFilename = opts::InputDataFilenames[Index];
     ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
         MemoryBuffer::getFileOrSTDIN(InputDataFilename);
     if (std::error_code EC = MB.getError())
@@ -325,6 +889,9 @@ int main(int argc, char **argv) {
 
     // Do the function merge.
     for (BinaryFunctionProfile &BF : BP.Functions) {
+      if (!opts::ProfileWeights.empty())
+        scaleFunctionProfile(BF, opts::ProfileWeights[Index]);
+
       if (!MergedBFs.count(BF.Name)) {
         MergedBFs.insert(std::make_pair(BF.Name, BF));
         continue;
@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+# ===- bolt/utils/bolt-bench.py - BOLT self-benchmark harness -------------=== #
+#
+# Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+# See https://llvm.org/LICENSE.txt for license information.
+# SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+#
+# ===----------------------------------------------------------------------=== #
+"""Benchmark the llvm-bolt rewrite pipeline over a synthetic binary corpus.
+
+The harness generates C sources with a parameterized number of functions,
+basic-block fan-out and data-reference (relocation) density, builds them with
+--emit-relocs so BOLT can operate in relocation mode, and runs llvm-bolt over
+each binary while collecting:
+
+  * total wall time and peak RSS of the llvm-bolt process;
+  * per-pass wall time, CPU time and heap delta via -report-pass-stats.
+
+Results are written as a JSON baseline. When --baseline is supplied, the
+current run is compared against it and the harness exits non-zero if any
+total or per-pass wall time regressed by more than --threshold percent.
+
+Typical usage, driven by the bolt-bench build target:
+
+  bolt-bench.py --bolt bin/llvm-bolt --output-dir bench/ \
+      [--baseline previous.json] [--threshold 10]
+"""
+
+import argparse
+import json
+import os
+import platform
+import subprocess
+import sys
+import time
+
+# Corpus configurations: function count, basic blocks per function, and the
+# number of global data references per function (relocation density).
+CORPUS = [
+    {"name": "small-flat", "functions": 200, "blocks": 4, "data_refs": 2},
+    {"name": "medium-branchy", "functions": 1000, "blocks": 16, "data_refs": 4},
+    {"name": "large-calls", "functions": 4000, "blocks": 8, "data_refs": 8},
+]
+
+BOLT_ARGS = [
+    "-relocs",
+    "-reorder-blocks=cache+",
+    "-report-pass-stats",
+]
+
+
+def generate_source(config, path):
+    """Emit a self-contained C translation unit for the given corpus entry."""
+    functions = config["functions"]
+    blocks = config["blocks"]
+    data_refs = config["data_refs"]
+    with open(path, "w") as out:
+        out.write("static long g_data[%d];\n\n" % (functions * data_refs))
+        for i in range(functions):
+            callee = (i + 1) % functions
+            out.write("long f_%d(long x);\n" % callee)
+            out.write("long f_%d(long x) {\n" % i)
+            # A switch over `blocks` cases gives each function a branchy CFG
+            # and usually a jump table; the data references pull in
+            # relocations against g_data.
+            out.write("  switch (x %% %d) {\n" % blocks)
+            for b in range(blocks):
+                ref = (i * data_refs + b % data_refs) % (functions * data_refs)
+                out.write("  case %d: x += g_data[%d] + %d; break;\n"
+                          % (b, ref, b * 7 + 1))
+            out.write("  }\n")
+            if i % 3 == 0:
+                out.write("  if (x > %d) x += f_%d(x - 1);\n" % (i, callee))
+            out.write("  return x;\n}\n\n")
+        out.write("int main(int argc, char **argv) {\n")
+        out.write("  long acc = argc;\n")
+        out.write("  for (int i = 0; i < %d; i += 97)\n" % functions)
+        out.write("    acc += f_0(acc + i);\n")
+        out.write("  return (int)(acc & 0xff);\n}\n")
+
+
+def build_binary(cc, source, binary):
+    cmd = [cc, "-O1", "-no-pie", "-Wl,--emit-relocs", "-o", binary, source]
+    subprocess.check_call(cmd)
+
+
+def run_bolt(bolt, binary, output):
+    """Run llvm-bolt and return (wall_time, max_rss_kb, pass_stats)."""
+    cmd = [bolt, binary, "-o", output] + BOLT_ARGS
+    start = time.monotonic()
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE,
+                            stderr=subprocess.STDOUT)
+    # Drain stdout before reaping so the child never blocks on a full pipe,
+    # and reap with wait4 to get the peak RSS.
+    stdout = proc.stdout.read()
+    _, status, rusage = os.wait4(proc.pid, 0)
+    wall_time = time.monotonic() - start
+    if status != 0:
+        sys.stderr.write(stdout.decode(errors="replace"))
+        raise RuntimeError("llvm-bolt failed on %s" % binary)
+
+    pass_stats = []
+    for line in stdout.decode(errors="replace").splitlines():
+        prefix = "BOLT-INFO: pass stats: "
+        if line.startswith(prefix):
+            pass_stats = json.loads(line[len(prefix):])
+    # ru_maxrss is in kilobytes on Linux.
+    return wall_time, rusage.ru_maxrss, pass_stats
+
+
+def compare(baseline, current, threshold):
+    """Return a list of human-readable regression descriptions."""
+    regressions = []
+    base_runs = {run["name"]: run for run in baseline["runs"]}
+    for run in current["runs"]:
+        base = base_runs.get(run["name"])
+        if base is None:
+            continue
+        if run["wall_time"] > base["wall_time"] * (1 + threshold / 100.0):
+            regressions.append(
+                "%s: total wall time %.2fs -> %.2fs"
+                % (run["name"], base["wall_time"], run["wall_time"]))
+        base_passes = {p["name"]: p for p in base["passes"]}
+        for p in run["passes"]:
+            bp = base_passes.get(p["name"])
+            # Ignore sub-100ms passes: they are dominated by noise.
+            if bp is None or bp["wall_time"] < 0.1:
+                continue
+            if p["wall_time"] > bp["wall_time"] * (1 + threshold / 100.0):
+                regressions.append(
+                    "%s/%s: pass wall time %.2fs -> %.2fs"
+                    % (run["name"], p["name"], bp["wall_time"], p["wall_time"]))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--bolt", required=True, help="path to llvm-bolt")
+    parser.add_argument("--cc", default=os.environ.get("CC", "cc"),
+                        help="host C compiler used to build the corpus")
+    parser.add_argument("--output-dir", required=True,
+                        help="directory for generated binaries and results")
+    parser.add_argument("--baseline",
+                        help="previous results JSON to compare against")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="regression threshold in percent (default: 10)")
+    args = parser.parse_args()
+
+    os.makedirs(args.output_dir, exist_ok=True)
+    results = {
+        "bolt": os.path.abspath(args.bolt),
+        "host": platform.platform(),
+        "date": time.strftime("%Y-%m-%dT%H:%M:%S"),
+        "runs": [],
+    }
+
+    for config in CORPUS:
+        name = config["name"]
+        source = os.path.join(args.output_dir, name + ".c")
+        binary = os.path.join(args.output_dir, name)
+        generate_source(config, source)
+        build_binary(args.cc, source, binary)
+        wall_time, max_rss, pass_stats = run_bolt(args.bolt, binary,
+                                                  binary + ".bolt")
+        print("bolt-bench: %-16s %6.2fs  %8d KB  %d passes"
+              % (name, wall_time, max_rss, len(pass_stats)))
+        results["runs"].append({
+            "name": name,
+            "config": config,
+            "wall_time": wall_time,
+            "max_rss_kb": max_rss,
+            "passes": pass_stats,
+        })
+
+    results_path = os.path.join(args.output_dir, "bolt-bench.json")
+    with open(results_path, "w") as out:
+        json.dump(results, out, indent=2)
+    print("bolt-bench: results written to %s" % results_path)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        regressions = compare(baseline, results, args.threshold)
+        for message in regressions:
+            print("bolt-bench: REGRESSION: " + message)
+        if regressions:
+            return 1
+        print("bolt-bench: no regressions above %.1f%%" % args.threshold)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())